@@ -0,0 +1,275 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Per-filter overhead microbenchmark, a performance companion to
+ * tests/test-layers.c.  For each filter we run:
+ *
+ *     this     ┌─────────┐    ┌────────┐
+ *  program ───▶│ filter  │───▶│  null  │
+ * (libnbd)     └─────────┘    └────────┘
+ *
+ * over a Unix socket (nbdkit -s --exit-with-parent) and time pread
+ * and pwrite loops at several request sizes, subtracting an unfiltered
+ * baseline measured the same way.  The delta is the per-layer cost of
+ * that filter, including any buffer copies it makes: a layer which
+ * copies the payload shows a delta that grows linearly with request
+ * size, which the final ns/MiB column makes visible.  Bytes copied
+ * inside the server are not directly observable from a client, so the
+ * slope is the best proxy we have.
+ *
+ * Usage:
+ *
+ *   bench-layers [filter[:key=val...] ...]
+ *
+ * With no arguments a standard list of filters that work unconfigured
+ * over the null plugin is measured.  Run it via the top level build
+ * directory wrapper so that --filter=name resolves to the freshly
+ * built filters:
+ *
+ *   PATH=..:$PATH bench/bench-layers
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+/* Declare program_name. */
+#if HAVE_DECL_PROGRAM_INVOCATION_SHORT_NAME == 1
+#include <errno.h>
+#define program_name program_invocation_short_name
+#else
+#define program_name "bench-layers"
+#endif
+
+#define DISK_SIZE (64 * 1024 * 1024)
+
+static const uint32_t sizes[] =  { 4096, 65536, 524288 };
+static const unsigned counts[] = { 4096,  1024,    128 };
+#define NR_SIZES (sizeof sizes / sizeof sizes[0])
+
+/* Filters measured when no arguments are given.  Only filters which
+ * pass requests through unmodified (or nearly so) with no mandatory
+ * configuration belong here; filters needing an argument carry it
+ * after a colon.
+ */
+static const char *default_filters[] = {
+  "blocksize",
+  "cache",
+  "cacheextents",
+  "cow",
+  "delay",
+  "exitlast",
+  "exportname",
+  "fua",
+  "limit",
+  "log:logfile=/dev/null",
+  "nocache",
+  "noextents",
+  "nofilter",
+  "noparallel",
+  "nozero",
+  "pause",
+  "readahead",
+  "retry",
+  "stats:statsfile=/dev/null",
+  "swab",
+  "truncate",
+  NULL
+};
+
+static char buf[524288];
+
+static double
+tv_diff_ns (const struct timespec *a, const struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+/* Measure one configuration.  spec is NULL for the unfiltered
+ * baseline, else "filter" or "filter:key=val:key=val".  Fills
+ * ns_read[] and ns_write[] with nanoseconds per request at each size.
+ * Returns 0 on success, -1 if the configuration failed to run.
+ */
+static int
+run_case (const char *spec, double *ns_read, double *ns_write)
+{
+  struct nbd_handle *nbd;
+  char *speccopy = NULL;
+  const char *args[16];
+  size_t nargs = 0, i;
+  unsigned j;
+  struct timespec t0, t1;
+
+  args[nargs++] = "nbdkit";
+  args[nargs++] = "--exit-with-parent";
+  args[nargs++] = "-s";
+  if (spec) {
+    char *p;
+
+    speccopy = strdup (spec);
+    if (speccopy == NULL) {
+      perror ("strdup");
+      exit (EXIT_FAILURE);
+    }
+    p = strchr (speccopy, ':');
+    if (p)
+      *p++ = '\0';
+    args[nargs++] = "--filter";
+    args[nargs++] = speccopy;
+    args[nargs++] = "null";
+    args[nargs++] = "67108864";
+    while (p && nargs < sizeof args / sizeof args[0] - 1) {
+      args[nargs++] = p;
+      p = strchr (p, ':');
+      if (p)
+        *p++ = '\0';
+    }
+  }
+  else {
+    args[nargs++] = "null";
+    args[nargs++] = "67108864";
+  }
+  args[nargs] = NULL;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "nbd_create: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) args) == -1) {
+    fprintf (stderr, "%s: %s: %s\n",
+             program_name, spec ? spec : "(baseline)", nbd_get_error ());
+    nbd_close (nbd);
+    free (speccopy);
+    return -1;
+  }
+
+  for (i = 0; i < NR_SIZES; ++i) {
+    const uint32_t size = sizes[i];
+    const uint64_t span = DISK_SIZE - size;
+
+    /* Warm up (fills caches in caching filters so that the steady
+     * state is measured, not the first miss).
+     */
+    for (j = 0; j < 16; ++j) {
+      if (nbd_pread (nbd, buf, size, (j * (uint64_t) size) % span, 0) == -1)
+        goto req_error;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    for (j = 0; j < counts[i]; ++j) {
+      if (nbd_pread (nbd, buf, size, (j * (uint64_t) size) % span, 0) == -1)
+        goto req_error;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+    ns_read[i] = tv_diff_ns (&t0, &t1) / counts[i];
+
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    for (j = 0; j < counts[i]; ++j) {
+      if (nbd_pwrite (nbd, buf, size, (j * (uint64_t) size) % span, 0) == -1)
+        goto req_error;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+    ns_write[i] = tv_diff_ns (&t0, &t1) / counts[i];
+  }
+
+  nbd_shutdown (nbd, 0);
+  nbd_close (nbd);
+  free (speccopy);
+  return 0;
+
+ req_error:
+  fprintf (stderr, "%s: %s: %s\n",
+           program_name, spec ? spec : "(baseline)", nbd_get_error ());
+  nbd_close (nbd);
+  free (speccopy);
+  return -1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char **filters;
+  double base_r[NR_SIZES], base_w[NR_SIZES];
+  double r[NR_SIZES], w[NR_SIZES];
+  size_t i, f;
+
+  if (argc > 1)
+    filters = (const char **) &argv[1];
+  else
+    filters = default_filters;
+
+  if (run_case (NULL, base_r, base_w) == -1) {
+    fprintf (stderr, "%s: baseline failed, cannot continue\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  printf ("# Per-layer overhead over null plugin; deltas vs unfiltered\n");
+  printf ("# baseline.  ns/MiB is the growth of the delta with request\n");
+  printf ("# size, a proxy for per-byte work (copies) in the layer.\n");
+  printf ("%-14s", "(baseline)");
+  for (i = 0; i < NR_SIZES; ++i)
+    printf ("  R%-3uk %8.0f  W%-3uk %8.0f",
+            sizes[i] / 1024, base_r[i], sizes[i] / 1024, base_w[i]);
+  printf ("\n");
+
+  for (f = 0; filters[f] != NULL; ++f) {
+    double slope_r, slope_w;
+
+    if (run_case (filters[f], r, w) == -1) {
+      printf ("%-14s  (failed to run, skipped)\n", filters[f]);
+      continue;
+    }
+
+    printf ("%-14s", filters[f]);
+    for (i = 0; i < NR_SIZES; ++i)
+      printf ("  R%-3uk %+8.0f  W%-3uk %+8.0f",
+              sizes[i] / 1024, r[i] - base_r[i],
+              sizes[i] / 1024, w[i] - base_w[i]);
+    slope_r = ((r[NR_SIZES-1] - base_r[NR_SIZES-1]) - (r[0] - base_r[0]))
+      / (sizes[NR_SIZES-1] - sizes[0]) * (1024 * 1024);
+    slope_w = ((w[NR_SIZES-1] - base_w[NR_SIZES-1]) - (w[0] - base_w[0]))
+      / (sizes[NR_SIZES-1] - sizes[0]) * (1024 * 1024);
+    printf ("  ns/MiB R %+8.0f W %+8.0f\n", slope_r, slope_w);
+  }
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+# nbdkit
+# Copyright (C) 2013-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Merge the per-profile fio JSON files written by run-bench.sh into a
+# single machine-readable results file, and compare against a recorded
+# baseline.
+#
+# Baselines are machine-specific so we do not ship one.  Record one on
+# the machine you care about with:
+#
+#   make bench
+#   cp bench-results.json bench-baseline.json
+#
+# and later runs of ‘make bench’ will compare against it.
+
+import argparse
+import json
+import os
+import sys
+
+# A profile is flagged as a regression if IOPS drop by more than this
+# fraction relative to the baseline.  Benchmarks are noisy; anything
+# tighter than 10% produces false alarms on shared machines.
+TOLERANCE = 0.10
+
+
+def summarize(fio_json):
+    """Reduce one fio JSON output to the numbers we track."""
+    out = {}
+    for job in fio_json["jobs"]:
+        for direction in ["read", "write"]:
+            d = job.get(direction, {})
+            if d.get("io_bytes", 0) == 0:
+                continue
+            out[direction] = {
+                "iops": round(d["iops"], 1),
+                "bw_bytes": d["bw_bytes"],
+                "lat_mean_ns": round(d["lat_ns"]["mean"], 1),
+            }
+    return out
+
+
+def main():
+    p = argparse.ArgumentParser()
+    p.add_argument("--results", required=True,
+                   help="directory of per-profile fio JSON files")
+    p.add_argument("--output", required=True,
+                   help="merged results file to write")
+    p.add_argument("--baseline", default="bench-baseline.json",
+                   help="baseline to compare against (if it exists)")
+    args = p.parse_args()
+
+    results = {}
+    for f in sorted(os.listdir(args.results)):
+        if not f.endswith(".json"):
+            continue
+        profile = f[:-len(".json")]
+        with open(os.path.join(args.results, f)) as fp:
+            results[profile] = summarize(json.load(fp))
+
+    with open(args.output, "w") as fp:
+        json.dump(results, fp, indent=2, sort_keys=True)
+        fp.write("\n")
+    print("bench: results written to %s" % args.output)
+
+    if not os.path.exists(args.baseline):
+        print("bench: no baseline %s, skipping comparison" % args.baseline)
+        print("bench: record one with: cp %s %s" %
+              (args.output, args.baseline))
+        return 0
+
+    with open(args.baseline) as fp:
+        baseline = json.load(fp)
+
+    regressions = 0
+    for profile, dirs in sorted(results.items()):
+        base = baseline.get(profile)
+        if base is None:
+            print("bench: %-24s not in baseline" % profile)
+            continue
+        for direction, r in sorted(dirs.items()):
+            b = base.get(direction)
+            if b is None or b["iops"] == 0:
+                continue
+            delta = (r["iops"] - b["iops"]) / b["iops"]
+            flag = ""
+            if delta < -TOLERANCE:
+                flag = "  REGRESSION"
+                regressions += 1
+            print("bench: %-24s %-5s %10.1f iops (baseline %10.1f, "
+                  "%+5.1f%%)%s" %
+                  (profile, direction, r["iops"], b["iops"],
+                   delta * 100, flag))
+
+    if regressions:
+        print("bench: %d profile(s) regressed more than %d%%" %
+              (regressions, TOLERANCE * 100))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,109 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2013-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Benchmark driver, normally invoked as ‘make bench’ from the top
+# level build directory.  See bench/README.bench.
+#
+# For each profile we run a captive nbdkit with a standard
+# configuration and drive it with fio (nbd ioengine) using a fixed job
+# file from this directory.  fio writes one JSON file per profile into
+# $builddir/results/, then compare-baseline.py merges them into
+# bench-results.json and (if a baseline has been recorded) reports any
+# regression.
+
+set -e
+
+srcdir=${srcdir:-$(dirname "$0")}
+abs_top_builddir=${abs_top_builddir:-$srcdir/..}
+nbdkit=$abs_top_builddir/nbdkit
+
+# How long fio runs each job, in seconds.  Raise this for less noisy
+# numbers.
+BENCH_RUNTIME=${BENCH_RUNTIME:-10}
+export BENCH_RUNTIME
+
+requires ()
+{
+    ( "$@" ) </dev/null >/dev/null 2>&1 || {
+        echo "$0: ‘$*’ failed with error code $?"
+        echo "$0: benchmark prerequisite is missing or not working"
+        exit 77
+    }
+}
+
+requires test -x "$nbdkit"
+requires fio --version
+# fio must have been compiled with --enable-libnbd.
+requires sh -c "fio --enghelp | grep -sq '^[[:space:]]*nbd$'"
+
+results=results
+rm -rf $results
+mkdir $results
+
+# run_profile NAME JOBFILE PLUGIN+FILTERS...
+#
+# The fio job files take the NBD URI from $uri, which nbdkit --run
+# defines for the captive command.
+run_profile ()
+{
+    name=$1
+    job=$2
+    shift 2
+
+    echo "bench: $name: nbdkit $*"
+    "$nbdkit" -U - "$@" \
+        --run 'export uri;
+               fio --output-format=json --output='$results/$name'.json '"$srcdir/$job"
+}
+
+# Standard profiles.  Keep these stable between releases: the whole
+# point is to compare like with like.
+tmpfile=$results/file.img
+truncate -s 1G $tmpfile
+
+run_profile memory-randread  nbd-randread.fio  memory 1G
+run_profile memory-randwrite nbd-randwrite.fio memory 1G
+run_profile memory-seqread   nbd-seqread.fio   memory 1G
+run_profile file-randread    nbd-randread.fio  file $tmpfile
+run_profile file-randwrite   nbd-randwrite.fio file $tmpfile
+run_profile pattern-seqread  nbd-seqread.fio   pattern 1G
+run_profile cache-randread   nbd-randread.fio  --filter=cache memory 1G
+run_profile cow-randwrite    nbd-randwrite.fio --filter=cow memory 1G
+run_profile blocksize-randwrite nbd-randwrite.fio \
+    --filter=blocksize memory 1G minblock=4096 maxdata=262144
+
+rm -f $tmpfile
+
+# Merge the per-profile JSON and compare against the baseline (if any).
+python3 "$srcdir/compare-baseline.py" \
+    --results $results --output bench-results.json \
+    ${BENCH_BASELINE:+--baseline "$BENCH_BASELINE"}
@@ -121,6 +121,33 @@ struct allocator_functions {
                   uint64_t count, uint64_t offset,
                   struct nbdkit_extents *extents)
   __attribute__((__nonnull__ (1, 4)));
+
+  /* Optional zero-copy read support.  borrow returns a pointer into
+   * the allocator's own storage covering [offset, offset+count-1],
+   * valid until release is called with the same pointer; or NULL when
+   * the range cannot be lent out (it is a hole, crosses an internal
+   * boundary, or too many borrows are in flight) and the caller must
+   * fall back to .read.  A concurrent write may change the bytes
+   * while they are lent out, but the memory stays valid.  Both
+   * pointers are NULL for allocators without support.
+   */
+  const void *(*borrow) (struct allocator *a,
+                         uint64_t count, uint64_t offset)
+  __attribute__((__nonnull__ (1)));
+  void (*release) (struct allocator *a, const void *buf)
+  __attribute__((__nonnull__ (1, 2)));
+
+  /* Optional snapshot support.  save serializes the allocated pages
+   * to the named file.  restore replaces the current contents with
+   * the contents of a snapshot file; it is expected to be cheap
+   * (O(metadata) rather than O(data)) - the sparse allocator maps the
+   * snapshot's pages copy-on-write instead of copying them.  Both
+   * pointers are NULL for allocators without support.
+   */
+  int (*save) (struct allocator *a, const char *filename)
+  __attribute__((__nonnull__ (1, 2)));
+  int (*restore) (struct allocator *a, const char *filename)
+  __attribute__((__nonnull__ (1, 2)));
 };
 
 struct allocator {
@@ -46,13 +46,14 @@
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
+#include "rounding.h"
 #include "vector.h"
 
 #include "allocator.h"
 #include "allocator-internal.h"
 
 /* This allocator implements a direct-mapped non-sparse RAM disk using
- * malloc, with optional mlock.
+ * malloc, with optional mlock and optional hugepage backing.
  */
 
 DEFINE_VECTOR_TYPE(bytearray, uint8_t);
@@ -60,22 +61,58 @@ DEFINE_VECTOR_TYPE(bytearray, uint8_t);
 struct m_alloc {
   struct allocator a;           /* Must come first. */
   bool use_mlock;
+  bool use_hugepages;
+  size_t hugepage_size;
 
   /* Byte array (vector) implementing the direct-mapped disk.  Note we
    * don't use the .size field.  Accesses must be protected by the
    * lock since writes may try to extend the array.
+   *
+   * With hugepages=true the array is an anonymous MAP_HUGETLB mapping
+   * instead of heap memory, and .alloc is always a whole number of
+   * hugepages.
    */
   pthread_rwlock_t lock;
   bytearray ba;
 };
 
+#ifdef MAP_HUGETLB
+/* Read the default hugepage size from /proc/meminfo, falling back to
+ * 2MB which is the usual default on x86-64 and aarch64.
+ */
+static size_t
+default_hugepage_size (void)
+{
+  size_t kb = 2048;
+  FILE *fp = fopen ("/proc/meminfo", "r");
+
+  if (fp) {
+    char line[256];
+
+    while (fgets (line, sizeof line, fp)) {
+      if (sscanf (line, "Hugepagesize: %zu kB", &kb) == 1)
+        break;
+    }
+    fclose (fp);
+  }
+  return kb * 1024;
+}
+#endif
+
 static void
 m_alloc_free (struct allocator *a)
 {
   struct m_alloc *ma = (struct m_alloc *) a;
 
   if (ma) {
-    free (ma->ba.ptr);
+#ifdef MAP_HUGETLB
+    if (ma->use_hugepages) {
+      if (ma->ba.ptr)
+        munmap (ma->ba.ptr, ma->ba.alloc);
+    }
+    else
+#endif
+      free (ma->ba.ptr);
     pthread_rwlock_destroy (&ma->lock);
     free (ma);
   }
@@ -88,6 +125,47 @@ extend (struct m_alloc *ma, uint64_t new_size)
   ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&ma->lock);
   size_t old_size, n;
 
+#ifdef MAP_HUGETLB
+  if (ma->use_hugepages) {
+    if (ma->ba.alloc < new_size) {
+      size_t new_alloc = ROUND_UP (new_size, ma->hugepage_size);
+      void *p;
+
+      p = mmap (NULL, new_alloc, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+      if (p == MAP_FAILED) {
+        nbdkit_error ("allocator=malloc: mmap: hugepages: %m "
+                      "(is a large enough hugepage pool reserved? "
+                      "see /proc/sys/vm/nr_hugepages)");
+        return -1;
+      }
+
+      /* The new mapping already reads as zeroes so there is nothing
+       * to initialize.
+       */
+      if (ma->ba.ptr) {
+        memcpy (p, ma->ba.ptr, ma->ba.alloc);
+        munmap (ma->ba.ptr, ma->ba.alloc);
+      }
+      ma->ba.ptr = p;
+      ma->ba.alloc = new_alloc;
+
+      /* Hugetlb pages are never swapped so mlock is not needed to pin
+       * them, but honour it anyway for consistent ulimit behaviour.
+       */
+#ifdef HAVE_MLOCK
+      if (ma->use_mlock) {
+        if (mlock (ma->ba.ptr, ma->ba.alloc) == -1) {
+          nbdkit_error ("allocator=malloc: mlock: %m");
+          return -1;
+        }
+      }
+#endif
+    }
+    return 0;
+  }
+#endif /* MAP_HUGETLB */
+
   if (ma->ba.alloc < new_size) {
     old_size = ma->ba.alloc;
     n = new_size - ma->ba.alloc;
@@ -257,9 +335,10 @@ m_alloc_create (const void *paramsv)
   const allocator_parameters *params  = paramsv;
   struct m_alloc *ma;
   bool use_mlock = false;
+  bool use_hugepages = false;
   size_t i;
 
-  /* Parse the optional mlock=true|false parameter. */
+  /* Parse the optional mlock= and hugepages= parameters. */
   for (i = 0; i < params->size; ++i) {
     if (strcmp (params->ptr[i].key, "mlock") == 0) {
       int r = nbdkit_parse_bool (params->ptr[i].value);
@@ -270,6 +349,17 @@ m_alloc_create (const void *paramsv)
         nbdkit_error ("mlock is not supported on this platform");
         return NULL;
       }
+#endif
+    }
+    else if (strcmp (params->ptr[i].key, "hugepages") == 0) {
+      int r = nbdkit_parse_bool (params->ptr[i].value);
+      if (r == -1) return NULL;
+      use_hugepages = r;
+#ifndef MAP_HUGETLB
+      if (use_hugepages) {
+        nbdkit_error ("hugepages are not supported on this platform");
+        return NULL;
+      }
 #endif
     }
     else {
@@ -285,6 +375,11 @@ m_alloc_create (const void *paramsv)
     return NULL;
   }
   ma->use_mlock = use_mlock;
+  ma->use_hugepages = use_hugepages;
+#ifdef MAP_HUGETLB
+  if (use_hugepages)
+    ma->hugepage_size = default_hugepage_size ();
+#endif
   pthread_rwlock_init (&ma->lock, NULL);
   ma->ba = (bytearray) empty_vector;
   return (struct allocator *) ma;
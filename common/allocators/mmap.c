@@ -0,0 +1,342 @@
+/* nbdkit
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include <pthread.h>
+
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "rounding.h"
+
+#include "allocator.h"
+#include "allocator-internal.h"
+
+#ifdef HAVE_MMAP
+
+/* This allocator implements a direct-mapped disk using a shared
+ * mapping of a named backing file (allocator=mmap,file=FILENAME).
+ *
+ * Unlike the malloc allocator the contents survive a restart: an
+ * existing backing file is mapped back in as-is, and dirty pages are
+ * written back by the kernel.  Because the pages belong to the page
+ * cache rather than anonymous memory the kernel can also reclaim
+ * clean pages under memory pressure, so the disk can be much larger
+ * than RAM (with performance degrading to file speed rather than the
+ * export failing).
+ */
+
+struct mm_alloc {
+  struct allocator a;           /* Must come first. */
+  int fd;                       /* Backing file. */
+
+  /* Shared mapping of the backing file.  .size is the exact file
+   * size; the mapping itself is .size rounded up to the page size.
+   * Accesses must be protected by the lock since writes may try to
+   * extend the file and remap it.
+   */
+  pthread_rwlock_t lock;
+  void *ptr;
+  uint64_t size;
+};
+
+static size_t
+mm_page_size (void)
+{
+  long n = sysconf (_SC_PAGESIZE);
+  return n > 0 ? n : 4096;
+}
+
+static void
+mm_alloc_free (struct allocator *a)
+{
+  struct mm_alloc *ma = (struct mm_alloc *) a;
+
+  if (ma) {
+    if (ma->ptr) {
+      /* Start writeback of dirty pages, but don't wait for it: the
+       * pages stay in the page cache and the kernel completes the
+       * flush after we exit.
+       */
+      msync (ma->ptr, ma->size, MS_ASYNC);
+      munmap (ma->ptr, ROUND_UP (ma->size, mm_page_size ()));
+    }
+    if (ma->fd >= 0)
+      close (ma->fd);
+    pthread_rwlock_destroy (&ma->lock);
+    free (ma);
+  }
+}
+
+/* Extend the underlying file and remap it if needed. */
+static int
+extend (struct mm_alloc *ma, uint64_t new_size)
+{
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&ma->lock);
+  const size_t page_size = mm_page_size ();
+  void *p;
+
+  if (ma->size < new_size) {
+    if (ftruncate (ma->fd, new_size) == -1) {
+      nbdkit_error ("allocator=mmap: ftruncate: %m");
+      return -1;
+    }
+
+    /* It is simplest to map the file again at the new size.  Nothing
+     * is copied: the data is in the file, and no other thread holds a
+     * pointer into the old mapping because we have the write lock.
+     */
+    p = mmap (NULL, ROUND_UP (new_size, page_size),
+              PROT_READ|PROT_WRITE, MAP_SHARED, ma->fd, 0);
+    if (p == MAP_FAILED) {
+      nbdkit_error ("allocator=mmap: mmap: %m");
+      return -1;
+    }
+    if (ma->ptr)
+      munmap (ma->ptr, ROUND_UP (ma->size, page_size));
+    ma->ptr = p;
+    ma->size = new_size;
+  }
+
+  return 0;
+}
+
+static int
+mm_alloc_set_size_hint (struct allocator *a, uint64_t size_hint)
+{
+  struct mm_alloc *ma = (struct mm_alloc *) a;
+  return extend (ma, size_hint);
+}
+
+static int
+mm_alloc_read (struct allocator *a, void *buf,
+               uint64_t count, uint64_t offset)
+{
+  struct mm_alloc *ma = (struct mm_alloc *) a;
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&ma->lock);
+
+  /* Avoid reading beyond the end of the file.  Return zeroes for that
+   * part.
+   */
+  if (offset >= ma->size)
+    memset (buf, 0, count);
+  else if (offset + count > ma->size) {
+    memcpy (buf, ma->ptr + offset, ma->size - offset);
+    memset (buf + ma->size - offset, 0, offset + count - ma->size);
+  }
+  else
+    memcpy (buf, ma->ptr + offset, count);
+
+  return 0;
+}
+
+static int
+mm_alloc_write (struct allocator *a, const void *buf,
+                uint64_t count, uint64_t offset)
+{
+  struct mm_alloc *ma = (struct mm_alloc *) a;
+
+  if (extend (ma, offset+count) == -1)
+    return -1;
+
+  /* This is correct: Even though we are writing, we only need to
+   * acquire the read lock here.  The write lock applies to changing
+   * the metadata and it was acquired if we called extend().
+   */
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&ma->lock);
+  memcpy (ma->ptr + offset, buf, count);
+  return 0;
+}
+
+static int
+mm_alloc_fill (struct allocator *a, char c, uint64_t count, uint64_t offset)
+{
+  struct mm_alloc *ma = (struct mm_alloc *) a;
+
+  if (extend (ma, offset+count) == -1)
+    return -1;
+
+  /* See comment in mm_alloc_write. */
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&ma->lock);
+  memset (ma->ptr + offset, c, count);
+  return 0;
+}
+
+static int
+mm_alloc_zero (struct allocator *a, uint64_t count, uint64_t offset)
+{
+  struct mm_alloc *ma = (struct mm_alloc *) a;
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&ma->lock);
+
+  /* Try to avoid extending the file, since the unallocated part
+   * always reads as zero.
+   */
+  if (offset < ma->size) {
+    if (offset + count > ma->size)
+      memset (ma->ptr + offset, 0, ma->size - offset);
+    else
+      memset (ma->ptr + offset, 0, count);
+  }
+
+  return 0;
+}
+
+static int
+mm_alloc_blit (struct allocator *a1, struct allocator *a2,
+               uint64_t count, uint64_t offset1, uint64_t offset2)
+{
+  struct mm_alloc *ma2 = (struct mm_alloc *) a2;
+
+  assert (a1 != a2);
+  assert (strcmp (a2->f->type, "mmap") == 0);
+
+  if (extend (ma2, offset2+count) == -1)
+    return -1;
+
+  /* See comment in mm_alloc_write. */
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&ma2->lock);
+  return a1->f->read (a1, ma2->ptr + offset2, count, offset1);
+}
+
+static int
+mm_alloc_extents (struct allocator *a,
+                  uint64_t count, uint64_t offset,
+                  struct nbdkit_extents *extents)
+{
+  /* Always fully allocated, same as the malloc allocator. */
+  return nbdkit_add_extent (extents, offset, count, 0);
+}
+
+struct allocator *
+mm_alloc_create (const void *paramsv)
+{
+  const allocator_parameters *params  = paramsv;
+  struct mm_alloc *ma;
+  const char *filename = NULL;
+  struct stat statbuf;
+  size_t i;
+
+  /* Parse the required file= parameter. */
+  for (i = 0; i < params->size; ++i) {
+    if (strcmp (params->ptr[i].key, "file") == 0)
+      filename = params->ptr[i].value;
+    else {
+      nbdkit_error ("allocator=mmap: unknown parameter %s",
+                    params->ptr[i].key);
+      return NULL;
+    }
+  }
+  if (filename == NULL) {
+    nbdkit_error ("allocator=mmap requires a file=FILENAME parameter");
+    return NULL;
+  }
+
+  ma = calloc (1, sizeof *ma);
+  if (ma == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  pthread_rwlock_init (&ma->lock, NULL);
+
+  ma->fd = open (filename, O_RDWR|O_CREAT|O_CLOEXEC|O_NOCTTY, 0600);
+  if (ma->fd == -1) {
+    nbdkit_error ("allocator=mmap: open: %s: %m", filename);
+    goto err;
+  }
+  if (fstat (ma->fd, &statbuf) == -1) {
+    nbdkit_error ("allocator=mmap: fstat: %s: %m", filename);
+    goto err;
+  }
+  if (!S_ISREG (statbuf.st_mode)) {
+    nbdkit_error ("allocator=mmap: %s: not a regular file", filename);
+    goto err;
+  }
+
+  /* Map any existing content so the disk survives a restart. */
+  if (statbuf.st_size > 0) {
+    ma->ptr = mmap (NULL, ROUND_UP (statbuf.st_size, mm_page_size ()),
+                    PROT_READ|PROT_WRITE, MAP_SHARED, ma->fd, 0);
+    if (ma->ptr == MAP_FAILED) {
+      ma->ptr = NULL;
+      nbdkit_error ("allocator=mmap: mmap: %s: %m", filename);
+      goto err;
+    }
+    ma->size = statbuf.st_size;
+  }
+
+  return (struct allocator *) ma;
+
+ err:
+  if (ma->fd >= 0)
+    close (ma->fd);
+  pthread_rwlock_destroy (&ma->lock);
+  free (ma);
+  return NULL;
+}
+
+static struct allocator_functions functions = {
+  .type = "mmap",
+  .create = mm_alloc_create,
+  .free = mm_alloc_free,
+  .set_size_hint = mm_alloc_set_size_hint,
+  .read = mm_alloc_read,
+  .write = mm_alloc_write,
+  .fill = mm_alloc_fill,
+  .zero = mm_alloc_zero,
+  .blit = mm_alloc_blit,
+  .extents = mm_alloc_extents,
+};
+
+static void register_mmap (void) __attribute__((constructor));
+
+static void
+register_mmap (void)
+{
+  register_allocator (&functions);
+}
+
+#endif /* HAVE_MMAP */
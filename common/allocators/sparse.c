@@ -40,13 +40,31 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include <pthread.h>
 
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#else
+/* Some old platforms lack atomic types, but 64 bit ints are usually
+ * "atomic enough".
+ */
+#define _Atomic /**/
+#endif
+
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
 #include "iszero.h"
+#include "rounding.h"
 #include "vector.h"
 
 #include "allocator.h"
@@ -61,9 +79,6 @@
  * sized disks, while permitting huge (but sparse) disks for testing.
  * Everything allocated has to be stored in memory.  There is no
  * temporary file backing.
- *
- * XXX It would be nice to change the locking to use r/w locks here,
- * as that ought to greatly benefit read-heavy loads using multi-conn.
  */
 
 /* Two level directory for the sparse array.
@@ -126,20 +141,182 @@ struct l1_entry {
 
 DEFINE_VECTOR_TYPE(l1_dir, struct l1_entry);
 
+/* Number of striped page locks.  Must be a power of 2. */
+#define NR_PAGE_LOCKS 16
+
+/* Maximum number of freed pages kept for reuse (2MB with the current
+ * page size).  Pages freed by zeroing are parked here instead of
+ * being returned to the C library on the hot path, and are handed
+ * back out to writers instead of calling calloc.
+ */
+#define PAGE_POOL_SIZE 64
+
+/* Maximum number of pages lent out to zero-copy readers at once;
+ * further borrows fall back to copying reads.
+ */
+#define MAX_BORROWS 64
+
 struct sparse_array {
   struct allocator a;           /* Must come first. */
-  pthread_mutex_t lock;
+
+  /* The read/write lock protects the L1 directory structure itself:
+   * take the read lock to search it (the common case) and the write
+   * lock to insert or remove an L1 entry.  Because entries can be
+   * removed (when zeroing empties a whole L2 directory), writers must
+   * be prepared for ensure_l1_entry followed by lookup to fail with
+   * EAGAIN and retry.
+   *
+   * Page contents, and the page pointers in the L2 directories, are
+   * protected by the page locks, striped by page number, so that
+   * parallel clients touching distinct regions of the disk do not
+   * serialize on a single lock.  Operations take the locks in the
+   * order: dir_lock (read), then one page lock.
+   */
+  pthread_rwlock_t dir_lock;
+  pthread_mutex_t page_locks[NR_PAGE_LOCKS];
   l1_dir l1_dir;                /* L1 directory. */
+
+  /* Pool of recently freed pages, protected by its own lock since
+   * pages are freed and reused under different page locks.
+   */
+  pthread_mutex_t pool_lock;
+  void *page_pool[PAGE_POOL_SIZE];
+  size_t nr_pooled;
+
+  /* Pages currently lent out by sparse_array_borrow for zero-copy
+   * reads, and "zombie" pages which were freed by a concurrent zero
+   * while lent out (those go back to the pool when the last borrow of
+   * the page is released, instead of at free time, so the borrower
+   * never reads unmapped memory).
+   */
+  pthread_mutex_t borrow_lock;
+  struct borrow { void *page; const void *buf; } borrows[MAX_BORROWS];
+  size_t nr_borrows;
+  void *zombies[MAX_BORROWS];
+  size_t nr_zombies;
+
+  /* Statistics, printed when the array is freed (under -v). */
+  _Atomic uint64_t nr_pages;    /* Pages currently allocated. */
+  _Atomic uint64_t nr_page_frees; /* Pages freed by zeroing over time. */
+
+#ifdef HAVE_MMAP
+  /* Copy-on-write mapping of the snapshot file after
+   * sparse_array_restore.  Pages inside this mapping must never be
+   * freed or pooled, only dropped; the whole mapping is unmapped when
+   * the array is freed or another snapshot is restored.
+   */
+  void *snap_map;
+  size_t snap_len;
+#endif
 };
 
+/* Is this page part of the snapshot mapping (as opposed to being
+ * separately allocated on the heap)?
+ */
+static bool
+page_is_mapped (struct sparse_array *sa, const void *page)
+{
+#ifdef HAVE_MMAP
+  return sa->snap_map != NULL &&
+    page >= sa->snap_map && page < sa->snap_map + sa->snap_len;
+#else
+  return false;
+#endif
+}
+
+/* Return the striped lock covering the page at offset. */
+static pthread_mutex_t *
+page_lock (struct sparse_array *sa, uint64_t offset)
+{
+  return &sa->page_locks[(offset / PAGE_SIZE) & (NR_PAGE_LOCKS-1)];
+}
+
+/* Allocate a zeroed page, preferring the pool of recently freed
+ * pages.  Returns NULL on error (and calls nbdkit_error).
+ */
+static void *
+page_alloc (struct sparse_array *sa)
+{
+  void *page = NULL;
+
+  {
+    ACQUIRE_ADAPTIVE_LOCK_FOR_CURRENT_SCOPE (&sa->pool_lock);
+    if (sa->nr_pooled > 0)
+      page = sa->page_pool[--sa->nr_pooled];
+  }
+
+  if (page)
+    memset (page, 0, PAGE_SIZE);
+  else {
+    page = calloc (PAGE_SIZE, 1);
+    if (page == NULL) {
+      nbdkit_error ("calloc: %m");
+      return NULL;
+    }
+  }
+
+  sa->nr_pages++;
+  return page;
+}
+
+/* Park a page in the pool for reuse; only when the pool is full is
+ * it returned to the C library, keeping free off the hot path.
+ */
+static void
+page_park (struct sparse_array *sa, void *page)
+{
+  ACQUIRE_ADAPTIVE_LOCK_FOR_CURRENT_SCOPE (&sa->pool_lock);
+  if (sa->nr_pooled < PAGE_POOL_SIZE)
+    sa->page_pool[sa->nr_pooled++] = page;
+  else
+    free (page);
+}
+
+/* Release a page which has become all zeroes. */
+static void
+page_free (struct sparse_array *sa, void *page)
+{
+  sa->nr_pages--;
+  sa->nr_page_frees++;
+
+  /* A page belonging to the snapshot mapping is just dropped (even if
+   * borrowed: the mapping stays valid).  If it was written to first,
+   * the kernel's private copy stays committed until the mapping goes
+   * away, which is the price of O(metadata) restores.
+   */
+  if (page_is_mapped (sa, page))
+    return;
+
+  /* If a zero-copy read has borrowed this page, parking it now could
+   * hand it to a writer or unmap it mid-send.  Move it to the zombie
+   * list instead; the last release parks it (the zombie list cannot
+   * overflow because at most MAX_BORROWS distinct pages are lent
+   * out).
+   */
+  {
+    size_t i;
+    ACQUIRE_ADAPTIVE_LOCK_FOR_CURRENT_SCOPE (&sa->borrow_lock);
+
+    for (i = 0; i < sa->nr_borrows; ++i) {
+      if (sa->borrows[i].page == page) {
+        sa->zombies[sa->nr_zombies++] = page;
+        return;
+      }
+    }
+  }
+
+  page_park (sa, page);
+}
+
 /* Free L1 and/or L2 directories. */
 static void
-free_l2_dir (struct l2_entry *l2_dir)
+free_l2_dir (struct sparse_array *sa, struct l2_entry *l2_dir)
 {
   size_t i;
 
   for (i = 0; i < L2_SIZE; ++i)
-    free (l2_dir[i].page);
+    if (!page_is_mapped (sa, l2_dir[i].page))
+      free (l2_dir[i].page);
   free (l2_dir);
 }
 
@@ -150,10 +327,28 @@ sparse_array_free (struct allocator *a)
   size_t i;
 
   if (sa) {
+    nbdkit_debug ("sparse array: %" PRIu64 " pages resident (%" PRIu64
+                  " bytes) in %zu L1 entries, "
+                  "%" PRIu64 " pages reclaimed by zeroing",
+                  (uint64_t) sa->nr_pages,
+                  (uint64_t) sa->nr_pages * PAGE_SIZE,
+                  sa->l1_dir.size,
+                  (uint64_t) sa->nr_page_frees);
+
     for (i = 0; i < sa->l1_dir.size; ++i)
-      free_l2_dir (sa->l1_dir.ptr[i].l2_dir);
+      free_l2_dir (sa, sa->l1_dir.ptr[i].l2_dir);
     free (sa->l1_dir.ptr);
-    pthread_mutex_destroy (&sa->lock);
+#ifdef HAVE_MMAP
+    if (sa->snap_map)
+      munmap (sa->snap_map, sa->snap_len);
+#endif
+    for (i = 0; i < sa->nr_pooled; ++i)
+      free (sa->page_pool[i]);
+    pthread_mutex_destroy (&sa->pool_lock);
+    pthread_mutex_destroy (&sa->borrow_lock);
+    for (i = 0; i < NR_PAGE_LOCKS; ++i)
+      pthread_mutex_destroy (&sa->page_locks[i]);
+    pthread_rwlock_destroy (&sa->dir_lock);
     free (sa);
   }
 }
@@ -215,16 +410,104 @@ insert_l1_entry (struct sparse_array *sa, const struct l1_entry *entry)
   return 0;
 }
 
+/* Ensure there is an L1 directory entry covering offset, inserting
+ * one if necessary.  Since inserting may reallocate the L1 directory,
+ * this takes the directory write lock: call it before taking any
+ * other lock.  Note the entry can be removed again by a concurrent
+ * compaction (see compact_l2_dirs) before the caller reacquires the
+ * read lock, in which case lookup fails with EAGAIN and the caller
+ * must retry.
+ */
+static int
+ensure_l1_entry (struct sparse_array *sa, uint64_t offset)
+{
+  struct l1_entry new_entry;
+
+  {
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&sa->dir_lock);
+    if (l1_dir_search (&sa->l1_dir, &offset, compare_l1_offsets))
+      return 0;
+  }
+
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&sa->dir_lock);
+
+  /* Another thread may have inserted the entry while we dropped the
+   * read lock, so search again.
+   */
+  if (l1_dir_search (&sa->l1_dir, &offset, compare_l1_offsets))
+    return 0;
+
+  new_entry.offset = offset & ~(PAGE_SIZE*L2_SIZE-1);
+  new_entry.l2_dir = calloc (L2_SIZE, sizeof (struct l2_entry));
+  if (new_entry.l2_dir == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  if (insert_l1_entry (sa, &new_entry) == -1) {
+    free (new_entry.l2_dir);
+    return -1;
+  }
+  return 0;
+}
+
+/* Free any L2 directories overlapping [offset, offset+count) which no
+ * longer contain any pages, removing their L1 entries.  Called after
+ * zeroing has freed pages, with no locks held.  Without this a
+ * long-lived disk which has been written to and then trimmed keeps
+ * the worst-case directory footprint forever.
+ *
+ * Holding the directory write lock excludes all readers and writers,
+ * so the emptiness check cannot race with a page being installed.
+ */
+static void
+compact_l2_dirs (struct sparse_array *sa, uint64_t offset, uint64_t count)
+{
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&sa->dir_lock);
+  uint64_t end = offset + count;
+  size_t i = 0;
+
+  while (i < sa->l1_dir.size) {
+    struct l1_entry *entry = &sa->l1_dir.ptr[i];
+    size_t j;
+
+    if (entry->offset >= end)
+      break;
+    if (entry->offset + PAGE_SIZE*L2_SIZE <= offset) {
+      ++i;
+      continue;
+    }
+
+    for (j = 0; j < L2_SIZE; ++j)
+      if (entry->l2_dir[j].page)
+        break;
+    if (j == L2_SIZE) {
+      if (sa->a.debug)
+        nbdkit_debug ("%s: freeing empty L2 directory for %" PRIu64,
+                      __func__, entry->offset);
+      free (entry->l2_dir);
+      l1_dir_remove (&sa->l1_dir, i);
+    }
+    else
+      ++i;
+  }
+}
+
 /* Look up a virtual offset, returning the address of the offset, the
  * count of bytes to the end of the page, and a pointer to the L2
  * directory entry containing the page pointer.
  *
- * If the create flag is set then a new page and/or directory will be
- * allocated if necessary.  Use this flag when writing.
+ * If the create flag is set then a new page will be allocated if
+ * necessary.  Use this flag when writing, after calling
+ * ensure_l1_entry for the offset.
+ *
+ * The caller must hold the directory read lock and the page lock
+ * covering offset.
  *
  * NULL may be returned normally if the page is not mapped (meaning it
- * reads as zero).  However if the create flag is set and NULL is
- * returned, this indicates an error.
+ * reads as zero).  If the create flag is set and NULL is returned
+ * then either the L1 entry was compacted away after ensure_l1_entry
+ * (errno is set to EAGAIN, the caller should retry) or allocation
+ * failed (any other errno).
  */
 static void *
 lookup (struct sparse_array *sa, uint64_t offset, bool create,
@@ -234,11 +517,9 @@ lookup (struct sparse_array *sa, uint64_t offset, bool create,
   struct l2_entry *l2_dir;
   uint64_t o;
   void *page;
-  struct l1_entry new_entry;
 
   *remaining = PAGE_SIZE - (offset & (PAGE_SIZE-1));
 
- again:
   /* Search the L1 directory. */
   entry = l1_dir_search (&sa->l1_dir, &offset, compare_l1_offsets);
 
@@ -260,11 +541,9 @@ lookup (struct sparse_array *sa, uint64_t offset, bool create,
     page = l2_dir[o].page;
     if (!page && create) {
       /* No page allocated.  Allocate one if creating. */
-      page = calloc (PAGE_SIZE, 1);
-      if (page == NULL) {
-        nbdkit_error ("calloc: %m");
+      page = page_alloc (sa);
+      if (page == NULL)
         return NULL;
-      }
       l2_dir[o].page = page;
     }
     if (!page)
@@ -273,26 +552,13 @@ lookup (struct sparse_array *sa, uint64_t offset, bool create,
       return page + (offset & (PAGE_SIZE-1));
   }
 
-  /* No L1 directory entry found. */
-  if (!create)
-    return NULL;
-
-  /* No L1 directory entry, and we're creating, so we need to allocate
-   * a new L1 directory entry and insert it in the L1 directory, and
-   * allocate the L2 directory with NULL page pointers.  Then we can
-   * repeat the above search to create the page.
+  /* No L1 directory entry found.  Writers create the entry with
+   * ensure_l1_entry before calling us with the create flag set, but
+   * a concurrent compaction can have removed it again in between.
    */
-  new_entry.offset = offset & ~(PAGE_SIZE*L2_SIZE-1);
-  new_entry.l2_dir = calloc (L2_SIZE, sizeof (struct l2_entry));
-  if (new_entry.l2_dir == NULL) {
-    nbdkit_error ("calloc: %m");
-    return NULL;
-  }
-  if (insert_l1_entry (sa, &new_entry) == -1) {
-    free (new_entry.l2_dir);
-    return NULL;
-  }
-  goto again;
+  if (create)
+    errno = EAGAIN;
+  return NULL;
 }
 
 static int
@@ -300,11 +566,12 @@ sparse_array_read (struct allocator *a,
                    void *buf, uint64_t count, uint64_t offset)
 {
   struct sparse_array *sa = (struct sparse_array *) a;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&sa->lock);
   uint64_t n;
   void *p;
 
   while (count > 0) {
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&sa->dir_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (sa, offset));
     p = lookup (sa, offset, false, &n, NULL);
     if (n > count)
       n = count;
@@ -322,19 +589,97 @@ sparse_array_read (struct allocator *a,
   return 0;
 }
 
+/* Lend out a pointer to a page for a zero-copy read.  The borrow is
+ * recorded so that a concurrent zero freeing the page defers it to
+ * the zombie list (see page_free) rather than recycling it.  The
+ * registry entry is taken while still holding the page lock, so the
+ * handoff cannot race the free.
+ */
+static const void *
+sparse_array_borrow (struct allocator *a, uint64_t count, uint64_t offset)
+{
+  struct sparse_array *sa = (struct sparse_array *) a;
+  uint64_t n;
+  void *p;
+
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&sa->dir_lock);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (sa, offset));
+  p = lookup (sa, offset, false, &n, NULL);
+  if (p == NULL || count == 0 || count > n)
+    return NULL;                /* hole, or crosses a page boundary */
+
+  {
+    ACQUIRE_ADAPTIVE_LOCK_FOR_CURRENT_SCOPE (&sa->borrow_lock);
+
+    if (sa->nr_borrows >= MAX_BORROWS)
+      return NULL;
+    sa->borrows[sa->nr_borrows].page = p - (offset & (PAGE_SIZE-1));
+    sa->borrows[sa->nr_borrows].buf = p;
+    sa->nr_borrows++;
+  }
+  return p;
+}
+
+static void
+sparse_array_release (struct allocator *a, const void *buf)
+{
+  struct sparse_array *sa = (struct sparse_array *) a;
+  void *page = NULL;
+  bool park = false;
+  size_t i;
+
+  {
+    ACQUIRE_ADAPTIVE_LOCK_FOR_CURRENT_SCOPE (&sa->borrow_lock);
+
+    for (i = 0; i < sa->nr_borrows; ++i)
+      if (sa->borrows[i].buf == buf)
+        break;
+    assert (i < sa->nr_borrows);
+    page = sa->borrows[i].page;
+    sa->borrows[i] = sa->borrows[--sa->nr_borrows];
+
+    /* If this was the last borrow of a page freed in the meantime,
+     * move it from the zombie list back to the pool.
+     */
+    for (i = 0; i < sa->nr_borrows; ++i)
+      if (sa->borrows[i].page == page)
+        break;
+    if (i == sa->nr_borrows) {
+      for (i = 0; i < sa->nr_zombies; ++i) {
+        if (sa->zombies[i] == page) {
+          sa->zombies[i] = sa->zombies[--sa->nr_zombies];
+          park = true;
+          break;
+        }
+      }
+    }
+  }
+
+  if (park)
+    page_park (sa, page);
+}
+
 static int
 sparse_array_write (struct allocator *a,
                     const void *buf, uint64_t count, uint64_t offset)
 {
   struct sparse_array *sa = (struct sparse_array *) a;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&sa->lock);
   uint64_t n;
   void *p;
 
   while (count > 0) {
+    if (ensure_l1_entry (sa, offset) == -1)
+      return -1;
+
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&sa->dir_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (sa, offset));
+    errno = 0;
     p = lookup (sa, offset, true, &n, NULL);
-    if (p == NULL)
+    if (p == NULL) {
+      if (errno == EAGAIN)
+        continue;               /* Raced with compaction, try again. */
       return -1;
+    }
 
     if (n > count)
       n = count;
@@ -362,12 +707,19 @@ sparse_array_fill (struct allocator *a, char c,
   if (c == 0)
     return sparse_array_zero (a, count, offset);
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&sa->lock);
-
   while (count > 0) {
+    if (ensure_l1_entry (sa, offset) == -1)
+      return -1;
+
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&sa->dir_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (sa, offset));
+    errno = 0;
     p = lookup (sa, offset, true, &n, NULL);
-    if (p == NULL)
+    if (p == NULL) {
+      if (errno == EAGAIN)
+        continue;               /* Raced with compaction, try again. */
       return -1;
+    }
 
     if (n > count)
       n = count;
@@ -384,12 +736,15 @@ static int
 sparse_array_zero (struct allocator *a, uint64_t count, uint64_t offset)
 {
   struct sparse_array *sa = (struct sparse_array *) a;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&sa->lock);
+  const uint64_t orig_offset = offset, orig_count = count;
+  bool freed = false;
   uint64_t n;
   void *p;
   struct l2_entry *l2_entry;
 
   while (count > 0) {
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&sa->dir_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (sa, offset));
     p = lookup (sa, offset, false, &n, &l2_entry);
     if (n > count)
       n = count;
@@ -405,8 +760,9 @@ sparse_array_zero (struct allocator *a, uint64_t count, uint64_t offset)
         if (sa->a.debug)
           nbdkit_debug ("%s: freeing zero page at offset %" PRIu64,
                         __func__, offset);
-        free (l2_entry->page);
+        page_free (sa, l2_entry->page);
         l2_entry->page = NULL;
+        freed = true;
       }
     }
 
@@ -414,6 +770,12 @@ sparse_array_zero (struct allocator *a, uint64_t count, uint64_t offset)
     offset += n;
   }
 
+  /* If we freed any pages then some L2 directories in the range may
+   * now be empty, so try to compact them.
+   */
+  if (freed)
+    compact_l2_dirs (sa, orig_offset, orig_count);
+
   return 0;
 }
 
@@ -424,7 +786,6 @@ sparse_array_blit (struct allocator *a1,
                    uint64_t offset1, uint64_t offset2)
 {
   struct sparse_array *sa2 = (struct sparse_array *) a2;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&sa2->lock);
   uint64_t n;
   void *p;
   struct l2_entry *l2_entry;
@@ -433,9 +794,18 @@ sparse_array_blit (struct allocator *a1,
   assert (strcmp (a2->f->type, "sparse") == 0);
 
   while (count > 0) {
+    if (ensure_l1_entry (sa2, offset2) == -1)
+      return -1;
+
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&sa2->dir_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (sa2, offset2));
+    errno = 0;
     p = lookup (sa2, offset2, true, &n, &l2_entry);
-    if (p == NULL)
+    if (p == NULL) {
+      if (errno == EAGAIN)
+        continue;               /* Raced with compaction, try again. */
       return -1;
+    }
 
     if (n > count)
       n = count;
@@ -451,7 +821,7 @@ sparse_array_blit (struct allocator *a1,
       if (sa2->a.debug)
         nbdkit_debug ("%s: freeing zero page at offset %" PRIu64,
                       __func__, offset2);
-      free (l2_entry->page);
+      page_free (sa2, l2_entry->page);
       l2_entry->page = NULL;
     }
 
@@ -469,12 +839,13 @@ sparse_array_extents (struct allocator *a,
                       struct nbdkit_extents *extents)
 {
   struct sparse_array *sa = (struct sparse_array *) a;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&sa->lock);
   uint64_t n;
   uint32_t type;
   void *p;
 
   while (count > 0) {
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&sa->dir_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (sa, offset));
     p = lookup (sa, offset, false, &n, NULL);
 
     /* Work out the type of this extent. */
@@ -502,11 +873,225 @@ sparse_array_extents (struct allocator *a,
   return 0;
 }
 
+#ifdef HAVE_MMAP
+
+/* Snapshot file layout: a fixed header, an index of the virtual
+ * offsets of the saved pages in ascending order, zero padding up to a
+ * PAGE_SIZE boundary, then the page contents in index order.
+ * Keeping the pages page-aligned in the file lets restore map them
+ * directly.  The header is written in host byte order; like the
+ * cache filter's persistent cache, snapshots are not portable
+ * between machines.
+ */
+#define SNAPSHOT_MAGIC "NBDKITSA"
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+  char magic[8];                /* SNAPSHOT_MAGIC */
+  uint32_t version;             /* SNAPSHOT_VERSION */
+  uint32_t page_size;           /* PAGE_SIZE */
+  uint64_t nr_pages;            /* Number of saved pages. */
+  uint64_t reserved[5];         /* Must be zero. */
+};
+
+static int
+sparse_array_save (struct allocator *a, const char *filename)
+{
+  struct sparse_array *sa = (struct sparse_array *) a;
+  struct snapshot_header h = { .magic = SNAPSHOT_MAGIC,
+                               .version = SNAPSHOT_VERSION,
+                               .page_size = PAGE_SIZE };
+  uint64_t nr_pages = 0, data_start;
+  size_t i, j;
+  FILE *fp;
+
+  /* Taking the directory write lock excludes all other access, so
+   * the snapshot is consistent.
+   */
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&sa->dir_lock);
+
+  /* Count the pages worth saving.  All-zero pages read back the same
+   * as holes, so they are left out.
+   */
+  for (i = 0; i < sa->l1_dir.size; ++i) {
+    const struct l2_entry *l2_dir = sa->l1_dir.ptr[i].l2_dir;
+
+    for (j = 0; j < L2_SIZE; ++j)
+      if (l2_dir[j].page && !is_zero (l2_dir[j].page, PAGE_SIZE))
+        nr_pages++;
+  }
+  h.nr_pages = nr_pages;
+
+  fp = fopen (filename, "w");
+  if (fp == NULL) {
+    nbdkit_error ("open: %s: %m", filename);
+    return -1;
+  }
+
+  if (fwrite (&h, sizeof h, 1, fp) != 1)
+    goto write_error;
+
+  /* The index. */
+  for (i = 0; i < sa->l1_dir.size; ++i) {
+    const struct l1_entry *entry = &sa->l1_dir.ptr[i];
+
+    for (j = 0; j < L2_SIZE; ++j) {
+      if (entry->l2_dir[j].page &&
+          !is_zero (entry->l2_dir[j].page, PAGE_SIZE)) {
+        uint64_t offset = entry->offset + j * PAGE_SIZE;
+
+        if (fwrite (&offset, sizeof offset, 1, fp) != 1)
+          goto write_error;
+      }
+    }
+  }
+
+  /* Pad to a page boundary, then the pages themselves. */
+  data_start = ROUND_UP (sizeof h + nr_pages * sizeof (uint64_t),
+                         (uint64_t) PAGE_SIZE);
+  if (fseeko (fp, data_start, SEEK_SET) == -1)
+    goto write_error;
+
+  for (i = 0; i < sa->l1_dir.size; ++i) {
+    const struct l2_entry *l2_dir = sa->l1_dir.ptr[i].l2_dir;
+
+    for (j = 0; j < L2_SIZE; ++j)
+      if (l2_dir[j].page && !is_zero (l2_dir[j].page, PAGE_SIZE))
+        if (fwrite (l2_dir[j].page, PAGE_SIZE, 1, fp) != 1)
+          goto write_error;
+  }
+
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("close: %s: %m", filename);
+    return -1;
+  }
+
+  nbdkit_debug ("sparse array: saved snapshot %s: %" PRIu64
+                " pages (%" PRIu64 " bytes)",
+                filename, nr_pages, nr_pages * PAGE_SIZE);
+  return 0;
+
+ write_error:
+  nbdkit_error ("write: %s: %m", filename);
+  fclose (fp);
+  return -1;
+}
+
+static int
+sparse_array_restore (struct allocator *a, const char *filename)
+{
+  struct sparse_array *sa = (struct sparse_array *) a;
+  const struct snapshot_header *h;
+  const uint64_t *index;
+  struct stat statbuf;
+  uint64_t data_start, i;
+  size_t len;
+  void *map;
+  int fd;
+
+  fd = open (filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", filename);
+    return -1;
+  }
+  if (fstat (fd, &statbuf) == -1) {
+    nbdkit_error ("stat: %s: %m", filename);
+    close (fd);
+    return -1;
+  }
+  len = statbuf.st_size;
+  if (len < sizeof *h) {
+    nbdkit_error ("%s: not a sparse array snapshot", filename);
+    close (fd);
+    return -1;
+  }
+
+  /* Map the whole file copy-on-write.  Pages served from the mapping
+   * are only copied by the kernel when they are first written to, so
+   * restoring is O(metadata) however large the snapshot.
+   */
+  map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED) {
+    nbdkit_error ("mmap: %s: %m", filename);
+    return -1;
+  }
+
+  h = map;
+  data_start = ROUND_UP (sizeof *h + h->nr_pages * sizeof (uint64_t),
+                         (uint64_t) PAGE_SIZE);
+  if (memcmp (h->magic, SNAPSHOT_MAGIC, sizeof h->magic) != 0 ||
+      h->version != SNAPSHOT_VERSION ||
+      h->page_size != PAGE_SIZE ||
+      h->nr_pages > (uint64_t) len / PAGE_SIZE ||
+      len < data_start + h->nr_pages * PAGE_SIZE) {
+    nbdkit_error ("%s: not a sparse array snapshot "
+                  "(or saved with an incompatible page size)", filename);
+    munmap (map, len);
+    return -1;
+  }
+  index = (const uint64_t *) (h + 1);
+
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&sa->dir_lock);
+
+  /* Drop the current contents (and any previous snapshot mapping). */
+  for (i = 0; i < sa->l1_dir.size; ++i)
+    free_l2_dir (sa, sa->l1_dir.ptr[i].l2_dir);
+  sa->l1_dir.size = 0;
+  sa->nr_pages = 0;
+  if (sa->snap_map)
+    munmap (sa->snap_map, sa->snap_len);
+  sa->snap_map = map;
+  sa->snap_len = len;
+
+  /* Install the snapshot's pages, pointing into the mapping.  The
+   * index is sorted, so insert_l1_entry always appends.
+   */
+  for (i = 0; i < h->nr_pages; ++i) {
+    uint64_t offset = index[i];
+    struct l1_entry *entry;
+
+    if (offset & (PAGE_SIZE-1)) {
+      nbdkit_error ("%s: corrupt snapshot index", filename);
+      return -1;
+    }
+
+    entry = l1_dir_search (&sa->l1_dir, &offset, compare_l1_offsets);
+    if (entry == NULL) {
+      struct l1_entry new_entry;
+
+      new_entry.offset = offset & ~(PAGE_SIZE*L2_SIZE-1);
+      new_entry.l2_dir = calloc (L2_SIZE, sizeof (struct l2_entry));
+      if (new_entry.l2_dir == NULL) {
+        nbdkit_error ("calloc: %m");
+        return -1;
+      }
+      if (insert_l1_entry (sa, &new_entry) == -1) {
+        free (new_entry.l2_dir);
+        return -1;
+      }
+      entry = l1_dir_search (&sa->l1_dir, &offset, compare_l1_offsets);
+      assert (entry);
+    }
+    entry->l2_dir[(offset - entry->offset) / PAGE_SIZE].page =
+      (char *) map + data_start + i * PAGE_SIZE;
+    sa->nr_pages++;
+  }
+
+  nbdkit_debug ("sparse array: restored snapshot %s: %" PRIu64
+                " pages (%" PRIu64 " bytes) mapped copy-on-write",
+                filename, h->nr_pages, h->nr_pages * PAGE_SIZE);
+  return 0;
+}
+
+#endif /* HAVE_MMAP */
+
 static struct allocator *
 sparse_array_create (const void *paramsv)
 {
   const allocator_parameters *params  = paramsv;
   struct sparse_array *sa;
+  size_t i;
 
   if (params->size > 0) {
     nbdkit_error ("allocator=sparse does not take extra parameters");
@@ -518,7 +1103,11 @@ sparse_array_create (const void *paramsv)
     nbdkit_error ("calloc: %m");
     return NULL;
   }
-  pthread_mutex_init (&sa->lock, NULL);
+  pthread_rwlock_init (&sa->dir_lock, NULL);
+  for (i = 0; i < NR_PAGE_LOCKS; ++i)
+    pthread_mutex_init (&sa->page_locks[i], NULL);
+  pthread_mutex_init (&sa->pool_lock, NULL);
+  pthread_mutex_init (&sa->borrow_lock, NULL);
 
   return (struct allocator *) sa;
 }
@@ -534,6 +1123,12 @@ static struct allocator_functions functions = {
   .zero = sparse_array_zero,
   .blit = sparse_array_blit,
   .extents = sparse_array_extents,
+  .borrow = sparse_array_borrow,
+  .release = sparse_array_release,
+#ifdef HAVE_MMAP
+  .save = sparse_array_save,
+  .restore = sparse_array_restore,
+#endif
 };
 
 static void register_sparse_array (void) __attribute__((constructor));
@@ -43,6 +43,15 @@
 
 #include <pthread.h>
 
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#else
+/* Some old platforms lack atomic types, but plain updates are usually
+ * "atomic enough" for statistics.
+ */
+#define _Atomic /**/
+#endif
+
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
@@ -57,17 +66,15 @@
 #include <zstd.h>
 
 /* This is derived from the sparse array implementation - see
- * common/allocators/sparse.c for details of how it works.
+ * common/allocators/sparse.c for details of how it works, including
+ * the locking scheme.
  *
  * TO DO:
  *
  * (1) We can avoid decompressing a page if we know we are going to
  * write over / trim / zero the whole page.
  *
- * (2) Locking is correct but very naive.  It should be possible to
- * take much more fine-grained locks.
- *
- * (3) Better stats: Can we iterate over the page table in order to
+ * (2) Better stats: Can we iterate over the page table in order to
  * find the ratio of uncompressed : compressed?
  *
  * Once some optimizations are made it would be worth profiling to
@@ -76,6 +83,9 @@
 #define PAGE_SIZE 32768
 #define L2_SIZE   4096
 
+/* Number of striped page locks.  Must be a power of 2. */
+#define NR_PAGE_LOCKS 16
+
 struct l2_entry {
   void *page;                   /* Pointer to compressed data. */
 };
@@ -89,28 +99,100 @@ DEFINE_VECTOR_TYPE(l1_dir, struct l1_entry);
 
 struct zstd_array {
   struct allocator a;           /* Must come first. */
-  pthread_mutex_t lock;
+
+  /* Same locking scheme as the sparse allocator: the read/write lock
+   * protects the L1 directory structure (write-locked only to insert
+   * a new L1 entry, which is rare and never undone), and page
+   * contents and page pointers are protected by the page locks,
+   * striped by page number.  Compression and decompression therefore
+   * run in parallel on distinct pages, which matters because they
+   * dominate the CPU cost of this allocator.
+   */
+  pthread_rwlock_t dir_lock;
+  pthread_mutex_t page_locks[NR_PAGE_LOCKS];
   l1_dir l1_dir;                /* L1 directory. */
 
-  /* Compression context and decompression stream.  We use the
-   * streaming API for decompression because it allows us to
-   * decompress without storing the compressed size, so we need a
-   * streaming object.  But in fact decompression context and stream
-   * are the same thing since zstd 1.3.0.
-   *
-   * If we ever get serious about making this allocator work well
-   * multi-threaded [at the moment the locking is too course-grained],
-   * then the zstd documentation recommends creating a context per
-   * thread.
+  /* Compression level (level=N parameter). */
+  int clevel;
+
+  /* Optional trained dictionary (dict=FILENAME parameter), used for
+   * both compression and decompression.  Dictionaries are immutable
+   * once created so they can be shared by all threads.
    */
-  ZSTD_CCtx *zcctx;
-  ZSTD_DStream *zdstrm;
+  ZSTD_CDict *cdict;
+  ZSTD_DDict *ddict;
 
   /* Collect stats when we compress a page. */
-  uint64_t stats_uncompressed_bytes;
-  uint64_t stats_compressed_bytes;
+  _Atomic uint64_t stats_uncompressed_bytes;
+  _Atomic uint64_t stats_compressed_bytes;
+};
+
+/* Return the striped lock covering the page at offset. */
+static pthread_mutex_t *
+page_lock (struct zstd_array *za, uint64_t offset)
+{
+  return &za->page_locks[(offset / PAGE_SIZE) & (NR_PAGE_LOCKS-1)];
+}
+
+/* Per-thread compression context and decompression stream, as
+ * recommended by the zstd documentation.  We use the streaming API
+ * for decompression because it allows us to decompress without
+ * storing the compressed size.  (Decompression context and stream are
+ * the same thing since zstd 1.3.0.)  The contexts belong to the
+ * worker thread, not the allocator, so they are shared by all zstd
+ * arrays and freed when the thread exits.
+ */
+struct zstd_ctxs {
+  ZSTD_CCtx *zcctx;
+  ZSTD_DStream *zdstrm;
 };
 
+static pthread_key_t ctxs_key;
+static pthread_once_t ctxs_once = PTHREAD_ONCE_INIT;
+
+static void
+free_ctxs (void *vp)
+{
+  struct zstd_ctxs *ctxs = vp;
+
+  ZSTD_freeCCtx (ctxs->zcctx);
+  ZSTD_freeDStream (ctxs->zdstrm);
+  free (ctxs);
+}
+
+static void
+make_ctxs_key (void)
+{
+  pthread_key_create (&ctxs_key, free_ctxs);
+}
+
+static struct zstd_ctxs *
+get_ctxs (void)
+{
+  struct zstd_ctxs *ctxs;
+
+  pthread_once (&ctxs_once, make_ctxs_key);
+  ctxs = pthread_getspecific (ctxs_key);
+  if (ctxs == NULL) {
+    ctxs = malloc (sizeof *ctxs);
+    if (ctxs == NULL) {
+      nbdkit_error ("malloc: %m");
+      return NULL;
+    }
+    ctxs->zcctx = ZSTD_createCCtx ();
+    ctxs->zdstrm = ZSTD_createDStream ();
+    if (ctxs->zcctx == NULL || ctxs->zdstrm == NULL) {
+      nbdkit_error ("ZSTD_createCCtx: %m");
+      ZSTD_freeCCtx (ctxs->zcctx);
+      ZSTD_freeDStream (ctxs->zdstrm);
+      free (ctxs);
+      return NULL;
+    }
+    pthread_setspecific (ctxs_key, ctxs);
+  }
+  return ctxs;
+}
+
 /* Free L1 and/or L2 directories. */
 static void
 free_l2_dir (struct l2_entry *l2_dir)
@@ -134,12 +216,14 @@ zstd_array_free (struct allocator *a)
                     (double) za->stats_uncompressed_bytes /
                     za->stats_compressed_bytes);
 
-    ZSTD_freeCCtx (za->zcctx);
-    ZSTD_freeDStream (za->zdstrm);
+    ZSTD_freeCDict (za->cdict);
+    ZSTD_freeDDict (za->ddict);
     for (i = 0; i < za->l1_dir.size; ++i)
       free_l2_dir (za->l1_dir.ptr[i].l2_dir);
     free (za->l1_dir.ptr);
-    pthread_mutex_destroy (&za->lock);
+    for (i = 0; i < NR_PAGE_LOCKS; ++i)
+      pthread_mutex_destroy (&za->page_locks[i]);
+    pthread_rwlock_destroy (&za->dir_lock);
     free (za);
   }
 }
@@ -201,6 +285,44 @@ insert_l1_entry (struct zstd_array *za, const struct l1_entry *entry)
   return 0;
 }
 
+/* Ensure there is an L1 directory entry covering offset, inserting
+ * one if necessary.  Since inserting may reallocate the L1 directory,
+ * this takes the directory write lock: call it before taking any
+ * other lock.  L1 entries are never removed, so after this returns
+ * the lookup is guaranteed to find the entry.
+ */
+static int
+ensure_l1_entry (struct zstd_array *za, uint64_t offset)
+{
+  struct l1_entry new_entry;
+
+  {
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&za->dir_lock);
+    if (l1_dir_search (&za->l1_dir, &offset, compare_l1_offsets))
+      return 0;
+  }
+
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&za->dir_lock);
+
+  /* Another thread may have inserted the entry while we dropped the
+   * read lock, so search again.
+   */
+  if (l1_dir_search (&za->l1_dir, &offset, compare_l1_offsets))
+    return 0;
+
+  new_entry.offset = offset & ~(PAGE_SIZE*L2_SIZE-1);
+  new_entry.l2_dir = calloc (L2_SIZE, sizeof (struct l2_entry));
+  if (new_entry.l2_dir == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  if (insert_l1_entry (za, &new_entry) == -1) {
+    free (new_entry.l2_dir);
+    return -1;
+  }
+  return 0;
+}
+
 /* Look up a virtual offset.
  *
  * If the L2 page is mapped then this uncompresses the page into the
@@ -216,10 +338,14 @@ insert_l1_entry (struct zstd_array *za, const struct l1_entry *entry)
  * To write data, after updating the buffer, you must subsequently
  * call compress() below.
  *
+ * The caller must hold the directory read lock and the page lock
+ * covering offset.
+ *
  * This function cannot return an error.
  */
 static void *
-lookup_decompress (struct zstd_array *za, uint64_t offset, void *buf,
+lookup_decompress (struct zstd_array *za, struct zstd_ctxs *ctxs,
+                   uint64_t offset, void *buf,
                    uint64_t *remaining, struct l2_entry **l2_entry)
 {
   struct l1_entry *entry;
@@ -259,9 +385,11 @@ lookup_decompress (struct zstd_array *za, uint64_t offset, void *buf,
       ZSTD_inBuffer inb = { .src = page, .size = SIZE_MAX, .pos = 0 };
       ZSTD_outBuffer outb = { .dst = buf, .size = PAGE_SIZE, .pos = 0 };
 
-      ZSTD_initDStream (za->zdstrm);
+      ZSTD_initDStream (ctxs->zdstrm);
+      if (za->ddict)
+        ZSTD_DCtx_refDDict (ctxs->zdstrm, za->ddict);
       while (outb.pos < outb.size)
-        ZSTD_decompressStream (za->zdstrm, &outb, &inb);
+        ZSTD_decompressStream (ctxs->zdstrm, &outb, &inb);
       assert (outb.pos == PAGE_SIZE);
     }
     else
@@ -271,6 +399,8 @@ lookup_decompress (struct zstd_array *za, uint64_t offset, void *buf,
   }
 
   /* No L1 directory entry found. */
+  if (l2_entry)
+    *l2_entry = NULL;
   memset (buf, 0, PAGE_SIZE);
   return buf + (offset & (PAGE_SIZE-1));
 }
@@ -280,19 +410,21 @@ lookup_decompress (struct zstd_array *za, uint64_t offset, void *buf,
  * This replaces a L2 page with a new version compressed from the
  * modified user buffer.
  *
+ * The caller must hold the same locks as for lookup_decompress, and
+ * must have called ensure_l1_entry for the offset beforehand.
+ *
  * It may fail, calling nbdkit_error and returning -1.
  */
 static int
-compress (struct zstd_array *za, uint64_t offset, void *buf)
+compress (struct zstd_array *za, struct zstd_ctxs *ctxs,
+          uint64_t offset, void *buf)
 {
   struct l1_entry *entry;
   struct l2_entry *l2_dir;
   uint64_t o;
   void *page;
-  struct l1_entry new_entry;
   size_t n;
 
- again:
   /* Search the L1 directory. */
   entry = l1_dir_search (&za->l1_dir, &offset, compare_l1_offsets);
 
@@ -319,8 +451,12 @@ compress (struct zstd_array *za, uint64_t offset, void *buf)
       nbdkit_error ("malloc: %m");
       return -1;
     }
-    n = ZSTD_compressCCtx (za->zcctx, page, n,
-                           buf, PAGE_SIZE, ZSTD_CLEVEL_DEFAULT);
+    if (za->cdict)
+      n = ZSTD_compress_usingCDict (ctxs->zcctx, page, n,
+                                    buf, PAGE_SIZE, za->cdict);
+    else
+      n = ZSTD_compressCCtx (ctxs->zcctx, page, n,
+                             buf, PAGE_SIZE, za->clevel);
     if (ZSTD_isError (n)) {
       nbdkit_error ("ZSTD_compressCCtx: %s", ZSTD_getErrorName (n));
       return -1;
@@ -333,22 +469,10 @@ compress (struct zstd_array *za, uint64_t offset, void *buf)
     return 0;
   }
 
-  /* No L1 directory entry, so we need to allocate a new L1 directory
-   * entry and insert it in the L1 directory, and allocate the L2
-   * directory with NULL page pointers.  Then we can repeat the above
-   * search to create the page.
+  /* Writers create the L1 entry with ensure_l1_entry before calling
+   * us, so this cannot be reached.
    */
-  new_entry.offset = offset & ~(PAGE_SIZE*L2_SIZE-1);
-  new_entry.l2_dir = calloc (L2_SIZE, sizeof (struct l2_entry));
-  if (new_entry.l2_dir == NULL) {
-    nbdkit_error ("calloc: %m");
-    return -1;
-  }
-  if (insert_l1_entry (za, &new_entry) == -1) {
-    free (new_entry.l2_dir);
-    return -1;
-  }
-  goto again;
+  abort ();
 }
 
 static int
@@ -356,11 +480,14 @@ zstd_array_read (struct allocator *a,
                  void *buf, uint64_t count, uint64_t offset)
 {
   struct zstd_array *za = (struct zstd_array *) a;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->lock);
+  struct zstd_ctxs *ctxs = get_ctxs ();
   CLEANUP_FREE void *tbuf = NULL;
   uint64_t n;
   void *p;
 
+  if (ctxs == NULL)
+    return -1;
+
   tbuf = malloc (PAGE_SIZE);
   if (tbuf == NULL) {
     nbdkit_error ("malloc: %m");
@@ -368,7 +495,9 @@ zstd_array_read (struct allocator *a,
   }
 
   while (count > 0) {
-    p = lookup_decompress (za, offset, tbuf, &n, NULL);
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&za->dir_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (za, offset));
+    p = lookup_decompress (za, ctxs, offset, tbuf, &n, NULL);
     if (n > count)
       n = count;
 
@@ -387,11 +516,14 @@ zstd_array_write (struct allocator *a,
                   const void *buf, uint64_t count, uint64_t offset)
 {
   struct zstd_array *za = (struct zstd_array *) a;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->lock);
+  struct zstd_ctxs *ctxs = get_ctxs ();
   CLEANUP_FREE void *tbuf = NULL;
   uint64_t n;
   void *p;
 
+  if (ctxs == NULL)
+    return -1;
+
   tbuf = malloc (PAGE_SIZE);
   if (tbuf == NULL) {
     nbdkit_error ("malloc: %m");
@@ -399,13 +531,18 @@ zstd_array_write (struct allocator *a,
   }
 
   while (count > 0) {
-    p = lookup_decompress (za, offset, tbuf, &n, NULL);
+    if (ensure_l1_entry (za, offset) == -1)
+      return -1;
+
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&za->dir_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (za, offset));
+    p = lookup_decompress (za, ctxs, offset, tbuf, &n, NULL);
 
     if (n > count)
       n = count;
     memcpy (p, buf, n);
 
-    if (compress (za, offset, tbuf) == -1)
+    if (compress (za, ctxs, offset, tbuf) == -1)
       return -1;
 
     buf += n;
@@ -424,6 +561,7 @@ zstd_array_fill (struct allocator *a, char c,
                    uint64_t count, uint64_t offset)
 {
   struct zstd_array *za = (struct zstd_array *) a;
+  struct zstd_ctxs *ctxs;
   CLEANUP_FREE void *tbuf = NULL;
   uint64_t n;
   void *p;
@@ -433,7 +571,9 @@ zstd_array_fill (struct allocator *a, char c,
     return 0;
   }
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->lock);
+  ctxs = get_ctxs ();
+  if (ctxs == NULL)
+    return -1;
 
   tbuf = malloc (PAGE_SIZE);
   if (tbuf == NULL) {
@@ -442,13 +582,18 @@ zstd_array_fill (struct allocator *a, char c,
   }
 
   while (count > 0) {
-    p = lookup_decompress (za, offset, tbuf, &n, NULL);
+    if (ensure_l1_entry (za, offset) == -1)
+      return -1;
+
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&za->dir_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (za, offset));
+    p = lookup_decompress (za, ctxs, offset, tbuf, &n, NULL);
 
     if (n > count)
       n = count;
     memset (p, c, n);
 
-    if (compress (za, offset, tbuf) == -1)
+    if (compress (za, ctxs, offset, tbuf) == -1)
       return -1;
 
     count -= n;
@@ -462,12 +607,15 @@ static int
 zstd_array_zero (struct allocator *a, uint64_t count, uint64_t offset)
 {
   struct zstd_array *za = (struct zstd_array *) a;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->lock);
+  struct zstd_ctxs *ctxs = get_ctxs ();
   CLEANUP_FREE void *tbuf = NULL;
   uint64_t n;
   void *p;
   struct l2_entry *l2_entry;
 
+  if (ctxs == NULL)
+    return -1;
+
   tbuf = malloc (PAGE_SIZE);
   if (tbuf == NULL) {
     nbdkit_error ("malloc: %m");
@@ -475,13 +623,15 @@ zstd_array_zero (struct allocator *a, uint64_t count, uint64_t offset)
   }
 
   while (count > 0) {
-    p = lookup_decompress (za, offset, tbuf, &n, &l2_entry);
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&za->dir_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (za, offset));
+    p = lookup_decompress (za, ctxs, offset, tbuf, &n, &l2_entry);
 
     if (n > count)
       n = count;
     memset (p, 0, n);
 
-    if (l2_entry->page) {
+    if (l2_entry && l2_entry->page) {
       /* If the whole page is now zero, free it. */
       if (n >= PAGE_SIZE || is_zero (l2_entry->page, PAGE_SIZE)) {
         if (za->a.debug)
@@ -491,7 +641,7 @@ zstd_array_zero (struct allocator *a, uint64_t count, uint64_t offset)
         l2_entry->page = NULL;
       }
       else {
-        if (compress (za, offset, tbuf) == -1)
+        if (compress (za, ctxs, offset, tbuf) == -1)
           return -1;
       }
     }
@@ -510,7 +660,7 @@ zstd_array_blit (struct allocator *a1,
                  uint64_t offset1, uint64_t offset2)
 {
   struct zstd_array *za2 = (struct zstd_array *) a2;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za2->lock);
+  struct zstd_ctxs *ctxs = get_ctxs ();
   CLEANUP_FREE void *tbuf = NULL;
   uint64_t n;
   void *p;
@@ -518,6 +668,9 @@ zstd_array_blit (struct allocator *a1,
   assert (a1 != a2);
   assert (strcmp (a2->f->type, "zstd") == 0);
 
+  if (ctxs == NULL)
+    return -1;
+
   tbuf = malloc (PAGE_SIZE);
   if (tbuf == NULL) {
     nbdkit_error ("malloc: %m");
@@ -525,7 +678,12 @@ zstd_array_blit (struct allocator *a1,
   }
 
   while (count > 0) {
-    p = lookup_decompress (za2, offset2, tbuf, &n, NULL);
+    if (ensure_l1_entry (za2, offset2) == -1)
+      return -1;
+
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&za2->dir_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (za2, offset2));
+    p = lookup_decompress (za2, ctxs, offset2, tbuf, &n, NULL);
 
     if (n > count)
       n = count;
@@ -536,7 +694,7 @@ zstd_array_blit (struct allocator *a1,
     if (a1->f->read (a1, p, n, offset1) == -1)
       return -1;
 
-    if (compress (za2, offset2, tbuf) == -1)
+    if (compress (za2, ctxs, offset2, tbuf) == -1)
       return -1;
 
     count -= n;
@@ -553,13 +711,16 @@ zstd_array_extents (struct allocator *a,
                       struct nbdkit_extents *extents)
 {
   struct zstd_array *za = (struct zstd_array *) a;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->lock);
+  struct zstd_ctxs *ctxs = get_ctxs ();
   CLEANUP_FREE void *buf = NULL;
   uint64_t n;
   uint32_t type;
   void *p;
   struct l2_entry *l2_entry;
 
+  if (ctxs == NULL)
+    return -1;
+
   buf = malloc (PAGE_SIZE);
   if (buf == NULL) {
     nbdkit_error ("malloc: %m");
@@ -567,10 +728,12 @@ zstd_array_extents (struct allocator *a,
   }
 
   while (count > 0) {
-    p = lookup_decompress (za, offset, buf, &n, &l2_entry);
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&za->dir_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (page_lock (za, offset));
+    p = lookup_decompress (za, ctxs, offset, buf, &n, &l2_entry);
 
     /* Work out the type of this extent. */
-    if (l2_entry->page == NULL)
+    if (l2_entry == NULL || l2_entry->page == NULL)
       /* No backing page, so it's a hole. */
       type = NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO;
     else {
@@ -594,15 +757,74 @@ zstd_array_extents (struct allocator *a,
   return 0;
 }
 
+/* Read a trained dictionary file into memory.  Returns the malloc'd
+ * buffer and its size, or NULL on error.
+ */
+static void *
+read_dict_file (const char *filename, size_t *size)
+{
+  FILE *fp;
+  long len;
+  void *buf = NULL;
+
+  fp = fopen (filename, "r");
+  if (fp == NULL) {
+    nbdkit_error ("allocator=zstd: open: %s: %m", filename);
+    return NULL;
+  }
+  if (fseek (fp, 0, SEEK_END) == -1 || (len = ftell (fp)) == -1 ||
+      fseek (fp, 0, SEEK_SET) == -1) {
+    nbdkit_error ("allocator=zstd: seek: %s: %m", filename);
+    goto err;
+  }
+  if (len == 0) {
+    nbdkit_error ("allocator=zstd: %s: dictionary file is empty", filename);
+    goto err;
+  }
+  buf = malloc (len);
+  if (buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    goto err;
+  }
+  if (fread (buf, 1, len, fp) != (size_t) len) {
+    nbdkit_error ("allocator=zstd: read: %s: %m", filename);
+    free (buf);
+    buf = NULL;
+    goto err;
+  }
+  *size = len;
+ err:
+  fclose (fp);
+  return buf;
+}
+
 struct allocator *
 zstd_array_create (const void *paramsv)
 {
   const allocator_parameters *params  = paramsv;
   struct zstd_array *za;
+  int clevel = ZSTD_CLEVEL_DEFAULT;
+  const char *dict_filename = NULL;
+  size_t i;
 
-  if (params->size > 0) {
-    nbdkit_error ("allocator=zstd does not take extra parameters");
-    return NULL;
+  /* Parse the optional level= and dict= parameters. */
+  for (i = 0; i < params->size; ++i) {
+    if (strcmp (params->ptr[i].key, "level") == 0) {
+      if (nbdkit_parse_int ("level", params->ptr[i].value, &clevel) == -1)
+        return NULL;
+      if (clevel < ZSTD_minCLevel () || clevel > ZSTD_maxCLevel ()) {
+        nbdkit_error ("allocator=zstd: level must be in the range %d .. %d",
+                      ZSTD_minCLevel (), ZSTD_maxCLevel ());
+        return NULL;
+      }
+    }
+    else if (strcmp (params->ptr[i].key, "dict") == 0)
+      dict_filename = params->ptr[i].value;
+    else {
+      nbdkit_error ("allocator=zstd: unknown parameter %s",
+                    params->ptr[i].key);
+      return NULL;
+    }
   }
 
   za = calloc (1, sizeof *za);
@@ -611,25 +833,36 @@ zstd_array_create (const void *paramsv)
     return NULL;
   }
 
-  pthread_mutex_init (&za->lock, NULL);
-
-  za->zcctx = ZSTD_createCCtx ();
-  if (za->zcctx == NULL) {
-    nbdkit_error ("ZSTD_createCCtx: %m");
-    free (za);
-    return NULL;
-  }
-  za->zdstrm = ZSTD_createDStream ();
-  if (za->zdstrm == NULL) {
-    nbdkit_error ("ZSTD_createDStream: %m");
-    ZSTD_freeCCtx (za->zcctx);
-    free (za);
-    return NULL;
+  pthread_rwlock_init (&za->dir_lock, NULL);
+  for (i = 0; i < NR_PAGE_LOCKS; ++i)
+    pthread_mutex_init (&za->page_locks[i], NULL);
+  za->clevel = clevel;
+
+  if (dict_filename) {
+    CLEANUP_FREE void *dict = NULL;
+    size_t dict_size = 0;
+
+    dict = read_dict_file (dict_filename, &dict_size);
+    if (dict == NULL)
+      goto err;
+    za->cdict = ZSTD_createCDict (dict, dict_size, clevel);
+    za->ddict = ZSTD_createDDict (dict, dict_size);
+    if (za->cdict == NULL || za->ddict == NULL) {
+      nbdkit_error ("allocator=zstd: %s: could not load dictionary",
+                    dict_filename);
+      goto err;
+    }
   }
 
   za->stats_uncompressed_bytes = za->stats_compressed_bytes = 0;
 
   return (struct allocator *) za;
+
+ err:
+  ZSTD_freeCDict (za->cdict);
+  ZSTD_freeDDict (za->ddict);
+  free (za);
+  return NULL;
 }
 
 static struct allocator_functions functions = {
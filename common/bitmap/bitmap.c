@@ -40,8 +40,9 @@
 #include <nbdkit-plugin.h>
 
 #include "bitmap.h"
+#include "byte-swapping.h"
+#include "minmax.h"
 #include "rounding.h"
-#include "nextnonzero.h"
 
 int
 bitmap_resize (struct bitmap *bm, uint64_t new_size)
@@ -80,36 +81,181 @@ bitmap_resize (struct bitmap *bm, uint64_t new_size)
   return 0;
 }
 
+/* Load a 64-bit little-endian word of the bitmap starting at the
+ * given byte offset.  Entry 0 of a byte lives in its least
+ * significant bits, so in the loaded word entry k of the run occupies
+ * bits [k*bpb, (k+1)*bpb).
+ */
+static inline uint64_t
+load_word (const struct bitmap *bm, uint64_t byte_offset)
+{
+  uint64_t w;
+
+  memcpy (&w, &bm->bitmap[byte_offset], sizeof w);
+  return le64toh (w);
+}
+
 int64_t
 bitmap_next (const struct bitmap *bm, uint64_t blk)
 {
-  uint64_t limit = bm->size * bm->ibpb;
-  const uint8_t *p;
+  const uint64_t limit = bm->size * bm->ibpb;
+  const uint64_t entries_per_word = bm->ibpb * UINT64_C (8);
+  uint64_t byte_offset;
 
-  /* Align to the next byte boundary. */
-  for (; blk < limit && (blk & (bm->ibpb-1)) != 0; ++blk) {
+  /* Align to the next 64-bit word boundary. */
+  for (; blk < limit && (blk & (entries_per_word-1)) != 0; ++blk) {
     if (bitmap_get_blk (bm, blk, 0) != 0)
       return blk;
   }
-  if (blk == limit)
-    return -1;
 
-  /* Now we're at a byte boundary we can use a fast string function to
-   * find the next non-zero byte.
+  /* Scan whole words, then use the position of the lowest set bit to
+   * find the first non-zero entry without testing each one.
    */
-  p = &bm->bitmap[blk >> (3 - bm->bitshift)];
-  p = (const uint8_t *) next_non_zero ((const char *) p,
-                                       &bm->bitmap[bm->size] - p);
-  if (p == NULL)
-    return -1;
+  byte_offset = blk >> (3 - bm->bitshift);
+  while (bm->size - byte_offset >= 8) {
+    const uint64_t w = load_word (bm, byte_offset);
+
+    if (w != 0)
+      return blk + __builtin_ctzll (w) / bm->bpb;
+    blk += entries_per_word;
+    byte_offset += 8;
+  }
 
-  /* Now check the non-zero byte to find out which bit (ie. block) is set. */
-  blk = (p - bm->bitmap) << (3 - bm->bitshift);
+  /* Entries in the partial word at the end. */
   for (; blk < limit; ++blk) {
     if (bitmap_get_blk (bm, blk, 0) != 0)
       return blk;
   }
 
-  /* Should never be reached. */
-  abort ();
+  return -1;
+}
+
+int64_t
+bitmap_next_zero (const struct bitmap *bm, uint64_t blk)
+{
+  const uint64_t limit = bm->size * bm->ibpb;
+  const uint64_t entries_per_word = bm->ibpb * UINT64_C (8);
+  uint64_t byte_offset;
+
+  /* Align to the next 64-bit word boundary. */
+  for (; blk < limit && (blk & (entries_per_word-1)) != 0; ++blk) {
+    if (bitmap_get_blk (bm, blk, 1) == 0)
+      return blk;
+  }
+
+  /* A word of all ones cannot contain a zero entry, whatever the bits
+   * per block, so skip those; in any other word the inverted lowest
+   * set bit locates the first entry which is not all ones, at or
+   * before the first zero entry.
+   */
+  byte_offset = blk >> (3 - bm->bitshift);
+  while (bm->size - byte_offset >= 8) {
+    const uint64_t w = load_word (bm, byte_offset);
+
+    if (w != UINT64_MAX) {
+      uint64_t end;
+
+      blk += __builtin_ctzll (~w) / bm->bpb;
+      end = MIN (limit, (blk | (entries_per_word-1)) + 1);
+      for (; blk < end; ++blk) {
+        if (bitmap_get_blk (bm, blk, 1) == 0)
+          return blk;
+      }
+      byte_offset = blk >> (3 - bm->bitshift);
+      continue;
+    }
+    blk += entries_per_word;
+    byte_offset += 8;
+  }
+
+  /* Entries in the partial word at the end. */
+  for (; blk < limit; ++blk) {
+    if (bitmap_get_blk (bm, blk, 1) == 0)
+      return blk;
+  }
+
+  return -1;
+}
+
+void
+bitmap_set_range_blk (const struct bitmap *bm, uint64_t blk, uint64_t n,
+                      unsigned v)
+{
+  const uint64_t limit = bm->size * bm->ibpb;
+  uint64_t end;
+  uint8_t pattern = 0;
+  unsigned i;
+
+  if (blk >= limit)
+    return;
+  end = blk + MIN (n, limit - blk);
+
+  /* Entries up to the first byte boundary. */
+  for (; blk < end && (blk & (bm->ibpb-1)) != 0; ++blk)
+    bitmap_set_blk (bm, blk, v);
+
+  /* Whole bytes are a memset with the value replicated. */
+  if (end - blk >= bm->ibpb) {
+    const uint64_t nr_bytes = (end - blk) >> (3 - bm->bitshift);
+
+    for (i = 0; i < bm->ibpb; ++i)
+      pattern = (pattern << bm->bpb) | v;
+    memset (&bm->bitmap[blk >> (3 - bm->bitshift)], pattern, nr_bytes);
+    blk += nr_bytes << (3 - bm->bitshift);
+  }
+
+  /* Entries after the last byte boundary. */
+  for (; blk < end; ++blk)
+    bitmap_set_blk (bm, blk, v);
+}
+
+uint64_t
+bitmap_popcount_range (const struct bitmap *bm, uint64_t blk, uint64_t n)
+{
+  const uint64_t limit = bm->size * bm->ibpb;
+  const uint64_t entries_per_word = bm->ibpb * UINT64_C (8);
+  uint64_t end, byte_offset, count = 0;
+
+  if (blk >= limit)
+    return 0;
+  end = blk + MIN (n, limit - blk);
+
+  /* Entries up to the first word boundary. */
+  for (; blk < end && (blk & (entries_per_word-1)) != 0; ++blk)
+    count += bitmap_get_blk (bm, blk, 0) != 0;
+
+  /* Whole words: fold each entry down to its lowest bit, then
+   * popcount.  Byte order doesn't matter for counting.
+   */
+  byte_offset = blk >> (3 - bm->bitshift);
+  while (end - blk >= entries_per_word) {
+    uint64_t w;
+
+    memcpy (&w, &bm->bitmap[byte_offset], sizeof w);
+    switch (bm->bpb) {
+    case 1:
+      break;
+    case 2:
+      w = (w | (w >> 1)) & UINT64_C (0x5555555555555555);
+      break;
+    case 4:
+      w |= w >> 2;
+      w = (w | (w >> 1)) & UINT64_C (0x1111111111111111);
+      break;
+    case 8:
+      w |= w >> 4;
+      w |= w >> 2;
+      w = (w | (w >> 1)) & UINT64_C (0x0101010101010101);
+      break;
+    }
+    count += __builtin_popcountll (w);
+    blk += entries_per_word;
+    byte_offset += 8;
+  }
+
+  /* Remaining entries. */
+  for (; blk < end; ++blk)
+    count += bitmap_get_blk (bm, blk, 0) != 0;
+
+  return count;
 }
@@ -180,4 +180,28 @@ bitmap_set (const struct bitmap *bm, uint64_t offset, unsigned v)
 extern int64_t bitmap_next (const struct bitmap *bm, uint64_t blk)
   __attribute__((__nonnull__ (1)));
 
+/* Find the next zero block in the bitmap, starting at ‘blk’.
+ * Returns -1 if the bitmap is all non-zero from blk to the end of the
+ * bitmap.
+ */
+extern int64_t bitmap_next_zero (const struct bitmap *bm, uint64_t blk)
+  __attribute__((__nonnull__ (1)));
+
+/* Set ‘n’ consecutive entries starting at block ‘blk’ to the value
+ * ‘v’.  Whole bytes are filled with memset, so this is much faster
+ * than a loop of bitmap_set_blk for large ranges.  Entries beyond the
+ * end of the bitmap are ignored.
+ */
+extern void bitmap_set_range_blk (const struct bitmap *bm,
+                                  uint64_t blk, uint64_t n, unsigned v)
+  __attribute__((__nonnull__ (1)));
+
+/* Count the entries with a non-zero value in the range of ‘n’ blocks
+ * starting at block ‘blk’, using word-at-a-time popcount.  The range
+ * is clamped to the end of the bitmap.
+ */
+extern uint64_t bitmap_popcount_range (const struct bitmap *bm,
+                                       uint64_t blk, uint64_t n)
+  __attribute__((__nonnull__ (1)));
+
 #endif /* NBDKIT_BITMAP_H */
@@ -117,6 +117,42 @@ test (int bpb, int blksize)
     ++j;
   }
 
+  /* Use bitmap_next_zero to iterate over the zero entries.  Note the
+   * bitmap is rounded up to a whole number of bytes so there may be
+   * extra (zero) entries after nr_blocks.
+   */
+  i = bitmap_next_zero (&bm, 0);
+  j = 0;
+  while (i != -1 && i < nr_blocks) {
+    v = bitmap_get_blk (&bm, i, 1);
+    assert (v == 0);
+    ++j;
+    i = bitmap_next_zero (&bm, i+1);
+  }
+  assert (j == nr_blocks - sizeof blks / sizeof blks[0]);
+
+  /* Range set and popcount. */
+  bitmap_clear (&bm);
+  bitmap_set_range_blk (&bm, 3, 130, 1);
+  assert (bitmap_get_blk (&bm, 2, 0) == 0);
+  assert (bitmap_get_blk (&bm, 3, 0) == 1);
+  assert (bitmap_get_blk (&bm, 132, 0) == 1);
+  assert (bitmap_get_blk (&bm, 133, 0) == 0);
+  assert (bitmap_popcount_range (&bm, 0, nr_blocks) == 130);
+  assert (bitmap_popcount_range (&bm, 0, 4) == 1);
+  assert (bitmap_popcount_range (&bm, 100, 1000000) == 33);
+  assert (bitmap_next (&bm, 0) == 3);
+  assert (bitmap_next_zero (&bm, 3) == 133);
+  bitmap_set_range_blk (&bm, 3, 130, 0);
+  assert (bitmap_next (&bm, 0) == -1);
+
+  vexp = (1 << bpb) - 1;
+  bitmap_set_range_blk (&bm, 0, nr_blocks, vexp);
+  assert (bitmap_get_blk (&bm, 0, 0) == vexp);
+  assert (bitmap_get_blk (&bm, nr_blocks-1, 0) == vexp);
+  assert (bitmap_popcount_range (&bm, 0, nr_blocks) == nr_blocks);
+  assert (bitmap_next_zero (&bm, 0) == -1);
+
   bitmap_free (&bm);
 }
 
@@ -32,6 +32,7 @@
 
 #include <config.h>
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -53,6 +54,7 @@ struct block {
   uint64_t start;
   uint64_t size;
   char *data;
+  unsigned refs;                /* References held by readers. */
 };
 
 blkcache *
@@ -107,6 +109,7 @@ get_block (blkcache *c, uint64_t offset, uint64_t *start, uint64_t *size)
       }
 
       c->stats.hits++;
+      c->blocks[0].refs++;
       *start = c->blocks[0].start;
       *size = c->blocks[0].size;
       return c->blocks[0].data;
@@ -120,24 +123,59 @@ get_block (blkcache *c, uint64_t offset, uint64_t *start, uint64_t *size)
 int
 put_block (blkcache *c, uint64_t start, uint64_t size, char *data)
 {
-  size_t i;
+  size_t i, victim;
 
-  /* Eject the least recently used block. */
-  i = c->maxdepth-1;
-  if (c->blocks[i].data != NULL)
-    free (c->blocks[i].data);
+  /* Pick the victim slot: an empty slot if there is one, otherwise
+   * the least recently used block with no references held.
+   */
+  victim = c->maxdepth;
+  for (i = 0; i < c->maxdepth; ++i) {
+    if (c->blocks[i].data == NULL) {
+      victim = i;
+      break;
+    }
+  }
+  if (victim == c->maxdepth) {
+    for (i = c->maxdepth; i >= 1; --i) {
+      if (c->blocks[i-1].refs == 0) {
+        victim = i-1;
+        break;
+      }
+    }
+  }
+  if (victim == c->maxdepth)
+    return 1;                   /* Every block in use, caller keeps data. */
 
-  for (; i >= 1; --i)
-    c->blocks[i] = c->blocks[i-1];
+  free (c->blocks[victim].data);
 
-  /* The new block is most recently used, so it goes at the start. */
+  /* The new block is most recently used, so it goes at the start,
+   * holding one reference for the caller.
+   */
+  for (i = victim; i >= 1; --i)
+    c->blocks[i] = c->blocks[i-1];
   c->blocks[0].start = start;
   c->blocks[0].size = size;
   c->blocks[0].data = data;
+  c->blocks[0].refs = 1;
 
   return 0;
 }
 
+void
+release_block (blkcache *c, char *data)
+{
+  size_t i;
+
+  for (i = 0; i < c->maxdepth; ++i) {
+    if (c->blocks[i].data == data) {
+      assert (c->blocks[i].refs > 0);
+      c->blocks[i].refs--;
+      return;
+    }
+  }
+  abort ();                     /* Releasing a block not in the cache. */
+}
+
 void
 blkcache_get_stats (blkcache *c, blkcache_stats *ret)
 {
@@ -40,13 +40,34 @@ typedef struct blkcache_stats {
   size_t misses;
 } blkcache_stats;
 
+/* The cache does no locking of its own: when it is shared between
+ * connections the caller must hold a lock around all calls.  Blocks
+ * are reference counted so that the data pointer returned by
+ * get_block (or inserted by put_block) can safely be read outside the
+ * caller's lock: a block is never evicted while a reference is held.
+ */
 extern blkcache *new_blkcache (size_t maxdepth);
 extern void free_blkcache (blkcache *) __attribute__((__nonnull__ (1)));
+
+/* On a cache hit this takes a reference to the block, which the
+ * caller must drop with release_block when it has finished reading
+ * the data.
+ */
 extern char *get_block (blkcache *, uint64_t offset,
                         uint64_t *start, uint64_t *size)
   __attribute__((__nonnull__ (1, 3, 4)));
+
+/* Insert a block, evicting the least recently used unreferenced
+ * block to make room.  On success (0) the cache owns 'data' and holds
+ * one reference for the caller, to be dropped with release_block.  If
+ * every slot is referenced it returns 1 and the caller keeps
+ * ownership of 'data'.
+ */
 extern int put_block (blkcache *, uint64_t start, uint64_t size, char *data)
   __attribute__((__nonnull__ (1, 4)));
+
+extern void release_block (blkcache *, char *data)
+  __attribute__((__nonnull__ (1, 2)));
 extern void blkcache_get_stats (blkcache *, blkcache_stats *ret)
   __attribute__((__nonnull__ (1, 2)));
 
@@ -0,0 +1,163 @@
+/* nbdkit
+ * Copyright (C) 2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* CRC-32, polynomial 0xedb88320 (reflected).
+ *
+ * The software path uses the slice-by-8 technique: eight table
+ * lookups per 8 input bytes, with no dependency between the lookups,
+ * instead of one dependent lookup per byte.  On aarch64 CPUs with the
+ * CRC extension (runtime detected) we use the CRC32X/CRC32B
+ * instructions instead, which implement this exact polynomial.
+ *
+ * Note the x86 CRC32 instruction (SSE4.2) is *not* usable here: it
+ * implements CRC-32C (Castagnoli, polynomial 0x82f63b78) which
+ * produces different checksums.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef __aarch64__
+#include <sys/auxv.h>
+#endif
+
+#include "byte-swapping.h"
+
+#include "crc32.h"
+
+/* Slice-by-8 lookup tables, computed on first use.  tables[0] is the
+ * classic byte-at-a-time table.
+ */
+static uint32_t tables[8][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void
+build_tables (void)
+{
+  unsigned i, j;
+  uint32_t c;
+
+  for (i = 0; i < 256; ++i) {
+    c = i;
+    for (j = 0; j < 8; ++j)
+      c = (c >> 1) ^ (c & 1 ? UINT32_C (0xedb88320) : 0);
+    tables[0][i] = c;
+  }
+  for (j = 1; j < 8; ++j) {
+    for (i = 0; i < 256; ++i)
+      tables[j][i] = (tables[j-1][i] >> 8) ^ tables[0][tables[j-1][i] & 0xff];
+  }
+}
+
+static uint32_t
+crc32_sw (uint32_t crc, const unsigned char *p, size_t len)
+{
+  pthread_once (&tables_once, build_tables);
+
+  while (len >= 8) {
+    uint32_t lo, hi;
+
+    memcpy (&lo, p, 4);
+    memcpy (&hi, p + 4, 4);
+    lo = le32toh (lo) ^ crc;
+    hi = le32toh (hi);
+    crc =
+      tables[7][lo & 0xff] ^ tables[6][(lo >> 8) & 0xff] ^
+      tables[5][(lo >> 16) & 0xff] ^ tables[4][lo >> 24] ^
+      tables[3][hi & 0xff] ^ tables[2][(hi >> 8) & 0xff] ^
+      tables[1][(hi >> 16) & 0xff] ^ tables[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc = tables[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    p++;
+    len--;
+  }
+  return crc;
+}
+
+#ifdef __aarch64__
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+static int
+have_hw_crc32 (void)
+{
+  static int have = -1;
+
+  if (have == -1)
+    have = (getauxval (AT_HWCAP) & HWCAP_CRC32) != 0;
+  return have;
+}
+
+static uint32_t
+crc32_hw (uint32_t crc, const unsigned char *p, size_t len)
+{
+  while (len >= 8) {
+    uint64_t v;
+
+    memcpy (&v, p, 8);
+    __asm__ (".arch_extension crc\n\t"
+             "crc32x %w0, %w0, %x1" : "+r" (crc) : "r" (v));
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    __asm__ (".arch_extension crc\n\t"
+             "crc32b %w0, %w0, %w1" : "+r" (crc) : "r" (*p));
+    p++;
+    len--;
+  }
+  return crc;
+}
+
+#endif /* __aarch64__ */
+
+uint32_t
+crc32_update (uint32_t crc, const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+
+  crc = ~crc;
+#ifdef __aarch64__
+  if (have_hw_crc32 ())
+    return ~crc32_hw (crc, p, len);
+#endif
+  return ~crc32_sw (crc, p, len);
+}
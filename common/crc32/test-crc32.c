@@ -0,0 +1,96 @@
+/* nbdkit
+ * Copyright (C) 2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Unit tests of the CRC-32 code. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#undef NDEBUG /* Keep test strong even for nbdkit built without assertions */
+#include <assert.h>
+
+#include "crc32.h"
+
+/* Plain bit-at-a-time reference implementation. */
+static uint32_t
+reference_crc32 (const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+  uint32_t crc = ~UINT32_C (0);
+  size_t i;
+  unsigned j;
+
+  for (i = 0; i < len; ++i) {
+    crc ^= p[i];
+    for (j = 0; j < 8; ++j)
+      crc = (crc >> 1) ^ (crc & 1 ? UINT32_C (0xedb88320) : 0);
+  }
+  return ~crc;
+}
+
+int
+main (void)
+{
+  unsigned char buf[1024];
+  size_t i, offset, len;
+
+  /* Well-known test vectors. */
+  assert (crc32_update (0, "", 0) == 0);
+  assert (crc32_update (0, "123456789", 9) == UINT32_C (0xcbf43926));
+  assert (crc32_update (0, "The quick brown fox jumps over the lazy dog", 43)
+          == UINT32_C (0x414fa339));
+
+  /* Incremental updates must match a single call. */
+  assert (crc32_update (crc32_update (0, "12345", 5), "6789", 4)
+          == UINT32_C (0xcbf43926));
+
+  /* Compare against the reference implementation at a range of
+   * alignments and lengths, to exercise the sliced/hardware paths and
+   * their unaligned heads and tails.
+   */
+  srand (42);
+  for (i = 0; i < sizeof buf; ++i)
+    buf[i] = rand () & 0xff;
+
+  for (offset = 0; offset <= 9; ++offset) {
+    for (len = 0; len <= 70; ++len)
+      assert (crc32_update (0, buf + offset, len)
+              == reference_crc32 (buf + offset, len));
+    assert (crc32_update (0, buf + offset, sizeof buf - offset)
+            == reference_crc32 (buf + offset, sizeof buf - offset));
+  }
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,103 @@
+/* nbdkit
+ * Copyright (C) 2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Microbenchmark for is_zero.  Not run by make check; build it with
+ * 'make bench-iszero' and run it by hand when touching iszero.h.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "iszero.h"
+#include "tvdiff.h"
+
+/* Total bytes scanned per measurement. */
+#define TOTAL (1LL << 32)
+
+static void
+bench (const char *label, char *buf, size_t size)
+{
+  const int64_t iters = TOTAL / size;
+  struct timeval start, end;
+  int64_t i, usec;
+  volatile bool r;
+
+  /* Warm up the cache and the CPU dispatch. */
+  for (i = 0; i < 16; ++i)
+    r = is_zero (buf, size);
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < iters; ++i)
+    r = is_zero (buf, size);
+  gettimeofday (&end, NULL);
+  (void) r;
+
+  usec = tvdiff_usec (&start, &end);
+  printf ("%-24s %8zu bytes  %8.2f GB/s\n",
+          label, size,
+          (double) size * iters / 1e3 / usec);
+}
+
+int
+main (void)
+{
+  const size_t sizes[] = { 4096, 65536, 1048576 };
+  const size_t maxsize = sizes[2];
+  size_t i;
+  char *buf;
+
+  buf = malloc (maxsize);
+  if (buf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  memset (buf, 0, maxsize);
+
+  for (i = 0; i < sizeof sizes / sizeof sizes[0]; ++i)
+    bench ("all zero", buf, sizes[i]);
+
+  /* Nonzero byte in the middle: scans half the buffer. */
+  for (i = 0; i < sizeof sizes / sizeof sizes[0]; ++i) {
+    buf[sizes[i]/2] = 1;
+    bench ("nonzero at midpoint", buf, sizes[i]);
+    buf[sizes[i]/2] = 0;
+  }
+
+  free (buf);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,105 @@
+/* nbdkit
+ * Copyright (C) 2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Microbenchmark for random_fill.  Not run by make check; build it
+ * with 'make bench-random' and run it by hand when touching random.h.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "random.h"
+#include "tvdiff.h"
+
+/* Total bytes generated per measurement. */
+#define TOTAL (1LL << 32)
+
+static void
+bench (const char *label,
+       void (*fill) (uint64_t seed, uint8_t *b, size_t count, uint64_t w),
+       uint8_t *buf, size_t size)
+{
+  const int64_t iters = TOTAL / size;
+  struct timeval start, end;
+  int64_t i, usec;
+
+  /* Warm up the cache and the CPU dispatch. */
+  for (i = 0; i < 16; ++i)
+    fill (42, buf, size, 0);
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < iters; ++i)
+    fill (42, buf, size, 0);
+  gettimeofday (&end, NULL);
+
+  usec = tvdiff_usec (&start, &end);
+  printf ("%-24s %8zu bytes  %8.2f GB/s\n",
+          label, size,
+          (double) size * iters / 1e3 / usec);
+}
+
+/* Wrap the dispatching entry point in the same shape as the kernels. */
+static void
+fill_dispatch (uint64_t seed, uint8_t *b, size_t count, uint64_t w)
+{
+  random_fill (seed, w * 8, b, count);
+}
+
+int
+main (void)
+{
+  const size_t sizes[] = { 4096, 65536, 1048576 };
+  const size_t maxsize = sizes[2];
+  size_t i;
+  uint8_t *buf;
+
+  buf = malloc (maxsize);
+  if (buf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < sizeof sizes / sizeof sizes[0]; ++i)
+    bench ("generic", random_fill_generic, buf, sizes[i]);
+
+  for (i = 0; i < sizeof sizes / sizeof sizes[0]; ++i)
+    bench ("dispatched", fill_dispatch, buf, sizes[i]);
+
+  free (buf);
+  exit (EXIT_SUCCESS);
+}
@@ -39,11 +39,17 @@
  * this header to provide the platform-specific implementation.  On
  * GNU/Linux these are defined in <endian.h> and <byteswap.h> but
  * other platforms have other requirements.
+ *
+ * In addition bswap_16_buf, bswap_32_buf and bswap_64_buf byte swap
+ * every element of a whole buffer, using SIMD where available.
  */
 
 #ifndef NBDKIT_BYTE_SWAPPING_H
 #define NBDKIT_BYTE_SWAPPING_H
 
+#include <stdint.h>
+#include <string.h>
+
 #ifdef HAVE_BYTESWAP_H
 #include <byteswap.h>
 #endif
@@ -127,4 +133,209 @@
 # endif
 #endif
 
+/* Byte swap each 16, 32 or 64 bit element of a buffer.  These work
+ * either from one buffer to another or in place (dest == src), but
+ * the buffers must not otherwise overlap.  len is in bytes and must
+ * be a multiple of the element size; the buffers need not be aligned.
+ *
+ * The generic versions below are always available.  On x86-64 the
+ * public functions dispatch at runtime to an SSSE3 or AVX2 shuffle,
+ * and on aarch64 (where NEON is mandatory) to vrev.
+ */
+
+static inline void
+bswap_16_buf_generic (void *dest, const void *src, size_t len)
+{
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+  uint16_t v;
+
+  for (; len >= 2; s += 2, d += 2, len -= 2) {
+    memcpy (&v, s, 2);
+    v = bswap_16 (v);
+    memcpy (d, &v, 2);
+  }
+}
+
+static inline void
+bswap_32_buf_generic (void *dest, const void *src, size_t len)
+{
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+  uint32_t v;
+
+  for (; len >= 4; s += 4, d += 4, len -= 4) {
+    memcpy (&v, s, 4);
+    v = bswap_32 (v);
+    memcpy (d, &v, 4);
+  }
+}
+
+static inline void
+bswap_64_buf_generic (void *dest, const void *src, size_t len)
+{
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+  uint64_t v;
+
+  for (; len >= 8; s += 8, d += 8, len -= 8) {
+    memcpy (&v, s, 8);
+    v = bswap_64 (v);
+    memcpy (d, &v, 8);
+  }
+}
+
+/* Internal helper: sel is 0, 1 or 2 for 16, 32 or 64 bit elements. */
+static inline void
+bswap_buf_generic (void *dest, const void *src, size_t len, unsigned sel)
+{
+  switch (sel) {
+  case 0: bswap_16_buf_generic (dest, src, len); break;
+  case 1: bswap_32_buf_generic (dest, src, len); break;
+  case 2: bswap_64_buf_generic (dest, src, len); break;
+  }
+}
+
+#if defined (__x86_64__) && (defined (__clang__) || __GNUC__ >= 6)
+#define BSWAP_BUF_CPU_DISPATCH 1
+
+#include <immintrin.h>
+
+/* pshufb control bytes reversing each 16, 32 or 64 bit element of a
+ * 16 byte lane, indexed by sel (above).
+ */
+static const uint8_t bswap_buf_shuffle[3][16]
+__attribute__ ((__aligned__ (16))) = {
+  { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+  { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+  { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 },
+};
+
+__attribute__ ((__target__ ("ssse3")))
+static inline void
+bswap_buf_ssse3 (void *dest, const void *src, size_t len, unsigned sel)
+{
+  const __m128i mask =
+    _mm_load_si128 ((const __m128i *) bswap_buf_shuffle[sel]);
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+
+  while (len >= 64) {
+    __m128i v0 = _mm_loadu_si128 ((const __m128i *) (s + 0));
+    __m128i v1 = _mm_loadu_si128 ((const __m128i *) (s + 16));
+    __m128i v2 = _mm_loadu_si128 ((const __m128i *) (s + 32));
+    __m128i v3 = _mm_loadu_si128 ((const __m128i *) (s + 48));
+    _mm_storeu_si128 ((__m128i *) (d + 0), _mm_shuffle_epi8 (v0, mask));
+    _mm_storeu_si128 ((__m128i *) (d + 16), _mm_shuffle_epi8 (v1, mask));
+    _mm_storeu_si128 ((__m128i *) (d + 32), _mm_shuffle_epi8 (v2, mask));
+    _mm_storeu_si128 ((__m128i *) (d + 48), _mm_shuffle_epi8 (v3, mask));
+    s += 64; d += 64; len -= 64;
+  }
+  while (len >= 16) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *) s);
+    _mm_storeu_si128 ((__m128i *) d, _mm_shuffle_epi8 (v, mask));
+    s += 16; d += 16; len -= 16;
+  }
+  if (len > 0)               /* still a multiple of the element size */
+    bswap_buf_generic (d, s, len, sel);
+}
+
+__attribute__ ((__target__ ("avx2")))
+static inline void
+bswap_buf_avx2 (void *dest, const void *src, size_t len, unsigned sel)
+{
+  /* vpshufb shuffles within each 16 byte lane, which is exactly what
+   * we want: the same control bytes in both lanes.
+   */
+  const __m256i mask = _mm256_broadcastsi128_si256
+    (_mm_load_si128 ((const __m128i *) bswap_buf_shuffle[sel]));
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+
+  while (len >= 64) {
+    __m256i v0 = _mm256_loadu_si256 ((const __m256i *) (s + 0));
+    __m256i v1 = _mm256_loadu_si256 ((const __m256i *) (s + 32));
+    _mm256_storeu_si256 ((__m256i *) (d + 0), _mm256_shuffle_epi8 (v0, mask));
+    _mm256_storeu_si256 ((__m256i *) (d + 32), _mm256_shuffle_epi8 (v1, mask));
+    s += 64; d += 64; len -= 64;
+  }
+  while (len >= 32) {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *) s);
+    _mm256_storeu_si256 ((__m256i *) d, _mm256_shuffle_epi8 (v, mask));
+    s += 32; d += 32; len -= 32;
+  }
+  if (len > 0)
+    bswap_buf_generic (d, s, len, sel);
+}
+
+static inline void
+bswap_buf_dispatch (void *dest, const void *src, size_t len, unsigned sel)
+{
+  if (len >= 16) {
+    if (__builtin_cpu_supports ("avx2"))
+      return bswap_buf_avx2 (dest, src, len, sel);
+    if (__builtin_cpu_supports ("ssse3"))
+      return bswap_buf_ssse3 (dest, src, len, sel);
+  }
+  bswap_buf_generic (dest, src, len, sel);
+}
+
+#elif defined (__aarch64__)
+#define BSWAP_BUF_CPU_DISPATCH 1
+
+#include <arm_neon.h>
+
+/* NEON is mandatory on aarch64, no runtime check needed. */
+static inline void
+bswap_buf_dispatch (void *dest, const void *src, size_t len, unsigned sel)
+{
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+
+  while (len >= 16) {
+    uint8x16_t v = vld1q_u8 (s);
+    switch (sel) {
+    case 0: v = vrev16q_u8 (v); break;
+    case 1: v = vrev32q_u8 (v); break;
+    case 2: v = vrev64q_u8 (v); break;
+    }
+    vst1q_u8 (d, v);
+    s += 16; d += 16; len -= 16;
+  }
+  if (len > 0)
+    bswap_buf_generic (d, s, len, sel);
+}
+
+#endif /* __aarch64__ */
+
+static inline void
+bswap_16_buf (void *dest, const void *src, size_t len)
+{
+#ifdef BSWAP_BUF_CPU_DISPATCH
+  bswap_buf_dispatch (dest, src, len, 0);
+#else
+  bswap_16_buf_generic (dest, src, len);
+#endif
+}
+
+static inline void
+bswap_32_buf (void *dest, const void *src, size_t len)
+{
+#ifdef BSWAP_BUF_CPU_DISPATCH
+  bswap_buf_dispatch (dest, src, len, 1);
+#else
+  bswap_32_buf_generic (dest, src, len);
+#endif
+}
+
+static inline void
+bswap_64_buf (void *dest, const void *src, size_t len)
+{
+#ifdef BSWAP_BUF_CPU_DISPATCH
+  bswap_buf_dispatch (dest, src, len, 2);
+#else
+  bswap_64_buf_generic (dest, src, len);
+#endif
+}
+
 #endif /* NBDKIT_BYTE_SWAPPING_H */
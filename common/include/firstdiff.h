@@ -0,0 +1,157 @@
+/* nbdkit
+ * Copyright (C) 2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* first_diff returns the offset of the first byte which differs
+ * between two buffers, or size if the buffers are equal.  Like
+ * memcmp, but telling you where; unlike memcmp, nothing is implied
+ * about the ordering of the buffers.  The structure mirrors iszero.h:
+ * a generic 16 byte vector loop, with wider variants selected at
+ * runtime on x86-64.
+ */
+
+#ifndef NBDKIT_FIRSTDIFF_H
+#define NBDKIT_FIRSTDIFF_H
+
+#include <string.h>
+#include <stddef.h>
+
+#ifdef __GNUC__
+
+typedef unsigned long long first_diff_v2du
+  __attribute__((__vector_size__ (16)));
+
+/* Scan the 16 bytes at i, which are known to contain a difference. */
+static inline size_t __attribute__((__nonnull__ (1, 2)))
+first_diff_within (const char *buf1, const char *buf2, size_t i)
+{
+  while (buf1[i] == buf2[i])
+    ++i;
+  return i;
+}
+
+static inline size_t __attribute__((__nonnull__ (1, 2)))
+first_diff_generic (const char *buf1, const char *buf2, size_t size)
+{
+  size_t i = 0;
+
+  /* Vectors are loaded through memcpy so unaligned buffers are safe;
+   * the compiler turns this into unaligned vector loads.
+   */
+  while (i + 16 <= size) {
+    first_diff_v2du v1, v2;
+
+    memcpy (&v1, &buf1[i], 16);
+    memcpy (&v2, &buf2[i], 16);
+    v1 ^= v2;
+    if (v1[0] | v1[1])
+      return first_diff_within (buf1, buf2, i);
+    i += 16;
+  }
+
+  for (; i < size; ++i)
+    if (buf1[i] != buf2[i])
+      return i;
+
+  return size;
+}
+
+#if defined (__x86_64__) && (defined (__clang__) || __GNUC__ >= 6)
+
+typedef unsigned long long first_diff_v4du
+  __attribute__((__vector_size__ (32)));
+
+/* 128 bytes per iteration with AVX2.  On a difference, rescan the
+ * block with the generic version to locate the byte; that costs a few
+ * extra loads but only on the mismatch path.
+ */
+static inline size_t
+__attribute__((__nonnull__ (1, 2), __target__ ("avx2")))
+first_diff_avx2 (const char *buf1, const char *buf2, size_t size)
+{
+  size_t i = 0;
+
+  while (i + 128 <= size) {
+    first_diff_v4du v0, v1, v2, v3, w0, w1, w2, w3, acc;
+
+    memcpy (&v0, &buf1[i], 32);
+    memcpy (&v1, &buf1[i+32], 32);
+    memcpy (&v2, &buf1[i+64], 32);
+    memcpy (&v3, &buf1[i+96], 32);
+    memcpy (&w0, &buf2[i], 32);
+    memcpy (&w1, &buf2[i+32], 32);
+    memcpy (&w2, &buf2[i+64], 32);
+    memcpy (&w3, &buf2[i+96], 32);
+    acc = ((v0 ^ w0) | (v1 ^ w1)) | ((v2 ^ w2) | (v3 ^ w3));
+    if (acc[0] | acc[1] | acc[2] | acc[3])
+      return i + first_diff_generic (&buf1[i], &buf2[i], 128);
+    i += 128;
+  }
+  return i + first_diff_generic (&buf1[i], &buf2[i], size - i);
+}
+
+static inline size_t __attribute__((__nonnull__ (1, 2)))
+first_diff (const char *buf1, const char *buf2, size_t size)
+{
+  /* For small buffers the dispatch isn't worth it.
+   * __builtin_cpu_supports is just a bit test on a library global.
+   */
+  if (size >= 256 && __builtin_cpu_supports ("avx2"))
+    return first_diff_avx2 (buf1, buf2, size);
+  return first_diff_generic (buf1, buf2, size);
+}
+
+#else /* !x86-64 or no dispatch support */
+
+static inline size_t __attribute__((__nonnull__ (1, 2)))
+first_diff (const char *buf1, const char *buf2, size_t size)
+{
+  return first_diff_generic (buf1, buf2, size);
+}
+
+#endif
+
+#else /* !__GNUC__ */
+
+static inline size_t
+first_diff (const char *buf1, const char *buf2, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i < size; ++i)
+    if (buf1[i] != buf2[i])
+      return i;
+  return size;
+}
+
+#endif /* !__GNUC__ */
+
+#endif /* NBDKIT_FIRSTDIFF_H */
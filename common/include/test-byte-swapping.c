@@ -57,6 +57,8 @@ main (void)
   uint16_t i16;
   uint32_t i32;
   uint64_t i64;
+  uint8_t src[1024], expected[1024], dst[1024];
+  size_t i, len;
 
   memcpy (&i16, le16, 2);
   assert (le16toh (i16) == 0x1234);
@@ -104,5 +106,54 @@ main (void)
   i64 = bswap_64 (i64);
   assert (memcmp (&i64, le64, 8) == 0);
 
+  /* Bulk buffer swaps: compare against bswap_* applied one element at
+   * a time, at a range of lengths to cover the SIMD kernels and their
+   * scalar tails, both out of place and in place.
+   */
+  for (i = 0; i < sizeof src; ++i)
+    src[i] = i * 7 + 123;
+
+  for (len = 0; len <= 320; len += 2) {
+    for (i = 0; i < len; i += 2) {
+      memcpy (&i16, src + i, 2);
+      i16 = bswap_16 (i16);
+      memcpy (expected + i, &i16, 2);
+    }
+    memset (dst, 0, sizeof dst);
+    bswap_16_buf (dst, src, len);
+    assert (memcmp (dst, expected, len) == 0);
+    memcpy (dst, src, len);
+    bswap_16_buf (dst, dst, len);
+    assert (memcmp (dst, expected, len) == 0);
+  }
+
+  for (len = 0; len <= 320; len += 4) {
+    for (i = 0; i < len; i += 4) {
+      memcpy (&i32, src + i, 4);
+      i32 = bswap_32 (i32);
+      memcpy (expected + i, &i32, 4);
+    }
+    memset (dst, 0, sizeof dst);
+    bswap_32_buf (dst, src, len);
+    assert (memcmp (dst, expected, len) == 0);
+    memcpy (dst, src, len);
+    bswap_32_buf (dst, dst, len);
+    assert (memcmp (dst, expected, len) == 0);
+  }
+
+  for (len = 0; len <= 320; len += 8) {
+    for (i = 0; i < len; i += 8) {
+      memcpy (&i64, src + i, 8);
+      i64 = bswap_64 (i64);
+      memcpy (expected + i, &i64, 8);
+    }
+    memset (dst, 0, sizeof dst);
+    bswap_64_buf (dst, src, len);
+    assert (memcmp (dst, expected, len) == 0);
+    memcpy (dst, src, len);
+    bswap_64_buf (dst, dst, len);
+    assert (memcmp (dst, expected, len) == 0);
+  }
+
   exit (EXIT_SUCCESS);
 }
@@ -0,0 +1,105 @@
+/* nbdkit
+ * Copyright (C) 2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#undef NDEBUG /* Keep test strong even for nbdkit built without assertions */
+#include <assert.h>
+
+#include "firstdiff.h"
+
+int
+main (void)
+{
+  char *buf1, *buf2;
+  size_t i, j;
+
+  /* Small sizes and all alignments, equal buffers. */
+  buf1 = calloc (1, 256);
+  buf2 = calloc (1, 256);
+  if (buf1 == NULL || buf2 == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+
+  for (j = 0; j <= 16; ++j)
+    for (i = 0; i <= 16; ++i)
+      assert (first_diff (&buf1[j], &buf2[j], i) == i);
+
+  /* A difference at every position of a small buffer. */
+  for (j = 0; j < 64; ++j) {
+    buf2[j] = 1;
+    assert (first_diff (buf1, buf2, 64) == j);
+    assert (first_diff (buf1, buf2, j) == j);
+    assert (first_diff (buf1, buf2, j+1) == j);
+    buf2[j] = 0;
+  }
+
+  free (buf1);
+  free (buf2);
+
+  /* Larger buffers, exercising the wide vector paths, with the
+   * difference planted at positions around the block boundaries.
+   */
+  buf1 = malloc (8192);
+  buf2 = malloc (8192);
+  if (buf1 == NULL || buf2 == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < 8192; ++i)
+    buf1[i] = buf2[i] = i & 0xff;
+
+  assert (first_diff (buf1, buf2, 8192) == 8192);
+
+  for (j = 0; j < 8192; j += 127) {
+    buf2[j] ^= 0x80;
+    assert (first_diff (buf1, buf2, 8192) == j);
+    assert (first_diff (buf1, buf2, j) == j);
+    if (j+1 < 8192)
+      assert (first_diff (&buf1[j+1], &buf2[j+1], 8192-j-1) == 8192-j-1);
+    buf2[j] ^= 0x80;
+  }
+
+  /* Two differences: the first must win. */
+  buf2[100] ^= 1;
+  buf2[5000] ^= 1;
+  assert (first_diff (buf1, buf2, 8192) == 100);
+
+  free (buf1);
+  free (buf2);
+  exit (EXIT_SUCCESS);
+}
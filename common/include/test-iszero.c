@@ -61,6 +61,31 @@ main (void)
       assert (is_zero (&buf[j], 256-j-i));
   }
 
+  free (buf);
+
+  /* Larger buffers, exercising the wide vector paths, with a single
+   * nonzero byte planted at positions around the block boundaries.
+   */
+  buf = malloc (8192);
+  if (buf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  memset (buf, 0, 8192);
+
+  for (j = 0; j <= 5; ++j)
+    assert (is_zero (&buf[j], 8192-16-j));
+
+  for (j = 0; j < 8192; j += 127) {
+    buf[j] = 1;
+    assert (!is_zero (buf, 8192));
+    assert (!is_zero (buf, j+1));
+    assert (is_zero (buf, j));
+    if (j+1 < 8192)
+      assert (is_zero (&buf[j+1], 8192-j-1));
+    buf[j] = 0;
+  }
+
   free (buf);
   exit (EXIT_SUCCESS);
 }
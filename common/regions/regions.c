@@ -76,6 +76,42 @@ find_region (const regions *rs, uint64_t offset)
   return regions_search (rs, &offset, compare_offset);
 }
 
+const struct region *
+find_region_hint (const regions *rs, uint64_t offset, size_t *hint)
+{
+  const size_t i = *hint;
+  const struct region *region;
+
+  /* Check the hinted region, then the next one, before searching. */
+  if (i < rs->size) {
+    region = &rs->ptr[i];
+    if (offset >= region->start && offset <= region->end)
+      return region;
+    if (offset > region->end && i+1 < rs->size) {
+      region++;
+      if (offset >= region->start && offset <= region->end) {
+        *hint = i+1;
+        return region;
+      }
+    }
+  }
+
+  region = find_region (rs, offset);
+  if (region)
+    *hint = region - rs->ptr;
+  return region;
+}
+
+int
+reserve_regions (regions *rs, size_t n)
+{
+  if (regions_reserve (rs, n) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  return 0;
+}
+
 /* This is the low level function for constructing the list of
  * regions.  It appends one region to the list, checking that the
  * invariants described above (about the regions being non-overlapping
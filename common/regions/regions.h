@@ -56,9 +56,13 @@ enum region_type {
   region_zero,        /* padding */
 };
 
-/* Region. */
+/* Region.  The start and end fields are first so that region lookup,
+ * which only examines those fields, touches as few cache lines of the
+ * array as possible.
+ */
 struct region {
-  uint64_t start, len, end;    /* byte offsets; end = start + len - 1 */
+  uint64_t start, end;         /* byte offsets; end = start + len - 1 */
+  uint64_t len;
   enum region_type type;
   union {
     size_t i;                  /* region_file: i'th file */
@@ -104,6 +108,26 @@ extern const struct region *find_region (const regions *regions,
                                          uint64_t offset)
   __attribute__((__nonnull__ (1)));
 
+/* Like find_region, but maintains a caller-supplied cursor.  *hint is
+ * the index of the region returned by the previous lookup (initialize
+ * it to 0).  Sequential clients nearly always hit the same region as
+ * the previous request or the one after it, so those are checked
+ * before falling back to the binary search.  The cursor is only a
+ * starting point and is validated before use, so a stale or
+ * concurrently updated value is safe, merely slower.
+ */
+extern const struct region *find_region_hint (const regions *regions,
+                                              uint64_t offset, size_t *hint)
+  __attribute__((__nonnull__ (1, 3)));
+
+/* Reserve space for at least n further regions.  Calling this before
+ * appending regions in bulk (eg. the partitioning plugin can create
+ * layouts with thousands of regions) avoids repeated reallocation of
+ * the array.  It is only an optimization; append works without it.
+ */
+extern int reserve_regions (regions *regions, size_t n)
+  __attribute__((__nonnull__ (1)));
+
 /* Append one region of a given length, plus up to two optional
  * padding regions.
  *
@@ -55,6 +55,37 @@ extern void cleanup_mutex_unlock (pthread_mutex_t **ptr);
     assert (!_r);                                                       \
   } while (0)
 
+/* Adaptive lock for very short critical sections (a few loads and
+ * stores): spin briefly with trylock before parking on the mutex,
+ * which avoids a futex round trip into the kernel when the current
+ * holder is just about to release.  Unlocking and the guarded scope
+ * are exactly as for ACQUIRE_LOCK_FOR_CURRENT_SCOPE.  Do not use
+ * this around sections which can block or do I/O - spinning would
+ * only burn CPU then.
+ */
+static inline void
+adaptive_mutex_lock (pthread_mutex_t *mutex)
+{
+  unsigned i;
+  int r;
+
+  for (i = 0; i < 64; ++i) {
+    if (pthread_mutex_trylock (mutex) == 0)
+      return;
+#if defined (__x86_64__) || defined (__i386__)
+    __asm__ __volatile__ ("pause");
+#elif defined (__aarch64__)
+    __asm__ __volatile__ ("yield");
+#endif
+  }
+  r = pthread_mutex_lock (mutex);
+  assert (!r);
+}
+
+#define ACQUIRE_ADAPTIVE_LOCK_FOR_CURRENT_SCOPE(mutex)                  \
+  CLEANUP_MUTEX_UNLOCK pthread_mutex_t *UNIQUE_VAR(_lock) = mutex;      \
+  adaptive_mutex_lock (UNIQUE_VAR(_lock))
+
 extern void cleanup_rwlock_unlock (pthread_rwlock_t **ptr);
 #define CLEANUP_RWLOCK_UNLOCK __attribute__((cleanup (cleanup_rwlock_unlock)))
 
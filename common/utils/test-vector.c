@@ -82,6 +82,51 @@ test_int64_vector (void)
   free (v.ptr);
 }
 
+static void
+test_growth (void)
+{
+  int64_vector v = empty_vector;
+  size_t i, reallocs = 0, alloc = 0;
+  int r;
+
+  /* Appending many elements must grow the allocation geometrically,
+   * not once per append.
+   */
+  for (i = 0; i < 100000; ++i) {
+    r = int64_vector_append (&v, i);
+    assert (r == 0);
+    if (v.alloc != alloc) {
+      reallocs++;
+      alloc = v.alloc;
+    }
+  }
+  assert (v.size == 100000);
+  assert (reallocs < 64);
+
+  for (i = 0; i < 100000; ++i)
+    assert (v.ptr[i] == i);
+
+  int64_vector_reset (&v);
+
+  /* reserve_capacity is a total capacity, not an increment, and
+   * calling it twice with the same value must not grow twice.
+   */
+  r = int64_vector_reserve_capacity (&v, 1000);
+  assert (r == 0);
+  assert (v.alloc >= 1000);
+  alloc = v.alloc;
+  r = int64_vector_reserve_capacity (&v, 1000);
+  assert (r == 0);
+  assert (v.alloc == alloc);
+  for (i = 0; i < 1000; ++i) {
+    r = int64_vector_append (&v, i);
+    assert (r == 0);
+  }
+  assert (v.alloc == alloc);    /* no realloc during the appends */
+
+  int64_vector_reset (&v);
+}
+
 static void
 test_string_vector (void)
 {
@@ -117,5 +162,6 @@ int
 main (int argc, char *argv[])
 {
   test_int64_vector ();
+  test_growth ();
   test_string_vector ();
 }
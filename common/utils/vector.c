@@ -34,6 +34,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
 
 #include "vector.h"
 
@@ -42,6 +44,12 @@ generic_vector_reserve (struct generic_vector *v, size_t n, size_t itemsize)
 {
   void *newptr;
 
+  if (n > (SIZE_MAX - v->alloc) ||
+      (v->alloc + n) > SIZE_MAX / itemsize) {
+    errno = ENOMEM;
+    return -1;
+  }
+
   newptr = realloc (v->ptr, (n + v->alloc) * itemsize);
   if (newptr == NULL)
     return -1;
@@ -49,3 +57,35 @@ generic_vector_reserve (struct generic_vector *v, size_t n, size_t itemsize)
   v->alloc += n;
   return 0;
 }
+
+int
+generic_vector_reserve_capacity (struct generic_vector *v, size_t cap,
+                                 size_t itemsize)
+{
+  void *newptr;
+  size_t newalloc;
+
+  if (cap <= v->alloc)
+    return 0;
+
+  /* Grow by 3/2, starting at 16 items, so a sequence of appends costs
+   * amortized O(1) reallocations rather than one per append.
+   */
+  newalloc = v->alloc + v->alloc / 2;
+  if (newalloc < 16)
+    newalloc = 16;
+  if (newalloc < cap)
+    newalloc = cap;
+
+  if (newalloc > SIZE_MAX / itemsize) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  newptr = realloc (v->ptr, newalloc * itemsize);
+  if (newptr == NULL)
+    return -1;
+  v->ptr = newptr;
+  v->alloc = newalloc;
+  return 0;
+}
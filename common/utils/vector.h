@@ -85,9 +85,10 @@
   };                                                                    \
   typedef struct name name;                                             \
                                                                         \
-  /* Reserve n elements at the end of the vector.  Note space is        \
-   * allocated but the vector size is not increased and the new         \
-   * elements are not initialized.                                      \
+  /* Reserve exactly n elements at the end of the vector.  Note space  \
+   * is allocated but the vector size is not increased and the new      \
+   * elements are not initialized.  Use this when the final size is     \
+   * known in advance.                                                  \
    */                                                                   \
   static inline int                                                     \
   name##_reserve (name *v, size_t n)                                    \
@@ -96,13 +97,26 @@
                                    sizeof (type));                      \
   }                                                                     \
                                                                         \
+  /* Ensure the vector can hold at least ‘cap’ elements in total       \
+   * without further reallocation.  Unlike ‘name’_reserve this grows    \
+   * the allocation geometrically, so calling it before every append    \
+   * (as the append/insert functions do) costs amortized O(1)           \
+   * reallocations over the life of the vector.                         \
+   */                                                                   \
+  static inline int                                                     \
+  name##_reserve_capacity (name *v, size_t cap)                         \
+  {                                                                     \
+    return generic_vector_reserve_capacity ((struct generic_vector *)v, \
+                                            cap, sizeof (type));        \
+  }                                                                     \
+                                                                        \
   /* Insert at i'th element.  i=0 => beginning  i=size => append */     \
   static inline int                                                     \
   name##_insert (name *v, type elem, size_t i)                          \
   {                                                                     \
     assert (i <= v->size);                                              \
     if (v->size >= v->alloc) {                                          \
-      if (name##_reserve (v, 1) == -1) return -1;                       \
+      if (name##_reserve_capacity (v, v->size + 1) == -1) return -1;    \
     }                                                                   \
     memmove (&v->ptr[i+1], &v->ptr[i], (v->size-i) * sizeof (elem));    \
     v->ptr[i] = elem;                                                   \
@@ -173,5 +187,7 @@ struct generic_vector {
 
 extern int generic_vector_reserve (struct generic_vector *v,
                                    size_t n, size_t itemsize);
+extern int generic_vector_reserve_capacity (struct generic_vector *v,
+                                            size_t cap, size_t itemsize);
 
 #endif /* NBDKIT_VECTOR_H */
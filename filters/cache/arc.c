@@ -0,0 +1,211 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* ARC-like (adaptive) eviction policy.
+ *
+ * A bitmap approximation of ARC in the same style as the lru policy.
+ * Blocks accessed once are "recent" (t1); blocks accessed again are
+ * "frequent" (t2).  When a block is evicted it leaves a ghost bit
+ * behind (b1 for recent, b2 for frequent).  A hit on a ghost means
+ * the block was evicted too early, so the adaptive target p shifts
+ * to give that side more of the cache: a b1 hit favours recency, a
+ * b2 hit favours frequency.
+ *
+ * Reclaim consults has_been_recently_accessed; we protect the
+ * frequent blocks while the recent side is over target and vice
+ * versa, so a single scan of the disk (which touches every block
+ * exactly once, filling t1) cannot push the genuinely hot blocks in
+ * t2 out of the cache.
+ *
+ * The bitmaps cannot remember access order, so unlike real ARC the
+ * lists are unordered and ghosts are forgotten wholesale when a
+ * ghost set grows past the cache size.  Every per-access operation
+ * is a couple of bitmap tests, O(1).
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <nbdkit-filter.h>
+
+#include "bitmap.h"
+#include "minmax.h"
+
+#include "cache.h"
+#include "blk.h"
+#include "policy.h"
+
+/* t1 = resident, accessed once; t2 = resident, accessed repeatedly;
+ * b1, b2 = the corresponding ghosts (evicted, remembered).
+ */
+static struct bitmap t1, t2, b1, b2;
+static uint64_t nt1, nt2, nb1, nb2;
+
+/* Adaptive target for the size of t1 (in blocks), 0 <= p <= N. */
+static uint64_t p;
+
+/* Approximate cache size in blocks. */
+static uint64_t N = 100;
+
+static void
+arc_init (void)
+{
+  bitmap_init (&t1, blksize, 1 /* bits per block */);
+  bitmap_init (&t2, blksize, 1 /* bits per block */);
+  bitmap_init (&b1, blksize, 1 /* bits per block */);
+  bitmap_init (&b2, blksize, 1 /* bits per block */);
+}
+
+static void
+arc_free (void)
+{
+  bitmap_free (&t1);
+  bitmap_free (&t2);
+  bitmap_free (&b1);
+  bitmap_free (&b2);
+}
+
+static int
+arc_set_size (uint64_t new_size)
+{
+  if (bitmap_resize (&t1, new_size) == -1 ||
+      bitmap_resize (&t2, new_size) == -1 ||
+      bitmap_resize (&b1, new_size) == -1 ||
+      bitmap_resize (&b2, new_size) == -1)
+    return -1;
+
+  if (max_size != -1)
+    N = MAX (max_size / blksize, 100);
+  else
+    N = MAX (new_size / blksize, 100);
+  p = N / 2;
+
+  return 0;
+}
+
+static void
+arc_set_recently_accessed (uint64_t blknum)
+{
+  if (bitmap_get_blk (&t2, blknum, false))
+    return;                     /* already frequent */
+
+  if (bitmap_get_blk (&t1, blknum, false)) {
+    /* Second access: promote recent -> frequent. */
+    bitmap_set_blk (&t1, blknum, false);
+    nt1--;
+    bitmap_set_blk (&t2, blknum, true);
+    nt2++;
+    return;
+  }
+
+  if (bitmap_get_blk (&b1, blknum, false)) {
+    /* Ghost hit on the recent side: grow the recent target. */
+    p = MIN (p + MAX (nb2 / MAX (nb1, 1), 1), N);
+    bitmap_set_blk (&b1, blknum, false);
+    nb1--;
+    bitmap_set_blk (&t2, blknum, true);
+    nt2++;
+    return;
+  }
+
+  if (bitmap_get_blk (&b2, blknum, false)) {
+    /* Ghost hit on the frequent side: grow the frequent target. */
+    uint64_t d = MAX (nb1 / MAX (nb2, 1), 1);
+    p = p > d ? p - d : 0;
+    bitmap_set_blk (&b2, blknum, false);
+    nb2--;
+    bitmap_set_blk (&t2, blknum, true);
+    nt2++;
+    return;
+  }
+
+  /* First access. */
+  bitmap_set_blk (&t1, blknum, true);
+  nt1++;
+}
+
+static bool
+arc_has_been_recently_accessed (uint64_t blknum)
+{
+  /* Evict from the side which is over its target: while t1 is over,
+   * the frequent blocks are protected, and vice versa.  Blocks in
+   * neither list (eg. restored from a persistent cache and never
+   * accessed) are fair game.
+   */
+  if (bitmap_get_blk (&t2, blknum, false))
+    return nt1 >= p;
+  if (bitmap_get_blk (&t1, blknum, false))
+    return nt1 < p;
+  return false;
+}
+
+static void
+arc_evicted (uint64_t blknum)
+{
+  /* Leave a ghost behind so a re-access can adapt the target.  The
+   * bitmaps cannot age ghosts individually, so forget a ghost set
+   * wholesale once it grows past the cache size.
+   */
+  if (bitmap_get_blk (&t1, blknum, false)) {
+    bitmap_set_blk (&t1, blknum, false);
+    nt1--;
+    bitmap_set_blk (&b1, blknum, true);
+    if (++nb1 > N) {
+      bitmap_clear (&b1);
+      nb1 = 0;
+    }
+  }
+  else if (bitmap_get_blk (&t2, blknum, false)) {
+    bitmap_set_blk (&t2, blknum, false);
+    nt2--;
+    bitmap_set_blk (&b2, blknum, true);
+    if (++nb2 > N) {
+      bitmap_clear (&b2);
+      nb2 = 0;
+    }
+  }
+}
+
+const struct eviction_policy arc_policy = {
+  .name = "arc",
+  .init = arc_init,
+  .free = arc_free,
+  .set_size = arc_set_size,
+  .set_recently_accessed = arc_set_recently_accessed,
+  .has_been_recently_accessed = arc_has_been_recently_accessed,
+  .evicted = arc_evicted,
+};
@@ -45,26 +45,101 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 
 #ifdef HAVE_SYS_STATVFS_H
 #include <sys/statvfs.h>
 #endif
 
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
 #include <nbdkit-filter.h>
 
+#include "allocator.h"
 #include "bitmap.h"
+#include "cleanup.h"
 #include "minmax.h"
 #include "rounding.h"
 #include "utils.h"
 
 #include "cache.h"
 #include "blk.h"
-#include "lru.h"
+#include "policy.h"
 #include "reclaim.h"
 
 /* The cache. */
 static int fd = -1;
 
+/* When cache-compress is set, blocks are stored compressed in memory
+ * by the zstd allocator instead of in the file above.
+ */
+static struct allocator *alloc;
+
+/* RAM tier (cache-ram-size=...).  Up to cache-ram-size bytes of the
+ * hottest blocks are additionally kept in a sparse in-memory array in
+ * front of the cache file, so repeat accesses to the hot set are
+ * served at memory speed instead of NVMe speed.
+ *
+ * The tier is inclusive: a RAM-resident block is also in the cache
+ * file, and writes update both copies, so demotion never has to write
+ * anything - it just drops the RAM copy.  Blocks are promoted on a
+ * cache file hit (ie. from their second access onwards); when the
+ * tier is full a clock hand scans the resident blocks and demotes the
+ * first one the eviction policy has not seen accessed recently.
+ */
+static struct allocator *ram;
+static struct bitmap ram_bm;    /* 1 bit per block: resident in RAM */
+static uint64_t nr_ram;         /* number of RAM-resident blocks */
+static uint64_t ram_max_blocks;
+static uint64_t ram_hand;       /* demotion clock hand */
+static uint64_t ram_hits, ram_promotions, ram_demotions;
+
+/* Read hit/miss counters over both tiers, for blk_metrics.  Updated
+ * under meta_lock.
+ */
+static uint64_t cache_hits, cache_misses;
+
+/* Persistent cache (cache-file=...).  The cache contents live in the
+ * named file instead of an unlinked temporary, and the block state
+ * bitmap is saved to a metadata file next to it (<cache-file>.meta)
+ * on clean shutdown so a restarted nbdkit can start with a warm
+ * cache.
+ *
+ * The metadata header and bitmap are stored in host byte order; the
+ * cache is not portable between machines, it is only meant to
+ * survive restarts on the same one.
+ */
+static char *meta_path;         /* <cache-file>.meta, NULL if not persistent */
+static bool loaded_bitmap;      /* bitmap was restored from the metadata */
+static uint64_t loaded_size;    /* device size recorded in the metadata */
+static uint64_t generation;     /* bumped every time the cache is reused */
+
+#define CACHE_META_MAGIC "NBDKITCACHEMETA"
+#define CACHE_META_VERSION 1
+
+struct meta_header {
+  char magic[16];               /* CACHE_META_MAGIC */
+  uint32_t version;             /* CACHE_META_VERSION */
+  uint32_t blksize;             /* block size when saved */
+  uint64_t size;                /* device size when saved */
+  uint64_t generation;          /* bumped on every reuse */
+  uint32_t clean;               /* nonzero = written at clean shutdown */
+  uint32_t unused;              /* padding, must be zero */
+};
+
+#ifdef HAVE_MMAP
+/* Where possible the cache file is also mapped into memory, so that
+ * reading or writing a block is a memcpy against the page cache
+ * instead of a syscall per block.  When the mapping cannot be
+ * established (eg. out of address space on 32 bit) this stays NULL
+ * and we fall back to pread/pwrite on the file descriptor.
+ */
+static uint8_t *map;
+static uint64_t map_size;
+#endif
+
 /* Bitmap.  There are two bits per block which are updated as we read,
  * write back or write through blocks.
  *
@@ -93,64 +168,353 @@ enum bm_entry {
   BLOCK_DIRTY = 3,
 };
 
+/* Number of blocks in the BLOCK_DIRTY state, used to decide when to
+ * start writing blocks back early.  Updated under meta_lock wherever
+ * the bitmap changes state.
+ */
+static uint64_t nr_dirty;
+
+/* The lock protecting block operations is sharded so that concurrent
+ * requests touching different blocks proceed in parallel instead of
+ * serializing the whole filter on one mutex.  A block operation holds
+ * the stripe lock for its block number; operations which touch every
+ * block (resizing, the flush walk) hold all of them.  The reclaim
+ * thread takes the victim block's stripe lock before punching it out
+ * of the cache.
+ *
+ * The bitmap and the eviction policy state pack several blocks into
+ * each word, so mutating them is not safe under different stripe
+ * locks; those short updates additionally take meta_lock (always
+ * acquired after a stripe lock, never before).  The reclaim thread
+ * also takes meta_lock while scanning for eviction candidates.
+ */
+#define NR_LOCK_STRIPES 64
+static pthread_mutex_t stripe_lock[NR_LOCK_STRIPES];
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_mutex_t *
+blk_stripe_lock (uint64_t blknum)
+{
+  return &stripe_lock[blknum % NR_LOCK_STRIPES];
+}
+
+pthread_mutex_t *
+blk_meta_lock (void)
+{
+  return &meta_lock;
+}
+
+void
+blk_lock_all (void)
+{
+  size_t i;
+
+  for (i = 0; i < NR_LOCK_STRIPES; ++i)
+    pthread_mutex_lock (&stripe_lock[i]);
+}
+
+void
+blk_unlock_all (void)
+{
+  size_t i;
+
+  for (i = NR_LOCK_STRIPES; i > 0; --i)
+    pthread_mutex_unlock (&stripe_lock[i-1]);
+}
+
+/* Because blk_set_size is called before the other blk_* functions
+ * this should be set to the true size before we need it.
+ */
+static uint64_t size = 0;
+
+/* Read or write the metadata file completely, coping with short
+ * reads and writes.
+ */
+static int
+full_pread (int fd2, void *buf, size_t count, off_t offset)
+{
+  while (count > 0) {
+    ssize_t r = pread (fd2, buf, count, offset);
+    if (r <= 0)
+      return -1;
+    buf = (char *) buf + r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+static int
+full_pwrite (int fd2, const void *buf, size_t count, off_t offset)
+{
+  while (count > 0) {
+    ssize_t r = pwrite (fd2, buf, count, offset);
+    if (r == -1)
+      return -1;
+    buf = (const char *) buf + r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+/* Try to restore the bitmap from the metadata file.  Any failure
+ * just means we start with a cold cache.
+ */
+static void
+blk_load_meta (void)
+{
+  struct meta_header hdr;
+  int mfd;
+
+  mfd = open (meta_path, O_RDWR | O_CLOEXEC);
+  if (mfd == -1) {
+    nbdkit_debug ("cache: %s: %m (starting cold)", meta_path);
+    return;
+  }
+
+  if (full_pread (mfd, &hdr, sizeof hdr, 0) == -1 ||
+      memcmp (hdr.magic, CACHE_META_MAGIC, sizeof hdr.magic) != 0 ||
+      hdr.version != CACHE_META_VERSION) {
+    nbdkit_debug ("cache: unrecognized metadata file, starting cold");
+    close (mfd);
+    return;
+  }
+
+  if (!hdr.clean) {
+    nbdkit_debug ("cache: cache was not shut down cleanly, starting cold");
+    close (mfd);
+    return;
+  }
+
+  if (hdr.blksize != blksize) {
+    nbdkit_debug ("cache: block size changed (%" PRIu32 " -> %u), "
+                  "starting cold", hdr.blksize, blksize);
+    close (mfd);
+    return;
+  }
+
+  if (bitmap_resize (&bm, hdr.size) == -1) {
+    close (mfd);
+    return;
+  }
+  if (full_pread (mfd, bm.bitmap, bm.size, sizeof hdr) == -1) {
+    nbdkit_debug ("cache: short read of metadata bitmap, starting cold");
+    bitmap_clear (&bm);
+    close (mfd);
+    return;
+  }
+
+  loaded_bitmap = true;
+  loaded_size = hdr.size;
+  generation = hdr.generation + 1;
+  nbdkit_debug ("cache: restored cache state (generation %" PRIu64 ")",
+                generation);
+  close (mfd);
+}
+
+/* Mark any existing metadata as in use just before the cache
+ * contents can first change, so that a crash leaves the metadata
+ * invalid rather than stale: the next run then starts cold instead
+ * of trusting a bitmap which no longer matches the cache contents.
+ */
+static void
+blk_mark_meta_in_use (void)
+{
+  struct meta_header hdr;
+  int mfd;
+
+  mfd = open (meta_path, O_RDWR | O_CLOEXEC);
+  if (mfd == -1)
+    return;
+  if (full_pread (mfd, &hdr, sizeof hdr, 0) == 0 &&
+      memcmp (hdr.magic, CACHE_META_MAGIC, sizeof hdr.magic) == 0 &&
+      hdr.clean) {
+    hdr.clean = 0;
+    hdr.generation = generation;
+    if (full_pwrite (mfd, &hdr, sizeof hdr, 0) == -1 ||
+        fdatasync (mfd) == -1)
+      nbdkit_debug ("cache: failed to update metadata header: %m");
+  }
+  close (mfd);
+}
+
+/* Write the metadata file at clean shutdown.  Failure is not fatal,
+ * the next run simply starts cold.
+ */
+static void
+blk_save_meta (void)
+{
+  struct meta_header hdr = {
+    .version = CACHE_META_VERSION,
+    .blksize = blksize,
+    .size = size,
+    .generation = generation,
+    .clean = 1,
+  };
+  CLEANUP_FREE char *tmp_path = NULL;
+  int mfd;
+
+  /* If the size was never set then no connection was made and the
+   * cache was not touched; any metadata on disk is still valid.
+   */
+  if (size == 0)
+    return;
+
+  memcpy (hdr.magic, CACHE_META_MAGIC, sizeof hdr.magic);
+
+  /* Make sure the cached blocks are on disk before the metadata
+   * claims they are valid.
+   */
+#ifdef HAVE_MMAP
+  if (map && msync (map, map_size, MS_SYNC) == -1) {
+    nbdkit_error ("msync: %s: %m", cache_path);
+    return;
+  }
+#endif
+  if (fsync (fd) == -1) {
+    nbdkit_error ("fsync: %s: %m", cache_path);
+    return;
+  }
+
+  /* Write the new metadata to a temporary file and rename it into
+   * place, so there is never a half-written metadata file.
+   */
+  if (asprintf (&tmp_path, "%s.tmp", meta_path) == -1)
+    return;
+  mfd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (mfd == -1) {
+    nbdkit_error ("open: %s: %m", tmp_path);
+    return;
+  }
+  if (full_pwrite (mfd, &hdr, sizeof hdr, 0) == -1 ||
+      full_pwrite (mfd, bm.bitmap, bm.size, sizeof hdr) == -1 ||
+      fdatasync (mfd) == -1) {
+    nbdkit_error ("write: %s: %m", tmp_path);
+    close (mfd);
+    unlink (tmp_path);
+    return;
+  }
+  close (mfd);
+  if (rename (tmp_path, meta_path) == -1) {
+    nbdkit_error ("rename: %s: %m", meta_path);
+    unlink (tmp_path);
+    return;
+  }
+
+  nbdkit_debug ("cache: saved cache state (generation %" PRIu64 ")",
+                generation);
+}
+
 int
 blk_init (void)
 {
-  const char *tmpdir;
-  size_t len;
-  char *template;
   struct statvfs statvfs;
 
-  tmpdir = getenv ("TMPDIR");
-  if (!tmpdir)
-    tmpdir = LARGE_TMPDIR;
+  if (cache_compress) {
+    /* Store the cache compressed in memory instead of in a file.
+     * cache-max-size and cache-file have been rejected in
+     * cache_config_complete, so neither the reclaim thread nor the
+     * metadata code can touch the (absent) file.
+     */
+    alloc = create_allocator ("zstd", false);
+    if (alloc == NULL)
+      return -1;
+    blksize = 4096;
+    nbdkit_debug ("cache: compressed cache, block size: %u", blksize);
+  }
+  else if (cache_path) {
+    /* Persistent cache in a named file. */
+    nbdkit_debug ("cache: persistent cache file: %s", cache_path);
+
+    fd = open (cache_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+      nbdkit_error ("open: %s: %m", cache_path);
+      return -1;
+    }
+    if (asprintf (&meta_path, "%s.meta", cache_path) == -1) {
+      nbdkit_error ("asprintf: %m");
+      return -1;
+    }
+  }
+  else {
+    const char *tmpdir;
+    size_t len;
+    char *template;
+
+    tmpdir = getenv ("TMPDIR");
+    if (!tmpdir)
+      tmpdir = LARGE_TMPDIR;
 
-  nbdkit_debug ("cache: temporary directory for cache: %s", tmpdir);
+    nbdkit_debug ("cache: temporary directory for cache: %s", tmpdir);
 
-  len = strlen (tmpdir) + 8;
-  template = alloca (len);
-  snprintf (template, len, "%s/XXXXXX", tmpdir);
+    len = strlen (tmpdir) + 8;
+    template = alloca (len);
+    snprintf (template, len, "%s/XXXXXX", tmpdir);
 
 #ifdef HAVE_MKOSTEMP
-  fd = mkostemp (template, O_CLOEXEC);
+    fd = mkostemp (template, O_CLOEXEC);
 #else
-  /* Not atomic, but this is only invoked during .load, so the race
-   * won't affect any plugin actions trying to fork
-   */
-  fd = mkstemp (template);
-  if (fd >= 0) {
-    fd = set_cloexec (fd);
-    if (fd < 0) {
-      int e = errno;
-      unlink (template);
-      errno = e;
+    /* Not atomic, but this is only invoked during startup, so the
+     * race won't affect any plugin actions trying to fork
+     */
+    fd = mkstemp (template);
+    if (fd >= 0) {
+      fd = set_cloexec (fd);
+      if (fd < 0) {
+        int e = errno;
+        unlink (template);
+        errno = e;
+      }
     }
-  }
 #endif
-  if (fd == -1) {
-    nbdkit_error ("mkostemp: %s: %m", tmpdir);
-    return -1;
-  }
+    if (fd == -1) {
+      nbdkit_error ("mkostemp: %s: %m", tmpdir);
+      return -1;
+    }
 
-  unlink (template);
+    unlink (template);
+  }
 
-  /* Choose the block size.
-   *
-   * A 4K block size means that we need 64 MB of memory to store the
-   * bitmaps for a 1 TB underlying image.  However to support
-   * hole-punching (for reclaiming) we need the block size to be at
-   * least as large as the filesystem block size.
-   */
-  if (fstatvfs (fd, &statvfs) == -1) {
-    nbdkit_error ("fstatvfs: %s: %m", tmpdir);
-    return -1;
+  if (!cache_compress) {
+    /* Choose the block size.
+     *
+     * A 4K block size means that we need 64 MB of memory to store the
+     * bitmaps for a 1 TB underlying image.  However to support
+     * hole-punching (for reclaiming) we need the block size to be at
+     * least as large as the filesystem block size.
+     */
+    if (fstatvfs (fd, &statvfs) == -1) {
+      nbdkit_error ("fstatvfs: %m");
+      return -1;
+    }
+    blksize = MAX (4096, statvfs.f_bsize);
+    nbdkit_debug ("cache: block size: %u", blksize);
   }
-  blksize = MAX (4096, statvfs.f_bsize);
-  nbdkit_debug ("cache: block size: %u", blksize);
 
   bitmap_init (&bm, blksize, 2 /* bits per block */);
 
-  lru_init ();
+  policy->init ();
+
+  {
+    size_t i;
+
+    for (i = 0; i < NR_LOCK_STRIPES; ++i)
+      pthread_mutex_init (&stripe_lock[i], NULL);
+  }
+
+  if (ram_max_size > 0) {
+    ram = create_allocator ("sparse", false);
+    if (ram == NULL)
+      return -1;
+    bitmap_init (&ram_bm, blksize, 1 /* bits per block */);
+  }
+
+  if (meta_path)
+    blk_load_meta ();
+
+  if (reclaim_init (fd, &bm) == -1)
+    return -1;
 
   return 0;
 }
@@ -158,34 +522,402 @@ blk_init (void)
 void
 blk_free (void)
 {
+  /* Stop the reclaim thread before tearing anything down. */
+  reclaim_free ();
+
+  if (meta_path && fd >= 0)
+    blk_save_meta ();
+
+#ifdef HAVE_MMAP
+  if (map)
+    munmap (map, map_size);
+#endif
+
   if (fd >= 0)
     close (fd);
 
+  if (alloc)
+    alloc->f->free (alloc);
+
+  if (ram) {
+    nbdkit_debug ("cache: RAM tier: %" PRIu64 " hits, %" PRIu64
+                  " promotions, %" PRIu64 " demotions",
+                  ram_hits, ram_promotions, ram_demotions);
+    ram->f->free (ram);
+    bitmap_free (&ram_bm);
+  }
+
+  free (meta_path);
+
   bitmap_free (&bm);
 
-  lru_free ();
+  policy->free ();
 }
 
-/* Because blk_set_size is called before the other blk_* functions
- * this should be set to the true size before we need it.
- */
-static uint64_t size = 0;
-
 int
 blk_set_size (uint64_t new_size)
 {
   size = new_size;
 
-  if (bitmap_resize (&bm, size) == -1)
-    return -1;
+  if (meta_path) {
+    static bool meta_marked = false;
+
+    if (!meta_marked) {
+      blk_mark_meta_in_use ();
+      meta_marked = true;
+    }
+  }
+
+  /* The reclaim thread scans the bitmap and the policy state under
+   * the meta lock only, so resizing them must hold it too.
+   */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+
+    if (bitmap_resize (&bm, size) == -1)
+      return -1;
+
+    /* If the device size does not match the size recorded in restored
+     * metadata then the underlying image has probably changed and the
+     * cached content cannot be trusted.
+     */
+    if (loaded_bitmap && size != loaded_size) {
+      nbdkit_debug ("cache: device size changed (%" PRIu64 " -> %" PRIu64 "), "
+                    "discarding restored cache", loaded_size, size);
+      bitmap_clear (&bm);
+      loaded_bitmap = false;
+    }
+
+    /* Resizing the bitmap can drop blocks, so recount the dirty
+     * ones.  bitmap_next skips runs of not-cached blocks a word at a
+     * time.
+     */
+    nr_dirty = 0;
+    for (int64_t b = bitmap_next (&bm, 0); b >= 0;
+         b = bitmap_next (&bm, b+1)) {
+      if (bitmap_get_blk (&bm, b, BLOCK_NOT_CACHED) == BLOCK_DIRTY)
+        nr_dirty++;
+    }
+
+    if (ram) {
+      if (bitmap_resize (&ram_bm, size) == -1)
+        return -1;
+      ram_max_blocks = ram_max_size / blksize;
+      nr_ram = bitmap_popcount_range (&ram_bm, 0, UINT64_MAX);
+    }
+
+    if (policy->set_size (size) == -1)
+      return -1;
+  }
+
+  if (alloc)
+    return alloc->f->set_size_hint (alloc, ROUND_UP (size, blksize));
 
   if (ftruncate (fd, ROUND_UP (size, blksize)) == -1) {
     nbdkit_error ("ftruncate: %m");
     return -1;
   }
 
-  if (lru_set_size (size) == -1)
+#ifdef HAVE_MMAP
+  /* (Re-)map the cache file.  Failure is not fatal, we simply keep
+   * using pread/pwrite on the file descriptor.
+   */
+  if (map) {
+    munmap (map, map_size);
+    map = NULL;
+  }
+  {
+    uint64_t new_map_size = ROUND_UP (size, blksize);
+    void *p;
+
+    p = mmap (NULL, new_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+      nbdkit_debug ("cache: mmap: %m (falling back to file I/O)");
+    else {
+      map = p;
+      map_size = new_map_size;
+    }
+  }
+#endif
+
+  return 0;
+}
+
+/* Read or write one whole block of the cache file. */
+static int
+cache_file_read (uint64_t blknum, uint8_t *block, int *err)
+{
+  off_t offset = blknum * blksize;
+
+  if (alloc) {
+    if (alloc->f->read (alloc, block, blksize, offset) == -1) {
+      *err = errno;
+      return -1;
+    }
+    return 0;
+  }
+
+#ifdef HAVE_MMAP
+  if (map) {
+    memcpy (block, map + offset, blksize);
+    return 0;
+  }
+#endif
+
+  if (pread (fd, block, blksize, offset) == -1) {
+    *err = errno;
+    nbdkit_error ("pread: %m");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+cache_file_write (uint64_t blknum, const uint8_t *block, int *err)
+{
+  off_t offset = blknum * blksize;
+
+  if (alloc) {
+    if (alloc->f->write (alloc, block, blksize, offset) == -1) {
+      *err = errno;
+      return -1;
+    }
+    return 0;
+  }
+
+#ifdef HAVE_MMAP
+  if (map) {
+    memcpy (map + offset, block, blksize);
+    return 0;
+  }
+#endif
+
+  if (pwrite (fd, block, blksize, offset) == -1) {
+    *err = errno;
+    nbdkit_error ("pwrite: %m");
+    return -1;
+  }
+  return 0;
+}
+
+/* RAM tier operations.  All of these are called with the stripe lock
+ * for the block held (blk_demote_one additionally trylocks the
+ * victim's stripe).
+ */
+
+static bool
+blk_in_ram (uint64_t blknum)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+  return bitmap_get_blk (&ram_bm, blknum, false);
+}
+
+/* Drop one block from the RAM tier to make room.  The clock hand
+ * scans the resident blocks and picks the first one the eviction
+ * policy has not seen accessed recently, falling back to the first
+ * resident block found.  Returns false if nothing could be demoted.
+ */
+static bool
+blk_demote_one (void)
+{
+  uint64_t total = (size + blksize - 1) / blksize;
+  uint64_t victim = 0, fallback = 0, scanned;
+  bool found = false, fallback_found = false;
+  pthread_mutex_t *lock;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    for (scanned = 0; scanned < total; ++scanned) {
+      ram_hand = (ram_hand + 1) % total;
+      if (!bitmap_get_blk (&ram_bm, ram_hand, false))
+        continue;
+      if (!fallback_found) {
+        fallback = ram_hand;
+        fallback_found = true;
+      }
+      if (!policy->has_been_recently_accessed (ram_hand)) {
+        victim = ram_hand;
+        found = true;
+        break;
+      }
+    }
+    if (!found && fallback_found) {
+      victim = fallback;
+      found = true;
+    }
+  }
+  if (!found)
+    return false;
+
+  /* Take the victim's stripe lock so that no concurrent reader can be
+   * part way through reading the RAM copy while it is zeroed.
+   * trylock because the caller already holds its own stripe lock; a
+   * contended victim is being accessed right now, so it was a poor
+   * choice anyway.
+   */
+  lock = blk_stripe_lock (victim);
+  if (pthread_mutex_trylock (lock) != 0)
+    return false;
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    if (bitmap_get_blk (&ram_bm, victim, false)) {
+      bitmap_set_blk (&ram_bm, victim, false);
+      nr_ram--;
+      ram_demotions++;
+    }
+    else
+      found = false;            /* demoted by someone else meanwhile */
+  }
+  if (found)
+    ram->f->zero (ram, blksize, victim * blksize);
+  pthread_mutex_unlock (lock);
+  return found;
+}
+
+/* Promote a block (whose content has just been read from the cache
+ * file) into the RAM tier.  Failure just means the block stays on the
+ * slower tier.
+ */
+static void
+blk_promote (uint64_t blknum, const uint8_t *block)
+{
+  if (ram == NULL || ram_max_blocks == 0)
+    return;
+
+  if (blk_in_ram (blknum))
+    return;
+
+  for (;;) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+      if (nr_ram < ram_max_blocks)
+        break;
+    }
+    if (!blk_demote_one ())
+      return;
+  }
+
+  if (ram->f->write (ram, block, blksize, blknum * blksize) == -1)
+    return;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+  bitmap_set_blk (&ram_bm, blknum, true);
+  nr_ram++;
+  ram_promotions++;
+}
+
+/* Keep a resident RAM copy coherent after the block was written. */
+static void
+blk_ram_update (uint64_t blknum, const uint8_t *block)
+{
+  if (ram == NULL || !blk_in_ram (blknum))
+    return;
+
+  if (ram->f->write (ram, block, blksize, blknum * blksize) == -1) {
+    /* Cannot keep the copy coherent, so drop it. */
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+      bitmap_set_blk (&ram_bm, blknum, false);
+      nr_ram--;
+    }
+    ram->f->zero (ram, blksize, blknum * blksize);
+  }
+}
+
+/* Handle a cache miss when cache-prefetch is set: read the missed
+ * block plus up to cache-prefetch bytes of following uncached blocks
+ * from the plugin in a single pread and store them all in the cache.
+ * A sequential reader then pays one large plugin request per run of
+ * misses instead of one round trip per block.
+ *
+ * The caller holds the stripe lock for blknum only.  The following
+ * blocks are populated under their own stripe locks, taken with
+ * trylock so that this cannot deadlock against another request or
+ * another prefetch run; a block whose lock is contended is simply not
+ * prefetched.
+ */
+static int
+blk_read_prefetch (struct nbdkit_next_ops *next_ops, void *nxdata,
+                   uint64_t blknum, uint8_t *block, int *err)
+{
+  off_t offset = blknum * blksize;
+  uint64_t max_blocks = 1 + prefetch / blksize;
+  uint64_t nr = 1, i, n;
+  unsigned tail = 0;
+  CLEANUP_FREE uint8_t *buf = NULL;
+  uint8_t *p = block;
+
+  /* Extend the run over following uncached blocks. */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    while (nr < max_blocks &&
+           offset + nr * blksize < size &&
+           bitmap_get_blk (&bm, blknum + nr,
+                           BLOCK_NOT_CACHED) == BLOCK_NOT_CACHED)
+      nr++;
+  }
+
+  if (nr > 1) {
+    buf = malloc (nr * blksize);
+    if (buf == NULL)
+      nr = 1;                   /* prefetch is only an optimization */
+    else
+      p = buf;
+  }
+
+  n = nr * blksize;
+  if (offset + n > size) {
+    tail = offset + n - size;
+    n -= tail;
+  }
+
+  if (next_ops->pread (nxdata, p, n, offset, 0, err) == -1)
+    return -1;
+  memset (p + n, 0, tail);
+
+  if (nr > 1) {
+    nbdkit_debug ("cache: prefetch %" PRIu64 " blocks at offset %" PRIu64,
+                  nr, (uint64_t) offset);
+    memcpy (block, p, blksize);
+  }
+
+  /* Store the requested block.  We hold its stripe lock. */
+  if (cache_file_write (blknum, block, err) == -1)
     return -1;
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
+    policy->set_recently_accessed (blknum);
+  }
+
+  /* Store the prefetched blocks.  Failure here is not an error: the
+   * client has its data, the block is simply not cached.
+   */
+  for (i = 1; i < nr; ++i) {
+    uint64_t b = blknum + i;
+    pthread_mutex_t *lock = blk_stripe_lock (b);
+    bool held = lock == blk_stripe_lock (blknum);
+    bool uncached;
+    int e;
+
+    if (!held && pthread_mutex_trylock (lock) != 0)
+      continue;
+
+    /* Re-check the state: the block may have been written, or cached
+     * by another prefetch, since we sampled the bitmap above.
+     */
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+      uncached = bitmap_get_blk (&bm, b, BLOCK_NOT_CACHED)
+        == BLOCK_NOT_CACHED;
+    }
+    if (uncached && cache_file_write (b, p + i * blksize, &e) == 0) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+      bitmap_set_blk (&bm, b, BLOCK_CLEAN);
+      policy->set_recently_accessed (b);
+    }
+    if (!held)
+      pthread_mutex_unlock (lock);
+  }
 
   return 0;
 }
@@ -195,10 +927,19 @@ blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
           uint64_t blknum, uint8_t *block, int *err)
 {
   off_t offset = blknum * blksize;
-  enum bm_entry state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+  enum bm_entry state;
 
+  /* Reclaim before looking at the block state: reclaim can evict any
+   * clean block, including this one, and we must not serve a block
+   * which has just been punched out of the cache.
+   */
   reclaim (fd, &bm);
 
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+  }
+
   nbdkit_debug ("cache: blk_read block %" PRIu64 " (offset %" PRIu64 ") is %s",
                 blknum, (uint64_t) offset,
                 state == BLOCK_NOT_CACHED ? "not cached" :
@@ -206,9 +947,30 @@ blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
                 state == BLOCK_DIRTY ? "dirty" :
                 "unknown");
 
+  /* RAM tier hit?  Resident copies are kept coherent with the cache
+   * file on writes, so a dirty block can be served from RAM too.
+   */
+  if (ram && state != BLOCK_NOT_CACHED && blk_in_ram (blknum)) {
+    if (ram->f->read (ram, block, blksize, offset) == 0) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+      ram_hits++;
+      cache_hits++;
+      policy->set_recently_accessed (blknum);
+      return 0;
+    }
+  }
+
   if (state == BLOCK_NOT_CACHED) { /* Read underlying plugin. */
     unsigned n = blksize, tail = 0;
 
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+      cache_misses++;
+    }
+
+    if (prefetch > 0)
+      return blk_read_prefetch (next_ops, nxdata, blknum, block, err);
+
     if (offset + n > size) {
       tail = offset + n - size;
       n -= tail;
@@ -229,23 +991,24 @@ blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
                     " (offset %" PRIu64 ")",
                     blknum, (uint64_t) offset);
 
-      if (pwrite (fd, block, blksize, offset) == -1) {
-        *err = errno;
-        nbdkit_error ("pwrite: %m");
+      if (cache_file_write (blknum, block, err) == -1)
         return -1;
-      }
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
       bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
-      lru_set_recently_accessed (blknum);
+      policy->set_recently_accessed (blknum);
     }
     return 0;
   }
   else {                        /* Read cache. */
-    if (pread (fd, block, blksize, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pread: %m");
+    if (cache_file_read (blknum, block, err) == -1)
       return -1;
-    }
-    lru_set_recently_accessed (blknum);
+    /* A cache file hit means at least a second access, so the block
+     * has earned a place on the RAM tier.
+     */
+    blk_promote (blknum, block);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    cache_hits++;
+    policy->set_recently_accessed (blknum);
     return 0;
   }
 }
@@ -255,10 +1018,16 @@ blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
            uint64_t blknum, uint8_t *block, int *err)
 {
   off_t offset = blknum * blksize;
-  enum bm_entry state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+  enum bm_entry state;
 
+  /* As in blk_read, reclaim before looking at the block state. */
   reclaim (fd, &bm);
 
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+  }
+
   nbdkit_debug ("cache: blk_cache block %" PRIu64 " (offset %" PRIu64 ") is %s",
                 blknum, (uint64_t) offset,
                 state == BLOCK_NOT_CACHED ? "not cached" :
@@ -287,13 +1056,11 @@ blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
     nbdkit_debug ("cache: cache block %" PRIu64 " (offset %" PRIu64 ")",
                   blknum, (uint64_t) offset);
 
-    if (pwrite (fd, block, blksize, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pwrite: %m");
+    if (cache_file_write (blknum, block, err) == -1)
       return -1;
-    }
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
     bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
-    lru_set_recently_accessed (blknum);
+    policy->set_recently_accessed (blknum);
   }
   else {
 #if HAVE_POSIX_FADVISE
@@ -304,11 +1071,39 @@ blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
       return -1;
     }
 #endif
-    lru_set_recently_accessed (blknum);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    policy->set_recently_accessed (blknum);
   }
   return 0;
 }
 
+int
+blk_populate (uint64_t blknum, const uint8_t *block, int *err)
+{
+  enum bm_entry state;
+
+  /* As in blk_read, reclaim before looking at the block state. */
+  reclaim (fd, &bm);
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+  }
+
+  /* If the block is already cached, leave it alone: the cached copy
+   * may be newer than the caller's data.
+   */
+  if (state != BLOCK_NOT_CACHED)
+    return 0;
+
+  if (cache_file_write (blknum, block, err) == -1)
+    return -1;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+  bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
+  policy->set_recently_accessed (blknum);
+  return 0;
+}
+
 int
 blk_writethrough (struct nbdkit_next_ops *next_ops, void *nxdata,
                   uint64_t blknum, const uint8_t *block, uint32_t flags,
@@ -327,17 +1122,20 @@ blk_writethrough (struct nbdkit_next_ops *next_ops, void *nxdata,
   nbdkit_debug ("cache: writethrough block %" PRIu64 " (offset %" PRIu64 ")",
                 blknum, (uint64_t) offset);
 
-  if (pwrite (fd, block, blksize, offset) == -1) {
-    *err = errno;
-    nbdkit_error ("pwrite: %m");
+  if (cache_file_write (blknum, block, err) == -1)
     return -1;
-  }
+  blk_ram_update (blknum, block);
 
   if (next_ops->pwrite (nxdata, block, n, offset, flags, err) == -1)
     return -1;
 
-  bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
-  lru_set_recently_accessed (blknum);
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    if (bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED) == BLOCK_DIRTY)
+      nr_dirty--;
+    bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
+    policy->set_recently_accessed (blknum);
+  }
 
   return 0;
 }
@@ -360,13 +1158,155 @@ blk_write (struct nbdkit_next_ops *next_ops, void *nxdata,
   nbdkit_debug ("cache: writeback block %" PRIu64 " (offset %" PRIu64 ")",
                 blknum, (uint64_t) offset);
 
-  if (pwrite (fd, block, blksize, offset) == -1) {
+  if (cache_file_write (blknum, block, err) == -1)
+    return -1;
+  blk_ram_update (blknum, block);
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    if (bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED) != BLOCK_DIRTY)
+      nr_dirty++;
+    bitmap_set_blk (&bm, blknum, BLOCK_DIRTY);
+    policy->set_recently_accessed (blknum);
+  }
+
+  return 0;
+}
+
+/* Called by the reclaim code after punching a block out of the cache
+ * file, to update the block state and the eviction policy.
+ */
+void
+blk_evicted (uint64_t blknum)
+{
+  bool resident = false;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    if (bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED) == BLOCK_DIRTY)
+      nr_dirty--;
+    bitmap_set_blk (&bm, blknum, BLOCK_NOT_CACHED);
+    policy->evicted (blknum);
+
+    /* The RAM tier is inclusive, so the RAM copy goes too. */
+    if (ram && bitmap_get_blk (&ram_bm, blknum, false)) {
+      bitmap_set_blk (&ram_bm, blknum, false);
+      nr_ram--;
+      resident = true;
+    }
+  }
+  if (resident)
+    ram->f->zero (ram, blksize, blknum * blksize);
+}
+
+uint64_t
+blk_nr_dirty (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+  return nr_dirty;
+}
+
+char *
+blk_metrics (void)
+{
+  uint64_t hits, misses, dirty, rhits, rpromotions, rdemotions;
+  bool have_ram;
+  char *s1, *s = NULL;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    hits = cache_hits;
+    misses = cache_misses;
+    dirty = nr_dirty;
+    have_ram = ram != NULL;
+    rhits = ram_hits;
+    rpromotions = ram_promotions;
+    rdemotions = ram_demotions;
+  }
+
+  if (asprintf (&s1,
+                "# HELP nbdkit_cache_hits_total "
+                "Reads served from the cache.\n"
+                "# TYPE nbdkit_cache_hits_total counter\n"
+                "nbdkit_cache_hits_total %" PRIu64 "\n"
+                "# HELP nbdkit_cache_misses_total "
+                "Reads which went to the underlying plugin.\n"
+                "# TYPE nbdkit_cache_misses_total counter\n"
+                "nbdkit_cache_misses_total %" PRIu64 "\n"
+                "# HELP nbdkit_cache_dirty_blocks "
+                "Blocks awaiting writeback.\n"
+                "# TYPE nbdkit_cache_dirty_blocks gauge\n"
+                "nbdkit_cache_dirty_blocks %" PRIu64 "\n",
+                hits, misses, dirty) == -1)
+    return NULL;
+  if (!have_ram)
+    return s1;
+
+  if (asprintf (&s,
+                "%s"
+                "# HELP nbdkit_cache_ram_hits_total "
+                "Reads served from the RAM tier.\n"
+                "# TYPE nbdkit_cache_ram_hits_total counter\n"
+                "nbdkit_cache_ram_hits_total %" PRIu64 "\n"
+                "# HELP nbdkit_cache_ram_promotions_total "
+                "Blocks promoted to the RAM tier.\n"
+                "# TYPE nbdkit_cache_ram_promotions_total counter\n"
+                "nbdkit_cache_ram_promotions_total %" PRIu64 "\n"
+                "# HELP nbdkit_cache_ram_demotions_total "
+                "Blocks demoted from the RAM tier.\n"
+                "# TYPE nbdkit_cache_ram_demotions_total counter\n"
+                "nbdkit_cache_ram_demotions_total %" PRIu64 "\n",
+                s1, rhits, rpromotions, rdemotions) == -1)
+    s = NULL;
+  free (s1);
+  return s;
+}
+
+int
+blk_writeback_batch (struct nbdkit_next_ops *next_ops, void *nxdata,
+                     uint64_t first, size_t nr_blocks, uint8_t *buf,
+                     int *err)
+{
+  off_t offset = first * blksize;
+  uint64_t n = (uint64_t) nr_blocks * blksize;
+  size_t i;
+
+  /* The last block may run over the end of the underlying file. */
+  if (offset + n > size)
+    n = size - offset;
+
+  nbdkit_debug ("cache: writeback %zu blocks at offset %" PRIu64,
+                nr_blocks, (uint64_t) offset);
+
+  if (alloc) {
+    if (alloc->f->read (alloc, buf, n, offset) == -1) {
+      *err = errno;
+      return -1;
+    }
+  }
+  else
+#ifdef HAVE_MMAP
+  if (map)
+    memcpy (buf, map + offset, n);
+  else
+#endif
+  if (pread (fd, buf, n, offset) == -1) {
     *err = errno;
-    nbdkit_error ("pwrite: %m");
+    nbdkit_error ("pread: %m");
     return -1;
   }
-  bitmap_set_blk (&bm, blknum, BLOCK_DIRTY);
-  lru_set_recently_accessed (blknum);
+
+  if (next_ops->pwrite (nxdata, buf, n, offset, 0, err) == -1)
+    return -1;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    for (i = 0; i < nr_blocks; ++i) {
+      if (bitmap_get_blk (&bm, first + i, BLOCK_NOT_CACHED) == BLOCK_DIRTY) {
+        bitmap_set_blk (&bm, first + i, BLOCK_CLEAN);
+        nr_dirty--;
+      }
+    }
+  }
 
   return 0;
 }
@@ -374,12 +1314,14 @@ blk_write (struct nbdkit_next_ops *next_ops, void *nxdata,
 int
 for_each_dirty_block (block_callback f, void *vp)
 {
-  uint64_t blknum;
-  enum bm_entry state;
+  int64_t blknum;
 
-  bitmap_for (&bm, blknum) {
-    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
-    if (state == BLOCK_DIRTY) {
+  /* bitmap_next skips runs of not-cached blocks a word at a time,
+   * which matters on huge, mostly-uncached maps.
+   */
+  for (blknum = bitmap_next (&bm, 0); blknum >= 0;
+       blknum = bitmap_next (&bm, blknum+1)) {
+    if (bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED) == BLOCK_DIRTY) {
       if (f (blknum, vp) == -1)
         return -1;
     }
@@ -33,17 +33,37 @@
 #ifndef NBDKIT_BLK_H
 #define NBDKIT_BLK_H
 
+#include <pthread.h>
+
 /* Initialize the cache and bitmap. */
 extern int blk_init (void);
 
 /* Close the cache, free the bitmap. */
 extern void blk_free (void);
 
+/* The lock which must be held when operating on a single block.  The
+ * locks are sharded by block number so operations on different blocks
+ * can proceed in parallel.
+ */
+extern pthread_mutex_t *blk_stripe_lock (uint64_t blknum);
+
+/* The lock protecting the block state bitmap and the eviction policy
+ * state.  Acquired after a stripe lock, never before.  Used by the
+ * reclaim thread to scan for eviction candidates.
+ */
+extern pthread_mutex_t *blk_meta_lock (void);
+
+/* Acquire/release every stripe lock, for operations which touch all
+ * blocks (resizing, the flush walk).
+ */
+extern void blk_lock_all (void);
+extern void blk_unlock_all (void);
+
 /*----------------------------------------------------------------------
  * ** NOTE **
  *
- * An exclusive lock must be held when you call any function below
- * this line.
+ * The stripe lock for the block (or all stripe locks) must be held
+ * when you call any function below this line.
  */
 
 /* Allocate or resize the cache file and bitmap. */
@@ -60,6 +80,12 @@ extern int blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
                       uint64_t blknum, uint8_t *block, int *err)
   __attribute__((__nonnull__ (1, 4, 5)));
 
+/* Insert a block whose content the caller has already read from the
+ * plugin (used by preloading).  Already-cached blocks are left alone.
+ */
+extern int blk_populate (uint64_t blknum, const uint8_t *block, int *err)
+  __attribute__((__nonnull__ (2, 3)));
+
 /* Write to the cache and the plugin. */
 extern int blk_writethrough (struct nbdkit_next_ops *next_ops, void *nxdata,
                              uint64_t blknum, const uint8_t *block,
@@ -84,4 +110,29 @@ typedef int (*block_callback) (uint64_t blknum, void *vp);
 extern int for_each_dirty_block (block_callback f, void *vp)
   __attribute__((__nonnull__ (1)));
 
+/* Number of dirty blocks in the cache.  May be called without any
+ * stripe lock held.
+ */
+extern uint64_t blk_nr_dirty (void);
+
+/* Hit/miss counters etc in Prometheus text format (the .metrics
+ * callback).  Returns a malloc'd string, or NULL on error.
+ */
+extern char *blk_metrics (void);
+
+/* Called by the reclaim code after punching a block out of the cache
+ * file.
+ */
+extern void blk_evicted (uint64_t blknum);
+
+/* Write a run of contiguous dirty blocks through to the underlying
+ * plugin as a single large write and mark them clean.  buf must have
+ * room for nr_blocks whole blocks.
+ */
+extern int blk_writeback_batch (struct nbdkit_next_ops *next_ops,
+                                void *nxdata,
+                                uint64_t first, size_t nr_blocks,
+                                uint8_t *buf, int *err)
+  __attribute__((__nonnull__ (1, 5, 6)));
+
 #endif /* NBDKIT_BLK_H */
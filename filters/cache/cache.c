@@ -60,35 +60,35 @@
 
 #include "cache.h"
 #include "blk.h"
+#include "policy.h"
+#include "preload.h"
 #include "reclaim.h"
 #include "isaligned.h"
 #include "minmax.h"
 #include "rounding.h"
 
-/* In order to handle parallel requests safely, this lock must be held
- * when calling any blk_* functions.
- */
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-
 unsigned blksize;
 enum cache_mode cache_mode = CACHE_MODE_WRITEBACK;
 int64_t max_size = -1;
 unsigned hi_thresh = 95, lo_thresh = 80;
 bool cache_on_read = false;
+int64_t dirty_limit = 16 * 1024 * 1024;
+int64_t prefetch = 0;
+bool cache_compress = false;
+char *cache_path = NULL;
+int64_t ram_max_size = 0;
+char *cache_preload = NULL;
+unsigned preload_threads = 1;
 
 static int cache_flush (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle, uint32_t flags, int *err);
-
-static void
-cache_load (void)
-{
-  if (blk_init () == -1)
-    exit (EXIT_FAILURE);
-}
+static void writeback_trickle (struct nbdkit_next_ops *next_ops, void *nxdata);
 
 static void
 cache_unload (void)
 {
   blk_free ();
+  free (cache_path);
+  free (cache_preload);
 }
 
 static int
@@ -168,6 +168,72 @@ cache_config (nbdkit_next_config *next, void *nxdata,
     cache_on_read = r;
     return 0;
   }
+  else if (strcmp (key, "cache-dirty-limit") == 0) {
+    int64_t r;
+
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    dirty_limit = r;
+    return 0;
+  }
+  else if (strcmp (key, "cache-prefetch") == 0) {
+    int64_t r;
+
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    prefetch = r;
+    return 0;
+  }
+  else if (strcmp (key, "cache-file") == 0) {
+    free (cache_path);
+    cache_path = nbdkit_absolute_path (value);
+    if (cache_path == NULL)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "cache-eviction") == 0) {
+    return policy_select (value);
+  }
+  else if (strcmp (key, "cache-ram-size") == 0) {
+    int64_t r;
+
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    ram_max_size = r;
+    return 0;
+  }
+  else if (strcmp (key, "cache-preload") == 0) {
+    free (cache_preload);
+    if (strcmp (value, "extents") == 0)
+      cache_preload = strdup (value);
+    else
+      cache_preload = nbdkit_absolute_path (value);
+    if (cache_preload == NULL)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "cache-preload-threads") == 0) {
+    if (nbdkit_parse_unsigned ("cache-preload-threads",
+                               value, &preload_threads) == -1)
+      return -1;
+    if (preload_threads == 0) {
+      nbdkit_error ("cache-preload-threads must be greater than zero");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "cache-compress") == 0) {
+    int r;
+
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    cache_compress = r;
+    return 0;
+  }
   else {
     return next (nxdata, key, value);
   }
@@ -176,7 +242,26 @@ cache_config (nbdkit_next_config *next, void *nxdata,
 #define cache_config_help_common \
   "cache=MODE                Set cache MODE, one of writeback (default),\n" \
   "                          writethrough, or unsafe.\n" \
-  "cache-on-read=BOOL        Set to true to cache on reads (default false).\n"
+  "cache-on-read=BOOL        Set to true to cache on reads (default false).\n" \
+  "cache-dirty-limit=SIZE    Start writing dirty blocks back early once\n" \
+  "                          SIZE bytes are dirty (default 16M, 0 = only\n" \
+  "                          write back on flush).\n" \
+  "cache-prefetch=SIZE       On a cache miss also fetch up to SIZE bytes\n" \
+  "                          of following uncached data (default 0).\n" \
+  "cache-file=PATH           Keep the cache in a named file which is\n" \
+  "                          reused over nbdkit restarts.\n" \
+  "cache-eviction=POLICY     Eviction policy: lru (default), clock or arc.\n" \
+  "cache-compress=BOOL       Store cache blocks compressed in memory\n" \
+  "                          (default false).\n" \
+  "cache-ram-size=SIZE       Keep up to SIZE bytes of the hottest blocks\n" \
+  "                          in a RAM tier in front of the cache file\n" \
+  "                          (default 0 = disabled).\n" \
+  "cache-preload=RANGES      Preload the cache when the first connection\n" \
+  "                          is made: either \"extents\" (everything the\n" \
+  "                          plugin reports as allocated) or a file of\n" \
+  "                          \"offset length\" ranges.\n" \
+  "cache-preload-threads=N   Number of parallel preload threads\n" \
+  "                          (default 1).\n"
 #ifndef HAVE_CACHE_RECLAIM
 #define cache_config_help cache_config_help_common
 #else
@@ -198,6 +283,29 @@ cache_config_complete (nbdkit_next_config_complete *next, void *nxdata)
     }
   }
 
+  /* The compressed cache lives in memory, so there is no file to
+   * hole-punch or to keep across restarts.
+   */
+  if (cache_compress && (max_size != -1 || cache_path != NULL)) {
+    nbdkit_error ("cache-compress cannot be used with "
+                  "cache-max-size or cache-file");
+    return -1;
+  }
+
+  /* The compressed cache is already entirely in memory, so a RAM tier
+   * in front of it makes no sense.
+   */
+  if (cache_compress && ram_max_size > 0) {
+    nbdkit_error ("cache-ram-size cannot be used with cache-compress");
+    return -1;
+  }
+
+  /* Initialize the cache.  This happens here rather than in .load
+   * because we need to know the cache-file parameter, if any.
+   */
+  if (blk_init () == -1)
+    return -1;
+
   return next (nxdata);
 }
 
@@ -215,8 +323,9 @@ cache_get_size (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   nbdkit_debug ("cache: underlying file size: %" PRIi64, size);
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  blk_lock_all ();
   r = blk_set_size (size);
+  blk_unlock_all ();
   if (r == -1)
     return -1;
 
@@ -236,6 +345,8 @@ cache_prepare (struct nbdkit_next_ops *next_ops, void *nxdata,
   r = cache_get_size (next_ops, nxdata, handle);
   if (r < 0)
     return -1;
+  if (preload (next_ops, nxdata) == -1)
+    return -1;
   return 0;
 }
 
@@ -332,7 +443,7 @@ cache_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
     uint64_t n = MIN (blksize - blkoffs, count);
 
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r == -1)
       return -1;
@@ -353,7 +464,7 @@ cache_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
    * smarter here.
    */
   while (count >= blksize) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, buf, err);
     if (r == -1)
       return -1;
@@ -367,7 +478,7 @@ cache_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
   /* Unaligned tail */
   if (count) {
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r == -1)
       return -1;
@@ -416,7 +527,7 @@ cache_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
      * Hold the lock over the whole operation.
      */
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
       memcpy (&block[blkoffs], buf, n);
@@ -433,7 +544,7 @@ cache_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   /* Aligned body */
   while (count >= blksize) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
     r = blk_write (next_ops, nxdata, blknum, buf, flags, err);
     if (r == -1)
       return -1;
@@ -447,7 +558,7 @@ cache_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
   /* Unaligned tail */
   if (count) {
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
       memcpy (block, buf, count);
@@ -459,6 +570,7 @@ cache_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   if (need_flush)
     return cache_flush (next_ops, nxdata, handle, 0, err);
+  writeback_trickle (next_ops, nxdata);
   return 0;
 }
 
@@ -506,7 +618,7 @@ cache_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     /* Do a read-modify-write operation on the current block.
      * Hold the lock over the whole operation.
      */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
       memset (&block[blkoffs], 0, n);
@@ -525,7 +637,7 @@ cache_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     memset (block, 0, blksize);
   while (count >=blksize) {
     /* Intentional that we do not use next_ops->zero */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
     r = blk_write (next_ops, nxdata, blknum, block, flags, err);
     if (r == -1)
       return -1;
@@ -537,7 +649,7 @@ cache_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   /* Unaligned tail */
   if (count) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
       memset (&block[count], 0, blksize - count);
@@ -549,12 +661,25 @@ cache_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   if (need_flush)
     return cache_flush (next_ops, nxdata, handle, 0, err);
+  writeback_trickle (next_ops, nxdata);
   return 0;
 }
 
-/* Flush: Go through all the dirty blocks, flushing them to disk. */
+/* Flush: Go through all the dirty blocks, flushing them to disk.
+ *
+ * The dirty block walk runs in block number order, so dirty blocks
+ * are written back sorted by offset, and runs of contiguous dirty
+ * blocks are batched into single large writes to the plugin instead
+ * of a write per block.
+ */
+#define WRITEBACK_BATCH_BLOCKS 256
+
 struct flush_data {
-  uint8_t *block;               /* bounce buffer */
+  uint8_t *buf;                 /* batch buffer */
+  uint64_t start;               /* first block of the current batch */
+  size_t nr_blocks;             /* number of blocks in the current batch */
+  size_t max_blocks;            /* stop after this many blocks (0 = all) */
+  size_t written;               /* blocks written back (or attempted) */
   unsigned errors;              /* count of errors seen */
   int first_errno;              /* first errno seen */
   struct nbdkit_next_ops *next_ops;
@@ -562,12 +687,13 @@ struct flush_data {
 };
 
 static int flush_dirty_block (uint64_t blknum, void *);
+static void flush_batch (struct flush_data *data);
 
 static int
 cache_flush (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
              uint32_t flags, int *err)
 {
-  CLEANUP_FREE uint8_t *block = NULL;
+  CLEANUP_FREE uint8_t *buf = NULL;
   struct flush_data data =
     { .errors = 0, .first_errno = 0, .next_ops = next_ops, .nxdata = nxdata };
   int tmp;
@@ -577,24 +703,24 @@ cache_flush (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
 
   assert (!flags);
 
-  /* Allocate the bounce buffer. */
-  block = malloc (blksize);
-  if (block == NULL) {
+  /* Allocate the batch buffer. */
+  buf = malloc (WRITEBACK_BATCH_BLOCKS * (size_t) blksize);
+  if (buf == NULL) {
     *err = errno;
     nbdkit_error ("malloc: %m");
     return -1;
   }
-  data.block = block;
+  data.buf = buf;
 
   /* In theory if cache_mode == CACHE_MODE_WRITETHROUGH then there
    * should be no dirty blocks.  However we go through the cache here
    * to be sure.  Also we still need to issue the flush to the
    * underlying storage.
    */
-  {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    for_each_dirty_block (flush_dirty_block, &data);
-  }
+  blk_lock_all ();
+  for_each_dirty_block (flush_dirty_block, &data);
+  flush_batch (&data);
+  blk_unlock_all ();
 
   /* Now issue a flush request to the underlying storage. */
   if (next_ops->flush (nxdata, 0,
@@ -612,24 +738,80 @@ static int
 flush_dirty_block (uint64_t blknum, void *datav)
 {
   struct flush_data *data = datav;
-  int tmp;
 
-  /* Perform a read + writethrough which will read from the
-   * cache and write it through to the underlying storage.
-   */
-  if (blk_read (data->next_ops, data->nxdata, blknum, data->block,
-                data->errors ? &tmp : &data->first_errno) == -1)
-    goto err;
-  if (blk_writethrough (data->next_ops, data->nxdata, blknum, data->block, 0,
-                        data->errors ? &tmp : &data->first_errno) == -1)
-    goto err;
+  /* Does this block extend the current batch? */
+  if (data->nr_blocks > 0 &&
+      blknum == data->start + data->nr_blocks &&
+      data->nr_blocks < WRITEBACK_BATCH_BLOCKS) {
+    data->nr_blocks++;
+    return 0;
+  }
+
+  flush_batch (data);
 
+  if (data->max_blocks > 0 && data->written >= data->max_blocks)
+    return -1;                  /* Early writeback: wrote enough for now. */
+
+  data->start = blknum;
+  data->nr_blocks = 1;
   return 0;
+}
+
+static void
+flush_batch (struct flush_data *data)
+{
+  int tmp;
+
+  if (data->nr_blocks == 0)
+    return;
+
+  if (blk_writeback_batch (data->next_ops, data->nxdata,
+                           data->start, data->nr_blocks, data->buf,
+                           data->errors ? &tmp : &data->first_errno) == -1) {
+    /* The blocks stay dirty, keep scanning and flushing. */
+    nbdkit_error ("cache: writeback of %zu blocks at block %" PRIu64
+                  " failed", data->nr_blocks, data->start);
+    data->errors++;
+  }
+  data->written += data->nr_blocks;
+  data->nr_blocks = 0;
+}
 
- err:
-  nbdkit_error ("cache: flush of block %" PRIu64 " failed", blknum);
-  data->errors++;
-  return 0; /* continue scanning and flushing. */
+/* If more than cache-dirty-limit bytes are dirty, write one batch of
+ * the lowest-numbered dirty blocks back to the plugin before
+ * returning to the client.  Spreading the writeback over the write
+ * requests which dirty the cache keeps the dirty set - and therefore
+ * the client-visible flush latency - bounded.
+ *
+ * (A detached writeback thread cannot do this: calls into the plugin
+ * resolve the connection from thread-local state, so writeback has to
+ * run on a connection's own threads.)
+ *
+ * Errors are deliberately not reported here: failed blocks simply
+ * stay dirty and the next client flush will retry and report them.
+ */
+static void
+writeback_trickle (struct nbdkit_next_ops *next_ops, void *nxdata)
+{
+  CLEANUP_FREE uint8_t *buf = NULL;
+  struct flush_data data =
+    { .max_blocks = WRITEBACK_BATCH_BLOCKS,
+      .next_ops = next_ops, .nxdata = nxdata };
+
+  if (cache_mode != CACHE_MODE_WRITEBACK || dirty_limit <= 0)
+    return;
+  if (blk_nr_dirty () * blksize <= (uint64_t) dirty_limit)
+    return;
+
+  buf = malloc (WRITEBACK_BATCH_BLOCKS * (size_t) blksize);
+  if (buf == NULL)
+    return;                     /* Not an error, flush will catch up. */
+  data.buf = buf;
+
+  blk_lock_all ();
+  for_each_dirty_block (flush_dirty_block, &data);
+  flush_batch (&data);
+  blk_unlock_all ();
 }
 
 /* Cache data. */
@@ -663,7 +845,7 @@ cache_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   /* Aligned body */
   while (remaining) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
     r = blk_cache (next_ops, nxdata, blknum, block, err);
     if (r == -1)
       return -1;
@@ -679,7 +861,6 @@ cache_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 static struct nbdkit_filter filter = {
   .name              = "cache",
   .longname          = "nbdkit caching filter",
-  .load              = cache_load,
   .unload            = cache_unload,
   .config            = cache_config,
   .config_complete   = cache_config_complete,
@@ -696,6 +877,7 @@ static struct nbdkit_filter filter = {
   .zero              = cache_zero,
   .flush             = cache_flush,
   .cache             = cache_cache,
+  .metrics           = blk_metrics,
 };
 
 NBDKIT_REGISTER_FILTER(filter)
@@ -52,4 +52,35 @@ extern unsigned hi_thresh, lo_thresh;
 /* Cache read requests. */
 extern bool cache_on_read;
 
+/* In writeback mode, start writing dirty blocks back to the plugin
+ * once more than this many bytes are dirty (0 = only write back on
+ * flush).
+ */
+extern int64_t dirty_limit;
+
+/* On a cache miss, also fetch up to this many bytes of following
+ * uncached data from the plugin in the same read (0 = no prefetch).
+ */
+extern int64_t prefetch;
+
+/* Persistent cache file (NULL = unlinked temporary file). */
+extern char *cache_path;
+
+/* Store cache blocks compressed in memory (zstd) instead of in a
+ * file.
+ */
+extern bool cache_compress;
+
+/* Size of the RAM tier in front of the cache file (0 = disabled). */
+extern int64_t ram_max_size;
+
+/* Preload the cache when the first connection is made: either
+ * "extents" (everything the plugin reports as allocated) or the name
+ * of a file of "offset length" ranges (NULL = no preloading).
+ */
+extern char *cache_preload;
+
+/* Number of threads used for preloading. */
+extern unsigned preload_threads;
+
 #endif /* NBDKIT_CACHE_H */
@@ -0,0 +1,117 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* CLOCK (second chance) eviction policy.
+ *
+ * One reference bit per block.  Accessing a block sets its bit -
+ * that is the entire hot path.  The reclaim scan acts as the clock
+ * hand: the first time it considers a block whose bit is set, the
+ * bit is cleared and the block is spared; if the scan comes around
+ * again before the block is accessed again, it is evicted.
+ *
+ * Compared to the lru policy this never rescans or swaps bitmaps on
+ * access, and a block only stays protected if it keeps getting
+ * accessed, which works better for scan-heavy workloads.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <nbdkit-filter.h>
+
+#include "bitmap.h"
+
+#include "cache.h"
+#include "blk.h"
+#include "policy.h"
+
+/* The reference bits. */
+static struct bitmap refs;
+
+static void
+clock_init (void)
+{
+  bitmap_init (&refs, blksize, 1 /* bits per block */);
+}
+
+static void
+clock_free (void)
+{
+  bitmap_free (&refs);
+}
+
+static int
+clock_set_size (uint64_t new_size)
+{
+  return bitmap_resize (&refs, new_size);
+}
+
+static void
+clock_set_recently_accessed (uint64_t blknum)
+{
+  bitmap_set_blk (&refs, blknum, true);
+}
+
+static bool
+clock_has_been_recently_accessed (uint64_t blknum)
+{
+  /* Give the block a second chance: spare it this time, but clear
+   * the reference bit so it is evicted next time around unless it is
+   * accessed again in the meantime.
+   */
+  if (bitmap_get_blk (&refs, blknum, false)) {
+    bitmap_set_blk (&refs, blknum, false);
+    return true;
+  }
+  return false;
+}
+
+static void
+clock_evicted (uint64_t blknum)
+{
+  bitmap_set_blk (&refs, blknum, false);
+}
+
+const struct eviction_policy clock_policy = {
+  .name = "clock",
+  .init = clock_init,
+  .free = clock_free,
+  .set_size = clock_set_size,
+  .set_recently_accessed = clock_set_recently_accessed,
+  .has_been_recently_accessed = clock_has_been_recently_accessed,
+  .evicted = clock_evicted,
+};
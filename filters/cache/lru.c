@@ -49,7 +49,7 @@
 
 #include "cache.h"
 #include "blk.h"
-#include "lru.h"
+#include "policy.h"
 
 /* LRU bitmaps.  These bitmaps implement a simple, fast LRU structure.
  *
@@ -86,21 +86,21 @@ static struct bitmap bm[2];
 static unsigned c0 = 0, c1 = 0;
 static unsigned N = 100;
 
-void
+static void
 lru_init (void)
 {
   bitmap_init (&bm[0], blksize, 1 /* bits per block */);
   bitmap_init (&bm[1], blksize, 1 /* bits per block */);
 }
 
-void
+static void
 lru_free (void)
 {
   bitmap_free (&bm[0]);
   bitmap_free (&bm[1]);
 }
 
-int
+static int
 lru_set_size (uint64_t new_size)
 {
   if (bitmap_resize (&bm[0], new_size) == -1)
@@ -117,7 +117,7 @@ lru_set_size (uint64_t new_size)
   return 0;
 }
 
-void
+static void
 lru_set_recently_accessed (uint64_t blknum)
 {
   /* If the block is already set in the first bitmap, don't need to do
@@ -143,10 +143,26 @@ lru_set_recently_accessed (uint64_t blknum)
   }
 }
 
-bool
+static bool
 lru_has_been_recently_accessed (uint64_t blknum)
 {
   return
     bitmap_get_blk (&bm[0], blknum, false) ||
     bitmap_get_blk (&bm[1], blknum, false);
 }
+
+static void
+lru_evicted (uint64_t blknum)
+{
+  /* Nothing: evicted blocks simply age out of the bitmaps. */
+}
+
+const struct eviction_policy lru_policy = {
+  .name = "lru",
+  .init = lru_init,
+  .free = lru_free,
+  .set_size = lru_set_size,
+  .set_recently_accessed = lru_set_recently_accessed,
+  .has_been_recently_accessed = lru_has_been_recently_accessed,
+  .evicted = lru_evicted,
+};
@@ -0,0 +1,81 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_POLICY_H
+#define NBDKIT_POLICY_H
+
+#include <stdbool.h>
+
+/* Eviction policy interface (cache-eviction=lru|clock|arc).
+ *
+ * The policy tracks which cached blocks are worth keeping.  The hot
+ * path hook is set_recently_accessed, called for every block access,
+ * so it must be O(1).  The reclaim code asks
+ * has_been_recently_accessed for each candidate block and skips the
+ * block while it returns true; evicted is called when a block is
+ * finally discarded from the cache.
+ *
+ * All hooks are called with the relevant block lock held, so they do
+ * not need their own locking.
+ */
+struct eviction_policy {
+  const char *name;
+
+  void (*init) (void);
+  void (*free) (void);
+
+  /* Notify the policy that the virtual size has changed. */
+  int (*set_size) (uint64_t new_size);
+
+  /* Mark a block as recently accessed. */
+  void (*set_recently_accessed) (uint64_t blknum);
+
+  /* Should reclaim skip this block for now? */
+  bool (*has_been_recently_accessed) (uint64_t blknum);
+
+  /* Notify the policy that a block was discarded from the cache. */
+  void (*evicted) (uint64_t blknum);
+};
+
+/* The selected policy (default: lru). */
+extern const struct eviction_policy *policy;
+
+/* Select the policy by name.  Returns -1 and calls nbdkit_error if
+ * the name is not known.
+ */
+extern int policy_select (const char *name);
+
+extern const struct eviction_policy lru_policy;
+extern const struct eviction_policy clock_policy;
+extern const struct eviction_policy arc_policy;
+
+#endif /* NBDKIT_POLICY_H */
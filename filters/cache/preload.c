@@ -0,0 +1,430 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Cache preloading (cache-preload): warm the cache when the first
+ * connection is made, instead of faulting every block in at
+ * miss-latency later.  The blocks to load come either from the
+ * plugin's own extents report ("extents" = everything allocated) or
+ * from a file of "offset length" ranges prepared by the
+ * administrator.
+ *
+ * The ranges are read through next_ops in large chunks and inserted
+ * into the cache block by block with blk_populate, which leaves
+ * already-cached blocks alone.  With cache-preload-threads > 1 the
+ * chunks are read by several helper threads in parallel; see "Calling
+ * next_ops from helper threads" in nbdkit-filter(3) for why this is
+ * only safe when the plugin supports the parallel thread model.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "minmax.h"
+#include "rounding.h"
+#include "tvdiff.h"
+#include "vector.h"
+
+#include "cache.h"
+#include "blk.h"
+#include "preload.h"
+
+/* Preferred size of a single read from the plugin (rounded up to a
+ * whole number of cache blocks).
+ */
+#define PRELOAD_CHUNK (8 * 1024 * 1024)
+
+/* Window covered by one extents request when cache-preload=extents. */
+#define EXTENTS_WINDOW (1024 * 1024 * 1024)
+
+struct range {
+  uint64_t offset, length;
+};
+DEFINE_VECTOR_TYPE(ranges, struct range);
+
+/* Shared state of one preload run. */
+struct preload_work {
+  void *context;                /* request context, lent to helpers */
+  struct nbdkit_next_ops *next_ops;
+  void *nxdata;
+  int64_t size;                 /* virtual size of the disk */
+  uint64_t chunk;               /* read size, a multiple of blksize */
+  ranges rs;
+
+  pthread_mutex_t lock;         /* protects everything below */
+  size_t next_range;            /* cursor: current range ... */
+  uint64_t range_done;          /* ... and bytes consumed within it */
+  uint64_t total, done;         /* bytes, for progress reporting */
+  unsigned last_pct;            /* last percentage reported */
+  unsigned errors;
+};
+
+/* Aligned length of a range: whole cache blocks, clamped to the disk
+ * (the final block may extend past the end of the disk; the reader
+ * deals with that).
+ */
+static uint64_t
+range_bytes (const struct range *r, int64_t size)
+{
+  uint64_t start = ROUND_DOWN (r->offset, blksize);
+  uint64_t end = MIN (ROUND_UP (r->offset + r->length, blksize),
+                      ROUND_UP ((uint64_t) size, blksize));
+
+  return end > start ? end - start : 0;
+}
+
+/* Parse a file of "offset length" lines (as in nbdkit-extentlist-filter,
+ * but without the type field).  Blank lines and #-comments are ignored.
+ */
+static int
+parse_ranges_file (ranges *rs)
+{
+  CLEANUP_FREE char *line = NULL;
+  size_t linelen = 0;
+  ssize_t len;
+  FILE *fp;
+
+  fp = fopen (cache_preload, "r");
+  if (fp == NULL) {
+    nbdkit_error ("open: %s: %m", cache_preload);
+    return -1;
+  }
+
+  while ((len = getline (&line, &linelen, fp)) != -1) {
+    const char *delim = " \t";
+    char *sp, *p;
+    int64_t offset, length;
+
+    if (len > 0 && line[len-1] == '\n') {
+      line[len-1] = '\0';
+      len--;
+    }
+
+    if ((p = strtok_r (line, delim, &sp)) == NULL || p[0] == '#')
+      continue;
+    offset = nbdkit_parse_size (p);
+    if (offset == -1)
+      goto err;
+
+    if ((p = strtok_r (NULL, delim, &sp)) == NULL) {
+      nbdkit_error ("%s: cannot parse %s", cache_preload, line);
+      goto err;
+    }
+    length = nbdkit_parse_size (p);
+    if (length == -1)
+      goto err;
+
+    if (length == 0)
+      continue;
+
+    if (ranges_append (rs, (struct range){.offset = offset,
+                                          .length = length}) == -1) {
+      nbdkit_error ("realloc: %m");
+      goto err;
+    }
+  }
+
+  fclose (fp);
+  return 0;
+
+ err:
+  fclose (fp);
+  return -1;
+}
+
+/* Build the range list from the plugin's extents: everything which is
+ * not a hole.
+ */
+static int
+ranges_from_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
+                     int64_t size, ranges *rs)
+{
+  uint64_t offset = 0;
+
+  if (next_ops->can_extents (nxdata) != 1) {
+    /* No extent information, so preload the whole disk. */
+    nbdkit_debug ("cache: preload: plugin does not support extents, "
+                  "preloading everything");
+    if (ranges_append (rs, (struct range){.offset = 0,
+                                          .length = size}) == -1) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    return 0;
+  }
+
+  while (offset < (uint64_t) size) {
+    uint32_t window = MIN ((uint64_t) size - offset,
+                           (uint64_t) EXTENTS_WINDOW);
+    struct nbdkit_extents *extents;
+    uint64_t next = offset;
+    size_t i, n;
+    int err;
+
+    extents = nbdkit_extents_full (next_ops, nxdata, window, offset, 0, &err);
+    if (extents == NULL) {
+      errno = err;
+      nbdkit_error ("cache: preload: cannot read extents: %m");
+      return -1;
+    }
+
+    n = nbdkit_extents_count (extents);
+    for (i = 0; i < n; ++i) {
+      struct nbdkit_extent e = nbdkit_get_extent (extents, i);
+
+      next = MAX (next, e.offset + e.length);
+      if (e.type & NBDKIT_EXTENT_HOLE)
+        continue;
+      if (ranges_append (rs, (struct range){.offset = e.offset,
+                                            .length = e.length}) == -1) {
+        nbdkit_error ("realloc: %m");
+        nbdkit_extents_free (extents);
+        return -1;
+      }
+    }
+    nbdkit_extents_free (extents);
+
+    if (next == offset)         /* don't loop if the plugin misbehaves */
+      break;
+    offset = next;
+  }
+
+  return 0;
+}
+
+/* Take the next chunk of work.  Returns false when no work is left.
+ * *count is always a whole number of blocks; the final block may
+ * extend past the end of the disk.
+ */
+static bool
+next_chunk (struct preload_work *w, uint64_t *offset, uint64_t *count)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&w->lock);
+
+  while (w->next_range < w->rs.size) {
+    const struct range *r = &w->rs.ptr[w->next_range];
+    uint64_t n = range_bytes (r, w->size);
+
+    if (w->range_done < n) {
+      *offset = ROUND_DOWN (r->offset, blksize) + w->range_done;
+      *count = MIN (n - w->range_done, w->chunk);
+      w->range_done += *count;
+      return true;
+    }
+    w->next_range++;
+    w->range_done = 0;
+  }
+  return false;
+}
+
+static void
+progress (struct preload_work *w, uint64_t n)
+{
+  unsigned pct;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&w->lock);
+  w->done += n;
+  pct = w->total ? 100 * w->done / w->total : 100;
+  if (pct >= w->last_pct + 10) {
+    w->last_pct = pct - pct % 10;
+    nbdkit_debug ("cache: preload: %u%% (%" PRIu64 "/%" PRIu64 " bytes)",
+                  w->last_pct, w->done, w->total);
+  }
+}
+
+/* Read chunks from the plugin and insert them into the cache until no
+ * work is left.  Runs on the preloading request's own thread and, if
+ * cache-preload-threads > 1, on helper threads as well.
+ */
+static void
+work (struct preload_work *w)
+{
+  CLEANUP_FREE uint8_t *buf = NULL;
+  uint64_t offset, count;
+  unsigned errors = 0;
+
+  buf = malloc (w->chunk);
+  if (buf == NULL) {
+    nbdkit_error ("malloc: %m");
+    errors++;
+    goto out;
+  }
+
+  while (next_chunk (w, &offset, &count)) {
+    uint64_t n = count, b;
+    int err;
+
+    /* The last block of the disk may be partial: read what exists and
+     * zero the rest of the block, as in blk_read.
+     */
+    if (offset + n > (uint64_t) w->size)
+      n = w->size - offset;
+
+    if (w->next_ops->pread (w->nxdata, buf, n, offset, 0, &err) == -1) {
+      errors++;
+      continue;
+    }
+    memset (buf + n, 0, count - n);
+
+    for (b = 0; b < count / blksize; ++b) {
+      uint64_t blknum = offset / blksize + b;
+
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+      if (blk_populate (blknum, buf + b * blksize, &err) == -1)
+        errors++;
+    }
+    progress (w, count);
+  }
+
+ out:
+  if (errors) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&w->lock);
+    w->errors += errors;
+  }
+}
+
+static void *
+worker_thread (void *vp)
+{
+  struct preload_work *w = vp;
+
+  /* Borrow the preloading request's context so this thread may call
+   * next_ops (see "Calling next_ops from helper threads" in
+   * nbdkit-filter(3)).
+   */
+  nbdkit_set_request_context (w->context);
+  work (w);
+  nbdkit_set_request_context (NULL);
+  return NULL;
+}
+
+int
+preload (struct nbdkit_next_ops *next_ops, void *nxdata)
+{
+  static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+  static bool done = false;
+  struct preload_work w = { .next_ops = next_ops, .nxdata = nxdata,
+                            .rs = empty_vector };
+  CLEANUP_FREE pthread_t *threads = NULL;
+  struct timeval start, end;
+  int64_t usec;
+  unsigned i, nr_threads = 0;
+  size_t j;
+  int r = -1;
+
+  if (cache_preload == NULL)
+    return 0;
+
+  /* Only the first connection preloads. */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&done_lock);
+    if (done)
+      return 0;
+    done = true;
+  }
+
+  w.size = next_ops->get_size (nxdata);
+  if (w.size == -1)
+    return -1;
+  w.chunk = ROUND_UP ((uint64_t) PRELOAD_CHUNK, blksize);
+  pthread_mutex_init (&w.lock, NULL);
+
+  if (strcmp (cache_preload, "extents") == 0) {
+    if (ranges_from_extents (next_ops, nxdata, w.size, &w.rs) == -1)
+      goto out;
+  }
+  else {
+    if (parse_ranges_file (&w.rs) == -1)
+      goto out;
+  }
+
+  for (j = 0; j < w.rs.size; ++j)
+    w.total += range_bytes (&w.rs.ptr[j], w.size);
+
+  nbdkit_debug ("cache: preload: %zu ranges, %" PRIu64 " bytes, "
+                "%u thread(s)",
+                w.rs.size, w.total, preload_threads);
+  gettimeofday (&start, NULL);
+
+  /* Start the helper threads (this thread is one of the workers).  If
+   * a thread cannot be created we just run with fewer.
+   */
+  if (preload_threads > 1) {
+    w.context = nbdkit_get_request_context ();
+    threads = calloc (preload_threads - 1, sizeof (pthread_t));
+    if (threads != NULL) {
+      for (i = 0; i < preload_threads - 1; ++i) {
+        if (pthread_create (&threads[i], NULL, worker_thread, &w) != 0)
+          break;
+        nr_threads++;
+      }
+    }
+  }
+
+  work (&w);
+
+  for (i = 0; i < nr_threads; ++i)
+    pthread_join (threads[i], NULL);
+
+  gettimeofday (&end, NULL);
+  usec = tvdiff_usec (&start, &end);
+  nbdkit_debug ("cache: preload: loaded %" PRIu64 " bytes in %.1f s "
+                "(%.1f MiB/s)",
+                w.done, usec / 1000000.0,
+                usec > 0 ? w.done / 1.048576 / usec : 0.0);
+
+  /* Read errors during preloading are not fatal: the affected blocks
+   * are simply not cached, and a later client read will retry (and
+   * report) them.
+   */
+  if (w.errors > 0)
+    nbdkit_error ("cache: preload: %u errors, some blocks were not "
+                  "preloaded", w.errors);
+
+  r = 0;
+ out:
+  ranges_reset (&w.rs);
+  pthread_mutex_destroy (&w.lock);
+  return r;
+}
@@ -39,20 +39,37 @@
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <assert.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <nbdkit-filter.h>
 
 #include "bitmap.h"
+#include "cleanup.h"
 
 #include "cache.h"
+#include "blk.h"
 #include "reclaim.h"
-#include "lru.h"
+#include "policy.h"
 
 #ifndef HAVE_CACHE_RECLAIM
 
+int
+reclaim_init (int fd, struct bitmap *bm)
+{
+  return 0;
+}
+
+void
+reclaim_free (void)
+{
+  /* nothing */
+}
+
 void
 reclaim (int fd, struct bitmap *bm)
 {
@@ -61,7 +78,12 @@ reclaim (int fd, struct bitmap *bm)
 
 #else /* HAVE_CACHE_RECLAIM */
 
-/* If we are currently reclaiming blocks from the cache.
+/* Reclaiming happens in a low priority background thread.  The
+ * request path only checks the allocated size of the cache file and
+ * wakes the thread when it crosses the high threshold; the thread
+ * punches holes in batches, taking only the victim block's stripe
+ * lock around each punch, so requests are not stalled while the
+ * cache is shrunk.
  *
  * The state machine starts in the NOT_RECLAIMING state.  When the
  * size of the cache exceeds the high threshold, we move to
@@ -71,10 +93,8 @@ reclaim (int fd, struct bitmap *bm)
  * If at any time the size of the cache goes below the low threshold
  * we move back to the NOT_RECLAIMING state.
  *
- * A possible future enhancement is to add an extra state between LRU
- * and ANY which reclaims blocks from lru.c:bm[1].
- *
- * reclaim_blk is the last block that we looked at.
+ * reclaim_blk is the last block that we looked at.  It is only used
+ * by the reclaim thread.
  */
 enum reclaim_state {
   NOT_RECLAIMING = 0,
@@ -85,122 +105,233 @@ enum reclaim_state {
 static enum reclaim_state reclaiming = NOT_RECLAIMING;
 static int64_t reclaim_blk;
 
-static void reclaim_one (int fd, struct bitmap *bm);
-static void reclaim_lru (int fd, struct bitmap *bm);
-static void reclaim_any (int fd, struct bitmap *bm);
-static void reclaim_block (int fd, struct bitmap *bm);
+/* Cache file and block state bitmap, stored by reclaim_init. */
+static int cache_fd = -1;
+static struct bitmap *cache_bm;
+
+static pthread_t thread;
+static bool thread_running = false;
+
+/* The control lock protects the two flags below and the condition
+ * variable used to wake the thread.
+ */
+static pthread_mutex_t ctl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ctl_cond = PTHREAD_COND_INITIALIZER;
+static bool wanted = false;
+static bool quit = false;
+
+/* Punch up to this many holes between re-checking the allocated size
+ * of the cache.
+ */
+#define RECLAIM_BATCH 64
+
+static void *reclaim_thread (void *vp);
+static bool reclaim_one (void);
+static bool reclaim_lru (void);
+static bool reclaim_any (void);
+static bool reclaim_block (void);
+
+int
+reclaim_init (int fd, struct bitmap *bm)
+{
+  int err;
+
+  cache_fd = fd;
+  cache_bm = bm;
+
+  /* If the user didn't set cache-max-size, no reclaiming is done. */
+  if (max_size == -1)
+    return 0;
+
+  err = pthread_create (&thread, NULL, reclaim_thread, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  thread_running = true;
+  return 0;
+}
 
 void
-reclaim (int fd, struct bitmap *bm)
+reclaim_free (void)
 {
-  struct stat statbuf;
-  uint64_t cache_allocated;
+  if (!thread_running)
+    return;
 
-  /* If the user didn't set cache-max-size, do nothing. */
-  if (max_size == -1) return;
+  pthread_mutex_lock (&ctl_lock);
+  quit = true;
+  pthread_cond_signal (&ctl_cond);
+  pthread_mutex_unlock (&ctl_lock);
+  pthread_join (thread, NULL);
+  thread_running = false;
+}
+
+/* Allocated size of the cache file in bytes. */
+static uint64_t
+cache_allocated (void)
+{
+  struct stat statbuf;
 
-  /* Check the allocated size of the cache. */
-  if (fstat (fd, &statbuf) == -1) {
+  if (fstat (cache_fd, &statbuf) == -1) {
     nbdkit_debug ("cache: fstat: %m");
-    return;
+    return 0;
   }
-  cache_allocated = statbuf.st_blocks * UINT64_C(512);
-
-  if (reclaiming) {
-    /* Keep reclaiming until the cache size drops below the low threshold. */
-    if (cache_allocated < max_size * lo_thresh / 100) {
-      nbdkit_debug ("cache: stop reclaiming");
-      reclaiming = NOT_RECLAIMING;
-      return;
+  return statbuf.st_blocks * UINT64_C (512);
+}
+
+void
+reclaim (int fd, struct bitmap *bm)
+{
+  if (!thread_running)
+    return;
+
+  if (cache_allocated () < max_size * hi_thresh / 100)
+    return;
+
+  pthread_mutex_lock (&ctl_lock);
+  wanted = true;
+  pthread_cond_signal (&ctl_cond);
+  pthread_mutex_unlock (&ctl_lock);
+}
+
+static void *
+reclaim_thread (void *vp)
+{
+  for (;;) {
+    pthread_mutex_lock (&ctl_lock);
+    while (!wanted && !quit)
+      pthread_cond_wait (&ctl_cond, &ctl_lock);
+    wanted = false;
+    if (quit) {
+      pthread_mutex_unlock (&ctl_lock);
+      break;
     }
-  }
-  else {
-    if (cache_allocated < max_size * hi_thresh / 100)
-      return;
+    pthread_mutex_unlock (&ctl_lock);
+
+    if (cache_allocated () < max_size * hi_thresh / 100)
+      continue;
 
-    /* Start reclaiming if the cache size goes over the high threshold. */
     nbdkit_debug ("cache: start reclaiming");
     reclaiming = RECLAIMING_LRU;
-  }
 
-  /* Reclaim up to 2 cache blocks. */
-  reclaim_one (fd, bm);
-  reclaim_one (fd, bm);
+    /* Keep reclaiming until the cache size drops below the low
+     * threshold, a batch makes no progress, or we are told to quit.
+     */
+    while (!quit && cache_allocated () >= max_size * lo_thresh / 100) {
+      bool progress = false;
+      unsigned i;
+
+      for (i = 0; i < RECLAIM_BATCH; ++i) {
+        if (reclaim_one ())
+          progress = true;
+      }
+
+      if (!progress)
+        break;
+    }
+
+    reclaiming = NOT_RECLAIMING;
+    nbdkit_debug ("cache: stop reclaiming");
+  }
+  return NULL;
 }
 
-/* Reclaim a single cache block. */
-static void
-reclaim_one (int fd, struct bitmap *bm)
+/* Reclaim a single cache block.  Returns true if progress was made. */
+static bool
+reclaim_one (void)
 {
   assert (reclaiming);
 
   if (reclaiming == RECLAIMING_LRU)
-    reclaim_lru (fd, bm);
+    return reclaim_lru ();
   else
-    reclaim_any (fd, bm);
+    return reclaim_any ();
 }
 
-static void
-reclaim_lru (int fd, struct bitmap *bm)
+static bool
+reclaim_lru (void)
 {
   int64_t old_reclaim_blk;
+  pthread_mutex_t *meta = blk_meta_lock ();
+
+  /* The bitmap and the policy state are protected by the meta lock,
+   * which must not be held while taking a stripe lock, so drop it
+   * before punching out the chosen block.
+   */
+  pthread_mutex_lock (meta);
 
   /* Find the next block in the cache. */
-  reclaim_blk = bitmap_next (bm, reclaim_blk+1);
+  reclaim_blk = bitmap_next (cache_bm, reclaim_blk+1);
   old_reclaim_blk = reclaim_blk;
 
   /* Search for an LRU block after this one. */
   do {
-    if (! lru_has_been_recently_accessed (reclaim_blk)) {
-      reclaim_block (fd, bm);
-      return;
+    if (! policy->has_been_recently_accessed (reclaim_blk)) {
+      pthread_mutex_unlock (meta);
+      return reclaim_block ();
     }
 
-    reclaim_blk = bitmap_next (bm, reclaim_blk+1);
+    reclaim_blk = bitmap_next (cache_bm, reclaim_blk+1);
     if (reclaim_blk == -1)    /* wrap around */
-      reclaim_blk = bitmap_next (bm, 0);
+      reclaim_blk = bitmap_next (cache_bm, 0);
   } while (reclaim_blk >= 0 && old_reclaim_blk != reclaim_blk);
 
+  pthread_mutex_unlock (meta);
+
   if (old_reclaim_blk == reclaim_blk) {
     /* Run out of LRU blocks, so start reclaiming any block in the cache. */
     nbdkit_debug ("cache: reclaiming any blocks");
     reclaiming = RECLAIMING_ANY;
-    reclaim_any (fd, bm);
+    return reclaim_any ();
   }
+  return false;                 /* the cache is empty */
 }
 
-static void
-reclaim_any (int fd, struct bitmap *bm)
+static bool
+reclaim_any (void)
 {
+  pthread_mutex_t *meta = blk_meta_lock ();
+
+  pthread_mutex_lock (meta);
+
   /* Find the next block in the cache. */
-  reclaim_blk = bitmap_next (bm, reclaim_blk+1);
+  reclaim_blk = bitmap_next (cache_bm, reclaim_blk+1);
   if (reclaim_blk == -1)        /* wrap around */
-    reclaim_blk = bitmap_next (bm, 0);
+    reclaim_blk = bitmap_next (cache_bm, 0);
+
+  pthread_mutex_unlock (meta);
 
-  reclaim_block (fd, bm);
+  return reclaim_block ();
 }
 
-static void
-reclaim_block (int fd, struct bitmap *bm)
+static bool
+reclaim_block (void)
 {
   if (reclaim_blk == -1) {
     nbdkit_debug ("cache: run out of blocks to reclaim!");
-    return;
+    return false;
   }
 
+  /* Hold the block's stripe lock so no request is using the block
+   * while we punch it out.
+   */
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (reclaim_blk));
+
   nbdkit_debug ("cache: reclaiming block %" PRIu64, reclaim_blk);
 #ifdef FALLOC_FL_PUNCH_HOLE
-  if (fallocate (fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+  if (fallocate (cache_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
                  reclaim_blk * blksize, blksize) == -1) {
     nbdkit_error ("cache: reclaiming cache blocks: "
                   "fallocate: FALLOC_FL_PUNCH_HOLE: %m");
-    return;
+    return false;
   }
 #else
 #error "no implementation for punching holes"
 #endif
 
-  bitmap_set_blk (bm, reclaim_blk, 0);
+  blk_evicted (reclaim_blk);
+  return true;
 }
 
 #endif /* HAVE_CACHE_RECLAIM */
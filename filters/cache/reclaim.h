@@ -42,10 +42,15 @@
 #undef HAVE_CACHE_RECLAIM
 #endif
 
-/* Check if we need to reclaim blocks, and if so reclaim up to two
- * blocks.
- *
- * Note this must be called with the blk lock held.
+/* Start the background reclaim thread (a no-op unless cache-max-size
+ * is set).  Called after the cache file and bitmap exist;
+ * reclaim_free must be called before they are torn down.
+ */
+extern int reclaim_init (int fd, struct bitmap *bm);
+extern void reclaim_free (void);
+
+/* Check if we need to reclaim blocks, and if so wake the reclaim
+ * thread.  May be called with a stripe lock held.
  */
 extern void reclaim (int fd, struct bitmap *bm);
 
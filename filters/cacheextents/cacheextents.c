@@ -44,6 +44,7 @@
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
+#include "minmax.h"
 
 /* -D cacheextents.cache=1: Debug cache operations. */
 int cacheextents_debug_cache = 0;
@@ -51,26 +52,80 @@ int cacheextents_debug_cache = 0;
 /* This lock protects the global state. */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Cached extents from the last extents () call and its start and end
- * for the sake of simplicity.
+/* The cache holds up to NR_CACHE_SLOTS replies, each covering one
+ * range of the disk, evicted LRU.  Several clients probing different
+ * regions of the disk (eg. parallel qemu-img convert workers) thus
+ * no longer evict each other's entries.
  */
-struct nbdkit_extents *cache_extents;
-static uint64_t cache_start;
-static uint64_t cache_end;
+#define NR_CACHE_SLOTS 16
+
+struct cache_slot {
+  struct nbdkit_extents *extents; /* NULL = slot unused */
+  uint64_t start, end;
+  uint64_t last_use;              /* for LRU eviction */
+};
+static struct cache_slot cache_slots[NR_CACHE_SLOTS];
+static uint64_t use_counter;
+
+static void
+free_slot (struct cache_slot *slot)
+{
+  nbdkit_extents_free (slot->extents);
+  slot->extents = NULL;
+}
 
 static void
 cacheextents_unload (void)
 {
-  nbdkit_extents_free (cache_extents);
+  size_t i;
+
+  for (i = 0; i < NR_CACHE_SLOTS; i++)
+    free_slot (&cache_slots[i]);
+}
+
+/* Find the cached range containing offset, or NULL. */
+static struct cache_slot *
+lookup (uint64_t offset)
+{
+  size_t i;
+
+  for (i = 0; i < NR_CACHE_SLOTS; i++) {
+    struct cache_slot *slot = &cache_slots[i];
+
+    if (slot->extents && offset >= slot->start && offset < slot->end)
+      return slot;
+  }
+  return NULL;
+}
+
+/* Return an unused slot, evicting the least recently used if full. */
+static struct cache_slot *
+get_free_slot (void)
+{
+  size_t i;
+  struct cache_slot *victim = &cache_slots[0];
+
+  for (i = 0; i < NR_CACHE_SLOTS; i++) {
+    struct cache_slot *slot = &cache_slots[i];
+
+    if (slot->extents == NULL)
+      return slot;
+    if (slot->last_use < victim->last_use)
+      victim = slot;
+  }
+  free_slot (victim);
+  return victim;
 }
 
 static int
-cacheextents_add (struct nbdkit_extents *extents, int *err)
+cacheextents_add (struct cache_slot *slot,
+                  struct nbdkit_extents *extents, int *err)
 {
   size_t i = 0;
 
-  for (i = 0; i < nbdkit_extents_count (cache_extents); i++) {
-    struct nbdkit_extent ex = nbdkit_get_extent (cache_extents, i);
+  slot->last_use = ++use_counter;
+  for (i = 0; i < nbdkit_extents_count (slot->extents); i++) {
+    struct nbdkit_extent ex = nbdkit_get_extent (slot->extents, i);
     if (nbdkit_add_extent (extents, ex.offset, ex.length, ex.type) == -1) {
       *err = errno;
       return -1;
@@ -87,13 +142,26 @@ fill (struct nbdkit_extents *extents, int *err)
   size_t count = nbdkit_extents_count (extents);
   struct nbdkit_extent first = nbdkit_get_extent (extents, 0);
   struct nbdkit_extent last = nbdkit_get_extent (extents, count - 1);
+  uint64_t start = first.offset;
+  uint64_t end = last.offset + last.length;
+  struct cache_slot *slot;
 
-  nbdkit_extents_free (cache_extents);
-  cache_start = first.offset;
-  cache_end = last.offset + last.length;
-  cache_extents = nbdkit_extents_new (cache_start, cache_end);
+  /* Drop any existing entry lying wholly inside the new range, since
+   * the new entry supersedes it.
+   */
+  for (i = 0; i < NR_CACHE_SLOTS; i++) {
+    slot = &cache_slots[i];
+    if (slot->extents && slot->start >= start && slot->end <= end)
+      free_slot (slot);
+  }
 
-  if (!cache_extents)
+  slot = get_free_slot ();
+  slot->start = start;
+  slot->end = end;
+  slot->last_use = ++use_counter;
+  slot->extents = nbdkit_extents_new (start, end);
+
+  if (!slot->extents)
     return -1;
 
   for (i = 0; i < count; i++) {
@@ -106,11 +174,10 @@ fill (struct nbdkit_extents *extents, int *err)
                     " type=%x",
                     ex.offset, ex.length, ex.type);
 
-    if (nbdkit_add_extent (cache_extents, ex.offset, ex.length,
+    if (nbdkit_add_extent (slot->extents, ex.offset, ex.length,
                            ex.type) == -1) {
       *err = errno;
-      nbdkit_extents_free (cache_extents);
-      cache_extents = NULL;
+      free_slot (slot);
       return -1;
     }
   }
@@ -125,20 +192,17 @@ cacheextents_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
                       struct nbdkit_extents *extents,
                       int *err)
 {
+  struct cache_slot *slot;
+
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
 
-  if (cacheextents_debug_cache)
-    nbdkit_debug ("cacheextents:"
-                  " cache_start=%" PRIu64
-                  " cache_end=%" PRIu64
-                  " cache_extents=%p",
-                  cache_start, cache_end, cache_extents);
-
-  if (cache_extents &&
-      offset >= cache_start && offset < cache_end) {
+  slot = lookup (offset);
+  if (slot) {
     if (cacheextents_debug_cache)
-      nbdkit_debug ("cacheextents: returning from cache");
-    return cacheextents_add (extents, err);
+      nbdkit_debug ("cacheextents: returning range"
+                    " [%" PRIu64 ", %" PRIu64 ") from cache",
+                    slot->start, slot->end);
+    return cacheextents_add (slot, extents, err);
   }
 
   if (cacheextents_debug_cache)
@@ -155,18 +219,98 @@ cacheextents_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
   return fill (extents, err);
 }
 
-/* Any changes to the data needs to clean the cache.
- *
- * Similar to the readahead filter this could be more intelligent, but
- * there would be very little benefit.
+/* Writes only invalidate the range they touch: cached entries
+ * overlapping the write are clipped, keeping the parts before and
+ * after the written range.
+ */
+
+/* Return a new extents list holding slot's extents clipped to
+ * [start, end), or NULL if that is empty or on allocation failure
+ * (the caller then simply drops that part of the cache).
  */
+static struct nbdkit_extents *
+clip_extents (const struct cache_slot *slot, uint64_t start, uint64_t end)
+{
+  struct nbdkit_extents *ret = nbdkit_extents_new (start, end);
+  size_t i;
+
+  if (ret == NULL)
+    return NULL;
+
+  for (i = 0; i < nbdkit_extents_count (slot->extents); i++) {
+    struct nbdkit_extent ex = nbdkit_get_extent (slot->extents, i);
+    uint64_t s = MAX (ex.offset, start);
+    uint64_t e = MIN (ex.offset + ex.length, end);
+
+    if (s < e && nbdkit_add_extent (ret, s, e - s, ex.type) == -1) {
+      nbdkit_extents_free (ret);
+      return NULL;
+    }
+  }
+
+  if (nbdkit_extents_count (ret) == 0) {
+    nbdkit_extents_free (ret);
+    return NULL;
+  }
+  return ret;
+}
 
 static void
-kill_cacheextents (void)
+invalidate_range (uint64_t offset, uint64_t count)
 {
+  uint64_t wstart = offset, wend = offset + count;
+  size_t i, j;
+
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  nbdkit_extents_free (cache_extents);
-  cache_extents = NULL;
+
+  for (i = 0; i < NR_CACHE_SLOTS; i++) {
+    struct cache_slot *slot = &cache_slots[i];
+    uint64_t s = slot->start, e = slot->end;
+    struct nbdkit_extents *before = NULL, *after = NULL;
+
+    if (slot->extents == NULL || e <= wstart || s >= wend)
+      continue;
+
+    if (cacheextents_debug_cache)
+      nbdkit_debug ("cacheextents: write [%" PRIu64 ", %" PRIu64 ")"
+                    " invalidates cached range [%" PRIu64 ", %" PRIu64 ")",
+                    wstart, wend, s, e);
+
+    if (s < wstart)
+      before = clip_extents (slot, s, wstart);
+    if (e > wend)
+      after = clip_extents (slot, wend, e);
+    free_slot (slot);
+
+    if (before) {
+      slot->extents = before;
+      slot->start = s;
+      slot->end = wstart;
+    }
+    else if (after) {
+      slot->extents = after;
+      slot->start = wend;
+      slot->end = e;
+      after = NULL;
+    }
+
+    /* If the write split the entry in two, keep the part after the
+     * write as well if there is a spare slot (don't evict for it).
+     */
+    if (after) {
+      for (j = 0; j < NR_CACHE_SLOTS; j++) {
+        if (cache_slots[j].extents == NULL) {
+          cache_slots[j].extents = after;
+          cache_slots[j].start = wend;
+          cache_slots[j].end = e;
+          cache_slots[j].last_use = slot->last_use;
+          after = NULL;
+          break;
+        }
+      }
+      nbdkit_extents_free (after);
+    }
+  }
 }
 
 static int
@@ -175,7 +319,7 @@ cacheextents_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
                      const void *buf, uint32_t count, uint64_t offset,
                      uint32_t flags, int *err)
 {
-  kill_cacheextents ();
+  invalidate_range (offset, count);
   return next_ops->pwrite (nxdata, buf, count, offset, flags, err);
 }
 
@@ -185,7 +329,7 @@ cacheextents_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
                    uint32_t count, uint64_t offset, uint32_t flags,
                    int *err)
 {
-  kill_cacheextents ();
+  invalidate_range (offset, count);
   return next_ops->trim (nxdata, count, offset, flags, err);
 }
 
@@ -195,7 +339,7 @@ cacheextents_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
                    uint32_t count, uint64_t offset, uint32_t flags,
                    int *err)
 {
-  kill_cacheextents ();
+  invalidate_range (offset, count);
   return next_ops->zero (nxdata, count, offset, flags, err);
 }
 
@@ -0,0 +1,494 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Changed block tracking: maintain a named, persistent dirty bitmap
+ * on top of any plugin so that incremental backups only have to read
+ * the blocks which changed since the last backup, instead of the
+ * whole image.
+ *
+ * Every successful write, zero or trim marks the touched granules
+ * dirty in an in-memory bitmap (common/bitmap).  The bitmap is
+ * checkpointed to a local state file after every successful flush and
+ * when the server shuts down, so it survives restarts; because the
+ * checkpoint happens after the flush of the plugin, a crash between
+ * checkpoints can only leave blocks spuriously dirty, never
+ * spuriously clean, which is the safe direction for backups.
+ *
+ * Clients read the bitmap through NBD_CMD_BLOCK_STATUS by selecting
+ * the "qemu:dirty-bitmap:NAME" metadata context during negotiation,
+ * exactly as they would against qemu-nbd, so existing incremental
+ * backup tooling works unchanged.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "bitmap.h"
+#include "cleanup.h"
+#include "ispowerof2.h"
+#include "minmax.h"
+#include "rounding.h"
+
+/* On-disk state file format: a header followed by the raw bitmap
+ * bytes (1 bit per granule, entry 0 in the least significant bit of
+ * byte 0).  Host byte order; the state only needs to survive
+ * restarts on the same machine.
+ */
+#define CBT_MAGIC "NBDKITCBTSTATE\0"
+#define CBT_VERSION 1
+
+struct cbt_header {
+  char magic[16];               /* CBT_MAGIC */
+  uint32_t version;             /* CBT_VERSION */
+  uint32_t granularity;         /* bytes per bit */
+  uint64_t virtual_size;        /* size of the tracked disk in bytes */
+};
+
+static char *state_file;        /* cbt-state=PATH */
+static const char *bitmap_name = "cbt0";      /* cbt-name=NAME */
+static uint32_t granularity = 65536;          /* cbt-granularity=SIZE */
+static bool clear_on_start;                   /* cbt-clear=true */
+
+static char *context_name;      /* "qemu:dirty-bitmap:NAME" */
+
+/* lock protects the bitmap, disk_size and checkpointing. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bitmap bm;
+static uint64_t disk_size;      /* size the bitmap currently covers */
+
+/* Bitmap bytes recovered from an existing state file in get_ready,
+ * applied once the disk size is known (first prepare).
+ */
+static uint8_t *saved_bits;
+static size_t saved_bits_size;
+static uint64_t saved_virtual_size;
+
+static void
+cbt_unload (void)
+{
+  bitmap_free (&bm);
+  free (saved_bits);
+  free (context_name);
+  free (state_file);
+}
+
+static int
+cbt_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
+            const char *key, const char *value)
+{
+  if (strcmp (key, "cbt-state") == 0) {
+    free (state_file);
+    state_file = nbdkit_absolute_path (value);
+    if (state_file == NULL)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "cbt-name") == 0) {
+    bitmap_name = nbdkit_strdup_intern (value);
+    if (bitmap_name == NULL)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "cbt-granularity") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r < 512 || r > UINT32_MAX || !is_power_of_2 (r)) {
+      nbdkit_error ("cbt-granularity must be a power of 2 and >= 512");
+      return -1;
+    }
+    granularity = r;
+    return 0;
+  }
+  else if (strcmp (key, "cbt-clear") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    clear_on_start = r;
+    return 0;
+  }
+  else {
+    return next (nxdata, key, value);
+  }
+}
+
+#define cbt_config_help \
+  "cbt-state=PATH            File storing the bitmap across restarts\n" \
+  "                          (required).\n" \
+  "cbt-name=NAME             Name of the dirty bitmap, exposed to\n" \
+  "                          clients as the qemu:dirty-bitmap:NAME\n" \
+  "                          metadata context (default \"cbt0\").\n" \
+  "cbt-granularity=SIZE      Bytes tracked per bitmap bit (default 64K).\n" \
+  "cbt-clear=true            Start a new tracking epoch: mark\n" \
+  "                          everything clean, ignoring saved state."
+
+static int
+cbt_config_complete (nbdkit_next_config_complete *next, nbdkit_backend *nxdata)
+{
+  if (state_file == NULL) {
+    nbdkit_error ("cbt-state parameter is required");
+    return -1;
+  }
+
+  if (asprintf (&context_name, "qemu:dirty-bitmap:%s", bitmap_name) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+
+  return next (nxdata);
+}
+
+/* Load an existing state file, if there is one.  The bits are only
+ * applied in cbt_prepare, when the disk size is known.
+ */
+static int
+cbt_get_ready (nbdkit_next_get_ready *next, nbdkit_backend *nxdata,
+               int thread_model)
+{
+  int fd;
+  struct cbt_header hdr;
+  ssize_t r;
+
+  if (next (nxdata) == -1)
+    return -1;
+
+  bitmap_init (&bm, granularity, 1);
+
+  if (clear_on_start)
+    return 0;
+
+  fd = open (state_file, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno == ENOENT)
+      return 0;                 /* first run: everything starts clean */
+    nbdkit_error ("open: %s: %m", state_file);
+    return -1;
+  }
+
+  r = read (fd, &hdr, sizeof hdr);
+  if (r != sizeof hdr ||
+      memcmp (hdr.magic, CBT_MAGIC, sizeof hdr.magic) != 0 ||
+      hdr.version != CBT_VERSION) {
+    nbdkit_error ("%s: not an nbdkit CBT state file "
+                  "(remove it or use a different cbt-state)", state_file);
+    close (fd);
+    return -1;
+  }
+  if (hdr.granularity != granularity) {
+    nbdkit_error ("%s: bitmap granularity %" PRIu32 " does not match "
+                  "cbt-granularity %" PRIu32 " (use cbt-clear=true to "
+                  "start a new bitmap)",
+                  state_file, hdr.granularity, granularity);
+    close (fd);
+    return -1;
+  }
+
+  saved_virtual_size = hdr.virtual_size;
+  saved_bits_size =
+    DIV_ROUND_UP (hdr.virtual_size, granularity * UINT64_C (8));
+  saved_bits = malloc (saved_bits_size ? saved_bits_size : 1);
+  if (saved_bits == NULL) {
+    nbdkit_error ("malloc: %m");
+    close (fd);
+    return -1;
+  }
+  r = read (fd, saved_bits, saved_bits_size);
+  close (fd);
+  if (r != saved_bits_size) {
+    nbdkit_error ("%s: truncated CBT state file "
+                  "(remove it or use cbt-clear=true)", state_file);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Checkpoint the bitmap to the state file (write to a temporary file
+ * and rename, so a crash mid-checkpoint leaves the old state intact).
+ * Called with the lock held.
+ */
+static int
+checkpoint (void)
+{
+  CLEANUP_FREE char *tmp = NULL;
+  int fd;
+  struct cbt_header hdr;
+
+  if (asprintf (&tmp, "%s.tmp", state_file) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+
+  fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", tmp);
+    return -1;
+  }
+
+  memset (&hdr, 0, sizeof hdr);
+  memcpy (hdr.magic, CBT_MAGIC, sizeof hdr.magic);
+  hdr.version = CBT_VERSION;
+  hdr.granularity = granularity;
+  hdr.virtual_size = disk_size;
+
+  if (write (fd, &hdr, sizeof hdr) != sizeof hdr ||
+      (bm.size > 0 && write (fd, bm.bitmap, bm.size) != bm.size) ||
+      fdatasync (fd) == -1) {
+    nbdkit_error ("write: %s: %m", tmp);
+    close (fd);
+    unlink (tmp);
+    return -1;
+  }
+  if (close (fd) == -1) {
+    nbdkit_error ("close: %s: %m", tmp);
+    unlink (tmp);
+    return -1;
+  }
+
+  if (rename (tmp, state_file) == -1) {
+    nbdkit_error ("rename: %s -> %s: %m", tmp, state_file);
+    unlink (tmp);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Size the bitmap to the disk and apply any bits recovered from the
+ * state file.  Blocks beyond the previously tracked size are marked
+ * dirty: they did not exist at the last checkpoint, so no backup can
+ * have seen them.
+ */
+static int
+cbt_prepare (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+             void *handle, int readonly)
+{
+  int64_t size;
+
+  size = next_ops->get_size (nxdata);
+  if (size == -1)
+    return -1;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  if ((uint64_t) size > disk_size) {
+    const uint64_t old_size = disk_size;
+
+    if (bitmap_resize (&bm, size) == -1)
+      return -1;
+    disk_size = size;
+    if (old_size > 0 && saved_bits == NULL)
+      bitmap_set_range_blk (&bm, old_size / granularity,
+                            DIV_ROUND_UP (disk_size, granularity)
+                            - old_size / granularity,
+                            1);
+  }
+
+  if (saved_bits) {
+    memcpy (bm.bitmap, saved_bits, MIN (saved_bits_size, bm.size));
+    if (disk_size > saved_virtual_size)
+      bitmap_set_range_blk (&bm, saved_virtual_size / granularity,
+                            DIV_ROUND_UP (disk_size, granularity)
+                            - saved_virtual_size / granularity,
+                            1);
+    free (saved_bits);
+    saved_bits = NULL;
+  }
+
+  return 0;
+}
+
+/* Persist the bitmap on clean connection shutdown. */
+static int
+cbt_finalize (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+              void *handle)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  return checkpoint ();
+}
+
+static void
+mark_dirty (uint64_t offset, uint32_t count)
+{
+  const uint64_t blk = offset / granularity;
+  const uint64_t n =
+    DIV_ROUND_UP (offset + count, (uint64_t) granularity) - blk;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  bitmap_set_range_blk (&bm, blk, n, 1);
+}
+
+static int
+cbt_pwrite (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+            void *handle,
+            const void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags, int *err)
+{
+  int r;
+
+  r = next_ops->pwrite (nxdata, buf, count, offset, flags, err);
+  if (r == 0)
+    mark_dirty (offset, count);
+  return r;
+}
+
+static int
+cbt_zero (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+          void *handle,
+          uint32_t count, uint64_t offset, uint32_t flags, int *err)
+{
+  int r;
+
+  r = next_ops->zero (nxdata, count, offset, flags, err);
+  if (r == 0)
+    mark_dirty (offset, count);
+  return r;
+}
+
+static int
+cbt_trim (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+          void *handle,
+          uint32_t count, uint64_t offset, uint32_t flags, int *err)
+{
+  int r;
+
+  r = next_ops->trim (nxdata, count, offset, flags, err);
+  if (r == 0)
+    mark_dirty (offset, count);
+  return r;
+}
+
+/* Checkpoint after a successful flush: once the plugin data is
+ * durable the bitmap covering it may be persisted too.  Checkpointing
+ * only here (and at shutdown) means a crash can leave blocks
+ * spuriously dirty but never spuriously clean.
+ */
+static int
+cbt_flush (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+           void *handle, uint32_t flags, int *err)
+{
+  int r;
+
+  r = next_ops->flush (nxdata, flags, err);
+  if (r == 0) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    if (checkpoint () == -1) {
+      *err = errno;
+      return -1;
+    }
+  }
+  return r;
+}
+
+static const char *
+cbt_dirty_bitmap (void)
+{
+  return context_name;
+}
+
+/* Answer NBD_CMD_BLOCK_STATUS for the qemu:dirty-bitmap:NAME context.
+ * Extent type bit 0 means dirty, matching NBD_STATE_DIRTY.
+ */
+static int
+cbt_dirty_extents (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+                   void *handle, uint32_t count, uint64_t offset,
+                   uint32_t flags, struct nbdkit_extents *extents, int *err)
+{
+  const uint64_t end = offset + count;
+  uint64_t pos = offset;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  while (pos < end) {
+    const uint64_t blk = pos / granularity;
+    const unsigned dirty = bitmap_get_blk (&bm, blk, 1);
+    int64_t next_blk;
+    uint64_t run_end;
+
+    /* Find where the current run of equal bits ends. */
+    if (dirty)
+      next_blk = bitmap_next_zero (&bm, blk);
+    else
+      next_blk = bitmap_next (&bm, blk);
+    if (next_blk == -1)
+      run_end = end;
+    else
+      run_end = MIN (end, (uint64_t) next_blk * granularity);
+
+    if (nbdkit_add_extent (extents, pos, run_end - pos,
+                           dirty ? 1 : 0) == -1) {
+      *err = errno;
+      return -1;
+    }
+
+    if (flags & NBDKIT_FLAG_REQ_ONE)
+      break;
+    pos = run_end;
+  }
+
+  return 0;
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "cbt",
+  .longname          = "nbdkit changed block tracking filter",
+  .unload            = cbt_unload,
+  .config            = cbt_config,
+  .config_complete   = cbt_config_complete,
+  .config_help       = cbt_config_help,
+  .get_ready         = cbt_get_ready,
+  .prepare           = cbt_prepare,
+  .finalize          = cbt_finalize,
+  .pwrite            = cbt_pwrite,
+  .zero              = cbt_zero,
+  .trim              = cbt_trim,
+  .flush             = cbt_flush,
+  .dirty_bitmap      = cbt_dirty_bitmap,
+  .dirty_extents     = cbt_dirty_extents,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
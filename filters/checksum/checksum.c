@@ -0,0 +1,763 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* End-to-end integrity checking.  The filter keeps a CRC-32C checksum
+ * per block, verifies it on every read and updates it on every write,
+ * so corruption introduced anywhere below the filter (plugin, storage,
+ * controller) turns into an EIO instead of silently reaching the
+ * client.  Checksums are kept in memory and persisted to a sidecar
+ * file (checksum-file=PATH) at clean shutdown.
+ *
+ * Blocks whose checksum is not (yet) known are checksummed on first
+ * read or write, so the filter can be put in front of a disk with
+ * existing content.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "bitmap.h"
+#include "cleanup.h"
+#include "isaligned.h"
+#include "ispowerof2.h"
+#include "minmax.h"
+
+#include "crc32c.h"
+
+static char *csum_path;         /* checksum-file=PATH */
+static unsigned blksize = 65536; /* checksum-blocksize */
+
+/* Per-block checksums and the bitmap of blocks whose checksum is
+ * known.  Both are protected by meta_lock, which is always acquired
+ * after the block's stripe lock (same ordering as the cache filter).
+ */
+static uint32_t *crcs;
+static struct bitmap valid;
+static uint64_t nr_blocks;
+static uint64_t size;
+static uint32_t crc_zero_blk;   /* CRC of a whole zeroed block */
+static bool loaded;             /* checksums restored from the sidecar */
+
+#define NR_LOCK_STRIPES 64
+static pthread_mutex_t stripe_lock[NR_LOCK_STRIPES];
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline pthread_mutex_t *
+blk_stripe_lock (uint64_t blknum)
+{
+  return &stripe_lock[blknum % NR_LOCK_STRIPES];
+}
+
+/* Stats, logged at unload, updated under meta_lock. */
+static uint64_t verified, established, mismatches;
+
+/* Sidecar file format: header, then the checksum array, then the
+ * valid bitmap.  Host byte order; the file is only meant to survive
+ * restarts on the same machine, like the cache filter's metadata.
+ */
+#define CSUM_MAGIC "NBDKITCHECKSUMS"
+#define CSUM_VERSION 1
+
+struct csum_header {
+  char magic[16];               /* CSUM_MAGIC */
+  uint32_t version;             /* CSUM_VERSION */
+  uint32_t blksize;             /* block size when saved */
+  uint64_t size;                /* device size when saved */
+  uint32_t clean;               /* nonzero = written at clean shutdown */
+  uint32_t unused;              /* padding, must be zero */
+};
+
+static void
+checksum_load (void)
+{
+  size_t i;
+
+  crc32c_init ();
+  bitmap_init (&valid, blksize, 1 /* bits per block */);
+  for (i = 0; i < NR_LOCK_STRIPES; ++i)
+    pthread_mutex_init (&stripe_lock[i], NULL);
+}
+
+/* Read or write the sidecar file completely, coping with short reads
+ * and writes.
+ */
+static int
+full_pread (int fd, void *buf, size_t count, off_t offset)
+{
+  while (count > 0) {
+    ssize_t r = pread (fd, buf, count, offset);
+    if (r <= 0)
+      return -1;
+    buf = (char *) buf + r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+static int
+full_pwrite (int fd, const void *buf, size_t count, off_t offset)
+{
+  while (count > 0) {
+    ssize_t r = pwrite (fd, buf, count, offset);
+    if (r == -1)
+      return -1;
+    buf = (const char *) buf + r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+/* Try to restore the checksums from the sidecar file.  Any failure
+ * just means we start with no known checksums, which is always safe.
+ */
+static void
+csum_load_file (void)
+{
+  struct csum_header hdr;
+  int fd;
+
+  fd = open (csum_path, O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
+    nbdkit_debug ("checksum: %s: %m (starting with no checksums)",
+                  csum_path);
+    return;
+  }
+
+  if (full_pread (fd, &hdr, sizeof hdr, 0) == -1 ||
+      memcmp (hdr.magic, CSUM_MAGIC, sizeof hdr.magic) != 0 ||
+      hdr.version != CSUM_VERSION) {
+    nbdkit_debug ("checksum: unrecognized checksum file, ignoring it");
+    close (fd);
+    return;
+  }
+  if (!hdr.clean) {
+    nbdkit_debug ("checksum: checksum file was not written at clean "
+                  "shutdown, ignoring it");
+    close (fd);
+    return;
+  }
+  if (hdr.blksize != blksize || hdr.size != size) {
+    nbdkit_debug ("checksum: block size or device size changed, "
+                  "ignoring saved checksums");
+    close (fd);
+    return;
+  }
+
+  if (full_pread (fd, crcs, nr_blocks * sizeof crcs[0], sizeof hdr) == -1 ||
+      full_pread (fd, valid.bitmap, valid.size,
+                  sizeof hdr + nr_blocks * sizeof crcs[0]) == -1) {
+    nbdkit_debug ("checksum: short read of checksum file, ignoring it");
+    memset (crcs, 0, nr_blocks * sizeof crcs[0]);
+    bitmap_clear (&valid);
+    close (fd);
+    return;
+  }
+
+  /* Mark the file as in use, so that a crash leaves it invalid rather
+   * than stale.  It is rewritten at clean shutdown.
+   */
+  hdr.clean = 0;
+  if (full_pwrite (fd, &hdr, sizeof hdr, 0) == -1 ||
+      fdatasync (fd) == -1)
+    nbdkit_debug ("checksum: failed to update checksum file header: %m");
+  close (fd);
+
+  loaded = true;
+  nbdkit_debug ("checksum: restored checksums for %" PRIu64 " blocks",
+                nr_blocks);
+}
+
+/* Write the sidecar file at clean shutdown.  Failure is not fatal,
+ * the next run simply starts with no known checksums.
+ */
+static void
+csum_save_file (void)
+{
+  struct csum_header hdr = {
+    .version = CSUM_VERSION,
+    .blksize = blksize,
+    .size = size,
+    .clean = 1,
+  };
+  CLEANUP_FREE char *tmp_path = NULL;
+  int fd;
+
+  /* If the size was never set then no connection was made and
+   * nothing changed; any checksum file on disk is still valid.
+   */
+  if (size == 0)
+    return;
+
+  memcpy (hdr.magic, CSUM_MAGIC, sizeof hdr.magic);
+
+  /* Write to a temporary file and rename it into place, so there is
+   * never a half-written checksum file.
+   */
+  if (asprintf (&tmp_path, "%s.tmp", csum_path) == -1)
+    return;
+  fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", tmp_path);
+    return;
+  }
+  if (full_pwrite (fd, &hdr, sizeof hdr, 0) == -1 ||
+      full_pwrite (fd, crcs, nr_blocks * sizeof crcs[0], sizeof hdr) == -1 ||
+      full_pwrite (fd, valid.bitmap, valid.size,
+                   sizeof hdr + nr_blocks * sizeof crcs[0]) == -1 ||
+      fdatasync (fd) == -1) {
+    nbdkit_error ("write: %s: %m", tmp_path);
+    close (fd);
+    unlink (tmp_path);
+    return;
+  }
+  if (close (fd) == -1 || rename (tmp_path, csum_path) == -1) {
+    nbdkit_error ("rename: %s: %m", csum_path);
+    unlink (tmp_path);
+  }
+}
+
+static void
+checksum_unload (void)
+{
+  csum_save_file ();
+
+  nbdkit_debug ("checksum: %" PRIu64 " blocks verified, "
+                "%" PRIu64 " checksums established, "
+                "%" PRIu64 " mismatches",
+                verified, established, mismatches);
+
+  free (crcs);
+  bitmap_free (&valid);
+  free (csum_path);
+}
+
+static int
+checksum_config (nbdkit_next_config *next, void *nxdata,
+                 const char *key, const char *value)
+{
+  if (strcmp (key, "checksum-file") == 0) {
+    free (csum_path);
+    csum_path = nbdkit_absolute_path (value);
+    if (csum_path == NULL)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "checksum-blocksize") == 0) {
+    int64_t r;
+
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r < 4096 || r > 16*1024*1024 || !is_power_of_2 (r)) {
+      nbdkit_error ("checksum-blocksize must be a power of 2 "
+                    "between 4K and 16M");
+      return -1;
+    }
+    blksize = r;
+    return 0;
+  }
+  else {
+    return next (nxdata, key, value);
+  }
+}
+
+#define checksum_config_help \
+  "checksum-file=PATH        File storing the checksums across restarts\n" \
+  "                          (required).\n" \
+  "checksum-blocksize=SIZE   Checksum block size (default 64K).\n"
+
+static int
+checksum_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  if (csum_path == NULL) {
+    nbdkit_error ("checksum-file parameter is required");
+    return -1;
+  }
+
+  return next (nxdata);
+}
+
+/* (Re-)size the checksum array.  Called with all stripe locks held. */
+static int
+csum_set_size (uint64_t new_size)
+{
+  uint64_t new_nr_blocks = (new_size + blksize - 1) / blksize;
+  uint32_t *np;
+  bool first_time = size == 0;
+
+  np = realloc (crcs, new_nr_blocks * sizeof crcs[0]);
+  if (np == NULL && new_nr_blocks > 0) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  crcs = np;
+  if (new_nr_blocks > nr_blocks)
+    memset (&crcs[nr_blocks], 0,
+            (new_nr_blocks - nr_blocks) * sizeof crcs[0]);
+  if (bitmap_resize (&valid, new_size) == -1)
+    return -1;
+  nr_blocks = new_nr_blocks;
+  size = new_size;
+
+  if (first_time) {
+    CLEANUP_FREE uint8_t *zeroes = calloc (1, blksize);
+
+    if (zeroes == NULL) {
+      nbdkit_error ("calloc: %m");
+      return -1;
+    }
+    crc_zero_blk = crc32c (zeroes, blksize);
+
+    csum_load_file ();
+  }
+  else if (loaded && !first_time)
+    /* Size changed under us: checksums for blocks past the old end
+     * are unknown, which the zeroed extension already expresses.
+     */
+    nbdkit_debug ("checksum: device resized to %" PRIu64, new_size);
+
+  return 0;
+}
+
+/* Get the file size, set the checksum array size. */
+static int64_t
+checksum_get_size (struct nbdkit_next_ops *next_ops, void *nxdata,
+                   void *handle)
+{
+  int64_t r;
+  size_t i;
+  int rv;
+
+  r = next_ops->get_size (nxdata);
+  if (r == -1)
+    return -1;
+
+  for (i = 0; i < NR_LOCK_STRIPES; ++i)
+    pthread_mutex_lock (&stripe_lock[i]);
+  rv = size == (uint64_t) r ? 0 : csum_set_size (r);
+  for (i = NR_LOCK_STRIPES; i > 0; --i)
+    pthread_mutex_unlock (&stripe_lock[i-1]);
+  if (rv == -1)
+    return -1;
+
+  return r;
+}
+
+/* Force an early call to checksum_get_size because we have to set the
+ * checksum array size before any other read or write calls.
+ */
+static int
+checksum_prepare (struct nbdkit_next_ops *next_ops, void *nxdata,
+                  void *handle, int readonly)
+{
+  int64_t r;
+
+  r = checksum_get_size (next_ops, nxdata, handle);
+  if (r < 0)
+    return -1;
+  return 0;
+}
+
+/* Read one block from the plugin and verify it (or establish its
+ * checksum on first sight).  Called with the stripe lock held.  The
+ * buffer must be blksize bytes; the tail of the last block is zeroed.
+ */
+static int
+blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
+          uint64_t blknum, uint8_t *block, int *err)
+{
+  uint64_t offset = blknum * blksize;
+  uint64_t n = MIN ((uint64_t) blksize, size - offset);
+  uint32_t crc;
+
+  if (next_ops->pread (nxdata, block, n, offset, 0, err) == -1)
+    return -1;
+  if (n < blksize)
+    memset (&block[n], 0, blksize - n);
+
+  crc = crc32c (block, n);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+  if (bitmap_get_blk (&valid, blknum, 0)) {
+    if (crcs[blknum] != crc) {
+      mismatches++;
+      nbdkit_error ("checksum: corruption detected at offset %" PRIu64 " "
+                    "(block %" PRIu64 "): "
+                    "expected crc32c 0x%08" PRIx32 ", "
+                    "read data has 0x%08" PRIx32,
+                    offset, blknum, crcs[blknum], crc);
+      *err = EIO;
+      return -1;
+    }
+    verified++;
+  }
+  else {
+    crcs[blknum] = crc;
+    bitmap_set_blk (&valid, blknum, 1);
+    established++;
+  }
+
+  return 0;
+}
+
+/* Write one block through to the plugin and update its checksum.
+ * Called with the stripe lock held.
+ */
+static int
+blk_write (struct nbdkit_next_ops *next_ops, void *nxdata,
+           uint64_t blknum, const uint8_t *block, uint32_t flags, int *err)
+{
+  uint64_t offset = blknum * blksize;
+  uint64_t n = MIN ((uint64_t) blksize, size - offset);
+  uint32_t crc;
+
+  crc = crc32c (block, n);
+
+  if (next_ops->pwrite (nxdata, block, n, offset, flags, err) == -1) {
+    /* The on-disk state is now unknown. */
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+    bitmap_set_blk (&valid, blknum, 0);
+    return -1;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+  crcs[blknum] = crc;
+  bitmap_set_blk (&valid, blknum, 1);
+
+  return 0;
+}
+
+/* Record the checksum for a block we know the plugin zeroed.  Called
+ * with the stripe lock held.
+ */
+static void
+blk_set_zero (uint64_t blknum)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+  crcs[blknum] = crc_zero_blk;
+  bitmap_set_blk (&valid, blknum, 1);
+}
+
+/* Forget the checksum for a block.  Called with the stripe lock
+ * held.
+ */
+static void
+blk_invalidate (uint64_t blknum)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&meta_lock);
+  bitmap_set_blk (&valid, blknum, 0);
+}
+
+/* Read data. */
+static int
+checksum_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+                void *handle, void *buf, uint32_t count, uint64_t offset,
+                uint32_t flags, int *err)
+{
+  CLEANUP_FREE uint8_t *block = NULL;
+  uint64_t blknum, blkoffs;
+  int r;
+
+  assert (!flags);
+  block = malloc (blksize);
+  if (block == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  blknum = offset / blksize;  /* block number */
+  blkoffs = offset % blksize; /* offset within the block */
+
+  /* Unaligned head */
+  if (blkoffs) {
+    uint64_t n = MIN (blksize - blkoffs, count);
+
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r == -1)
+      return -1;
+
+    memcpy (buf, &block[blkoffs], n);
+
+    buf += n;
+    count -= n;
+    offset += n;
+    blknum++;
+  }
+
+  /* Aligned body.  Reads still go through the bounce buffer so that
+   * the whole block is available to checksum.
+   */
+  while (count >= blksize) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r == -1)
+      return -1;
+
+    memcpy (buf, block, blksize);
+
+    buf += blksize;
+    count -= blksize;
+    offset += blksize;
+    blknum++;
+  }
+
+  /* Unaligned tail */
+  if (count) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r == -1)
+      return -1;
+
+    memcpy (buf, block, count);
+  }
+
+  return 0;
+}
+
+/* Write data. */
+static int
+checksum_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
+                 void *handle, const void *buf, uint32_t count,
+                 uint64_t offset, uint32_t flags, int *err)
+{
+  CLEANUP_FREE uint8_t *block = NULL;
+  uint64_t blknum, blkoffs;
+  int r;
+
+  if (!IS_ALIGNED (count | offset, blksize)) {
+    block = malloc (blksize);
+    if (block == NULL) {
+      *err = errno;
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+  }
+
+  blknum = offset / blksize;  /* block number */
+  blkoffs = offset % blksize; /* offset within the block */
+
+  /* Unaligned head */
+  if (blkoffs) {
+    uint64_t n = MIN (blksize - blkoffs, count);
+
+    /* Do a read-modify-write operation on the current block.  The
+     * read also verifies the old content, so corruption in the
+     * untouched part of the block is caught before it is
+     * re-checksummed.  Hold the lock over the whole operation.
+     */
+    assert (block);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r != -1) {
+      memcpy (&block[blkoffs], buf, n);
+      r = blk_write (next_ops, nxdata, blknum, block, flags, err);
+    }
+    if (r == -1)
+      return -1;
+
+    buf += n;
+    count -= n;
+    offset += n;
+    blknum++;
+  }
+
+  /* Aligned body */
+  while (count >= blksize) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_write (next_ops, nxdata, blknum, buf, flags, err);
+    if (r == -1)
+      return -1;
+
+    buf += blksize;
+    count -= blksize;
+    offset += blksize;
+    blknum++;
+  }
+
+  /* Unaligned tail */
+  if (count) {
+    assert (block);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r != -1) {
+      memcpy (block, buf, count);
+      r = blk_write (next_ops, nxdata, blknum, block, flags, err);
+    }
+    if (r == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Zero data. */
+static int
+checksum_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
+               void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+               int *err)
+{
+  CLEANUP_FREE uint8_t *block = NULL;
+  uint64_t blknum, blkoffs;
+  int r;
+
+  /* Unaligned edges are zeroed with read-modify-write, which is not
+   * fast.
+   */
+  if ((flags & NBDKIT_FLAG_FAST_ZERO) &&
+      !IS_ALIGNED (count | offset, blksize)) {
+    *err = ENOTSUP;
+    return -1;
+  }
+
+  if (!IS_ALIGNED (count | offset, blksize)) {
+    block = malloc (blksize);
+    if (block == NULL) {
+      *err = errno;
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+  }
+
+  blknum = offset / blksize;  /* block number */
+  blkoffs = offset % blksize; /* offset within the block */
+
+  /* Unaligned head */
+  if (blkoffs) {
+    uint64_t n = MIN (blksize - blkoffs, count);
+
+    assert (block);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r != -1) {
+      memset (&block[blkoffs], 0, n);
+      r = blk_write (next_ops, nxdata, blknum, block, flags, err);
+    }
+    if (r == -1)
+      return -1;
+
+    count -= n;
+    offset += n;
+    blknum++;
+  }
+
+  /* Aligned body */
+  while (count >= blksize) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    if (next_ops->zero (nxdata, blksize, offset, flags, err) == -1) {
+      blk_invalidate (blknum);
+      return -1;
+    }
+    blk_set_zero (blknum);
+
+    count -= blksize;
+    offset += blksize;
+    blknum++;
+  }
+
+  /* Unaligned tail */
+  if (count) {
+    assert (block);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r != -1) {
+      memset (block, 0, count);
+      r = blk_write (next_ops, nxdata, blknum, block, flags, err);
+    }
+    if (r == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Trim data.  After a trim the content is undefined, so forget the
+ * checksum for every touched block and pass the trim through.
+ */
+static int
+checksum_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
+               void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+               int *err)
+{
+  uint64_t blknum = offset / blksize;
+
+  while (count > 0) {
+    uint64_t blkoffs = offset % blksize;
+    uint64_t n = MIN (blksize - blkoffs, count);
+
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    blk_invalidate (blknum);
+    if (next_ops->trim (nxdata, n, offset, flags, err) == -1)
+      return -1;
+
+    count -= n;
+    offset += n;
+    blknum++;
+  }
+
+  return 0;
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "checksum",
+  .longname          = "nbdkit block checksum filter",
+  .load              = checksum_load,
+  .unload            = checksum_unload,
+  .config            = checksum_config,
+  .config_complete   = checksum_config_complete,
+  .config_help       = checksum_config_help,
+  .prepare           = checksum_prepare,
+  .get_size          = checksum_get_size,
+  .pread             = checksum_pread,
+  .pwrite            = checksum_pwrite,
+  .zero              = checksum_zero,
+  .trim              = checksum_trim,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
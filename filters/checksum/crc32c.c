@@ -0,0 +1,110 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+/* Software fallback, one table lookup per byte (reflected polynomial
+ * 0x82F63B78), in the style of common/gpt/efi-crc32.c but with the
+ * table computed at load time.
+ */
+static uint32_t crc_table[256];
+
+static uint32_t
+crc32c_sw (uint32_t crc, const uint8_t *buf, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; ++i)
+    crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+static uint32_t (*crc32c_impl) (uint32_t crc, const uint8_t *buf, size_t len)
+  = crc32c_sw;
+
+#if defined(__x86_64__)
+/* Hardware implementation using the SSE4.2 crc32 instruction, 8
+ * bytes per instruction.  Only called if crc32c_init found the CPU
+ * supports it.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw (uint32_t crc, const uint8_t *buf, size_t len)
+{
+  uint64_t crc64 = crc;
+
+  while (len >= 8) {
+    uint64_t v;
+    memcpy (&v, buf, 8);
+    crc64 = __builtin_ia32_crc32di (crc64, v);
+    buf += 8;
+    len -= 8;
+  }
+  crc = crc64;
+  while (len > 0) {
+    crc = __builtin_ia32_crc32qi (crc, *buf);
+    buf++;
+    len--;
+  }
+  return crc;
+}
+#endif /* __x86_64__ */
+
+void
+crc32c_init (void)
+{
+  uint32_t i, j, c;
+
+  for (i = 0; i < 256; ++i) {
+    c = i;
+    for (j = 0; j < 8; ++j)
+      c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+    crc_table[i] = c;
+  }
+
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports ("sse4.2"))
+    crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t
+crc32c (const void *buf, size_t len)
+{
+  return crc32c_impl (0xffffffff, buf, len) ^ 0xffffffff;
+}
@@ -34,12 +34,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <errno.h>
 
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
+#include "firstdiff.h"
 #include "iszero.h"
 #include "minmax.h"
 
@@ -116,6 +119,12 @@ data_does_not_match (int *err)
   return -1;
 }
 
+/* Chunk size for reading back and comparing.  Small enough that the
+ * data just read is still in cache when we compare it, large enough
+ * to amortize the per-request cost of the underlying pread.
+ */
+#define VERIFY_CHUNK_SIZE (2 * 1024 * 1024)
+
 /* Provide write-like operations which perform the additional checks. */
 static int
 checkwrite_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
@@ -123,22 +132,41 @@ checkwrite_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
                    const void *buf, uint32_t count, uint64_t offset,
                    uint32_t flags, int *err)
 {
+  const char *pbuf = buf;
   CLEANUP_FREE char *expected;
 
-  expected = malloc (count);
+  expected = malloc (MIN (VERIFY_CHUNK_SIZE, count));
   if (expected == NULL) {
     *err = errno;
     nbdkit_error ("malloc: %m");
     return -1;
   }
 
-  /* Read underlying plugin data into the buffer. */
-  if (next_ops->pread (nxdata, expected, count, offset, 0, err) == -1)
-    return -1;
+  /* Read back the underlying plugin data a chunk at a time and
+   * compare, so the comparison runs over data which is still hot in
+   * cache.  The compare itself is the vectorized first_diff, which
+   * also tells us where the mismatch is.
+   */
+  while (count > 0) {
+    const uint32_t n = MIN (VERIFY_CHUNK_SIZE, count);
+    size_t d;
+
+    if (next_ops->pread (nxdata, expected, n, offset, 0, err) == -1)
+      return -1;
 
-  /* If data written doesn't match data expected, inject EIO. */
-  if (memcmp (buf, expected, count) != 0)
-    return data_does_not_match (err);
+    /* If data written doesn't match data expected, inject EIO. */
+    d = first_diff (pbuf, expected, n);
+    if (d != n) {
+      *err = EIO;
+      nbdkit_error ("data written does not match expected "
+                    "at offset %" PRIu64, offset + d);
+      return -1;
+    }
+
+    pbuf += n;
+    offset += n;
+    count -= n;
+  }
 
   return 0;
 }
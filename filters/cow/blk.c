@@ -60,10 +60,12 @@
  * temporary file, setting the bit in the bitmap.  (Writing zeroes is
  * handled the same way.)
  *
- * When trimming we set the trimmed flag in the bitmap for whole
- * blocks, and handle the unaligned portions like writing zeroes
- * above.  We could punch holes in the overlay as an optimization, but
- * for simplicity we do not do that yet.
+ * When trimming or writing zeroes we set the trimmed flag in the
+ * bitmap for whole blocks and punch a hole in the overlay so the
+ * range stops consuming space, handling the unaligned portions like
+ * writing zeroes above.  Trimmed blocks are served as zeroes from the
+ * bitmap alone, so reads of them touch neither the overlay file nor
+ * the plugin.
  *
  * Since the overlay is a deleted temporary file, we can ignore FUA
  * and flush commands.
@@ -107,6 +109,34 @@
 /* The temporary overlay. */
 static int fd = -1;
 
+/* Persistent overlay (cow-file=...).  The overlay lives in the named
+ * file instead of an unlinked temporary, and the block bitmap is
+ * saved to a metadata file next to it (<cow-file>.meta) on clean
+ * shutdown so a restarted nbdkit can reattach to the overlay and keep
+ * previous guest writes.
+ *
+ * The metadata header and bitmap are stored in host byte order; the
+ * overlay is not portable between machines, it is only meant to
+ * survive restarts on the same one.
+ */
+static char *meta_path;         /* <cow-file>.meta, NULL if not persistent */
+static bool loaded_bitmap;      /* bitmap was restored from the metadata */
+static uint64_t loaded_size;    /* device size recorded in the metadata */
+static uint64_t generation;     /* bumped every time the overlay is reused */
+
+#define COW_META_MAGIC "NBDKITCOWOVERLAY"
+#define COW_META_VERSION 1
+
+struct meta_header {
+  char magic[16];               /* COW_META_MAGIC */
+  uint32_t version;             /* COW_META_VERSION */
+  uint32_t blksize;             /* block size when saved */
+  uint64_t size;                /* device size when saved */
+  uint64_t generation;          /* bumped on every reuse */
+  uint32_t clean;               /* nonzero = written at clean shutdown */
+  uint32_t unused;              /* padding, must be zero */
+};
+
 /* This lock protects the bitmap from parallel access. */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -130,68 +160,279 @@ state_to_string (enum bm_entry state)
   }
 }
 
+/* Because blk_set_size is called before the other blk_* functions
+ * this should be set to the true size before we need it.
+ */
+static uint64_t size = 0;
+
+/* Read or write the metadata file completely, coping with short
+ * reads and writes.
+ */
+static int
+full_pread (int fd2, void *buf, size_t count, off_t offset)
+{
+  while (count > 0) {
+    ssize_t r = pread (fd2, buf, count, offset);
+    if (r <= 0)
+      return -1;
+    buf = (char *) buf + r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+static int
+full_pwrite (int fd2, const void *buf, size_t count, off_t offset)
+{
+  while (count > 0) {
+    ssize_t r = pwrite (fd2, buf, count, offset);
+    if (r == -1)
+      return -1;
+    buf = (const char *) buf + r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+/* Try to restore the bitmap from the metadata file.  Any failure
+ * just means we start with an empty overlay, which loses previous
+ * writes but is always consistent.
+ */
+static void
+blk_load_meta (void)
+{
+  struct meta_header hdr;
+  int mfd;
+
+  mfd = open (meta_path, O_RDWR | O_CLOEXEC);
+  if (mfd == -1) {
+    nbdkit_debug ("cow: %s: %m (starting with an empty overlay)", meta_path);
+    return;
+  }
+
+  if (full_pread (mfd, &hdr, sizeof hdr, 0) == -1 ||
+      memcmp (hdr.magic, COW_META_MAGIC, sizeof hdr.magic) != 0 ||
+      hdr.version != COW_META_VERSION) {
+    nbdkit_debug ("cow: unrecognized metadata file, "
+                  "starting with an empty overlay");
+    close (mfd);
+    return;
+  }
+
+  if (!hdr.clean) {
+    nbdkit_debug ("cow: overlay was not shut down cleanly, "
+                  "starting with an empty overlay");
+    close (mfd);
+    return;
+  }
+
+  if (hdr.blksize != BLKSIZE) {
+    nbdkit_debug ("cow: block size changed (%" PRIu32 " -> %d), "
+                  "starting with an empty overlay", hdr.blksize, BLKSIZE);
+    close (mfd);
+    return;
+  }
+
+  if (bitmap_resize (&bm, hdr.size) == -1) {
+    close (mfd);
+    return;
+  }
+  if (full_pread (mfd, bm.bitmap, bm.size, sizeof hdr) == -1) {
+    nbdkit_debug ("cow: short read of metadata bitmap, "
+                  "starting with an empty overlay");
+    bitmap_clear (&bm);
+    close (mfd);
+    return;
+  }
+
+  loaded_bitmap = true;
+  loaded_size = hdr.size;
+  generation = hdr.generation + 1;
+  nbdkit_debug ("cow: restored overlay state (generation %" PRIu64 ")",
+                generation);
+  close (mfd);
+}
+
+/* Mark any existing metadata as in use just before the overlay
+ * contents can first change, so that a crash leaves the metadata
+ * invalid rather than stale: the next run then starts with an empty
+ * overlay instead of trusting a bitmap which no longer matches the
+ * overlay contents.
+ */
+static void
+blk_mark_meta_in_use (void)
+{
+  struct meta_header hdr;
+  int mfd;
+
+  mfd = open (meta_path, O_RDWR | O_CLOEXEC);
+  if (mfd == -1)
+    return;
+  if (full_pread (mfd, &hdr, sizeof hdr, 0) == 0 &&
+      memcmp (hdr.magic, COW_META_MAGIC, sizeof hdr.magic) == 0 &&
+      hdr.clean) {
+    hdr.clean = 0;
+    hdr.generation = generation;
+    if (full_pwrite (mfd, &hdr, sizeof hdr, 0) == -1 ||
+        fdatasync (mfd) == -1)
+      nbdkit_debug ("cow: failed to update metadata header: %m");
+  }
+  close (mfd);
+}
+
+/* Write the metadata file at clean shutdown.  Failure is not fatal,
+ * the next run simply starts with an empty overlay.
+ */
+static void
+blk_save_meta (void)
+{
+  struct meta_header hdr = {
+    .version = COW_META_VERSION,
+    .blksize = BLKSIZE,
+    .size = size,
+    .generation = generation,
+    .clean = 1,
+  };
+  CLEANUP_FREE char *tmp_path = NULL;
+  int mfd;
+
+  /* If the size was never set then no connection was made and the
+   * overlay was not touched; any metadata on disk is still valid.
+   */
+  if (size == 0)
+    return;
+
+  memcpy (hdr.magic, COW_META_MAGIC, sizeof hdr.magic);
+
+  /* Make sure the overlay blocks are on disk before the metadata
+   * claims they are valid.
+   */
+  if (fsync (fd) == -1) {
+    nbdkit_error ("fsync: %s: %m", cow_path);
+    return;
+  }
+
+  /* Write the new metadata to a temporary file and rename it into
+   * place, so there is never a half-written metadata file.
+   */
+  if (asprintf (&tmp_path, "%s.tmp", meta_path) == -1)
+    return;
+  mfd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (mfd == -1) {
+    nbdkit_error ("open: %s: %m", tmp_path);
+    return;
+  }
+  if (full_pwrite (mfd, &hdr, sizeof hdr, 0) == -1 ||
+      full_pwrite (mfd, bm.bitmap, bm.size, sizeof hdr) == -1 ||
+      fdatasync (mfd) == -1) {
+    nbdkit_error ("write: %s: %m", tmp_path);
+    close (mfd);
+    unlink (tmp_path);
+    return;
+  }
+  close (mfd);
+  if (rename (tmp_path, meta_path) == -1) {
+    nbdkit_error ("rename: %s: %m", meta_path);
+    unlink (tmp_path);
+    return;
+  }
+
+  nbdkit_debug ("cow: saved overlay state (generation %" PRIu64 ")",
+                generation);
+}
+
 int
 blk_init (void)
 {
-  const char *tmpdir;
-  size_t len;
-  char *template;
-
   bitmap_init (&bm, BLKSIZE, 2 /* bits per block */);
 
-  tmpdir = getenv ("TMPDIR");
-  if (!tmpdir)
-    tmpdir = LARGE_TMPDIR;
+  if (cow_path) {
+    /* Persistent overlay in a named file. */
+    nbdkit_debug ("cow: persistent overlay file: %s", cow_path);
+
+    fd = open (cow_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+      nbdkit_error ("open: %s: %m", cow_path);
+      return -1;
+    }
+    if (asprintf (&meta_path, "%s.meta", cow_path) == -1) {
+      nbdkit_error ("asprintf: %m");
+      return -1;
+    }
+
+    blk_load_meta ();
+  }
+  else {
+    const char *tmpdir;
+    size_t len;
+    char *template;
+
+    tmpdir = getenv ("TMPDIR");
+    if (!tmpdir)
+      tmpdir = LARGE_TMPDIR;
 
-  nbdkit_debug ("cow: temporary directory for overlay: %s", tmpdir);
+    nbdkit_debug ("cow: temporary directory for overlay: %s", tmpdir);
 
-  len = strlen (tmpdir) + 8;
-  template = alloca (len);
-  snprintf (template, len, "%s/XXXXXX", tmpdir);
+    len = strlen (tmpdir) + 8;
+    template = alloca (len);
+    snprintf (template, len, "%s/XXXXXX", tmpdir);
 
 #ifdef HAVE_MKOSTEMP
-  fd = mkostemp (template, O_CLOEXEC);
+    fd = mkostemp (template, O_CLOEXEC);
 #else
-  /* Not atomic, but this is only invoked during .load, so the race
-   * won't affect any plugin actions trying to fork
-   */
-  fd = mkstemp (template);
-  if (fd >= 0) {
-    fd = set_cloexec (fd);
-    if (fd < 0) {
-      int e = errno;
-      unlink (template);
-      errno = e;
+    /* Not atomic, but this is only invoked during .load, so the race
+     * won't affect any plugin actions trying to fork
+     */
+    fd = mkstemp (template);
+    if (fd >= 0) {
+      fd = set_cloexec (fd);
+      if (fd < 0) {
+        int e = errno;
+        unlink (template);
+        errno = e;
+      }
     }
-  }
 #endif
-  if (fd == -1) {
-    nbdkit_error ("mkostemp: %s: %m", tmpdir);
-    return -1;
+    if (fd == -1) {
+      nbdkit_error ("mkostemp: %s: %m", tmpdir);
+      return -1;
+    }
+
+    unlink (template);
   }
 
-  unlink (template);
   return 0;
 }
 
 void
 blk_free (void)
 {
+  if (meta_path && fd >= 0)
+    blk_save_meta ();
+
   if (fd >= 0)
     close (fd);
 
+  free (meta_path);
+
   bitmap_free (&bm);
 }
 
-/* Because blk_set_size is called before the other blk_* functions
- * this should be set to the true size before we need it.
- */
-static uint64_t size = 0;
-
 /* Allocate or resize the overlay file and bitmap. */
 int
 blk_set_size (uint64_t new_size)
 {
+  if (meta_path) {
+    static bool meta_marked = false;
+
+    if (!meta_marked) {
+      blk_mark_meta_in_use ();
+      meta_marked = true;
+    }
+  }
+
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
 
   size = new_size;
@@ -199,6 +440,17 @@ blk_set_size (uint64_t new_size)
   if (bitmap_resize (&bm, size) == -1)
     return -1;
 
+  /* If the device size does not match the size recorded in restored
+   * metadata then the underlying image has probably changed and the
+   * overlay cannot be trusted.
+   */
+  if (loaded_bitmap && size != loaded_size) {
+    nbdkit_debug ("cow: device size changed (%" PRIu64 " -> %" PRIu64 "), "
+                  "discarding restored overlay", loaded_size, size);
+    bitmap_clear (&bm);
+    loaded_bitmap = false;
+  }
+
   if (ftruncate (fd, ROUND_UP (size, BLKSIZE)) == -1) {
     nbdkit_error ("ftruncate: %m");
     return -1;
@@ -333,20 +585,33 @@ blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 
 int
 blk_write (uint64_t blknum, const uint8_t *block, int *err)
+{
+  return blk_write_blocks (blknum, 1, block, err);
+}
+
+int
+blk_write_blocks (uint64_t blknum, uint64_t nrblocks,
+                  const uint8_t *block, int *err)
 {
   off_t offset = blknum * BLKSIZE;
 
-  nbdkit_debug ("cow: blk_write block %" PRIu64 " (offset %" PRIu64 ")",
-                blknum, (uint64_t) offset);
+  nbdkit_debug ("cow: blk_write %" PRIu64 " block(s) starting at %" PRIu64
+                " (offset %" PRIu64 ")",
+                nrblocks, blknum, (uint64_t) offset);
 
-  if (pwrite (fd, block, BLKSIZE, offset) == -1) {
+  /* Because we always overwrite the whole of each block, we never
+   * need to read from the plugin here, even for blocks which have not
+   * been copied to the overlay yet.  One pwrite covers the whole run
+   * of blocks.
+   */
+  if (pwrite (fd, block, nrblocks * BLKSIZE, offset) == -1) {
     *err = errno;
     nbdkit_error ("pwrite: %m");
     return -1;
   }
 
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  bitmap_set_blk (&bm, blknum, BLOCK_ALLOCATED);
+  bitmap_set_range_blk (&bm, blknum, nrblocks, BLOCK_ALLOCATED);
 
   return 0;
 }
@@ -354,16 +619,52 @@ blk_write (uint64_t blknum, const uint8_t *block, int *err)
 int
 blk_trim (uint64_t blknum, int *err)
 {
-  off_t offset = blknum * BLKSIZE;
+  return blk_trim_blocks (blknum, 1, err);
+}
 
-  nbdkit_debug ("cow: blk_trim block %" PRIu64 " (offset %" PRIu64 ")",
-                blknum, (uint64_t) offset);
+int
+blk_trim_blocks (uint64_t blknum, uint64_t nrblocks, int *err)
+{
+  off_t offset = blknum * BLKSIZE;
 
-  /* XXX As an optimization we could punch a whole in the overlay
-   * here.  However it's not trivial since BLKSIZE is unrelated to the
-   * overlay filesystem block size.
+  nbdkit_debug ("cow: blk_trim %" PRIu64 " block(s) starting at %" PRIu64
+                " (offset %" PRIu64 ")",
+                nrblocks, blknum, (uint64_t) offset);
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  /* Punch a hole in the overlay so the trimmed range stops consuming
+   * space.  Although BLKSIZE is unrelated to the overlay filesystem
+   * block size, fallocate zeroes the whole byte range and deallocates
+   * the filesystem blocks it fully covers, which is all we need.  If
+   * it fails we just lose the space saving: trimmed blocks are served
+   * from the bitmap and never read back from the overlay file.
    */
+  if (fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 offset, nrblocks * BLKSIZE) == -1)
+    nbdkit_debug ("cow: fallocate: FALLOC_FL_PUNCH_HOLE: %m (ignored)");
+#endif
+
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  bitmap_set_blk (&bm, blknum, BLOCK_TRIMMED);
+  bitmap_set_range_blk (&bm, blknum, nrblocks, BLOCK_TRIMMED);
+  return 0;
+}
+
+/* A client flush only has to provide durability for a persistent
+ * overlay: a temporary overlay is thrown away on shutdown anyway, and
+ * writes never reach the underlying plugin in either case.  The
+ * overlay is shared by all connections, so one flush covers writes
+ * made on every connection (required for advertising multi-conn).
+ */
+int
+blk_flush (int *err)
+{
+  if (meta_path == NULL)
+    return 0;
+
+  if (fdatasync (fd) == -1) {
+    *err = errno;
+    nbdkit_error ("fdatasync: %s: %m", cow_path);
+    return -1;
+  }
   return 0;
 }
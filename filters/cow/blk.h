@@ -38,6 +38,11 @@
  */
 #define BLKSIZE 4096
 
+/* Optional name of a persistent overlay file (cow-file=...), NULL to
+ * use an anonymous temporary file.
+ */
+extern char *cow_path;
+
 /* Initialize the overlay and bitmap. */
 extern int blk_init (void);
 
@@ -73,8 +78,21 @@ extern int blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 extern int blk_write (uint64_t blknum, const uint8_t *block, int *err)
   __attribute__((__nonnull__ (2, 3)));
 
+/* Write a run of adjacent blocks in a single request. */
+extern int blk_write_blocks (uint64_t blknum, uint64_t nrblocks,
+                             const uint8_t *block, int *err)
+  __attribute__((__nonnull__ (3, 4)));
+
 /* Trim a single block. */
 extern int blk_trim (uint64_t blknum, int *err)
   __attribute__((__nonnull__ (2)));
 
+/* Trim a run of adjacent blocks, punching a hole in the overlay. */
+extern int blk_trim_blocks (uint64_t blknum, uint64_t nrblocks, int *err)
+  __attribute__((__nonnull__ (3)));
+
+/* Sync a persistent overlay to disk (no-op for temporary overlays). */
+extern int blk_flush (int *err)
+  __attribute__((__nonnull__ (1)));
+
 #endif /* NBDKIT_BLK_H */
@@ -59,17 +59,22 @@ static pthread_mutex_t rmw_lock = PTHREAD_MUTEX_INITIALIZER;
 
 bool cow_on_cache;
 
-static void
-cow_load (void)
-{
-  if (blk_init () == -1)
-    exit (EXIT_FAILURE);
-}
+/* Name of a persistent overlay file (cow-file=...), NULL to use an
+ * anonymous temporary file which is discarded on exit.
+ */
+char *cow_path;
+
+/* If set, base:allocation block status reports which blocks have been
+ * modified in the overlay instead of the usual allocation data, so an
+ * external tool can copy out only the changed blocks.
+ */
+static bool cow_block_status_dirty;
 
 static void
 cow_unload (void)
 {
   blk_free ();
+  free (cow_path);
 }
 
 static int
@@ -85,13 +90,49 @@ cow_config (nbdkit_next_config *next, void *nxdata,
     cow_on_cache = r;
     return 0;
   }
+  else if (strcmp (key, "cow-block-status") == 0) {
+    if (strcmp (value, "dirty") == 0)
+      cow_block_status_dirty = true;
+    else if (strcmp (value, "default") == 0)
+      cow_block_status_dirty = false;
+    else {
+      nbdkit_error ("invalid cow-block-status parameter, "
+                    "should be default|dirty");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "cow-file") == 0) {
+    free (cow_path);
+    cow_path = nbdkit_absolute_path (value);
+    if (cow_path == NULL)
+      return -1;
+    return 0;
+  }
   else {
     return next (nxdata, key, value);
   }
 }
 
+static int
+cow_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  /* Initialize the overlay.  This happens here rather than in .load
+   * because we need to know the cow-file parameter, if any.
+   */
+  if (blk_init () == -1)
+    return -1;
+
+  return next (nxdata);
+}
+
 #define cow_config_help \
-  "cow-on-cache=<BOOL>  Set to true to treat client cache requests as writes.\n"
+  "cow-on-cache=<BOOL>  Set to true to treat client cache requests as writes.\n" \
+  "cow-block-status=default|dirty\n" \
+  "                     Report blocks modified in the overlay instead of\n" \
+  "                     allocation data through block status.\n" \
+  "cow-file=PATH        Keep the overlay in a named file which is\n" \
+  "                     reattached after nbdkit is restarted.\n"
 
 static void *
 cow_open (nbdkit_next_open *next, void *nxdata,
@@ -151,6 +192,15 @@ cow_can_trim (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
   return 1;
 }
 
+static int
+cow_can_zero (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
+{
+  /* We have our own efficient zeroing and must not rely on the
+   * plugin, which is opened read-only and so reports no zero support.
+   */
+  return NBDKIT_ZERO_NATIVE;
+}
+
 static int
 cow_can_extents (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
 {
@@ -317,16 +367,21 @@ cow_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
     blknum++;
   }
 
-  /* Aligned body */
-  while (count >= BLKSIZE) {
-    r = blk_write (blknum, buf, err);
+  /* Aligned body.  These writes do not need to copy anything from the
+   * plugin first since whole blocks are overwritten, and adjacent
+   * blocks are written to the overlay in a single request.
+   */
+  if (count >= BLKSIZE) {
+    uint64_t nrblocks = count / BLKSIZE;
+
+    r = blk_write_blocks (blknum, nrblocks, buf, err);
     if (r == -1)
       return -1;
 
-    buf += BLKSIZE;
-    count -= BLKSIZE;
-    offset += BLKSIZE;
-    blknum++;
+    buf += nrblocks * BLKSIZE;
+    count -= nrblocks * BLKSIZE;
+    offset += nrblocks * BLKSIZE;
+    blknum += nrblocks;
   }
 
   /* Unaligned tail */
@@ -365,11 +420,13 @@ cow_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     return -1;
   }
 
-  block = malloc (BLKSIZE);
-  if (block == NULL) {
-    *err = errno;
-    nbdkit_error ("malloc: %m");
-    return -1;
+  if (!IS_ALIGNED (count | offset, BLKSIZE)) {
+    block = malloc (BLKSIZE);
+    if (block == NULL) {
+      *err = errno;
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
   }
 
   blknum = offset / BLKSIZE;  /* block number */
@@ -382,6 +439,7 @@ cow_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     /* Do a read-modify-write operation on the current block.
      * Hold the rmw_lock over the whole operation.
      */
+    assert (block);
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
@@ -396,24 +454,26 @@ cow_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     blknum++;
   }
 
-  /* Aligned body */
-  if (count >= BLKSIZE)
-    memset (block, 0, BLKSIZE);
-  while (count >= BLKSIZE) {
-    /* XXX There is the possibility of optimizing this: since this loop is
-     * writing a whole, aligned block, we should use FALLOC_FL_ZERO_RANGE.
-     */
-    r = blk_write (blknum, block, err);
+  /* Aligned body.  Whole blocks of zeroes are the same as trimmed
+   * blocks: mark them in the bitmap and punch a hole in the overlay
+   * rather than writing real zero blocks, so zeroing does not inflate
+   * the overlay and subsequent reads are served from the bitmap.
+   */
+  if (count >= BLKSIZE) {
+    uint64_t nrblocks = count / BLKSIZE;
+
+    r = blk_trim_blocks (blknum, nrblocks, err);
     if (r == -1)
       return -1;
 
-    count -= BLKSIZE;
-    offset += BLKSIZE;
-    blknum++;
+    count -= nrblocks * BLKSIZE;
+    offset += nrblocks * BLKSIZE;
+    blknum += nrblocks;
   }
 
   /* Unaligned tail */
   if (count) {
+    assert (block);
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
@@ -473,14 +533,16 @@ cow_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
   }
 
   /* Aligned body */
-  while (count >= BLKSIZE) {
-    r = blk_trim (blknum, err);
+  if (count >= BLKSIZE) {
+    uint64_t nrblocks = count / BLKSIZE;
+
+    r = blk_trim_blocks (blknum, nrblocks, err);
     if (r == -1)
       return -1;
 
-    count -= BLKSIZE;
-    offset += BLKSIZE;
-    blknum++;
+    count -= nrblocks * BLKSIZE;
+    offset += nrblocks * BLKSIZE;
+    blknum += nrblocks;
   }
 
   /* Unaligned tail */
@@ -504,8 +566,11 @@ static int
 cow_flush (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
            uint32_t flags, int *err)
 {
-  /* Deliberately ignored. */
-  return 0;
+  /* Writes never reach the plugin so there is nothing to flush below
+   * us; but a persistent overlay (cow-file=...) must be made durable,
+   * from whichever connection sent the flush.
+   */
+  return blk_flush (err);
 }
 
 static int
@@ -589,6 +654,37 @@ cow_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
   assert (IS_ALIGNED (count, BLKSIZE));
   assert (count > 0);           /* We must make forward progress. */
 
+  /* In cow-block-status=dirty mode the client is asking which blocks
+   * have been modified in the overlay, not about allocation.  Written
+   * blocks are reported as data, trimmed blocks as zero (modified,
+   * reads as zeroes) and untouched blocks as a sparse hole.
+   */
+  if (cow_block_status_dirty) {
+    while (count > 0) {
+      bool present, trimmed;
+      struct nbdkit_extent e;
+
+      blk_status (blknum, &present, &trimmed);
+
+      e.offset = offset;
+      e.length = BLKSIZE;
+      if (present)
+        e.type = trimmed ? NBDKIT_EXTENT_ZERO : 0;
+      else
+        e.type = NBDKIT_EXTENT_HOLE|NBDKIT_EXTENT_ZERO;
+
+      if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
+        *err = errno;
+        return -1;
+      }
+
+      blknum++;
+      offset += BLKSIZE;
+      count -= BLKSIZE;
+    }
+    return 0;
+  }
+
   while (count > 0) {
     bool present, trimmed;
     struct nbdkit_extent e;
@@ -693,16 +789,17 @@ cow_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
 static struct nbdkit_filter filter = {
   .name              = "cow",
   .longname          = "nbdkit copy-on-write (COW) filter",
-  .load              = cow_load,
   .unload            = cow_unload,
   .open              = cow_open,
   .config            = cow_config,
   .config_help       = cow_config_help,
+  .config_complete   = cow_config_complete,
   .prepare           = cow_prepare,
   .get_size          = cow_get_size,
   .can_write         = cow_can_write,
   .can_flush         = cow_can_flush,
   .can_trim          = cow_can_trim,
+  .can_zero          = cow_can_zero,
   .can_extents       = cow_can_extents,
   .can_fua           = cow_can_fua,
   .can_cache         = cow_can_cache,
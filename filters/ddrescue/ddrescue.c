@@ -37,6 +37,8 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <unistd.h>
+#include <assert.h>
 
 #include <pthread.h>
 
@@ -61,6 +63,126 @@ struct mapfile {
 
 static struct mapfile map = { 0, empty_vector };
 
+/* Per-connection cursor remembering which range the last read hit.
+ * Sequential recovery reads (the common access pattern when copying
+ * out a rescued disk) land in the same range or the following one,
+ * skipping the binary search.
+ */
+struct handle {
+  size_t cursor;
+};
+
+/* Compiled map format, mirroring the extentlist filter: magic,
+ * version, count, then the sorted range array written directly.  Not
+ * endian- or arch-portable; the magic check simply fails and you must
+ * recompile the map.
+ */
+#define BIN_MAGIC "NBDKITDDRESCUEMP" /* exactly 16 bytes, no trailing NUL */
+#define BIN_VERSION 1
+
+struct bin_header {
+  char magic[16];
+  uint32_t version;
+  uint32_t unused;
+  uint64_t count;
+};
+
+static const char *ddrescue_compile; /* ddrescue-compile=FILE */
+
+/* Load a compiled map, appending to the range list. */
+static int
+load_binary (const char *filename, FILE *fp)
+{
+  struct bin_header hdr;
+  size_t old_size;
+
+  if (fread (&hdr, sizeof hdr, 1, fp) != 1) {
+    nbdkit_error ("%s: ddrescue: cannot read header: %m", filename);
+    return -1;
+  }
+  assert (memcmp (hdr.magic, BIN_MAGIC, sizeof hdr.magic) == 0);
+  if (hdr.version != BIN_VERSION) {
+    nbdkit_error ("%s: ddrescue: unsupported compiled map version %" PRIu32,
+                  filename, hdr.version);
+    return -1;
+  }
+
+  old_size = map.ranges.size;
+  if (ranges_reserve (&map.ranges, hdr.count) == -1) {
+    nbdkit_error ("%s: ddrescue: realloc: %m", filename);
+    return -1;
+  }
+  if (fread (&map.ranges.ptr[old_size], sizeof (struct range), hdr.count, fp)
+      != hdr.count) {
+    nbdkit_error ("%s: ddrescue: truncated compiled map", filename);
+    return -1;
+  }
+  map.ranges.size = old_size + hdr.count;
+
+  return 0;
+}
+
+/* Compile the processed map to a binary file which later runs can
+ * load directly, skipping the text parse.  Written to a temporary
+ * file and renamed into place.
+ */
+static int
+save_binary (const char *filename)
+{
+  CLEANUP_FREE char *tmp = NULL;
+  struct bin_header hdr;
+  FILE *fp;
+  int fd;
+
+  if (asprintf (&tmp, "%s.XXXXXX", filename) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+  fd = mkstemp (tmp);
+  if (fd == -1) {
+    nbdkit_error ("mkstemp: %s: %m", tmp);
+    return -1;
+  }
+
+  fp = fdopen (fd, "w");
+  if (fp == NULL) {
+    nbdkit_error ("fdopen: %s: %m", tmp);
+    close (fd);
+    goto err;
+  }
+
+  memset (&hdr, 0, sizeof hdr);
+  memcpy (hdr.magic, BIN_MAGIC, sizeof hdr.magic);
+  hdr.version = BIN_VERSION;
+  hdr.count = map.ranges.size;
+  if (fwrite (&hdr, sizeof hdr, 1, fp) != 1 ||
+      fwrite (map.ranges.ptr, sizeof (struct range), map.ranges.size, fp)
+      != map.ranges.size ||
+      fflush (fp) == EOF ||
+      fsync (fileno (fp)) == -1) {
+    nbdkit_error ("write: %s: %m", tmp);
+    fclose (fp);
+    goto err;
+  }
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("close: %s: %m", tmp);
+    goto err;
+  }
+
+  if (rename (tmp, filename) == -1) {
+    nbdkit_error ("rename: %s: %m", filename);
+    goto err;
+  }
+
+  nbdkit_debug ("ddrescue: compiled %zu ranges to %s",
+                map.ranges.size, filename);
+  return 0;
+
+ err:
+  unlink (tmp);
+  return -1;
+}
+
 static int
 parse_mapfile (const char *filename)
 {
@@ -70,6 +192,7 @@ parse_mapfile (const char *filename)
   ssize_t len;
   int ret = -1;
   int status_seen = 0;
+  char magic[16];
 
   fp = fopen (filename, "r");
   if (!fp) {
@@ -77,6 +200,17 @@ parse_mapfile (const char *filename)
     goto out;
   }
 
+  /* The format is detected from the file: compiled maps start with a
+   * magic string, anything else is parsed as text.
+   */
+  if (fread (magic, sizeof magic, 1, fp) == 1 &&
+      memcmp (magic, BIN_MAGIC, sizeof magic) == 0) {
+    rewind (fp);
+    ret = load_binary (filename, fp);
+    goto out;
+  }
+  rewind (fp);
+
   while ((len = getline (&line, &linelen, fp)) != -1) {
     int64_t offset, length;
     char status;
@@ -146,12 +280,74 @@ ddrescue_config (nbdkit_next_config *next, void *nxdata,
     return 0;
   }
 
+  else if (strcmp (key, "ddrescue-compile") == 0) {
+    ddrescue_compile = value;
+    return 0;
+  }
+
   else
     return next (nxdata, key, value);
 }
 
+/* Sort ranges by start offset. */
+static int
+compare_ranges (const struct range *r1, const struct range *r2)
+{
+  if (r1->start < r2->start)
+    return -1;
+  else if (r1->start > r2->start)
+    return 1;
+  else
+    return 0;
+}
+
+/* Find the range containing an offset, for binary searching. */
+static int
+compare_offset (const void *offsetv, const struct range *r)
+{
+  const int64_t *offset = offsetv;
+
+  if (*offset < r->start)
+    return -1;
+  else if (*offset > r->end)
+    return 1;
+  else
+    return 0;
+}
+
+/* Sort the ranges and merge contiguous ones, so that lookups can
+ * binary search instead of walking the whole list.  Rescue maps from
+ * large drives can contain millions of entries.
+ */
+static int
+ddrescue_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  size_t i, j;
+
+  ranges_sort (&map.ranges, compare_ranges);
+
+  for (i = j = 0; i < map.ranges.size; ++i) {
+    if (j > 0 && map.ranges.ptr[i].start <= map.ranges.ptr[j-1].end + 1) {
+      if (map.ranges.ptr[i].end > map.ranges.ptr[j-1].end) {
+        map.ranges.ptr[j-1].end = map.ranges.ptr[i].end;
+        map.ranges.ptr[j-1].size =
+          map.ranges.ptr[j-1].end - map.ranges.ptr[j-1].start + 1;
+      }
+    }
+    else
+      map.ranges.ptr[j++] = map.ranges.ptr[i];
+  }
+  map.ranges.size = j;
+
+  if (ddrescue_compile && save_binary (ddrescue_compile) == -1)
+    return -1;
+
+  return next (nxdata);
+}
+
 #define ddrescue_config_help \
-  "ddrescue-mapfile=...     Specify ddrescue mapfile to use"
+  "ddrescue-mapfile=...     Specify ddrescue mapfile to use\n" \
+  "ddrescue-compile=...     Write a compiled map for faster loading"
 
 /* We need this because otherwise the layer below can_write is called
  * and that might return true (eg. if the plugin has a pwrite method
@@ -172,24 +368,60 @@ ddrescue_can_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
   return 0;
 }
 
+static void *
+ddrescue_open (nbdkit_next_open *next, void *nxdata,
+               int readonly, const char *exportname, int is_tls)
+{
+  struct handle *h;
+
+  if (next (nxdata, readonly, exportname) == -1)
+    return NULL;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  return h;
+}
+
+static void
+ddrescue_close (void *handle)
+{
+  free (handle);
+}
+
 /* Read data. */
 static int
 ddrescue_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
                 void *handle, void *buf, uint32_t count, uint64_t offset,
                 uint32_t flags, int *err)
 {
+  struct handle *h = handle;
+  const int64_t soffset = offset;
+  const struct range *p;
   size_t i;
 
-  for (i = 0; i < map.ranges.size; i++) {
-    if (map.ranges.ptr[i].status != '+')
-      continue;
-    if (offset >= map.ranges.ptr[i].start && offset <= map.ranges.ptr[i].end) {
-      if (offset + count - 1 <= map.ranges.ptr[i].end) {
-        /* entirely contained within this range */
-        return next_ops->pread (nxdata, buf, count, offset, flags, err);
-      }
-    }
+  /* The map is immutable after config, so the cursor is only a hint:
+   * parallel requests on the same connection may leave any value
+   * behind, which at worst costs a binary search.
+   */
+  i = h->cursor;
+  if (i < map.ranges.size &&
+      compare_offset (&soffset, &map.ranges.ptr[i]) == 0)
+    p = &map.ranges.ptr[i];
+  else if (i + 1 < map.ranges.size &&
+           compare_offset (&soffset, &map.ranges.ptr[i+1]) == 0)
+    p = &map.ranges.ptr[i+1];
+  else
+    p = ranges_search (&map.ranges, &soffset, compare_offset);
+
+  if (p != NULL && offset + count - 1 <= p->end) {
+    /* entirely contained within this range */
+    h->cursor = p - map.ranges.ptr;
+    return next_ops->pread (nxdata, buf, count, offset, flags, err);
   }
+
   /* read was not fully covered */
   nbdkit_debug ("ddrescue: pread: range: 0x%" PRIx64 " 0x%" PRIx32
                 " failing with EIO", offset, count);
@@ -202,7 +434,10 @@ static struct nbdkit_filter filter = {
   .longname          = "nbdkit ddrescue mapfile filter",
   .unload            = ddrescue_unload,
   .config            = ddrescue_config,
+  .config_complete   = ddrescue_config_complete,
   .config_help       = ddrescue_config_help,
+  .open              = ddrescue_open,
+  .close             = ddrescue_close,
   .can_write         = ddrescue_can_write,
   .can_cache         = ddrescue_can_cache,
   .pread             = ddrescue_pread,
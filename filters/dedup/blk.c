@@ -0,0 +1,507 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* These are the block operations.  They always read or write a single
+ * whole block of size ‘blksize’.
+ *
+ * Unique block contents are kept once in a content-addressed store: a
+ * directory of immutable files named after a fast 64 bit hash of their
+ * content.  The hash is not cryptographic, so before deduplicating
+ * against an existing store file its content is compared with the new
+ * block; genuine collisions get a new file with a bumped variant
+ * number in the name.  Store files are created atomically (written to
+ * a temporary file and link(2)ed into place), so several nbdkit
+ * instances can safely share one store directory and deduplicate
+ * across images.
+ *
+ * Each instance keeps a private in-memory map from block number to
+ * (hash, variant).  The map is rebuilt as blocks are read, so a
+ * restarted instance starts cold but the store stays warm.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "iszero.h"
+#include "minmax.h"
+#include "utils.h"
+
+#include "dedup.h"
+#include "blk.h"
+
+/* In-memory map from block number to store entry. */
+enum blk_state {
+  BLOCK_UNMAPPED = 0,           /* read through to the plugin */
+  BLOCK_MAPPED,                 /* content is in the store */
+  BLOCK_ZERO,                   /* content is all zeroes, no store file */
+};
+
+struct blk_entry {
+  uint64_t hash;
+  uint32_t variant;
+  uint8_t state;                /* enum blk_state */
+};
+
+static struct blk_entry *map;
+static uint64_t nr_blocks;
+
+/* Give up deduplicating a block whose hash collides this often.  In
+ * practice variants > 0 should be vanishingly rare.
+ */
+#define MAX_VARIANTS 16
+
+/* Because blk_set_size is called before the other blk_* functions
+ * this should be set to the true size before we need it.
+ */
+static uint64_t size = 0;
+
+/* Map entries are protected by sharded locks, like the cache filter.
+ * The store directory needs no locking: files there are immutable
+ * once linked into place.
+ */
+#define NR_LOCK_STRIPES 64
+static pthread_mutex_t stripe_lock[NR_LOCK_STRIPES];
+
+pthread_mutex_t *
+blk_stripe_lock (uint64_t blknum)
+{
+  return &stripe_lock[blknum % NR_LOCK_STRIPES];
+}
+
+void
+blk_lock_all (void)
+{
+  size_t i;
+
+  for (i = 0; i < NR_LOCK_STRIPES; ++i)
+    pthread_mutex_lock (&stripe_lock[i]);
+}
+
+void
+blk_unlock_all (void)
+{
+  size_t i;
+
+  for (i = NR_LOCK_STRIPES; i > 0; --i)
+    pthread_mutex_unlock (&stripe_lock[i-1]);
+}
+
+/* Statistics, logged at unload. */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t store_reads, zero_reads, plugin_reads;
+static uint64_t unique_blocks, dup_blocks;
+
+/* Fast non-cryptographic 64 bit hash (FNV-1a over 64 bit words).
+ * Collisions are tolerated: the store compares content before
+ * deduplicating against an existing block.
+ */
+static uint64_t
+blk_hash (const uint8_t *block)
+{
+  uint64_t h = UINT64_C (0xcbf29ce484222325);
+  size_t i;
+
+  for (i = 0; i < blksize; i += sizeof (uint64_t)) {
+    uint64_t w;
+
+    memcpy (&w, &block[i], sizeof w);
+    h ^= w;
+    h *= UINT64_C (0x100000001b3);
+  }
+  return h;
+}
+
+static void
+store_path (char *path, size_t len, uint64_t hash, uint32_t variant)
+{
+  snprintf (path, len, "%s/%016" PRIx64 "-%" PRIu32 ".blk",
+            dedup_dir, hash, variant);
+}
+
+#define STORE_PATH_MAX (PATH_MAX + 64)
+
+int
+blk_init (void)
+{
+  size_t i;
+
+  if (mkdir (dedup_dir, 0700) == -1 && errno != EEXIST) {
+    nbdkit_error ("mkdir: %s: %m", dedup_dir);
+    return -1;
+  }
+
+  for (i = 0; i < NR_LOCK_STRIPES; ++i)
+    pthread_mutex_init (&stripe_lock[i], NULL);
+
+  return 0;
+}
+
+void
+blk_free (void)
+{
+  nbdkit_debug ("dedup: reads: %" PRIu64 " from store, "
+                "%" PRIu64 " zero, %" PRIu64 " from plugin",
+                store_reads, zero_reads, plugin_reads);
+  nbdkit_debug ("dedup: blocks stored: %" PRIu64 " unique, "
+                "%" PRIu64 " deduplicated",
+                unique_blocks, dup_blocks);
+  free (map);
+  map = NULL;
+  nr_blocks = 0;
+}
+
+int
+blk_set_size (uint64_t new_size)
+{
+  uint64_t new_nr_blocks = (new_size + blksize - 1) / blksize;
+  struct blk_entry *new_map;
+
+  size = new_size;
+
+  new_map = realloc (map, new_nr_blocks * sizeof *map);
+  if (new_map == NULL && new_nr_blocks > 0) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  if (new_nr_blocks > nr_blocks)
+    memset (&new_map[nr_blocks], 0,
+            (new_nr_blocks - nr_blocks) * sizeof *map);
+  map = new_map;
+  nr_blocks = new_nr_blocks;
+
+  return 0;
+}
+
+/* Read or write a store file completely, coping with short
+ * reads and writes.
+ */
+static int
+full_read (int fd, void *buf, size_t count)
+{
+  while (count > 0) {
+    ssize_t r = read (fd, buf, count);
+    if (r <= 0)
+      return -1;
+    buf = (char *) buf + r;
+    count -= r;
+  }
+  return 0;
+}
+
+static int
+full_write (int fd, const void *buf, size_t count)
+{
+  while (count > 0) {
+    ssize_t r = write (fd, buf, count);
+    if (r == -1)
+      return -1;
+    buf = (const char *) buf + r;
+    count -= r;
+  }
+  return 0;
+}
+
+/* Read one block out of the store. */
+static int
+store_read (uint64_t hash, uint32_t variant, uint8_t *block)
+{
+  char path[STORE_PATH_MAX];
+  int fd, r;
+
+  store_path (path, sizeof path, hash, variant);
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  r = full_read (fd, block, blksize);
+  close (fd);
+  return r;
+}
+
+/* Does an existing store file contain exactly this block? */
+static int
+store_compare (const char *path, const uint8_t *block, bool *equal)
+{
+  CLEANUP_FREE uint8_t *existing = NULL;
+  int fd, r;
+
+  existing = malloc (blksize);
+  if (existing == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  r = full_read (fd, existing, blksize);
+  close (fd);
+  if (r == -1)
+    return -1;
+
+  *equal = memcmp (existing, block, blksize) == 0;
+  return 0;
+}
+
+/* Write the block to a temporary file and atomically link it into
+ * place as path.  Returns 1 on success, 0 if someone else created the
+ * file first (caller must re-verify it), -1 on error.
+ */
+static int
+store_create (const char *path, const uint8_t *block)
+{
+  char tmp[STORE_PATH_MAX];
+  int fd, r;
+
+  snprintf (tmp, sizeof tmp, "%s/tmp.XXXXXX", dedup_dir);
+  fd = mkstemp (tmp);
+  if (fd == -1) {
+    nbdkit_error ("mkstemp: %s: %m", dedup_dir);
+    return -1;
+  }
+
+  if (full_write (fd, block, blksize) == -1) {
+    nbdkit_error ("write: %s: %m", tmp);
+    close (fd);
+    unlink (tmp);
+    return -1;
+  }
+  close (fd);
+
+  r = link (tmp, path);
+  unlink (tmp);
+  if (r == -1) {
+    if (errno == EEXIST)
+      return 0;                 /* lost the race, re-verify the winner */
+    nbdkit_error ("link: %s: %m", path);
+    return -1;
+  }
+  return 1;
+}
+
+/* Find or create the store entry for this block content, returning
+ * the variant number in *variant.
+ */
+static int
+store_insert (const uint8_t *block, uint64_t hash, uint32_t *variant)
+{
+  uint32_t v;
+
+  for (v = 0; v < MAX_VARIANTS; ++v) {
+    char path[STORE_PATH_MAX];
+    bool equal;
+    int r;
+
+    store_path (path, sizeof path, hash, v);
+
+    if (access (path, F_OK) == 0) {
+      /* Fast hash, so verify the content before deduplicating. */
+      if (store_compare (path, block, &equal) == -1)
+        return -1;
+      if (equal) {
+        ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&stats_lock);
+        dup_blocks++;
+        *variant = v;
+        return 0;
+      }
+      continue;                 /* genuine collision, try next variant */
+    }
+
+    r = store_create (path, block);
+    if (r == -1)
+      return -1;
+    if (r == 0) {
+      /* Another instance linked this name first; loop around without
+       * advancing so the new file is compared like any other.
+       */
+      v--;
+      continue;
+    }
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&stats_lock);
+      unique_blocks++;
+    }
+    *variant = v;
+    return 0;
+  }
+
+  nbdkit_debug ("dedup: too many collisions for hash %016" PRIx64
+                ", not deduplicating this block", hash);
+  return -1;
+}
+
+/* Map a block number to its (just read or written) content.  Failure
+ * to map is not an error: the block is simply read from the plugin
+ * next time.
+ */
+static void
+blk_map_content (uint64_t blknum, const uint8_t *block)
+{
+  uint64_t hash;
+  uint32_t variant;
+
+  if (is_zero (block, blksize)) {
+    map[blknum].state = BLOCK_ZERO;
+    return;
+  }
+
+  hash = blk_hash (block);
+  if (store_insert (block, hash, &variant) == -1) {
+    map[blknum].state = BLOCK_UNMAPPED;
+    return;
+  }
+  map[blknum].hash = hash;
+  map[blknum].variant = variant;
+  map[blknum].state = BLOCK_MAPPED;
+}
+
+/* Read one block from the plugin, zeroing the tail if the last block
+ * runs over the end of the underlying device.
+ */
+static int
+plugin_read (struct nbdkit_next_ops *next_ops, void *nxdata,
+             uint64_t blknum, uint8_t *block, int *err)
+{
+  uint64_t offset = blknum * blksize;
+  unsigned n = blksize, tail = 0;
+
+  if (offset + n > size) {
+    tail = offset + n - size;
+    n -= tail;
+  }
+  if (next_ops->pread (nxdata, block, n, offset, 0, err) == -1)
+    return -1;
+  memset (block + n, 0, tail);
+  return 0;
+}
+
+int
+blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
+          uint64_t blknum, uint8_t *block, int *err)
+{
+  switch (map[blknum].state) {
+  case BLOCK_ZERO:
+    memset (block, 0, blksize);
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&stats_lock);
+      zero_reads++;
+    }
+    return 0;
+
+  case BLOCK_MAPPED:
+    if (store_read (map[blknum].hash, map[blknum].variant, block) == 0) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&stats_lock);
+      store_reads++;
+      return 0;
+    }
+    /* The store file has gone away (eg. external cleanup).  Fall
+     * through and read the plugin.
+     */
+    nbdkit_debug ("dedup: store file for block %" PRIu64 " disappeared, "
+                  "re-reading from plugin", blknum);
+    map[blknum].state = BLOCK_UNMAPPED;
+    /*FALLTHROUGH*/
+
+  case BLOCK_UNMAPPED:
+  default:
+    if (plugin_read (next_ops, nxdata, blknum, block, err) == -1)
+      return -1;
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&stats_lock);
+      plugin_reads++;
+    }
+    blk_map_content (blknum, block);
+    return 0;
+  }
+}
+
+int
+blk_write (struct nbdkit_next_ops *next_ops, void *nxdata,
+           uint64_t blknum, const uint8_t *block, uint32_t flags,
+           int *err)
+{
+  uint64_t offset = blknum * blksize;
+  unsigned n = blksize;
+
+  if (offset + n > size)
+    n = size - offset;
+
+  if (next_ops->pwrite (nxdata, block, n, offset, flags, err) == -1) {
+    /* The plugin content is now uncertain, stop serving the old
+     * mapping.
+     */
+    blk_unmap (blknum);
+    return -1;
+  }
+
+  blk_map_content (blknum, block);
+  return 0;
+}
+
+int
+blk_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
+          uint64_t blknum, uint32_t flags, int *err)
+{
+  uint64_t offset = blknum * blksize;
+  unsigned n = blksize;
+
+  if (offset + n > size)
+    n = size - offset;
+
+  if (next_ops->zero (nxdata, n, offset, flags, err) == -1) {
+    blk_unmap (blknum);
+    return -1;
+  }
+
+  map[blknum].state = BLOCK_ZERO;
+  return 0;
+}
+
+void
+blk_unmap (uint64_t blknum)
+{
+  map[blknum].state = BLOCK_UNMAPPED;
+}
@@ -0,0 +1,90 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_BLK_H
+#define NBDKIT_BLK_H
+
+#include <pthread.h>
+
+/* Check the store directory and initialize the block map. */
+extern int blk_init (void);
+
+/* Free the block map, log statistics. */
+extern void blk_free (void);
+
+/* The lock which must be held when operating on a single block.  The
+ * locks are sharded by block number so operations on different blocks
+ * can proceed in parallel.  The store directory itself needs no lock:
+ * store files are immutable and created atomically.
+ */
+extern pthread_mutex_t *blk_stripe_lock (uint64_t blknum);
+
+/* Acquire/release every stripe lock, for operations which touch all
+ * blocks (resizing).
+ */
+extern void blk_lock_all (void);
+extern void blk_unlock_all (void);
+
+/*----------------------------------------------------------------------
+ * ** NOTE **
+ *
+ * The stripe lock for the block (or all stripe locks) must be held
+ * when you call any function below this line.
+ */
+
+/* Resize the block map. */
+extern int blk_set_size (uint64_t new_size);
+
+/* Read a single block, from the store if mapped, else from the plugin
+ * (which also maps it).
+ */
+extern int blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
+                     uint64_t blknum, uint8_t *block, int *err)
+  __attribute__((__nonnull__ (1, 4, 5)));
+
+/* Write a whole block through to the plugin and remap it. */
+extern int blk_write (struct nbdkit_next_ops *next_ops, void *nxdata,
+                      uint64_t blknum, const uint8_t *block,
+                      uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 4, 6)));
+
+/* Zero a whole block in the plugin and map it to the zero block. */
+extern int blk_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
+                     uint64_t blknum, uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 5)));
+
+/* Forget the mapping for a block (used by trim: the content becomes
+ * undefined, so subsequent reads must go back to the plugin).
+ */
+extern void blk_unmap (uint64_t blknum);
+
+#endif /* NBDKIT_BLK_H */
@@ -0,0 +1,467 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "isaligned.h"
+#include "ispowerof2.h"
+#include "minmax.h"
+
+#include "dedup.h"
+#include "blk.h"
+
+char *dedup_dir = NULL;
+unsigned blksize = 65536;
+
+static void
+dedup_unload (void)
+{
+  blk_free ();
+  free (dedup_dir);
+}
+
+static int
+dedup_config (nbdkit_next_config *next, void *nxdata,
+              const char *key, const char *value)
+{
+  if (strcmp (key, "dedup-dir") == 0) {
+    free (dedup_dir);
+    dedup_dir = nbdkit_absolute_path (value);
+    if (dedup_dir == NULL)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "dedup-blocksize") == 0) {
+    int64_t r;
+
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r < 4096 || r > 16*1024*1024 || !is_power_of_2 (r)) {
+      nbdkit_error ("dedup-blocksize must be a power of 2 "
+                    "between 4K and 16M");
+      return -1;
+    }
+    blksize = r;
+    return 0;
+  }
+  else {
+    return next (nxdata, key, value);
+  }
+}
+
+#define dedup_config_help \
+  "dedup-dir=DIR             Directory holding the shared block store\n" \
+  "                          (required; may be shared between instances).\n" \
+  "dedup-blocksize=SIZE      Deduplication block size (default 64K).\n"
+
+static int
+dedup_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  if (dedup_dir == NULL) {
+    nbdkit_error ("dedup-dir parameter is required");
+    return -1;
+  }
+
+  if (blk_init () == -1)
+    return -1;
+
+  return next (nxdata);
+}
+
+/* Get the file size, set the block map size. */
+static int64_t
+dedup_get_size (struct nbdkit_next_ops *next_ops, void *nxdata,
+                void *handle)
+{
+  int64_t size;
+  int r;
+
+  size = next_ops->get_size (nxdata);
+  if (size == -1)
+    return -1;
+
+  nbdkit_debug ("dedup: underlying file size: %" PRIi64, size);
+
+  blk_lock_all ();
+  r = blk_set_size (size);
+  blk_unlock_all ();
+  if (r == -1)
+    return -1;
+
+  return size;
+}
+
+/* Force an early call to dedup_get_size because we have to set the
+ * block map size before any other read or write calls.
+ */
+static int
+dedup_prepare (struct nbdkit_next_ops *next_ops, void *nxdata,
+               void *handle, int readonly)
+{
+  int64_t r;
+
+  r = dedup_get_size (next_ops, nxdata, handle);
+  if (r < 0)
+    return -1;
+  return 0;
+}
+
+/* Override the plugin's .can_cache, because we are caching here instead. */
+static int
+dedup_can_cache (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
+{
+  return NBDKIT_CACHE_NATIVE;
+}
+
+/* Read data. */
+static int
+dedup_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+             void *handle, void *buf, uint32_t count, uint64_t offset,
+             uint32_t flags, int *err)
+{
+  CLEANUP_FREE uint8_t *block = NULL;
+  uint64_t blknum, blkoffs;
+  int r;
+
+  assert (!flags);
+  if (!IS_ALIGNED (count | offset, blksize)) {
+    block = malloc (blksize);
+    if (block == NULL) {
+      *err = errno;
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+  }
+
+  blknum = offset / blksize;  /* block number */
+  blkoffs = offset % blksize; /* offset within the block */
+
+  /* Unaligned head */
+  if (blkoffs) {
+    uint64_t n = MIN (blksize - blkoffs, count);
+
+    assert (block);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r == -1)
+      return -1;
+
+    memcpy (buf, &block[blkoffs], n);
+
+    buf += n;
+    count -= n;
+    offset += n;
+    blknum++;
+  }
+
+  /* Aligned body */
+  while (count >= blksize) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, buf, err);
+    if (r == -1)
+      return -1;
+
+    buf += blksize;
+    count -= blksize;
+    offset += blksize;
+    blknum++;
+  }
+
+  /* Unaligned tail */
+  if (count) {
+    assert (block);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r == -1)
+      return -1;
+
+    memcpy (buf, block, count);
+  }
+
+  return 0;
+}
+
+/* Write data.  Writes go straight through to the plugin; the store
+ * and the block map are updated along the way.
+ */
+static int
+dedup_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
+              void *handle, const void *buf, uint32_t count, uint64_t offset,
+              uint32_t flags, int *err)
+{
+  CLEANUP_FREE uint8_t *block = NULL;
+  uint64_t blknum, blkoffs;
+  int r;
+
+  if (!IS_ALIGNED (count | offset, blksize)) {
+    block = malloc (blksize);
+    if (block == NULL) {
+      *err = errno;
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+  }
+
+  blknum = offset / blksize;  /* block number */
+  blkoffs = offset % blksize; /* offset within the block */
+
+  /* Unaligned head */
+  if (blkoffs) {
+    uint64_t n = MIN (blksize - blkoffs, count);
+
+    /* Do a read-modify-write operation on the current block.
+     * Hold the lock over the whole operation.
+     */
+    assert (block);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r != -1) {
+      memcpy (&block[blkoffs], buf, n);
+      r = blk_write (next_ops, nxdata, blknum, block, flags, err);
+    }
+    if (r == -1)
+      return -1;
+
+    buf += n;
+    count -= n;
+    offset += n;
+    blknum++;
+  }
+
+  /* Aligned body */
+  while (count >= blksize) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_write (next_ops, nxdata, blknum, buf, flags, err);
+    if (r == -1)
+      return -1;
+
+    buf += blksize;
+    count -= blksize;
+    offset += blksize;
+    blknum++;
+  }
+
+  /* Unaligned tail */
+  if (count) {
+    assert (block);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r != -1) {
+      memcpy (block, buf, count);
+      r = blk_write (next_ops, nxdata, blknum, block, flags, err);
+    }
+    if (r == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Zero data. */
+static int
+dedup_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
+            void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+            int *err)
+{
+  CLEANUP_FREE uint8_t *block = NULL;
+  uint64_t blknum, blkoffs;
+  int r;
+
+  /* Unaligned edges are zeroed with read-modify-write, which is not
+   * fast.
+   */
+  if ((flags & NBDKIT_FLAG_FAST_ZERO) &&
+      !IS_ALIGNED (count | offset, blksize)) {
+    *err = ENOTSUP;
+    return -1;
+  }
+
+  if (!IS_ALIGNED (count | offset, blksize)) {
+    block = malloc (blksize);
+    if (block == NULL) {
+      *err = errno;
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+  }
+
+  blknum = offset / blksize;  /* block number */
+  blkoffs = offset % blksize; /* offset within the block */
+
+  /* Unaligned head */
+  if (blkoffs) {
+    uint64_t n = MIN (blksize - blkoffs, count);
+
+    assert (block);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r != -1) {
+      memset (&block[blkoffs], 0, n);
+      r = blk_write (next_ops, nxdata, blknum, block, flags, err);
+    }
+    if (r == -1)
+      return -1;
+
+    count -= n;
+    offset += n;
+    blknum++;
+  }
+
+  /* Aligned body */
+  while (count >= blksize) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_zero (next_ops, nxdata, blknum, flags, err);
+    if (r == -1)
+      return -1;
+
+    count -= blksize;
+    offset += blksize;
+    blknum++;
+  }
+
+  /* Unaligned tail */
+  if (count) {
+    assert (block);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r != -1) {
+      memset (block, 0, count);
+      r = blk_write (next_ops, nxdata, blknum, block, flags, err);
+    }
+    if (r == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Trim data.  After a trim the content is undefined, so stop serving
+ * the old mapping for every touched block and pass the trim through.
+ */
+static int
+dedup_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
+            void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+            int *err)
+{
+  uint64_t blknum = offset / blksize;
+
+  while (count > 0) {
+    uint64_t blkoffs = offset % blksize;
+    uint64_t n = MIN (blksize - blkoffs, count);
+
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    blk_unmap (blknum);
+    if (next_ops->trim (nxdata, n, offset, flags, err) == -1)
+      return -1;
+
+    count -= n;
+    offset += n;
+    blknum++;
+  }
+
+  return 0;
+}
+
+/* Cache data: populate the store for the given range. */
+static int
+dedup_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
+             void *handle, uint32_t count, uint64_t offset,
+             uint32_t flags, int *err)
+{
+  CLEANUP_FREE uint8_t *block = NULL;
+  uint64_t blknum, blkoffs;
+  uint64_t remaining = count;   /* Rounding out could exceed 32 bits */
+  int r;
+
+  assert (!flags);
+  block = malloc (blksize);
+  if (block == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  blknum = offset / blksize;  /* block number */
+  blkoffs = offset % blksize; /* offset within the block */
+
+  /* Round the range out to whole blocks. */
+  remaining += blkoffs;
+  offset -= blkoffs;
+  remaining = (remaining + blksize - 1) & ~(uint64_t) (blksize - 1);
+
+  while (remaining) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_stripe_lock (blknum));
+    r = blk_read (next_ops, nxdata, blknum, block, err);
+    if (r == -1)
+      return -1;
+
+    remaining -= blksize;
+    offset += blksize;
+    blknum++;
+  }
+
+  return 0;
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "dedup",
+  .longname          = "nbdkit block deduplication filter",
+  .unload            = dedup_unload,
+  .config            = dedup_config,
+  .config_complete   = dedup_config_complete,
+  .config_help       = dedup_config_help,
+  .prepare           = dedup_prepare,
+  .get_size          = dedup_get_size,
+  .can_cache         = dedup_can_cache,
+  .pread             = dedup_pread,
+  .pwrite            = dedup_pwrite,
+  .zero              = dedup_zero,
+  .trim              = dedup_trim,
+  .cache             = dedup_cache,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
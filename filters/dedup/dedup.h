@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2018 Red Hat Inc.
+ * Copyright (C) 2018-2021 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -30,24 +30,13 @@
  * SUCH DAMAGE.
  */
 
-#ifndef NBDKIT_LRU_H
-#define NBDKIT_LRU_H
+#ifndef NBDKIT_DEDUP_H
+#define NBDKIT_DEDUP_H
 
-#include <stdbool.h>
+/* Directory holding the content-addressed block store (dedup-dir). */
+extern char *dedup_dir;
 
-/* Initialize LRU. */
-extern void lru_init (void);
+/* Block size (dedup-blocksize). */
+extern unsigned blksize;
 
-/* Free the LRU. */
-extern void lru_free (void);
-
-/* Notify LRU that the virtual size has changed. */
-extern int lru_set_size (uint64_t new_size);
-
-/* Mark a block as recently accessed in the LRU structure. */
-extern void lru_set_recently_accessed (uint64_t blknum);
-
-/* Check if a block has been recently accessed. */
-extern bool lru_has_been_recently_accessed (uint64_t blknum);
-
-#endif /* NBDKIT_LRU_H */
+#endif /* NBDKIT_DEDUP_H */
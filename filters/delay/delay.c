@@ -39,6 +39,7 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 
 #include <nbdkit-filter.h>
 
@@ -49,6 +50,7 @@ static int delay_trim_ms = 0;   /* trim delay (milliseconds) */
 static int delay_extents_ms = 0;/* extents delay (milliseconds) */
 static int delay_cache_ms = 0;  /* cache delay (milliseconds) */
 static int delay_fast_zero = 1; /* whether delaying zero includes fast zero */
+static int delay_overlap = 0;   /* delay as service latency, not additive */
 
 static int
 parse_delay (const char *key, const char *value)
@@ -92,6 +94,31 @@ delay (int ms, int *err)
   return 0;
 }
 
+/* In delay-overlap mode the delay is an absolute deadline measured
+ * from the arrival of the request, so the plugin call happens inside
+ * the delay instead of after it: the filter simulates a device with
+ * a fixed service latency rather than adding latency on top of the
+ * plugin's own.
+ */
+static int64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C (1000000000) + ts.tv_nsec;
+}
+
+static int
+remaining_delay (int ms, int64_t start, int *err)
+{
+  int64_t elapsed_ms = (now_ns () - start) / 1000000;
+
+  if (elapsed_ms >= ms)
+    return 0;
+  return delay (ms - elapsed_ms, err);
+}
+
 static int
 read_delay (int *err)
 {
@@ -191,6 +218,12 @@ delay_config (nbdkit_next_config *next, void *nxdata,
       return -1;
     return 0;
   }
+  else if (strcmp (key, "delay-overlap") == 0) {
+    delay_overlap = nbdkit_parse_bool (value);
+    if (delay_overlap < 0)
+      return -1;
+    return 0;
+  }
   else
     return next (nxdata, key, value);
 }
@@ -204,7 +237,10 @@ delay_config (nbdkit_next_config *next, void *nxdata,
   "delay-extents=<NN>[ms]         Extents delay in seconds/milliseconds.\n" \
   "delay-cache=<NN>[ms]           Cache delay in seconds/milliseconds.\n" \
   "wdelay=<NN>[ms]                Write, zero and trim delay in secs/msecs.\n" \
-  "delay-fast-zero=<BOOL>         Delay fast zero requests (default true).\n"
+  "delay-fast-zero=<BOOL>         Delay fast zero requests (default true).\n" \
+  "delay-overlap=<BOOL>           Delay counts from the arrival of the\n" \
+  "                               request and overlaps the plugin call\n" \
+  "                               (default false).\n"
 
 /* Override the plugin's .can_fast_zero if needed */
 static int
@@ -223,9 +259,15 @@ delay_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
              void *handle, void *buf, uint32_t count, uint64_t offset,
              uint32_t flags, int *err)
 {
-  if (read_delay (err) == -1)
+  int64_t start = delay_overlap ? now_ns () : 0;
+  int r;
+
+  if (!delay_overlap && read_delay (err) == -1)
     return -1;
-  return next_ops->pread (nxdata, buf, count, offset, flags, err);
+  r = next_ops->pread (nxdata, buf, count, offset, flags, err);
+  if (delay_overlap && remaining_delay (delay_read_ms, start, err) == -1)
+    return -1;
+  return r;
 }
 
 /* Write data. */
@@ -235,9 +277,15 @@ delay_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
               const void *buf, uint32_t count, uint64_t offset, uint32_t flags,
               int *err)
 {
-  if (write_delay (err) == -1)
+  int64_t start = delay_overlap ? now_ns () : 0;
+  int r;
+
+  if (!delay_overlap && write_delay (err) == -1)
+    return -1;
+  r = next_ops->pwrite (nxdata, buf, count, offset, flags, err);
+  if (delay_overlap && remaining_delay (delay_write_ms, start, err) == -1)
     return -1;
-  return next_ops->pwrite (nxdata, buf, count, offset, flags, err);
+  return r;
 }
 
 /* Zero data. */
@@ -246,13 +294,20 @@ delay_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
             void *handle, uint32_t count, uint64_t offset, uint32_t flags,
             int *err)
 {
+  int64_t start;
+  int r;
+
   if ((flags & NBDKIT_FLAG_FAST_ZERO) && delay_zero_ms && !delay_fast_zero) {
     *err = ENOTSUP;
     return -1;
   }
-  if (zero_delay (err) == -1)
+  start = delay_overlap ? now_ns () : 0;
+  if (!delay_overlap && zero_delay (err) == -1)
     return -1;
-  return next_ops->zero (nxdata, count, offset, flags, err);
+  r = next_ops->zero (nxdata, count, offset, flags, err);
+  if (delay_overlap && remaining_delay (delay_zero_ms, start, err) == -1)
+    return -1;
+  return r;
 }
 
 /* Trim data. */
@@ -261,9 +316,15 @@ delay_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
             void *handle, uint32_t count, uint64_t offset,
             uint32_t flags, int *err)
 {
-  if (trim_delay (err) == -1)
+  int64_t start = delay_overlap ? now_ns () : 0;
+  int r;
+
+  if (!delay_overlap && trim_delay (err) == -1)
+    return -1;
+  r = next_ops->trim (nxdata, count, offset, flags, err);
+  if (delay_overlap && remaining_delay (delay_trim_ms, start, err) == -1)
     return -1;
-  return next_ops->trim (nxdata, count, offset, flags, err);
+  return r;
 }
 
 /* Extents. */
@@ -272,9 +333,15 @@ delay_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
                void *handle, uint32_t count, uint64_t offset, uint32_t flags,
                struct nbdkit_extents *extents, int *err)
 {
-  if (extents_delay (err) == -1)
+  int64_t start = delay_overlap ? now_ns () : 0;
+  int r;
+
+  if (!delay_overlap && extents_delay (err) == -1)
     return -1;
-  return next_ops->extents (nxdata, count, offset, flags, extents, err);
+  r = next_ops->extents (nxdata, count, offset, flags, extents, err);
+  if (delay_overlap && remaining_delay (delay_extents_ms, start, err) == -1)
+    return -1;
+  return r;
 }
 
 /* Cache. */
@@ -283,9 +350,15 @@ delay_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
              void *handle, uint32_t count, uint64_t offset, uint32_t flags,
              int *err)
 {
-  if (cache_delay (err) == -1)
+  int64_t start = delay_overlap ? now_ns () : 0;
+  int r;
+
+  if (!delay_overlap && cache_delay (err) == -1)
+    return -1;
+  r = next_ops->cache (nxdata, count, offset, flags, err);
+  if (delay_overlap && remaining_delay (delay_cache_ms, start, err) == -1)
     return -1;
-  return next_ops->cache (nxdata, count, offset, flags, err);
+  return r;
 }
 
 static struct nbdkit_filter filter = {
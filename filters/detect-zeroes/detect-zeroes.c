@@ -0,0 +1,168 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Detect writes of zeroes and turn them into zero requests, which
+ * plugins can usually implement as holes.  Clients write long runs
+ * of literal zeroes (mkfs, image copies, secure wipes); passing them
+ * through as data writes fills sparse images and wastes bandwidth to
+ * remote plugins.
+ *
+ * Mixed payloads are split at multiples of detect-zeroes-block: runs
+ * of zero blocks become one zero call and the data in between is
+ * written unchanged.  Zero runs shorter than one block are written
+ * as data so a pathological mixed payload does not explode into many
+ * small requests.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <nbdkit-filter.h>
+
+#include "iszero.h"
+#include "ispowerof2.h"
+#include "minmax.h"
+
+#define MIN_BLOCK_SIZE    4096
+#define MAX_BLOCK_SIZE    (16*1024*1024)
+static uint32_t block_size = 65536;  /* detect-zeroes-block */
+
+static int
+detect_zeroes_config (nbdkit_next_config *next, void *nxdata,
+                      const char *key, const char *value)
+{
+  if (strcmp (key, "detect-zeroes-block") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r < MIN_BLOCK_SIZE || r > MAX_BLOCK_SIZE || !is_power_of_2 (r)) {
+      nbdkit_error ("detect-zeroes-block must be a power of 2 "
+                    "between 4K and 16M");
+      return -1;
+    }
+    block_size = r;
+    return 0;
+  }
+  else
+    return next (nxdata, key, value);
+}
+
+#define detect_zeroes_config_help \
+  "detect-zeroes-block=SIZE  Granularity of zero detection in mixed\n" \
+  "                          payloads (default 64K)."
+
+/* Write data, converting runs of zero blocks into zero calls.
+ *
+ * A data run is not issued until we know how the following zero run
+ * ends: if the zero run turns out to be shorter than one block it is
+ * folded back into the data run rather than emitted separately.
+ */
+static int
+detect_zeroes_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
+                      void *handle, const void *buf, uint32_t count,
+                      uint64_t offset, uint32_t flags, int *err)
+{
+  const uint8_t *b = buf;
+  const uint32_t zflags =
+    NBDKIT_FLAG_MAY_TRIM | (flags & NBDKIT_FLAG_FUA);
+  uint64_t cur = offset, end = offset + count;
+  uint64_t dstart = offset;     /* pending data run: [dstart, dstart+dlen) */
+  uint64_t dlen = 0;
+  uint64_t zlen = 0;            /* current zero run, follows the data run */
+
+  if (next_ops->can_zero (nxdata) <= 0)
+    return next_ops->pwrite (nxdata, buf, count, offset, flags, err);
+
+  /* Common case: the whole payload is zeroes. */
+  if (is_zero ((const char *) buf, count))
+    return next_ops->zero (nxdata, count, offset, zflags, err);
+
+  while (cur < end) {
+    /* Chunks end at multiples of block_size so zero calls are
+     * aligned wherever the client's request is.
+     */
+    uint32_t n = MIN (end - cur, block_size - (cur & (block_size-1)));
+    bool zero = is_zero ((const char *) &b[cur - offset], n);
+
+    if (zero)
+      zlen += n;
+    else {
+      if (zlen >= block_size) {
+        /* The zero run is worth a hole: emit the data before it,
+         * then the run itself.
+         */
+        if (dlen > 0 &&
+            next_ops->pwrite (nxdata, &b[dstart - offset], dlen, dstart,
+                              flags, err) == -1)
+          return -1;
+        if (next_ops->zero (nxdata, zlen, dstart + dlen, zflags, err) == -1)
+          return -1;
+        dstart = cur;
+        dlen = 0;
+      }
+      else
+        dlen += zlen;           /* too short: keep it as data */
+      zlen = 0;
+      dlen += n;
+    }
+    cur += n;
+  }
+
+  /* Trailing zero run: always emit it as a zero call (it ends the
+   * request, so it cannot fragment anything after it).
+   */
+  if (dlen > 0 &&
+      next_ops->pwrite (nxdata, &b[dstart - offset], dlen, dstart,
+                        flags, err) == -1)
+    return -1;
+  if (zlen > 0 &&
+      next_ops->zero (nxdata, zlen, dstart + dlen, zflags, err) == -1)
+    return -1;
+
+  return 0;
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "detect-zeroes",
+  .longname          = "nbdkit detect zeroes filter",
+  .config            = detect_zeroes_config,
+  .config_help       = detect_zeroes_config_help,
+  .pwrite            = detect_zeroes_pwrite,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
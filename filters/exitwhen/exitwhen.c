@@ -45,6 +45,11 @@
 
 #include <pthread.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
@@ -71,10 +76,8 @@ struct event {
   union {
     char *filename;             /* Filename or script. */
     int fd;                     /* For PROCESS_EXITS or FD_CLOSED. */
-#ifndef __linux__
-    pid_t pid;                  /* For PROCESS_EXITS on non-Linux. */
-#endif
   } u;
+  pid_t pid;                    /* For PROCESS_EXITS. */
 };
 DEFINE_VECTOR_TYPE(event_list, struct event);
 static event_list events = empty_vector;
@@ -236,7 +239,7 @@ check_for_event_process_exits (const struct event *event)
   }
 #else /* !__linux__ */
   /* XXX Find a safe way to do this on BSD at least. */
-  if (kill (event->u.pid, 0) == -1 && errno == ESRCH) {
+  if (kill (event->pid, 0) == -1 && errno == ESRCH) {
     nbdkit_debug ("exit-when-process-exits: detected process exit");
     exiting = true;
   }
@@ -307,17 +310,152 @@ check_for_event_script (const struct event *event)
 }
 #endif
 
-/* The background polling thread.
+/* The background watcher thread.
+ *
+ * Where the operating system lets us, events are armed as file
+ * descriptors (inotify for file creation/deletion, a pidfd for
+ * process exit, the pipe itself for pipe closure) and the thread
+ * sleeps in poll(2) until one fires, so events take effect
+ * immediately.  The check_for_event() functions above remain
+ * authoritative: the descriptors only wake the thread up.  Events
+ * which cannot be armed — scripts, and anything the OS or kernel
+ * cannot watch — fall back to waking every pollsecs as before.
  *
- * This runs continuously in the background, but you can pause it by
- * grabbing &pause_lock (use the pause/resume_polling_thread()
+ * The thread runs continuously in the background, but you can pause
+ * it by grabbing &pause_lock (use the pause/resume_polling_thread()
  * wrappers below).
  */
 static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
 
+DEFINE_VECTOR_TYPE(pollfd_list, struct pollfd);
+
+/* Set if some event could not be armed as a file descriptor and we
+ * must wake up periodically to check it.
+ */
+static bool need_timeout;
+
+#ifdef __linux__
+static int inotify_fd = -1;
+#endif
+
+static int
+add_wakeup_fd (pollfd_list *fds, int fd, short poll_events)
+{
+  struct pollfd pfd = { .fd = fd, .events = poll_events };
+
+  if (pollfd_list_append (fds, pfd) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  return 0;
+}
+
+#ifdef __linux__
+/* Watch the directory containing the file for creations, deletions
+ * and renames.  Returns -1 (falling back to polling) if the directory
+ * cannot be watched.
+ */
+static int
+arm_file_watch (pollfd_list *fds, const char *filename)
+{
+  CLEANUP_FREE char *dir = NULL;
+  char *slash;
+
+  dir = strdup (filename);
+  if (dir == NULL) {
+    nbdkit_debug ("exitwhen: strdup: %m");
+    return -1;
+  }
+  slash = strrchr (dir, '/');
+  if (slash == NULL)            /* filename is absolute, can't happen */
+    return -1;
+  if (slash == dir)             /* file directly under the root */
+    slash[1] = '\0';
+  else
+    *slash = '\0';
+
+  if (inotify_fd == -1) {
+    inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+      nbdkit_debug ("exitwhen: inotify_init1: %m");
+      return -1;
+    }
+    if (add_wakeup_fd (fds, inotify_fd, POLLIN) == -1)
+      return -1;
+  }
+
+  if (inotify_add_watch (inotify_fd, dir,
+                         IN_CREATE | IN_DELETE |
+                         IN_MOVED_TO | IN_MOVED_FROM) == -1) {
+    nbdkit_debug ("exitwhen: inotify_add_watch: %s: %m", dir);
+    return -1;
+  }
+  return 0;
+}
+#endif /* __linux__ */
+
+/* Arm whatever events can be armed.  Runs once in the watcher thread;
+ * any failure just means falling back to periodic polling for that
+ * event.
+ */
+static void
+arm_wakeup_fds (pollfd_list *fds)
+{
+  size_t i;
+
+  for (i = 0; i < events.size; ++i) {
+    const struct event *event = &events.ptr[i];
+
+    switch (event->type) {
+#if defined (EVENT_FILE_CREATED) && defined (EVENT_FILE_DELETED)
+    case EVENT_FILE_CREATED:
+    case EVENT_FILE_DELETED:
+#ifdef __linux__
+      if (arm_file_watch (fds, event->u.filename) == -1)
+#endif
+        need_timeout = true;
+      break;
+#endif
+#ifdef EVENT_FD_CLOSED
+    case EVENT_FD_CLOSED:
+      /* POLLHUP and POLLNVAL are always reported. */
+      if (add_wakeup_fd (fds, event->u.fd, 0) == -1)
+        need_timeout = true;
+      break;
+#endif
+#ifdef EVENT_PROCESS_EXITS
+    case EVENT_PROCESS_EXITS: {
+#if defined (__linux__) && defined (SYS_pidfd_open)
+      int pidfd = syscall (SYS_pidfd_open, event->pid, 0);
+
+      if (pidfd >= 0) {
+        if (add_wakeup_fd (fds, pidfd, POLLIN) == 0)
+          break;
+        close (pidfd);
+      }
+      else
+        nbdkit_debug ("exitwhen: pidfd_open: %m");
+#endif
+      need_timeout = true;
+      break;
+    }
+#endif
+    default:                    /* EVENT_SCRIPT and anything unarmable */
+      need_timeout = true;
+      break;
+    }
+  }
+}
+
 static void *
 polling_thread (void *vp)
 {
+  pollfd_list fds = empty_vector;
+  int timeout;
+
+  arm_wakeup_fds (&fds);
+  timeout = need_timeout ? (int) pollsecs * 1000 : -1;
+
   for (;;) {
     {
       /* Note the order here is chosen to avoid possible deadlock
@@ -329,10 +467,45 @@ polling_thread (void *vp)
       if (check_for_event ()) {
         nbdkit_debug ("exitwhen: shutdown from polling thread");
         nbdkit_shutdown ();
+        /* The armed descriptors would stay readable and make this
+         * loop spin, and there is nothing left to wait for anyway.
+         */
+        return NULL;
       }
     }
 
-    sleep (pollsecs);
+    if (fds.size > 0) {
+      size_t i;
+
+      if (poll (fds.ptr, fds.size, timeout) == -1 && errno != EINTR)
+        nbdkit_error ("exitwhen: poll: %m");
+
+      for (i = 0; i < fds.size; ++i) {
+        if (fds.ptr[i].revents == 0)
+          continue;
+#ifdef __linux__
+        if (fds.ptr[i].fd == inotify_fd) {
+          /* Drain the queue; the wakeup itself is the payload. */
+          char buf[4096];
+          while (read (inotify_fd, buf, sizeof buf) > 0)
+            ;
+        }
+        else
+#endif
+        if ((fds.ptr[i].events & POLLIN) != 0) {
+          /* A pidfd fired.  It stays readable forever, and the
+           * process may linger as a zombie which the authoritative
+           * check above does not yet count as exited, so disarm it
+           * and fall back to periodic checks.
+           */
+          close (fds.ptr[i].fd);
+          fds.ptr[i].fd = -1;   /* poll ignores negative fds */
+          timeout = (int) pollsecs * 1000;
+        }
+      }
+    }
+    else
+      sleep (pollsecs);
   }
 }
 
@@ -392,6 +565,7 @@ exitwhen_config (nbdkit_next_config *next, void *nxdata,
     event.type = EVENT_PROCESS_EXITS;
     if (nbdkit_parse_uint64_t ("exit-when-process-exits", value, &pid) == -1)
       return -1;
+    event.pid = (pid_t) pid;
 #ifdef __linux__
     /* See: https://gitlab.freedesktop.org/polkit/polkit/-/issues/75 */
     if (asprintf (&str, "/proc/%" PRIu64 "/stat", pid) == -1) {
@@ -403,8 +577,6 @@ exitwhen_config (nbdkit_next_config *next, void *nxdata,
       nbdkit_error ("exit-when-process-exits: %s: %m", str);
       return -1;
     }
-#else
-    event.u.pid = (pid_t) pid;
 #endif
     goto append_event;
   }
@@ -248,14 +248,10 @@ static const char *
 exportname_default_export (nbdkit_next_default_export *next, void *nxdata,
                            int readonly, int is_tls)
 {
-  size_t i;
-
   /* If we are strict, do not allow connection unless "" was advertised. */
   if (strict) {
-    for (i = 0; i < nbdkit_exports_count (exports); i++) {
-      if (nbdkit_get_export (exports, i).name[0] == '\0')
-        return default_export ?: "";
-    }
+    if (nbdkit_find_export (exports, "") >= 0)
+      return default_export ?: "";
     return NULL;
   }
 
@@ -272,15 +268,10 @@ static void *
 exportname_open (nbdkit_next_open *next, void *nxdata,
                  int readonly, const char *exportname, int is_tls)
 {
-  size_t i;
   struct handle *h;
 
   if (strict) {
-    for (i = 0; i < nbdkit_exports_count (exports); i++) {
-      if (strcmp (nbdkit_get_export (exports, i).name, exportname) == 0)
-        break;
-    }
-    if (i == nbdkit_exports_count (exports)) {
+    if (nbdkit_find_export (exports, exportname) < 0) {
       nbdkit_error ("export '%s not found", exportname);
       errno = ENOENT;
       return NULL;
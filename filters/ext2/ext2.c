@@ -73,6 +73,12 @@ ext2_config (nbdkit_next_config *next, void *nxdata,
     file = value;
     return 0;
   }
+  else if (strcmp (key, "ext2cache") == 0) {
+    nbdkit_io_cache_size = nbdkit_parse_size (value);
+    if (nbdkit_io_cache_size == -1)
+      return -1;
+    return 0;
+  }
   else
     return next (nxdata, key, value);
 }
@@ -98,7 +104,8 @@ ext2_config_complete (nbdkit_next_config_complete *next, void *nxdata)
 
 #define ext2_config_help \
   "ext2file=<FILENAME>  (required) Absolute name of file to serve inside the\n" \
-  "                     disk image, or 'exportname' for client choice."
+  "                     disk image, or 'exportname' for client choice.\n" \
+  "ext2cache=<SIZE>     Size of the metadata block cache (default 4M)."
 
 /* The per-connection handle. */
 struct handle {
@@ -46,9 +46,14 @@
 
 #include <config.h>
 
+#include <stdbool.h>
+#include <inttypes.h>
+
 #include <ext2_fs.h>
 #include <ext2fs.h>
 
+#include "minmax.h"
+
 #include "io.h"
 
 /*
@@ -58,12 +63,39 @@
 #define EXT2_CHECK_MAGIC(struct, code) \
   if ((struct)->magic != (code)) return (code)
 
+/* Size in bytes of the per-channel write-through block cache, set
+ * from the ext2cache parameter (0 disables caching).  The filter
+ * serializes connections so the cache needs no locking.
+ */
+int64_t nbdkit_io_cache_size = 4 * 1024 * 1024;
+
+/* How many blocks to fetch in one request when single-block reads
+ * miss the cache sequentially (eg. inode table scans).
+ */
+#define READAHEAD_BLOCKS 16
+
+struct cache_entry {
+  char *buf;                    /* NULL = slot never used */
+  unsigned long long block;
+  bool valid;
+};
+
 struct io_private_data {
   int magic;
   struct nbdkit_next_ops *next_ops;
   void *nxdata;
   ext2_loff_t offset;
   struct struct_io_stats io_stats;
+
+  /* Direct-mapped, write-through block cache.  ext2fs metadata
+   * access is dominated by repeated single-block reads of the
+   * superblock, group descriptors and bitmaps, so even a small cache
+   * removes most round trips to the underlying plugin.
+   */
+  struct cache_entry *cache;
+  size_t cache_entries;
+  unsigned long long last_miss;  /* for sequential readahead */
+  uint64_t hits, misses;
 };
 
 static errcode_t
@@ -83,6 +115,99 @@ io_get_stats (io_channel channel, io_stats *stats)
   return retval;
 }
 
+/*
+ * The block cache.  Only single-block transfers are cached: that is
+ * what ext2fs uses for metadata, and data blocks read through
+ * ext2fs_file_read come in larger runs which would only churn the
+ * cache.  Writes go straight to the plugin (write-through) so there
+ * is never anything dirty to flush.
+ */
+
+static void
+cache_free (struct io_private_data *data)
+{
+  size_t i;
+
+  if (data->cache == NULL)
+    return;
+  for (i = 0; i < data->cache_entries; ++i)
+    free (data->cache[i].buf);
+  free (data->cache);
+  data->cache = NULL;
+  data->cache_entries = 0;
+}
+
+/* (Re-)create the cache for the current channel block size.  Called
+ * whenever the block size changes.  Failure to allocate simply
+ * disables the cache.
+ */
+static void
+cache_create (io_channel channel, struct io_private_data *data)
+{
+  cache_free (data);
+
+  if (nbdkit_io_cache_size < channel->block_size)
+    return;
+
+  data->cache_entries = nbdkit_io_cache_size / channel->block_size;
+  data->cache = calloc (data->cache_entries, sizeof (struct cache_entry));
+  if (data->cache == NULL)
+    data->cache_entries = 0;
+}
+
+/* Return the cache slot for a block (direct-mapped), or NULL if the
+ * cache is disabled.
+ */
+static struct cache_entry *
+cache_slot (struct io_private_data *data, unsigned long long block)
+{
+  if (data->cache_entries == 0)
+    return NULL;
+  return &data->cache[block % data->cache_entries];
+}
+
+static void
+cache_insert (io_channel channel, struct io_private_data *data,
+              unsigned long long block, const void *buf)
+{
+  struct cache_entry *e = cache_slot (data, block);
+
+  if (e == NULL)
+    return;
+  if (e->buf == NULL) {
+    e->buf = malloc (channel->block_size);
+    if (e->buf == NULL)
+      return;
+  }
+  memcpy (e->buf, buf, channel->block_size);
+  e->block = block;
+  e->valid = true;
+}
+
+/* Drop any cached copies of blocks in [block, block+count). */
+static void
+cache_invalidate (struct io_private_data *data,
+                  unsigned long long block, unsigned long long count)
+{
+  unsigned long long i;
+  struct cache_entry *e;
+
+  if (data->cache_entries == 0)
+    return;
+
+  if (count >= data->cache_entries) {
+    for (i = 0; i < data->cache_entries; ++i)
+      data->cache[i].valid = false;
+    return;
+  }
+
+  for (i = 0; i < count; ++i) {
+    e = cache_slot (data, block + i);
+    if (e->valid && e->block == block + i)
+      e->valid = false;
+  }
+}
+
 /*
  * Here are the raw I/O functions
  */
@@ -113,6 +238,68 @@ raw_read_blk (io_channel channel,
   return retval;
 }
 
+/* Single-block read going through the cache. */
+static errcode_t
+cached_read_blk (io_channel channel, struct io_private_data *data,
+                 unsigned long long block, void *buf)
+{
+  struct cache_entry *e = cache_slot (data, block);
+  errcode_t retval;
+
+  if (e != NULL && e->valid && e->block == block) {
+    data->hits++;
+    memcpy (buf, e->buf, channel->block_size);
+    return 0;
+  }
+
+  data->misses++;
+
+  /* Sequential misses are typically an inode table scan.  Fetch a
+   * run of blocks in one request and cache them so that the
+   * following reads are hits.
+   */
+  if (e != NULL && block == data->last_miss + 1) {
+    size_t ra = MIN ((size_t) READAHEAD_BLOCKS, data->cache_entries);
+    ext2_loff_t location =
+      (ext2_loff_t) block * channel->block_size + data->offset;
+    int64_t devsize = data->next_ops->get_size (data->nxdata);
+
+    if (devsize >= 0 &&
+        location + (ext2_loff_t) ra * channel->block_size > devsize) {
+      if (location >= devsize)
+        ra = 0;
+      else
+        ra = (devsize - location) / channel->block_size;
+    }
+
+    if (ra > 1) {
+      char *rabuf = malloc (ra * channel->block_size);
+
+      if (rabuf != NULL) {
+        retval = raw_read_blk (channel, data, block, (int) ra, rabuf);
+        if (retval == 0) {
+          size_t i;
+
+          for (i = 0; i < ra; ++i)
+            cache_insert (channel, data, block + i,
+                          rabuf + i * channel->block_size);
+          memcpy (buf, rabuf, channel->block_size);
+          data->last_miss = block;
+          free (rabuf);
+          return 0;
+        }
+        free (rabuf);
+      }
+    }
+  }
+  data->last_miss = block;
+
+  retval = raw_read_blk (channel, data, block, 1, buf);
+  if (retval == 0)
+    cache_insert (channel, data, block, buf);
+  return retval;
+}
+
 static errcode_t
 raw_write_blk (io_channel channel,
                struct io_private_data *data,
@@ -217,6 +404,9 @@ io_open (const char *name, int flags,
     retval = EPERM;
     goto cleanup;
   }
+
+  cache_create (io, data);
+
   *channel = io;
   return 0;
 
@@ -245,6 +435,11 @@ io_close (io_channel channel)
   if (--channel->refcount > 0)
     return 0;
 
+  if (data->hits + data->misses > 0)
+    nbdkit_debug ("ext2: block cache: %" PRIu64 " hits, %" PRIu64 " misses",
+                  data->hits, data->misses);
+  cache_free (data);
+
   ext2fs_free_mem (&channel->private_data);
   if (channel->name)
     ext2fs_free_mem (&channel->name);
@@ -261,7 +456,11 @@ io_set_blksize (io_channel channel, int blksize)
   data = (struct io_private_data *) channel->private_data;
   EXT2_CHECK_MAGIC (data, EXT2_ET_MAGIC_NBDKIT_IO_CHANNEL);
 
-  channel->block_size = blksize;
+  if (channel->block_size != blksize) {
+    channel->block_size = blksize;
+    /* The cache holds whole blocks so it must be rebuilt. */
+    cache_create (channel, data);
+  }
   return 0;
 }
 
@@ -275,6 +474,9 @@ io_read_blk64 (io_channel channel, unsigned long long block,
   data = (struct io_private_data *) channel->private_data;
   EXT2_CHECK_MAGIC (data, EXT2_ET_MAGIC_NBDKIT_IO_CHANNEL);
 
+  if (count == 1 && data->cache_entries > 0)
+    return cached_read_blk (channel, data, block, buf);
+
   return raw_read_blk (channel, data, block, count, buf);
 }
 
@@ -290,12 +492,30 @@ io_write_blk64 (io_channel channel, unsigned long long block,
                 int count, const void *buf)
 {
   struct io_private_data *data;
+  errcode_t retval;
 
   EXT2_CHECK_MAGIC (channel, EXT2_ET_MAGIC_IO_CHANNEL);
   data = (struct io_private_data *) channel->private_data;
   EXT2_CHECK_MAGIC (data, EXT2_ET_MAGIC_NBDKIT_IO_CHANNEL);
 
-  return raw_write_blk (channel, data, block, count, buf);
+  retval = raw_write_blk (channel, data, block, count, buf);
+  if (retval)
+    return retval;
+
+  /* Write-through: keep the cache in sync with what was written. */
+  if (count == 1)
+    cache_insert (channel, data, block, buf);
+  else {
+    unsigned long long nr_blocks;
+
+    if (count < 0)
+      nr_blocks = ((unsigned long long) -count + channel->block_size - 1)
+        / channel->block_size;
+    else
+      nr_blocks = count;
+    cache_invalidate (data, block, nr_blocks);
+  }
+  return 0;
 }
 
 #ifdef HAVE_STRUCT_STRUCT_IO_MANAGER_CACHE_READAHEAD
@@ -310,6 +530,26 @@ io_cache_readahead (io_channel channel,
   data = (struct io_private_data *)channel->private_data;
   EXT2_CHECK_MAGIC (data, EXT2_ET_MAGIC_NBDKIT_IO_CHANNEL);
 
+  /* Pull the start of the range into the local block cache.  ext2fs
+   * issues this ahead of inode table scans, which then arrive as
+   * single-block reads.
+   */
+  if (data->cache_entries > 0) {
+    size_t n = MIN (count, data->cache_entries);
+    char *buf = malloc (n * channel->block_size);
+
+    if (buf != NULL) {
+      if (raw_read_blk (channel, data, block, (int) n, buf) == 0) {
+        size_t i;
+
+        for (i = 0; i < n; ++i)
+          cache_insert (channel, data, block + i,
+                        buf + i * channel->block_size);
+      }
+      free (buf);
+    }
+  }
+
   if (data->next_ops->can_cache (data->nxdata) == 1) {
     /* TODO is 32-bit overflow ever likely to be a problem? */
     if (data->next_ops->cache (data->nxdata,
@@ -346,6 +586,10 @@ io_write_byte (io_channel channel, unsigned long offset,
                               offset + data->offset, 0, &errno) == -1)
     return errno;
 
+  cache_invalidate (data, offset / channel->block_size,
+                    (offset % channel->block_size + size +
+                     channel->block_size - 1) / channel->block_size);
+
   return 0;
 }
 
@@ -410,8 +654,10 @@ io_discard (io_channel channel, unsigned long long block,
                               (off_t)(count) * channel->block_size,
                               ((off_t)(block) * channel->block_size +
                                data->offset),
-                              0, &errno) == 0)
+                              0, &errno) == 0) {
+      cache_invalidate (data, block, count);
       return 0;
+    }
     if (errno == EOPNOTSUPP)
       goto unimplemented;
     return errno;
@@ -438,8 +684,10 @@ io_zeroout (io_channel channel, unsigned long long block,
                               (off_t)(count) * channel->block_size,
                               ((off_t)(block) * channel->block_size +
                                data->offset),
-                              NBDKIT_FLAG_MAY_TRIM, &errno) == 0)
+                              NBDKIT_FLAG_MAY_TRIM, &errno) == 0) {
+      cache_invalidate (data, block, count);
       return 0;
+    }
     if (errno == EOPNOTSUPP)
       goto unimplemented;
     return errno;
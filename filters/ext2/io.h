@@ -53,5 +53,10 @@ extern int nbdkit_io_decode(const char *name, struct nbdkit_next *out)
 /* Custom io manager that performs all ext2fs I/O on the next nbdkit layer */
 extern io_manager nbdkit_io_manager;
 
+/* Size in bytes of the write-through block cache inside each io
+ * channel (0 disables the cache).  Set from the ext2cache parameter.
+ */
+extern int64_t nbdkit_io_cache_size;
+
 
 #endif /* NBDKIT_IO_H */
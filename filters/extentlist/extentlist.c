@@ -35,10 +35,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <nbdkit-filter.h>
 
@@ -50,6 +55,7 @@
 #define HOLE (NBDKIT_EXTENT_HOLE|NBDKIT_EXTENT_ZERO)
 
 static const char *extentlist;
+static const char *extentlist_compile; /* extentlist-compile=FILE */
 
 /* List of extents.  Once we've finally parsed them this will be
  * ordered, non-overlapping and have no gaps.
@@ -61,6 +67,40 @@ struct extent {
 DEFINE_VECTOR_TYPE(extent_list, struct extent);
 static extent_list extents;
 
+/* This lock protects the extent list, the cursor and the reload
+ * state, since the list can be swapped at runtime when the extent
+ * list file changes.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Cursor remembering where the last lookup ended.  Sequential scans
+ * (qemu-img convert and similar linear clients) hit the cursor and
+ * skip the binary search entirely.
+ */
+static size_t cursor;
+
+/* File identity when we last (re-)loaded the list, used to notice
+ * that the file has been replaced.
+ */
+static time_t load_mtime;
+static off_t load_size;
+
+/* Compiled extent list format: a 16 byte magic, a version, the
+ * number of entries, then the fully processed (sorted, gap-filled)
+ * extent array written out directly.  Like the other binary caches
+ * in nbdkit this is not endian- or arch-portable; the magic check
+ * simply fails and you must recompile the list.
+ */
+#define BIN_MAGIC "NBDKITEXTENTLIST" /* exactly 16 bytes, no trailing NUL */
+#define BIN_VERSION 1
+
+struct bin_header {
+  char magic[16];
+  uint32_t version;
+  uint32_t unused;
+  uint64_t count;
+};
+
 static void
 extentlist_unload (void)
 {
@@ -80,6 +120,10 @@ extentlist_config (nbdkit_next_config *next, void *nxdata,
     extentlist = value;
     return 0;
   }
+  else if (strcmp (key, "extentlist-compile") == 0) {
+    extentlist_compile = value;
+    return 0;
+  }
   else
     return next (nxdata, key, value);
 }
@@ -121,25 +165,12 @@ compare_ranges (const void *ev1, const struct extent *e2)
 }
 
 /* Similar to parse_extents in plugins/sh/methods.c */
-static void
-parse_extentlist (void)
+static int
+parse_text (FILE *fp, extent_list *list)
 {
-  FILE *fp;
   CLEANUP_FREE char *line = NULL;
   size_t linelen = 0;
   ssize_t len;
-  size_t i;
-  uint64_t end;
-
-  assert (extentlist != NULL);
-  assert (extents.ptr == NULL);
-  assert (extents.size == 0);
-
-  fp = fopen (extentlist, "r");
-  if (!fp) {
-    nbdkit_error ("open: %s: %m", extentlist);
-    exit (EXIT_FAILURE);
-  }
 
   while ((len = getline (&line, &linelen, fp)) != -1) {
     const char *delim = " \t";
@@ -155,17 +186,17 @@ parse_extentlist (void)
     if ((p = strtok_r (line, delim, &sp)) == NULL) {
     parse_error:
       nbdkit_error ("%s: cannot parse %s", extentlist, line);
-      exit (EXIT_FAILURE);
+      return -1;
     }
     offset = nbdkit_parse_size (p);
     if (offset == -1)
-      exit (EXIT_FAILURE);
+      return -1;
 
     if ((p = strtok_r (NULL, delim, &sp)) == NULL)
       goto parse_error;
     length = nbdkit_parse_size (p);
     if (length == -1)
-      exit (EXIT_FAILURE);
+      return -1;
 
     /* Skip zero length extents.  Makes the rest of the code easier. */
     if (length == 0)
@@ -184,79 +215,275 @@ parse_extentlist (void)
         type |= NBDKIT_EXTENT_ZERO;
     }
 
-    if (extent_list_append (&extents,
+    if (extent_list_append (list,
                             (struct extent){.offset = offset, .length=length,
                                             .type=type}) == -1) {
       nbdkit_error ("realloc: %m");
-      exit (EXIT_FAILURE);
+      return -1;
     }
   }
 
-  fclose (fp);
+  return 0;
+}
+
+/* Sort, check for overlaps and fill the gaps with hole|zero extents,
+ * making the list ordered, non-overlapping and gapless.
+ */
+static int
+postprocess (extent_list *list)
+{
+  size_t i;
+  uint64_t end;
 
   /* Sort the extents by offset. */
-  extent_list_sort (&extents, compare_offsets);
+  extent_list_sort (list, compare_offsets);
 
   /* There must not be overlaps at this point. */
   end = 0;
-  for (i = 0; i < extents.size; ++i) {
-    if (extents.ptr[i].offset < end ||
-        extents.ptr[i].offset + extents.ptr[i].length < extents.ptr[i].offset) {
+  for (i = 0; i < list->size; ++i) {
+    if (list->ptr[i].offset < end ||
+        list->ptr[i].offset + list->ptr[i].length < list->ptr[i].offset) {
       nbdkit_error ("extents in the extent list are overlapping");
-      exit (EXIT_FAILURE);
+      return -1;
     }
-    end = extents.ptr[i].offset + extents.ptr[i].length;
+    end = list->ptr[i].offset + list->ptr[i].length;
   }
 
   /* If there's a gap at the beginning, insert a hole|zero extent. */
-  if (extents.size == 0 || extents.ptr[0].offset > 0) {
-    end = extents.size == 0 ? UINT64_MAX : extents.ptr[0].offset;
-    if (extent_list_insert (&extents,
+  if (list->size == 0 || list->ptr[0].offset > 0) {
+    end = list->size == 0 ? UINT64_MAX : list->ptr[0].offset;
+    if (extent_list_insert (list,
                             (struct extent){.offset = 0, .length = end,
                                             .type = HOLE},
                             0) == -1) {
       nbdkit_error ("realloc: %m");
-      exit (EXIT_FAILURE);
+      return -1;
     }
   }
 
   /* Now insert hole|zero extents after every extent where there
    * is a gap between that extent and the next one.
    */
-  for (i = 0; i < extents.size-1; ++i) {
-    end = extents.ptr[i].offset + extents.ptr[i].length;
-    if (end < extents.ptr[i+1].offset)
-      if (extent_list_insert (&extents,
+  for (i = 0; i < list->size-1; ++i) {
+    end = list->ptr[i].offset + list->ptr[i].length;
+    if (end < list->ptr[i+1].offset)
+      if (extent_list_insert (list,
                               (struct extent){.offset = end,
-                                              .length = extents.ptr[i+1].offset - end,
+                                              .length = list->ptr[i+1].offset - end,
                                               .type = HOLE},
                               i+1) == -1) {
         nbdkit_error ("realloc: %m");
-        exit (EXIT_FAILURE);
+        return -1;
       }
   }
 
   /* If there's a gap at the end, insert a hole|zero extent. */
-  end = extents.ptr[extents.size-1].offset + extents.ptr[extents.size-1].length;
+  end = list->ptr[list->size-1].offset + list->ptr[list->size-1].length;
   if (end < UINT64_MAX) {
-    if (extent_list_append (&extents,
+    if (extent_list_append (list,
                             (struct extent){.offset = end,
                                             .length = UINT64_MAX-end,
                                             .type = HOLE}) == -1) {
       nbdkit_error ("realloc: %m");
-      exit (EXIT_FAILURE);
+      return -1;
     }
   }
 
   /* Debug the final list. */
-  for (i = 0; i < extents.size; ++i) {
+  for (i = 0; i < list->size; ++i) {
     nbdkit_debug ("extentlist: "
                   "extent[%zu] = %" PRIu64 "-%" PRIu64 " (length %" PRIu64 ")"
                   " type %" PRIu32,
-                  i, extents.ptr[i].offset,
-                  extents.ptr[i].offset + extents.ptr[i].length - 1,
-                  extents.ptr[i].length,
-                  extents.ptr[i].type);
+                  i, list->ptr[i].offset,
+                  list->ptr[i].offset + list->ptr[i].length - 1,
+                  list->ptr[i].length,
+                  list->ptr[i].type);
+  }
+
+  return 0;
+}
+
+/* Load a compiled extent list.  The stored list was already
+ * postprocessed when it was compiled.
+ */
+static int
+load_binary (FILE *fp, extent_list *list)
+{
+  struct bin_header hdr;
+
+  if (fread (&hdr, sizeof hdr, 1, fp) != 1) {
+    nbdkit_error ("%s: cannot read header: %m", extentlist);
+    return -1;
+  }
+  assert (memcmp (hdr.magic, BIN_MAGIC, sizeof hdr.magic) == 0);
+  if (hdr.version != BIN_VERSION) {
+    nbdkit_error ("%s: unsupported compiled extent list version %" PRIu32,
+                  extentlist, hdr.version);
+    return -1;
+  }
+  if (hdr.count == 0) {
+    nbdkit_error ("%s: empty compiled extent list", extentlist);
+    return -1;
+  }
+
+  if (extent_list_reserve (list, hdr.count) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  if (fread (list->ptr, sizeof (struct extent), hdr.count, fp) != hdr.count) {
+    nbdkit_error ("%s: truncated compiled extent list", extentlist);
+    return -1;
+  }
+  list->size = hdr.count;
+
+  return 0;
+}
+
+/* Compile the processed list to a binary file which later runs can
+ * load directly, skipping the text parse.  Written to a temporary
+ * file and renamed into place.
+ */
+static int
+save_binary (const char *filename, const extent_list *list)
+{
+  CLEANUP_FREE char *tmp = NULL;
+  struct bin_header hdr;
+  FILE *fp;
+  int fd;
+
+  if (asprintf (&tmp, "%s.XXXXXX", filename) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+  fd = mkstemp (tmp);
+  if (fd == -1) {
+    nbdkit_error ("mkstemp: %s: %m", tmp);
+    return -1;
+  }
+
+  fp = fdopen (fd, "w");
+  if (fp == NULL) {
+    nbdkit_error ("fdopen: %s: %m", tmp);
+    close (fd);
+    goto err;
+  }
+
+  memset (&hdr, 0, sizeof hdr);
+  memcpy (hdr.magic, BIN_MAGIC, sizeof hdr.magic);
+  hdr.version = BIN_VERSION;
+  hdr.count = list->size;
+  if (fwrite (&hdr, sizeof hdr, 1, fp) != 1 ||
+      fwrite (list->ptr, sizeof (struct extent), list->size, fp)
+      != list->size ||
+      fflush (fp) == EOF ||
+      fsync (fileno (fp)) == -1) {
+    nbdkit_error ("write: %s: %m", tmp);
+    fclose (fp);
+    goto err;
+  }
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("close: %s: %m", tmp);
+    goto err;
+  }
+
+  if (rename (tmp, filename) == -1) {
+    nbdkit_error ("rename: %s: %m", filename);
+    goto err;
+  }
+
+  nbdkit_debug ("extentlist: compiled %zu extents to %s",
+                list->size, filename);
+  return 0;
+
+ err:
+  unlink (tmp);
+  return -1;
+}
+
+/* (Re-)load the extent list file, swapping in the new list under the
+ * lock so in-flight connections are not disturbed.  The format is
+ * detected from the file: compiled lists start with a magic string,
+ * anything else is parsed as text.
+ */
+static int
+load_extentlist (void)
+{
+  FILE *fp;
+  extent_list new_extents = empty_vector;
+  extent_list old_extents;
+  struct stat statbuf;
+  char magic[16];
+  bool binary;
+
+  assert (extentlist != NULL);
+
+  fp = fopen (extentlist, "r");
+  if (!fp) {
+    nbdkit_error ("open: %s: %m", extentlist);
+    return -1;
+  }
+  if (fstat (fileno (fp), &statbuf) == -1) {
+    nbdkit_error ("stat: %s: %m", extentlist);
+    fclose (fp);
+    return -1;
+  }
+
+  binary = fread (magic, sizeof magic, 1, fp) == 1 &&
+    memcmp (magic, BIN_MAGIC, sizeof magic) == 0;
+  rewind (fp);
+
+  if (binary ? load_binary (fp, &new_extents) == -1
+             : (parse_text (fp, &new_extents) == -1 ||
+                postprocess (&new_extents) == -1)) {
+    free (new_extents.ptr);
+    fclose (fp);
+    return -1;
+  }
+  fclose (fp);
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    old_extents = extents;
+    extents = new_extents;
+    cursor = 0;
+    load_mtime = statbuf.st_mtime;
+    load_size = statbuf.st_size;
+  }
+  free (old_extents.ptr);
+
+  return 0;
+}
+
+/* Check whether the extent list file has been replaced and reload it
+ * if so.  A failed reload keeps serving the old list.  The check is
+ * one stat(2) per extents request, which is noise compared to the
+ * request itself.
+ */
+static void
+maybe_reload (void)
+{
+  struct stat statbuf;
+  bool changed;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    if (stat (extentlist, &statbuf) == -1)
+      return;                   /* ignore, keep the current list */
+    changed = statbuf.st_mtime != load_mtime || statbuf.st_size != load_size;
+    if (changed) {
+      /* Record the new identity now so that a failing reload is not
+       * retried on every request.
+       */
+      load_mtime = statbuf.st_mtime;
+      load_size = statbuf.st_size;
+    }
+  }
+
+  if (changed) {
+    nbdkit_debug ("extentlist: %s changed, reloading", extentlist);
+    if (load_extentlist () == -1)
+      nbdkit_error ("extentlist: reloading %s failed, "
+                    "keeping the previous extent list", extentlist);
   }
 }
 
@@ -264,7 +491,12 @@ static int
 extentlist_get_ready (nbdkit_next_get_ready *next, void *nxdata,
                       int thread_model)
 {
-  parse_extentlist ();
+  if (load_extentlist () == -1)
+    return -1;
+
+  if (extentlist_compile &&
+      save_binary (extentlist_compile, &extents) == -1)
+    return -1;
 
   return next (nxdata);
 }
@@ -292,10 +524,25 @@ extentlist_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
   ssize_t i;
   uint64_t end;
 
-  /* Find the starting point in the extents list. */
-  p = extent_list_search (&extents, &eoffset, compare_ranges);
-  assert (p != NULL);
-  i = p - extents.ptr;
+  maybe_reload ();
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  /* Find the starting point in the extents list.  Try the cursor
+   * left behind by the previous request first: linear scans land
+   * either on the same extent or the following one, skipping the
+   * binary search.
+   */
+  if (compare_ranges (&eoffset, &extents.ptr[cursor]) == 0)
+    i = cursor;
+  else if (cursor + 1 < extents.size &&
+           compare_ranges (&eoffset, &extents.ptr[cursor + 1]) == 0)
+    i = cursor + 1;
+  else {
+    p = extent_list_search (&extents, &eoffset, compare_ranges);
+    assert (p != NULL);
+    i = p - extents.ptr;
+  }
 
   /* Add extents to the output. */
   while (count > 0) {
@@ -314,6 +561,8 @@ extentlist_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
     i++;
   }
 
+  cursor = i > 0 ? i - 1 : 0;
+
   return 0;
 }
 
@@ -0,0 +1,274 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Split large requests into sub-requests issued concurrently — the
+ * inverse of the blocksize filter.  A single large client request
+ * (eg. a 32M read from nbdcopy) otherwise executes as one .pread
+ * call on one thread, leaving a parallel plugin idle.
+ *
+ * The helper threads issue next_ops calls on behalf of the request
+ * using nbdkit_get_request_context / nbdkit_set_request_context, so
+ * this only makes sense — and is only safe — when the server's
+ * thread model is parallel.  The filter checks this in .get_ready
+ * and falls back to passing requests through unchanged otherwise.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "ispowerof2.h"
+#include "minmax.h"
+
+/* Requests larger than this are split into pieces of this size. */
+static unsigned splitsize = 1024*1024;
+
+/* Maximum number of concurrent sub-requests per client request. */
+static unsigned nr_threads = 8;
+
+/* False if the thread model turned out not to be parallel. */
+static bool enabled = true;
+
+static int
+fanout_config (nbdkit_next_config *next, void *nxdata,
+               const char *key, const char *value)
+{
+  if (strcmp (key, "fanout-split") == 0) {
+    int64_t r;
+
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r < 65536 || r > 64*1024*1024 || !is_power_of_2 (r)) {
+      nbdkit_error ("fanout-split must be a power of 2 "
+                    "between 64K and 64M");
+      return -1;
+    }
+    splitsize = r;
+    return 0;
+  }
+  else if (strcmp (key, "fanout-threads") == 0) {
+    if (nbdkit_parse_unsigned ("fanout-threads", value, &nr_threads) == -1)
+      return -1;
+    if (nr_threads < 1 || nr_threads > 64) {
+      nbdkit_error ("fanout-threads must be between 1 and 64");
+      return -1;
+    }
+    return 0;
+  }
+  else {
+    return next (nxdata, key, value);
+  }
+}
+
+#define fanout_config_help \
+  "fanout-split=SIZE         Size of the concurrent sub-requests that\n" \
+  "                          larger requests are split into (default 1M).\n" \
+  "fanout-threads=N          Maximum concurrent sub-requests per request\n" \
+  "                          (default 8)."
+
+static int
+fanout_get_ready (nbdkit_next_get_ready *next, nbdkit_backend *nxdata,
+                  int thread_model)
+{
+  if (next (nxdata) == -1)
+    return -1;
+
+  /* Issuing concurrent sub-requests would violate any thread model
+   * which serializes requests, so just pass requests through.
+   */
+  if (thread_model != NBDKIT_THREAD_MODEL_PARALLEL) {
+    nbdkit_debug ("fanout: thread model is not parallel, "
+                  "large requests will not be split");
+    enabled = false;
+  }
+
+  return 0;
+}
+
+/* One client request being fanned out.  Worker threads pull piece
+ * numbers from next_piece until all pieces are issued or a piece
+ * fails.
+ */
+struct fanout_work {
+  struct nbdkit_next_ops *next_ops;
+  nbdkit_backend *nxdata;
+  void *context;                /* from nbdkit_get_request_context */
+
+  bool is_write;
+  uint8_t *buf;
+  uint32_t count;
+  uint64_t offset;
+  uint32_t flags;
+
+  pthread_mutex_t lock;
+  unsigned next_piece;
+  unsigned nr_pieces;
+  int ret;                      /* set to -1 on the first failure */
+  int err;
+};
+
+static void *
+fanout_worker (void *vw)
+{
+  struct fanout_work *w = vw;
+
+  nbdkit_set_request_context (w->context);
+
+  for (;;) {
+    unsigned piece;
+    uint64_t pieceoffs;
+    uint32_t piececount;
+    int r, err = 0;
+
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&w->lock);
+      if (w->ret == -1 || w->next_piece >= w->nr_pieces)
+        return NULL;
+      piece = w->next_piece++;
+    }
+
+    pieceoffs = (uint64_t) piece * splitsize;
+    piececount = MIN ((uint64_t) splitsize, w->count - pieceoffs);
+
+    if (w->is_write)
+      r = w->next_ops->pwrite (w->nxdata, w->buf + pieceoffs, piececount,
+                               w->offset + pieceoffs, w->flags, &err);
+    else
+      r = w->next_ops->pread (w->nxdata, w->buf + pieceoffs, piececount,
+                              w->offset + pieceoffs, w->flags, &err);
+
+    if (r == -1) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&w->lock);
+      if (w->ret != -1) {
+        w->ret = -1;
+        w->err = err;
+      }
+      return NULL;
+    }
+  }
+}
+
+/* Fan one request out over up to nr_threads concurrent sub-requests.
+ * The calling thread participates, so only nr_threads-1 helpers are
+ * created; if creating helpers fails the calling thread simply works
+ * through the remaining pieces by itself.
+ */
+static int
+fanout (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+        bool is_write, void *buf, uint32_t count, uint64_t offset,
+        uint32_t flags, int *err)
+{
+  struct fanout_work w = {
+    .next_ops = next_ops,
+    .nxdata = nxdata,
+    .context = nbdkit_get_request_context (),
+    .is_write = is_write,
+    .buf = buf,
+    .count = count,
+    .offset = offset,
+    .flags = flags,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .nr_pieces = (count + splitsize - 1) / splitsize,
+    .ret = 0,
+  };
+  pthread_t thread[64];
+  unsigned i, created = 0, helpers;
+
+  helpers = MIN (w.nr_pieces, nr_threads) - 1;
+  for (i = 0; i < helpers; ++i) {
+    int r = pthread_create (&thread[created], NULL, fanout_worker, &w);
+    if (r != 0) {
+      nbdkit_debug ("fanout: pthread_create: %s", strerror (r));
+      break;
+    }
+    created++;
+  }
+
+  fanout_worker (&w);
+
+  for (i = 0; i < created; ++i)
+    pthread_join (thread[i], NULL);
+
+  if (w.ret == -1)
+    *err = w.err;
+  return w.ret;
+}
+
+/* Read data. */
+static int
+fanout_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+              void *handle, void *buf, uint32_t count, uint64_t offset,
+              uint32_t flags, int *err)
+{
+  if (!enabled || count <= splitsize)
+    return next_ops->pread (nxdata, buf, count, offset, flags, err);
+
+  return fanout (next_ops, nxdata, false, buf, count, offset, flags, err);
+}
+
+/* Write data. */
+static int
+fanout_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
+               void *handle, const void *buf, uint32_t count, uint64_t offset,
+               uint32_t flags, int *err)
+{
+  if (!enabled || count <= splitsize)
+    return next_ops->pwrite (nxdata, buf, count, offset, flags, err);
+
+  return fanout (next_ops, nxdata, true, (void *) buf, count, offset,
+                 flags, err);
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "fanout",
+  .longname          = "nbdkit fanout filter",
+  .config            = fanout_config,
+  .config_help       = fanout_config_help,
+  .get_ready         = fanout_get_ready,
+  .pread             = fanout_pread,
+  .pwrite            = fanout_pwrite,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
@@ -38,6 +38,10 @@
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <pthread.h>
 
 #include <nbdkit-filter.h>
 
@@ -50,6 +54,74 @@ static enum FuaMode {
   DISCARD,
 } fuamode;
 
+/* Flush coalescing (group commit): concurrent requests needing a
+ * flush share one backend flush instead of issuing one each.  A
+ * request is satisfied by any flush which starts after the request
+ * joined, so while one flush is running all new arrivals form the
+ * next batch and a single flush completes all of them.  This adds no
+ * latency when there is no concurrency: an uncontended request
+ * becomes the leader and flushes immediately.
+ */
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t flush_started;  /* number of the last batch started */
+static uint64_t flush_completed;/* number of the last batch completed */
+static uint64_t flush_failed;   /* number of the last batch that failed */
+static int flush_failed_errno;
+static bool flush_running;
+static uint64_t flushes_requested, flushes_issued; /* stats */
+
+static int
+coalesced_flush (struct nbdkit_next_ops *next_ops, void *nxdata, int *err)
+{
+  uint64_t target;
+  int r;
+
+  pthread_mutex_lock (&flush_lock);
+  flushes_requested++;
+  /* Only a flush which starts after this point covers us. */
+  target = flush_started + 1;
+  while (flush_completed < target) {
+    if (!flush_running) {
+      /* Become the leader of the next batch. */
+      uint64_t batch = ++flush_started;
+      int e = 0;
+
+      flush_running = true;
+      flushes_issued++;
+      pthread_mutex_unlock (&flush_lock);
+      r = next_ops->flush (nxdata, 0, &e);
+      pthread_mutex_lock (&flush_lock);
+      flush_completed = batch;
+      if (r == -1) {
+        flush_failed = batch;
+        flush_failed_errno = e;
+      }
+      flush_running = false;
+      pthread_cond_broadcast (&flush_cond);
+    }
+    else
+      pthread_cond_wait (&flush_cond, &flush_lock);
+  }
+  if (flush_failed >= target) {
+    *err = flush_failed_errno ? flush_failed_errno : EIO;
+    r = -1;
+  }
+  else
+    r = 0;
+  pthread_mutex_unlock (&flush_lock);
+  return r;
+}
+
+static void
+fua_unload (void)
+{
+  if (flushes_requested > 0)
+    nbdkit_debug ("fua: %" PRIu64 " flushes requested, "
+                  "%" PRIu64 " issued to the plugin",
+                  flushes_requested, flushes_issued);
+}
+
 static int
 fua_config (nbdkit_next_config *next, void *nxdata,
             const char *key, const char *value)
@@ -186,7 +258,7 @@ fua_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
   }
   r = next_ops->pwrite (nxdata, buf, count, offs, flags, err);
   if (r != -1 && need_flush)
-    r = next_ops->flush (nxdata, 0, err);
+    r = coalesced_flush (next_ops, nxdata, err);
   return r;
 }
 
@@ -203,7 +275,7 @@ fua_flush (struct nbdkit_next_ops *next_ops, void *nxdata,
   case EMULATE:
   case NATIVE:
   case PASS:
-    return next_ops->flush (nxdata, flags, err);
+    return coalesced_flush (next_ops, nxdata, err);
   }
   abort ();
 }
@@ -238,7 +310,7 @@ fua_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
   }
   r = next_ops->trim (nxdata, count, offs, flags, err);
   if (r != -1 && need_flush)
-    r = next_ops->flush (nxdata, 0, err);
+    r = coalesced_flush (next_ops, nxdata, err);
   return r;
 }
 
@@ -272,13 +344,14 @@ fua_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
   }
   r = next_ops->zero (nxdata, count, offs, flags, err);
   if (r != -1 && need_flush)
-    r = next_ops->flush (nxdata, 0, err);
+    r = coalesced_flush (next_ops, nxdata, err);
   return r;
 }
 
 static struct nbdkit_filter filter = {
   .name              = "fua",
   .longname          = "nbdkit fua filter",
+  .unload            = fua_unload,
   .config            = fua_config,
   .config_help       = fua_config_help,
   .prepare           = fua_prepare,
@@ -32,12 +32,14 @@
 
 #include <config.h>
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
 
@@ -46,26 +48,53 @@
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
-#include "pread.h"
 #include "minmax.h"
 
-/* The first thread to call gzip_prepare has to uncompress the whole
- * plugin to the temporary file.  This lock prevents concurrent
- * access.
+/* Instead of uncompressing the whole stream up front into a temporary
+ * file, we keep a "zran"-style random access index (see
+ * examples/zran.c in the zlib sources): while making a single
+ * sequential pass over the stream we save a checkpoint every ‘span’
+ * bytes of uncompressed output, containing the compressed bit
+ * position and the preceding 32K window of uncompressed data.  Reads
+ * then restart raw inflation from the nearest checkpoint at or before
+ * the requested offset, so each read decompresses at most ‘span’
+ * bytes instead of requiring the whole file on disk.
+ *
+ * The index can optionally be saved to a file (gzip-index=FILENAME)
+ * in which case subsequent server startups skip the sequential pass
+ * entirely.
+ */
+
+#define WINSIZE 32768           /* Deflate history window size. */
+
+struct checkpoint {
+  uint64_t out;                 /* Uncompressed offset of this point. */
+  uint64_t in;                  /* Compressed offset of first full byte. */
+  uint32_t bits;                /* Bits (0-7) needed from the byte at in-1. */
+  uint32_t window_have;         /* Valid bytes at the end of window[]. */
+  uint8_t window[WINSIZE];      /* Preceding uncompressed data. */
+};
+
+/* The lock protects the creation of the index by the first thread to
+ * call gzip_prepare.  After that the index is immutable and reads do
+ * not take the lock.
  */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Temporary file storing the uncompressed data. */
-static int fd = -1;
+static struct checkpoint *points;
+static uint64_t nr_points;
 
 /* Size of compressed and uncompressed data. */
 static int64_t compressed_size = -1, size = -1;
 
+static uint64_t span = 8 * 1024 * 1024;
+static char *index_path;        /* gzip-index=FILENAME */
+
 static void
 gzip_unload (void)
 {
-  if (fd >= 0)
-    close (fd);
+  free (points);
+  free (index_path);
 }
 
 static int
@@ -74,6 +103,36 @@ gzip_thread_model (void)
   return NBDKIT_THREAD_MODEL_PARALLEL;
 }
 
+static int
+gzip_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
+             const char *key, const char *value)
+{
+  if (strcmp (key, "gzip-span") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r < 2 * WINSIZE) {
+      nbdkit_error ("gzip-span parameter is too small");
+      return -1;
+    }
+    span = (uint64_t) r;
+    return 0;
+  }
+  else if (strcmp (key, "gzip-index") == 0) {
+    free (index_path);
+    index_path = nbdkit_absolute_path (value);
+    if (index_path == NULL)
+      return -1;
+    return 0;
+  }
+  else
+    return next (nxdata, key, value);
+}
+
+#define gzip_config_help \
+  "gzip-span=<SIZE>     (optional) Distance between index points (default: 8M)\n"\
+  "gzip-index=<FILENAME> (optional) File used to persist the index\n"
+
 static void *
 gzip_open (nbdkit_next_open *next, nbdkit_backend *nxdata,
            int readonly, const char *exportname, int is_tls)
@@ -104,85 +163,210 @@ zerror (const char *op, const z_stream *strm, int zerr)
   }
 }
 
-/* Write a whole buffer to the temporary file or fail. */
+/* Add a checkpoint to the index.  ‘left’ is strm.avail_out, used to
+ * reassemble the circular output window into chronological order.
+ */
 static int
-xwrite (const void *buf, size_t count)
+add_checkpoint (uint32_t bits, uint64_t in, uint64_t out,
+                unsigned left, const uint8_t *window)
 {
-  ssize_t r;
+  struct checkpoint *p;
+
+  /* Grow the array by doubling. */
+  if ((nr_points & (nr_points - 1)) == 0 && nr_points > 0) {
+    p = realloc (points, 2 * nr_points * sizeof *points);
+    if (p == NULL) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    points = p;
+  }
+  else if (nr_points == 0) {
+    points = malloc (sizeof *points);
+    if (points == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+  }
+
+  p = &points[nr_points++];
+  p->bits = bits;
+  p->in = in;
+  p->out = out;
+  p->window_have = MIN (out, WINSIZE);
+  if (left)
+    memcpy (p->window, window + WINSIZE - left, left);
+  if (left < WINSIZE)
+    memcpy (p->window + left, window, WINSIZE - left);
+
+  return 0;
+}
+
+/* Header of the persistent index file. */
+#define GZIP_INDEX_MAGIC "NBDKITGZIPINDEX" /* sizeof == 16 including \0 */
+#define GZIP_INDEX_VERSION 1
+
+struct index_header {
+  char magic[16];
+  uint32_t version;
+  uint32_t unused;
+  uint64_t compressed_size;
+  uint64_t uncompressed_size;
+  uint64_t nr_points;
+};
 
+static int
+full_pread (int fd, void *buf, size_t count)
+{
   while (count > 0) {
-    r = write (fd, buf, count);
-    if (r == -1) {
-      nbdkit_error ("write: %m");
+    ssize_t r = read (fd, buf, count);
+    if (r == -1)
+      return -1;
+    if (r == 0) {
+      errno = EIO;
       return -1;
     }
     buf += r;
     count -= r;
   }
+  return 0;
+}
 
+static int
+full_pwrite (int fd, const void *buf, size_t count)
+{
+  while (count > 0) {
+    ssize_t r = write (fd, buf, count);
+    if (r == -1)
+      return -1;
+    buf += r;
+    count -= r;
+  }
   return 0;
 }
 
-/* The first thread to call gzip_prepare uncompresses the whole plugin. */
+/* Try to load a previously saved index.  Returns 0 if the index was
+ * loaded, 1 if it is missing or does not match this image (so it must
+ * be rebuilt), or -1 on unrecoverable errors.
+ */
 static int
-do_uncompress (struct nbdkit_next_ops *next_ops, void *nxdata)
+load_index (void)
 {
-  z_stream strm;
-  int zerr;
-  const char *tmpdir;
-  size_t len;
-  char *template;
-  CLEANUP_FREE char *in_block = NULL, *out_block = NULL;
+  int fd;
+  struct index_header hdr;
 
-  /* Choose a generous block size here because it's more efficient
-   * with some plugins (esp. curl).  XXX This should really be
-   * configurable.
-   */
-  const size_t block_size = 4 * 1024 * 1024;
+  fd = open (index_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      nbdkit_error ("open: %s: %m", index_path);
+      return -1;
+    }
+    return 1;
+  }
 
-  assert (size == -1);
+  if (full_pread (fd, &hdr, sizeof hdr) == -1 ||
+      memcmp (hdr.magic, GZIP_INDEX_MAGIC, sizeof hdr.magic) != 0 ||
+      hdr.version != GZIP_INDEX_VERSION ||
+      hdr.compressed_size != compressed_size) {
+    nbdkit_debug ("gzip: index file %s missing, invalid or stale, rebuilding",
+                  index_path);
+    close (fd);
+    return 1;
+  }
 
-  /* Get the size of the underlying plugin. */
-  compressed_size = next_ops->get_size (nxdata);
-  if (compressed_size == -1)
+  points = malloc (hdr.nr_points * sizeof *points);
+  if (points == NULL) {
+    nbdkit_error ("malloc: %m");
+    close (fd);
     return -1;
+  }
+  if (full_pread (fd, points, hdr.nr_points * sizeof *points) == -1) {
+    nbdkit_error ("read: %s: %m", index_path);
+    free (points);
+    points = NULL;
+    close (fd);
+    return -1;
+  }
+  close (fd);
 
-  /* Create the temporary file. */
-  tmpdir = getenv ("TMPDIR");
-  if (!tmpdir)
-    tmpdir = LARGE_TMPDIR;
-
-  len = strlen (tmpdir) + 8;
-  template = alloca (len);
-  snprintf (template, len, "%s/XXXXXX", tmpdir);
-
-#ifdef HAVE_MKOSTEMP
-  fd = mkostemp (template, O_CLOEXEC);
-#else
-  /* This is only invoked serially with the lock held, so this is safe. */
-  fd = mkstemp (template);
-  if (fd >= 0) {
-    fd = set_cloexec (fd);
-    if (fd < 0) {
-      int e = errno;
-      unlink (template);
-      errno = e;
-    }
+  nr_points = hdr.nr_points;
+  size = hdr.uncompressed_size;
+  nbdkit_debug ("gzip: loaded index with %" PRIu64 " points from %s",
+                nr_points, index_path);
+  return 0;
+}
+
+/* Save the index.  Failure to save is not fatal: it only means the
+ * next startup has to rebuild the index.
+ */
+static void
+save_index (void)
+{
+  CLEANUP_FREE char *tmppath = NULL;
+  int fd;
+  struct index_header hdr;
+
+  if (asprintf (&tmppath, "%s.tmp", index_path) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return;
   }
-#endif
+
+  fd = open (tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
   if (fd == -1) {
-    nbdkit_error ("mkostemp: %s: %m", tmpdir);
-    return -1;
+    nbdkit_error ("open: %s: %m", tmppath);
+    return;
   }
 
-  unlink (template);
+  memcpy (hdr.magic, GZIP_INDEX_MAGIC, sizeof hdr.magic);
+  hdr.version = GZIP_INDEX_VERSION;
+  hdr.unused = 0;
+  hdr.compressed_size = compressed_size;
+  hdr.uncompressed_size = size;
+  hdr.nr_points = nr_points;
+
+  if (full_pwrite (fd, &hdr, sizeof hdr) == -1 ||
+      full_pwrite (fd, points, nr_points * sizeof *points) == -1) {
+    nbdkit_error ("write: %s: %m", tmppath);
+    close (fd);
+    unlink (tmppath);
+    return;
+  }
+  if (fsync (fd) == -1 || close (fd) == -1) {
+    nbdkit_error ("%s: %m", tmppath);
+    unlink (tmppath);
+    return;
+  }
+  if (rename (tmppath, index_path) == -1) {
+    nbdkit_error ("rename: %s: %m", index_path);
+    unlink (tmppath);
+    return;
+  }
+
+  nbdkit_debug ("gzip: saved index with %" PRIu64 " points to %s",
+                nr_points, index_path);
+}
+
+/* The first thread to call gzip_prepare makes one sequential pass
+ * over the compressed stream, recording a checkpoint at the first
+ * deflate block boundary after each ‘span’ bytes of output.  Nothing
+ * is written to disk; this pass also discovers the uncompressed size
+ * (which cannot be determined reliably any other way, see
+ * https://stackoverflow.com/a/9213826).
+ */
+static int
+build_index (struct nbdkit_next_ops *next_ops, void *nxdata)
+{
+  z_stream strm;
+  int zerr;
+  uint64_t totin = 0, totout = 0, last = 0;
+  CLEANUP_FREE unsigned char *in_block = NULL;
+  CLEANUP_FREE unsigned char *window = NULL;
 
-  /* Uncompress the whole plugin.  This is REQUIRED in order to
-   * implement gzip_get_size.  See: https://stackoverflow.com/a/9213826
-   *
-   * For use of inflateInit2 on gzip streams see:
-   * https://stackoverflow.com/a/1838702
+  /* Choose a generous block size here because it's more efficient
+   * with some plugins (esp. curl).
    */
+  const size_t block_size = 4 * 1024 * 1024;
+
   memset (&strm, 0, sizeof strm);
   zerr = inflateInit2 (&strm, 16+MAX_WBITS);
   if (zerr != Z_OK) {
@@ -191,58 +375,73 @@ do_uncompress (struct nbdkit_next_ops *next_ops, void *nxdata)
   }
 
   in_block = malloc (block_size);
-  if (!in_block) {
-    nbdkit_error ("malloc: %m");
-    return -1;
-  }
-  out_block = malloc (block_size);
-  if (!out_block) {
+  window = malloc (WINSIZE);
+  if (!in_block || !window) {
     nbdkit_error ("malloc: %m");
+    inflateEnd (&strm);
     return -1;
   }
 
+  strm.avail_out = 0;
   for (;;) {
     /* Do we need to read more from the plugin? */
-    if (strm.avail_in == 0 && strm.total_in < compressed_size) {
-      size_t n = MIN (block_size, compressed_size - strm.total_in);
+    if (strm.avail_in == 0 && totin < compressed_size) {
+      size_t n = MIN (block_size, compressed_size - totin);
       int err = 0;
 
-      if (next_ops->pread (nxdata, in_block, (uint32_t) n, strm.total_in,
+      if (next_ops->pread (nxdata, in_block, (uint32_t) n, totin,
                            0, &err) == -1) {
         errno = err;
+        inflateEnd (&strm);
         return -1;
       }
 
-      strm.next_in = (void *) in_block;
+      strm.next_in = in_block;
       strm.avail_in = n;
     }
 
-    /* Inflate the next chunk of input. */
-    strm.next_out = (void *) out_block;
-    strm.avail_out = block_size;
-    zerr = inflate (&strm, Z_SYNC_FLUSH);
-    if (zerr < 0) {
-      zerror ("inflate", &strm, zerr);
-      return -1;
+    /* The output buffer is only used as a circular window so that we
+     * can snapshot the last 32K of output at checkpoints.
+     */
+    if (strm.avail_out == 0) {
+      strm.next_out = window;
+      strm.avail_out = WINSIZE;
     }
 
-    /* Write the output to the file. */
-    if (xwrite (out_block, (char *) strm.next_out - out_block) == -1)
-      return -1;
-
+    /* Inflate until the next deflate block boundary. */
+    totin += strm.avail_in;
+    totout += strm.avail_out;
+    zerr = inflate (&strm, Z_BLOCK);
+    totin -= strm.avail_in;
+    totout -= strm.avail_out;
     if (zerr == Z_STREAM_END)
       break;
+    if (zerr != Z_OK) {
+      zerror ("inflate", &strm, zerr);
+      inflateEnd (&strm);
+      return -1;
+    }
+
+    /* At a block boundary (but not the end of the stream), add a
+     * checkpoint if we have output ‘span’ bytes since the last one.
+     */
+    if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+        (totout == 0 || totout - last >= span)) {
+      if (add_checkpoint (strm.data_type & 7, totin, totout,
+                          strm.avail_out, window) == -1) {
+        inflateEnd (&strm);
+        return -1;
+      }
+      last = totout;
+    }
   }
 
+  inflateEnd (&strm);
+
   /* Set the size to the total uncompressed size. */
-  size = strm.total_out;
+  size = totout;
   nbdkit_debug ("gzip: uncompressed size: %" PRIi64, size);
-
-  zerr = inflateEnd (&strm);
-  if (zerr != Z_OK) {
-    zerror ("inflateEnd", &strm, zerr);
-    return -1;
-  }
+  nbdkit_debug ("gzip: index has %" PRIu64 " points", nr_points);
 
   return 0;
 }
@@ -251,11 +450,31 @@ static int
 gzip_prepare (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
               int readonly)
 {
+  int r;
+
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
 
   if (size >= 0)
     return 0;
-  return do_uncompress (next_ops, nxdata);
+
+  /* Get the size of the underlying plugin. */
+  compressed_size = next_ops->get_size (nxdata);
+  if (compressed_size == -1)
+    return -1;
+
+  if (index_path) {
+    r = load_index ();
+    if (r == -1)
+      return -1;
+    if (r == 0)
+      return 0;
+  }
+
+  if (build_index (next_ops, nxdata) == -1)
+    return -1;
+  if (index_path)
+    save_index ();
+  return 0;
 }
 
 /* Whatever the plugin says, this filter makes it read-only. */
@@ -324,35 +543,166 @@ gzip_get_size (struct nbdkit_next_ops *next_ops, void *nxdata,
   if (t != compressed_size) {
     nbdkit_error ("plugin size changed unexpectedly: "
                   "you must restart nbdkit so the gzip filter "
-                  "can uncompress the data again");
+                  "can index the data again");
     return -1;
   }
 
   return size;
 }
 
-/* Read data from the temporary file. */
+/* Find the last checkpoint at or before the uncompressed offset, or
+ * NULL meaning start from the beginning of the stream.
+ */
+static const struct checkpoint *
+find_checkpoint (uint64_t offset)
+{
+  uint64_t lo = 0, hi = nr_points;
+
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (points[mid].out <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? &points[lo-1] : NULL;
+}
+
+/* Read data by raw-inflating from the nearest checkpoint. */
 static int
 gzip_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
             void *handle, void *buf, uint32_t count, uint64_t offset,
             uint32_t flags, int *err)
 {
-  /* This must be true because gzip_prepare must have been called. */
-  assert (fd >= 0);
+  const struct checkpoint *p;
+  z_stream strm;
+  int zerr;
+  uint64_t curr_in, skip;
+  CLEANUP_FREE unsigned char *in_block = NULL;
+  unsigned char discard[16384];
+  const size_t block_size = 128 * 1024;
 
-  while (count > 0) {
-    ssize_t r = pread (fd, buf, count, offset);
-    if (r == -1) {
-      nbdkit_error ("pread: %m");
+  in_block = malloc (block_size);
+  if (!in_block) {
+    *err = ENOMEM;
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  memset (&strm, 0, sizeof strm);
+  p = find_checkpoint (offset);
+  if (p != NULL) {
+    /* Resume raw inflation at the checkpoint. */
+    zerr = inflateInit2 (&strm, -MAX_WBITS);
+    if (zerr != Z_OK) {
+      zerror ("inflateInit2", &strm, zerr);
+      *err = errno;
       return -1;
     }
-    if (r == 0) {
-      nbdkit_error ("pread: unexpected end of file");
+    if (p->bits) {
+      unsigned char byte;
+      int rerr = 0;
+
+      if (next_ops->pread (nxdata, &byte, 1, p->in - 1, 0, &rerr) == -1) {
+        *err = rerr;
+        inflateEnd (&strm);
+        return -1;
+      }
+      zerr = inflatePrime (&strm, p->bits, byte >> (8 - p->bits));
+      if (zerr != Z_OK) {
+        zerror ("inflatePrime", &strm, zerr);
+        *err = errno;
+        inflateEnd (&strm);
+        return -1;
+      }
+    }
+    if (p->window_have > 0) {
+      zerr = inflateSetDictionary (&strm,
+                                   p->window + WINSIZE - p->window_have,
+                                   p->window_have);
+      if (zerr != Z_OK) {
+        zerror ("inflateSetDictionary", &strm, zerr);
+        *err = errno;
+        inflateEnd (&strm);
+        return -1;
+      }
+    }
+    curr_in = p->in;
+    skip = offset - p->out;
+  }
+  else {
+    /* No checkpoint before the offset: start from the beginning of
+     * the stream, letting zlib parse the gzip header.
+     */
+    zerr = inflateInit2 (&strm, 16+MAX_WBITS);
+    if (zerr != Z_OK) {
+      zerror ("inflateInit2", &strm, zerr);
+      *err = errno;
       return -1;
     }
-    buf += r;
-    count -= r;
-    offset += r;
+    curr_in = 0;
+    skip = offset;
+  }
+
+  /* Discard ‘skip’ bytes of output, then inflate into the caller's
+   * buffer.
+   */
+  while (skip > 0 || count > 0) {
+    unsigned before, produced;
+
+    if (strm.avail_in == 0) {
+      size_t n = MIN (block_size, compressed_size - curr_in);
+      int rerr = 0;
+
+      if (n == 0)
+        break;                  /* Unexpected end of compressed data. */
+      if (next_ops->pread (nxdata, in_block, (uint32_t) n, curr_in,
+                           0, &rerr) == -1) {
+        *err = rerr;
+        inflateEnd (&strm);
+        return -1;
+      }
+      curr_in += n;
+      strm.next_in = in_block;
+      strm.avail_in = n;
+    }
+
+    if (skip > 0) {
+      strm.next_out = discard;
+      strm.avail_out = MIN (skip, sizeof discard);
+    }
+    else {
+      strm.next_out = buf;
+      strm.avail_out = count;
+    }
+    before = strm.avail_out;
+
+    zerr = inflate (&strm, Z_NO_FLUSH);
+    if (zerr != Z_OK && zerr != Z_STREAM_END && zerr != Z_BUF_ERROR) {
+      zerror ("inflate", &strm, zerr);
+      *err = errno;
+      inflateEnd (&strm);
+      return -1;
+    }
+
+    produced = before - strm.avail_out;
+    if (skip > 0)
+      skip -= produced;
+    else {
+      buf += produced;
+      count -= produced;
+    }
+
+    if (zerr == Z_STREAM_END)
+      break;
+  }
+
+  inflateEnd (&strm);
+
+  if (skip > 0 || count > 0) {
+    nbdkit_error ("gzip: pread: unexpected end of stream");
+    *err = EIO;
+    return -1;
   }
 
   return 0;
@@ -363,13 +713,14 @@ static struct nbdkit_filter filter = {
   .longname           = "nbdkit gzip filter",
   .unload             = gzip_unload,
   .thread_model       = gzip_thread_model,
+  .config             = gzip_config,
+  .config_help        = gzip_config_help,
   .open               = gzip_open,
   .prepare            = gzip_prepare,
   .can_write          = gzip_can_write,
   .can_extents        = gzip_can_extents,
   .can_cache          = gzip_can_cache,
   .can_multi_conn     = gzip_can_multi_conn,
-  .prepare            = gzip_prepare,
   .export_description = gzip_export_description,
   .get_size           = gzip_get_size,
   .pread              = gzip_pread,
@@ -39,6 +39,9 @@
 #include <inttypes.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
@@ -81,6 +84,48 @@ struct rule {
 static struct rule *allow_rules, *allow_rules_last;
 static struct rule *deny_rules, *deny_rules_last;
 
+/* Rules loaded from rulesfile=..., kept separate from the command
+ * line rules so that the file can be re-read without losing them.
+ */
+static char *rulesfile;
+static struct rule *file_allow_rules, *file_allow_rules_last;
+static struct rule *file_deny_rules, *file_deny_rules_last;
+static time_t load_mtime;       /* file identity at the last (re-)load */
+static off_t load_size;
+
+/* Compiled form of a rule list.  Matching a list only asks "does any
+ * rule match this client?", so CIDR rules compile into a binary trie
+ * over the address bits: the walk stops as soon as it passes a node
+ * marking the end of some rule's prefix, ie. O(prefix length)
+ * regardless of the number of rules.  Exact pid/uid/gid and vsock
+ * cid/port rules go into small open-addressed hash sets.  The raw
+ * lists above are kept for -D ip.rules=1 (which prints the verdict of
+ * every rule) and for recompiling after a rulesfile reload.
+ */
+struct trie_node {
+  struct trie_node *child[2];
+  bool terminal;                /* some rule's prefix ends here */
+};
+
+struct idset {
+  int64_t *slots;               /* -1 = empty; valid ids are >= 0 */
+  size_t nr_slots;              /* power of 2, or 0 when the set is empty */
+};
+
+struct ruleset {
+  bool any, anyv4, anyv6, anyunix, anyvsock;
+  struct trie_node *ipv4_trie;
+  struct trie_node *ipv6_trie;
+  struct idset pids, uids, gids, cids, ports;
+};
+
+static struct ruleset *allow_set, *deny_set;
+
+/* Serializes matching against reloading.  Only taken in .preconnect,
+ * so it costs nothing on the data path.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void
 print_rule (const char *name, const struct rule *rule, const char *suffix)
 {
@@ -159,11 +204,240 @@ free_rules (struct rule *rules)
   }
 }
 
+static unsigned
+addr_bit (const uint8_t *addr, unsigned i)
+{
+  return (addr[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+static void
+trie_free (struct trie_node *node)
+{
+  if (node == NULL)
+    return;
+  trie_free (node->child[0]);
+  trie_free (node->child[1]);
+  free (node);
+}
+
+/* Insert a prefix of prefixlen bits of addr (in network byte order).
+ * Returns 0 on success, -1 on error (ENOMEM).
+ */
+static int
+trie_insert (struct trie_node **root, const uint8_t *addr, unsigned prefixlen)
+{
+  struct trie_node **np = root, *node;
+  unsigned i;
+
+  for (i = 0; ; ++i) {
+    if (*np == NULL) {
+      *np = calloc (1, sizeof **np);
+      if (*np == NULL) {
+        nbdkit_error ("calloc: %m");
+        return -1;
+      }
+    }
+    node = *np;
+    if (node->terminal)
+      return 0;                 /* an existing shorter prefix covers this */
+    if (i == prefixlen) {
+      node->terminal = true;
+      return 0;
+    }
+    np = &node->child[addr_bit (addr, i)];
+  }
+}
+
+/* Does any inserted prefix cover addr? */
+static bool
+trie_match (const struct trie_node *node, const uint8_t *addr, unsigned nbits)
+{
+  unsigned i;
+
+  for (i = 0; node != NULL; ++i) {
+    if (node->terminal)
+      return true;
+    if (i == nbits)
+      break;
+    node = node->child[addr_bit (addr, i)];
+  }
+  return false;
+}
+
+/* Open-addressed hash set of non-negative int64 ids. */
+static void
+idset_free (struct idset *set)
+{
+  free (set->slots);
+  set->slots = NULL;
+  set->nr_slots = 0;
+}
+
+static size_t
+idset_slot (const struct idset *set, int64_t id)
+{
+  return (uint64_t) id * UINT64_C (0x9e3779b97f4a7c15) >> 32
+    & (set->nr_slots - 1);
+}
+
+static int
+idset_insert (struct idset *set, int64_t id)
+{
+  size_t i;
+
+  if (set->nr_slots == 0) {
+    set->nr_slots = 64;         /* tiny, but never more than ~43% full */
+    set->slots = malloc (set->nr_slots * sizeof (int64_t));
+    if (set->slots == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+    memset (set->slots, 0xff, set->nr_slots * sizeof (int64_t));
+  }
+
+  for (i = idset_slot (set, id); set->slots[i] != -1;
+       i = (i + 1) & (set->nr_slots - 1)) {
+    if (set->slots[i] == id)
+      return 0;
+  }
+  set->slots[i] = id;
+
+  /* Grow at 2/3 load by rehashing into a doubled set. */
+  {
+    size_t used = 0, n;
+    for (n = 0; n < set->nr_slots; ++n)
+      used += set->slots[n] != -1;
+    if (used * 3 >= set->nr_slots * 2) {
+      struct idset bigger = { .nr_slots = set->nr_slots * 2 };
+      bigger.slots = malloc (bigger.nr_slots * sizeof (int64_t));
+      if (bigger.slots == NULL) {
+        nbdkit_error ("malloc: %m");
+        return -1;
+      }
+      memset (bigger.slots, 0xff, bigger.nr_slots * sizeof (int64_t));
+      for (n = 0; n < set->nr_slots; ++n) {
+        if (set->slots[n] != -1) {
+          for (i = idset_slot (&bigger, set->slots[n]);
+               bigger.slots[i] != -1;
+               i = (i + 1) & (bigger.nr_slots - 1))
+            ;
+          bigger.slots[i] = set->slots[n];
+        }
+      }
+      idset_free (set);
+      *set = bigger;
+    }
+  }
+  return 0;
+}
+
+static bool
+idset_contains (const struct idset *set, int64_t id)
+{
+  size_t i;
+
+  if (set->nr_slots == 0 || id < 0)
+    return false;
+  for (i = idset_slot (set, id); set->slots[i] != -1;
+       i = (i + 1) & (set->nr_slots - 1)) {
+    if (set->slots[i] == id)
+      return true;
+  }
+  return false;
+}
+
+static void
+free_ruleset (struct ruleset *rs)
+{
+  if (rs == NULL)
+    return;
+  trie_free (rs->ipv4_trie);
+  trie_free (rs->ipv6_trie);
+  idset_free (&rs->pids);
+  idset_free (&rs->uids);
+  idset_free (&rs->gids);
+  idset_free (&rs->cids);
+  idset_free (&rs->ports);
+  free (rs);
+}
+
+static int
+compile_rules (struct ruleset *rs, const struct rule *rules)
+{
+  const struct rule *rule;
+
+  for (rule = rules; rule != NULL; rule = rule->next) {
+    switch (rule->type) {
+    case ANY:      rs->any = true; break;
+    case ANYV4:    rs->anyv4 = true; break;
+    case ANYV6:    rs->anyv6 = true; break;
+    case ANYUNIX:  rs->anyunix = true; break;
+    case ANYVSOCK: rs->anyvsock = true; break;
+    case IPV4:
+      if (trie_insert (&rs->ipv4_trie,
+                       (const uint8_t *) &rule->u.ipv4.s_addr,
+                       rule->prefixlen) == -1)
+        return -1;
+      break;
+    case IPV6:
+      if (trie_insert (&rs->ipv6_trie, rule->u.ipv6.s6_addr,
+                       rule->prefixlen) == -1)
+        return -1;
+      break;
+    case PID:
+      if (idset_insert (&rs->pids, rule->u.id) == -1) return -1;
+      break;
+    case UID:
+      if (idset_insert (&rs->uids, rule->u.id) == -1) return -1;
+      break;
+    case GID:
+      if (idset_insert (&rs->gids, rule->u.id) == -1) return -1;
+      break;
+    case VSOCKCID:
+      if (idset_insert (&rs->cids, rule->u.id) == -1) return -1;
+      break;
+    case VSOCKPORT:
+      if (idset_insert (&rs->ports, rule->u.id) == -1) return -1;
+      break;
+    case BAD:
+    default:
+      abort ();
+    }
+  }
+  return 0;
+}
+
+/* Compile the command line rules plus the file rules (either list may
+ * be empty) into one ruleset.  Returns NULL on error.
+ */
+static struct ruleset *
+compile_ruleset (const struct rule *cli_rules, const struct rule *frules)
+{
+  struct ruleset *rs;
+
+  rs = calloc (1, sizeof *rs);
+  if (rs == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  if (compile_rules (rs, cli_rules) == -1 ||
+      compile_rules (rs, frules) == -1) {
+    free_ruleset (rs);
+    return NULL;
+  }
+  return rs;
+}
+
 static void
 ip_unload (void)
 {
   free_rules (allow_rules);
   free_rules (deny_rules);
+  free_rules (file_allow_rules);
+  free_rules (file_deny_rules);
+  free_ruleset (allow_set);
+  free_ruleset (deny_set);
+  free (rulesfile);
 }
 
 /* Try to parse the first n characters of value as an IPv4 or IPv6
@@ -398,6 +672,105 @@ parse_rules (const char *paramname,
   return 0;
 }
 
+/* (Re-)read the rules file and replace the file rule lists and the
+ * compiled rulesets, atomically from the point of view of matching
+ * (the caller holds the lock, or we are still in config_complete).
+ * On failure nothing is replaced, so a failed reload keeps serving
+ * with the old rules.
+ */
+static int
+load_rulesfile (void)
+{
+  FILE *fp;
+  CLEANUP_FREE char *line = NULL;
+  size_t linelen = 0;
+  ssize_t len;
+  struct rule *new_allow = NULL, *new_allow_last = NULL;
+  struct rule *new_deny = NULL, *new_deny_last = NULL;
+  struct ruleset *new_allow_set, *new_deny_set;
+  struct stat statbuf;
+
+  fp = fopen (rulesfile, "r");
+  if (fp == NULL) {
+    nbdkit_error ("open: %s: %m", rulesfile);
+    return -1;
+  }
+  if (fstat (fileno (fp), &statbuf) == -1) {
+    nbdkit_error ("fstat: %s: %m", rulesfile);
+    fclose (fp);
+    return -1;
+  }
+
+  while ((len = getline (&line, &linelen, fp)) != -1) {
+    if (len > 0 && line[len-1] == '\n')
+      line[--len] = '\0';
+    if (len == 0 || line[0] == '#')
+      continue;
+    if (strncmp (line, "allow=", 6) == 0) {
+      if (parse_rules ("allow", &new_allow, &new_allow_last, &line[6]) == -1)
+        goto err;
+    }
+    else if (strncmp (line, "deny=", 5) == 0) {
+      if (parse_rules ("deny", &new_deny, &new_deny_last, &line[5]) == -1)
+        goto err;
+    }
+    else {
+      nbdkit_error ("%s: expecting \"allow=...\" or \"deny=...\": %s",
+                    rulesfile, line);
+      goto err;
+    }
+  }
+  fclose (fp);
+
+  new_allow_set = compile_ruleset (allow_rules, new_allow);
+  new_deny_set = compile_ruleset (deny_rules, new_deny);
+  if (new_allow_set == NULL || new_deny_set == NULL) {
+    free_ruleset (new_allow_set);
+    free_ruleset (new_deny_set);
+    free_rules (new_allow);
+    free_rules (new_deny);
+    return -1;
+  }
+
+  free_rules (file_allow_rules);
+  free_rules (file_deny_rules);
+  file_allow_rules = new_allow;
+  file_allow_rules_last = new_allow_last;
+  file_deny_rules = new_deny;
+  file_deny_rules_last = new_deny_last;
+  free_ruleset (allow_set);
+  free_ruleset (deny_set);
+  allow_set = new_allow_set;
+  deny_set = new_deny_set;
+  load_mtime = statbuf.st_mtime;
+  load_size = statbuf.st_size;
+  return 0;
+
+ err:
+  fclose (fp);
+  free_rules (new_allow);
+  free_rules (new_deny);
+  return -1;
+}
+
+/* Called with the lock held before matching each new connection. */
+static void
+maybe_reload (void)
+{
+  struct stat statbuf;
+
+  if (rulesfile == NULL)
+    return;
+  if (stat (rulesfile, &statbuf) == -1)
+    return;                     /* Ignore, keep the old rules. */
+  if (statbuf.st_mtime == load_mtime && statbuf.st_size == load_size)
+    return;
+
+  nbdkit_debug ("ip: rules file %s changed, reloading", rulesfile);
+  if (load_rulesfile () == -1)
+    nbdkit_debug ("ip: reload failed, keeping the previous rules");
+}
+
 static int
 ip_config (nbdkit_next_config *next, void *nxdata,
            const char *key, const char *value)
@@ -415,6 +788,13 @@ ip_config (nbdkit_next_config *next, void *nxdata,
       return -1;
     return 0;
   }
+  else if (strcmp (key, "rulesfile") == 0) {
+    free (rulesfile);
+    rulesfile = nbdkit_absolute_path (value);
+    if (rulesfile == NULL)
+      return -1;
+    return 0;
+  }
 
   return next (nxdata, key, value);
 }
@@ -422,9 +802,25 @@ ip_config (nbdkit_next_config *next, void *nxdata,
 static int
 ip_config_complete (nbdkit_next_config_complete *next, void *nxdata)
 {
+  if (rulesfile != NULL) {
+    /* A rules file which cannot be read at startup is fatal.  This
+     * also compiles the rulesets.
+     */
+    if (load_rulesfile () == -1)
+      return -1;
+  }
+  else {
+    allow_set = compile_ruleset (allow_rules, NULL);
+    deny_set = compile_ruleset (deny_rules, NULL);
+    if (allow_set == NULL || deny_set == NULL)
+      return -1;
+  }
+
   if (ip_debug_rules) {
     print_rules ("ip: parsed allow", allow_rules);
     print_rules ("ip: parsed deny", deny_rules);
+    print_rules ("ip: parsed file allow", file_allow_rules);
+    print_rules ("ip: parsed file deny", file_deny_rules);
   }
 
   return next (nxdata);
@@ -432,7 +828,8 @@ ip_config_complete (nbdkit_next_config_complete *next, void *nxdata)
 
 #define ip_config_help \
   "allow=addr[,addr...]     Set allow list.\n" \
-  "deny=addr[,addr...]      Set deny list."
+  "deny=addr[,addr...]      Set deny list.\n" \
+  "rulesfile=FILE           Read and reload rules from a file."
 
 /* Compare two IPv6 addresses as far as prefixlen bits.  Both
  * addresses are in network byte order (ie. big endian) so we can
@@ -559,6 +956,55 @@ matches_rules_list (const char *name, const struct rule *rules,
   return false;
 }
 
+/* Compiled equivalent of matches_rules_list. */
+static bool
+ruleset_matches (const struct ruleset *rs,
+                 int family, const struct sockaddr *addr)
+{
+  const struct sockaddr_in *sin;
+  const struct sockaddr_in6 *sin6;
+#ifdef AF_VSOCK
+  const struct sockaddr_vm *svm;
+#endif
+
+  if (rs->any)
+    return true;
+
+  switch (family) {
+  case AF_INET:
+    if (rs->anyv4)
+      return true;
+    sin = (const struct sockaddr_in *) addr;
+    return trie_match (rs->ipv4_trie,
+                       (const uint8_t *) &sin->sin_addr.s_addr, 32);
+
+  case AF_INET6:
+    if (rs->anyv6)
+      return true;
+    sin6 = (const struct sockaddr_in6 *) addr;
+    return trie_match (rs->ipv6_trie, sin6->sin6_addr.s6_addr, 128);
+
+  case AF_UNIX:
+    /* These work even if the underlying nbdkit_peer_* call fails. */
+    return rs->anyunix ||
+      idset_contains (&rs->pids, nbdkit_peer_pid ()) ||
+      idset_contains (&rs->uids, nbdkit_peer_uid ()) ||
+      idset_contains (&rs->gids, nbdkit_peer_gid ());
+
+#ifdef AF_VSOCK
+  case AF_VSOCK:
+    if (rs->anyvsock)
+      return true;
+    svm = (const struct sockaddr_vm *) addr;
+    return idset_contains (&rs->cids, svm->svm_cid) ||
+      idset_contains (&rs->ports, svm->svm_port);
+#endif
+
+  default:
+    return false;
+  }
+}
+
 static bool
 check_if_allowed (const struct sockaddr *addr)
 {
@@ -574,12 +1020,29 @@ check_if_allowed (const struct sockaddr *addr)
       )
     return true;
 
-  if (matches_rules_list ("ip: match source with allow",
-                          allow_rules, family, addr))
+  /* With -D ip.rules=1 walk the uncompiled lists instead, so that the
+   * verdict of every rule gets printed.
+   */
+  if (ip_debug_rules) {
+    if (matches_rules_list ("ip: match source with allow",
+                            allow_rules, family, addr) ||
+        matches_rules_list ("ip: match source with file allow",
+                            file_allow_rules, family, addr))
+      return true;
+
+    if (matches_rules_list ("ip: match source with deny",
+                            deny_rules, family, addr) ||
+        matches_rules_list ("ip: match source with file deny",
+                            file_deny_rules, family, addr))
+      return false;
+
+    return true;
+  }
+
+  if (ruleset_matches (allow_set, family, addr))
     return true;
 
-  if (matches_rules_list ("ip: match source with deny",
-                          deny_rules, family, addr))
+  if (ruleset_matches (deny_set, family, addr))
     return false;
 
   return true;
@@ -595,10 +1058,16 @@ ip_preconnect (nbdkit_next_preconnect *next, void *nxdata, int readonly)
     return -1;                  /* We should fail closed ... */
 
   /* Follow the rules. */
-  if (check_if_allowed ((struct sockaddr *) &addr) == false) {
-    nbdkit_error ("client not permitted to connect "
-                  "because of source address restriction");
-    return -1;
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+    maybe_reload ();
+
+    if (check_if_allowed ((struct sockaddr *) &addr) == false) {
+      nbdkit_error ("client not permitted to connect "
+                    "because of source address restriction");
+      return -1;
+    }
   }
 
   if (next (nxdata, readonly) == -1)
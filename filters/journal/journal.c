@@ -0,0 +1,760 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Write journaling: make flush and FUA fast and crash-safe on top of
+ * plugins with slow flush (curl, ssh).
+ *
+ * Writes are appended to a local sequential journal file and kept in
+ * an in-memory pending list; flush and FUA only have to make the
+ * journal durable (one fdatasync of a local file) instead of
+ * flushing the plugin.  Reads overlay the pending writes on top of
+ * plugin data.  Pending writes are replayed to the plugin
+ * opportunistically while requests are being served and drained
+ * completely when a connection closes, after which the journal is
+ * truncated.  If nbdkit crashes or is killed, the journal is
+ * replayed into the plugin the next time it starts, so acknowledged
+ * flushes survive a crash — this is the writeback half of the cache
+ * filter made crash-safe.
+ *
+ * Replay happens on the threads servicing requests (bounded work per
+ * request) because filters cannot call next_ops from a free-running
+ * background thread outside a request.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "minmax.h"
+
+/* On-disk journal format: a header followed by a sequence of
+ * records, each a fixed header optionally followed by payload data.
+ * Host byte order; the journal only needs to survive restarts on the
+ * same machine.
+ */
+#define JOURNAL_MAGIC "NBDKITJOURNAL\0\0"
+#define JOURNAL_VERSION 1
+
+struct journal_header {
+  char magic[16];               /* JOURNAL_MAGIC */
+  uint32_t version;             /* JOURNAL_VERSION */
+  uint32_t unused;
+};
+
+#define REC_MAGIC 0x4c4e524a    /* "JRNL" */
+
+enum rec_type {
+  REC_WRITE = 1,                /* followed by count bytes of data */
+  REC_ZERO = 2,                 /* no payload */
+};
+
+struct rec_header {
+  uint32_t magic;               /* REC_MAGIC */
+  uint32_t type;                /* enum rec_type */
+  uint64_t offset;
+  uint32_t count;
+  uint32_t flags;               /* NBDKIT_FLAG_MAY_TRIM for REC_ZERO */
+};
+
+/* One pending (journaled but not yet replayed) record.  The list is
+ * kept in journal order; overlaying it on a read in order gives the
+ * same result as replaying it.
+ */
+struct pending {
+  struct pending *next;
+  enum rec_type type;
+  uint32_t flags;
+  uint64_t offset;
+  uint32_t count;
+  uint8_t *data;                /* REC_WRITE only */
+};
+
+static char *j_path;            /* journal-file=PATH */
+static int64_t pending_limit = 16*1024*1024;  /* journal-pending */
+static int64_t j_max_size = 256*1024*1024;    /* journal-max-size */
+
+static int j_fd = -1;
+static uint64_t j_size;         /* current append offset */
+
+/* journal_lock protects the pending list, pending_bytes, j_size and
+ * appends to the journal file.  replay_lock serializes replay to the
+ * plugin (so records are replayed in journal order) and is always
+ * acquired before journal_lock.
+ */
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pending *pending_head, *pending_tail;
+static uint64_t pending_bytes;
+
+/* Stats, logged at unload, updated under journal_lock. */
+static uint64_t journaled_writes, replayed_records, recovered_records;
+
+static void
+journal_unload (void)
+{
+  struct pending *p, *next;
+
+  nbdkit_debug ("journal: %" PRIu64 " writes journaled, "
+                "%" PRIu64 " records replayed, "
+                "%" PRIu64 " records recovered at startup",
+                journaled_writes, replayed_records, recovered_records);
+
+  for (p = pending_head; p != NULL; p = next) {
+    next = p->next;
+    free (p->data);
+    free (p);
+  }
+  if (j_fd >= 0)
+    close (j_fd);
+  free (j_path);
+}
+
+static int
+journal_config (nbdkit_next_config *next, void *nxdata,
+                const char *key, const char *value)
+{
+  if (strcmp (key, "journal-file") == 0) {
+    free (j_path);
+    j_path = nbdkit_absolute_path (value);
+    if (j_path == NULL)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "journal-pending") == 0) {
+    pending_limit = nbdkit_parse_size (value);
+    if (pending_limit == -1)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "journal-max-size") == 0) {
+    j_max_size = nbdkit_parse_size (value);
+    if (j_max_size == -1)
+      return -1;
+    return 0;
+  }
+  else {
+    return next (nxdata, key, value);
+  }
+}
+
+#define journal_config_help \
+  "journal-file=PATH         The journal file (required).  Put it on\n" \
+  "                          fast local storage.\n" \
+  "journal-pending=SIZE      Replay to the plugin once more than SIZE\n" \
+  "                          bytes are pending (default 16M).\n" \
+  "journal-max-size=SIZE     Fully drain and truncate the journal when\n" \
+  "                          it grows past SIZE (default 256M)."
+
+static int
+journal_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  if (j_path == NULL) {
+    nbdkit_error ("journal-file parameter is required");
+    return -1;
+  }
+
+  return next (nxdata);
+}
+
+/* Open (or create) the journal file. */
+static int
+journal_get_ready (nbdkit_next_get_ready *next, nbdkit_backend *nxdata,
+                   int thread_model)
+{
+  struct journal_header hdr;
+  ssize_t r;
+
+  if (next (nxdata) == -1)
+    return -1;
+
+  j_fd = open (j_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (j_fd == -1) {
+    nbdkit_error ("open: %s: %m", j_path);
+    return -1;
+  }
+
+  r = pread (j_fd, &hdr, sizeof hdr, 0);
+  if (r == 0) {                 /* new journal */
+    memset (&hdr, 0, sizeof hdr);
+    memcpy (hdr.magic, JOURNAL_MAGIC, sizeof hdr.magic);
+    hdr.version = JOURNAL_VERSION;
+    if (pwrite (j_fd, &hdr, sizeof hdr, 0) != sizeof hdr ||
+        fdatasync (j_fd) == -1) {
+      nbdkit_error ("write: %s: %m", j_path);
+      return -1;
+    }
+    j_size = sizeof hdr;
+    return 0;
+  }
+
+  if (r != sizeof hdr ||
+      memcmp (hdr.magic, JOURNAL_MAGIC, sizeof hdr.magic) != 0 ||
+      hdr.version != JOURNAL_VERSION) {
+    nbdkit_error ("%s: not an nbdkit journal file "
+                  "(remove it or use a different journal-file)", j_path);
+    return -1;
+  }
+
+  /* An existing journal: its records (if any) are replayed into the
+   * plugin by the first connection, see journal_recover.
+   */
+  j_size = sizeof hdr;          /* recomputed during recovery */
+  return 0;
+}
+
+/* Write buf completely at the given offset. */
+static int
+full_pwrite (const void *buf, size_t count, off_t offset)
+{
+  while (count > 0) {
+    ssize_t r = pwrite (j_fd, buf, count, offset);
+    if (r == -1)
+      return -1;
+    buf = (const char *) buf + r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+/* Truncate the journal back to just the header.  Caller must ensure
+ * nothing in the journal is still pending.
+ */
+static int
+journal_reset (void)
+{
+  if (ftruncate (j_fd, sizeof (struct journal_header)) == -1 ||
+      fdatasync (j_fd) == -1) {
+    nbdkit_error ("ftruncate: %s: %m", j_path);
+    return -1;
+  }
+  j_size = sizeof (struct journal_header);
+  return 0;
+}
+
+/* Append one record (and payload, for writes) to the journal and the
+ * pending list.  Does not sync the journal; that happens on flush or
+ * FUA.
+ */
+static int
+journal_append (enum rec_type type, const void *buf, uint32_t count,
+                uint64_t offset, uint32_t flags, int *err)
+{
+  struct rec_header rec = {
+    .magic = REC_MAGIC,
+    .type = type,
+    .offset = offset,
+    .count = count,
+    .flags = flags,
+  };
+  struct pending *p;
+
+  p = calloc (1, sizeof *p);
+  if (p == NULL) {
+    *err = errno;
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  p->type = type;
+  p->flags = flags;
+  p->offset = offset;
+  p->count = count;
+  if (type == REC_WRITE) {
+    p->data = malloc (count);
+    if (p->data == NULL) {
+      *err = errno;
+      nbdkit_error ("malloc: %m");
+      free (p);
+      return -1;
+    }
+    memcpy (p->data, buf, count);
+  }
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&journal_lock);
+
+    if (full_pwrite (&rec, sizeof rec, j_size) == -1 ||
+        (type == REC_WRITE &&
+         full_pwrite (buf, count, j_size + sizeof rec) == -1)) {
+      *err = errno;
+      nbdkit_error ("write: %s: %m", j_path);
+      free (p->data);
+      free (p);
+      return -1;
+    }
+    j_size += sizeof rec + (type == REC_WRITE ? count : 0);
+
+    if (pending_tail)
+      pending_tail->next = p;
+    else
+      pending_head = p;
+    pending_tail = p;
+    pending_bytes += count;
+    journaled_writes++;
+  }
+
+  return 0;
+}
+
+/* Replay the oldest pending record to the plugin.  Called with
+ * replay_lock held.  Returns 1 if a record was replayed, 0 if the
+ * list was empty, -1 on error (the record stays pending).
+ */
+static int
+replay_one (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+            int *err)
+{
+  struct pending *p;
+  int r;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&journal_lock);
+    p = pending_head;
+  }
+  if (p == NULL)
+    return 0;
+
+  if (p->type == REC_WRITE)
+    r = next_ops->pwrite (nxdata, p->data, p->count, p->offset, 0, err);
+  else if (next_ops->can_zero (nxdata) > 0)
+    r = next_ops->zero (nxdata, p->count, p->offset,
+                        p->flags & NBDKIT_FLAG_MAY_TRIM, err);
+  else {
+    CLEANUP_FREE uint8_t *zeroes = calloc (1, p->count);
+
+    if (zeroes == NULL) {
+      *err = errno;
+      nbdkit_error ("calloc: %m");
+      return -1;
+    }
+    r = next_ops->pwrite (nxdata, zeroes, p->count, p->offset, 0, err);
+  }
+  if (r == -1)
+    return -1;
+
+  /* Only remove the record from the list after it has reached the
+   * plugin, so concurrent reads always see it in one place or the
+   * other.
+   */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&journal_lock);
+    pending_head = p->next;
+    if (pending_head == NULL)
+      pending_tail = NULL;
+    pending_bytes -= p->count;
+    replayed_records++;
+  }
+  free (p->data);
+  free (p);
+  return 1;
+}
+
+/* Replay records until no more than ‘limit’ bytes are pending. */
+static int
+drain_below (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+             uint64_t limit, int *err)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&replay_lock);
+
+  for (;;) {
+    int r;
+
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&journal_lock);
+      if (pending_bytes <= limit)
+        return 0;
+    }
+    r = replay_one (next_ops, nxdata, err);
+    if (r == -1)
+      return -1;
+    if (r == 0)
+      return 0;
+  }
+}
+
+/* Replay everything, flush the plugin and truncate the journal.
+ * Holding replay_lock throughout guarantees that every record
+ * replayed before the flush is covered by it; records appended
+ * concurrently leave the list non-empty so the journal is not
+ * truncated under them.
+ */
+static int
+drain_all (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+           int *err)
+{
+  int r;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&replay_lock);
+
+  do {
+    r = replay_one (next_ops, nxdata, err);
+    if (r == -1)
+      return -1;
+  } while (r == 1);
+
+  if (next_ops->can_flush (nxdata) == 1 &&
+      next_ops->flush (nxdata, 0, err) == -1)
+    return -1;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&journal_lock);
+    if (pending_head == NULL && journal_reset () == -1) {
+      *err = errno;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Replay any records left in the journal by a previous nbdkit which
+ * did not shut down cleanly.  Runs in the first connection's
+ * .prepare, before any client I/O.
+ */
+static int
+journal_recover (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata)
+{
+  uint64_t pos = sizeof (struct journal_header);
+  uint64_t nr = 0;
+  int64_t size = -1;
+  int err = 0;
+
+  for (;;) {
+    struct rec_header rec;
+    CLEANUP_FREE uint8_t *data = NULL;
+    ssize_t r;
+
+    r = pread (j_fd, &rec, sizeof rec, pos);
+    if (r != sizeof rec)
+      break;                    /* end of journal or torn record */
+    if (rec.magic != REC_MAGIC ||
+        (rec.type != REC_WRITE && rec.type != REC_ZERO))
+      break;
+
+    /* We run before the protocol layer has queried the size and the
+     * write-related flags, so query them ourselves before replaying.
+     */
+    if (nr == 0) {
+      size = next_ops->get_size (nxdata);
+      if (size == -1)
+        return -1;
+      if (next_ops->can_write (nxdata) != 1) {
+        nbdkit_error ("journal: cannot recover journaled writes "
+                      "into a read-only plugin");
+        return -1;
+      }
+    }
+    if (rec.offset + rec.count > (uint64_t) size)
+      break;                    /* corrupt record */
+
+    if (rec.type == REC_WRITE) {
+      data = malloc (rec.count);
+      if (data == NULL) {
+        nbdkit_error ("malloc: %m");
+        return -1;
+      }
+      if (pread (j_fd, data, rec.count, pos + sizeof rec) !=
+          (ssize_t) rec.count)
+        break;                  /* torn payload: was never acknowledged */
+      if (next_ops->pwrite (nxdata, data, rec.count, rec.offset,
+                            0, &err) == -1)
+        return -1;
+      pos += sizeof rec + rec.count;
+    }
+    else {
+      if (next_ops->can_zero (nxdata) > 0) {
+        if (next_ops->zero (nxdata, rec.count, rec.offset,
+                            rec.flags & NBDKIT_FLAG_MAY_TRIM, &err) == -1)
+          return -1;
+      }
+      else {
+        CLEANUP_FREE uint8_t *zeroes = calloc (1, rec.count);
+
+        if (zeroes == NULL) {
+          nbdkit_error ("calloc: %m");
+          return -1;
+        }
+        if (next_ops->pwrite (nxdata, zeroes, rec.count, rec.offset,
+                              0, &err) == -1)
+          return -1;
+      }
+      pos += sizeof rec;
+    }
+    nr++;
+  }
+
+  if (nr > 0) {
+    if (next_ops->can_flush (nxdata) == 1 &&
+        next_ops->flush (nxdata, 0, &err) == -1)
+      return -1;
+    nbdkit_debug ("journal: recovered %" PRIu64 " records "
+                  "from a previous run", nr);
+    recovered_records = nr;
+  }
+
+  return journal_reset ();
+}
+
+static int
+journal_prepare (struct nbdkit_next_ops *next_ops, void *nxdata,
+                 void *handle, int readonly)
+{
+  static bool recovered = false;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&replay_lock);
+  if (!recovered) {
+    if (journal_recover (next_ops, nxdata) == -1)
+      return -1;
+    recovered = true;
+  }
+  return 0;
+}
+
+/* Drain everything when a connection closes, so an idle server has
+ * an empty journal and a fully up-to-date plugin.
+ */
+static int
+journal_finalize (struct nbdkit_next_ops *next_ops, void *nxdata,
+                  void *handle)
+{
+  int err = 0;
+
+  if (drain_all (next_ops, nxdata, &err) == -1)
+    /* Not fatal: the records remain journaled and durable, and are
+     * replayed by the next connection or the next run.
+     */
+    nbdkit_debug ("journal: drain at connection close failed, "
+                  "records remain journaled");
+  return 0;
+}
+
+/* Whatever the plugin says, we can flush (by syncing the journal)
+ * and support FUA natively.
+ */
+static int
+journal_can_flush (struct nbdkit_next_ops *next_ops, void *nxdata,
+                   void *handle)
+{
+  return 1;
+}
+
+static int
+journal_can_fua (struct nbdkit_next_ops *next_ops, void *nxdata,
+                 void *handle)
+{
+  return NBDKIT_FUA_NATIVE;
+}
+
+/* Fast zeroing is always possible: it is just a journal append. */
+static int
+journal_can_fast_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
+                       void *handle)
+{
+  return 1;
+}
+
+static int
+journal_can_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
+                  void *handle)
+{
+  return 1;
+}
+
+/* Read data: plugin data with pending writes overlaid in journal
+ * order.
+ */
+static int
+journal_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+               void *handle, void *buf, uint32_t count, uint64_t offset,
+               uint32_t flags, int *err)
+{
+  struct pending *p;
+
+  if (next_ops->pread (nxdata, buf, count, offset, flags, err) == -1)
+    return -1;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&journal_lock);
+  for (p = pending_head; p != NULL; p = p->next) {
+    uint64_t start = MAX (offset, p->offset);
+    uint64_t end = MIN (offset + count, p->offset + p->count);
+
+    if (start >= end)
+      continue;
+    if (p->type == REC_WRITE)
+      memcpy ((uint8_t *) buf + (start - offset),
+              &p->data[start - p->offset], end - start);
+    else
+      memset ((uint8_t *) buf + (start - offset), 0, end - start);
+  }
+
+  return 0;
+}
+
+/* After journaling a request, replay opportunistically if too much
+ * is pending, and drain completely if the journal file has grown too
+ * large.
+ */
+static int
+post_append (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+             int *err)
+{
+  bool too_large;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&journal_lock);
+    too_large = j_max_size > 0 && j_size > (uint64_t) j_max_size;
+  }
+  if (too_large)
+    return drain_all (next_ops, nxdata, err);
+  return drain_below (next_ops, nxdata, pending_limit, err);
+}
+
+/* Write data. */
+static int
+journal_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
+                void *handle, const void *buf, uint32_t count,
+                uint64_t offset, uint32_t flags, int *err)
+{
+  if (journal_append (REC_WRITE, buf, count, offset, 0, err) == -1)
+    return -1;
+
+  if (flags & NBDKIT_FLAG_FUA) {
+    if (fdatasync (j_fd) == -1) {
+      *err = errno;
+      nbdkit_error ("fdatasync: %s: %m", j_path);
+      return -1;
+    }
+  }
+
+  return post_append (next_ops, nxdata, err);
+}
+
+/* Zero data. */
+static int
+journal_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
+              void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+              int *err)
+{
+  if (journal_append (REC_ZERO, NULL, count, offset,
+                      flags & NBDKIT_FLAG_MAY_TRIM, err) == -1)
+    return -1;
+
+  if (flags & NBDKIT_FLAG_FUA) {
+    if (fdatasync (j_fd) == -1) {
+      *err = errno;
+      nbdkit_error ("fdatasync: %s: %m", j_path);
+      return -1;
+    }
+  }
+
+  return post_append (next_ops, nxdata, err);
+}
+
+/* Flush: make the journal durable.  The plugin is not flushed — that
+ * is the point of this filter; durability is provided by crash
+ * recovery from the journal.
+ */
+static int
+journal_flush (struct nbdkit_next_ops *next_ops, void *nxdata,
+               void *handle, uint32_t flags, int *err)
+{
+  if (fdatasync (j_fd) == -1) {
+    *err = errno;
+    nbdkit_error ("fdatasync: %s: %m", j_path);
+    return -1;
+  }
+  return 0;
+}
+
+/* Trim: drain the journal first so ordering against pending writes
+ * is preserved, then pass it through.
+ */
+static int
+journal_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
+              void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+              int *err)
+{
+  if (drain_all (next_ops, nxdata, err) == -1)
+    return -1;
+  return next_ops->trim (nxdata, count, offset, flags, err);
+}
+
+/* Extents: drain first, otherwise the plugin's answer would not
+ * reflect pending writes.
+ */
+static int
+journal_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
+                 void *handle, uint32_t count, uint64_t offset,
+                 uint32_t flags, struct nbdkit_extents *extents, int *err)
+{
+  if (drain_all (next_ops, nxdata, err) == -1)
+    return -1;
+  return next_ops->extents (nxdata, count, offset, flags, extents, err);
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "journal",
+  .longname          = "nbdkit write journal filter",
+  .unload            = journal_unload,
+  .config            = journal_config,
+  .config_complete   = journal_config_complete,
+  .config_help       = journal_config_help,
+  .get_ready         = journal_get_ready,
+  .prepare           = journal_prepare,
+  .finalize          = journal_finalize,
+  .can_flush         = journal_can_flush,
+  .can_fua           = journal_can_fua,
+  .can_zero          = journal_can_zero,
+  .can_fast_zero     = journal_can_fast_zero,
+  .pread             = journal_pread,
+  .pwrite            = journal_pwrite,
+  .zero              = journal_zero,
+  .flush             = journal_flush,
+  .trim              = journal_trim,
+  .extents           = journal_extents,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
@@ -34,9 +34,22 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <pthread.h>
 
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_LINUX_VM_SOCKETS_H
+#include <linux/vm_sockets.h>
+#endif
+
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
@@ -48,6 +61,196 @@ static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 /* Client limit (0 = filter is disabled). */
 static unsigned limit = 1;
 
+/* Per-source-address and per-export limits (0 = no limit). */
+static unsigned clientlimit = 0;
+static unsigned exportlimit = 0;
+
+/* A key identifying the source of a connection: the address family
+ * plus the significant part of the peer address (IPv4/IPv6 address or
+ * vsock CID, never the port).  Connections over Unix domain sockets
+ * or other families all share a single key per family.
+ */
+struct client_key {
+  int family;
+  uint8_t addr[16];
+};
+
+/* Reference-counted hash table entries, chained per bucket.  Chaining
+ * keeps entry pointers stable so connection handles can point at
+ * their entry directly, making close a pointer dereference rather
+ * than a second lookup.  Entries are removed when their count drops
+ * to zero, so table size is bounded by the number of live clients.
+ */
+struct entry {
+  struct entry *next;
+  unsigned count;
+  struct client_key key;        /* for the client table */
+  char *exportname;             /* for the export table */
+};
+
+#define NR_BUCKETS 64           /* must be a power of 2 */
+static struct entry *client_table[NR_BUCKETS];
+static struct entry *export_table[NR_BUCKETS];
+
+struct handle {
+  struct entry *client;         /* may be NULL if not counted */
+  struct entry *export;
+};
+
+static uint64_t
+hash_bytes (const void *vp, size_t len)
+{
+  const uint8_t *p = vp;
+  uint64_t h = UINT64_C (0xcbf29ce484222325); /* FNV-1a */
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    h ^= p[i];
+    h *= UINT64_C (0x100000001b3);
+  }
+  return h;
+}
+
+/* Get the client key for the current connection.  Returns -1 only if
+ * the peer address cannot be read at all.
+ */
+static int
+get_client_key (struct client_key *key)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof addr;
+
+  if (nbdkit_peer_name ((struct sockaddr *) &addr, &addrlen) == -1)
+    return -1;
+
+  memset (key, 0, sizeof *key);
+  key->family = ((struct sockaddr *) &addr)->sa_family;
+  switch (key->family) {
+  case AF_INET:
+    memcpy (key->addr, &((struct sockaddr_in *) &addr)->sin_addr, 4);
+    break;
+  case AF_INET6:
+    memcpy (key->addr, &((struct sockaddr_in6 *) &addr)->sin6_addr, 16);
+    break;
+#ifdef AF_VSOCK
+  case AF_VSOCK: {
+    uint32_t cid = ((struct sockaddr_vm *) &addr)->svm_cid;
+    memcpy (key->addr, &cid, 4);
+    break;
+  }
+#endif
+  default:
+    /* AF_UNIX etc: all connections share the per-family key. */
+    break;
+  }
+  return 0;
+}
+
+static struct entry **
+client_bucket (const struct client_key *key)
+{
+  return &client_table[hash_bytes (key, sizeof *key) & (NR_BUCKETS-1)];
+}
+
+static struct entry **
+export_bucket (const char *exportname)
+{
+  return &export_table[hash_bytes (exportname, strlen (exportname))
+                       & (NR_BUCKETS-1)];
+}
+
+/* The following functions are called with the lock held. */
+
+static unsigned
+count_client (const struct client_key *key)
+{
+  const struct entry *e;
+
+  for (e = *client_bucket (key); e != NULL; e = e->next)
+    if (memcmp (&e->key, key, sizeof *key) == 0)
+      return e->count;
+  return 0;
+}
+
+static unsigned
+count_export (const char *exportname)
+{
+  const struct entry *e;
+
+  for (e = *export_bucket (exportname); e != NULL; e = e->next)
+    if (strcmp (e->exportname, exportname) == 0)
+      return e->count;
+  return 0;
+}
+
+static struct entry *
+ref_client (const struct client_key *key)
+{
+  struct entry **bucket = client_bucket (key), *e;
+
+  for (e = *bucket; e != NULL; e = e->next) {
+    if (memcmp (&e->key, key, sizeof *key) == 0) {
+      e->count++;
+      return e;
+    }
+  }
+
+  e = calloc (1, sizeof *e);
+  if (e == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  e->key = *key;
+  e->count = 1;
+  e->next = *bucket;
+  *bucket = e;
+  return e;
+}
+
+static struct entry *
+ref_export (const char *exportname)
+{
+  struct entry **bucket = export_bucket (exportname), *e;
+
+  for (e = *bucket; e != NULL; e = e->next) {
+    if (strcmp (e->exportname, exportname) == 0) {
+      e->count++;
+      return e;
+    }
+  }
+
+  e = calloc (1, sizeof *e);
+  if (e == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  e->exportname = strdup (exportname);
+  if (e->exportname == NULL) {
+    nbdkit_error ("strdup: %m");
+    free (e);
+    return NULL;
+  }
+  e->count = 1;
+  e->next = *bucket;
+  *bucket = e;
+  return e;
+}
+
+static void
+unref_entry (struct entry **bucket, struct entry *e)
+{
+  if (e == NULL)
+    return;
+
+  if (--e->count == 0) {
+    while (*bucket != e)
+      bucket = &(*bucket)->next;
+    *bucket = e->next;
+    free (e->exportname);
+    free (e);
+  }
+}
+
 static int
 limit_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
               const char *key, const char *value)
@@ -57,6 +260,16 @@ limit_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
       return -1;
     return 0;
   }
+  else if (strcmp (key, "clientlimit") == 0) {
+    if (nbdkit_parse_unsigned ("clientlimit", value, &clientlimit) == -1)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "exportlimit") == 0) {
+    if (nbdkit_parse_unsigned ("exportlimit", value, &exportlimit) == -1)
+      return -1;
+    return 0;
+  }
 
   return next (nxdata, key, value);
 }
@@ -67,6 +280,20 @@ too_many_clients_error (void)
   nbdkit_error ("limit: too many clients connected, connection rejected");
 }
 
+static void
+client_limit_error (void)
+{
+  nbdkit_error ("limit: too many connections from this client address, "
+                "connection rejected");
+}
+
+static void
+export_limit_error (void)
+{
+  nbdkit_error ("limit: too many connections to this export, "
+                "connection rejected");
+}
+
 /* We limit connections in the preconnect stage (in particular before
  * any heavyweight NBD or TLS negotiations has been done).  However we
  * count connections in the open/close calls since clients can drop
@@ -86,6 +313,20 @@ limit_preconnect (nbdkit_next_preconnect *next, nbdkit_backend *nxdata,
     return -1;
   }
 
+  /* The export name is not known yet so the export limit can only be
+   * checked in open below.
+   */
+  if (clientlimit > 0) {
+    struct client_key key;
+
+    if (get_client_key (&key) == -1)
+      return -1;                /* We should fail closed ... */
+    if (count_client (&key) >= clientlimit) {
+      client_limit_error ();
+      return -1;
+    }
+  }
+
   return 0;
 }
 
@@ -93,9 +334,17 @@ static void *
 limit_open (nbdkit_next_open *next, nbdkit_backend *nxdata,
             int readonly, const char *exportname, int is_tls)
 {
+  struct handle *h;
+
   if (next (nxdata, readonly, exportname) == -1)
     return NULL;
 
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
 
   /* We have to check again because clients can artificially slow down
@@ -103,17 +352,54 @@ limit_open (nbdkit_next_open *next, nbdkit_backend *nxdata,
    */
   if (limit > 0 && connections >= limit) {
     too_many_clients_error ();
-    return NULL;
+    goto err;
+  }
+
+  if (clientlimit > 0) {
+    struct client_key key;
+
+    if (get_client_key (&key) == -1)
+      goto err;
+    if (count_client (&key) >= clientlimit) {
+      client_limit_error ();
+      goto err;
+    }
+    h->client = ref_client (&key);
+    if (h->client == NULL)
+      goto err;
+  }
+
+  if (exportlimit > 0) {
+    if (count_export (exportname) >= exportlimit) {
+      export_limit_error ();
+      goto err;
+    }
+    h->export = ref_export (exportname);
+    if (h->export == NULL)
+      goto err;
   }
 
   connections++;
-  return NBDKIT_HANDLE_NOT_NEEDED;
+  return h;
+
+ err:
+  if (h->client)
+    unref_entry (client_bucket (&h->client->key), h->client);
+  free (h);
+  return NULL;
 }
 
 static void
 limit_close (void *handle)
 {
+  struct handle *h = handle;
+
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (h->client)
+    unref_entry (client_bucket (&h->client->key), h->client);
+  if (h->export)
+    unref_entry (export_bucket (h->export->exportname), h->export);
+  free (h);
   connections--;
 }
 
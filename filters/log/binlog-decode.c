@@ -0,0 +1,135 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Convert a binary log written by the log filter (logbinfile=FILE)
+ * back to text, one line per completed operation:
+ *
+ *   nbdkit-binlog-decode < file.binlog
+ *
+ * Must run on the same architecture that wrote the log, since the
+ * records are stored in native byte order.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "binlog.h"
+
+static const char *
+op_name (uint32_t op)
+{
+  switch (op) {
+  case BINLOG_CONNECT:    return "Connect";
+  case BINLOG_DISCONNECT: return "Disconnect";
+  case BINLOG_READ:       return "Read";
+  case BINLOG_WRITE:      return "Write";
+  case BINLOG_FLUSH:      return "Flush";
+  case BINLOG_TRIM:       return "Trim";
+  case BINLOG_ZERO:       return "Zero";
+  case BINLOG_EXTENTS:    return "Extents";
+  case BINLOG_CACHE:      return "Cache";
+  default:                return "Unknown";
+  }
+}
+
+static void
+print_timestamp (uint64_t us)
+{
+  time_t secs = us / 1000000;
+  struct tm tm;
+  char buf[32];
+
+  gmtime_r (&secs, &tm);
+  strftime (buf, sizeof buf, "%F %T", &tm);
+  printf ("%s.%06" PRIu64, buf, us % 1000000);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct binlog_header hdr;
+  struct binlog_record rec;
+
+  if (argc != 1) {
+    fprintf (stderr, "usage: %s < file.binlog\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (fread (&hdr, sizeof hdr, 1, stdin) != 1 ||
+      memcmp (hdr.magic, BINLOG_MAGIC, sizeof hdr.magic) != 0) {
+    fprintf (stderr, "%s: input is not an nbdkit binary log\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (hdr.version != BINLOG_VERSION ||
+      hdr.record_size != sizeof (struct binlog_record)) {
+    fprintf (stderr, "%s: unsupported binary log version\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  while (fread (&rec, sizeof rec, 1, stdin) == 1) {
+    print_timestamp (rec.start_us);
+    printf (" connection=%" PRIu64 " %s", rec.connection, op_name (rec.op));
+    if (rec.id)
+      printf (" id=%" PRIu64, rec.id);
+    switch (rec.op) {
+    case BINLOG_READ:
+    case BINLOG_WRITE:
+    case BINLOG_TRIM:
+    case BINLOG_ZERO:
+    case BINLOG_EXTENTS:
+    case BINLOG_CACHE:
+      printf (" offset=0x%" PRIx64 " count=0x%" PRIx32 " flags=0x%" PRIx32,
+              rec.offset, rec.count, rec.flags);
+      break;
+    default:
+      break;
+    }
+    printf (" duration=%" PRIu64 "us return=%" PRId32,
+            rec.end_us - rec.start_us, rec.result);
+    if (rec.result == -1)
+      printf (" errno=%" PRId32 " (%s)", rec.error, strerror (rec.error));
+    putchar ('\n');
+  }
+
+  if (ferror (stdin)) {
+    fprintf (stderr, "%s: read error\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  exit (EXIT_SUCCESS);
+}
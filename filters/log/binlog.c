@@ -0,0 +1,267 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Binary logging (logbinfile=FILE).
+ *
+ * The request threads only copy a fixed size record into a ring
+ * buffer; a background flusher thread batches records out to the log
+ * file.  This keeps the hot path down to a mutex and a memcpy
+ * instead of formatting text and flushing a stdio stream per
+ * operation.  Records are never dropped: if the ring fills up the
+ * request threads wait for the flusher.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "utils.h"
+#include "windows-compat.h"
+
+#include "log.h"
+#include "binlog.h"
+
+const char *logbinfilename;
+
+/* Ring of records waiting to be written, and the flusher thread. */
+#define RING_SIZE 16384
+static struct binlog_record ring[RING_SIZE];
+static size_t ring_head, ring_tail;     /* write and read positions */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ring_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static bool flusher_running;
+static bool quit;
+
+static int fd = -1;
+
+static bool
+ring_is_empty (void)
+{
+  return ring_head == ring_tail;
+}
+
+static bool
+ring_is_full (void)
+{
+  return (ring_head + 1) % RING_SIZE == ring_tail;
+}
+
+int
+binlog_open (bool append)
+{
+  struct binlog_header hdr;
+  off_t size;
+
+  fd = open (logbinfilename,
+             O_CLOEXEC | O_RDWR | O_CREAT | (append ? O_APPEND : O_TRUNC),
+             0666);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", logbinfilename);
+    return -1;
+  }
+
+  size = lseek (fd, 0, SEEK_END);
+  if (size > 0) {
+    /* Appending to an existing log: check it really is one. */
+    char magic[16];
+
+    if (pread (fd, magic, sizeof magic, 0) != sizeof magic ||
+        memcmp (magic, BINLOG_MAGIC, sizeof magic) != 0) {
+      nbdkit_error ("%s: not a binary log file", logbinfilename);
+      close (fd);
+      fd = -1;
+      return -1;
+    }
+  }
+  else {
+    memset (&hdr, 0, sizeof hdr);
+    memcpy (hdr.magic, BINLOG_MAGIC, sizeof hdr.magic);
+    hdr.version = BINLOG_VERSION;
+    hdr.record_size = sizeof (struct binlog_record);
+    if (write (fd, &hdr, sizeof hdr) != sizeof hdr) {
+      nbdkit_error ("write: %s: %m", logbinfilename);
+      close (fd);
+      fd = -1;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Write all of buf, coping with short writes. */
+static void
+write_records (const struct binlog_record *recs, size_t n)
+{
+  const char *p = (const char *) recs;
+  size_t len = n * sizeof *recs;
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (fd, p, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      /* Logging is best effort; don't take the server down. */
+      nbdkit_error ("write: %s: %m", logbinfilename);
+      return;
+    }
+    p += r;
+    len -= r;
+  }
+}
+
+static void *
+flusher_thread (void *arg)
+{
+  static struct binlog_record batch[RING_SIZE];
+  size_t n;
+
+  for (;;) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ring_lock);
+      while (ring_is_empty () && !quit)
+        pthread_cond_wait (&ring_not_empty, &ring_lock);
+      if (ring_is_empty () && quit)
+        break;
+
+      /* Drain everything queued so far into the local batch. */
+      n = 0;
+      while (!ring_is_empty ()) {
+        batch[n++] = ring[ring_tail];
+        ring_tail = (ring_tail + 1) % RING_SIZE;
+      }
+      pthread_cond_broadcast (&ring_not_full);
+    }
+
+    write_records (batch, n);
+  }
+
+  return NULL;
+}
+
+int
+binlog_start (void)
+{
+  int err;
+
+  err = pthread_create (&flusher, NULL, flusher_thread, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  flusher_running = true;
+  return 0;
+}
+
+void
+binlog_close (void)
+{
+  if (fd == -1)
+    return;
+
+  if (flusher_running) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ring_lock);
+      quit = true;
+      pthread_cond_broadcast (&ring_not_empty);
+    }
+    pthread_join (flusher, NULL);
+    flusher_running = false;
+  }
+
+  /* Flush anything which was queued before the flusher started. */
+  while (!ring_is_empty ()) {
+    write_records (&ring[ring_tail], 1);
+    ring_tail = (ring_tail + 1) % RING_SIZE;
+  }
+
+  close (fd);
+  fd = -1;
+}
+
+uint64_t
+binlog_now (void)
+{
+  struct timeval tv;
+
+  if (fd == -1)
+    return 0;
+  if (gettimeofday (&tv, NULL) == -1)
+    return 0;
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void
+binlog_record (struct handle *h, uint64_t id, uint32_t op,
+               uint64_t offset, uint32_t count, uint32_t flags,
+               uint64_t start_us, int result, int error)
+{
+  struct binlog_record rec;
+
+  if (fd == -1)
+    return;
+
+  rec.start_us = start_us;
+  rec.end_us = binlog_now ();
+  rec.connection = h ? h->connection : 0;
+  rec.id = id;
+  rec.offset = offset;
+  rec.count = count;
+  rec.flags = flags;
+  rec.op = op;
+  rec.result = result;
+  rec.error = result == -1 ? error : 0;
+  rec.unused = 0;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ring_lock);
+  while (ring_is_full ())
+    pthread_cond_wait (&ring_not_full, &ring_lock);
+  ring[ring_head] = rec;
+  ring_head = (ring_head + 1) % RING_SIZE;
+  pthread_cond_signal (&ring_not_empty);
+}
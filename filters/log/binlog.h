@@ -0,0 +1,113 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_BINLOG_H
+#define NBDKIT_BINLOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Binary log file format (logbinfile=FILE): a 32 byte header followed
+ * by fixed size records.  Records are written in native byte order
+ * and are not portable between architectures; decode them on the
+ * machine that wrote them (see binlog-decode.c).
+ */
+
+#define BINLOG_MAGIC "NBDKITBINLOG\0\0\0"   /* 16 bytes incl. NULs */
+#define BINLOG_VERSION 1
+
+struct binlog_header {
+  char magic[16];
+  uint32_t version;
+  uint32_t record_size;         /* sizeof (struct binlog_record) */
+  uint64_t unused;
+};
+
+/* One record per completed operation, carrying both the start and
+ * completion timestamps.
+ */
+enum binlog_op {
+  BINLOG_CONNECT = 1,
+  BINLOG_DISCONNECT,
+  BINLOG_READ,
+  BINLOG_WRITE,
+  BINLOG_FLUSH,
+  BINLOG_TRIM,
+  BINLOG_ZERO,
+  BINLOG_EXTENTS,
+  BINLOG_CACHE,
+};
+
+struct binlog_record {
+  uint64_t start_us;            /* microseconds since the epoch */
+  uint64_t end_us;
+  uint64_t connection;
+  uint64_t id;                  /* transaction id, 0 for connect etc. */
+  uint64_t offset;
+  uint32_t count;
+  uint32_t flags;               /* NBDKIT_FLAG_* as passed in */
+  uint32_t op;                  /* enum binlog_op */
+  int32_t result;               /* 0 or -1 */
+  int32_t error;                /* errno, if result == -1 */
+  uint32_t unused;
+};
+
+/* The rest of this header is only used by the filter itself, not by
+ * binlog-decode.c.
+ */
+
+struct handle;
+
+/* Set from the logbinfile parameter.  NULL = binary logging disabled. */
+extern const char *logbinfilename;
+
+/* Open the binary log (.get_ready) and start the flusher thread
+ * (.after_fork, since threads do not survive the server forking).
+ */
+extern int binlog_open (bool append);
+extern int binlog_start (void);
+
+/* Flush and close the binary log, stopping the flusher thread. */
+extern void binlog_close (void);
+
+/* Current time in microseconds, or 0 if binary logging is disabled. */
+extern uint64_t binlog_now (void);
+
+/* Queue one record.  Cheap: a memcpy into the ring buffer.  Blocks
+ * only if the flusher thread cannot keep up (records are never
+ * dropped).
+ */
+extern void binlog_record (struct handle *h, uint64_t id, uint32_t op,
+                           uint64_t offset, uint32_t count, uint32_t flags,
+                           uint64_t start_us, int result, int error);
+
+#endif /* NBDKIT_BINLOG_H */
@@ -70,6 +70,7 @@ pid_t saved_pid;
 static void
 log_unload (void)
 {
+  binlog_close ();
   if (logfile)
     fclose (logfile);
 }
@@ -93,13 +94,18 @@ log_config (nbdkit_next_config *next, void *nxdata,
     logscript = value;
     return 0;
   }
+  if (strcmp (key, "logbinfile") == 0) {
+    logbinfilename = value;
+    return 0;
+  }
   return next (nxdata, key, value);
 }
 
 #define log_config_help \
   "logfile=<FILE>               The file to place the log in.\n" \
   "logappend=<BOOL>             True to append to the log (default false).\n" \
-  "logscript=<SCRIPT>           Script to run for logging."
+  "logscript=<SCRIPT>           Script to run for logging.\n" \
+  "logbinfile=<FILE>            Binary log file (see nbdkit-log-filter(1))."
 
 /* Open the logfile. */
 static int
@@ -129,6 +135,11 @@ log_get_ready (nbdkit_next_get_ready *next, void *nxdata, int thread_model)
     }
   }
 
+  if (logbinfilename) {
+    if (binlog_open (append) == -1)
+      return -1;
+  }
+
   saved_pid = getpid ();
 
   print (NULL, "Ready", "thread_model=%d", thread_model);
@@ -142,6 +153,14 @@ log_after_fork (nbdkit_next_after_fork *next, void *nxdata)
   if (getpid () != saved_pid)
     print (NULL, "Fork", "");
 
+  /* The flusher thread would not survive the fork above, so it is
+   * only started here.
+   */
+  if (logbinfilename) {
+    if (binlog_start () == -1)
+      return -1;
+  }
+
   return next (nxdata);
 }
 
@@ -280,6 +299,8 @@ log_prepare (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
   else
     print (h, "Connect", "");
 
+  binlog_record (h, 0, BINLOG_CONNECT, 0, 0, 0, binlog_now (), 0, 0);
+
   return 0;
 }
 
@@ -289,6 +310,7 @@ log_finalize (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
   struct handle *h = handle;
 
   print (h, "Disconnect", "transactions=%" PRId64, h->id);
+  binlog_record (h, h->id, BINLOG_DISCONNECT, 0, 0, 0, binlog_now (), 0, 0);
   return 0;
 }
 
@@ -301,7 +323,8 @@ log_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct handle *h = handle;
   int r;
 
-  LOG (h, "Read", r, err, "offset=0x%" PRIx64 " count=0x%x", offs, count);
+  LOG (h, "Read", BINLOG_READ, offs, count, flags, r, err,
+       "offset=0x%" PRIx64 " count=0x%x", offs, count);
 
   assert (!flags);
   return r = next_ops->pread (nxdata, buf, count, offs, flags, err);
@@ -316,7 +339,7 @@ log_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct handle *h = handle;
   int r;
 
-  LOG (h, "Write", r, err,
+  LOG (h, "Write", BINLOG_WRITE, offs, count, flags, r, err,
        "offset=0x%" PRIx64 " count=0x%x fua=%d",
        offs, count, !!(flags & NBDKIT_FLAG_FUA));
 
@@ -332,7 +355,7 @@ log_flush (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
   struct handle *h = handle;
   int r;
 
-  LOG (h, "Flush", r, err, "");
+  LOG (h, "Flush", BINLOG_FLUSH, 0, 0, flags, r, err, "");
 
   assert (!flags);
   return r = next_ops->flush (nxdata, flags, err);
@@ -347,7 +370,7 @@ log_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct handle *h = handle;
   int r;
 
-  LOG (h, "Trim", r, err,
+  LOG (h, "Trim", BINLOG_TRIM, offs, count, flags, r, err,
        "offset=0x%" PRIx64 " count=0x%x fua=%d",
        offs, count, !!(flags & NBDKIT_FLAG_FUA));
 
@@ -364,7 +387,7 @@ log_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct handle *h = handle;
   int r;
 
-  LOG (h, "Zero", r, err,
+  LOG (h, "Zero", BINLOG_ZERO, offs, count, flags, r, err,
        "offset=0x%" PRIx64 " count=0x%x trim=%d fua=%d fast=%d",
        offs, count, !!(flags & NBDKIT_FLAG_MAY_TRIM),
        !!(flags & NBDKIT_FLAG_FUA),
@@ -383,6 +406,7 @@ log_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
 {
   struct handle *h = handle;
   log_id_t id = get_id (h);
+  uint64_t start_us = binlog_now ();
   int r;
 
   assert (!(flags & ~(NBDKIT_FLAG_REQ_ONE)));
@@ -390,6 +414,8 @@ log_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
          "offset=0x%" PRIx64 " count=0x%x req_one=%d",
          offs, count, !!(flags & NBDKIT_FLAG_REQ_ONE));
   r = next_ops->extents (nxdata, count, offs, flags, extents, err);
+  binlog_record (h, id, BINLOG_EXTENTS, offs, count, flags, start_us,
+                 r, r == -1 ? *err : 0);
   if (r == -1)
     leave_simple (h, id, "Extents", r, err);
   else {
@@ -437,7 +463,8 @@ log_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct handle *h = handle;
   int r;
 
-  LOG (h, "Cache", r, err, "offset=0x%" PRIx64 " count=0x%x", offs, count);
+  LOG (h, "Cache", BINLOG_CACHE, offs, count, flags, r, err,
+       "offset=0x%" PRIx64 " count=0x%x", offs, count);
 
   assert (!flags);
   return r = next_ops->cache (nxdata, count, offs, flags, err);
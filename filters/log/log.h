@@ -54,6 +54,8 @@ extern const char *logscript;
 extern int append;
 extern pthread_mutex_t lock;
 
+#include "binlog.h"
+
 /* Compute the next id number on the current connection. */
 static inline log_id_t
 get_id (struct handle *h)
@@ -92,14 +94,21 @@ struct leave_simple_params {
   const char *act;
   int *r;
   int *err;
+  /* Extra fields recorded in the binary log. */
+  uint32_t op;
+  uint64_t offset;
+  uint32_t count;
+  uint32_t flags;
+  uint64_t start_us;
 };
 
 extern void leave_simple2 (struct leave_simple_params *params);
 
-#define LOG(h, act, r, err, ...)                                        \
-  log_id_t id = get_id (h);                                                 \
+#define LOG(h, act, op, offs, count, flags, r, err, ...)                \
+  log_id_t id = get_id (h);                                             \
   __attribute__((cleanup (leave_simple2)))                              \
-  struct leave_simple_params _params = { h, id, act, &r, err };         \
+  struct leave_simple_params _params =                                  \
+    { h, id, act, &r, err, op, offs, count, flags, binlog_now () };     \
   enter ((h), id, (act), ##__VA_ARGS__)
 
 #endif /* NBDKIT_LOG_H */
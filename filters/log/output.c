@@ -251,4 +251,8 @@ void
 leave_simple2 (struct leave_simple_params *params)
 {
   leave_simple (params->h, params->id, params->act, *params->r, params->err);
+  binlog_record (params->h, params->id, params->op,
+                 params->offset, params->count, params->flags,
+                 params->start_us, *params->r,
+                 *params->r == -1 ? *params->err : 0);
 }
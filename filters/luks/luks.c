@@ -0,0 +1,792 @@
+/* nbdkit
+ * Copyright (C) 2018-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Read and write LUKSv1-encrypted disks in-process, removing the need
+ * to put qemu in front of nbdkit just for encryption.
+ *
+ * The heavy lifting is done by GnuTLS (the library nbdkit already
+ * links for TLS support), whose AES implementation uses AES-NI where
+ * the CPU has it.  Cipher contexts are pooled per connection, so
+ * parallel requests encrypt and decrypt concurrently.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#include <nbdkit-filter.h>
+
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "isaligned.h"
+#include "minmax.h"
+#include "rounding.h"
+
+#define SECTOR_SIZE 512
+
+/* On-disk LUKSv1 header.  All integer fields are big endian. */
+#define LUKS_NUMKEYS 8
+#define LUKS_KEY_ENABLED  0x00AC71F3
+#define LUKS_KEY_DISABLED 0x0000DEAD
+#define LUKS_DIGESTSIZE 20
+#define LUKS_SALTSIZE 32
+#define LUKS_MAX_KEY_BYTES 64
+
+struct luks_keyslot {
+  uint32_t active;              /* LUKS_KEY_ENABLED / LUKS_KEY_DISABLED */
+  uint32_t password_iterations;
+  uint8_t password_salt[LUKS_SALTSIZE];
+  uint32_t key_material_offset; /* in sectors */
+  uint32_t stripes;
+} __attribute__((__packed__));
+
+struct luks_header {
+  char magic[6];                /* LUKS_MAGIC */
+  uint16_t version;             /* 1 */
+  char cipher_name[32];
+  char cipher_mode[32];
+  char hash_spec[32];
+  uint32_t payload_offset;      /* in sectors */
+  uint32_t master_key_len;      /* in bytes */
+  uint8_t master_key_digest[LUKS_DIGESTSIZE];
+  uint8_t master_key_salt[LUKS_SALTSIZE];
+  uint32_t master_key_digest_iterations;
+  char uuid[40];
+  struct luks_keyslot keyslot[LUKS_NUMKEYS];
+} __attribute__((__packed__));
+
+static const char luks_magic[6] = { 'L', 'U', 'K', 'S', 0xba, 0xbe };
+
+/* How the per-sector IV is generated. */
+enum iv_mode {
+  IV_PLAIN,                     /* 32 bit LE sector number */
+  IV_PLAIN64,                   /* 64 bit LE sector number */
+  IV_ESSIV_SHA256,              /* sector number encrypted with hash of key */
+};
+
+/* Cipher parameters decoded from the header. */
+struct crypt_params {
+  gnutls_cipher_algorithm_t cipher;
+  enum iv_mode ivmode;
+  gnutls_mac_algorithm_t mac;   /* hash_spec, for PBKDF2 */
+  gnutls_digest_algorithm_t dig; /* hash_spec, for anti-forensic merge */
+};
+
+/* A pooled pair of cipher contexts (the second one only used for
+ * ESSIV IV generation).  Contexts hold IV state so each concurrent
+ * request needs its own.
+ */
+struct cipher_ctx {
+  gnutls_cipher_hd_t cipher;
+  gnutls_cipher_hd_t essiv;
+  struct cipher_ctx *next;
+};
+
+struct handle {
+  bool unlocked;                /* master key recovered */
+  struct crypt_params params;
+  uint8_t masterkey[LUKS_MAX_KEY_BYTES];
+  size_t masterkey_len;
+  uint64_t payload_offset;      /* in bytes */
+  int64_t size;                 /* plaintext size in bytes */
+
+  /* Pool of free cipher contexts, protected by the lock.  Grows to
+   * the number of concurrently executing requests.
+   */
+  pthread_mutex_t lock;
+  struct cipher_ctx *free_ctxs;
+};
+
+/* The passphrase (passphrase=...). */
+static char *passphrase = NULL;
+
+static void
+luks_unload (void)
+{
+  if (passphrase) {
+    memset (passphrase, 0, strlen (passphrase));
+    free (passphrase);
+  }
+}
+
+static int
+luks_config (nbdkit_next_config *next, void *nxdata,
+             const char *key, const char *value)
+{
+  if (strcmp (key, "passphrase") == 0) {
+    if (nbdkit_read_password (value, &passphrase) == -1)
+      return -1;
+    return 0;
+  }
+
+  return next (nxdata, key, value);
+}
+
+static int
+luks_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  if (passphrase == NULL) {
+    nbdkit_error ("LUKS passphrase was not set "
+                  "(use passphrase=... to set it)");
+    return -1;
+  }
+
+  return next (nxdata);
+}
+
+#define luks_config_help \
+  "passphrase=<SECRET>      Passphrase to unlock the LUKS disk.  Use\n" \
+  "                         +FILE to read it from a file."
+
+/* Decode cipher_name/cipher_mode/hash_spec from the header. */
+static int
+parse_crypt_params (const struct luks_header *hdr, uint32_t key_bytes,
+                    struct crypt_params *p)
+{
+  const char *mode = hdr->cipher_mode;
+
+  if (strncmp (hdr->cipher_name, "aes", sizeof hdr->cipher_name) != 0) {
+    nbdkit_error ("unsupported LUKS cipher: %.32s "
+                  "(only aes is supported)", hdr->cipher_name);
+    return -1;
+  }
+
+  if (strncmp (mode, "xts-", 4) == 0) {
+    switch (key_bytes) {
+    case 32: p->cipher = GNUTLS_CIPHER_AES_128_XTS; break;
+    case 64: p->cipher = GNUTLS_CIPHER_AES_256_XTS; break;
+    default:
+      nbdkit_error ("unsupported XTS key size: %" PRIu32 " bytes", key_bytes);
+      return -1;
+    }
+    mode += 4;
+  }
+  else if (strncmp (mode, "cbc-", 4) == 0) {
+    switch (key_bytes) {
+    case 16: p->cipher = GNUTLS_CIPHER_AES_128_CBC; break;
+    case 24: p->cipher = GNUTLS_CIPHER_AES_192_CBC; break;
+    case 32: p->cipher = GNUTLS_CIPHER_AES_256_CBC; break;
+    default:
+      nbdkit_error ("unsupported CBC key size: %" PRIu32 " bytes", key_bytes);
+      return -1;
+    }
+    mode += 4;
+  }
+  else {
+    nbdkit_error ("unsupported LUKS cipher mode: %.32s", hdr->cipher_mode);
+    return -1;
+  }
+
+  if (strcmp (mode, "plain") == 0)
+    p->ivmode = IV_PLAIN;
+  else if (strcmp (mode, "plain64") == 0)
+    p->ivmode = IV_PLAIN64;
+  else if (strcmp (mode, "essiv:sha256") == 0)
+    p->ivmode = IV_ESSIV_SHA256;
+  else {
+    nbdkit_error ("unsupported LUKS IV mode: %.32s", hdr->cipher_mode);
+    return -1;
+  }
+
+  if (strncmp (hdr->hash_spec, "sha1", sizeof hdr->hash_spec) == 0) {
+    p->mac = GNUTLS_MAC_SHA1;
+    p->dig = GNUTLS_DIG_SHA1;
+  }
+  else if (strncmp (hdr->hash_spec, "sha256", sizeof hdr->hash_spec) == 0) {
+    p->mac = GNUTLS_MAC_SHA256;
+    p->dig = GNUTLS_DIG_SHA256;
+  }
+  else if (strncmp (hdr->hash_spec, "sha512", sizeof hdr->hash_spec) == 0) {
+    p->mac = GNUTLS_MAC_SHA512;
+    p->dig = GNUTLS_DIG_SHA512;
+  }
+  else if (strncmp (hdr->hash_spec, "ripemd160",
+                    sizeof hdr->hash_spec) == 0) {
+    p->mac = GNUTLS_MAC_RMD160;
+    p->dig = GNUTLS_DIG_RMD160;
+  }
+  else {
+    nbdkit_error ("unsupported LUKS hash: %.32s", hdr->hash_spec);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Allocate a cipher context (pair) for the given key. */
+static struct cipher_ctx *
+ctx_alloc (const struct crypt_params *p, const uint8_t *key, size_t keylen)
+{
+  struct cipher_ctx *c;
+  gnutls_datum_t dkey = { .data = (unsigned char *) key, .size = keylen };
+  static const uint8_t zero_iv[16];
+  gnutls_datum_t div = { .data = (unsigned char *) zero_iv,
+                         .size = sizeof zero_iv };
+  int r;
+
+  c = calloc (1, sizeof *c);
+  if (c == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  r = gnutls_cipher_init (&c->cipher, p->cipher, &dkey, &div);
+  if (r != 0) {
+    nbdkit_error ("gnutls_cipher_init: %s", gnutls_strerror (r));
+    free (c);
+    return NULL;
+  }
+
+  if (p->ivmode == IV_ESSIV_SHA256) {
+    /* The ESSIV cipher is keyed with SHA256 of the data key.  A
+     * single block is encrypted at a time, so AES-256-CBC with a zero
+     * IV behaves as AES-256-ECB, which GnuTLS does not expose
+     * directly.
+     */
+    uint8_t ekey[32];
+    gnutls_datum_t dekey = { .data = ekey, .size = sizeof ekey };
+
+    gnutls_hash_fast (GNUTLS_DIG_SHA256, key, keylen, ekey);
+    r = gnutls_cipher_init (&c->essiv, GNUTLS_CIPHER_AES_256_CBC,
+                            &dekey, &div);
+    memset (ekey, 0, sizeof ekey);
+    if (r != 0) {
+      nbdkit_error ("gnutls_cipher_init (essiv): %s", gnutls_strerror (r));
+      gnutls_cipher_deinit (c->cipher);
+      free (c);
+      return NULL;
+    }
+  }
+
+  return c;
+}
+
+static void
+ctx_free (struct cipher_ctx *c)
+{
+  gnutls_cipher_deinit (c->cipher);
+  if (c->essiv)
+    gnutls_cipher_deinit (c->essiv);
+  free (c);
+}
+
+/* Get a cipher context for the master key from the pool, creating a
+ * new one when all are in use.
+ */
+static struct cipher_ctx *
+ctx_acquire (struct handle *h)
+{
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+    if (h->free_ctxs) {
+      struct cipher_ctx *c = h->free_ctxs;
+      h->free_ctxs = c->next;
+      return c;
+    }
+  }
+  return ctx_alloc (&h->params, h->masterkey, h->masterkey_len);
+}
+
+static void
+ctx_release (struct handle *h, struct cipher_ctx *c)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+  c->next = h->free_ctxs;
+  h->free_ctxs = c;
+}
+
+/* Encrypt or decrypt whole sectors in place.  ‘sector’ is the sector
+ * number used for IV generation.
+ */
+static int
+crypt_sectors (const struct crypt_params *p, struct cipher_ctx *c,
+               uint64_t sector, uint8_t *buf, size_t len, bool encrypt)
+{
+  assert (IS_ALIGNED (len, SECTOR_SIZE));
+
+  while (len > 0) {
+    uint8_t iv[16] = { 0 };
+    size_t i;
+    int r;
+
+    switch (p->ivmode) {
+    case IV_PLAIN:
+      for (i = 0; i < 4; ++i)
+        iv[i] = (sector >> (i*8)) & 0xff;
+      break;
+    case IV_PLAIN64:
+      for (i = 0; i < 8; ++i)
+        iv[i] = (sector >> (i*8)) & 0xff;
+      break;
+    case IV_ESSIV_SHA256: {
+      uint8_t sbuf[16] = { 0 };
+      static const uint8_t zero_iv[16];
+
+      for (i = 0; i < 8; ++i)
+        sbuf[i] = (sector >> (i*8)) & 0xff;
+      gnutls_cipher_set_iv (c->essiv, (void *) zero_iv, sizeof zero_iv);
+      r = gnutls_cipher_encrypt2 (c->essiv, sbuf, sizeof sbuf,
+                                  iv, sizeof iv);
+      if (r != 0) {
+        nbdkit_error ("gnutls_cipher_encrypt2 (essiv): %s",
+                      gnutls_strerror (r));
+        return -1;
+      }
+      break;
+    }
+    }
+
+    gnutls_cipher_set_iv (c->cipher, iv, sizeof iv);
+    if (encrypt)
+      r = gnutls_cipher_encrypt2 (c->cipher, buf, SECTOR_SIZE,
+                                  buf, SECTOR_SIZE);
+    else
+      r = gnutls_cipher_decrypt2 (c->cipher, buf, SECTOR_SIZE,
+                                  buf, SECTOR_SIZE);
+    if (r != 0) {
+      nbdkit_error ("gnutls_cipher_%scrypt2: %s",
+                    encrypt ? "en" : "de", gnutls_strerror (r));
+      return -1;
+    }
+
+    buf += SECTOR_SIZE;
+    len -= SECTOR_SIZE;
+    sector++;
+  }
+
+  return 0;
+}
+
+/* The anti-forensic diffuse function: hash the block in digest-sized
+ * chunks, each prefixed with its big endian chunk number.
+ */
+static int
+af_hash (gnutls_digest_algorithm_t dig, uint8_t *block, size_t len)
+{
+  size_t ds = gnutls_hash_get_len (dig);
+  size_t i, nr_chunks = len / ds, padding = len % ds;
+  uint8_t temp[64];
+  gnutls_hash_hd_t hd;
+  uint32_t ivbe;
+  int r;
+
+  assert (ds <= sizeof temp);
+
+  for (i = 0; i < nr_chunks; ++i) {
+    r = gnutls_hash_init (&hd, dig);
+    if (r != 0)
+      goto error;
+    ivbe = htobe32 (i);
+    gnutls_hash (hd, &ivbe, sizeof ivbe);
+    gnutls_hash (hd, &block[i*ds], ds);
+    gnutls_hash_deinit (hd, &block[i*ds]);
+  }
+  if (padding) {
+    r = gnutls_hash_init (&hd, dig);
+    if (r != 0)
+      goto error;
+    ivbe = htobe32 (nr_chunks);
+    gnutls_hash (hd, &ivbe, sizeof ivbe);
+    gnutls_hash (hd, &block[nr_chunks*ds], padding);
+    gnutls_hash_deinit (hd, temp);
+    memcpy (&block[nr_chunks*ds], temp, padding);
+  }
+
+  return 0;
+
+ error:
+  nbdkit_error ("gnutls_hash_init: %s", gnutls_strerror (r));
+  return -1;
+}
+
+/* Merge the anti-forensic stripes back into the key. */
+static int
+af_merge (gnutls_digest_algorithm_t dig, const uint8_t *material,
+          uint32_t stripes, uint8_t *key, size_t keylen)
+{
+  uint32_t s;
+  size_t i;
+
+  memset (key, 0, keylen);
+  for (s = 0; s < stripes; ++s) {
+    for (i = 0; i < keylen; ++i)
+      key[i] ^= material[s*keylen + i];
+    if (s < stripes - 1) {
+      if (af_hash (dig, key, keylen) == -1)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/* Try to recover the master key from one key slot.  Returns 0 on
+ * success, 1 if the passphrase does not match this slot, -1 on error.
+ */
+static int
+try_keyslot (struct nbdkit_next_ops *next_ops, void *nxdata,
+             const struct luks_header *hdr, const struct crypt_params *p,
+             int slot, uint8_t *masterkey, int *err)
+{
+  const struct luks_keyslot *ks = &hdr->keyslot[slot];
+  const uint32_t key_bytes = be32toh (hdr->master_key_len);
+  const uint32_t stripes = be32toh (ks->stripes);
+  const uint64_t material_len =
+    ROUND_UP ((uint64_t) stripes * key_bytes, SECTOR_SIZE);
+  uint8_t dkey[LUKS_MAX_KEY_BYTES];
+  uint8_t digest[LUKS_DIGESTSIZE];
+  CLEANUP_FREE uint8_t *material = NULL;
+  struct cipher_ctx *c;
+  gnutls_datum_t dpass, dsalt;
+  int r;
+
+  /* Derive the slot key from the passphrase. */
+  dpass.data = (unsigned char *) passphrase;
+  dpass.size = strlen (passphrase);
+  dsalt.data = (unsigned char *) ks->password_salt;
+  dsalt.size = LUKS_SALTSIZE;
+  r = gnutls_pbkdf2 (p->mac, &dpass, &dsalt,
+                     be32toh (ks->password_iterations), dkey, key_bytes);
+  if (r != 0) {
+    nbdkit_error ("gnutls_pbkdf2: %s", gnutls_strerror (r));
+    return -1;
+  }
+
+  /* Read and decrypt the anti-forensic key material. */
+  material = malloc (material_len);
+  if (material == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  if (next_ops->pread (nxdata, material, material_len,
+                       (uint64_t) be32toh (ks->key_material_offset) *
+                       SECTOR_SIZE, 0, err) == -1)
+    return -1;
+
+  c = ctx_alloc (p, dkey, key_bytes);
+  memset (dkey, 0, sizeof dkey);
+  if (c == NULL)
+    return -1;
+  r = crypt_sectors (p, c, 0, material, material_len, false);
+  ctx_free (c);
+  if (r == -1)
+    return -1;
+
+  if (af_merge (p->dig, material, stripes, masterkey, key_bytes) == -1)
+    return -1;
+
+  /* Check the candidate against the master key digest. */
+  dpass.data = masterkey;
+  dpass.size = key_bytes;
+  dsalt.data = (unsigned char *) hdr->master_key_salt;
+  dsalt.size = LUKS_SALTSIZE;
+  r = gnutls_pbkdf2 (p->mac, &dpass, &dsalt,
+                     be32toh (hdr->master_key_digest_iterations),
+                     digest, sizeof digest);
+  if (r != 0) {
+    nbdkit_error ("gnutls_pbkdf2: %s", gnutls_strerror (r));
+    return -1;
+  }
+
+  return memcmp (digest, hdr->master_key_digest, sizeof digest) == 0 ? 0 : 1;
+}
+
+/* Read the LUKS header and unlock the master key. */
+static int
+luks_unlock (struct nbdkit_next_ops *next_ops, void *nxdata,
+             struct handle *h)
+{
+  struct luks_header hdr;
+  int64_t size;
+  int slot, r, err = 0;
+
+  size = next_ops->get_size (nxdata);
+  if (size == -1)
+    return -1;
+  if (size < (int64_t) sizeof hdr) {
+    nbdkit_error ("underlying disk is too small to be a LUKS disk");
+    return -1;
+  }
+
+  if (next_ops->pread (nxdata, &hdr, sizeof hdr, 0, 0, &err) == -1)
+    return -1;
+
+  if (memcmp (hdr.magic, luks_magic, sizeof hdr.magic) != 0) {
+    nbdkit_error ("this disk does not contain a LUKS header");
+    return -1;
+  }
+  if (be16toh (hdr.version) != 1) {
+    nbdkit_error ("unsupported LUKS version: %d "
+                  "(only LUKSv1 is supported)", be16toh (hdr.version));
+    return -1;
+  }
+
+  h->masterkey_len = be32toh (hdr.master_key_len);
+  if (h->masterkey_len > LUKS_MAX_KEY_BYTES) {
+    nbdkit_error ("unsupported LUKS key size: %zu bytes", h->masterkey_len);
+    return -1;
+  }
+
+  if (parse_crypt_params (&hdr, h->masterkey_len, &h->params) == -1)
+    return -1;
+
+  nbdkit_debug ("luks: cipher: %.32s-%.32s, hash: %.32s, key: %zu bits",
+                hdr.cipher_name, hdr.cipher_mode, hdr.hash_spec,
+                h->masterkey_len * 8);
+
+  for (slot = 0; slot < LUKS_NUMKEYS; ++slot) {
+    if (be32toh (hdr.keyslot[slot].active) != LUKS_KEY_ENABLED)
+      continue;
+    r = try_keyslot (next_ops, nxdata, &hdr, &h->params, slot,
+                     h->masterkey, &err);
+    if (r == -1)
+      return -1;
+    if (r == 0) {
+      nbdkit_debug ("luks: unlocked key slot %d", slot);
+      break;
+    }
+  }
+  if (slot == LUKS_NUMKEYS) {
+    nbdkit_error ("LUKS passphrase does not match any key slot");
+    return -1;
+  }
+
+  h->payload_offset = (uint64_t) be32toh (hdr.payload_offset) * SECTOR_SIZE;
+  if ((uint64_t) size < h->payload_offset) {
+    nbdkit_error ("underlying disk is smaller than the LUKS data offset");
+    return -1;
+  }
+  h->size = ROUND_DOWN (size - h->payload_offset, SECTOR_SIZE);
+  h->unlocked = true;
+
+  return 0;
+}
+
+static void *
+luks_open (nbdkit_next_open *next, void *nxdata, int readonly,
+           const char *exportname, int is_tls)
+{
+  struct handle *h;
+
+  if (next (nxdata, readonly, exportname) == -1)
+    return NULL;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  pthread_mutex_init (&h->lock, NULL);
+
+  return h;
+}
+
+static void
+luks_close (void *handle)
+{
+  struct handle *h = handle;
+  struct cipher_ctx *c, *next;
+
+  for (c = h->free_ctxs; c != NULL; c = next) {
+    next = c->next;
+    ctx_free (c);
+  }
+  memset (h->masterkey, 0, sizeof h->masterkey);
+  pthread_mutex_destroy (&h->lock);
+  free (h);
+}
+
+static int
+luks_prepare (struct nbdkit_next_ops *next_ops, void *nxdata,
+              void *handle, int readonly)
+{
+  struct handle *h = handle;
+
+  return luks_unlock (next_ops, nxdata, h);
+}
+
+static int64_t
+luks_get_size (struct nbdkit_next_ops *next_ops, void *nxdata,
+               void *handle)
+{
+  struct handle *h = handle;
+
+  if (!h->unlocked && luks_unlock (next_ops, nxdata, h) == -1)
+    return -1;
+  return h->size;
+}
+
+/* Whole sectors only: anything finer would need read-modify-write.
+ * Use nbdkit-blocksize-filter on top for clients which make
+ * sub-sector requests.
+ */
+static int
+check_aligned (uint32_t count, uint64_t offset, int *err)
+{
+  if (!IS_ALIGNED (count | offset, SECTOR_SIZE)) {
+    nbdkit_error ("requests to the luks filter must be aligned to "
+                  "%d byte sectors (consider nbdkit-blocksize-filter)",
+                  SECTOR_SIZE);
+    *err = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+/* Read data. */
+static int
+luks_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+            void *handle, void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags, int *err)
+{
+  struct handle *h = handle;
+  struct cipher_ctx *c;
+  int r;
+
+  if (check_aligned (count, offset, err) == -1)
+    return -1;
+
+  if (next_ops->pread (nxdata, buf, count, offset + h->payload_offset,
+                       flags, err) == -1)
+    return -1;
+
+  c = ctx_acquire (h);
+  if (c == NULL) {
+    *err = ENOMEM;
+    return -1;
+  }
+  r = crypt_sectors (&h->params, c, offset / SECTOR_SIZE,
+                     buf, count, false);
+  ctx_release (h, c);
+  if (r == -1)
+    *err = EIO;
+  return r;
+}
+
+/* Write data. */
+static int
+luks_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
+             void *handle, const void *buf, uint32_t count, uint64_t offset,
+             uint32_t flags, int *err)
+{
+  struct handle *h = handle;
+  CLEANUP_FREE uint8_t *ctbuf = NULL;
+  struct cipher_ctx *c;
+  int r;
+
+  if (check_aligned (count, offset, err) == -1)
+    return -1;
+
+  ctbuf = malloc (count);
+  if (ctbuf == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  memcpy (ctbuf, buf, count);
+
+  c = ctx_acquire (h);
+  if (c == NULL) {
+    *err = ENOMEM;
+    return -1;
+  }
+  r = crypt_sectors (&h->params, c, offset / SECTOR_SIZE,
+                     ctbuf, count, true);
+  ctx_release (h, c);
+  if (r == -1) {
+    *err = EIO;
+    return -1;
+  }
+
+  return next_ops->pwrite (nxdata, ctbuf, count, offset + h->payload_offset,
+                           flags, err);
+}
+
+/* Zeroed plaintext is not zeroed ciphertext, so force the server to
+ * emulate zeroing with pwrite.
+ */
+static int
+luks_can_zero (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
+{
+  return 0;
+}
+
+/* Trimmed regions would decrypt to garbage, appearing to corrupt the
+ * disk, so don't pass trims through.
+ */
+static int
+luks_can_trim (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
+{
+  return 0;
+}
+
+/* Underlying holes decrypt to garbage, not to holes, so don't let the
+ * plugin report extents.
+ */
+static int
+luks_can_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
+                  void *handle)
+{
+  return 0;
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "luks",
+  .longname          = "nbdkit LUKS filter",
+  .unload            = luks_unload,
+  .config            = luks_config,
+  .config_complete   = luks_config_complete,
+  .config_help       = luks_config_help,
+  .open              = luks_open,
+  .close             = luks_close,
+  .prepare           = luks_prepare,
+  .get_size          = luks_get_size,
+  .can_zero          = luks_can_zero,
+  .can_trim          = luks_can_trim,
+  .can_extents       = luks_can_extents,
+  .pread             = luks_pread,
+  .pwrite            = luks_pwrite,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
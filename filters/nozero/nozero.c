@@ -40,8 +40,11 @@
 #include <assert.h>
 #include <errno.h>
 
+#include <pthread.h>
+
 #include <nbdkit-filter.h>
 
+#include "cleanup.h"
 #include "minmax.h"
 
 /* IGNORE is defined as a macro in Windows headers files ... */
@@ -51,6 +54,17 @@
 
 #define MAX_WRITE (64 * 1024 * 1024)
 
+/* Number of threads used to issue emulated zero writes concurrently
+ * when a single request covers several chunks and the thread model
+ * allows it.
+ */
+#define NR_ZERO_THREADS 8
+
+/* Set in .get_ready when the final thread model allows concurrent
+ * writes to the plugin from one request.
+ */
+static bool parallel;
+
 static enum ZeroMode {
   NONE,
   EMULATE,
@@ -104,6 +118,14 @@ nozero_config (nbdkit_next_config *next, void *nxdata,
   "zeromode=<MODE>      One of 'none' (default), 'emulate', 'notrim', 'plugin'.\n" \
   "fastzeromode=<MODE>  One of 'default', 'none', 'slow', 'ignore'.\n"
 
+static int
+nozero_get_ready (nbdkit_next_get_ready *next, nbdkit_backend *nxdata,
+                  int thread_model)
+{
+  parallel = thread_model == NBDKIT_THREAD_MODEL_PARALLEL;
+  return next (nxdata);
+}
+
 /* Check that desired mode is supported by plugin. */
 static int
 nozero_prepare (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
@@ -154,6 +176,103 @@ nozero_can_fast_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
   return fastzeromode != NOFAST;
 }
 
+/* Always contains zeroes, but we can't use const or else gcc 9 will
+ * use .rodata instead of .bss and inflate the binary size.
+ */
+static /* const */ char buffer[MAX_WRITE];
+
+/* One multi-chunk emulated zero being written by several threads.
+ * Threads pull chunk numbers from next_chunk under the lock; the
+ * first error wins.
+ */
+struct zero_work {
+  struct nbdkit_next_ops *next_ops;
+  void *nxdata;
+  void *context;                /* request context of the caller */
+  uint64_t offs;
+  uint32_t count;
+  pthread_mutex_t lock;
+  uint32_t next_chunk;
+  uint32_t nr_chunks;
+  int ret;
+  int err;
+};
+
+static void *
+zero_worker (void *vp)
+{
+  struct zero_work *w = vp;
+
+  /* Lend the caller's request context to this thread so next_ops
+   * calls resolve to the right connection.
+   */
+  nbdkit_set_request_context (w->context);
+
+  for (;;) {
+    uint32_t chunk;
+    uint64_t chunkoffs;
+    uint32_t size;
+    int err = 0;
+
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&w->lock);
+      if (w->ret == -1 || w->next_chunk >= w->nr_chunks)
+        break;
+      chunk = w->next_chunk++;
+    }
+
+    chunkoffs = (uint64_t) chunk * MAX_WRITE;
+    size = MIN (w->count - chunkoffs, MAX_WRITE);
+    if (w->next_ops->pwrite (w->nxdata, buffer, size, w->offs + chunkoffs,
+                             0, &err) == -1) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&w->lock);
+      if (w->ret == 0) {
+        w->ret = -1;
+        w->err = err;
+      }
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/* Emulate a large zero by writing chunks of the zero buffer
+ * concurrently.  Only used when there is no FUA flag: with several
+ * writers there is no meaningful "last" write to attach FUA to.
+ */
+static int
+zero_parallel (struct nbdkit_next_ops *next_ops, void *nxdata,
+               uint32_t count, uint64_t offs, int *err)
+{
+  struct zero_work w = {
+    .next_ops = next_ops,
+    .nxdata = nxdata,
+    .context = nbdkit_get_request_context (),
+    .offs = offs,
+    .count = count,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .nr_chunks = (count + MAX_WRITE - 1) / MAX_WRITE,
+  };
+  pthread_t thread[NR_ZERO_THREADS];
+  size_t i, nr_threads = MIN (w.nr_chunks, NR_ZERO_THREADS);
+
+  for (i = 0; i < nr_threads - 1; ++i) {
+    int r = pthread_create (&thread[i], NULL, zero_worker, &w);
+    if (r != 0) {
+      nbdkit_debug ("nozero: pthread_create: %s", strerror (r));
+      break;                    /* fewer helpers, still correct */
+    }
+  }
+  zero_worker (&w);             /* this thread participates */
+  while (i > 0)
+    pthread_join (thread[--i], NULL);
+
+  if (w.ret == -1)
+    *err = w.err;
+  return w.ret;
+}
+
 static int
 nozero_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
              void *handle, uint32_t count, uint64_t offs, uint32_t flags,
@@ -187,11 +306,10 @@ nozero_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
       writeflags = NBDKIT_FLAG_FUA;
   }
 
+  if (parallel && !(flags & NBDKIT_FLAG_FUA) && count > MAX_WRITE)
+    return zero_parallel (next_ops, nxdata, count, offs, err);
+
   while (count) {
-    /* Always contains zeroes, but we can't use const or else gcc 9
-     * will use .rodata instead of .bss and inflate the binary size.
-     */
-    static /* const */ char buffer[MAX_WRITE];
     uint32_t size = MIN (count, MAX_WRITE);
 
     if (size == count && need_flush)
@@ -210,6 +328,7 @@ static struct nbdkit_filter filter = {
   .longname          = "nbdkit nozero filter",
   .config            = nozero_config,
   .config_help       = nozero_config_help,
+  .get_ready         = nozero_get_ready,
   .prepare           = nozero_prepare,
   .can_zero          = nozero_can_zero,
   .can_fast_zero     = nozero_can_fast_zero,
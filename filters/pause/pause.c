@@ -131,47 +131,69 @@ pause_config_complete (nbdkit_next_config_complete *next, void *nxdata)
 #define pause_config_help \
   "pause-control=SOCKET           Control socket."
 
-/* This is locked by the background thread when we're paused, causing
- * all requests in the main threads to hang.
+/* A single lock protects the pause state and the count of NBD
+ * requests in flight.  While paused, incoming requests park on
+ * unpaused_cond; resume is one broadcast, so all parked requests are
+ * released at once.  Pausing waits on drained_cond until the
+ * in-flight count reaches zero.
  */
-static pthread_mutex_t paused = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unpaused_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained_cond = PTHREAD_COND_INITIALIZER;
 static bool is_paused = false;
-
-/* This keeps track of the number of NBD requests in flight. */
-static pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t count_cond = PTHREAD_COND_INITIALIZER;
 static unsigned count_requests = 0;
 
 static void
-do_pause (void)
+do_pause (bool wait_for_drain)
 {
-  if (is_paused) return;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
 
-  /* Grabbing the paused lock is enough to stop request processing. */
-  pthread_mutex_lock (&paused);
   is_paused = true;
-
-  /* However we must also wait until all outstanding requests have
-   * been completed before we send the acknowledgement.
-   */
-  nbdkit_debug ("pause: pausing, waiting for requests to complete");
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&count_lock);
-  while (count_requests > 0)
-    pthread_cond_wait (&count_cond, &count_lock);
-  nbdkit_debug ("pause: paused");
+  if (wait_for_drain) {
+    /* Wait until all outstanding requests have been completed before
+     * we send the acknowledgement.
+     */
+    nbdkit_debug ("pause: pausing, waiting for requests to complete");
+    while (count_requests > 0)
+      pthread_cond_wait (&drained_cond, &lock);
+    nbdkit_debug ("pause: paused");
+  }
+  else
+    nbdkit_debug ("pause: pausing, %u requests still in flight",
+                  count_requests);
 }
 
 static void
 do_resume (void)
 {
-  if (!is_paused) return;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
 
   /* Release the worker threads. */
-  pthread_mutex_unlock (&paused);
   is_paused = false;
+  pthread_cond_broadcast (&unpaused_cond);
   nbdkit_debug ("pause: resumed");
 }
 
+/* Report the pause state and in-flight count, eg. "paused 3\n".
+ * Used by orchestration to poll for drain after an immediate pause.
+ */
+static void
+do_status (int s)
+{
+  char buf[64];
+  bool p;
+  unsigned n;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    p = is_paused;
+    n = count_requests;
+  }
+  snprintf (buf, sizeof buf, "%s %u\n", p ? "paused" : "running", n);
+  if (write (s, buf, strlen (buf)) == -1)
+    nbdkit_debug ("pause: write status: %m");
+}
+
 /* Background thread which monitors the control socket.  This can only
  * accept one connection at a time.
  */
@@ -195,11 +217,20 @@ control_socket_thread (void *arg)
     while ((n = read (s, &c, 1)) == 1) {
       switch (c) {
       case 'p':
-        do_pause ();
+        do_pause (true);
+        break;
+      case 'P':
+        /* Pause but acknowledge immediately; the caller polls with
+         * 's' to see when in-flight requests have drained.
+         */
+        do_pause (false);
         break;
       case 'r':
         do_resume ();
         break;
+      case 's':
+        do_status (s);
+        continue;
       case '\n':
       case '\t':
       case ' ':
@@ -248,11 +279,13 @@ pause_after_fork (nbdkit_next_after_fork *next, void *nxdata)
 static void
 begin_request (void)
 {
-  /* This will hang if we're paused. */
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&paused);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  /* Park here while we're paused. */
+  while (is_paused)
+    pthread_cond_wait (&unpaused_cond, &lock);
 
   /* Count the number of requests in flight. */
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&count_lock);
   count_requests++;
 }
 
@@ -260,9 +293,11 @@ begin_request (void)
 static void
 end_request (void)
 {
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&count_lock);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
   count_requests--;
-  pthread_cond_signal (&count_cond);
+  if (count_requests == 0)
+    pthread_cond_signal (&drained_cond);
 }
 
 /* Read data. */
@@ -68,24 +68,47 @@ static char *rate_file = NULL;
 
 /* Bucket capacity controls the burst rate.  It is expressed as the
  * length of time in "rate-equivalent seconds" that the client can
- * burst for after a period of inactivity.  This could be adjustable
- * in future.
+ * burst for after a period of inactivity, and can be changed with the
+ * burst and connection-burst parameters.
  */
 #define BUCKET_CAPACITY 2.0
+static double burst = BUCKET_CAPACITY;
+static double connection_burst = BUCKET_CAPACITY;
+
+/* Threads waiting for tokens from one bucket are served in strict
+ * FIFO order, so a stream of large requests cannot starve a small
+ * request: once at the head of the queue a request takes the tokens
+ * it needs and hands the head to the next waiter.  Without this a
+ * large request which finds the bucket empty would grab every token
+ * as it trickled in, and small requests behind it could be delayed
+ * arbitrarily.
+ */
+struct waitq {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint64_t head, tail;          /* tickets */
+};
+
+#define WAITQ_INITIALIZER \
+  { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 }
 
 /* Global read and write buckets. */
 static struct bucket read_bucket;
 static pthread_mutex_t read_bucket_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct waitq read_waitq = WAITQ_INITIALIZER;
 static struct bucket write_bucket;
 static pthread_mutex_t write_bucket_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct waitq write_waitq = WAITQ_INITIALIZER;
 
 /* Per-connection handle. */
 struct rate_handle {
   /* Per-connection read and write buckets. */
   struct bucket read_bucket;
   pthread_mutex_t read_bucket_lock;
+  struct waitq read_waitq;
   struct bucket write_bucket;
   pthread_mutex_t write_bucket_lock;
+  struct waitq write_waitq;
 };
 
 static void
@@ -128,6 +151,28 @@ rate_config (nbdkit_next_config *next, void *nxdata,
     }
     return 0;
   }
+  else if (strcmp (key, "burst") == 0) {
+    double d;
+    int n;
+
+    if (sscanf (value, "%lg%n", &d, &n) != 1 || value[n] != '\0' || d <= 0) {
+      nbdkit_error ("invalid burst parameter: %s", value);
+      return -1;
+    }
+    burst = d;
+    return 0;
+  }
+  else if (strcmp (key, "connection-burst") == 0) {
+    double d;
+    int n;
+
+    if (sscanf (value, "%lg%n", &d, &n) != 1 || value[n] != '\0' || d <= 0) {
+      nbdkit_error ("invalid connection-burst parameter: %s", value);
+      return -1;
+    }
+    connection_burst = d;
+    return 0;
+  }
   else if (strcmp (key, "rate-file") == 0) {
     free (rate_file);
     rate_file = nbdkit_absolute_path (value);
@@ -150,8 +195,8 @@ static int
 rate_get_ready (nbdkit_next_get_ready *next, void *nxdata, int thread_model)
 {
   /* Initialize the global buckets. */
-  bucket_init (&read_bucket, rate, BUCKET_CAPACITY);
-  bucket_init (&write_bucket, rate, BUCKET_CAPACITY);
+  bucket_init (&read_bucket, rate, burst);
+  bucket_init (&write_bucket, rate, burst);
 
   return next (nxdata);
 }
@@ -160,7 +205,9 @@ rate_get_ready (nbdkit_next_get_ready *next, void *nxdata, int thread_model)
   "rate=BITSPERSEC                Limit total bandwidth.\n" \
   "connection-rate=BITSPERSEC     Limit per-connection bandwidth.\n" \
   "rate-file=FILENAME             Dynamically adjust total bandwidth.\n" \
-  "connection-rate-file=FILENAME  Dynamically adjust per-connection bandwidth."
+  "connection-rate-file=FILENAME  Dynamically adjust per-connection bandwidth.\n" \
+  "burst=SECS                     Total burst length (default 2.0).\n" \
+  "connection-burst=SECS          Per-connection burst length (default 2.0)."
 
 /* Create the per-connection handle. */
 static void *
@@ -178,10 +225,16 @@ rate_open (nbdkit_next_open *next, void *nxdata,
     return NULL;
   }
 
-  bucket_init (&h->read_bucket, connection_rate, BUCKET_CAPACITY);
-  bucket_init (&h->write_bucket, connection_rate, BUCKET_CAPACITY);
+  bucket_init (&h->read_bucket, connection_rate, connection_burst);
+  bucket_init (&h->write_bucket, connection_rate, connection_burst);
   pthread_mutex_init (&h->read_bucket_lock, NULL);
   pthread_mutex_init (&h->write_bucket_lock, NULL);
+  pthread_mutex_init (&h->read_waitq.lock, NULL);
+  pthread_cond_init (&h->read_waitq.cond, NULL);
+  h->read_waitq.head = h->read_waitq.tail = 0;
+  pthread_mutex_init (&h->write_waitq.lock, NULL);
+  pthread_cond_init (&h->write_waitq.cond, NULL);
+  h->write_waitq.head = h->write_waitq.tail = 0;
 
   return h;
 }
@@ -194,6 +247,10 @@ rate_close (void *handle)
 
   pthread_mutex_destroy (&h->read_bucket_lock);
   pthread_mutex_destroy (&h->write_bucket_lock);
+  pthread_mutex_destroy (&h->read_waitq.lock);
+  pthread_cond_destroy (&h->read_waitq.cond);
+  pthread_mutex_destroy (&h->write_waitq.lock);
+  pthread_cond_destroy (&h->write_waitq.cond);
   free (h);
 }
 
@@ -246,11 +303,13 @@ maybe_adjust (const char *file, struct bucket *bucket, pthread_mutex_t *lock)
 }
 
 static inline int
-maybe_sleep (struct bucket *bucket, pthread_mutex_t *lock, uint32_t count,
-             int *err)
+maybe_sleep (struct bucket *bucket, pthread_mutex_t *lock, struct waitq *wq,
+             uint32_t count, int *err)
 {
   struct timespec ts;
   uint64_t bits;
+  uint64_t ticket;
+  int r = 0;
 
   /* Count is in bytes, but we rate limit using bits.  We could
    * multiply this by 10 to include start/stop but let's not
@@ -258,6 +317,16 @@ maybe_sleep (struct bucket *bucket, pthread_mutex_t *lock, uint32_t count,
    */
   bits = count * UINT64_C(8);
 
+  /* Wait for our turn at the bucket (see the comment above struct
+   * waitq).  When the bucket has spare tokens the queue is empty and
+   * this costs one uncontended lock/unlock.
+   */
+  pthread_mutex_lock (&wq->lock);
+  ticket = wq->tail++;
+  while (ticket != wq->head)
+    pthread_cond_wait (&wq->cond, &wq->lock);
+  pthread_mutex_unlock (&wq->lock);
+
   while (bits > 0) {
     /* Run the token bucket algorithm. */
     {
@@ -267,10 +336,18 @@ maybe_sleep (struct bucket *bucket, pthread_mutex_t *lock, uint32_t count,
 
     if (bits > 0 && nbdkit_nanosleep (ts.tv_sec, ts.tv_nsec) == -1) {
       *err = errno;
-      return -1;
+      r = -1;
+      break;
     }
   }
-  return 0;
+
+  /* Hand the head of the queue to the next waiter. */
+  pthread_mutex_lock (&wq->lock);
+  wq->head++;
+  pthread_cond_broadcast (&wq->cond);
+  pthread_mutex_unlock (&wq->lock);
+
+  return r;
 }
 
 /* Read data. */
@@ -282,10 +359,11 @@ rate_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct rate_handle *h = handle;
 
   maybe_adjust (rate_file, &read_bucket, &read_bucket_lock);
-  if (maybe_sleep (&read_bucket, &read_bucket_lock, count, err))
+  if (maybe_sleep (&read_bucket, &read_bucket_lock, &read_waitq, count, err))
     return -1;
   maybe_adjust (connection_rate_file, &h->read_bucket, &h->read_bucket_lock);
-  if (maybe_sleep (&h->read_bucket, &h->read_bucket_lock, count, err))
+  if (maybe_sleep (&h->read_bucket, &h->read_bucket_lock, &h->read_waitq,
+                   count, err))
     return -1;
 
   return next_ops->pread (nxdata, buf, count, offset, flags, err);
@@ -301,10 +379,12 @@ rate_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
   struct rate_handle *h = handle;
 
   maybe_adjust (rate_file, &write_bucket, &write_bucket_lock);
-  if (maybe_sleep (&write_bucket, &write_bucket_lock, count, err))
+  if (maybe_sleep (&write_bucket, &write_bucket_lock, &write_waitq,
+                   count, err))
     return -1;
   maybe_adjust (connection_rate_file, &h->write_bucket, &h->write_bucket_lock);
-  if (maybe_sleep (&h->write_bucket, &h->write_bucket_lock, count, err))
+  if (maybe_sleep (&h->write_bucket, &h->write_bucket_lock, &h->write_waitq,
+                   count, err))
     return -1;
 
   return next_ops->pwrite (nxdata, buf, count, offset, flags, err);
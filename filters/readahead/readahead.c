@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 
@@ -58,22 +59,82 @@ static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 /* The real size of the underlying plugin. */
 static uint64_t size;
 
-/* Size of the readahead window. */
-static uint64_t window = READAHEAD_MIN;
+/* Per-connection stream tracking, modelled on kernel readahead: a
+ * connection only gets a readahead window once it has issued
+ * contiguous sequential reads, the window then grows geometrically,
+ * and any non-sequential read shuts readahead off again.  Mixed
+ * clients therefore neither starve a sequential stream nor inflate
+ * random reads.  The fields are protected by the global lock.
+ */
+struct readahead_handle {
+  uint64_t window;      /* current readahead window, 0 = disabled */
+  uint64_t last_offset; /* end of this connection's previous read */
+  unsigned seq_hits;    /* consecutive sequential reads (saturating) */
+};
+
+/* A small cache of readahead windows shared by all threads.  Each
+ * window buffer grows dynamically as required, but never shrinks.
+ *
+ * Several windows let interleaved sequential streams coexist without
+ * evicting each other, and the global lock is dropped while a window
+ * is filled from the plugin, so reads served from other windows do
+ * not stall behind plugin latency.  A client which keeps several
+ * requests in flight therefore overlaps its own consumption with the
+ * next fill.
+ */
+#define NR_WINDOWS 4
+
+struct window {
+  char *buffer;
+  size_t bufsize;
+  uint64_t position;    /* virtual disk offset of the window */
+  uint32_t length;      /* valid bytes, or expected bytes while filling */
+  bool filling;         /* a thread is reading this window from the plugin */
+  uint64_t last_used;   /* for LRU eviction */
+};
+
+static struct window windows[NR_WINDOWS];
+static uint64_t use_counter;
+
+/* Signalled whenever a window finishes filling. */
+static pthread_cond_t fill_done = PTHREAD_COND_INITIALIZER;
 
-/* The single prefetch buffer shared by all threads, and its virtual
- * location in the virtual disk.  The prefetch buffer grows
- * dynamically as required, but never shrinks.
+/* Bumped by writes and write-like operations so that fills which
+ * started before the write discard their stale data when they
+ * complete.
  */
-static char *buffer = NULL;
-static size_t bufsize = 0;
-static uint64_t position;
-static uint32_t length = 0;
+static uint64_t generation;
 
 static void
 readahead_unload (void)
 {
-  free (buffer);
+  size_t i;
+
+  for (i = 0; i < NR_WINDOWS; ++i)
+    free (windows[i].buffer);
+}
+
+static void *
+readahead_open (nbdkit_next_open *next, void *nxdata,
+                int readonly, const char *exportname, int is_tls)
+{
+  struct readahead_handle *h;
+
+  if (next (nxdata, readonly, exportname) == -1)
+    return NULL;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  return h;
+}
+
+static void
+readahead_close (void *handle)
+{
+  free (handle);
 }
 
 static int64_t readahead_get_size (struct nbdkit_next_ops *next_ops,
@@ -122,81 +183,144 @@ readahead_can_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 /* Read data. */
 
 static int
-fill_readahead (struct nbdkit_next_ops *next_ops, void *nxdata,
-                uint32_t count, uint64_t offset, uint32_t flags, int *err)
+readahead_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+                 void *handle, void *buf, uint32_t count, uint64_t offset,
+                 uint32_t flags, int *err)
 {
-  position = offset;
+  struct readahead_handle *h = handle;
 
-  /* Read at least window bytes, but if count is larger read that.
-   * Note that the count cannot be bigger than the buffer size.
-   */
-  length = MAX (count, window);
+  pthread_mutex_lock (&lock);
 
-  /* Don't go beyond the end of the underlying file. */
-  length = MIN (length, size - position);
-
-  /* Grow the buffer if necessary. */
-  if (bufsize < length) {
-    char *new_buffer = realloc (buffer, length);
-    if (new_buffer == NULL) {
-      *err = errno;
-      nbdkit_error ("realloc: %m");
-      return -1;
-    }
-    buffer = new_buffer;
-    bufsize = length;
+  /* Sequentiality detection.  Readahead switches on only after the
+   * second consecutive read continuing exactly where the previous one
+   * ended, then grows geometrically; any other access pattern turns
+   * it off for this connection.
+   */
+  if (count > 0 && offset == h->last_offset) {
+    if (h->seq_hits < 2)
+      h->seq_hits++;
+    if (h->seq_hits >= 2)
+      h->window = h->window == 0 ? READAHEAD_MIN
+        : MIN (h->window * 2, READAHEAD_MAX);
   }
-
-  if (next_ops->pread (nxdata, buffer, length, offset, flags, err) == -1) {
-    length = 0;           /* failed to fill the prefetch buffer */
-    return -1;
+  else {
+    h->seq_hits = 0;
+    h->window = 0;
   }
-
-  return 0;
-}
-
-static int
-readahead_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
-                 void *handle, void *buf, uint32_t count, uint64_t offset,
-                 uint32_t flags, int *err)
-{
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  h->last_offset = offset + count;
 
   while (count > 0) {
-    if (length == 0) {
-      /* We don't have a prefetch buffer at all.  This could be the
-       * first request or reset after a miss.
-       */
-      window = READAHEAD_MIN;
-      if (fill_readahead (next_ops, nxdata, count, offset, flags, err) == -1)
-        return -1;
+    struct window *w = NULL;
+    bool wait_for_fill = false;
+    uint64_t gen;
+    uint32_t n;
+    size_t i;
+    int r;
+
+    /* Can we satisfy this request partly or entirely from a window? */
+    for (i = 0; i < NR_WINDOWS; ++i) {
+      struct window *t = &windows[i];
+
+      if (t->length > 0 &&
+          t->position <= offset && offset < t->position + t->length) {
+        if (t->filling)
+          wait_for_fill = true;
+        else {
+          w = t;
+          break;
+        }
+      }
     }
 
-    /* Can we satisfy this request partly or entirely from the prefetch
-     * buffer?
-     */
-    else if (position <= offset && offset < position + length) {
-      uint32_t n = MIN (position - offset + length, count);
-      memcpy (buf, &buffer[offset-position], n);
+    if (w) {
+      n = MIN (w->position - offset + w->length, count);
+      memcpy (buf, &w->buffer[offset - w->position], n);
+      w->last_used = ++use_counter;
       buf += n;
       offset += n;
       count -= n;
+      continue;
+    }
+
+    /* Another thread is filling a window which will cover this
+     * offset.  Wait for it rather than reading the same data from the
+     * plugin again.
+     */
+    if (wait_for_fill) {
+      pthread_cond_wait (&fill_done, &lock);
+      continue;
     }
 
-    /* Does the request start immediately after the prefetch buffer?
-     * This is a “hit” allowing us to double the window size.
+    /* Fill the least recently used window. */
+    for (i = 0; i < NR_WINDOWS; ++i) {
+      if (windows[i].filling)
+        continue;
+      if (w == NULL || windows[i].last_used < w->last_used)
+        w = &windows[i];
+    }
+
+    if (w == NULL) {
+      /* Every window is being filled by other threads (unlikely).
+       * Just read through to the plugin.
+       */
+      pthread_mutex_unlock (&lock);
+      return next_ops->pread (nxdata, buf, count, offset, flags, err);
+    }
+
+    w->position = offset;
+
+    /* Read at least the connection's readahead window, but if count
+     * is larger read that.  Don't go beyond the end of the underlying
+     * file.  For random access (window == 0) this reads exactly what
+     * the client asked for.
      */
-    else if (offset == position + length) {
-      window = MIN (window * 2, READAHEAD_MAX);
-      if (fill_readahead (next_ops, nxdata, count, offset, flags, err) == -1)
+    w->length = MAX (count, h->window);
+    w->length = MIN (w->length, size - offset);
+
+    /* Grow the buffer if necessary. */
+    if (w->bufsize < w->length) {
+      char *new_buffer = realloc (w->buffer, w->length);
+      if (new_buffer == NULL) {
+        *err = errno;
+        w->length = 0;
+        pthread_mutex_unlock (&lock);
+        nbdkit_error ("realloc: %m");
         return -1;
+      }
+      w->buffer = new_buffer;
+      w->bufsize = w->length;
     }
 
-    /* Else it's a “miss”.  Reset everything and start again. */
-    else
-      length = 0;
+    /* Drop the lock during the plugin read so other threads continue
+     * to be served from the remaining windows.  The filling flag
+     * keeps this window private until the read completes.
+     */
+    w->filling = true;
+    w->last_used = ++use_counter;
+    gen = generation;
+    {
+      uint64_t position = w->position;
+      uint32_t length = w->length;
+
+      pthread_mutex_unlock (&lock);
+      r = next_ops->pread (nxdata, w->buffer, length, position, flags, err);
+      pthread_mutex_lock (&lock);
+    }
+    w->filling = false;
+    if (r == -1 || gen != generation)
+      w->length = 0;  /* failed, or invalidated by a write meanwhile */
+    pthread_cond_broadcast (&fill_done);
+    if (r == -1) {
+      pthread_mutex_unlock (&lock);
+      return -1;
+    }
+
+    /* Loop again: normally the next iteration copies from the window
+     * we just filled, but if it was invalidated we simply refill.
+     */
   }
 
+  pthread_mutex_unlock (&lock);
   return 0;
 }
 
@@ -207,11 +331,21 @@ readahead_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
  */
 
 static void
-kill_readahead (void)
+kill_readahead (struct readahead_handle *h)
 {
+  size_t i;
+
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  window = READAHEAD_MIN;
-  length = 0;
+  h->seq_hits = 0;
+  h->window = 0;
+  generation++;
+  for (i = 0; i < NR_WINDOWS; ++i) {
+    /* Windows still being filled discard themselves when they see the
+     * generation change.
+     */
+    if (!windows[i].filling)
+      windows[i].length = 0;
+  }
 }
 
 static int
@@ -220,7 +354,7 @@ readahead_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
                   const void *buf, uint32_t count, uint64_t offset,
                   uint32_t flags, int *err)
 {
-  kill_readahead ();
+  kill_readahead (handle);
   return next_ops->pwrite (nxdata, buf, count, offset, flags, err);
 }
 
@@ -230,7 +364,7 @@ readahead_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
                 uint32_t count, uint64_t offset, uint32_t flags,
                 int *err)
 {
-  kill_readahead ();
+  kill_readahead (handle);
   return next_ops->trim (nxdata, count, offset, flags, err);
 }
 
@@ -240,7 +374,7 @@ readahead_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
                 uint32_t count, uint64_t offset, uint32_t flags,
                 int *err)
 {
-  kill_readahead ();
+  kill_readahead (handle);
   return next_ops->zero (nxdata, count, offset, flags, err);
 }
 
@@ -248,7 +382,7 @@ static int
 readahead_flush (struct nbdkit_next_ops *next_ops, void *nxdata,
                  void *handle, uint32_t flags, int *err)
 {
-  kill_readahead ();
+  kill_readahead (handle);
   return next_ops->flush (nxdata, flags, err);
 }
 
@@ -256,6 +390,8 @@ static struct nbdkit_filter filter = {
   .name              = "readahead",
   .longname          = "nbdkit readahead filter",
   .unload            = readahead_unload,
+  .open              = readahead_open,
+  .close             = readahead_close,
   .prepare           = readahead_prepare,
   .get_size          = readahead_get_size,
   .can_cache         = readahead_can_cache,
@@ -38,18 +38,33 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
+#include "random.h"
 #include "windows-compat.h"
 
 static unsigned retries = 5;    /* 0 = filter is disabled */
 static unsigned initial_delay = 2;
 static bool exponential_backoff = true;
+static bool retry_jitter = true;
 static bool force_readonly = false;
 
+/* Random state used to jitter the retry delay. */
+static struct random_state random_state;
+
+/* Counters for retry_metrics, updated from any connection thread. */
+static _Atomic uint64_t total_retries, total_reopens, total_exhausted;
+
+static void
+retry_load (void)
+{
+  xsrandom (time (NULL), &random_state);
+}
+
 /* Currently next_ops->reopen is not safe if another thread makes a
  * request on the same connection (but on other connections it's OK).
  * To work around this for now we limit the thread model here, but
@@ -88,6 +103,13 @@ retry_config (nbdkit_next_config *next, void *nxdata,
     exponential_backoff = r;
     return 0;
   }
+  else if (strcmp (key, "retry-jitter") == 0) {
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    retry_jitter = r;
+    return 0;
+  }
   else if (strcmp (key, "retry-readonly") == 0) {
     r = nbdkit_parse_bool (value);
     if (r == -1)
@@ -103,6 +125,7 @@ retry_config (nbdkit_next_config *next, void *nxdata,
   "retries=<N>              Number of retries (default: 5).\n" \
   "retry-delay=<N>          Seconds to wait before retry (default: 2).\n" \
   "retry-exponential=yes|no Exponential back-off (default: yes).\n" \
+  "retry-jitter=yes|no      Randomize delays (default: yes).\n" \
   "retry-readonly=yes|no    Force read-only on failure (default: no).\n"
 
 struct retry_handle {
@@ -176,6 +199,8 @@ do_retry (struct retry_handle *h,
           struct nbdkit_next_ops *next_ops, void *nxdata,
           const char *method, int *err)
 {
+  uint64_t delay_ns;
+
   /* If it's the first retry, initialize the other fields in *data. */
   if (data->retry == 0)
     data->delay = initial_delay;
@@ -183,15 +208,29 @@ do_retry (struct retry_handle *h,
  again:
   if (data->retry >= retries) {
     nbdkit_debug ("could not recover after %d retries", retries);
+    total_exhausted++;
     return false;
   }
 
   /* Since we will retry, log the original errno otherwise it will be lost. */
   nbdkit_debug ("%s failed: original errno = %d", method, *err);
 
-  nbdkit_debug ("retry %d: waiting %d seconds before retrying",
-                data->retry+1, data->delay);
-  if (nbdkit_nanosleep (data->delay, 0) == -1) {
+  /* Ideally we would hand the command back to the server here and
+   * requeue it on a timer, but the backend API is synchronous so the
+   * delay has to happen on this connection's worker thread.  What we
+   * can avoid is connections retrying in lockstep: after a shared
+   * failure (eg. a SAN failover) synchronized retries all hit the
+   * recovering backend at the same instant, which can prolong the
+   * outage.  So by default sleep for a uniformly distributed random
+   * time in [delay/2, delay] instead of exactly delay seconds.
+   */
+  delay_ns = (uint64_t) data->delay * 1000000000;
+  if (retry_jitter)
+    delay_ns = delay_ns/2 + xrandom (&random_state) % (delay_ns/2 + 1);
+  nbdkit_debug ("retry %d: waiting %.1f seconds before retrying",
+                data->retry+1, delay_ns / 1e9);
+  if (nbdkit_nanosleep (delay_ns / 1000000000,
+                        delay_ns % 1000000000) == -1) {
     /* We could do this but it would overwrite the more important
      * errno from the underlying data call.
      */
@@ -202,11 +241,13 @@ do_retry (struct retry_handle *h,
 
   /* Update *data in case we are called again. */
   data->retry++;
+  total_retries++;
   if (exponential_backoff)
     data->delay *= 2;
 
   /* Reopen the connection. */
   h->reopens++;
+  total_reopens++;
   if (next_ops->reopen (nxdata,
                         h->readonly || force_readonly, h->exportname) == -1) {
     /* If the reopen fails we treat it the same way as a command
@@ -451,10 +492,36 @@ retry_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
   return r;
 }
 
+static char *
+retry_metrics (void)
+{
+  char *s;
+
+  if (asprintf (&s,
+                "# HELP nbdkit_retry_retries_total "
+                "Commands retried after a failure.\n"
+                "# TYPE nbdkit_retry_retries_total counter\n"
+                "nbdkit_retry_retries_total %" PRIu64 "\n"
+                "# HELP nbdkit_retry_reopens_total "
+                "Plugin connections reopened before retrying.\n"
+                "# TYPE nbdkit_retry_reopens_total counter\n"
+                "nbdkit_retry_reopens_total %" PRIu64 "\n"
+                "# HELP nbdkit_retry_exhausted_total "
+                "Commands which failed even after all retries.\n"
+                "# TYPE nbdkit_retry_exhausted_total counter\n"
+                "nbdkit_retry_exhausted_total %" PRIu64 "\n",
+                (uint64_t) total_retries,
+                (uint64_t) total_reopens,
+                (uint64_t) total_exhausted) == -1)
+    return NULL;
+  return s;
+}
+
 static struct nbdkit_filter filter = {
   .name              = "retry",
   .longname          = "nbdkit retry filter",
   .thread_model      = retry_thread_model,
+  .load              = retry_load,
   .config            = retry_config,
   .config_help       = retry_config_help,
   .open              = retry_open,
@@ -466,6 +533,7 @@ static struct nbdkit_filter filter = {
   .zero              = retry_zero,
   .extents           = retry_extents,
   .cache             = retry_cache,
+  .metrics           = retry_metrics,
 };
 
 NBDKIT_REGISTER_FILTER(filter)
@@ -38,12 +38,23 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include <pthread.h>
 
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#else
+/* Some old platforms lack atomic types, but plain updates are usually
+ * "atomic enough" for statistics.
+ */
+#define _Atomic /**/
+#endif
+
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
@@ -55,14 +66,29 @@ static bool append;
 static FILE *fp;
 static struct timeval start_t;
 
+/* Histograms are log2-bucketed: bucket i counts values in the range
+ * [2^(i-1), 2^i), with bucket 0 counting zeroes.  64 buckets cover
+ * the whole uint64_t range.
+ */
+#define NR_BUCKETS 64
+
+/* The counters are atomic so the request path never takes a lock,
+ * which matters for parallel plugins.  Readers may see the fields of
+ * one entry slightly out of sync with each other; for statistics that
+ * does not matter.
+ */
 typedef struct {
   const char *name;
-  uint64_t ops;
-  uint64_t bytes;
-  uint64_t usecs;
+  _Atomic uint64_t ops;
+  _Atomic uint64_t bytes;
+  _Atomic uint64_t usecs;
+  _Atomic uint64_t latency[NR_BUCKETS];  /* histogram of op time (usecs) */
+  _Atomic uint64_t sizes[NR_BUCKETS];    /* histogram of request sizes */
 } nbdstat;
 
-/* This lock protects all the stats. */
+/* This lock serializes writers to the stats file (the final print on
+ * unload and any on-demand dumps), not the counters.
+ */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static nbdstat pread_st   = { "read" };
 static nbdstat pwrite_st  = { "write" };
@@ -108,6 +134,51 @@ maybe (char *s)
   return s ? s : "(n/a)";
 }
 
+static inline unsigned
+bucket_of (uint64_t val)
+{
+  unsigned b;
+
+  if (val == 0)
+    return 0;
+  b = 64 - __builtin_clzll (val);
+  return b >= NR_BUCKETS ? NR_BUCKETS-1 : b;
+}
+
+/* Upper bound of the bucket containing the requested percentile, ie.
+ * “pct % of operations were < this”.
+ */
+static uint64_t
+histogram_percentile (const _Atomic uint64_t *buckets, uint64_t total,
+                      unsigned pct)
+{
+  uint64_t target = (total * pct + 99) / 100;
+  uint64_t cum = 0;
+  unsigned i;
+
+  for (i = 0; i < NR_BUCKETS-1; ++i) {
+    cum += buckets[i];
+    if (cum >= target)
+      break;
+  }
+  return UINT64_C(1) << i;
+}
+
+static void
+print_histogram (const char *name, const char *unit,
+                 const _Atomic uint64_t *buckets)
+{
+  unsigned i;
+
+  fprintf (fp, "    %s:", name);
+  for (i = 0; i < NR_BUCKETS; ++i) {
+    if (buckets[i] > 0)
+      fprintf (fp, " <%" PRIu64 "%s:%" PRIu64,
+               UINT64_C(1) << i, unit, (uint64_t) buckets[i]);
+  }
+  fprintf (fp, "\n");
+}
+
 static void
 print_stat (const nbdstat *st, int64_t usecs)
 {
@@ -117,8 +188,17 @@ print_stat (const nbdstat *st, int64_t usecs)
     char *total_rate = humanrate (st->bytes, usecs);
 
     fprintf (fp, "%s: %" PRIu64 " ops, %.6f s, %s, %s/s op, %s/s total\n",
-             st->name, st->ops, st->usecs / 1000000.0, maybe (size),
-             maybe (op_rate), maybe (total_rate));
+             st->name, (uint64_t) st->ops, st->usecs / 1000000.0,
+             maybe (size), maybe (op_rate), maybe (total_rate));
+
+    fprintf (fp, "    latency: p50 <%" PRIu64 " us, p90 <%" PRIu64 " us, "
+             "p99 <%" PRIu64 " us\n",
+             histogram_percentile (st->latency, st->ops, 50),
+             histogram_percentile (st->latency, st->ops, 90),
+             histogram_percentile (st->latency, st->ops, 99));
+    print_histogram ("latency histogram", "us", st->latency);
+    if (st->bytes > 0)
+      print_histogram ("request sizes", "", st->sizes);
 
     free (size);
     free (op_rate);
@@ -165,16 +245,52 @@ stats_unload (void)
 
   gettimeofday (&now, NULL);
   usecs = tvdiff_usec (&start_t, &now);
-  if (fp && usecs > 0) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (fp && usecs > 0)
     print_stats (usecs);
-  }
 
-  if (fp)
+  if (fp) {
     fclose (fp);
+    fp = NULL;
+  }
   free (filename);
 }
 
+#ifdef SIGUSR2
+/* Dump the statistics collected so far whenever the server receives
+ * SIGUSR2.  The signal is blocked in every thread and consumed by
+ * this dedicated thread with sigwait, since stdio cannot safely be
+ * used from a signal handler.
+ */
+static void *
+stats_thread (void *arg)
+{
+  sigset_t set;
+  int sig;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR2);
+
+  for (;;) {
+    struct timeval now;
+    int64_t usecs;
+
+    if (sigwait (&set, &sig) != 0)
+      break;
+
+    gettimeofday (&now, NULL);
+    usecs = tvdiff_usec (&start_t, &now);
+
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    if (fp && usecs > 0)
+      print_stats (usecs);
+  }
+
+  return NULL;
+}
+#endif
+
 static int
 stats_config (nbdkit_next_config *next, void *nxdata,
               const char *key, const char *value)
@@ -236,6 +352,33 @@ stats_get_ready (nbdkit_next_get_ready *next, void *nxdata, int thread_model)
 
   gettimeofday (&start_t, NULL);
 
+#ifdef SIGUSR2
+  /* Block SIGUSR2 in this thread.  All threads created later inherit
+   * the mask, so the signal is only ever delivered to the dump thread
+   * which collects it with sigwait.
+   */
+  {
+    sigset_t set;
+    pthread_attr_t attrs;
+    pthread_t thread;
+    int r;
+
+    sigemptyset (&set);
+    sigaddset (&set, SIGUSR2);
+    pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+    pthread_attr_init (&attrs);
+    pthread_attr_setdetachstate (&attrs, PTHREAD_CREATE_DETACHED);
+    r = pthread_create (&thread, &attrs, stats_thread, NULL);
+    pthread_attr_destroy (&attrs);
+    if (r != 0) {
+      errno = r;
+      nbdkit_error ("pthread_create: %m");
+      return -1;
+    }
+  }
+#endif
+
   return next (nxdata);
 }
 
@@ -252,10 +395,12 @@ record_stat (nbdstat *st, uint32_t count, const struct timeval *start)
   gettimeofday (&end, NULL);
   usecs = tvdiff_usec (start, &end);
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   st->ops++;
   st->bytes += count;
   st->usecs += usecs;
+  st->latency[bucket_of (usecs)]++;
+  if (count > 0)
+    st->sizes[bucket_of (count)]++;
 }
 
 /* Read. */
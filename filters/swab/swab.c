@@ -99,34 +99,25 @@ is_aligned (uint32_t count, uint64_t offset, int *err)
   return true;
 }
 
-/* Byte swap, works either from one buffer to another or in-place. */
+/* Byte swap, works either from one buffer to another or in-place.
+ * The SIMD kernels live in common/include/byte-swapping.h.
+ */
 static void
 buf_bswap (void *dest, const void *src, uint32_t count)
 {
-  uint32_t i;
-  uint16_t *d16, *s16;
-  uint32_t *d32, *s32;
-  uint64_t *d64, *s64;
-
   switch (bits) {
-  case 8: /* nothing */ break;
+  case 8:
+    if (dest != src)
+      memcpy (dest, src, count);
+    break;
   case 16:
-    d16 = (uint16_t *) dest;
-    s16 = (uint16_t *) src;
-    for (i = 0; i < count; i += 2)
-      *d16++ = bswap_16 (*s16++);
+    bswap_16_buf (dest, src, count);
     break;
   case 32:
-    d32 = (uint32_t *) dest;
-    s32 = (uint32_t *) src;
-    for (i = 0; i < count; i += 4)
-      *d32++ = bswap_32 (*s32++);
+    bswap_32_buf (dest, src, count);
     break;
   case 64:
-    d64 = (uint64_t *) dest;
-    s64 = (uint64_t *) src;
-    for (i = 0; i < count; i += 8)
-      *d64++ = bswap_64 (*s64++);
+    bswap_64_buf (dest, src, count);
     break;
   }
 }
@@ -40,29 +40,45 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <errno.h>
 #include <sys/types.h>
-#include <sys/stat.h>
 
 #include <pthread.h>
 
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
-#include "poll.h"
+#include "iszero.h"
 #include "minmax.h"
-#include "utils.h"
+#include "rounding.h"
 
 static const char *entry;       /* File within tar (tar-entry=...) */
-static const char *tar_program = "tar";
 
-/* Offset and size within tarball.
+/* The index of entries in the tarball.
  *
- * These are calculated once in the first connection that calls
- * tar_prepare.  They are protected by the lock.
+ * It is built by the first connection that calls tar_prepare, using
+ * range reads of the tar headers only, and shared by all later
+ * connections.  It is protected by the lock.
  */
+struct tar_entry {
+  char *name;                   /* Path within the tarball. */
+  uint64_t offset, size;        /* Byte range of the content. */
+};
+
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static bool initialized = false;
-static uint64_t tar_offset, tar_size;
+static struct tar_entry *entries;
+static size_t nr_entries;
+
+static void
+tar_unload (void)
+{
+  size_t i;
+
+  for (i = 0; i < nr_entries; ++i)
+    free (entries[i].name);
+  free (entries);
+}
 
 static int
 tar_config (nbdkit_next_config *next, void *nxdata,
@@ -77,26 +93,20 @@ tar_config (nbdkit_next_config *next, void *nxdata,
     return 0;
   }
   else if (strcmp (key, "tar") == 0) {
-    tar_program = value;
+    /* We used to shell out to an external tar program, selected with
+     * this parameter.  The archive is now parsed natively, but accept
+     * and ignore the parameter so existing command lines keep working.
+     */
+    nbdkit_debug ("tar: ignoring obsolete tar=%s parameter", value);
     return 0;
   }
 
   return next (nxdata, key, value);
 }
 
-static int
-tar_config_complete (nbdkit_next_config_complete *next, void *nxdata)
-{
-  if (entry == NULL) {
-    nbdkit_error ("you must supply the tar-entry=<FILENAME> parameter");
-    return -1;
-  }
-
-  return next (nxdata);
-}
-
 #define tar_config_help \
-  "tar-entry=<FILENAME> (required) The path inside the tar file to serve."
+  "tar-entry=<FILENAME> (optional) The path inside the tar file to serve.\n" \
+  "                     If omitted, the client export name selects the path."
 
 static int
 tar_thread_model (void)
@@ -105,9 +115,15 @@ tar_thread_model (void)
 }
 
 struct handle {
-  /* These are copied from the globals during tar_prepare, so that we
+  /* Client export name, used to select the entry when the tar-entry
+   * parameter is not given.
+   */
+  const char *exportname;
+
+  /* These are copied from the index during tar_prepare, so that we
    * don't have to keep grabbing the lock on each request.
    */
+  const char *name;
   uint64_t offset, size;
 };
 
@@ -117,14 +133,29 @@ tar_open (nbdkit_next_open *next, nbdkit_backend *nxdata,
 {
   struct handle *h;
 
-  if (next (nxdata, readonly, exportname) == -1)
-    return NULL;
-
   h = calloc (1, sizeof *h);
   if (h == NULL) {
     nbdkit_error ("calloc: %m");
     return NULL;
   }
+
+  h->exportname = nbdkit_strdup_intern (exportname);
+  if (h->exportname == NULL) {
+    free (h);
+    return NULL;
+  }
+
+  /* If we are using export names to select the entry, don't leak the
+   * client export name to the underlying plugin.
+   */
+  if (!entry)
+    exportname = "";
+
+  if (next (nxdata, readonly, exportname) == -1) {
+    free (h);
+    return NULL;
+  }
+
   return h;
 }
 
@@ -134,178 +165,363 @@ tar_close (void *handle)
   free (handle);
 }
 
-/* Calculate the offset of the entry within the tarball.  This is
- * called with the lock held.  The method used is described here:
- * https://www.redhat.com/archives/libguestfs/2020-July/msg00017.html
+/* A tar header block.  Numeric fields are octal ASCII, except that
+ * GNU tar stores sizes >= 8GB in big-endian base-256 with the top bit
+ * of the first byte set.  See tar(5).
  */
-static int
-calculate_offset_of_entry (struct nbdkit_next_ops *next_ops, void *nxdata)
+struct tar_header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char padding[12];
+};
+
+static uint64_t
+parse_size_field (const char *field, size_t len)
 {
-  const size_t bufsize = 65536;
-  char output[] = "/tmp/tarXXXXXX";
-  int fd;
-  FILE *fp;
-  CLEANUP_FREE char *cmd = NULL;
-  size_t cmdlen = 0;
-  CLEANUP_FREE char *buf = NULL;
-  int64_t i, copysize;
-  bool scanned_ok = false;
-
-  assert (entry);
-
-  /* Temporary file to capture the output from the tar command. */
-  fd = mkstemp (output);
-  if (fd == -1) {
-    nbdkit_error ("mkstemp: %m");
-    return -1;
+  uint64_t r = 0;
+  size_t i;
+
+  if (field[0] & 0x80) {        /* Base-256. */
+    r = (unsigned char) field[0] & 0x7f;
+    for (i = 1; i < len; ++i)
+      r = (r << 8) | (unsigned char) field[i];
+    return r;
   }
-  close (fd);
 
-  /* Construct the tar command to examine the tar file. */
-  fp = open_memstream (&cmd, &cmdlen);
-  if (fp == NULL) {
-    nbdkit_error ("open_memstream: %m");
-    return -1;
+  for (i = 0; i < len && field[i] == ' '; ++i)
+    ;
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+    r = r * 8 + (field[i] - '0');
+  return r;
+}
+
+/* Add an entry to the index, taking ownership of the name. */
+static int
+add_entry (char *name, uint64_t offset, uint64_t size)
+{
+  struct tar_entry *e;
+  char *p;
+
+  /* Strip a leading "./" which some tar programs add. */
+  if (name[0] == '.' && name[1] == '/') {
+    p = strdup (name + 2);
+    if (p == NULL) {
+      nbdkit_error ("strdup: %m");
+      free (name);
+      return -1;
+    }
+    free (name);
+    name = p;
   }
-  fprintf (fp, "LANG=C ");
-  shell_quote (tar_program, fp);
-  fprintf (fp, " --no-auto-compress -t --block-number -v -f - ");
-  shell_quote (entry, fp);
-  fprintf (fp, " > ");
-  shell_quote (output, fp);
-  /* Unfortunately we have to hide stderr since we are
-   * expecting tar to warn:
-   *   tar: Unexpected EOF in archive
-   *   tar: Error is not recoverable: exiting now
-   * when we close the connection abruptly.
-   */
-  fprintf (fp, " 2>/dev/null");
-  if (fclose (fp) == EOF) {
-    nbdkit_error ("memstream failed: %m");
-    return -1;
+  if (name[0] == '\0') {
+    free (name);
+    return 0;
   }
 
-  /* Prepare the copy buffer and copy size. */
-  buf = malloc (bufsize);
-  if (buf == NULL) {
-    nbdkit_error ("malloc: %m");
+  e = realloc (entries, (nr_entries + 1) * sizeof *entries);
+  if (e == NULL) {
+    nbdkit_error ("realloc: %m");
+    free (name);
     return -1;
   }
-  copysize = next_ops->get_size (nxdata);
-  if (copysize == -1)
-    return -1;
+  entries = e;
+  entries[nr_entries].name = name;
+  entries[nr_entries].offset = offset;
+  entries[nr_entries].size = size;
+  nr_entries++;
 
-  /* Run the tar command. */
-  nbdkit_debug ("%s", cmd);
-  fp = popen (cmd, "w");
-  if (fp == NULL) {
-    nbdkit_error ("tar: %m");
-    return -1;
+  nbdkit_debug ("tar: %s found at offset %" PRIu64 ", size %" PRIu64,
+                name, offset, size);
+  return 0;
+}
+
+/* Parse a pax extended header: a sequence of "<len> <key>=<value>\n"
+ * records.  We only care about path and size overrides for the
+ * following entry.  The buffer is writable and NUL-terminated.
+ */
+static void
+parse_pax_records (char *buf, size_t len,
+                   char **path, uint64_t *size, bool *has_size)
+{
+  while (len > 0) {
+    char *sp, *end, *eq;
+    unsigned long reclen;
+
+    sp = memchr (buf, ' ', len);
+    if (sp == NULL)
+      break;
+    reclen = strtoul (buf, NULL, 10);
+    if (reclen <= (size_t) (sp - buf) + 1 || reclen > len)
+      break;
+    end = buf + reclen;         /* Points just past the '\n'. */
+    end[-1] = '\0';
+    eq = strchr (sp + 1, '=');
+    if (eq != NULL) {
+      *eq = '\0';
+      if (strcmp (sp + 1, "path") == 0) {
+        free (*path);
+        *path = strdup (eq + 1);
+      }
+      else if (strcmp (sp + 1, "size") == 0) {
+        *size = strtoull (eq + 1, NULL, 10);
+        *has_size = true;
+      }
+    }
+    buf = end;
+    len -= reclen;
   }
+}
 
-  /* Now loop, writing data from the plugin (the tar file) until we
-   * detect that tar has written something to the output file or we
-   * run out of plugin.  We're making the assumption that the plugin
-   * is not going to be sparse, which is probably true of most tar
-   * files.
-   */
-  for (i = 0; i < copysize; i += bufsize) {
-    int err, r;
-    const int64_t count = MIN (bufsize, copysize-i);
-    int64_t j;
-    struct stat statbuf;
-
-    r = next_ops->pread (nxdata, buf, count, i, 0, &err);
-    if (r == -1) {
+/* Limit on the size of long name and pax headers that we will read.
+ * Anything larger is assumed to be a corrupt archive.
+ */
+#define MAX_META_SIZE 65536
+
+/* Build the index of all entries by walking the tar headers.  Only
+ * the 512 byte header of each entry (plus any long name / pax
+ * extended header content) is read; the content itself is skipped
+ * over, so for a large archive this is a handful of small range reads
+ * rather than a pass over the whole file.  This is called with the
+ * lock held.
+ */
+static int
+scan_tar (struct nbdkit_next_ops *next_ops, void *nxdata)
+{
+  int64_t archive_size;
+  uint64_t offs = 0;
+  CLEANUP_FREE char *longname = NULL;
+  uint64_t pax_size = 0;
+  bool has_pax_size = false;
+
+  archive_size = next_ops->get_size (nxdata);
+  if (archive_size == -1)
+    return -1;
+
+  while (offs + 512 <= archive_size) {
+    struct tar_header hdr;
+    int err = 0;
+    uint64_t size, content;
+
+    if (next_ops->pread (nxdata, &hdr, 512, offs, 0, &err) == -1) {
       errno = err;
       nbdkit_error ("pread: %m");
-      pclose (fp);
       return -1;
     }
-    for (j = 0; j < count;) {
-      size_t written = fwrite (&buf[j], 1, count-j, fp);
-      if (written == 0) {
-        nbdkit_error ("tar: error writing to subprocess");
-        pclose (fp);
-        return -1;
+    if (is_zero ((const char *) &hdr, 512))
+      break;                    /* End of archive marker. */
+
+    size = parse_size_field (hdr.size, sizeof hdr.size);
+    content = ROUND_UP (size, 512);
+
+    switch (hdr.typeflag) {
+    case 'L':                   /* GNU long name for the next entry. */
+      free (longname);
+      longname = NULL;
+      if (size > 0 && size < MAX_META_SIZE) {
+        longname = malloc (size + 1);
+        if (longname == NULL) {
+          nbdkit_error ("malloc: %m");
+          return -1;
+        }
+        if (next_ops->pread (nxdata, longname, size, offs + 512,
+                             0, &err) == -1) {
+          errno = err;
+          nbdkit_error ("pread: %m");
+          return -1;
+        }
+        longname[size] = '\0';
+      }
+      break;
+
+    case 'x': {                 /* pax extended header for the next entry. */
+      CLEANUP_FREE char *pax = NULL;
+
+      if (size > 0 && size < MAX_META_SIZE) {
+        pax = malloc (size + 1);
+        if (pax == NULL) {
+          nbdkit_error ("malloc: %m");
+          return -1;
+        }
+        if (next_ops->pread (nxdata, pax, size, offs + 512, 0, &err) == -1) {
+          errno = err;
+          nbdkit_error ("pread: %m");
+          return -1;
+        }
+        pax[size] = '\0';
+        parse_pax_records (pax, size, &longname, &pax_size, &has_pax_size);
       }
-      j += written;
+      break;
     }
 
-    /* Did we get something in the output file yet? */
-    if (stat (output, &statbuf) == 0 && statbuf.st_size > 0)
+    case 'g':                   /* pax global header: ignore. */
+    case 'K':                   /* GNU long link name: ignore. */
       break;
-  }
-  pclose (fp);
 
-  /* Open the tar output and try to parse it. */
-  fp = fopen (output, "r");
-  if (fp == NULL) {
-    nbdkit_error ("%s: %m", output);
-    return -1;
-  }
-  scanned_ok = fscanf (fp, "block %" SCNu64 ": %*s %*s %" SCNu64,
-                       &tar_offset, &tar_size) == 2;
-  fclose (fp);
-  unlink (output);
-
-  if (!scanned_ok) {
-    nbdkit_error ("tar subcommand failed, "
-                  "check that the file really exists in the tarball");
-    return -1;
-  }
+    case '0': case '\0': {      /* Regular file. */
+      char *name;
 
-  /* Adjust the offset: Add 1 for the tar header, then multiply by the
-   * block size.
-   */
-  tar_offset = (tar_offset+1) * 512;
+      if (longname) {
+        name = longname;
+        longname = NULL;
+      }
+      else {
+        char nbuf[257];
+
+        /* Old (pre-POSIX) archives have no magic and no prefix. */
+        if (memcmp (hdr.magic, "ustar", 5) == 0 && hdr.prefix[0] != '\0')
+          snprintf (nbuf, sizeof nbuf, "%.155s/%.100s", hdr.prefix, hdr.name);
+        else
+          snprintf (nbuf, sizeof nbuf, "%.100s", hdr.name);
+        name = strdup (nbuf);
+        if (name == NULL) {
+          nbdkit_error ("strdup: %m");
+          return -1;
+        }
+      }
 
-  nbdkit_debug ("tar: %s found at offset %" PRIu64 ", size %" PRIu64,
-                entry, tar_offset, tar_size);
+      if (has_pax_size) {
+        size = pax_size;
+        content = ROUND_UP (size, 512);
+        has_pax_size = false;
+      }
 
-  /* Check it looks sensible.  XXX We ought to check it doesn't exceed
-   * the size of the tar file.
-   */
-  if (tar_offset >= INT64_MAX || tar_size >= INT64_MAX) {
-    nbdkit_error ("internal error: calculated offset and size are wrong");
-    return -1;
+      if (add_entry (name, offs + 512, size) == -1)
+        return -1;
+      break;
+    }
+
+    default:                    /* Directories, links, devices etc. */
+      free (longname);
+      longname = NULL;
+      has_pax_size = false;
+      break;
+    }
+
+    offs += 512 + content;
   }
 
+  nbdkit_debug ("tar: indexed %zu entries", nr_entries);
   initialized = true;
-
   return 0;
 }
 
+/* Find an entry by name.  Called with the lock held. */
+static const struct tar_entry *
+find_entry (const char *name)
+{
+  size_t i;
+
+  if (name[0] == '.' && name[1] == '/')
+    name += 2;
+  for (i = 0; i < nr_entries; ++i) {
+    if (strcmp (entries[i].name, name) == 0)
+      return &entries[i];
+  }
+  return NULL;
+}
+
 static int
 tar_prepare (struct nbdkit_next_ops *next_ops, void *nxdata,
              void *handle, int readonly)
 {
   struct handle *h = handle;
+  const char *name;
+  const struct tar_entry *e;
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
 
   if (!initialized) {
-    if (calculate_offset_of_entry (next_ops, nxdata) == -1)
+    if (scan_tar (next_ops, nxdata) == -1)
       return -1;
   }
 
-  assert (initialized);
-  assert (tar_offset > 0);
-  h->offset = tar_offset;
-  h->size = tar_size;
+  /* The tar-entry parameter, if given, wins; otherwise the client
+   * export name selects the entry, defaulting to the first file in
+   * the archive.
+   */
+  name = entry ? entry : h->exportname;
+  if (name[0] != '\0')
+    e = find_entry (name);
+  else
+    e = nr_entries > 0 ? &entries[0] : NULL;
+  if (e == NULL) {
+    nbdkit_error ("tar: entry '%s' not found in the tarball", name);
+    return -1;
+  }
+
+  h->name = e->name;
+  h->offset = e->offset;
+  h->size = e->size;
   return 0;
 }
 
+/* List exports. */
+static int
+tar_list_exports (nbdkit_next_list_exports *next, nbdkit_backend *nxdata,
+                  int readonly, int is_tls, struct nbdkit_exports *exports)
+{
+  size_t i;
+
+  /* In tar-entry mode every export serves the same entry, so let the
+   * underlying plugin advertise its exports as before.
+   */
+  if (entry)
+    return next (nxdata, readonly, exports);
+
+  /* We cannot open the plugin from here to scan the archive, so the
+   * list is only populated once a connection has built the index.
+   * (Compare the ext2 filter which has a similar limitation.)
+   */
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  for (i = 0; i < nr_entries; ++i) {
+    if (nbdkit_add_export (exports, entries[i].name, NULL) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/* Default export. */
+static const char *
+tar_default_export (nbdkit_next_default_export *next, nbdkit_backend *nxdata,
+                    int readonly, int is_tls)
+{
+  if (entry)
+    return next (nxdata, readonly);
+
+  /* The default export resolves to the first file in the archive
+   * (see tar_prepare).
+   */
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (initialized && nr_entries > 0)
+    return entries[0].name;
+  return "";
+}
+
 /* Description. */
 static const char *
 tar_export_description (struct nbdkit_next_ops *next_ops, void *nxdata,
                         void *handle)
 {
+  struct handle *h = handle;
   const char *base = next_ops->export_description (nxdata);
 
   if (!base)
     return NULL;
   return nbdkit_printf_intern ("embedded %s from within tar file: %s",
-                               entry, base);
+                               h->name, base);
 }
 
 /* Get the file size. */
@@ -410,10 +626,12 @@ tar_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 static struct nbdkit_filter filter = {
   .name               = "tar",
   .longname           = "nbdkit tar filter",
+  .unload             = tar_unload,
   .config             = tar_config,
-  .config_complete    = tar_config_complete,
   .config_help        = tar_config_help,
   .thread_model       = tar_thread_model,
+  .list_exports       = tar_list_exports,
+  .default_export     = tar_default_export,
   .open               = tar_open,
   .close              = tar_close,
   .prepare            = tar_prepare,
@@ -35,11 +35,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <lzma.h>
 
@@ -50,7 +52,69 @@
 #include "cleanup.h"
 
 static uint64_t maxblock = 512 * 1024 * 1024;
-static uint32_t maxdepth = 8;
+static uint32_t maxdepth = 32;
+
+/* Block cache shared between all connections, so that many clients
+ * reading the same image (eg. a boot storm of VMs cloned from one
+ * compressed golden image) decompress each block only once.  The lock
+ * protects the cache and the in-flight table below; decompression
+ * itself happens outside the lock.
+ */
+static blkcache *cache;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inflight_done = PTHREAD_COND_INITIALIZER;
+
+/* The parsed seek index, shared between all connections.  The first
+ * connection to reach .prepare parses it; later connections (and
+ * clients reconnecting to a long-running server) reuse it instead of
+ * re-scanning the stream footers and index blocks of the file, which
+ * for a multi-gigabyte image served over a slow plugin is a
+ * significant cost per connection.  After creation the index is
+ * immutable and can be iterated from many threads at once.  liblzma
+ * has no API to serialize a parsed index, so sharing is per-process
+ * rather than persistent.
+ */
+static xzfile *xz_file;
+
+/* Uncompressed start offsets of blocks some thread is currently
+ * decompressing.  Other threads needing the same block wait on
+ * inflight_done instead of decoding it a second time.  The table is
+ * bounded: if it fills up we simply allow a duplicate decode.
+ */
+#define MAX_INFLIGHT 64
+static uint64_t inflight[MAX_INFLIGHT];
+static size_t nr_inflight;
+
+static bool
+block_is_inflight (uint64_t start)
+{
+  size_t i;
+
+  for (i = 0; i < nr_inflight; ++i)
+    if (inflight[i] == start)
+      return true;
+  return false;
+}
+
+static void
+add_inflight (uint64_t start)
+{
+  if (nr_inflight < MAX_INFLIGHT)
+    inflight[nr_inflight++] = start;
+}
+
+static void
+remove_inflight (uint64_t start)
+{
+  size_t i;
+
+  for (i = 0; i < nr_inflight; ++i) {
+    if (inflight[i] == start) {
+      inflight[i] = inflight[--nr_inflight];
+      return;
+    }
+  }
+}
 
 static int
 xz_config (nbdkit_next_config *next, void *nxdata,
@@ -78,14 +142,36 @@ xz_config (nbdkit_next_config *next, void *nxdata,
 
 #define xz_config_help \
   "xz-max-block=<SIZE> (optional) Maximum block size allowed (default: 512M)\n"\
-  "xz-max-depth=<N>    (optional) Maximum blocks in cache (default: 4)\n"
+  "xz-max-depth=<N>    (optional) Maximum blocks in cache (default: 32)\n"
+
+static int
+xz_get_ready (nbdkit_next_get_ready *next, nbdkit_backend *nxdata,
+              int thread_model)
+{
+  cache = new_blkcache (maxdepth);
+  if (!cache)
+    return -1;
+
+  return next (nxdata);
+}
+
+static void
+xz_unload (void)
+{
+  blkcache_stats stats;
+
+  if (cache) {
+    blkcache_get_stats (cache, &stats);
+    nbdkit_debug ("cache: hits = %zu, misses = %zu",
+                  stats.hits, stats.misses);
+    free_blkcache (cache);
+  }
+  xzfile_close (xz_file);
+}
 
 /* The per-connection handle. */
 struct xz_handle {
-  xzfile *xz;
-
-  /* Block cache. */
-  blkcache *c;
+  xzfile *xz;                   /* Points to the shared xz_file. */
 };
 
 /* Create the per-connection handle. */
@@ -105,30 +191,20 @@ xz_open (nbdkit_next_open *next, void *nxdata,
     return NULL;
   }
 
-  h->c = new_blkcache (maxdepth);
-  if (!h->c) {
-    free (h);
-    return NULL;
-  }
-
   /* Initialized in xz_prepare. */
   h->xz = NULL;
 
   return h;
 }
 
-/* Free up the per-connection handle. */
+/* Free up the per-connection handle.  The xzfile is shared and is
+ * freed in xz_unload.
+ */
 static void
 xz_close (void *handle)
 {
   struct xz_handle *h = handle;
-  blkcache_stats stats;
-
-  blkcache_get_stats (h->c, &stats);
-  nbdkit_debug ("cache: hits = %zu, misses = %zu", stats.hits, stats.misses);
 
-  xzfile_close (h->xz);
-  free_blkcache (h->c);
   free (h);
 }
 
@@ -138,9 +214,15 @@ xz_prepare (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
 {
   struct xz_handle *h = handle;
 
-  h->xz = xzfile_open (next_ops, nxdata);
-  if (!h->xz)
-    return -1;
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    if (xz_file == NULL) {
+      xz_file = xzfile_open (next_ops, nxdata);
+      if (xz_file == NULL)
+        return -1;
+    }
+  }
+  h->xz = xz_file;
 
   if (maxblock < xzfile_max_uncompressed_block_size (h->xz)) {
     nbdkit_error ("xz file largest block is bigger than maxblock\n"
@@ -230,17 +312,47 @@ xz_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
   char *data;
   uint64_t start, size;
   uint32_t n;
+  bool cached;
 
-  /* Find the block in the cache. */
-  data = get_block (h->c, offset, &start, &size);
+  if (xzfile_locate_block (h->xz, offset, &start, &size) == -1) {
+    *err = EIO;
+    return -1;
+  }
+
+  /* Find the block in the shared cache.  If another connection is
+   * already decompressing the block we need, wait for it to finish
+   * rather than decoding the same block twice.
+   */
+  pthread_mutex_lock (&lock);
+  for (;;) {
+    data = get_block (cache, offset, &start, &size);
+    if (data != NULL || !block_is_inflight (start))
+      break;
+    pthread_cond_wait (&inflight_done, &lock);
+  }
+  cached = data != NULL;
   if (!data) {
-    /* Not in the cache.  We need to read the block from the xz file. */
+    /* Not in the cache.  We need to read the block from the xz file.
+     * This happens outside the lock so that connections decompress
+     * different blocks in parallel.
+     */
+    add_inflight (start);
+    pthread_mutex_unlock (&lock);
     data = xzfile_read_block (h->xz, next_ops, nxdata, flags, err,
                               offset, &start, &size);
-    if (data == NULL)
+    pthread_mutex_lock (&lock);
+    remove_inflight (start);
+    pthread_cond_broadcast (&inflight_done);
+    if (data == NULL) {
+      pthread_mutex_unlock (&lock);
       return -1;
-    put_block (h->c, start, size, data);
+    }
+    /* If this fails then every cache slot is referenced by a reader
+     * and we simply keep ownership of the uncached block.
+     */
+    cached = put_block (cache, start, size, data) == 0;
   }
+  pthread_mutex_unlock (&lock);
 
   /* It's possible if the blocks are really small or oddly aligned or
    * if the requests are large that we need to read the following
@@ -251,6 +363,15 @@ xz_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
     n = start + size - offset;
 
   memcpy (buf, &data[offset-start], n);
+
+  if (cached) {
+    pthread_mutex_lock (&lock);
+    release_block (cache, data);
+    pthread_mutex_unlock (&lock);
+  }
+  else
+    free (data);
+
   buf += n;
   count -= n;
   offset += n;
@@ -268,9 +389,11 @@ static int xz_thread_model (void)
 static struct nbdkit_filter filter = {
   .name               = "xz",
   .longname           = "nbdkit XZ filter",
+  .unload             = xz_unload,
   .config             = xz_config,
   .config_help        = xz_config_help,
   .thread_model       = xz_thread_model,
+  .get_ready          = xz_get_ready,
   .open               = xz_open,
   .close              = xz_close,
   .prepare            = xz_prepare,
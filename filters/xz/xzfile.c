@@ -347,6 +347,23 @@ xzfile_get_size (xzfile *xz)
   return lzma_index_uncompressed_size (xz->idx);
 }
 
+int
+xzfile_locate_block (xzfile *xz, uint64_t offset,
+                     uint64_t *start_rtn, uint64_t *size_rtn)
+{
+  lzma_index_iter iter;
+
+  lzma_index_iter_init (&iter, xz->idx);
+  if (lzma_index_iter_locate (&iter, offset)) {
+    nbdkit_error ("cannot find offset %" PRIu64 " in the xz file", offset);
+    return -1;
+  }
+
+  *start_rtn = iter.block.uncompressed_file_offset;
+  *size_rtn = iter.block.uncompressed_size;
+  return 0;
+}
+
 char *
 xzfile_read_block (xzfile *xz,
                    struct nbdkit_next_ops *next_ops,
@@ -51,6 +51,13 @@ extern uint64_t xzfile_max_uncompressed_block_size (xzfile *);
 /* Get the total uncompressed size of the file. */
 extern uint64_t xzfile_get_size (xzfile *);
 
+/* Find the start offset & size, relative to the uncompressed file, of
+ * the block containing the byte at 'offset', without reading or
+ * decompressing anything.
+ */
+extern int xzfile_locate_block (xzfile *xz, uint64_t offset,
+                                uint64_t *start, uint64_t *size);
+
 /* Read the xz file block that contains the byte at 'offset' in the
  * uncompressed file.
  *
@@ -0,0 +1,406 @@
+/* nbdkit
+ * Copyright (C) 2013-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "zstdfile.h"
+#include "blkcache.h"
+#include "cleanup.h"
+
+static uint64_t maxframe = 512 * 1024 * 1024;
+static uint32_t maxdepth = 32;
+
+/* Frame cache shared between all connections, so that many clients
+ * reading the same image (eg. a boot storm of VMs cloned from one
+ * compressed golden image) decompress each frame only once.  The lock
+ * protects the cache and the in-flight table below; decompression
+ * itself happens outside the lock.
+ */
+static blkcache *cache;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inflight_done = PTHREAD_COND_INITIALIZER;
+
+/* The parsed seek table, shared between all connections.  The first
+ * connection to reach .prepare parses it; later connections reuse it
+ * instead of re-reading the seek table from the file.  After creation
+ * it is immutable and can be searched from many threads at once.
+ */
+static zstdfile *zstd_file;
+
+/* Uncompressed start offsets of frames some thread is currently
+ * decompressing.  Other threads needing the same frame wait on
+ * inflight_done instead of decoding it a second time.  The table is
+ * bounded: if it fills up we simply allow a duplicate decode.
+ */
+#define MAX_INFLIGHT 64
+static uint64_t inflight[MAX_INFLIGHT];
+static size_t nr_inflight;
+
+static bool
+frame_is_inflight (uint64_t start)
+{
+  size_t i;
+
+  for (i = 0; i < nr_inflight; ++i)
+    if (inflight[i] == start)
+      return true;
+  return false;
+}
+
+static void
+add_inflight (uint64_t start)
+{
+  if (nr_inflight < MAX_INFLIGHT)
+    inflight[nr_inflight++] = start;
+}
+
+static void
+remove_inflight (uint64_t start)
+{
+  size_t i;
+
+  for (i = 0; i < nr_inflight; ++i) {
+    if (inflight[i] == start) {
+      inflight[i] = inflight[--nr_inflight];
+      return;
+    }
+  }
+}
+
+static int
+zstd_config (nbdkit_next_config *next, void *nxdata,
+             const char *key, const char *value)
+{
+  if (strcmp (key, "zstd-max-frame") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    maxframe = (uint64_t) r;
+    return 0;
+  }
+  else if (strcmp (key, "zstd-max-depth") == 0) {
+    if (nbdkit_parse_uint32_t ("zstd-max-depth", value, &maxdepth) == -1)
+      return -1;
+    if (maxdepth == 0) {
+      nbdkit_error ("'zstd-max-depth' parameter must be >= 1");
+      return -1;
+    }
+    return 0;
+  }
+  else
+    return next (nxdata, key, value);
+}
+
+#define zstd_config_help \
+  "zstd-max-frame=<SIZE> (optional) Maximum frame size allowed (default: 512M)\n"\
+  "zstd-max-depth=<N>    (optional) Maximum frames in cache (default: 32)\n"
+
+static int
+zstd_get_ready (nbdkit_next_get_ready *next, nbdkit_backend *nxdata,
+                int thread_model)
+{
+  cache = new_blkcache (maxdepth);
+  if (!cache)
+    return -1;
+
+  return next (nxdata);
+}
+
+static void
+zstd_unload (void)
+{
+  blkcache_stats stats;
+
+  if (cache) {
+    blkcache_get_stats (cache, &stats);
+    nbdkit_debug ("cache: hits = %zu, misses = %zu",
+                  stats.hits, stats.misses);
+    free_blkcache (cache);
+  }
+  zstdfile_close (zstd_file);
+}
+
+/* The per-connection handle. */
+struct zstd_handle {
+  zstdfile *zs;                 /* Points to the shared zstd_file. */
+};
+
+/* Create the per-connection handle. */
+static void *
+zstd_open (nbdkit_next_open *next, void *nxdata,
+           int readonly, const char *exportname, int is_tls)
+{
+  struct zstd_handle *h;
+
+  /* Always pass readonly=1 to the underlying plugin. */
+  if (next (nxdata, 1, exportname) == -1)
+    return NULL;
+
+  h = malloc (sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+
+  /* Initialized in zstd_prepare. */
+  h->zs = NULL;
+
+  return h;
+}
+
+/* Free up the per-connection handle.  The zstdfile is shared and is
+ * freed in zstd_unload.
+ */
+static void
+zstd_close (void *handle)
+{
+  struct zstd_handle *h = handle;
+
+  free (h);
+}
+
+static int
+zstd_prepare (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
+              int readonly)
+{
+  struct zstd_handle *h = handle;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    if (zstd_file == NULL) {
+      zstd_file = zstdfile_open (next_ops, nxdata);
+      if (zstd_file == NULL)
+        return -1;
+    }
+  }
+  h->zs = zstd_file;
+
+  if (maxframe < zstdfile_max_uncompressed_frame_size (h->zs)) {
+    nbdkit_error ("zstd file largest frame is bigger than maxframe\n"
+                  "Either recompress the zstd file with smaller frames "
+                  "(see nbdkit-zstd-filter(1))\n"
+                  "or make maxframe parameter bigger.\n"
+                  "maxframe = %" PRIu64 " (bytes)\n"
+                  "largest frame in zstd file = %" PRIu64 " (bytes)",
+                  maxframe,
+                  zstdfile_max_uncompressed_frame_size (h->zs));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Description. */
+static const char *
+zstd_export_description (struct nbdkit_next_ops *next_ops, void *nxdata,
+                         void *handle)
+{
+  const char *base = next_ops->export_description (nxdata);
+
+  if (!base)
+    return NULL;
+  return nbdkit_printf_intern ("expansion of zstd-compressed image: %s",
+                               base);
+}
+
+/* Get the file size. */
+static int64_t
+zstd_get_size (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle)
+{
+  struct zstd_handle *h = handle;
+
+  return zstdfile_get_size (h->zs);
+}
+
+/* We need this because otherwise the layer below can_write is called
+ * and that might return true (eg. if the plugin has a pwrite method
+ * at all), resulting in writes being passed through to the layer
+ * below.
+ */
+static int
+zstd_can_write (struct nbdkit_next_ops *next_ops, void *nxdata,
+                void *handle)
+{
+  return 0;
+}
+
+/* Whatever the plugin says, this filter is consistent across connections. */
+static int
+zstd_can_multi_conn (struct nbdkit_next_ops *next_ops, void *nxdata,
+                     void *handle)
+{
+  return 1;
+}
+
+static int
+zstd_can_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
+                  void *handle)
+{
+  return 0;
+}
+
+/* Cache */
+static int
+zstd_can_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
+                void *handle)
+{
+  /* We are already operating as a cache regardless of the plugin's
+   * underlying .can_cache, but it's easiest to just rely on nbdkit's
+   * behavior of calling .pread for caching.
+   */
+  return NBDKIT_CACHE_EMULATE;
+}
+
+/* Read data from the file. */
+static int
+zstd_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+            void *handle, void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags, int *err)
+{
+  struct zstd_handle *h = handle;
+  char *data;
+  uint64_t start, size;
+  uint32_t n;
+  bool cached;
+
+  if (zstdfile_locate_frame (h->zs, offset, &start, &size) == -1) {
+    *err = EIO;
+    return -1;
+  }
+
+  /* Find the frame in the shared cache.  If another thread is already
+   * decompressing the frame we need, wait for it to finish rather
+   * than decoding the same frame twice.
+   */
+  pthread_mutex_lock (&lock);
+  for (;;) {
+    data = get_block (cache, offset, &start, &size);
+    if (data != NULL || !frame_is_inflight (start))
+      break;
+    pthread_cond_wait (&inflight_done, &lock);
+  }
+  cached = data != NULL;
+  if (!data) {
+    /* Not in the cache.  We need to read the frame from the zstd
+     * file.  This happens outside the lock so that threads decompress
+     * different frames in parallel.
+     */
+    add_inflight (start);
+    pthread_mutex_unlock (&lock);
+    data = zstdfile_read_frame (h->zs, next_ops, nxdata, flags, err,
+                                offset, &start, &size);
+    pthread_mutex_lock (&lock);
+    remove_inflight (start);
+    pthread_cond_broadcast (&inflight_done);
+    if (data == NULL) {
+      pthread_mutex_unlock (&lock);
+      return -1;
+    }
+    /* If this fails then every cache slot is referenced by a reader
+     * and we simply keep ownership of the uncached frame.
+     */
+    cached = put_block (cache, start, size, data) == 0;
+  }
+  pthread_mutex_unlock (&lock);
+
+  /* It's possible if the frames are really small or oddly aligned or
+   * if the requests are large that we need to read the following
+   * frame to satisfy the request.
+   */
+  n = count;
+  if (start + size - offset < n)
+    n = start + size - offset;
+
+  memcpy (buf, &data[offset-start], n);
+
+  if (cached) {
+    pthread_mutex_lock (&lock);
+    release_block (cache, data);
+    pthread_mutex_unlock (&lock);
+  }
+  else
+    free (data);
+
+  buf += n;
+  count -= n;
+  offset += n;
+  if (count > 0)
+    return zstd_pread (next_ops, nxdata, h, buf, count, offset, flags, err);
+
+  return 0;
+}
+
+/* Unlike liblzma, decompressing a seekable zstd frame needs no state
+ * shared between requests (each frame is decoded with a one-shot
+ * call), so requests on the same connection can decompress different
+ * frames in parallel.
+ */
+static int
+zstd_thread_model (void)
+{
+  return NBDKIT_THREAD_MODEL_PARALLEL;
+}
+
+static struct nbdkit_filter filter = {
+  .name               = "zstd",
+  .longname           = "nbdkit zstd filter",
+  .unload             = zstd_unload,
+  .config             = zstd_config,
+  .config_help        = zstd_config_help,
+  .thread_model       = zstd_thread_model,
+  .get_ready          = zstd_get_ready,
+  .open               = zstd_open,
+  .close              = zstd_close,
+  .prepare            = zstd_prepare,
+  .export_description = zstd_export_description,
+  .get_size           = zstd_get_size,
+  .can_write          = zstd_can_write,
+  .can_extents        = zstd_can_extents,
+  .can_cache          = zstd_can_cache,
+  .can_multi_conn     = zstd_can_multi_conn,
+  .pread              = zstd_pread,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
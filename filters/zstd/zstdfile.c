@@ -0,0 +1,358 @@
+/* nbdkit
+ * Copyright (C) 2013-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Parser for the zstd seekable format.  The format is documented in
+ * contrib/seekable_format/zstd_seekable_compression_format.md in the
+ * zstd sources: the file is a sequence of independently compressed
+ * zstd frames, and the last frame is a skippable frame holding a seek
+ * table which gives the compressed and uncompressed size of every
+ * preceding frame.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <nbdkit-filter.h>
+
+#include <zstd.h>
+
+#include "cleanup.h"
+
+#include "zstdfile.h"
+
+/* Magic number of the skippable frame holding the seek table
+ * (0x184D2A50 | 0xE), and of the seek table footer.
+ */
+#define ZSTD_SEEK_TABLE_MAGIC    UINT32_C (0x184D2A5E)
+#define ZSTD_SEEKABLE_MAGIC      UINT32_C (0x8F92EAB1)
+
+/* Size of the seek table footer: number of frames (4), seek table
+ * descriptor (1), seekable magic number (4).
+ */
+#define ZSTD_SEEK_TABLE_FOOTER_SIZE 9
+
+/* One compressed frame.  Offsets are cumulative and precomputed so
+ * that frames can be located with a binary search.
+ */
+struct zstd_frame {
+  uint64_t c_off;               /* Offset in the compressed file. */
+  uint64_t u_off;               /* Offset in the uncompressed data. */
+  uint32_t c_size;
+  uint32_t u_size;
+};
+
+struct zstdfile {
+  struct zstd_frame *frames;    /* Data frames only (u_size > 0). */
+  size_t nr_frames;
+  uint64_t size;                /* Total uncompressed size. */
+  uint64_t max_uncompressed_frame_size;
+};
+
+static uint32_t
+get_le32 (const uint8_t *p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+    ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+zstdfile *
+zstdfile_open (struct nbdkit_next_ops *next_ops, void *nxdata)
+{
+  zstdfile *zs = NULL;
+  uint8_t footer[ZSTD_SEEK_TABLE_FOOTER_SIZE];
+  uint8_t header[8];
+  CLEANUP_FREE uint8_t *entries = NULL;
+  uint64_t table_start, c_off, u_off;
+  uint32_t nr_entries, entry_size, table_size;
+  uint8_t descriptor;
+  int64_t file_size;
+  size_t i, n;
+  int err;
+
+  file_size = next_ops->get_size (nxdata);
+  if (file_size == -1) {
+    nbdkit_error ("zstd: get_size: %m");
+    return NULL;
+  }
+
+  /* The footer of the seek table is the last 9 bytes of the file. */
+  if (file_size < (int64_t) sizeof header + ZSTD_SEEK_TABLE_FOOTER_SIZE) {
+    nbdkit_error ("zstd: file too short to be a seekable zstd file");
+    return NULL;
+  }
+  if (next_ops->pread (nxdata, footer, sizeof footer,
+                       file_size - sizeof footer, 0, &err) == -1) {
+    nbdkit_error ("zstd: could not read seek table footer: error %d", err);
+    return NULL;
+  }
+  if (get_le32 (&footer[5]) != ZSTD_SEEKABLE_MAGIC) {
+    nbdkit_error ("zstd: not a seekable zstd file\n"
+                  "The file has no seek table.  Compress it in the zstd "
+                  "seekable format (eg. with t2sz, or any tool using the "
+                  "zstd seekable compression API).");
+    return NULL;
+  }
+
+  nr_entries = get_le32 (&footer[0]);
+  descriptor = footer[4];
+  if ((descriptor & 0x7c) != 0) {
+    nbdkit_error ("zstd: unsupported seek table descriptor 0x%02x "
+                  "(reserved bits are set)", descriptor);
+    return NULL;
+  }
+  /* Entries are larger if the optional per-frame checksums are present. */
+  entry_size = (descriptor & 0x80) ? 12 : 8;
+
+  table_size =
+    sizeof header + nr_entries * entry_size + ZSTD_SEEK_TABLE_FOOTER_SIZE;
+  if (table_size > file_size) {
+    nbdkit_error ("zstd: invalid seek table: "
+                  "%" PRIu32 " entries do not fit in the file", nr_entries);
+    return NULL;
+  }
+  table_start = file_size - table_size;
+
+  /* Check the header of the skippable frame holding the seek table. */
+  if (next_ops->pread (nxdata, header, sizeof header, table_start,
+                       0, &err) == -1) {
+    nbdkit_error ("zstd: could not read seek table header: error %d", err);
+    return NULL;
+  }
+  if (get_le32 (&header[0]) != ZSTD_SEEK_TABLE_MAGIC ||
+      get_le32 (&header[4]) != table_size - sizeof header) {
+    nbdkit_error ("zstd: invalid seek table: bad skippable frame header");
+    return NULL;
+  }
+
+  entries = malloc (nr_entries * (size_t) entry_size);
+  if (entries == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  if (next_ops->pread (nxdata, entries, nr_entries * (size_t) entry_size,
+                       table_start + sizeof header, 0, &err) == -1) {
+    nbdkit_error ("zstd: could not read seek table: error %d", err);
+    return NULL;
+  }
+
+  zs = calloc (1, sizeof *zs);
+  if (zs == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  zs->frames = calloc (nr_entries > 0 ? nr_entries : 1, sizeof *zs->frames);
+  if (zs->frames == NULL) {
+    nbdkit_error ("calloc: %m");
+    goto err;
+  }
+
+  /* Turn the entries into cumulative offsets.  Frames with no
+   * uncompressed data (skippable frames in the middle of the file)
+   * only advance the compressed offset.
+   */
+  c_off = u_off = 0;
+  n = 0;
+  for (i = 0; i < nr_entries; ++i) {
+    const uint8_t *e = &entries[i * entry_size];
+    uint32_t c_size = get_le32 (&e[0]);
+    uint32_t u_size = get_le32 (&e[4]);
+
+    if (c_size == 0) {
+      nbdkit_error ("zstd: invalid seek table: "
+                    "frame %zu has zero compressed size", i);
+      goto err;
+    }
+    if (u_size > 0) {
+      zs->frames[n].c_off = c_off;
+      zs->frames[n].u_off = u_off;
+      zs->frames[n].c_size = c_size;
+      zs->frames[n].u_size = u_size;
+      if (u_size > zs->max_uncompressed_frame_size)
+        zs->max_uncompressed_frame_size = u_size;
+      n++;
+    }
+    c_off += c_size;
+    u_off += u_size;
+  }
+  if (c_off > table_start) {
+    nbdkit_error ("zstd: invalid seek table: "
+                  "frames overlap the seek table");
+    goto err;
+  }
+  zs->nr_frames = n;
+  zs->size = u_off;
+
+  nbdkit_debug ("zstd: size %" PRIu64 " bytes (%.1fM)",
+                zs->size, zs->size / 1024.0 / 1024.0);
+  nbdkit_debug ("zstd: %zu frames", zs->nr_frames);
+  nbdkit_debug ("zstd: maximum uncompressed frame size %" PRIu64
+                " bytes (%.1fM)",
+                zs->max_uncompressed_frame_size,
+                zs->max_uncompressed_frame_size / 1024.0 / 1024.0);
+
+  return zs;
+
+ err:
+  zstdfile_close (zs);
+  return NULL;
+}
+
+void
+zstdfile_close (zstdfile *zs)
+{
+  if (zs) {
+    free (zs->frames);
+    free (zs);
+  }
+}
+
+uint64_t
+zstdfile_max_uncompressed_frame_size (zstdfile *zs)
+{
+  return zs->max_uncompressed_frame_size;
+}
+
+uint64_t
+zstdfile_get_size (zstdfile *zs)
+{
+  return zs->size;
+}
+
+/* Binary search for the data frame containing the uncompressed byte
+ * at 'offset'.  Returns NULL if the offset is out of range.
+ */
+static const struct zstd_frame *
+find_frame (zstdfile *zs, uint64_t offset)
+{
+  size_t lo = 0, hi = zs->nr_frames;
+
+  if (offset >= zs->size)
+    return NULL;
+
+  while (lo + 1 < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (offset < zs->frames[mid].u_off)
+      hi = mid;
+    else
+      lo = mid;
+  }
+  return &zs->frames[lo];
+}
+
+int
+zstdfile_locate_frame (zstdfile *zs, uint64_t offset,
+                       uint64_t *start_rtn, uint64_t *size_rtn)
+{
+  const struct zstd_frame *f = find_frame (zs, offset);
+
+  if (f == NULL) {
+    nbdkit_error ("cannot find offset %" PRIu64 " in the zstd file", offset);
+    return -1;
+  }
+
+  *start_rtn = f->u_off;
+  *size_rtn = f->u_size;
+  return 0;
+}
+
+char *
+zstdfile_read_frame (zstdfile *zs,
+                     struct nbdkit_next_ops *next_ops,
+                     void *nxdata, uint32_t flags, int *err,
+                     uint64_t offset,
+                     uint64_t *start_rtn, uint64_t *size_rtn)
+{
+  const struct zstd_frame *f = find_frame (zs, offset);
+  CLEANUP_FREE uint8_t *cbuf = NULL;
+  char *data = NULL;
+  size_t r;
+
+  if (f == NULL) {
+    nbdkit_error ("cannot find offset %" PRIu64 " in the zstd file", offset);
+    return NULL;
+  }
+
+  *start_rtn = f->u_off;
+  *size_rtn = f->u_size;
+
+  nbdkit_debug ("seek: frame %zd at file offset %" PRIu64,
+                f - zs->frames, f->c_off);
+
+  cbuf = malloc (f->c_size);
+  data = malloc (f->u_size);
+  if (cbuf == NULL || data == NULL) {
+    nbdkit_error ("malloc (%" PRIu32 " bytes): %m\n"
+                  "NOTE: If this error occurs, you need to recompress your "
+                  "zstd files with a smaller frame size.",
+                  f->c_size > f->u_size ? f->c_size : f->u_size);
+    *err = ENOMEM;
+    goto err;
+  }
+
+  if (next_ops->pread (nxdata, cbuf, f->c_size, f->c_off, 0, err) == -1) {
+    nbdkit_error ("zstd: read: could not read frame of compressed data: "
+                  "error %d", *err);
+    goto err;
+  }
+
+  /* Frames in the seekable format are independent, so each one can be
+   * decompressed with the stateless one-shot API, from any thread.
+   */
+  r = ZSTD_decompress (data, f->u_size, cbuf, f->c_size);
+  if (ZSTD_isError (r)) {
+    nbdkit_error ("zstd: could not decompress frame: %s",
+                  ZSTD_getErrorName (r));
+    *err = EIO;
+    goto err;
+  }
+  if (r != f->u_size) {
+    nbdkit_error ("zstd: frame decompressed to %zu bytes, "
+                  "but the seek table says %" PRIu32, r, f->u_size);
+    *err = EIO;
+    goto err;
+  }
+
+  return data;
+
+ err:
+  free (data);
+  return NULL;
+}
@@ -0,0 +1,81 @@
+/* nbdkit
+ * Copyright (C) 2013-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Parser for the zstd seekable format: a sequence of independent zstd
+ * frames followed by a seek table stored in a skippable frame at the
+ * end of the file.
+ */
+
+#ifndef NBDKIT_ZSTDFILE_H
+#define NBDKIT_ZSTDFILE_H
+
+#include <nbdkit-filter.h>
+
+typedef struct zstdfile zstdfile;
+
+/* Open (and verify) a file in the zstd seekable format. */
+extern zstdfile *zstdfile_open (struct nbdkit_next_ops *next_ops,
+                                void *nxdata);
+
+/* Close the file and free up all resources. */
+extern void zstdfile_close (zstdfile *);
+
+/* Get (uncompressed) size of the largest frame in the file. */
+extern uint64_t zstdfile_max_uncompressed_frame_size (zstdfile *);
+
+/* Get the total uncompressed size of the file. */
+extern uint64_t zstdfile_get_size (zstdfile *);
+
+/* Find the start offset & size, relative to the uncompressed file, of
+ * the frame containing the byte at 'offset', without reading or
+ * decompressing anything.
+ */
+extern int zstdfile_locate_frame (zstdfile *zs, uint64_t offset,
+                                  uint64_t *start, uint64_t *size);
+
+/* Read and decompress the frame that contains the byte at 'offset' in
+ * the uncompressed file.
+ *
+ * The uncompressed frame of data, which probably begins before the
+ * requested byte and ends after it, is returned.  The caller must
+ * free it.  NULL is returned if there was an error.
+ *
+ * The start offset & size of the frame relative to the uncompressed
+ * file are returned in *start and *size.
+ */
+extern char *zstdfile_read_frame (zstdfile *zs,
+                                  struct nbdkit_next_ops *next_ops,
+                                  void *nxdata, uint32_t flags, int *err,
+                                  uint64_t offset,
+                                  uint64_t *start, uint64_t *size);
+
+#endif /* NBDKIT_ZSTDFILE_H */
@@ -38,6 +38,7 @@
 #endif
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <errno.h>
 
@@ -82,6 +83,16 @@ extern "C" {
 #define NBDKIT_EXTENT_HOLE    (1<<0) /* Same as NBD_STATE_HOLE */
 #define NBDKIT_EXTENT_ZERO    (1<<1) /* Same as NBD_STATE_ZERO */
 
+/* One segment of a scatter-gather read or write (see .preadv and
+ * .pwritev).  Layout-compatible with struct iovec on platforms which
+ * have it, but defined here so that the public headers do not depend
+ * on <sys/uio.h>.
+ */
+struct nbdkit_iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+
 #ifndef WIN32
 #define NBDKIT_EXTERN_DECL(ret, fn, args) extern ret fn args
 #else
@@ -124,6 +135,7 @@ NBDKIT_EXTERN_DECL (int, nbdkit_parse_int64_t,
 NBDKIT_EXTERN_DECL (int, nbdkit_parse_uint64_t,
                     (const char *what, const char *str, uint64_t *r));
 NBDKIT_EXTERN_DECL (int, nbdkit_stdio_safe, (void));
+NBDKIT_EXTERN_DECL (int, nbdkit_buffer_alignment, (void));
 NBDKIT_EXTERN_DECL (int, nbdkit_read_password,
                     (const char *value, char **password));
 NBDKIT_EXTERN_DECL (char *, nbdkit_realpath, (const char *path));
@@ -134,6 +146,8 @@ NBDKIT_EXTERN_DECL (int64_t, nbdkit_peer_pid, (void));
 NBDKIT_EXTERN_DECL (int64_t, nbdkit_peer_uid, (void));
 NBDKIT_EXTERN_DECL (int64_t, nbdkit_peer_gid, (void));
 NBDKIT_EXTERN_DECL (void, nbdkit_shutdown, (void));
+NBDKIT_EXTERN_DECL (void *, nbdkit_get_request_context, (void));
+NBDKIT_EXTERN_DECL (void, nbdkit_set_request_context, (void *context));
 
 NBDKIT_EXTERN_DECL (const char *, nbdkit_strdup_intern,
                     (const char *str));
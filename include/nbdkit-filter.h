@@ -108,6 +108,20 @@ struct nbdkit_next_ops {
                   uint32_t flags, struct nbdkit_extents *extents, int *err);
   int (*cache) (nbdkit_backend *nxdata, uint32_t count, uint64_t offset,
                 uint32_t flags, int *err);
+
+  /* Scatter-gather variants of pread and pwrite.  The request covers
+   * [offset, offset + sum of iov_len).  These always work: layers
+   * which do not understand vectors are handled by the server looping
+   * over the segments, so a filter may build a vector (eg. to prepend
+   * a bounce buffer to the caller's buffer) without checking for
+   * support.
+   */
+  int (*preadv) (nbdkit_backend *nxdata,
+                 const struct nbdkit_iovec *iov, int iovcnt, uint64_t offset,
+                 uint32_t flags, int *err);
+  int (*pwritev) (nbdkit_backend *nxdata,
+                  const struct nbdkit_iovec *iov, int iovcnt, uint64_t offset,
+                  uint32_t flags, int *err);
 };
 
 /* Extent functions. */
@@ -149,6 +163,9 @@ NBDKIT_EXTERN_DECL (size_t, nbdkit_exports_count,
                     (const struct nbdkit_exports *));
 NBDKIT_EXTERN_DECL (const struct nbdkit_export, nbdkit_get_export,
                     (const struct nbdkit_exports *, size_t));
+/* Constant-time lookup by name; returns the index or -1 if absent. */
+NBDKIT_EXTERN_DECL (ssize_t, nbdkit_find_export,
+                    (const struct nbdkit_exports *, const char *));
 
 /* Filter struct. */
 struct nbdkit_filter {
@@ -246,6 +263,46 @@ struct nbdkit_filter {
   int (*cache) (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
                 void *handle, uint32_t count, uint64_t offset, uint32_t flags,
                 int *err);
+
+  /* A filter which maintains a dirty bitmap (see nbdkit-cbt-filter)
+   * can expose it as an NBD metadata context.  .dirty_bitmap returns
+   * the context name (eg. "qemu:dirty-bitmap:NAME"); it must only
+   * depend on configuration as it is called during negotiation,
+   * before any handle is open.  .dirty_extents answers block status
+   * queries for that context, using extent type bit 0 to mean dirty.
+   */
+  const char * (*dirty_bitmap) (void);
+  int (*dirty_extents) (struct nbdkit_next_ops *next_ops,
+                        nbdkit_backend *nxdata,
+                        void *handle, uint32_t count, uint64_t offset,
+                        uint32_t flags,
+                        struct nbdkit_extents *extents, int *err);
+
+  /* A filter may export internal counters (cache hit rates, retry
+   * counts, ...) through the server's metrics report (see the
+   * --stats-socket option in nbdkit(1)).  Return a malloc'd string of
+   * complete lines in Prometheus text exposition format, or NULL.
+   * The server frees the string.  Called from a reporting thread, so
+   * any counters read here must be safe against concurrent updates
+   * from the data path.
+   */
+  char * (*metrics) (void);
+
+  /* Scatter-gather variants of .pread and .pwrite (optional).  A
+   * filter which edits requests by reframing the buffer — prepending,
+   * trimming or splitting — can implement these to adjust the vector
+   * instead of copying into a new contiguous buffer.  When absent the
+   * server falls back to per-segment calls of .pread/.pwrite, or
+   * passes the vector through unchanged if those are also absent.
+   */
+  int (*preadv) (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+                 void *handle,
+                 const struct nbdkit_iovec *iov, int iovcnt, uint64_t offset,
+                 uint32_t flags, int *err);
+  int (*pwritev) (struct nbdkit_next_ops *next_ops, nbdkit_backend *nxdata,
+                  void *handle,
+                  const struct nbdkit_iovec *iov, int iovcnt, uint64_t offset,
+                  uint32_t flags, int *err);
 };
 
 #define NBDKIT_REGISTER_FILTER(filter)                                  \
@@ -49,6 +49,18 @@ extern "C" {
 #error Unsupported API version
 #endif
 
+/* Token identifying one in-flight asynchronous operation.  Opaque to
+ * plugins; pass it unchanged to nbdkit_completion_complete.
+ */
+struct nbdkit_completion;
+
+/* Filled in by .pread_zerocopy. */
+struct nbdkit_zerocopy_read {
+  const void *buf;                /* plugin-owned data to transmit */
+  void *opaque;                   /* passed to release */
+  void (*release) (void *opaque); /* called after transmission */
+};
+
 struct nbdkit_plugin {
   /* Do not set these fields directly; use NBDKIT_REGISTER_PLUGIN.
    * They exist so that we can support plugins compiled against
@@ -144,9 +156,62 @@ struct nbdkit_plugin {
                        struct nbdkit_exports *exports);
   const char * (*default_export) (int readonly, int is_tls);
   const char * (*export_description) (void *handle);
+
+  /* Asynchronous I/O (optional).  Submit the operation and return 0
+   * without waiting for it to finish; when it completes, call
+   * nbdkit_completion_complete (from any thread) exactly once.
+   * Return -1 if the operation could not be submitted, in which case
+   * the completion must not be called.  Requires
+   * NBDKIT_THREAD_MODEL_PARALLEL.
+   */
+  int (*pread_async) (void *handle, void *buf, uint32_t count,
+                      uint64_t offset, uint32_t flags,
+                      struct nbdkit_completion *completion);
+  int (*pwrite_async) (void *handle, const void *buf, uint32_t count,
+                       uint64_t offset, uint32_t flags,
+                       struct nbdkit_completion *completion);
+
+  /* Zero-copy read (optional).  Instead of filling the server's
+   * buffer, lend the server a pointer into the plugin's own storage
+   * covering [offset, offset+count-1]; the server calls release
+   * (possibly from another thread) once the data has been written to
+   * the socket.  Return 0 with zc filled in, 1 to make the server
+   * fall back to .pread for this request (eg. the range is not
+   * contiguous in the plugin's storage), or -1 on error.  A
+   * concurrent writer may change the bytes while they are lent out,
+   * which is no different from a copied read racing the same write.
+   */
+  int (*pread_zerocopy) (void *handle, struct nbdkit_zerocopy_read *zc,
+                         uint32_t count, uint64_t offset, uint32_t flags);
+
+  /* Handle reuse (optional).  Called when a connection closes; return
+   * 1 if the handle may be parked by the server and handed to a later
+   * connection opening the same export with the same readonly flag
+   * (in which case .close is deferred until the cached handle expires
+   * or the server shuts down), or 0 to close it as normal.  Useful
+   * when .open is expensive (remote sessions) and clients reconnect
+   * often.
+   */
+  int (*can_reuse) (void *handle);
+
+  /* Scatter-gather I/O (optional).  Like .pread and .pwrite except
+   * the data is described by a vector of segments; the total length
+   * of the vector equals the request count.  Plugins which can issue
+   * vectored I/O directly (eg. preadv(2)/pwritev(2)) avoid the server
+   * looping over the segments with multiple .pread/.pwrite calls.
+   */
+  int (*preadv) (void *handle, const struct nbdkit_iovec *iov, int iovcnt,
+                 uint64_t offset, uint32_t flags);
+  int (*pwritev) (void *handle, const struct nbdkit_iovec *iov, int iovcnt,
+                  uint64_t offset, uint32_t flags);
 };
 
 NBDKIT_EXTERN_DECL (void, nbdkit_set_error, (int err));
+/* Finish an asynchronous operation.  error is 0 on success or a
+ * positive errno value.
+ */
+NBDKIT_EXTERN_DECL (void, nbdkit_completion_complete,
+                    (struct nbdkit_completion *completion, int error));
 NBDKIT_EXTERN_DECL (const char *, nbdkit_export_name, (void));
 NBDKIT_EXTERN_DECL (int, nbdkit_is_tls, (void));
 
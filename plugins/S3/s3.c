@@ -0,0 +1,767 @@
+/* nbdkit
+ * Copyright (C) 2020-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* S3 plugin which serves a single object from an S3-compatible object
+ * store using HTTP range requests.  This replaced an earlier Python
+ * plugin which made one boto3 call per request; doing the requests
+ * directly with libcurl avoids the interpreter overhead and lets many
+ * ranged GETs run in parallel over pooled connections.
+ *
+ * Request signing (AWS signature version 4) is done by libcurl
+ * (CURLOPT_AWS_SIGV4, libcurl >= 7.75.0).  Unsigned requests to
+ * public buckets or to local object stores such as MinIO work with
+ * any libcurl.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#define NBDKIT_API_VERSION 2
+
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+
+#ifdef CURL_AT_LEAST_VERSION
+#if CURL_AT_LEAST_VERSION(7, 55, 0)
+#define HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
+#endif
+#if CURL_AT_LEAST_VERSION(7, 75, 0)
+#define HAVE_CURLOPT_AWS_SIGV4
+#endif
+#endif
+
+/* Plugin configuration. */
+static const char *access_key = NULL;
+static char *secret_key = NULL;
+static char *session_token = NULL;
+static const char *endpoint_url = NULL;
+static const char *bucket = NULL;
+static const char *key_name = NULL;
+static const char *region = NULL;
+static unsigned connections = 16;
+static bool sslverify = true;
+
+/* Computed at config_complete time. */
+static char *url = NULL;        /* full URL of the object */
+static char *sigv4 = NULL;      /* CURLOPT_AWS_SIGV4 parameter */
+static char *userpwd = NULL;    /* "ACCESS_KEY:SECRET_KEY" */
+static struct curl_slist *headers = NULL;
+
+/* Use '-D S3.verbose=1' to set. */
+int S3_debug_verbose = 0;
+
+static void
+s3_load (void)
+{
+  CURLcode r;
+
+  r = curl_global_init (CURL_GLOBAL_DEFAULT);
+  if (r != CURLE_OK) {
+    nbdkit_error ("libcurl initialization failed: %d", (int) r);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void free_all_handles (void);
+
+static void
+s3_unload (void)
+{
+  free_all_handles ();
+  free (secret_key);
+  free (session_token);
+  free (url);
+  free (sigv4);
+  free (userpwd);
+  if (headers)
+    curl_slist_free_all (headers);
+  curl_global_cleanup ();
+}
+
+/* Called for each key=value passed on the command line.  The
+ * underscore variants are accepted for compatibility with the old
+ * Python version of this plugin.
+ */
+static int
+s3_config (const char *key, const char *value)
+{
+  int r;
+
+  if (strcmp (key, "access-key") == 0 || strcmp (key, "access_key") == 0)
+    access_key = value;
+
+  else if (strcmp (key, "secret-key") == 0 || strcmp (key, "secret_key") == 0) {
+    free (secret_key);
+    if (nbdkit_read_password (value, &secret_key) == -1)
+      return -1;
+  }
+
+  else if (strcmp (key, "session-token") == 0 ||
+           strcmp (key, "session_token") == 0) {
+    free (session_token);
+    if (nbdkit_read_password (value, &session_token) == -1)
+      return -1;
+  }
+
+  else if (strcmp (key, "endpoint-url") == 0 ||
+           strcmp (key, "endpoint_url") == 0)
+    endpoint_url = value;
+
+  else if (strcmp (key, "bucket") == 0)
+    bucket = value;
+
+  else if (strcmp (key, "key") == 0)
+    key_name = value;
+
+  else if (strcmp (key, "region") == 0)
+    region = value;
+
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections == 0) {
+      nbdkit_error ("connections parameter must not be 0");
+      return -1;
+    }
+  }
+
+  else if (strcmp (key, "sslverify") == 0) {
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    sslverify = r;
+  }
+
+  else {
+    nbdkit_error ("unknown parameter '%s'", key);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Append the string to the URL, percent-escaping everything except
+ * unreserved characters and '/' (object keys may contain slashes
+ * which must remain path separators).
+ */
+static int
+append_escaped (char **purl, const char *str)
+{
+  CURL *c;
+  const char *p;
+  size_t n;
+  char *s, *new_url;
+  int ret = -1;
+
+  c = curl_easy_init ();
+  if (c == NULL) {
+    nbdkit_error ("curl_easy_init: failed");
+    return -1;
+  }
+
+  for (p = str; *p; p += n) {
+    n = strcspn (p, "/");
+    if (n > 0) {
+      s = curl_easy_escape (c, p, (int) n);
+      if (s == NULL) {
+        nbdkit_error ("curl_easy_escape: failed");
+        goto out;
+      }
+      if (asprintf (&new_url, "%s%s", *purl, s) == -1) {
+        nbdkit_error ("asprintf: %m");
+        curl_free (s);
+        goto out;
+      }
+      curl_free (s);
+      free (*purl);
+      *purl = new_url;
+    }
+    while (p[n] == '/') {
+      if (asprintf (&new_url, "%s/", *purl) == -1) {
+        nbdkit_error ("asprintf: %m");
+        goto out;
+      }
+      free (*purl);
+      *purl = new_url;
+      n++;
+    }
+  }
+  ret = 0;
+
+ out:
+  curl_easy_cleanup (c);
+  return ret;
+}
+
+static int
+s3_config_complete (void)
+{
+  size_t len;
+  const char *s;
+
+  if (bucket == NULL) {
+    nbdkit_error ("you must supply the bucket=<BUCKET> parameter "
+                  "after the plugin name on the command line");
+    return -1;
+  }
+  if (key_name == NULL) {
+    nbdkit_error ("you must supply the key=<KEY> parameter "
+                  "after the plugin name on the command line");
+    return -1;
+  }
+
+  /* Fall back to the standard AWS environment variables, the same
+   * ones that boto3 used to read for us.
+   */
+  if (access_key == NULL)
+    access_key = getenv ("AWS_ACCESS_KEY_ID");
+  if (secret_key == NULL && (s = getenv ("AWS_SECRET_ACCESS_KEY")) != NULL) {
+    secret_key = strdup (s);
+    if (secret_key == NULL) {
+      nbdkit_error ("strdup: %m");
+      return -1;
+    }
+  }
+  if (session_token == NULL && (s = getenv ("AWS_SESSION_TOKEN")) != NULL) {
+    session_token = strdup (s);
+    if (session_token == NULL) {
+      nbdkit_error ("strdup: %m");
+      return -1;
+    }
+  }
+  if (region == NULL)
+    region = getenv ("AWS_DEFAULT_REGION");
+  if (region == NULL)
+    region = "us-east-1";
+
+  if ((access_key == NULL) != (secret_key == NULL)) {
+    nbdkit_error ("access-key and secret-key must be used together");
+    return -1;
+  }
+
+  /* Construct the (path-style) URL of the object. */
+  if (endpoint_url != NULL) {
+    url = strdup (endpoint_url);
+    if (url == NULL) {
+      nbdkit_error ("strdup: %m");
+      return -1;
+    }
+    /* Remove any trailing slashes. */
+    len = strlen (url);
+    while (len > 0 && url[len-1] == '/')
+      url[--len] = '\0';
+  }
+  else if (asprintf (&url, "https://s3.%s.amazonaws.com", region) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+  if (append_escaped (&url, "/") == -1 ||
+      append_escaped (&url, bucket) == -1 ||
+      append_escaped (&url, "/") == -1 ||
+      append_escaped (&url, key_name) == -1)
+    return -1;
+
+  nbdkit_debug ("S3: url: %s", url);
+
+  /* Set up request signing. */
+  if (access_key != NULL) {
+#ifdef HAVE_CURLOPT_AWS_SIGV4
+    if (asprintf (&sigv4, "aws:amz:%s:s3", region) == -1 ||
+        asprintf (&userpwd, "%s:%s", access_key, secret_key) == -1) {
+      nbdkit_error ("asprintf: %m");
+      return -1;
+    }
+    if (session_token != NULL) {
+      CLEANUP_FREE char *h = NULL;
+
+      if (asprintf (&h, "x-amz-security-token: %s", session_token) == -1) {
+        nbdkit_error ("asprintf: %m");
+        return -1;
+      }
+      headers = curl_slist_append (headers, h);
+      if (headers == NULL) {
+        nbdkit_error ("curl_slist_append: %m");
+        return -1;
+      }
+    }
+#else
+    nbdkit_error ("request signing requires libcurl >= 7.75.0, "
+                  "this plugin can only access unsigned endpoints");
+    return -1;
+#endif
+  }
+
+  return 0;
+}
+
+#define s3_config_help \
+  "access-key=<ACCESS_KEY>    The AWS access key.\n" \
+  "secret-key=<SECRET_KEY>    The AWS secret key.\n" \
+  "session-token=<TOKEN>      The AWS session token (optional).\n" \
+  "endpoint-url=<URL>         Endpoint of an S3-compatible service.\n" \
+  "bucket=<BUCKET> (required) The bucket containing the object.\n" \
+  "key=<KEY>       (required) The object to serve.\n" \
+  "region=<REGION>            The AWS region (default us-east-1).\n" \
+  "connections=<N>            Number of pooled connections (default 16).\n" \
+  "sslverify=false            Do not verify SSL certificate of remote host."
+
+/* Translate CURLcode to nbdkit_error. */
+#define display_curl_error(h, r, fs, ...)                       \
+  do {                                                          \
+    nbdkit_error ((fs ": %s: %s"), ## __VA_ARGS__,              \
+                  curl_easy_strerror ((r)), (h)->errbuf);       \
+  } while (0)
+
+/* A handle in the pool: one libcurl easy handle, which keeps its
+ * connection to the endpoint open between requests.
+ */
+struct s3_handle {
+  struct s3_handle *next;       /* Next free handle. */
+  CURL *c;
+  char errbuf[CURL_ERROR_SIZE];
+  int64_t exportsize;
+
+  /* Used by the write callback to fill the caller's buffer. */
+  char *write_buf;
+  uint32_t write_count;
+};
+
+static int debug_cb (CURL *handle, curl_infotype type,
+                     const char *data, size_t size, void *);
+static size_t write_cb (char *ptr, size_t size, size_t nmemb, void *opaque);
+
+/* Cache of the size probe.  Only the first handle created issues a
+ * HEAD request; handles allocated after that reuse the answer.
+ */
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool probed = false;
+static int64_t probed_exportsize;
+
+/* Allocate a new easy handle for the pool, performing the initial
+ * HEAD request to fetch the size of the object (only for the first
+ * handle, see above).
+ */
+static struct s3_handle *
+allocate_handle (void)
+{
+  struct s3_handle *h;
+  CURLcode r;
+#ifdef HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
+  curl_off_t o;
+#else
+  double d;
+#endif
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  h->c = curl_easy_init ();
+  if (h->c == NULL) {
+    nbdkit_error ("curl_easy_init: failed: %m");
+    goto err;
+  }
+
+  if (S3_debug_verbose) {
+    /* NB: Constants must be explicitly long because the parameter is
+     * varargs.
+     */
+    curl_easy_setopt (h->c, CURLOPT_VERBOSE, 1L);
+    curl_easy_setopt (h->c, CURLOPT_DEBUGFUNCTION, debug_cb);
+  }
+
+  curl_easy_setopt (h->c, CURLOPT_ERRORBUFFER, h->errbuf);
+
+  r = curl_easy_setopt (h->c, CURLOPT_URL, url);
+  if (r != CURLE_OK) {
+    display_curl_error (h, r, "curl_easy_setopt: CURLOPT_URL [%s]", url);
+    goto err;
+  }
+
+  curl_easy_setopt (h->c, CURLOPT_FAILONERROR, 1);
+  if (headers)
+    curl_easy_setopt (h->c, CURLOPT_HTTPHEADER, headers);
+#ifdef HAVE_CURLOPT_AWS_SIGV4
+  if (sigv4) {
+    curl_easy_setopt (h->c, CURLOPT_AWS_SIGV4, sigv4);
+    curl_easy_setopt (h->c, CURLOPT_USERPWD, userpwd);
+  }
+#endif
+  if (!sslverify) {
+    curl_easy_setopt (h->c, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt (h->c, CURLOPT_SSL_VERIFYHOST, 0L);
+  }
+
+  /* Get the size of the object.  This cannot change for the lifetime
+   * of the plugin, so the result of the first probe is cached and
+   * further handles do not re-issue the HEAD request.
+   */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&probe_lock);
+
+    if (probed) {
+      h->exportsize = probed_exportsize;
+      goto probe_done;
+    }
+
+    curl_easy_setopt (h->c, CURLOPT_NOBODY, 1L);
+    r = curl_easy_perform (h->c);
+    if (r != CURLE_OK) {
+      display_curl_error (h, r,
+                          "problem doing HEAD request to fetch size of object "
+                          "[%s]", url);
+      goto err;
+    }
+
+#ifdef HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
+    r = curl_easy_getinfo (h->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &o);
+    if (r != CURLE_OK) {
+      display_curl_error (h, r, "could not get size of object [%s]", url);
+      goto err;
+    }
+    if (o == -1) {
+      nbdkit_error ("could not get size of object [%s], "
+                    "are the bucket and key correct?", url);
+      goto err;
+    }
+    h->exportsize = o;
+#else
+    r = curl_easy_getinfo (h->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d);
+    if (r != CURLE_OK) {
+      display_curl_error (h, r, "could not get size of object [%s]", url);
+      goto err;
+    }
+    if (d == -1) {
+      nbdkit_error ("could not get size of object [%s], "
+                    "are the bucket and key correct?", url);
+      goto err;
+    }
+    h->exportsize = d;
+#endif
+    nbdkit_debug ("content length: %" PRIi64, h->exportsize);
+
+    probed_exportsize = h->exportsize;
+    probed = true;
+  }
+ probe_done:
+
+  /* Get set up for reading. */
+  curl_easy_setopt (h->c, CURLOPT_NOBODY, 0L);
+  curl_easy_setopt (h->c, CURLOPT_WRITEFUNCTION, write_cb);
+  curl_easy_setopt (h->c, CURLOPT_WRITEDATA, h);
+
+  return h;
+
+ err:
+  if (h->c)
+    curl_easy_cleanup (h->c);
+  free (h);
+  return NULL;
+}
+
+static void
+free_handle (struct s3_handle *h)
+{
+  curl_easy_cleanup (h->c);
+  free (h);
+}
+
+/* The pool of easy handles.  Each easy handle can only process one
+ * request at a time, so to let requests overlap (the thread model is
+ * parallel) every request borrows a handle from this pool for its
+ * duration.  Handles are created on demand up to the limit set by the
+ * connections parameter; when all are busy, requests wait their turn.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct s3_handle *free_handles = NULL;
+static unsigned nr_handles = 0;
+
+static struct s3_handle *
+get_handle (void)
+{
+  struct s3_handle *h;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+    for (;;) {
+      if (free_handles != NULL) {
+        h = free_handles;
+        free_handles = h->next;
+        return h;
+      }
+      if (nr_handles < connections) {
+        /* Reserve a slot before dropping the lock to allocate, so
+         * that we never create more than the configured number of
+         * handles.
+         */
+        nr_handles++;
+        break;
+      }
+      pthread_cond_wait (&pool_cond, &pool_lock);
+    }
+  }
+
+  /* Allocating may perform the initial HEAD request so must be done
+   * without holding the lock.
+   */
+  h = allocate_handle ();
+  if (h == NULL) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+    nr_handles--;
+    pthread_cond_signal (&pool_cond);
+  }
+  return h;
+}
+
+static void
+put_handle (struct s3_handle *h)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+  h->next = free_handles;
+  free_handles = h;
+  pthread_cond_signal (&pool_cond);
+}
+
+/* Called from s3_unload.  At this point no connections are open so
+ * every handle is back on the free list.
+ */
+static void
+free_all_handles (void)
+{
+  struct s3_handle *h, *next;
+
+  for (h = free_handles; h != NULL; h = next) {
+    next = h->next;
+    free_handle (h);
+  }
+  free_handles = NULL;
+  nr_handles = 0;
+}
+
+/* When using CURLOPT_VERBOSE, this callback is used to redirect
+ * messages to nbdkit_debug (instead of stderr).
+ */
+static int
+debug_cb (CURL *handle, curl_infotype type,
+          const char *data, size_t size, void *opaque)
+{
+  size_t origsize = size;
+  CLEANUP_FREE char *str;
+
+  /* The data parameter passed is NOT \0-terminated, but also it may
+   * have \n or \r\n line endings.  The only sane way to deal with
+   * this is to copy the string.  (The data strings may also be
+   * multi-line, but we don't deal with that here).
+   */
+  str = malloc (size + 1);
+  if (str == NULL)
+    goto out;
+  memcpy (str, data, size);
+  str[size] = '\0';
+
+  while (size > 0 && (str[size-1] == '\n' || str[size-1] == '\r')) {
+    str[size-1] = '\0';
+    size--;
+  }
+
+  switch (type) {
+  case CURLINFO_TEXT:
+    nbdkit_debug ("%s", str);
+    break;
+  case CURLINFO_HEADER_IN:
+    nbdkit_debug ("S: %s", str);
+    break;
+  case CURLINFO_HEADER_OUT:
+    nbdkit_debug ("C: %s", str);
+    break;
+  default:
+    /* Assume everything else is binary data that we cannot print. */
+    nbdkit_debug ("<data with size=%zu>", origsize);
+  }
+
+ out:
+  return 0;
+}
+
+/* Per-connection handle.  The curl easy handles live in the shared
+ * pool, so this only records what we learned at open time.
+ */
+struct handle {
+  int64_t exportsize;
+};
+
+/* Create the per-connection handle. */
+static void *
+s3_open (int readonly)
+{
+  struct handle *d;
+  struct s3_handle *h;
+
+  d = calloc (1, sizeof *d);
+  if (d == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  /* Borrow a handle from the pool (creating the first one if
+   * necessary) so that errors contacting the object store are
+   * reported when the client connects, and to get the size.
+   */
+  h = get_handle ();
+  if (h == NULL) {
+    free (d);
+    return NULL;
+  }
+  d->exportsize = h->exportsize;
+  put_handle (h);
+
+  return d;
+}
+
+/* Free up the per-connection handle. */
+static void
+s3_close (void *handle)
+{
+  struct handle *d = handle;
+
+  free (d);
+}
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+/* Get the object size. */
+static int64_t
+s3_get_size (void *handle)
+{
+  struct handle *d = handle;
+
+  return d->exportsize;
+}
+
+/* Read data from the object. */
+static int
+s3_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+          uint32_t flags)
+{
+  struct s3_handle *h;
+  CURLcode r;
+  char range[128];
+
+  h = get_handle ();
+  if (h == NULL)
+    return -1;
+
+  /* Tell the write_cb where we want the data to be written.  write_cb
+   * will update this if the data comes in multiple sections.
+   */
+  h->write_buf = buf;
+  h->write_count = count;
+
+  curl_easy_setopt (h->c, CURLOPT_HTTPGET, 1L);
+
+  /* Make an HTTP range request. */
+  snprintf (range, sizeof range, "%" PRIu64 "-%" PRIu64,
+            offset, offset + count - 1);
+  curl_easy_setopt (h->c, CURLOPT_RANGE, range);
+
+  r = curl_easy_perform (h->c);
+  if (r != CURLE_OK) {
+    display_curl_error (h, r, "pread: curl_easy_perform");
+    goto err;
+  }
+
+  /* As far as I understand the cURL API, this should never happen. */
+  assert (h->write_count == 0);
+
+  put_handle (h);
+  return 0;
+
+ err:
+  put_handle (h);
+  return -1;
+}
+
+static size_t
+write_cb (char *ptr, size_t size, size_t nmemb, void *opaque)
+{
+  struct s3_handle *h = opaque;
+  size_t orig_realsize = size * nmemb;
+  size_t realsize = orig_realsize;
+
+  assert (h->write_buf);
+
+  /* Don't read more than the requested amount of data, even if the
+   * server or libcurl sends more.
+   */
+  if (realsize > h->write_count)
+    realsize = h->write_count;
+
+  memcpy (h->write_buf, ptr, realsize);
+
+  h->write_count -= realsize;
+  h->write_buf += realsize;
+
+  return orig_realsize;
+}
+
+static struct nbdkit_plugin plugin = {
+  .name              = "S3",
+  .version           = PACKAGE_VERSION,
+  .load              = s3_load,
+  .unload            = s3_unload,
+  .config            = s3_config,
+  .config_complete   = s3_config_complete,
+  .config_help       = s3_config_help,
+  .open              = s3_open,
+  .close             = s3_close,
+  .get_size          = s3_get_size,
+  .pread             = s3_pread,
+};
+
+NBDKIT_REGISTER_PLUGIN(plugin)
@@ -0,0 +1,770 @@
+/* nbdkit
+ * Copyright (C) 2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Linux block device plugin.
+ *
+ * Unlike the generic file plugin this one only serves block devices,
+ * which lets it use the device interfaces directly: the size comes
+ * from BLKGETSIZE64, trim is BLKDISCARD, zeroing is BLKZEROOUT, and
+ * reads and writes go through a per-connection io_uring, by default
+ * in SQPOLL mode so that submissions need no system call at all.
+ * Each NBD connection gets its own ring (and with SQPOLL its own
+ * kernel submission thread), so a multi-conn client's queues map
+ * one-to-one onto device submission queues.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "isaligned.h"
+#include "rounding.h"
+
+static char *device;
+static unsigned queue_depth = 128;
+static bool uring_requested = true;
+static bool sqpoll_requested = true;
+
+static void
+blockdev_unload (void)
+{
+  free (device);
+}
+
+static int
+blockdev_config (const char *key, const char *value)
+{
+  if (strcmp (key, "device") == 0) {
+    free (device);
+    device = nbdkit_realpath (value);
+    if (device == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "queue-depth") == 0) {
+    if (nbdkit_parse_unsigned ("queue-depth", value, &queue_depth) == -1)
+      return -1;
+    if (queue_depth < 1 || queue_depth > 4096) {
+      nbdkit_error ("queue-depth must be between 1 and 4096");
+      return -1;
+    }
+  }
+  else if (strcmp (key, "uring") == 0) {
+    int r = nbdkit_parse_bool (value);
+
+    if (r == -1)
+      return -1;
+    uring_requested = r;
+  }
+  else if (strcmp (key, "sqpoll") == 0) {
+    int r = nbdkit_parse_bool (value);
+
+    if (r == -1)
+      return -1;
+    sqpoll_requested = r;
+  }
+  else {
+    nbdkit_error ("unknown parameter '%s'", key);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+blockdev_config_complete (void)
+{
+  if (device == NULL) {
+    nbdkit_error ("you must supply the device=<DEVICE> parameter "
+                  "after the plugin name on the command line");
+    return -1;
+  }
+
+  return 0;
+}
+
+#define blockdev_config_help \
+  "device=<DEVICE>     (required) The block device to serve.\n" \
+  "queue-depth=<N>     io_uring submission queue depth (default 128).\n" \
+  "uring=<BOOL>        Submit reads and writes through io_uring.\n" \
+  "sqpoll=<BOOL>       Use a kernel submission queue polling thread."
+
+static void
+blockdev_dump_plugin (void)
+{
+#ifdef HAVE_LIBURING
+  printf ("blockdev_io_uring=yes\n");
+#endif
+}
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+#ifdef HAVE_LIBURING
+
+/* Per-connection io_uring, same engine as the file plugin's uring=true
+ * mode: the device descriptor is registered in the ring, a reaper
+ * thread finishes completions, and short transfers or the FUA
+ * fdatasync are pushed back into the ring as further SQEs.  With
+ * SQPOLL the kernel polls the submission queue, so after start-up
+ * submitting I/O does not enter the kernel at all.
+ */
+
+struct uring_op {
+  struct nbdkit_completion *completion;
+  void *buf;                    /* position reached so far */
+  uint32_t remaining;
+  uint64_t offset;
+  bool is_write;
+  bool fua;                     /* fdatasync after the write completes */
+  bool syncing;                 /* the in-flight SQE is the FUA fdatasync */
+};
+
+struct uring {
+  int fd;
+  struct io_uring ring;
+  pthread_mutex_t lock;         /* serializes submission queue access */
+  pthread_t reaper;
+};
+
+/* Queue one SQE for the op and push it to the kernel.  Called with
+ * u->lock held.  Returns -1 if the submission queue is full.
+ */
+static int
+uring_queue_op (struct uring *u, struct uring_op *op)
+{
+  struct io_uring_sqe *sqe;
+  int r;
+
+  sqe = io_uring_get_sqe (&u->ring);
+  if (sqe == NULL) {
+    io_uring_submit (&u->ring);
+    sqe = io_uring_get_sqe (&u->ring);
+    if (sqe == NULL)
+      return -1;
+  }
+  if (op->syncing)
+    io_uring_prep_fsync (sqe, 0, IORING_FSYNC_DATASYNC);
+  else if (op->is_write)
+    io_uring_prep_write (sqe, 0, op->buf, op->remaining, op->offset);
+  else
+    io_uring_prep_read (sqe, 0, op->buf, op->remaining, op->offset);
+  /* The 0 above is the index of the registered device descriptor.
+   * SQPOLL rings can only operate on registered files.
+   */
+  sqe->flags |= IOSQE_FIXED_FILE;
+  io_uring_sqe_set_data (sqe, op);
+
+  do
+    r = io_uring_submit (&u->ring);
+  while (r == -EINTR);
+  if (r < 0) {
+    /* The SQE stays queued and rides along with a later submission,
+     * so the op has still been handed to the ring; don't fail it.
+     */
+    errno = -r;
+    nbdkit_debug ("io_uring_submit: %m");
+  }
+  return 0;
+}
+
+/* Finish an op with plain pread/pwrite, used when the ring cannot
+ * take it (or its remainder after a short transfer).
+ */
+static void
+uring_op_finish_sync (struct uring *u, struct uring_op *op)
+{
+  int error = 0;
+
+  while (op->remaining > 0) {
+    ssize_t r;
+
+    if (op->is_write)
+      r = pwrite (u->fd, op->buf, op->remaining, op->offset);
+    else
+      r = pread (u->fd, op->buf, op->remaining, op->offset);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("%s: %m", op->is_write ? "pwrite" : "pread");
+      error = errno;
+      break;
+    }
+    if (r == 0) {
+      nbdkit_error ("pread: unexpected end of device");
+      error = EIO;
+      break;
+    }
+    op->buf += r;
+    op->remaining -= r;
+    op->offset += r;
+  }
+  if (error == 0 && op->is_write && op->fua && fdatasync (u->fd) == -1) {
+    nbdkit_error ("fdatasync: %m");
+    error = errno;
+  }
+  nbdkit_completion_complete (op->completion, error);
+  free (op);
+}
+
+/* Handle one completion: either finish the request or push its next
+ * stage (the remainder after a short transfer, or the FUA fdatasync)
+ * back into the ring.
+ */
+static void
+uring_op_advance (struct uring *u, struct uring_op *op, int res)
+{
+  if (res == -EINTR || res == -EAGAIN)
+    goto resubmit;                      /* retry the same range */
+  if (res < 0) {
+    errno = -res;
+    nbdkit_error ("%s: %m", op->syncing ? "fdatasync" :
+                  op->is_write ? "pwrite" : "pread");
+    nbdkit_completion_complete (op->completion, -res);
+    free (op);
+    return;
+  }
+  if (op->syncing) {                    /* the FUA fdatasync finished */
+    nbdkit_completion_complete (op->completion, 0);
+    free (op);
+    return;
+  }
+  if (!op->is_write && res == 0) {
+    nbdkit_error ("pread: unexpected end of device");
+    nbdkit_completion_complete (op->completion, EIO);
+    free (op);
+    return;
+  }
+  op->buf += res;
+  op->remaining -= res;
+  op->offset += res;
+  if (op->remaining == 0) {
+    if (op->is_write && op->fua) {
+      op->syncing = true;
+      goto resubmit;
+    }
+    nbdkit_completion_complete (op->completion, 0);
+    free (op);
+    return;
+  }
+
+ resubmit:
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&u->lock);
+    if (uring_queue_op (u, op) == 0)
+      return;
+  }
+  /* Could not queue the next stage; finish synchronously rather than
+   * failing a request which may have partly completed.
+   */
+  uring_op_finish_sync (u, op);
+}
+
+/* Per-connection thread which waits for completions and finishes the
+ * corresponding requests.  Exits when the handle is closed, signalled
+ * by a NOP with NULL user data.
+ */
+static void *
+uring_reaper (void *vu)
+{
+  struct uring *u = vu;
+
+  for (;;) {
+    struct io_uring_cqe *cqe;
+    struct uring_op *op;
+    int r, res;
+
+    r = io_uring_wait_cqe (&u->ring, &cqe);
+    if (r == -EINTR)
+      continue;
+    if (r < 0) {
+      errno = -r;
+      nbdkit_error ("io_uring_wait_cqe: %m");
+      return NULL;
+    }
+    op = io_uring_cqe_get_data (cqe);
+    res = cqe->res;
+    io_uring_cqe_seen (&u->ring, cqe);
+    if (op == NULL)
+      return NULL;
+    uring_op_advance (u, op, res);
+  }
+}
+
+/* Start an asynchronous read or write.  Returns -1 (without using the
+ * completion) only if nothing could be allocated.
+ */
+static int
+uring_start_op (struct uring *u, struct nbdkit_completion *completion,
+                void *buf, uint32_t count, uint64_t offset,
+                bool is_write, bool fua)
+{
+  struct uring_op *op;
+
+  op = malloc (sizeof *op);
+  if (op == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  op->completion = completion;
+  op->buf = buf;
+  op->remaining = count;
+  op->offset = offset;
+  op->is_write = is_write;
+  op->fua = fua;
+  op->syncing = false;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&u->lock);
+    if (uring_queue_op (u, op) == 0)
+      return 0;
+  }
+  /* The ring is momentarily full: run this request synchronously. */
+  uring_op_finish_sync (u, op);
+  return 0;
+}
+
+/* Create the ring for one connection, register the device descriptor,
+ * and start the reaper thread.  SQPOLL needs CAP_SYS_NICE (or root)
+ * on older kernels, so if it cannot be set up fall back to a plain
+ * ring, and if that also fails fall back to synchronous I/O.
+ */
+static struct uring *
+uring_open (int fd)
+{
+  struct uring *u;
+  struct io_uring_params params;
+  int r;
+
+  u = malloc (sizeof *u);
+  if (u == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  u->fd = fd;
+
+  memset (&params, 0, sizeof params);
+  if (sqpoll_requested) {
+    params.flags = IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = 2000; /* ms before the poller thread sleeps */
+  }
+  r = io_uring_queue_init_params (queue_depth, &u->ring, &params);
+  if (r < 0 && sqpoll_requested) {
+    errno = -r;
+    nbdkit_debug ("io_uring_queue_init_params (SQPOLL): %m "
+                  "(using a plain ring instead)");
+    memset (&params, 0, sizeof params);
+    r = io_uring_queue_init_params (queue_depth, &u->ring, &params);
+  }
+  if (r < 0) {
+    errno = -r;
+    nbdkit_debug ("io_uring_queue_init_params: %m "
+                  "(using synchronous I/O instead)");
+    free (u);
+    return NULL;
+  }
+  r = io_uring_register_files (&u->ring, &fd, 1);
+  if (r < 0) {
+    errno = -r;
+    nbdkit_debug ("io_uring_register_files: %m "
+                  "(using synchronous I/O instead)");
+    goto err;
+  }
+  pthread_mutex_init (&u->lock, NULL);
+  r = pthread_create (&u->reaper, NULL, uring_reaper, u);
+  if (r != 0) {
+    errno = r;
+    nbdkit_error ("pthread_create: %m");
+    pthread_mutex_destroy (&u->lock);
+    goto err;
+  }
+  if (params.flags & IORING_SETUP_SQPOLL)
+    nbdkit_debug ("blockdev: io_uring with SQPOLL, queue depth %u",
+                  queue_depth);
+  else
+    nbdkit_debug ("blockdev: io_uring, queue depth %u", queue_depth);
+  return u;
+
+ err:
+  io_uring_queue_exit (&u->ring);
+  free (u);
+  return NULL;
+}
+
+/* Stop the reaper thread and free the ring.  The server has already
+ * drained any asynchronous operations in flight on this handle.
+ */
+static void
+uring_close (struct uring *u)
+{
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&u->lock);
+    struct io_uring_sqe *sqe = io_uring_get_sqe (&u->ring);
+
+    assert (sqe != NULL);       /* nothing is in flight */
+    io_uring_prep_nop (sqe);
+    io_uring_sqe_set_data (sqe, NULL);
+    io_uring_submit (&u->ring);
+  }
+  pthread_join (u->reaper, NULL);
+  io_uring_queue_exit (&u->ring);
+  pthread_mutex_destroy (&u->lock);
+  free (u);
+}
+
+#endif /* HAVE_LIBURING */
+
+struct handle {
+  int fd;
+  int64_t size;
+  unsigned sector_size;
+  bool can_discard;
+#ifdef HAVE_LIBURING
+  struct uring *uring;          /* NULL means synchronous I/O */
+#endif
+};
+
+static void *
+blockdev_open (int readonly)
+{
+  struct handle *h;
+  struct stat statbuf;
+  uint64_t size;
+  int flags;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  flags = O_CLOEXEC | O_NOCTTY;
+  if (readonly)
+    flags |= O_RDONLY;
+  else
+    flags |= O_RDWR;
+  h->fd = open (device, flags);
+  if (h->fd == -1) {
+    nbdkit_error ("open: %s: %m", device);
+    free (h);
+    return NULL;
+  }
+
+  if (fstat (h->fd, &statbuf) == -1) {
+    nbdkit_error ("fstat: %s: %m", device);
+    goto err;
+  }
+  if (!S_ISBLK (statbuf.st_mode)) {
+    nbdkit_error ("%s: not a block device, use nbdkit-file-plugin for "
+                  "regular files", device);
+    goto err;
+  }
+
+  if (ioctl (h->fd, BLKGETSIZE64, &size) == -1) {
+    nbdkit_error ("ioctl: BLKGETSIZE64: %s: %m", device);
+    goto err;
+  }
+  h->size = size;
+
+  h->sector_size = 512;
+  if (ioctl (h->fd, BLKSSZGET, &h->sector_size) == -1)
+    nbdkit_debug ("cannot get sector size: %s: %m", device);
+
+  h->can_discard = true;        /* disabled on the first EOPNOTSUPP */
+
+#ifdef HAVE_LIBURING
+  h->uring = NULL;
+  if (uring_requested)
+    h->uring = uring_open (h->fd);
+#endif
+
+  return h;
+
+ err:
+  close (h->fd);
+  free (h);
+  return NULL;
+}
+
+static void
+blockdev_close (void *handle)
+{
+  struct handle *h = handle;
+
+#ifdef HAVE_LIBURING
+  if (h->uring)
+    uring_close (h->uring);
+#endif
+  close (h->fd);
+  free (h);
+}
+
+static int64_t
+blockdev_get_size (void *handle)
+{
+  struct handle *h = handle;
+
+  return h->size;
+}
+
+/* The kernel serializes access to the device, so parallel connections
+ * from one client are safe.
+ */
+static int
+blockdev_can_multi_conn (void *handle)
+{
+  return 1;
+}
+
+static int
+blockdev_can_trim (void *handle)
+{
+  return 1;
+}
+
+static int
+blockdev_can_fua (void *handle)
+{
+  return NBDKIT_FUA_NATIVE;
+}
+
+static int
+blockdev_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+                uint32_t flags)
+{
+  struct handle *h = handle;
+
+  while (count > 0) {
+    ssize_t r = pread (h->fd, buf, count, offset);
+
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("pread: %m");
+      return -1;
+    }
+    if (r == 0) {
+      nbdkit_error ("pread: unexpected end of device");
+      errno = EIO;
+      return -1;
+    }
+    buf += r;
+    count -= r;
+    offset += r;
+  }
+
+  return 0;
+}
+
+static int
+blockdev_flush (void *handle, uint32_t flags)
+{
+  struct handle *h = handle;
+
+  if (fdatasync (h->fd) == -1) {
+    nbdkit_error ("fdatasync: %m");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+blockdev_pwrite (void *handle, const void *buf, uint32_t count,
+                 uint64_t offset, uint32_t flags)
+{
+  struct handle *h = handle;
+
+  while (count > 0) {
+    ssize_t r = pwrite (h->fd, buf, count, offset);
+
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("pwrite: %m");
+      return -1;
+    }
+    buf += r;
+    count -= r;
+    offset += r;
+  }
+
+  if ((flags & NBDKIT_FLAG_FUA) && blockdev_flush (handle, 0) == -1)
+    return -1;
+
+  return 0;
+}
+
+#ifdef HAVE_LIBURING
+
+static int
+blockdev_pread_async (void *handle, void *buf, uint32_t count,
+                      uint64_t offset, uint32_t flags,
+                      struct nbdkit_completion *completion)
+{
+  struct handle *h = handle;
+
+  if (h->uring == NULL) {
+    int r = blockdev_pread (handle, buf, count, offset, flags);
+    nbdkit_completion_complete (completion,
+                                r == -1 ? (errno ? errno : EIO) : 0);
+    return 0;
+  }
+  return uring_start_op (h->uring, completion, buf, count, offset,
+                         false, false);
+}
+
+static int
+blockdev_pwrite_async (void *handle, const void *buf, uint32_t count,
+                       uint64_t offset, uint32_t flags,
+                       struct nbdkit_completion *completion)
+{
+  struct handle *h = handle;
+
+  if (h->uring == NULL) {
+    int r = blockdev_pwrite (handle, buf, count, offset, flags);
+    nbdkit_completion_complete (completion,
+                                r == -1 ? (errno ? errno : EIO) : 0);
+    return 0;
+  }
+  return uring_start_op (h->uring, completion, (void *) buf, count, offset,
+                         true, !!(flags & NBDKIT_FLAG_FUA));
+}
+
+#endif /* HAVE_LIBURING */
+
+/* Discard the range.  Trim is advisory, so the unaligned head and
+ * tail of the range (the device only discards whole sectors) and
+ * devices without discard support are silently ignored.
+ */
+static int
+blockdev_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  struct handle *h = handle;
+  uint64_t start = ROUND_UP (offset, h->sector_size);
+  uint64_t end = ROUND_DOWN (offset + count, h->sector_size);
+
+  if (h->can_discard && end > start) {
+    uint64_t range[2] = { start, end - start };
+
+    if (ioctl (h->fd, BLKDISCARD, range) == -1) {
+      if (errno != EOPNOTSUPP) {
+        nbdkit_error ("ioctl: BLKDISCARD: %m");
+        return -1;
+      }
+      nbdkit_debug ("%s: device does not support discard", device);
+      h->can_discard = false;
+    }
+  }
+
+  if ((flags & NBDKIT_FLAG_FUA) && blockdev_flush (handle, 0) == -1)
+    return -1;
+
+  return 0;
+}
+
+/* Zero the range with BLKZEROOUT if it is sector-aligned, otherwise
+ * tell nbdkit to fall back to writing zeroes.
+ */
+static int
+blockdev_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  struct handle *h = handle;
+  uint64_t range[2] = { offset, count };
+
+  if (!IS_ALIGNED (offset, h->sector_size) ||
+      !IS_ALIGNED (count, h->sector_size)) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+
+  if (ioctl (h->fd, BLKZEROOUT, range) == -1) {
+    if (errno == EOPNOTSUPP)
+      return -1;                /* nbdkit writes zeroes instead */
+    nbdkit_error ("ioctl: BLKZEROOUT: %m");
+    return -1;
+  }
+
+  if ((flags & NBDKIT_FLAG_FUA) && blockdev_flush (handle, 0) == -1)
+    return -1;
+
+  return 0;
+}
+
+static struct nbdkit_plugin plugin = {
+  .name              = "blockdev",
+  .longname          = "nbdkit block device plugin",
+  .version           = PACKAGE_VERSION,
+  .unload            = blockdev_unload,
+  .config            = blockdev_config,
+  .config_complete   = blockdev_config_complete,
+  .config_help       = blockdev_config_help,
+  .magic_config_key  = "device",
+  .dump_plugin       = blockdev_dump_plugin,
+  .open              = blockdev_open,
+  .close             = blockdev_close,
+  .get_size          = blockdev_get_size,
+  .can_multi_conn    = blockdev_can_multi_conn,
+  .can_trim          = blockdev_can_trim,
+  .can_fua           = blockdev_can_fua,
+  .pread             = blockdev_pread,
+  .pwrite            = blockdev_pwrite,
+#ifdef HAVE_LIBURING
+  .pread_async       = blockdev_pread_async,
+  .pwrite_async      = blockdev_pwrite_async,
+#endif
+  .flush             = blockdev_flush,
+  .trim              = blockdev_trim,
+  .zero              = blockdev_zero,
+  .errno_is_preserved = 1,
+};
+
+NBDKIT_REGISTER_PLUGIN (plugin)
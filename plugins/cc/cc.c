@@ -35,10 +35,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <dlfcn.h>
+#include <sys/stat.h>
 
 #define NBDKIT_API_VERSION 2
 #include <nbdkit-plugin.h>
@@ -65,6 +68,236 @@ static string_vector params = empty_vector;
 static void *dl;
 static struct nbdkit_plugin subplugin;
 
+/* Cache of compiled plugins, in $XDG_CACHE_HOME/nbdkit/cc (or
+ * ~/.cache/nbdkit/cc).  The cache key is the complete input of the
+ * compilation: the source plus the compiler and flags.  A 64-bit hash
+ * of the key picks the file names, and the full key is stored next to
+ * the cached binary and compared on lookup, so a hash collision can
+ * never load the wrong plugin, it just misses the cache.  Caching is
+ * best-effort: if the cache cannot be used we simply compile.
+ */
+static char *cache_so;          /* cached .so, NULL if cache unusable */
+static char *cache_keyfile;     /* the stored key next to it */
+
+/* FNV-1a. */
+static uint64_t
+hash_key (const char *buf, size_t len)
+{
+  uint64_t h = UINT64_C (0xcbf29ce484222325);
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    h ^= (unsigned char) buf[i];
+    h *= UINT64_C (0x100000001b3);
+  }
+  return h;
+}
+
+/* Read a whole file into memory.  Returns NULL on any failure. */
+static char *
+read_whole_file (const char *filename, size_t *len_rtn)
+{
+  FILE *fp;
+  char *buf = NULL;
+  size_t len = 0, n;
+  char block[BUFSIZ];
+
+  fp = fopen (filename, "r");
+  if (fp == NULL)
+    return NULL;
+  while ((n = fread (block, 1, sizeof block, fp)) > 0) {
+    char *new_buf = realloc (buf, len + n);
+
+    if (new_buf == NULL) {
+      fclose (fp);
+      free (buf);
+      return NULL;
+    }
+    buf = new_buf;
+    memcpy (buf + len, block, n);
+    len += n;
+  }
+  if (ferror (fp)) {
+    fclose (fp);
+    free (buf);
+    return NULL;
+  }
+  fclose (fp);
+  *len_rtn = len;
+  return buf;
+}
+
+/* Construct the cache key: compiler, flags and the program source. */
+static char *
+build_cache_key (size_t *keylen)
+{
+  char *key = NULL;
+  size_t len = 0, srclen;
+  FILE *fp;
+  CLEANUP_FREE char *source = NULL;
+
+  source = read_whole_file (script, &srclen);
+  if (source == NULL)
+    return NULL;
+
+  fp = open_memstream (&key, &len);
+  if (fp == NULL)
+    return NULL;
+  fprintf (fp, "CC=%s\nCFLAGS=%s\nEXTRA_CFLAGS=%s\n",
+           cc, cflags, extra_cflags ? : "");
+  fwrite (source, 1, srclen, fp);
+  if (fclose (fp) == EOF) {
+    free (key);
+    return NULL;
+  }
+  *keylen = len;
+  return key;
+}
+
+/* Work out the cache file names, creating the cache directory.  On
+ * failure cache_so is left NULL and caching is disabled.
+ */
+static void
+set_up_cache (const char *key, size_t keylen)
+{
+  CLEANUP_FREE char *dir = NULL;
+  const char *base;
+  uint64_t h;
+
+  base = getenv ("XDG_CACHE_HOME");
+  if (base != NULL && base[0] != '\0') {
+    if (asprintf (&dir, "%s/nbdkit/cc", base) == -1)
+      return;
+  }
+  else {
+    base = getenv ("HOME");
+    if (base == NULL || base[0] == '\0') {
+      nbdkit_debug ("cc: neither XDG_CACHE_HOME nor HOME is set, "
+                    "not caching the compiled plugin");
+      return;
+    }
+    if (asprintf (&dir, "%s/.cache/nbdkit/cc", base) == -1)
+      return;
+  }
+
+  /* Create the cache directory and any missing parents. */
+  {
+    char *p = dir + 1;
+
+    for (;;) {
+      p = strchr (p, '/');
+      if (p != NULL)
+        *p = '\0';
+      if (mkdir (dir, 0700) == -1 && errno != EEXIST)
+        return;
+      if (p == NULL)
+        break;
+      *p++ = '/';
+    }
+  }
+
+  h = hash_key (key, keylen);
+  if (asprintf (&cache_so, "%s/%016" PRIx64 ".so", dir, h) == -1) {
+    cache_so = NULL;
+    return;
+  }
+  if (asprintf (&cache_keyfile, "%s/%016" PRIx64 ".key", dir, h) == -1) {
+    free (cache_so);
+    cache_so = NULL;
+    cache_keyfile = NULL;
+  }
+}
+
+/* Does the cache contain a plugin compiled from the same key? */
+static bool
+cache_is_valid (const char *key, size_t keylen)
+{
+  CLEANUP_FREE char *stored = NULL;
+  size_t storedlen;
+
+  if (cache_so == NULL)
+    return false;
+  if (access (cache_so, R_OK) == -1)
+    return false;
+  stored = read_whole_file (cache_keyfile, &storedlen);
+  if (stored == NULL)
+    return false;
+  return storedlen == keylen && memcmp (stored, key, keylen) == 0;
+}
+
+/* Copy the freshly compiled plugin into the cache.  Both files are
+ * published with rename so concurrent nbdkit instances always see
+ * either nothing or a complete entry; the binary goes first because
+ * lookups require a matching key file.  Best-effort: all failures are
+ * ignored.
+ */
+static void
+store_in_cache (const char *sofile, const char *key, size_t keylen)
+{
+  CLEANUP_FREE char *tmp = NULL;
+  CLEANUP_FREE char *so = NULL;
+  size_t solen;
+  FILE *fp;
+  int fd;
+
+  if (cache_so == NULL)
+    return;
+
+  so = read_whole_file (sofile, &solen);
+  if (so == NULL)
+    return;
+
+  if (asprintf (&tmp, "%s.XXXXXX", cache_so) == -1)
+    return;
+  fd = mkstemp (tmp);
+  if (fd == -1)
+    return;
+  fp = fdopen (fd, "w");
+  if (fp == NULL) {
+    close (fd);
+    unlink (tmp);
+    return;
+  }
+  if (fwrite (so, 1, solen, fp) != solen) {
+    fclose (fp);
+    unlink (tmp);
+    return;
+  }
+  if (fclose (fp) == EOF) {
+    unlink (tmp);
+    return;
+  }
+  if (rename (tmp, cache_so) == -1) {
+    unlink (tmp);
+    return;
+  }
+
+  free (tmp);
+  tmp = NULL;
+  if (asprintf (&tmp, "%s.XXXXXX", cache_keyfile) == -1)
+    return;
+  fd = mkstemp (tmp);
+  if (fd == -1)
+    return;
+  fp = fdopen (fd, "w");
+  if (fp == NULL) {
+    close (fd);
+    unlink (tmp);
+    return;
+  }
+  if (fwrite (key, 1, keylen, fp) != keylen) {
+    fclose (fp);
+    unlink (tmp);
+    return;
+  }
+  if (fclose (fp) == EOF) {
+    unlink (tmp);
+    return;
+  }
+  if (rename (tmp, cache_keyfile) == -1)
+    unlink (tmp);
+}
+
 static void
 cc_unload (void)
 {
@@ -77,6 +310,8 @@ cc_unload (void)
     dlclose (dl);
   free (params.ptr);
   free (script);
+  free (cache_so);
+  free (cache_keyfile);
 }
 
 static void
@@ -185,7 +420,8 @@ static int
 cc_config_complete (void)
 {
   CLEANUP_FREE char *command = NULL;
-  size_t len = 0, size, i;
+  CLEANUP_FREE char *key = NULL;
+  size_t len = 0, keylen = 0, size, i;
   FILE *fp;
   int fd, r;
   char tmpfile[] = "/tmp/ccXXXXXX.so";
@@ -198,45 +434,68 @@ cc_config_complete (void)
     return -1;
   }
 
-  /* Create a temporary file to store the compiled plugin. */
-  fd = mkstemps (tmpfile, 3);
-  if (fd == -1) {
-    nbdkit_error ("mkstemps: %m");
-    return -1;
+  /* If a plugin compiled from the same source with the same compiler
+   * and flags is in the cache, load it and skip the compiler
+   * entirely.
+   */
+  key = build_cache_key (&keylen);
+  if (key != NULL) {
+    set_up_cache (key, keylen);
+    if (cache_is_valid (key, keylen)) {
+      nbdkit_debug ("cc: loading cached plugin %s", cache_so);
+      dl = dlopen (cache_so, RTLD_NOW);
+      if (dl == NULL)
+        /* eg. a cached plugin built against a library since removed.
+         * Not fatal, recompile below and overwrite the cache entry.
+         */
+        nbdkit_debug ("cc: cannot open the cached plugin: %s", dlerror ());
+    }
   }
-  close (fd);
 
-  /* Compile the C program. */
-  fp = open_memstream (&command, &len);
-  if (fp == NULL) {
-    nbdkit_error ("open_memstream: %m");
-    return -1;
-  }
-  /* The C compiler and C flags don't need to be quoted. */
-  fprintf (fp, "%s %s ", cc, cflags);
-  if (extra_cflags)
-    fprintf (fp, "%s ", extra_cflags);
-  shell_quote (script, fp);
-  fprintf (fp, " -o ");
-  shell_quote (tmpfile, fp);
-  if (fclose (fp) == EOF) {
-    nbdkit_error ("memstream failed: %m");
-    return -1;
-  }
+  if (dl == NULL) {
+    /* Create a temporary file to store the compiled plugin. */
+    fd = mkstemps (tmpfile, 3);
+    if (fd == -1) {
+      nbdkit_error ("mkstemps: %m");
+      return -1;
+    }
+    close (fd);
 
-  nbdkit_debug ("cc: %s", command);
-  r = system (command);
-  if (exit_status_to_nbd_error (r, cc) == -1) {
-    unlink (tmpfile);
-    return -1;
-  }
+    /* Compile the C program. */
+    fp = open_memstream (&command, &len);
+    if (fp == NULL) {
+      nbdkit_error ("open_memstream: %m");
+      return -1;
+    }
+    /* The C compiler and C flags don't need to be quoted. */
+    fprintf (fp, "%s %s ", cc, cflags);
+    if (extra_cflags)
+      fprintf (fp, "%s ", extra_cflags);
+    shell_quote (script, fp);
+    fprintf (fp, " -o ");
+    shell_quote (tmpfile, fp);
+    if (fclose (fp) == EOF) {
+      nbdkit_error ("memstream failed: %m");
+      return -1;
+    }
 
-  /* Load the subplugin. */
-  dl = dlopen (tmpfile, RTLD_NOW);
-  unlink (tmpfile);
-  if (dl == NULL) {
-    nbdkit_error ("cannot open the compiled plugin: %s", dlerror ());
-    return -1;
+    nbdkit_debug ("cc: %s", command);
+    r = system (command);
+    if (exit_status_to_nbd_error (r, cc) == -1) {
+      unlink (tmpfile);
+      return -1;
+    }
+
+    if (key != NULL)
+      store_in_cache (tmpfile, key, keylen);
+
+    /* Load the subplugin. */
+    dl = dlopen (tmpfile, RTLD_NOW);
+    unlink (tmpfile);
+    if (dl == NULL) {
+      nbdkit_error ("cannot open the compiled plugin: %s", dlerror ());
+      return -1;
+    }
   }
 
   /* Now we basically behave like core nbdkit when it loads a plugin. */
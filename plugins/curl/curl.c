@@ -40,17 +40,27 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <string.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
 
+#if defined (__linux__) && !defined (FALLOC_FL_PUNCH_HOLE)
+#include <linux/falloc.h>   /* For FALLOC_FL_*, glibc < 2.18 */
+#endif
+
+#include <pthread.h>
+
 #include <curl/curl.h>
 
 #include <nbdkit-plugin.h>
 
 #include "ascii-ctype.h"
 #include "ascii-string.h"
+#include "bitmap.h"
 #include "cleanup.h"
+#include "minmax.h"
+#include "rounding.h"
 
 #include "curldefs.h"
 
@@ -61,13 +71,23 @@
 #if CURL_AT_LEAST_VERSION(7, 55, 0)
 #define HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
 #endif
+/* The multi=true engine needs curl_multi_poll and curl_multi_wakeup
+ * (7.68, Jan 2020).
+ */
+#if CURL_AT_LEAST_VERSION(7, 68, 0)
+#define HAVE_CURL_MULTI_ENGINE
+#endif
 #endif
 
 /* Plugin configuration. */
 const char *url = NULL;         /* required */
 
+char *cache_path = NULL;
+uint64_t cache_max_size = 0;
 const char *cainfo = NULL;
 const char *capath = NULL;
+unsigned connections = 4;
+static bool multi = false;
 char *cookie = NULL;
 const char *cookie_script = NULL;
 unsigned cookie_script_renew = 0;
@@ -102,9 +122,20 @@ curl_load (void)
   }
 }
 
+static void free_all_handles (void);
+static void cache_close (void);
+#ifdef HAVE_CURL_MULTI_ENGINE
+static void multi_shutdown (void);
+#endif
+
 static void
 curl_unload (void)
 {
+#ifdef HAVE_CURL_MULTI_ENGINE
+  multi_shutdown ();
+#endif
+  cache_close ();
+  free_all_handles ();
   free (cookie);
   if (headers)
     curl_slist_free_all (headers);
@@ -196,7 +227,22 @@ curl_config (const char *key, const char *value)
 {
   int r;
 
-  if (strcmp (key, "cainfo") == 0) {
+  if (strcmp (key, "cache") == 0) {
+    free (cache_path);
+    cache_path = nbdkit_absolute_path (value);
+    if (cache_path == NULL)
+      return -1;
+  }
+
+  else if (strcmp (key, "cache-max-size") == 0) {
+    int64_t bytes = nbdkit_parse_size (value);
+
+    if (bytes == -1)
+      return -1;
+    cache_max_size = bytes;
+  }
+
+  else if (strcmp (key, "cainfo") == 0) {
     cainfo = value;
   }
 
@@ -204,6 +250,22 @@ curl_config (const char *key, const char *value)
     capath =  value;
   }
 
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections == 0) {
+      nbdkit_error ("connections parameter must not be 0");
+      return -1;
+    }
+  }
+
+  else if (strcmp (key, "multi") == 0) {
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    multi = r;
+  }
+
   else if (strcmp (key, "cookie") == 0) {
     free (cookie);
     if (nbdkit_read_password (value, &cookie) == -1)
@@ -343,23 +405,39 @@ curl_config_complete (void)
     return -1;
   }
 
+#ifndef HAVE_CURL_MULTI_ENGINE
+  if (multi) {
+    nbdkit_error ("multi=true requires libcurl >= 7.68.0");
+    return -1;
+  }
+#endif
+
   if (!cookie_script && cookie_script_renew) {
     nbdkit_error ("cookie-script-renew cannot be used without cookie-script");
     return -1;
   }
 
+  if (!cache_path && cache_max_size) {
+    nbdkit_error ("cache-max-size cannot be used without cache");
+    return -1;
+  }
+
   return 0;
 }
 
 #define curl_config_help \
+  "cache=<FILE>               Cache downloaded ranges in this file.\n" \
+  "cache-max-size=<SIZE>      Limit on the size of the cache file.\n" \
   "cainfo=<CAINFO>            Path to Certificate Authority file.\n" \
   "capath=<CAPATH>            Path to directory with CA certificates.\n" \
+  "connections=<N>            Number of pooled curl handles.\n" \
   "cookie=<COOKIE>            Set HTTP/HTTPS cookies.\n" \
   "cookie-script=<SCRIPT>     Script to set HTTP/HTTPS cookies.\n" \
   "cookie-script-renew=<SECS> Time to renew HTTP/HTTPS cookies.\n" \
   "header=<HEADER>            Set HTTP/HTTPS header.\n" \
   "header-script=<SCRIPT>     Script to set HTTP/HTTPS headers.\n" \
   "header-script-renew=<SECS> Time to renew HTTP/HTTPS headers.\n" \
+  "multi=true                 Multiplex requests over shared connections.\n" \
   "password=<PASSWORD>        The password for the user account.\n" \
   "protocols=PROTO,PROTO,..   Limit protocols allowed.\n" \
   "proxy=<PROXY>              Set proxy URL.\n" \
@@ -387,9 +465,21 @@ static size_t header_cb (void *ptr, size_t size, size_t nmemb, void *opaque);
 static size_t write_cb (char *ptr, size_t size, size_t nmemb, void *opaque);
 static size_t read_cb (void *ptr, size_t size, size_t nmemb, void *opaque);
 
-/* Create the per-connection handle. */
-static void *
-curl_open (int readonly)
+/* Cache of the size/capability probe.  Only the first handle created
+ * issues a HEAD request; any handle allocated after that reuses the
+ * answer.  The URL cannot change while the plugin is running.
+ */
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool probed = false;
+static int64_t probed_exportsize;
+static bool probed_accept_range;
+
+/* Allocate a new curl easy handle for the pool, performing the
+ * initial HEAD request to fetch the size of the URL (only for the
+ * first handle, see above).
+ */
+static struct curl_handle *
+allocate_handle (void)
 {
   struct curl_handle *h;
   CURLcode r;
@@ -487,76 +577,101 @@ curl_open (int readonly)
     curl_easy_setopt (h->c, CURLOPT_USERNAME, user);
   if (user_agent)
     curl_easy_setopt (h->c, CURLOPT_USERAGENT, user_agent);
+#ifdef HAVE_CURL_MULTI_ENGINE
+  if (multi)
+    /* Prefer adding a stream to an existing multiplexed connection
+     * over opening a new connection.
+     */
+    curl_easy_setopt (h->c, CURLOPT_PIPEWAIT, 1L);
+#endif
 
   /* Get the file size and also whether the remote HTTP server
-   * supports byte ranges.
+   * supports byte ranges.  These cannot change for the lifetime of
+   * the plugin, so the result of the first probe is cached and
+   * further handles (however many connections are opened) do not
+   * re-issue the HEAD request.
    *
    * We must run the scripts if necessary and set headers in the
    * handle.
    */
-  if (do_scripts (h) == -1) goto err;
-  h->accept_range = false;
-  curl_easy_setopt (h->c, CURLOPT_NOBODY, 1); /* No Body, not nobody! */
-  curl_easy_setopt (h->c, CURLOPT_HEADERFUNCTION, header_cb);
-  curl_easy_setopt (h->c, CURLOPT_HEADERDATA, h);
-  r = curl_easy_perform (h->c);
-  if (r != CURLE_OK) {
-    display_curl_error (h, r,
-                        "problem doing HEAD request to fetch size of URL [%s]",
-                        url);
-    goto err;
-  }
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&probe_lock);
+
+    if (probed) {
+      h->exportsize = probed_exportsize;
+      h->accept_range = probed_accept_range;
+      goto probe_done;
+    }
+
+    if (do_scripts (h) == -1) goto err;
+    h->accept_range = false;
+    curl_easy_setopt (h->c, CURLOPT_NOBODY, 1); /* No Body, not nobody! */
+    curl_easy_setopt (h->c, CURLOPT_HEADERFUNCTION, header_cb);
+    curl_easy_setopt (h->c, CURLOPT_HEADERDATA, h);
+    r = curl_easy_perform (h->c);
+    if (r != CURLE_OK) {
+      display_curl_error (h, r,
+                          "problem doing HEAD request to fetch size of URL "
+                          "[%s]", url);
+      goto err;
+    }
 
 #ifdef HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
-  r = curl_easy_getinfo (h->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &o);
-  if (r != CURLE_OK) {
-    display_curl_error (h, r, "could not get length of remote file [%s]", url);
-    goto err;
-  }
+    r = curl_easy_getinfo (h->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &o);
+    if (r != CURLE_OK) {
+      display_curl_error (h, r, "could not get length of remote file [%s]",
+                          url);
+      goto err;
+    }
 
-  if (o == -1) {
-    nbdkit_error ("could not get length of remote file [%s], "
-                  "is the URL correct?", url);
-    goto err;
-  }
+    if (o == -1) {
+      nbdkit_error ("could not get length of remote file [%s], "
+                    "is the URL correct?", url);
+      goto err;
+    }
 
-  h->exportsize = o;
+    h->exportsize = o;
 #else
-  r = curl_easy_getinfo (h->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d);
-  if (r != CURLE_OK) {
-    display_curl_error (h, r, "could not get length of remote file [%s]", url);
-    goto err;
-  }
+    r = curl_easy_getinfo (h->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d);
+    if (r != CURLE_OK) {
+      display_curl_error (h, r, "could not get length of remote file [%s]",
+                          url);
+      goto err;
+    }
 
-  if (d == -1) {
-    nbdkit_error ("could not get length of remote file [%s], "
-                  "is the URL correct?", url);
-    goto err;
-  }
+    if (d == -1) {
+      nbdkit_error ("could not get length of remote file [%s], "
+                    "is the URL correct?", url);
+      goto err;
+    }
 
-  h->exportsize = d;
+    h->exportsize = d;
 #endif
-  nbdkit_debug ("content length: %" PRIi64, h->exportsize);
+    nbdkit_debug ("content length: %" PRIi64, h->exportsize);
 
-  if (ascii_strncasecmp (url, "http://", strlen ("http://")) == 0 ||
-      ascii_strncasecmp (url, "https://", strlen ("https://")) == 0) {
-    if (!h->accept_range) {
-      nbdkit_error ("server does not support 'range' (byte range) requests");
-      goto err;
+    if (ascii_strncasecmp (url, "http://", strlen ("http://")) == 0 ||
+        ascii_strncasecmp (url, "https://", strlen ("https://")) == 0) {
+      if (!h->accept_range) {
+        nbdkit_error ("server does not support 'range' (byte range) requests");
+        goto err;
+      }
+
+      nbdkit_debug ("accept range supported (for HTTP/HTTPS)");
     }
 
-    nbdkit_debug ("accept range supported (for HTTP/HTTPS)");
+    probed_exportsize = h->exportsize;
+    probed_accept_range = h->accept_range;
+    probed = true;
   }
+ probe_done:
 
   /* Get set up for reading and writing. */
   curl_easy_setopt (h->c, CURLOPT_HEADERFUNCTION, NULL);
   curl_easy_setopt (h->c, CURLOPT_HEADERDATA, NULL);
   curl_easy_setopt (h->c, CURLOPT_WRITEFUNCTION, write_cb);
   curl_easy_setopt (h->c, CURLOPT_WRITEDATA, h);
-  if (!readonly) {
-    curl_easy_setopt (h->c, CURLOPT_READFUNCTION, read_cb);
-    curl_easy_setopt (h->c, CURLOPT_READDATA, h);
-  }
+  curl_easy_setopt (h->c, CURLOPT_READFUNCTION, read_cb);
+  curl_easy_setopt (h->c, CURLOPT_READDATA, h);
 
   return h;
 
@@ -567,6 +682,476 @@ curl_open (int readonly)
   return NULL;
 }
 
+static void
+free_handle (struct curl_handle *h)
+{
+  curl_easy_cleanup (h->c);
+  if (h->headers_copy)
+    curl_slist_free_all (h->headers_copy);
+  free (h);
+}
+
+/* The pool of curl easy handles.  Each easy handle can only process
+ * one request at a time, so to let requests overlap (the thread model
+ * is parallel) every request borrows a handle from this pool for its
+ * duration.  Handles are created on demand up to the limit set by the
+ * connections parameter; when all are busy, requests wait their turn.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct curl_handle *free_handles = NULL;
+static unsigned nr_handles = 0;
+
+static struct curl_handle *
+get_handle (void)
+{
+  struct curl_handle *h;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+    for (;;) {
+      if (free_handles != NULL) {
+        h = free_handles;
+        free_handles = h->next;
+        return h;
+      }
+      if (nr_handles < connections) {
+        /* Reserve a slot before dropping the lock to allocate, so
+         * that we never create more than the configured number of
+         * handles.
+         */
+        nr_handles++;
+        break;
+      }
+      pthread_cond_wait (&pool_cond, &pool_lock);
+    }
+  }
+
+  /* Allocating performs the initial HEAD request so must be done
+   * without holding the lock.
+   */
+  h = allocate_handle ();
+  if (h == NULL) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+    nr_handles--;
+    pthread_cond_signal (&pool_cond);
+  }
+  return h;
+}
+
+static void
+put_handle (struct curl_handle *h)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+  h->next = free_handles;
+  free_handles = h;
+  pthread_cond_signal (&pool_cond);
+}
+
+/* Called from curl_unload.  At this point no connections are open so
+ * every handle is back on the free list.
+ */
+static void
+free_all_handles (void)
+{
+  struct curl_handle *h, *next;
+
+  for (h = free_handles; h != NULL; h = next) {
+    next = h->next;
+    free_handle (h);
+  }
+  free_handles = NULL;
+  nr_handles = 0;
+}
+
+/* The shared download cache (cache=FILE).  Ranges fetched from the
+ * remote server are copied into a local sparse file, shared by all
+ * connections, and consulted before any HTTP request is made.  When
+ * many clients read the same image the origin is only asked for each
+ * block once.
+ *
+ * The cache is managed in fixed-size blocks.  A bitmap records which
+ * blocks are present; a second bitmap records blocks currently being
+ * fetched, so concurrent readers of the same block wait for the first
+ * fetch instead of issuing a duplicate request.  If cache-max-size is
+ * set, a clock hand evicts blocks (punching holes so the disk space
+ * is returned) once the budget is exceeded.
+ *
+ * Which blocks are present is saved in FILE.map at exit, so a later
+ * nbdkit serving the same URL starts with a warm cache.  The map
+ * records the URL and export size and is discarded if either changed.
+ */
+#define CACHE_BLKSIZE 65536
+
+#define CACHE_MAP_MAGIC "nbdkit-curl-cache 1"
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static int cache_fd = -1;
+static struct bitmap cache_bm;       /* Blocks present in the cache. */
+static struct bitmap cache_inflight; /* Blocks being fetched now. */
+static uint64_t cache_exportsize;
+static uint64_t cache_nr_blocks;     /* Number of bits set in cache_bm. */
+static uint64_t cache_clock;         /* Eviction hand. */
+static uint64_t cache_hits, cache_misses;
+
+/* Read or write the cache file, handling short transfers. */
+static int
+cache_file_pread (char *buf, uint32_t count, uint64_t offset)
+{
+  while (count > 0) {
+    ssize_t r = pread (cache_fd, buf, count, offset);
+    if (r == -1) {
+      nbdkit_error ("pread: %s: %m", cache_path);
+      return -1;
+    }
+    if (r == 0) {
+      nbdkit_error ("pread: %s: unexpected end of file", cache_path);
+      return -1;
+    }
+    buf += r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+static int
+cache_file_pwrite (const char *buf, uint32_t count, uint64_t offset)
+{
+  while (count > 0) {
+    ssize_t r = pwrite (cache_fd, buf, count, offset);
+    if (r == -1) {
+      nbdkit_error ("pwrite: %s: %m", cache_path);
+      return -1;
+    }
+    buf += r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+/* Load the bitmap saved by a previous run, if it is usable.  A
+ * missing or stale map is not an error, the cache just starts cold.
+ */
+static void
+cache_load_map (void)
+{
+  CLEANUP_FREE char *mapfile = NULL;
+  FILE *fp;
+  char magic[64], mapurl[4096];
+  uint64_t mapsize, mapblksize;
+  uint64_t blk, nr_blks;
+
+  if (asprintf (&mapfile, "%s.map", cache_path) == -1)
+    return;
+  fp = fopen (mapfile, "r");
+  if (fp == NULL)
+    return;
+
+  if (fscanf (fp, "%63[^\n]\n%4095[^\n]\n%" SCNu64 " %" SCNu64 "\n",
+              magic, mapurl, &mapsize, &mapblksize) != 4 ||
+      strcmp (magic, CACHE_MAP_MAGIC) != 0 ||
+      strcmp (mapurl, url) != 0 ||
+      mapsize != cache_exportsize ||
+      mapblksize != CACHE_BLKSIZE) {
+    nbdkit_debug ("curl: ignoring stale cache map %s", mapfile);
+    fclose (fp);
+    return;
+  }
+
+  if (fread (cache_bm.bitmap, 1, cache_bm.size, fp) != cache_bm.size) {
+    nbdkit_debug ("curl: ignoring truncated cache map %s", mapfile);
+    memset (cache_bm.bitmap, 0, cache_bm.size);
+    fclose (fp);
+    return;
+  }
+  fclose (fp);
+
+  nr_blks = DIV_ROUND_UP (cache_exportsize, CACHE_BLKSIZE);
+  for (blk = 0; blk < nr_blks; ++blk)
+    cache_nr_blocks += bitmap_get_blk (&cache_bm, blk, 0);
+  nbdkit_debug ("curl: cache starts warm with %" PRIu64 " block(s)",
+                cache_nr_blocks);
+}
+
+/* Save the bitmap so the next run can reuse the cache file. */
+static void
+cache_save_map (void)
+{
+  CLEANUP_FREE char *mapfile = NULL;
+  FILE *fp;
+
+  if (asprintf (&mapfile, "%s.map", cache_path) == -1)
+    return;
+  fp = fopen (mapfile, "w");
+  if (fp == NULL) {
+    nbdkit_error ("open: %s: %m", mapfile);
+    return;
+  }
+  fprintf (fp, "%s\n%s\n%" PRIu64 " %d\n",
+           CACHE_MAP_MAGIC, url, cache_exportsize, CACHE_BLKSIZE);
+  fwrite (cache_bm.bitmap, 1, cache_bm.size, fp);
+  if (fclose (fp) == EOF)
+    nbdkit_error ("close: %s: %m", mapfile);
+}
+
+/* Open the cache file once the export size is known (ie. on first
+ * connection).  Later connections return immediately.
+ */
+static int
+cache_ensure (int64_t exportsize)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache_lock);
+
+  if (cache_fd >= 0)
+    return 0;
+
+  cache_fd = open (cache_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (cache_fd == -1) {
+    nbdkit_error ("open: %s: %m", cache_path);
+    return -1;
+  }
+  if (ftruncate (cache_fd, exportsize) == -1) {
+    nbdkit_error ("ftruncate: %s: %m", cache_path);
+    close (cache_fd);
+    cache_fd = -1;
+    return -1;
+  }
+  cache_exportsize = exportsize;
+
+  bitmap_init (&cache_bm, CACHE_BLKSIZE, 1);
+  bitmap_init (&cache_inflight, CACHE_BLKSIZE, 1);
+  if (bitmap_resize (&cache_bm, exportsize) == -1 ||
+      bitmap_resize (&cache_inflight, exportsize) == -1) {
+    close (cache_fd);
+    cache_fd = -1;
+    return -1;
+  }
+
+  cache_load_map ();
+  return 0;
+}
+
+/* Drop cached blocks until we are back under cache-max-size.  Called
+ * with cache_lock held after inserting a block.
+ */
+static void
+cache_evict (void)
+{
+  const uint64_t nr_blks = DIV_ROUND_UP (cache_exportsize, CACHE_BLKSIZE);
+  uint64_t max_blks, scanned = 0;
+
+  if (cache_max_size == 0)
+    return;
+  max_blks = cache_max_size / CACHE_BLKSIZE;
+  if (max_blks == 0)
+    max_blks = 1;
+
+  while (cache_nr_blocks > max_blks && scanned++ < nr_blks) {
+    const uint64_t blk = cache_clock;
+
+    cache_clock = (cache_clock + 1) % nr_blks;
+    if (!bitmap_get_blk (&cache_bm, blk, 0))
+      continue;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate (cache_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   blk * CACHE_BLKSIZE, CACHE_BLKSIZE) == -1)
+      nbdkit_debug ("fallocate: %s: %m (ignored)", cache_path);
+#endif
+    bitmap_set_blk (&cache_bm, blk, 0);
+    cache_nr_blocks--;
+  }
+}
+
+/* Called from curl_unload. */
+static void
+cache_close (void)
+{
+  if (cache_fd >= 0) {
+    cache_save_map ();
+    nbdkit_debug ("curl: cache hits %" PRIu64 " misses %" PRIu64,
+                  cache_hits, cache_misses);
+    bitmap_free (&cache_bm);
+    bitmap_free (&cache_inflight);
+    close (cache_fd);
+    cache_fd = -1;
+  }
+  free (cache_path);
+  cache_path = NULL;
+}
+
+/* The multi=true engine.  Instead of each request performing its own
+ * transfer, transfers are submitted to a shared curl multi handle
+ * driven by a dedicated event thread.  The multi handle has
+ * multiplexing enabled, so against an HTTP/2 server many range
+ * requests share a single TCP connection as separate streams, which
+ * matters for origins which throttle per connection.
+ *
+ * Easy handles still come from the pool above: one per in-flight
+ * transfer, holding the transfer's buffers and error state.
+ */
+#ifdef HAVE_CURL_MULTI_ENGINE
+
+/* A transfer submitted to the event thread, on the stack of the
+ * submitting thread which waits for completion.
+ */
+struct command {
+  CURL *c;
+  struct command *next;         /* Next submitted command. */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool done;
+  CURLcode status;
+};
+
+static CURLM *multi_handle;
+static pthread_t multi_thread;
+static pthread_mutex_t multi_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct command *submitted;
+static bool multi_stop;
+
+static void *
+multi_worker (void *vp)
+{
+  int still_running, msgs;
+  struct CURLMsg *msg;
+  struct command *cmd;
+
+  for (;;) {
+    /* Add newly submitted transfers to the multi handle. */
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&multi_lock);
+      if (multi_stop)
+        return NULL;
+      while (submitted != NULL) {
+        cmd = submitted;
+        submitted = cmd->next;
+        curl_multi_add_handle (multi_handle, cmd->c);
+      }
+    }
+
+    curl_multi_perform (multi_handle, &still_running);
+
+    /* Signal any completed transfers. */
+    while ((msg = curl_multi_info_read (multi_handle, &msgs)) != NULL) {
+      if (msg->msg == CURLMSG_DONE) {
+        CURL *c = msg->easy_handle;
+        CURLcode status = msg->data.result;
+
+        curl_easy_getinfo (c, CURLINFO_PRIVATE, (char **) &cmd);
+        curl_multi_remove_handle (multi_handle, c);
+        pthread_mutex_lock (&cmd->mutex);
+        cmd->status = status;
+        cmd->done = true;
+        pthread_cond_signal (&cmd->cond);
+        pthread_mutex_unlock (&cmd->mutex);
+        /* cmd is on the submitter's stack, do not touch it again. */
+      }
+    }
+
+    /* Sleep until there is socket activity or curl_multi_wakeup is
+     * called because of a new submission (or shutdown).
+     */
+    curl_multi_poll (multi_handle, NULL, 0, 60000, NULL);
+  }
+}
+
+/* Submit the transfer in h to the event thread and wait for it to
+ * complete.
+ */
+static CURLcode
+submit_and_wait (struct curl_handle *h)
+{
+  struct command cmd;
+
+  cmd.c = h->c;
+  cmd.next = NULL;
+  cmd.done = false;
+  cmd.status = CURLE_OK;
+  pthread_mutex_init (&cmd.mutex, NULL);
+  pthread_cond_init (&cmd.cond, NULL);
+  curl_easy_setopt (h->c, CURLOPT_PRIVATE, &cmd);
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&multi_lock);
+    cmd.next = submitted;
+    submitted = &cmd;
+  }
+  curl_multi_wakeup (multi_handle);
+
+  pthread_mutex_lock (&cmd.mutex);
+  while (!cmd.done)
+    pthread_cond_wait (&cmd.cond, &cmd.mutex);
+  pthread_mutex_unlock (&cmd.mutex);
+
+  pthread_mutex_destroy (&cmd.mutex);
+  pthread_cond_destroy (&cmd.cond);
+  return cmd.status;
+}
+
+static void
+multi_shutdown (void)
+{
+  if (multi_handle == NULL)
+    return;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&multi_lock);
+    multi_stop = true;
+  }
+  curl_multi_wakeup (multi_handle);
+  pthread_join (multi_thread, NULL);
+  curl_multi_cleanup (multi_handle);
+  multi_handle = NULL;
+}
+
+#endif /* HAVE_CURL_MULTI_ENGINE */
+
+/* Start the event thread.  This happens after forking so the thread
+ * is not lost, and before any client can connect.
+ */
+static int
+curl_after_fork (void)
+{
+#ifdef HAVE_CURL_MULTI_ENGINE
+  int err;
+
+  if (!multi)
+    return 0;
+
+  multi_handle = curl_multi_init ();
+  if (multi_handle == NULL) {
+    nbdkit_error ("curl_multi_init failed");
+    return -1;
+  }
+  curl_multi_setopt (multi_handle, CURLMOPT_PIPELINING,
+                     (long) CURLPIPE_MULTIPLEX);
+  curl_multi_setopt (multi_handle, CURLMOPT_MAX_HOST_CONNECTIONS,
+                     (long) connections);
+
+  err = pthread_create (&multi_thread, NULL, multi_worker, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+/* Perform the transfer set up in the easy handle. */
+static CURLcode
+perform (struct curl_handle *h)
+{
+#ifdef HAVE_CURL_MULTI_ENGINE
+  if (multi)
+    return submit_and_wait (h);
+#endif
+  return curl_easy_perform (h->c);
+}
+
 /* When using CURLOPT_VERBOSE, this callback is used to redirect
  * messages to nbdkit_debug (instead of stderr).
  */
@@ -645,27 +1230,64 @@ header_cb (void *ptr, size_t size, size_t nmemb, void *opaque)
   return realsize;
 }
 
+/* Per-connection handle.  The curl easy handles live in the shared
+ * pool, so this only records what we learned at open time.
+ */
+struct handle {
+  int64_t exportsize;
+};
+
+/* Create the per-connection handle. */
+static void *
+curl_open (int readonly)
+{
+  struct handle *d;
+  struct curl_handle *ch;
+
+  d = calloc (1, sizeof *d);
+  if (d == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  /* Borrow a handle from the pool (creating the first one if
+   * necessary) so that errors contacting the remote server are
+   * reported when the client connects, and to get the size.
+   */
+  ch = get_handle ();
+  if (ch == NULL) {
+    free (d);
+    return NULL;
+  }
+  d->exportsize = ch->exportsize;
+  put_handle (ch);
+
+  if (cache_path != NULL && cache_ensure (d->exportsize) == -1) {
+    free (d);
+    return NULL;
+  }
+
+  return d;
+}
+
 /* Free up the per-connection handle. */
 static void
 curl_close (void *handle)
 {
-  struct curl_handle *h = handle;
+  struct handle *d = handle;
 
-  curl_easy_cleanup (h->c);
-  if (h->headers_copy)
-    curl_slist_free_all (h->headers_copy);
-  free (h);
+  free (d);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
 static int64_t
 curl_get_size (void *handle)
 {
-  struct curl_handle *h = handle;
+  struct handle *d = handle;
 
-  return h->exportsize;
+  return d->exportsize;
 }
 
 /* NB: The terminology used by libcurl is confusing!
@@ -676,16 +1298,20 @@ curl_get_size (void *handle)
  * We use the same terminology as libcurl here.
  */
 
-/* Read data from the remote server. */
+/* Fetch a range from the remote server, bypassing the cache. */
 static int
-curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+fetch_range (void *buf, uint32_t count, uint64_t offset)
 {
-  struct curl_handle *h = handle;
+  struct curl_handle *h;
   CURLcode r;
   char range[128];
 
+  h = get_handle ();
+  if (h == NULL)
+    return -1;
+
   /* Run the scripts if necessary and set headers in the handle. */
-  if (do_scripts (h) == -1) return -1;
+  if (do_scripts (h) == -1) goto err;
 
   /* Tell the write_cb where we want the data to be written.  write_cb
    * will update this if the data comes in multiple sections.
@@ -701,10 +1327,10 @@ curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   curl_easy_setopt (h->c, CURLOPT_RANGE, range);
 
   /* The assumption here is that curl will look after timeouts. */
-  r = curl_easy_perform (h->c);
+  r = perform (h);
   if (r != CURLE_OK) {
     display_curl_error (h, r, "pread: curl_easy_perform");
-    return -1;
+    goto err;
   }
 
   /* Could use curl_easy_getinfo here to obtain further information
@@ -714,9 +1340,96 @@ curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   /* As far as I understand the cURL API, this should never happen. */
   assert (h->write_count == 0);
 
+  put_handle (h);
+  return 0;
+
+ err:
+  put_handle (h);
+  return -1;
+}
+
+/* Serve a read through the shared download cache.  Whole blocks are
+ * fetched and stored; concurrent readers of a block being fetched
+ * wait on cache_cond rather than fetching it again.
+ */
+static int
+cached_pread (void *buf, uint32_t count, uint64_t offset)
+{
+  char *out = buf;
+
+  while (count > 0) {
+    const uint64_t blk = offset / CACHE_BLKSIZE;
+    const uint64_t blkstart = blk * CACHE_BLKSIZE;
+    const uint64_t blkoffs = offset - blkstart;
+    const uint32_t n = MIN (count, CACHE_BLKSIZE - blkoffs);
+    const uint32_t blklen = MIN (CACHE_BLKSIZE, cache_exportsize - blkstart);
+    CLEANUP_FREE char *blkbuf = NULL;
+    bool present;
+    int r = 0;
+
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache_lock);
+      for (;;) {
+        present = bitmap_get_blk (&cache_bm, blk, 0);
+        if (present || !bitmap_get_blk (&cache_inflight, blk, 0))
+          break;
+        pthread_cond_wait (&cache_cond, &cache_lock);
+      }
+      if (present) {
+        cache_hits++;
+        if (cache_file_pread (out, n, offset) == -1)
+          return -1;
+      }
+      else {
+        cache_misses++;
+        bitmap_set_blk (&cache_inflight, blk, 1);
+      }
+    }
+
+    if (!present) {
+      blkbuf = malloc (CACHE_BLKSIZE);
+      if (blkbuf == NULL) {
+        nbdkit_error ("malloc: %m");
+        r = -1;
+      }
+      else
+        r = fetch_range (blkbuf, blklen, blkstart);
+
+      {
+        ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache_lock);
+        bitmap_set_blk (&cache_inflight, blk, 0);
+        /* If storing fails the data is still good, the cache just
+         * doesn't grow.
+         */
+        if (r == 0 && cache_file_pwrite (blkbuf, blklen, blkstart) == 0) {
+          bitmap_set_blk (&cache_bm, blk, 1);
+          cache_nr_blocks++;
+          cache_evict ();
+        }
+        pthread_cond_broadcast (&cache_cond);
+      }
+      if (r == -1)
+        return -1;
+      memcpy (out, blkbuf + blkoffs, n);
+    }
+
+    out += n;
+    offset += n;
+    count -= n;
+  }
+
   return 0;
 }
 
+/* Read data from the remote server. */
+static int
+curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+{
+  if (cache_fd >= 0)
+    return cached_pread (buf, count, offset);
+  return fetch_range (buf, count, offset);
+}
+
 static size_t
 write_cb (char *ptr, size_t size, size_t nmemb, void *opaque)
 {
@@ -744,12 +1457,16 @@ write_cb (char *ptr, size_t size, size_t nmemb, void *opaque)
 static int
 curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
 {
-  struct curl_handle *h = handle;
+  struct curl_handle *h;
   CURLcode r;
   char range[128];
 
+  h = get_handle ();
+  if (h == NULL)
+    return -1;
+
   /* Run the scripts if necessary and set headers in the handle. */
-  if (do_scripts (h) == -1) return -1;
+  if (do_scripts (h) == -1) goto err;
 
   /* Tell the read_cb where we want the data to be read from.  read_cb
    * will update this if the data comes in multiple sections.
@@ -765,10 +1482,10 @@ curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
   curl_easy_setopt (h->c, CURLOPT_RANGE, range);
 
   /* The assumption here is that curl will look after timeouts. */
-  r = curl_easy_perform (h->c);
+  r = perform (h);
   if (r != CURLE_OK) {
     display_curl_error (h, r, "pwrite: curl_easy_perform");
-    return -1;
+    goto err;
   }
 
   /* Could use curl_easy_getinfo here to obtain further information
@@ -778,7 +1495,28 @@ curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
   /* As far as I understand the cURL API, this should never happen. */
   assert (h->read_count == 0);
 
+  put_handle (h);
+
+  /* Drop any cached blocks the write touched so later reads refetch
+   * the new contents.
+   */
+  if (cache_fd >= 0) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache_lock);
+    uint64_t blk = offset / CACHE_BLKSIZE;
+    const uint64_t last = (offset + count - 1) / CACHE_BLKSIZE;
+
+    for (; blk <= last; ++blk) {
+      if (bitmap_get_blk (&cache_bm, blk, 0)) {
+        bitmap_set_blk (&cache_bm, blk, 0);
+        cache_nr_blocks--;
+      }
+    }
+  }
   return 0;
+
+ err:
+  put_handle (h);
+  return -1;
 }
 
 static size_t
@@ -808,6 +1546,7 @@ static struct nbdkit_plugin plugin = {
   .config_complete   = curl_config_complete,
   .config_help       = curl_config_help,
   .magic_config_key  = "url",
+  .after_fork        = curl_after_fork,
   .open              = curl_open,
   .close             = curl_close,
   .get_size          = curl_get_size,
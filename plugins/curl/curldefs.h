@@ -38,6 +38,7 @@
 extern const char *url;
 
 extern const char *cainfo;
+extern unsigned connections;
 extern const char *capath;
 extern char *cookie;
 extern const char *cookie_script;
@@ -58,9 +59,12 @@ extern const char *unix_socket_path;
 extern const char *user;
 extern const char *user_agent;
 
-/* The per-connection handle. */
+/* A wrapper around one curl easy handle.  These live in a shared pool
+ * (see curl.c) and are used by one request at a time.
+ */
 struct curl_handle {
   CURL *c;
+  struct curl_handle *next;     /* Next free handle in the pool. */
   bool accept_range;
   int64_t exportsize;
   char errbuf[CURL_ERROR_SIZE];
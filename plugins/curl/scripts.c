@@ -85,8 +85,9 @@ static int run_cookie_script (struct curl_handle *);
 
 /* This is called from any thread just before we make a curl request.
  *
- * Because the thread model is NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
- * we can be assured of exclusive access to curl_handle here.
+ * Although the thread model is parallel, the curl_handle has been
+ * taken from the pool by the caller so we have exclusive access to
+ * it here.  The lock only protects the state above.
  */
 int
 do_scripts (struct curl_handle *h)
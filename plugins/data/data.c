@@ -77,6 +77,7 @@ static param_list params;
 static void
 data_unload (void)
 {
+  lazy_free ();
   if (a)
     a->f->free (a);
 }
@@ -307,7 +308,11 @@ data_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
             uint32_t flags)
 {
   assert (!flags);
-  return a->f->read (a, buf, count, offset);
+  if (a->f->read (a, buf, count, offset) == -1)
+    return -1;
+  /* Overlay any lazily evaluated repeats on the buffer. */
+  lazy_read (buf, count, offset);
+  return 0;
 }
 
 /* Write data. */
@@ -317,6 +322,8 @@ data_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 {
   /* Flushing, and thus FUA flag, is a no-op */
   assert ((flags & ~NBDKIT_FLAG_FUA) == 0);
+  if (lazy_punch (count, offset) == -1)
+    return -1;
   return a->f->write (a, buf, count, offset);
 }
 
@@ -328,6 +335,8 @@ data_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
    * a->f->zero generally beats writes, so FAST_ZERO is a no-op. */
   assert ((flags & ~(NBDKIT_FLAG_FUA | NBDKIT_FLAG_MAY_TRIM |
                      NBDKIT_FLAG_FAST_ZERO)) == 0);
+  if (lazy_punch (count, offset) == -1)
+    return -1;
   return a->f->zero (a, count, offset);
 }
 
@@ -337,6 +346,8 @@ data_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   /* Flushing, and thus FUA flag, is a no-op */
   assert ((flags & ~NBDKIT_FLAG_FUA) == 0);
+  if (lazy_punch (count, offset) == -1)
+    return -1;
   return a->f->zero (a, count, offset);
 }
 
@@ -352,7 +363,8 @@ static int
 data_extents (void *handle, uint32_t count, uint64_t offset,
               uint32_t flags, struct nbdkit_extents *extents)
 {
-  return a->f->extents (a, count, offset, extents);
+  /* Lazily evaluated repeats count as allocated data. */
+  return lazy_extents (a, count, offset, extents);
 }
 
 static struct nbdkit_plugin plugin = {
@@ -40,6 +40,8 @@
 #include <string.h>
 #include <assert.h>
 
+#include <pthread.h>
+
 #define NBDKIT_API_VERSION 2
 #include <nbdkit-plugin.h>
 
@@ -276,7 +278,7 @@ static int parser (int level, const char *value, size_t *start, size_t len,
                    node_id *root_rtn);
 static int optimize_ast (node_id root, node_id *root_rtn);
 static int evaluate (const dict_t *dict, node_id root,
-                     struct allocator *a,
+                     struct allocator *a, bool toplevel,
                      uint64_t *offset, uint64_t *size);
 
 int
@@ -302,7 +304,7 @@ read_data_format (const char *value, struct allocator *a, uint64_t *size_rtn)
     debug_expr (root, 0);
 
   /* Evaluate the expression into the allocator. */
-  r = evaluate (NULL, root, a, &offset, size_rtn);
+  r = evaluate (NULL, root, a, true, &offset, size_rtn);
 
  out:
   free_expr_table ();
@@ -1058,6 +1060,244 @@ expr_list_only_bytes (const expr_t *e)
   return true;
 }
 
+/* Lazily evaluated repeats.
+ *
+ * Huge repeated patterns like "pattern*1G" used to be materialized
+ * byte by byte through the allocator, costing O(disk size) memory and
+ * start-up time.  Instead, when the evaluator meets a large repeat of
+ * a small pattern at the top level, it records the pattern and the
+ * range of the disk which it covers here, and the data is only
+ * generated when the client reads it back.  The plugin overlays these
+ * segments on what it read from the allocator (lazy_read), and client
+ * writes punch holes in the segments (lazy_punch) so that written
+ * data, which goes to the allocator, wins.
+ */
+struct lazy_segment {
+  uint64_t start, len;          /* disk range covered by this segment */
+  uint64_t base;                /* disk offset where the pattern began,
+                                   kept when the head is punched off so
+                                   the phase of the pattern is preserved */
+  uint8_t *pattern;             /* the repeating unit */
+  uint64_t pattern_len;
+};
+DEFINE_VECTOR_TYPE(lazy_segment_list, struct lazy_segment);
+static lazy_segment_list lazy_segments;
+
+/* Segments are only created at config time, but after that reads
+ * (which iterate over the list) run in parallel with writes (which
+ * punch holes in it).
+ */
+static pthread_rwlock_t lazy_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Repeats at least this large are stored lazily ... */
+#define LAZY_MIN_SIZE (16*1024*1024)
+/* ... unless the repeating unit itself is too large to keep a copy of. */
+#define LAZY_MAX_PATTERN (2*1024*1024)
+
+/* Should a repeat of n copies of a size bytes long pattern be stored
+ * lazily rather than materialized in the allocator?
+ */
+static bool
+lazy_wanted (uint64_t size, uint64_t n)
+{
+  if (size == 0 || size > LAZY_MAX_PATTERN)
+    return false;
+  if (n > UINT64_MAX / size)    /* overflow, caught in lazy_add_repeat */
+    return true;
+  return size * n >= LAZY_MIN_SIZE;
+}
+
+/* Remove [offset, offset+count-1] from all lazy segments because that
+ * range has been written (or zeroed) in the allocator.  The caller
+ * must hold lazy_lock for writing (except at config time).
+ */
+static int
+lazy_punch_locked (uint64_t count, uint64_t offset)
+{
+  const uint64_t end = offset + count;
+  size_t i;
+
+  for (i = 0; i < lazy_segments.size; /**/) {
+    struct lazy_segment *seg = &lazy_segments.ptr[i];
+    const uint64_t seg_end = seg->start + seg->len;
+
+    if (end <= seg->start || offset >= seg_end) {
+      /* No overlap. */
+      i++;
+    }
+    else if (offset <= seg->start && end >= seg_end) {
+      /* The whole segment is removed. */
+      free (seg->pattern);
+      memmove (&lazy_segments.ptr[i], &lazy_segments.ptr[i+1],
+               (lazy_segments.size-i-1) * sizeof (struct lazy_segment));
+      lazy_segments.size--;
+    }
+    else if (offset <= seg->start) {
+      /* Punch the head off the segment.  seg->base does not move so
+       * the phase of the pattern is preserved.
+       */
+      seg->len = seg_end - end;
+      seg->start = end;
+      i++;
+    }
+    else if (end >= seg_end) {
+      /* Punch the tail off the segment. */
+      seg->len = offset - seg->start;
+      i++;
+    }
+    else {
+      /* Punch a hole in the middle, splitting the segment.  The new
+       * tail segment gets its own copy of the pattern.
+       */
+      struct lazy_segment tail = *seg;
+
+      tail.pattern = malloc (tail.pattern_len);
+      if (tail.pattern == NULL) {
+        nbdkit_error ("malloc: %m");
+        return -1;
+      }
+      memcpy (tail.pattern, seg->pattern, tail.pattern_len);
+      tail.start = end;
+      tail.len = seg_end - end;
+      seg->len = offset - seg->start;
+      /* NB: this invalidates the seg pointer. */
+      if (lazy_segment_list_append (&lazy_segments, tail) == -1) {
+        nbdkit_error ("realloc: %m");
+        free (tail.pattern);
+        return -1;
+      }
+      i++;
+    }
+  }
+
+  return 0;
+}
+
+/* Record a repeat (n copies of the size bytes long pattern, placed at
+ * offset) to be evaluated lazily when it is read back.  The pattern
+ * is copied.  Only called at config time so no locking is needed.
+ */
+static int
+lazy_add_repeat (const uint8_t *pattern, uint64_t size, uint64_t n,
+                 uint64_t offset)
+{
+  struct lazy_segment seg;
+
+  if (n > UINT64_MAX / size) {
+    nbdkit_error ("data parameter: *%" PRIu64 " is too large", n);
+    return -1;
+  }
+
+  seg.pattern = malloc (size);
+  if (seg.pattern == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  memcpy (seg.pattern, pattern, size);
+  seg.start = seg.base = offset;
+  seg.len = size * n;
+  seg.pattern_len = size;
+
+  /* A later part of the expression may overwrite an earlier repeat,
+   * so punch out any overlap first.
+   */
+  if (lazy_punch_locked (seg.len, seg.start) == -1) {
+    free (seg.pattern);
+    return -1;
+  }
+  if (lazy_segment_list_append (&lazy_segments, seg) == -1) {
+    nbdkit_error ("realloc: %m");
+    free (seg.pattern);
+    return -1;
+  }
+
+  nbdkit_debug ("lazy repeat: %" PRIu64 " x %" PRIu64 " byte pattern "
+                "at offset %" PRIu64, n, size, offset);
+  return 0;
+}
+
+/* See lazy_punch_locked.  Called by the plugin for client writes. */
+int
+lazy_punch (uint64_t count, uint64_t offset)
+{
+  /* Segments are never added after config time, so if the list is
+   * empty now it will stay empty and we can avoid taking the lock.
+   */
+  if (lazy_segments.size == 0)
+    return 0;
+
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&lazy_lock);
+  return lazy_punch_locked (count, offset);
+}
+
+/* Overlay the lazy segments on top of a buffer which has just been
+ * read from the allocator.
+ */
+void
+lazy_read (void *buf, uint32_t count, uint64_t offset)
+{
+  size_t i;
+
+  if (lazy_segments.size == 0)
+    return;
+
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&lazy_lock);
+  for (i = 0; i < lazy_segments.size; ++i) {
+    const struct lazy_segment *seg = &lazy_segments.ptr[i];
+    const uint64_t seg_end = seg->start + seg->len;
+    uint64_t pos, end;
+
+    if (offset >= seg_end || offset + count <= seg->start)
+      continue;
+    pos = MAX (offset, seg->start);
+    end = MIN (offset + count, seg_end);
+    while (pos < end) {
+      const uint64_t phase = (pos - seg->base) % seg->pattern_len;
+      const uint64_t len = MIN (end - pos, seg->pattern_len - phase);
+
+      memcpy ((char *) buf + (pos - offset), &seg->pattern[phase], len);
+      pos += len;
+    }
+  }
+}
+
+/* Describe extents in the given range.  If no lazy segment overlaps
+ * the range then the allocator gives the exact answer.  Otherwise be
+ * conservative and describe the whole range as allocated data: we
+ * cannot ask the allocator about the gaps between segments because
+ * its page-granular answers may extend beyond the gap, marking data
+ * which only exists lazily as a hole.
+ */
+int
+lazy_extents (struct allocator *a, uint32_t count, uint64_t offset,
+              struct nbdkit_extents *extents)
+{
+  size_t i;
+
+  if (lazy_segments.size == 0)
+    return a->f->extents (a, count, offset, extents);
+
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&lazy_lock);
+  for (i = 0; i < lazy_segments.size; ++i) {
+    const struct lazy_segment *seg = &lazy_segments.ptr[i];
+
+    if (offset < seg->start + seg->len && offset + count > seg->start)
+      return nbdkit_add_extent (extents, offset, count, 0 /* data */);
+  }
+
+  return a->f->extents (a, count, offset, extents);
+}
+
+void
+lazy_free (void)
+{
+  size_t i;
+
+  for (i = 0; i < lazy_segments.size; ++i)
+    free (lazy_segments.ptr[i].pattern);
+  lazy_segment_list_reset (&lazy_segments);
+}
+
 static int store_file (struct allocator *a,
                        const char *filename, uint64_t *offset);
 static int store_file_slice (struct allocator *a,
@@ -1071,10 +1311,16 @@ static int store_script_len (struct allocator *a,
 
 /* This is the evaluator.  It takes the root (node_id) of the parsed
  * abstract syntax treea and evaulates it into the allocator.
+ *
+ * toplevel is true when evaluating directly into the disk (as opposed
+ * to a temporary allocator which will be blitted somewhere else
+ * later).  Only at the top level do offsets in the allocator
+ * correspond to disk offsets, which the lazy segments above need.
  */
 static int
 evaluate (const dict_t *dict, node_id root,
-          struct allocator *a, uint64_t *offset, uint64_t *size)
+          struct allocator *a, bool toplevel,
+          uint64_t *offset, uint64_t *size)
 {
   /* 'd' is the local dictionary for this function.  Assignments are
    * added to the dictionary in this scope and passed to nested
@@ -1095,6 +1341,9 @@ evaluate (const dict_t *dict, node_id root,
   }
 
   for (i = 0; i < list.size; ++i) {
+    const uint64_t start_offset = *offset;
+    bool stored_lazily = false;
+
     e = get_node (list.ptr[i]);
 
     switch (e->t) {
@@ -1183,7 +1432,7 @@ evaluate (const dict_t *dict, node_id root,
       /* NB: We pass the environment at the time that the assignment was
        * made (t->next) not the current environment.  This is deliberate.
        */
-      if (evaluate (t->next, t->id, a2, &offset2, &size2) == -1)
+      if (evaluate (t->next, t->id, a2, false, &offset2, &size2) == -1)
         return -1;
 
       if (a->f->blit (a2, a, size2, 0, *offset) == -1)
@@ -1203,7 +1452,18 @@ evaluate (const dict_t *dict, node_id root,
        * sense to optimize it here.
        */
       if (e->t == EXPR_REPEAT && get_node (e->id)->t == EXPR_BYTE) {
-        if (a->f->fill (a, get_node (e->id)->b, e->r.n, *offset) == -1)
+        const uint8_t b = get_node (e->id)->b;
+
+        /* A huge fill with a non-zero byte would still materialize
+         * the whole range, so store it lazily instead.  (Zero fills
+         * are cheap in the sparse allocator so leave those alone.)
+         */
+        if (toplevel && b != 0 && lazy_wanted (1, e->r.n)) {
+          if (lazy_add_repeat (&b, 1, e->r.n, *offset) == -1)
+            return -1;
+          stored_lazily = true;
+        }
+        else if (a->f->fill (a, b, e->r.n, *offset) == -1)
           return -1;
         *offset += e->r.n;
       }
@@ -1242,7 +1502,7 @@ evaluate (const dict_t *dict, node_id root,
           nbdkit_error ("malloc: %m");
           return -1;
         }
-        if (evaluate (d, e->id, a2, &offset2, &size2) == -1)
+        if (evaluate (d, e->id, a2, false, &offset2, &size2) == -1)
           return -1;
 
         switch (e->t) {
@@ -1252,6 +1512,26 @@ evaluate (const dict_t *dict, node_id root,
           *offset += size2;
           break;
         case EXPR_REPEAT:
+          /* Large repeats of a small pattern are stored lazily and
+           * only generated when the client reads them back, so
+           * multi-terabyte synthetic disks cost O(expression) memory
+           * and start-up time.  See lazy_add_repeat above.
+           */
+          if (toplevel && lazy_wanted (size2, e->r.n)) {
+            CLEANUP_FREE uint8_t *pattern = malloc (size2);
+
+            if (pattern == NULL) {
+              nbdkit_error ("malloc: %m");
+              return -1;
+            }
+            if (a2->f->read (a2, pattern, size2, 0) == -1)
+              return -1;
+            if (lazy_add_repeat (pattern, size2, e->r.n, *offset) == -1)
+              return -1;
+            stored_lazily = true;
+            *offset += size2 * e->r.n;
+            break;
+          }
           /* Duplicate the allocator a2 N times. */
           for (j = 0; j < e->r.n; ++j) {
             if (a->f->blit (a2, a, size2, 0, *offset) == -1)
@@ -1280,6 +1560,15 @@ evaluate (const dict_t *dict, node_id root,
       break;
     }
 
+    /* Anything written to the allocator at the top level must
+     * override earlier lazy repeats covering the same range.
+     */
+    if (toplevel && !stored_lazily && is_data_expr (e) &&
+        *offset > start_offset) {
+      if (lazy_punch_locked (*offset - start_offset, start_offset) == -1)
+        return -1;
+    }
+
     /* Adjust the size if the offset is now larger. */
     if (*size < *offset)
       *size = *offset;
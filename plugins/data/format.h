@@ -41,4 +41,17 @@
 extern int read_data_format (const char *value,
                              struct allocator *a, uint64_t *size);
 
+/* Large repeats in the data parameter are not materialized in the
+ * allocator by read_data_format, but recorded as lazy segments which
+ * the plugin must overlay on the allocator at read time (lazy_read).
+ * Client writes and zeroes must call lazy_punch first so that the
+ * data in the allocator wins.
+ */
+extern void lazy_read (void *buf, uint32_t count, uint64_t offset);
+extern int lazy_punch (uint64_t count, uint64_t offset);
+extern int lazy_extents (struct allocator *a,
+                         uint32_t count, uint64_t offset,
+                         struct nbdkit_extents *extents);
+extern void lazy_free (void);
+
 #endif /* NBDKIT_DATA_FORMAT_H */
@@ -68,6 +68,7 @@ static const char *known_methods[] = {
   "close",
   "config",
   "config_complete",
+  "coprocess",
   "default_export",
   "dump_plugin",
   "export_description",
@@ -217,6 +218,11 @@ eval_load (void)
   missing = create_script ("missing", "exit 2\n");
   if (!missing)
     exit (EXIT_FAILURE);
+
+  /* Since we know exactly what the missing script does, calls to it
+   * can be answered without forking it.
+   */
+  call_register_missing (missing);
 }
 
 static void
@@ -242,6 +248,7 @@ eval_unload (void)
   call_unload ();
   method_script_list_iter (&method_scripts, free_method_script);
   free (method_scripts.ptr);
+  call_register_missing (NULL);
   free (missing);
 }
 
@@ -273,6 +280,12 @@ add_method (const char *key, const char *value)
   if (!script)
     return -1;
 
+  /* If the user overrides the missing script then it no longer
+   * simply exits with code 2, so it really has to be run.
+   */
+  if (strcmp (key, "missing") == 0)
+    call_register_missing (NULL);
+
   /* After this, the script variable will be stored in the global
    * array and freed on unload.
    */
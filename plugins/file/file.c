@@ -44,23 +44,43 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <limits.h>
 #include <dirent.h>
 
 #ifdef HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
 #include <pthread.h>
 
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#else
+/* Some old platforms lack atomic types, but 32 bit ints are usually
+ * "atomic enough".
+ */
+#define _Atomic /**/
+#endif
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
 #if defined (__linux__) && !defined (FALLOC_FL_PUNCH_HOLE)
 #include <linux/falloc.h>   /* For FALLOC_FL_*, glibc < 2.18 */
 #endif
 
 #if defined (__linux__)
 #include <linux/fs.h>       /* For BLKZEROOUT */
+#include <linux/fiemap.h>   /* For FS_IOC_FIEMAP */
 #endif
 
 #define NBDKIT_API_VERSION 2
@@ -68,6 +88,7 @@
 
 #include "cleanup.h"
 #include "isaligned.h"
+#include "rounding.h"
 #include "fdatasync.h"
 
 static char *filename = NULL;
@@ -84,6 +105,24 @@ static int fadvise_mode =
 
 /* cache mode */
 static enum { cache_default, cache_none } cache_mode = cache_default;
+#ifdef O_DIRECT
+static bool direct_requested = false;
+#endif
+#ifdef SEEK_HOLE
+static bool scan_extents_requested = false;
+#endif
+
+#ifdef HAVE_LIBURING
+static bool uring_requested = false;
+#endif
+
+/* Number of file descriptors to open per connection (fds=N).  Reads
+ * and writes round-robin across them, which raises the effective
+ * queue depth on storage which caps the queue per descriptor
+ * (eg. some iSCSI and multipath configurations).
+ */
+#define MAX_FDS 64
+static unsigned num_fds = 1;
 
 /* Any callbacks using lseek must be protected by this lock. */
 static pthread_mutex_t lseek_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -97,9 +136,16 @@ is_enotsup (int err)
   return err == ENOTSUP || err == EOPNOTSUPP;
 }
 
+#ifdef O_DIRECT
+static void bounce_pool_drain (void);
+#endif
+
 static void
 file_unload (void)
 {
+#ifdef O_DIRECT
+  bounce_pool_drain ();
+#endif
   free (filename);
   free (directory);
 }
@@ -169,6 +215,53 @@ file_config (const char *key, const char *value)
       return -1;
     }
   }
+  else if (strcmp (key, "direct") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+#ifdef O_DIRECT
+    direct_requested = r;
+#else
+    if (r) {
+      nbdkit_error ("O_DIRECT is not supported on this platform");
+      return -1;
+    }
+#endif
+  }
+  else if (strcmp (key, "fds") == 0) {
+    if (nbdkit_parse_unsigned ("fds", value, &num_fds) == -1)
+      return -1;
+    if (num_fds < 1 || num_fds > MAX_FDS) {
+      nbdkit_error ("fds parameter must be between 1 and %d", MAX_FDS);
+      return -1;
+    }
+  }
+  else if (strcmp (key, "scan-extents") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+#ifdef SEEK_HOLE
+    scan_extents_requested = r;
+#else
+    if (r) {
+      nbdkit_error ("this platform does not support extents");
+      return -1;
+    }
+#endif
+  }
+  else if (strcmp (key, "uring") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+#ifdef HAVE_LIBURING
+    uring_requested = r;
+#else
+    if (r) {
+      nbdkit_error ("this build of the file plugin does not support io_uring");
+      return -1;
+    }
+#endif
+  }
   else if (strcmp (key, "rdelay") == 0 ||
            strcmp (key, "wdelay") == 0) {
     nbdkit_error ("add --filter=delay on the command line");
@@ -228,6 +321,10 @@ file_config_complete (void)
   "dir=<DIRNAME>         A directory containing files to serve.\n" \
   "cache=<MODE>          Set use of caching (default, none).\n" \
   "fadise=<LEVEL>        Set fadvise hint (normal, random, sequential).\n" \
+  "direct=<BOOL>         Open the file with O_DIRECT.\n" \
+  "fds=<N>               Stripe requests over N file descriptors.\n" \
+  "scan-extents=<BOOL>   Scan the file's layout once at open.\n" \
+  "uring=<BOOL>          Submit reads and writes through io_uring.\n" \
 
 /* Print some extra information about how the plugin was compiled. */
 static void
@@ -245,6 +342,15 @@ file_dump_plugin (void)
 #ifdef FALLOC_FL_ZERO_RANGE
   printf ("file_falloc_fl_zero_range=yes\n");
 #endif
+#ifdef HAVE_LIBURING
+  printf ("file_io_uring=yes\n");
+#endif
+#ifdef O_DIRECT
+  printf ("file_o_direct=yes\n");
+#endif
+#if defined (SEEK_HOLE) && defined (FS_IOC_FIEMAP)
+  printf ("file_fiemap=yes\n");
+#endif
 }
 
 static int
@@ -299,17 +405,401 @@ file_list_exports (int readonly, int default_only,
   return 0;
 }
 
+#ifdef HAVE_LIBURING
+
+/* io_uring I/O engine (uring=true): each handle gets its own ring
+ * with the file descriptor registered in it, and reads and writes are
+ * submitted through .pread_async / .pwrite_async instead of blocking
+ * a server worker thread each.  A per-handle reaper thread waits for
+ * completions and finishes the requests, so a handful of server
+ * threads can keep a deep device queue busy.
+ *
+ * The request buffers are owned by the server and allocated per
+ * request, so they cannot be registered as fixed buffers; only the
+ * file descriptor is registered (IOSQE_FIXED_FILE), which avoids the
+ * per-operation fget/fput in the kernel.
+ */
+
+#define URING_QUEUE_DEPTH 128
+
+struct uring_op {
+  struct nbdkit_completion *completion;
+  void *buf;                    /* position reached so far */
+  uint32_t remaining;
+  uint64_t offset;
+  bool is_write;
+  bool fua;                     /* fdatasync after the write completes */
+  bool syncing;                 /* the in-flight SQE is the FUA fdatasync */
+};
+
+struct uring {
+  int fd;
+  struct io_uring ring;
+  pthread_mutex_t lock;         /* serializes submission queue access */
+  pthread_t reaper;
+};
+
+/* Queue one SQE for the op and push it to the kernel.  Called with
+ * u->lock held.  Returns -1 if the submission queue is full.
+ */
+static int
+uring_queue_op (struct uring *u, struct uring_op *op)
+{
+  struct io_uring_sqe *sqe;
+  int r;
+
+  sqe = io_uring_get_sqe (&u->ring);
+  if (sqe == NULL) {
+    /* SQ ring full: push any unsubmitted entries and retry once. */
+    io_uring_submit (&u->ring);
+    sqe = io_uring_get_sqe (&u->ring);
+    if (sqe == NULL)
+      return -1;
+  }
+  if (op->syncing)
+    io_uring_prep_fsync (sqe, 0, IORING_FSYNC_DATASYNC);
+  else if (op->is_write)
+    io_uring_prep_write (sqe, 0, op->buf, op->remaining, op->offset);
+  else
+    io_uring_prep_read (sqe, 0, op->buf, op->remaining, op->offset);
+  /* The 0 above is the index of the registered file, not an fd. */
+  sqe->flags |= IOSQE_FIXED_FILE;
+  io_uring_sqe_set_data (sqe, op);
+
+  do
+    r = io_uring_submit (&u->ring);
+  while (r == -EINTR);
+  if (r < 0) {
+    /* The SQE stays queued and rides along with a later submission,
+     * so the op has still been handed to the ring; don't fail it.
+     */
+    errno = -r;
+    nbdkit_debug ("io_uring_submit: %m");
+  }
+  return 0;
+}
+
+/* Finish an op with plain pread/pwrite, used when the ring cannot
+ * take it (or its remainder after a short transfer).
+ */
+static void
+uring_op_finish_sync (struct uring *u, struct uring_op *op)
+{
+  int error = 0;
+
+  while (op->remaining > 0) {
+    ssize_t r;
+
+    if (op->is_write)
+      r = pwrite (u->fd, op->buf, op->remaining, op->offset);
+    else
+      r = pread (u->fd, op->buf, op->remaining, op->offset);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("%s: %m", op->is_write ? "pwrite" : "pread");
+      error = errno;
+      break;
+    }
+    if (r == 0) {
+      nbdkit_error ("pread: unexpected end of file");
+      error = EIO;
+      break;
+    }
+    op->buf += r;
+    op->remaining -= r;
+    op->offset += r;
+  }
+  if (error == 0 && op->is_write && op->fua && fdatasync (u->fd) == -1) {
+    nbdkit_error ("fdatasync: %m");
+    error = errno;
+  }
+  nbdkit_completion_complete (op->completion, error);
+  free (op);
+}
+
+/* Handle one completion: either finish the request or push its next
+ * stage (the remainder after a short transfer, or the FUA fdatasync)
+ * back into the ring.
+ */
+static void
+uring_op_advance (struct uring *u, struct uring_op *op, int res)
+{
+  if (res == -EINTR || res == -EAGAIN)
+    goto resubmit;                      /* retry the same range */
+  if (res < 0) {
+    errno = -res;
+    nbdkit_error ("%s: %m", op->syncing ? "fdatasync" :
+                  op->is_write ? "pwrite" : "pread");
+    nbdkit_completion_complete (op->completion, -res);
+    free (op);
+    return;
+  }
+  if (op->syncing) {                    /* the FUA fdatasync finished */
+    nbdkit_completion_complete (op->completion, 0);
+    free (op);
+    return;
+  }
+  if (!op->is_write && res == 0) {
+    nbdkit_error ("pread: unexpected end of file");
+    nbdkit_completion_complete (op->completion, EIO);
+    free (op);
+    return;
+  }
+  op->buf += res;
+  op->remaining -= res;
+  op->offset += res;
+  if (op->remaining == 0) {
+    if (op->is_write && op->fua) {
+      op->syncing = true;
+      goto resubmit;
+    }
+    nbdkit_completion_complete (op->completion, 0);
+    free (op);
+    return;
+  }
+
+ resubmit:
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&u->lock);
+    if (uring_queue_op (u, op) == 0)
+      return;
+  }
+  /* Could not queue the next stage; finish synchronously rather than
+   * failing a request which may have partly completed.
+   */
+  uring_op_finish_sync (u, op);
+}
+
+/* Per-handle thread which waits for completions and finishes the
+ * corresponding requests.  Exits when the handle is closed, signalled
+ * by a NOP with NULL user data.
+ */
+static void *
+uring_reaper (void *vu)
+{
+  struct uring *u = vu;
+
+  for (;;) {
+    struct io_uring_cqe *cqe;
+    struct uring_op *op;
+    int r, res;
+
+    r = io_uring_wait_cqe (&u->ring, &cqe);
+    if (r == -EINTR)
+      continue;
+    if (r < 0) {
+      errno = -r;
+      nbdkit_error ("io_uring_wait_cqe: %m");
+      return NULL;
+    }
+    op = io_uring_cqe_get_data (cqe);
+    res = cqe->res;
+    io_uring_cqe_seen (&u->ring, cqe);
+    if (op == NULL)
+      return NULL;
+    uring_op_advance (u, op, res);
+  }
+}
+
+/* Start an asynchronous read or write.  Returns -1 (without using the
+ * completion) only if nothing could be allocated.
+ */
+static int
+uring_start_op (struct uring *u, struct nbdkit_completion *completion,
+                void *buf, uint32_t count, uint64_t offset,
+                bool is_write, bool fua)
+{
+  struct uring_op *op;
+
+  op = malloc (sizeof *op);
+  if (op == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  op->completion = completion;
+  op->buf = buf;
+  op->remaining = count;
+  op->offset = offset;
+  op->is_write = is_write;
+  op->fua = fua;
+  op->syncing = false;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&u->lock);
+    if (uring_queue_op (u, op) == 0)
+      return 0;
+  }
+  /* The ring is momentarily full: run this request synchronously. */
+  uring_op_finish_sync (u, op);
+  return 0;
+}
+
+/* Create the ring for one handle, register the file descriptor, and
+ * start the reaper thread.  Returns NULL (and the handle falls back
+ * to synchronous I/O) if io_uring is unavailable at runtime.
+ */
+static struct uring *
+uring_open (int fd)
+{
+  struct uring *u;
+  int r;
+
+  u = malloc (sizeof *u);
+  if (u == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  u->fd = fd;
+  r = io_uring_queue_init (URING_QUEUE_DEPTH, &u->ring, 0);
+  if (r < 0) {
+    errno = -r;
+    nbdkit_debug ("io_uring_queue_init: %m (using synchronous I/O instead)");
+    free (u);
+    return NULL;
+  }
+  r = io_uring_register_files (&u->ring, &fd, 1);
+  if (r < 0) {
+    errno = -r;
+    nbdkit_debug ("io_uring_register_files: %m "
+                  "(using synchronous I/O instead)");
+    goto err;
+  }
+  pthread_mutex_init (&u->lock, NULL);
+  r = pthread_create (&u->reaper, NULL, uring_reaper, u);
+  if (r != 0) {
+    errno = r;
+    nbdkit_error ("pthread_create: %m");
+    pthread_mutex_destroy (&u->lock);
+    goto err;
+  }
+  return u;
+
+ err:
+  io_uring_queue_exit (&u->ring);
+  free (u);
+  return NULL;
+}
+
+/* Stop the reaper thread and free the ring.  The server has already
+ * drained any asynchronous operations in flight on this handle.
+ */
+static void
+uring_close (struct uring *u)
+{
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&u->lock);
+    struct io_uring_sqe *sqe = io_uring_get_sqe (&u->ring);
+
+    assert (sqe != NULL);       /* nothing is in flight */
+    io_uring_prep_nop (sqe);
+    io_uring_sqe_set_data (sqe, NULL);
+    io_uring_submit (&u->ring);
+  }
+  pthread_join (u->reaper, NULL);
+  io_uring_queue_exit (&u->ring);
+  pthread_mutex_destroy (&u->lock);
+  free (u);
+}
+
+#endif /* HAVE_LIBURING */
+
+#if defined (FALLOC_FL_PUNCH_HOLE) || defined (FALLOC_FL_ZERO_RANGE)
+/* Batching state for zero/trim fallocate calls; see batched_fallocate
+ * below.
+ */
+#define MAX_PENDING_RANGES 64
+
+struct zrange {
+  uint64_t offset, end;
+};
+
+struct zero_batch {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct zrange pending[MAX_PENDING_RANGES];
+  size_t nr_pending;
+  int pending_mode;             /* fallocate mode of the pending ranges */
+  bool running;                 /* a leader is issuing fallocates */
+  uint64_t gen_started;         /* number of the last batch started */
+  uint64_t gen_completed;      /* number of the last batch completed */
+  uint64_t gen_failed;         /* number of the last batch that failed */
+  int failed_errno;
+  uint64_t ranges, calls;       /* stats */
+};
+#endif
+
+#ifdef SEEK_HOLE
+/* Cached extent map; see the comment above exmap_lookup. */
+struct exmap_entry {
+  uint64_t offset, end;
+  uint32_t type;
+};
+
+struct exmap {
+  pthread_mutex_t lock;
+  struct exmap_entry *entries;  /* sorted by offset, non-overlapping */
+  size_t len, alloc;
+  uint64_t hits, misses;        /* stats */
+};
+#endif
+
 /* The per-connection handle. */
 struct handle {
-  int fd;
+  int fd;                       /* == fds[0], used for everything
+                                   except striped data transfers */
+  int *fds;                     /* nr_fds descriptors to the same file */
+  unsigned nr_fds;
+  _Atomic unsigned next_fd;     /* round-robin counter for get_fd */
   bool is_block_device;
   int sector_size;
   bool can_punch_hole;
   bool can_zero_range;
   bool can_fallocate;
   bool can_zeroout;
+  bool direct;                  /* file opened with O_DIRECT */
+#ifdef HAVE_LIBURING
+  struct uring *uring;          /* NULL = use synchronous I/O */
+#endif
+#if defined (FALLOC_FL_PUNCH_HOLE) || defined (FALLOC_FL_ZERO_RANGE)
+  struct zero_batch batch;
+#endif
+#ifdef SEEK_HOLE
+  struct exmap exmap;
+#endif
 };
 
+#ifdef SEEK_HOLE
+/* Defined below with the rest of the extents code. */
+static void exmap_invalidate (struct handle *h, uint64_t offset,
+                              uint64_t count);
+static void exmap_scan (struct handle *h, uint64_t size);
+#endif
+
+/* Close every descriptor in the handle, including h->fd (== fds[0]). */
+static void
+close_fds (struct handle *h)
+{
+  unsigned i;
+
+  for (i = 0; i < h->nr_fds; i++)
+    close (h->fds[i]);
+  free (h->fds);
+}
+
+/* Pick the descriptor for the next data transfer.  With fds=1 (the
+ * default) this is always h->fd; otherwise transfers round-robin
+ * across the descriptors so that each one keeps its own block layer
+ * queue busy.
+ */
+static int
+get_fd (struct handle *h)
+{
+  if (h->nr_fds == 1)
+    return h->fd;
+  return h->fds[h->next_fd++ % h->nr_fds];
+}
+
 /* Create the per-connection handle. */
 static void *
 file_open (int readonly)
@@ -347,6 +837,10 @@ file_open (int readonly)
     flags |= O_RDONLY;
   else
     flags |= O_RDWR;
+#ifdef O_DIRECT
+  if (direct_requested)
+    flags |= O_DIRECT;
+#endif
 
   h->fd = openat (dfd, file, flags);
   if (h->fd == -1) {
@@ -356,21 +850,55 @@ file_open (int readonly)
     free (h);
     return NULL;
   }
+
+  h->fds = malloc (num_fds * sizeof (int));
+  if (h->fds == NULL) {
+    nbdkit_error ("malloc: %m");
+    close (h->fd);
+    if (dfd != -1)
+      close (dfd);
+    free (h);
+    return NULL;
+  }
+  h->fds[0] = h->fd;
+  h->nr_fds = 1;
+  h->next_fd = 0;
+
+  /* Open the extra descriptors for fds=N.  Like io_uring below, this
+   * is an optimization, so if we run out of descriptors just carry on
+   * with however many we got.
+   */
+  while (h->nr_fds < num_fds) {
+    int fd = openat (dfd, file, flags);
+    if (fd == -1) {
+      nbdkit_debug ("fds=%u: open: %s: %m (continuing with %u descriptors)",
+                    num_fds, file, h->nr_fds);
+      break;
+    }
+    h->fds[h->nr_fds++] = fd;
+  }
+
   if (dfd != -1)
     close (dfd);
 
   if (fstat (h->fd, &statbuf) == -1) {
     nbdkit_error ("fstat: %s: %m", file);
+    close_fds (h);
     free (h);
     return NULL;
   }
 
   if (fadvise_mode != -1) {
-    /* This is a hint so we ignore failures. */
+    /* This is a hint so we ignore failures.  Readahead behaviour is
+     * per-descriptor, so apply it to all of them.
+     */
 #ifdef HAVE_POSIX_FADVISE
-    int r = posix_fadvise (h->fd, 0, 0, fadvise_mode);
-    if (r == -1)
-      nbdkit_debug ("posix_fadvise: %s: %m (ignored)", file);
+    unsigned i;
+    for (i = 0; i < h->nr_fds; i++) {
+      int r = posix_fadvise (h->fds[i], 0, 0, fadvise_mode);
+      if (r == -1)
+        nbdkit_debug ("posix_fadvise: %s: %m (ignored)", file);
+    }
 #else
     nbdkit_debug ("fadvise is not supported");
 #endif
@@ -382,7 +910,7 @@ file_open (int readonly)
     h->is_block_device = false;
   else {
     nbdkit_error ("file is not regular or block device: %s", file);
-    close (h->fd);
+    close_fds (h);
     free (h);
     return NULL;
   }
@@ -410,6 +938,51 @@ file_open (int readonly)
   h->can_fallocate = true;
   h->can_zeroout = h->is_block_device;
 
+#ifdef O_DIRECT
+  h->direct = direct_requested;
+  /* Every O_DIRECT transfer must be a whole number of sectors, so the
+   * last sector of the file must not be partial.  Block devices are
+   * always a whole number of sectors.
+   */
+  if (h->direct && !h->is_block_device &&
+      !IS_ALIGNED (statbuf.st_size, h->sector_size)) {
+    nbdkit_error ("%s: direct=true requires the file size (%" PRIi64 ") "
+                  "to be a multiple of the sector size (%d)",
+                  file, (int64_t) statbuf.st_size, h->sector_size);
+    close_fds (h);
+    free (h);
+    return NULL;
+  }
+#else
+  h->direct = false;
+#endif
+
+#ifdef HAVE_LIBURING
+  /* O_DIRECT needs the aligned bounce buffering on the synchronous
+   * path, so the two engines cannot be combined (yet).
+   */
+  h->uring = NULL;
+  if (uring_requested && !h->direct)
+    h->uring = uring_open (h->fd);
+#endif
+
+#if defined (FALLOC_FL_PUNCH_HOLE) || defined (FALLOC_FL_ZERO_RANGE)
+  memset (&h->batch, 0, sizeof h->batch);
+  pthread_mutex_init (&h->batch.lock, NULL);
+  pthread_cond_init (&h->batch.cond, NULL);
+#endif
+
+#ifdef SEEK_HOLE
+  memset (&h->exmap, 0, sizeof h->exmap);
+  pthread_mutex_init (&h->exmap.lock, NULL);
+  if (scan_extents_requested) {
+    if (h->is_block_device)
+      nbdkit_debug ("scan-extents ignored for block devices");
+    else
+      exmap_scan (h, statbuf.st_size);
+  }
+#endif
+
   return h;
 }
 
@@ -419,7 +992,26 @@ file_close (void *handle)
 {
   struct handle *h = handle;
 
-  close (h->fd);
+#ifdef HAVE_LIBURING
+  if (h->uring)
+    uring_close (h->uring);
+#endif
+#if defined (FALLOC_FL_PUNCH_HOLE) || defined (FALLOC_FL_ZERO_RANGE)
+  if (h->batch.ranges > 0)
+    nbdkit_debug ("batched fallocate: %" PRIu64 " ranges "
+                  "in %" PRIu64 " calls",
+                  h->batch.ranges, h->batch.calls);
+  pthread_mutex_destroy (&h->batch.lock);
+  pthread_cond_destroy (&h->batch.cond);
+#endif
+#ifdef SEEK_HOLE
+  if (h->exmap.hits + h->exmap.misses > 0)
+    nbdkit_debug ("extent cache: %" PRIu64 " hits, %" PRIu64 " misses",
+                  h->exmap.hits, h->exmap.misses);
+  free (h->exmap.entries);
+  pthread_mutex_destroy (&h->exmap.lock);
+#endif
+  close_fds (h);
   free (h);
 }
 
@@ -492,6 +1084,17 @@ file_can_fua (void *handle)
   return NBDKIT_FUA_NATIVE;
 }
 
+static int
+file_can_fast_zero (void *handle)
+{
+  /* wrapped fallocate either succeeds very quickly, or gives
+   * EOPNOTSUPP with no permanent effects; and file_zero never
+   * degrades into the slow path of writing literal zeroes.  So we
+   * can always advertise support for NBD_CMD_FLAG_FAST_ZERO.
+   */
+  return 1;
+}
+
 static int
 file_can_cache (void *handle)
 {
@@ -520,61 +1123,33 @@ file_flush (void *handle, uint32_t flags)
   return 0;
 }
 
-/* Read data from the file. */
+/* Read and write the whole range, coping with short transfers. */
 static int
-file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
-            uint32_t flags)
+pread_full (int fd, void *buf, size_t count, uint64_t offset)
 {
-  struct handle *h = handle;
-#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
-  uint32_t orig_count = count;
-  uint64_t orig_offset = offset;
-#endif
-
   while (count > 0) {
-    ssize_t r = pread (h->fd, buf, count, offset);
+    ssize_t r = pread (fd, buf, count, offset);
     if (r == -1) {
       nbdkit_error ("pread: %m");
       return -1;
     }
     if (r == 0) {
       nbdkit_error ("pread: unexpected end of file");
+      errno = EIO;
       return -1;
     }
     buf += r;
     count -= r;
     offset += r;
   }
-
-#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
-  /* On Linux this will evict the pages we just read from the page cache. */
-  if (cache_mode == cache_none)
-    posix_fadvise (h->fd, orig_offset, orig_count, POSIX_FADV_DONTNEED);
-#endif
-
   return 0;
 }
 
-/* Write data to the file. */
 static int
-file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
-             uint32_t flags)
+pwrite_full (int fd, const void *buf, size_t count, uint64_t offset)
 {
-  struct handle *h = handle;
-
-#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
-  uint32_t orig_count = count;
-  uint64_t orig_offset = offset;
-
-  /* If cache=none we want to force pages we have just written to the
-   * file to be flushed to disk so we can immediately evict them from
-   * the page cache.
-   */
-  if (cache_mode == cache_none) flags |= NBDKIT_FLAG_FUA;
-#endif
-
   while (count > 0) {
-    ssize_t r = pwrite (h->fd, buf, count, offset);
+    ssize_t r = pwrite (fd, buf, count, offset);
     if (r == -1) {
       nbdkit_error ("pwrite: %m");
       return -1;
@@ -583,18 +1158,486 @@ file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
     count -= r;
     offset += r;
   }
+  return 0;
+}
 
-  if ((flags & NBDKIT_FLAG_FUA) && file_flush (handle, 0) == -1)
+/* Vectored versions of the above.  struct nbdkit_iovec is
+ * layout-compatible with struct iovec, so the vector can be passed to
+ * the syscall directly.  A short transfer ending inside a segment is
+ * finished with a flat call so that the const vector never needs to
+ * be edited.
+ */
+#ifdef HAVE_PREADV
+static int
+preadv_full (int fd, const struct nbdkit_iovec *iov, int iovcnt,
+             uint64_t offset)
+{
+  while (iovcnt > 0) {
+    ssize_t r = preadv (fd, (const struct iovec *) iov,
+                        iovcnt > IOV_MAX ? IOV_MAX : iovcnt, offset);
+    if (r == -1) {
+      nbdkit_error ("preadv: %m");
+      return -1;
+    }
+    if (r == 0) {
+      nbdkit_error ("preadv: unexpected end of file");
+      errno = EIO;
+      return -1;
+    }
+    offset += r;
+    while (iovcnt > 0 && r >= (ssize_t) iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0 && r > 0) {
+      if (pread_full (fd, (char *) iov->iov_base + r, iov->iov_len - r,
+                      offset) == -1)
+        return -1;
+      offset += iov->iov_len - r;
+      iov++;
+      iovcnt--;
+    }
+  }
+  return 0;
+}
+#endif /* HAVE_PREADV */
+
+#ifdef HAVE_PWRITEV
+static int
+pwritev_full (int fd, const struct nbdkit_iovec *iov, int iovcnt,
+              uint64_t offset)
+{
+  while (iovcnt > 0) {
+    ssize_t r = pwritev (fd, (const struct iovec *) iov,
+                         iovcnt > IOV_MAX ? IOV_MAX : iovcnt, offset);
+    if (r == -1) {
+      nbdkit_error ("pwritev: %m");
+      return -1;
+    }
+    offset += r;
+    while (iovcnt > 0 && r >= (ssize_t) iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0 && r > 0) {
+      if (pwrite_full (fd, (const char *) iov->iov_base + r,
+                       iov->iov_len - r, offset) == -1)
+        return -1;
+      offset += iov->iov_len - r;
+      iov++;
+      iovcnt--;
+    }
+  }
+  return 0;
+}
+#endif /* HAVE_PWRITEV */
+
+#ifdef O_DIRECT
+
+/* With direct=true, transfers whose offset, count and memory address
+ * are all sector-aligned go straight to the file; anything else goes
+ * through an aligned bounce buffer covering the surrounding sectors.
+ * The buffers are pooled so steady state does no allocation.  The
+ * request buffers allocated by the server are aligned to at least
+ * nbdkit_buffer_alignment() bytes (4k), so any client issuing
+ * sector-aligned requests takes the direct path; bouncing is only
+ * left for unaligned requests and for filters which substitute
+ * buffers of their own.
+ */
+
+#define BOUNCE_ALIGNMENT 4096   /* covers any sector size we detect */
+#define MAX_POOLED_BUFFERS 16
+
+struct bounce {
+  struct bounce *next;
+  void *data;
+  size_t size;
+};
+
+static pthread_mutex_t bounce_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bounce *bounce_pool;
+static unsigned bounce_pool_size;
+
+static struct bounce *
+bounce_get (size_t size)
+{
+  struct bounce *b, **prev;
+  int err;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&bounce_lock);
+    for (prev = &bounce_pool; (b = *prev) != NULL; prev = &b->next) {
+      if (b->size >= size) {
+        *prev = b->next;
+        bounce_pool_size--;
+        return b;
+      }
+    }
+  }
+
+  b = malloc (sizeof *b);
+  if (b == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  err = posix_memalign (&b->data, BOUNCE_ALIGNMENT, size);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("posix_memalign: %m");
+    free (b);
+    return NULL;
+  }
+  b->size = size;
+  return b;
+}
+
+static void
+bounce_put (struct bounce *b)
+{
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&bounce_lock);
+    if (bounce_pool_size < MAX_POOLED_BUFFERS) {
+      b->next = bounce_pool;
+      bounce_pool = b;
+      bounce_pool_size++;
+      return;
+    }
+  }
+  free (b->data);
+  free (b);
+}
+
+/* Called from .unload. */
+static void
+bounce_pool_drain (void)
+{
+  while (bounce_pool) {
+    struct bounce *b = bounce_pool;
+
+    bounce_pool = b->next;
+    free (b->data);
+    free (b);
+  }
+  bounce_pool_size = 0;
+}
+
+static int
+file_pread_direct (struct handle *h, int fd, void *buf, uint32_t count,
+                   uint64_t offset)
+{
+  const uint32_t align = h->sector_size;
+  uint64_t aligned_offset, aligned_end;
+  size_t span;
+  struct bounce *b;
+
+  if (IS_ALIGNED (offset, align) && IS_ALIGNED (count, align) &&
+      IS_ALIGNED ((uintptr_t) buf, align))
+    return pread_full (fd, buf, count, offset);
+
+  aligned_offset = ROUND_DOWN (offset, (uint64_t) align);
+  aligned_end = ROUND_UP (offset + count, (uint64_t) align);
+  span = aligned_end - aligned_offset;
+  b = bounce_get (span);
+  if (b == NULL)
+    return -1;
+  if (pread_full (fd, b->data, span, aligned_offset) == -1) {
+    int serr = errno;
+    bounce_put (b);
+    errno = serr;
+    return -1;
+  }
+  memcpy (buf, b->data + (offset - aligned_offset), count);
+  bounce_put (b);
+  return 0;
+}
+
+static int
+file_pwrite_direct (struct handle *h, int fd, const void *buf, uint32_t count,
+                    uint64_t offset)
+{
+  const uint32_t align = h->sector_size;
+  uint64_t aligned_offset, aligned_end;
+  size_t span;
+  struct bounce *b;
+  int serr;
+
+  if (IS_ALIGNED (offset, align) && IS_ALIGNED (count, align) &&
+      IS_ALIGNED ((uintptr_t) buf, align))
+    return pwrite_full (fd, buf, count, offset);
+
+  aligned_offset = ROUND_DOWN (offset, (uint64_t) align);
+  aligned_end = ROUND_UP (offset + count, (uint64_t) align);
+  span = aligned_end - aligned_offset;
+  b = bounce_get (span);
+  if (b == NULL)
+    return -1;
+
+  /* Read-modify-write.  Only the first and the last sector can
+   * contain bytes which the client's data does not overwrite, so read
+   * just those (or the single sector, if they are the same one).
+   */
+  if (offset > aligned_offset &&
+      pread_full (fd, b->data, align, aligned_offset) == -1)
+    goto err;
+  if (offset + count < aligned_end &&
+      (span > align || offset == aligned_offset) &&
+      pread_full (fd, b->data + span - align, align,
+                  aligned_end - align) == -1)
+    goto err;
+
+  memcpy (b->data + (offset - aligned_offset), buf, count);
+  if (pwrite_full (fd, b->data, span, aligned_offset) == -1)
+    goto err;
+  bounce_put (b);
+  return 0;
+
+ err:
+  serr = errno;
+  bounce_put (b);
+  errno = serr;
+  return -1;
+}
+
+#endif /* O_DIRECT */
+
+/* Read data from the file. */
+static int
+file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags)
+{
+  struct handle *h = handle;
+  int fd = get_fd (h);
+#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
+  uint32_t orig_count = count;
+  uint64_t orig_offset = offset;
+#endif
+
+#ifdef O_DIRECT
+  /* O_DIRECT bypasses the page cache, so the cache=none eviction
+   * below does not apply.
+   */
+  if (h->direct)
+    return file_pread_direct (h, fd, buf, count, offset);
+#endif
+
+  if (pread_full (fd, buf, count, offset) == -1)
+    return -1;
+
+#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
+  /* On Linux this will evict the pages we just read from the page cache. */
+  if (cache_mode == cache_none)
+    posix_fadvise (fd, orig_offset, orig_count, POSIX_FADV_DONTNEED);
+#endif
+
+  return 0;
+}
+
+/* Write data to the file. */
+static int
+file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
+             uint32_t flags)
+{
+  struct handle *h = handle;
+  int fd = get_fd (h);
+
+#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
+  uint32_t orig_count = count;
+  uint64_t orig_offset = offset;
+
+  /* If cache=none we want to force pages we have just written to the
+   * file to be flushed to disk so we can immediately evict them from
+   * the page cache.
+   */
+  if (cache_mode == cache_none) flags |= NBDKIT_FLAG_FUA;
+#endif
+
+#ifdef SEEK_HOLE
+  exmap_invalidate (h, offset, count);
+#endif
+
+#ifdef O_DIRECT
+  if (h->direct) {
+    if (file_pwrite_direct (h, fd, buf, count, offset) == -1)
+      return -1;
+    if ((flags & NBDKIT_FLAG_FUA) && file_flush (handle, 0) == -1)
+      return -1;
+    return 0;
+  }
+#endif
+
+  if (pwrite_full (fd, buf, count, offset) == -1)
+    return -1;
+
+  if ((flags & NBDKIT_FLAG_FUA) && file_flush (handle, 0) == -1)
+    return -1;
+
+#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
+  /* On Linux this will evict the pages we just wrote from the page cache. */
+  if (cache_mode == cache_none)
+    posix_fadvise (fd, orig_offset, orig_count, POSIX_FADV_DONTNEED);
+#endif
+
+  return 0;
+}
+
+#ifdef HAVE_PREADV
+/* Vectored read. */
+static int
+file_preadv (void *handle, const struct nbdkit_iovec *iov, int iovcnt,
+             uint64_t offset, uint32_t flags)
+{
+  struct handle *h = handle;
+  int fd = get_fd (h);
+#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
+  uint64_t orig_offset = offset;
+  uint64_t count = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; ++i)
+    count += iov[i].iov_len;
+#endif
+
+#ifdef O_DIRECT
+  /* Direct I/O goes through the aligned bounce pool one segment at a
+   * time; combining the segments would gain nothing as each one has
+   * to be copied to aligned memory anyway.
+   */
+  if (h->direct) {
+    while (iovcnt > 0) {
+      if (file_pread_direct (h, fd, iov->iov_base, iov->iov_len,
+                             offset) == -1)
+        return -1;
+      offset += iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    return 0;
+  }
+#endif
+
+  if (preadv_full (fd, iov, iovcnt, offset) == -1)
+    return -1;
+
+#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
+  /* On Linux this will evict the pages we just read from the page cache. */
+  if (cache_mode == cache_none)
+    posix_fadvise (fd, orig_offset, count, POSIX_FADV_DONTNEED);
+#endif
+
+  return 0;
+}
+#endif /* HAVE_PREADV */
+
+#ifdef HAVE_PWRITEV
+/* Vectored write. */
+static int
+file_pwritev (void *handle, const struct nbdkit_iovec *iov, int iovcnt,
+              uint64_t offset, uint32_t flags)
+{
+  struct handle *h = handle;
+  int fd = get_fd (h);
+#if defined (SEEK_HOLE) || \
+    (defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED))
+  const uint64_t orig_offset = offset;
+  uint64_t count = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; ++i)
+    count += iov[i].iov_len;
+#endif
+
+#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
+  /* If cache=none we want to force pages we have just written to the
+   * file to be flushed to disk so we can immediately evict them from
+   * the page cache.
+   */
+  if (cache_mode == cache_none) flags |= NBDKIT_FLAG_FUA;
+#endif
+
+#ifdef SEEK_HOLE
+  exmap_invalidate (h, orig_offset, count);
+#endif
+
+#ifdef O_DIRECT
+  if (h->direct) {
+    while (iovcnt > 0) {
+      if (file_pwrite_direct (h, fd, iov->iov_base, iov->iov_len,
+                              offset) == -1)
+        return -1;
+      offset += iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if ((flags & NBDKIT_FLAG_FUA) && file_flush (handle, 0) == -1)
+      return -1;
+    return 0;
+  }
+#endif
+
+  if (pwritev_full (fd, iov, iovcnt, offset) == -1)
+    return -1;
+
+  if ((flags & NBDKIT_FLAG_FUA) && file_flush (handle, 0) == -1)
     return -1;
 
 #if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
   /* On Linux this will evict the pages we just wrote from the page cache. */
   if (cache_mode == cache_none)
-    posix_fadvise (h->fd, orig_offset, orig_count, POSIX_FADV_DONTNEED);
+    posix_fadvise (fd, orig_offset, count, POSIX_FADV_DONTNEED);
 #endif
 
   return 0;
 }
+#endif /* HAVE_PWRITEV */
+
+#ifdef HAVE_LIBURING
+/* Read data from the file, submitted through the io_uring. */
+static int
+file_pread_async (void *handle, void *buf, uint32_t count, uint64_t offset,
+                  uint32_t flags, struct nbdkit_completion *completion)
+{
+  struct handle *h = handle;
+
+  /* cache=none needs the fadvise dance in file_pread; and the ring
+   * may have failed to initialize for this handle.  In both cases
+   * read synchronously: completing before returning is allowed.
+   */
+  if (h->uring == NULL || cache_mode == cache_none) {
+    int r = file_pread (handle, buf, count, offset, flags);
+    nbdkit_completion_complete (completion,
+                                r == -1 ? (errno ? errno : EIO) : 0);
+    return 0;
+  }
+  return uring_start_op (h->uring, completion, buf, count, offset,
+                         false, false);
+}
+
+/* Write data to the file, submitted through the io_uring.  FUA is
+ * native, so it may arrive here: the reaper chases the write with an
+ * IORING_OP_FSYNC before completing the request.
+ */
+static int
+file_pwrite_async (void *handle, const void *buf, uint32_t count,
+                   uint64_t offset, uint32_t flags,
+                   struct nbdkit_completion *completion)
+{
+  struct handle *h = handle;
+
+  if (h->uring == NULL || cache_mode == cache_none) {
+    int r = file_pwrite (handle, buf, count, offset, flags);
+    nbdkit_completion_complete (completion,
+                                r == -1 ? (errno ? errno : EIO) : 0);
+    return 0;
+  }
+#ifdef SEEK_HOLE
+  exmap_invalidate (h, offset, count);
+#endif
+  return uring_start_op (h->uring, completion, (void *) buf, count, offset,
+                         true, !!(flags & NBDKIT_FLAG_FUA));
+}
+#endif /* HAVE_LIBURING */
 
 #if defined (FALLOC_FL_PUNCH_HOLE) || defined (FALLOC_FL_ZERO_RANGE)
 static int
@@ -608,6 +1651,102 @@ do_fallocate (int fd, int mode, off_t offset, off_t len)
   }
   return r;
 }
+
+static int
+compare_zrange (const void *rv1, const void *rv2)
+{
+  const struct zrange *r1 = rv1, *r2 = rv2;
+
+  if (r1->offset < r2->offset)
+    return -1;
+  return r1->offset > r2->offset;
+}
+
+/* Coalescing wrapper around do_fallocate.  Provisioning clients send
+ * long runs of adjacent zero/trim requests, and on filesystems like
+ * XFS it is the number of fallocate calls, not the bytes covered,
+ * which limits wipe speed.  Requests arriving while a previous
+ * fallocate is in flight add their ranges to a pending list; the
+ * first one to find no batch running becomes the leader, takes the
+ * whole list, merges adjacent and overlapping ranges and issues one
+ * fallocate per merged range.  A request is only completed by a batch
+ * which started after it joined, and an uncontended request issues
+ * its fallocate immediately, so semantics and latency are unchanged.
+ */
+static int
+batched_fallocate (struct handle *h, int mode, uint64_t offset, uint64_t count)
+{
+  struct zero_batch *zb = &h->batch;
+  uint64_t target;
+  int r = 0;
+
+  pthread_mutex_lock (&zb->lock);
+  /* A batch merges only ranges using the same fallocate mode. */
+  while (zb->nr_pending > 0 && zb->pending_mode != mode)
+    pthread_cond_wait (&zb->cond, &zb->lock);
+  if (zb->nr_pending >= MAX_PENDING_RANGES) {
+    /* Queue unreasonably deep: just issue this one ourselves. */
+    pthread_mutex_unlock (&zb->lock);
+    return do_fallocate (h->fd, mode, offset, count);
+  }
+  zb->pending_mode = mode;
+  zb->pending[zb->nr_pending].offset = offset;
+  zb->pending[zb->nr_pending].end = offset + count;
+  zb->nr_pending++;
+  zb->ranges++;
+  /* Only a batch which starts after this point covers us. */
+  target = zb->gen_started + 1;
+  while (zb->gen_completed < target) {
+    if (!zb->running) {
+      /* Become the leader: take the pending list and issue it. */
+      struct zrange batch[MAX_PENDING_RANGES];
+      size_t n = zb->nr_pending, i;
+      int bmode = zb->pending_mode;
+      uint64_t gen, calls = 0;
+      int err = 0;
+
+      memcpy (batch, zb->pending, n * sizeof batch[0]);
+      zb->nr_pending = 0;
+      gen = ++zb->gen_started;
+      zb->running = true;
+      /* Wake requests waiting for a different mode to drain. */
+      pthread_cond_broadcast (&zb->cond);
+      pthread_mutex_unlock (&zb->lock);
+
+      qsort (batch, n, sizeof batch[0], compare_zrange);
+      i = 0;
+      while (i < n && err == 0) {
+        uint64_t start = batch[i].offset, end = batch[i].end;
+
+        while (++i < n && batch[i].offset <= end) {
+          if (batch[i].end > end)
+            end = batch[i].end;
+        }
+        calls++;
+        if (do_fallocate (h->fd, bmode, start, end - start) == -1)
+          err = errno;
+      }
+
+      pthread_mutex_lock (&zb->lock);
+      zb->calls += calls;
+      zb->gen_completed = gen;
+      if (err) {
+        zb->gen_failed = gen;
+        zb->failed_errno = err;
+      }
+      zb->running = false;
+      pthread_cond_broadcast (&zb->cond);
+    }
+    else
+      pthread_cond_wait (&zb->cond, &zb->lock);
+  }
+  if (zb->gen_failed >= target) {
+    errno = zb->failed_errno ? zb->failed_errno : EIO;
+    r = -1;
+  }
+  pthread_mutex_unlock (&zb->lock);
+  return r;
+}
 #endif
 
 /* Write zeroes to the file. */
@@ -617,10 +1756,14 @@ file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   struct handle *h = handle;
   int r;
 
+#ifdef SEEK_HOLE
+  exmap_invalidate (h, offset, count);
+#endif
+
 #ifdef FALLOC_FL_PUNCH_HOLE
   if (h->can_punch_hole && (flags & NBDKIT_FLAG_MAY_TRIM)) {
-    r = do_fallocate (h->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-                      offset, count);
+    r = batched_fallocate (h, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           offset, count);
     if (r == 0) {
       if (file_debug_zero)
         nbdkit_debug ("h->can_punch_hole && may_trim: "
@@ -639,7 +1782,7 @@ file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 
 #ifdef FALLOC_FL_ZERO_RANGE
   if (h->can_zero_range) {
-    r = do_fallocate (h->fd, FALLOC_FL_ZERO_RANGE, offset, count);
+    r = batched_fallocate (h, FALLOC_FL_ZERO_RANGE, offset, count);
     if (r == 0) {
       if (file_debug_zero)
         nbdkit_debug ("h->can_zero-range: "
@@ -661,10 +1804,10 @@ file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
    * fallocate to zero a range. This is expected to be more efficient than
    * writing zeroes manually. */
   if (h->can_punch_hole && h->can_fallocate) {
-    r = do_fallocate (h->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-                      offset, count);
+    r = batched_fallocate (h, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           offset, count);
     if (r == 0) {
-      r = do_fallocate (h->fd, 0, offset, count);
+      r = batched_fallocate (h, 0, offset, count);
       if (r == 0) {
         if (file_debug_zero)
           nbdkit_debug ("h->can_punch_hole && h->can_fallocate: "
@@ -732,8 +1875,11 @@ file_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   int r;
 
   if (h->can_punch_hole) {
-    r = do_fallocate (h->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-                      offset, count);
+#ifdef SEEK_HOLE
+    exmap_invalidate (h, offset, count);
+#endif
+    r = batched_fallocate (h, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           offset, count);
     if (r == -1) {
       /* Trim is advisory; we don't care if it fails for anything other
        * than EIO or EPERM. */
@@ -759,12 +1905,317 @@ file_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 #ifdef SEEK_HOLE
 /* Extents. */
 
+/* Probing extents with lseek SEEK_HOLE/SEEK_DATA costs a syscall (or
+ * a round trip, on NFS) per transition, every time a client asks.
+ * The results are cached in a per-handle map of sorted,
+ * non-overlapping ranges, invalidated by writes to the overlapping
+ * region only, so repeated queries (eg. qemu-img convert probing
+ * block status ahead of every read) hit the map.  scan-extents=true
+ * additionally loads the whole layout once at open, using FIEMAP
+ * where available.
+ */
+
+/* Find the index of the first entry with end > offset, ie. the only
+ * entry which could contain offset.  Called with the lock held.
+ */
+static size_t
+exmap_find (struct exmap *m, uint64_t offset)
+{
+  size_t lo = 0, hi = m->len;
+
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+
+    if (m->entries[mid].end <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Make room for at least one more entry. */
+static int
+exmap_reserve (struct exmap *m)
+{
+  struct exmap_entry *p;
+  size_t alloc;
+
+  if (m->len < m->alloc)
+    return 0;
+  alloc = m->alloc ? m->alloc * 2 : 64;
+  p = realloc (m->entries, alloc * sizeof *p);
+  if (p == NULL)
+    return -1;
+  m->entries = p;
+  m->alloc = alloc;
+  return 0;
+}
+
+/* Remove any part of the map overlapping [offset, end).  Called with
+ * the lock held.
+ */
+static void
+exmap_remove_range (struct exmap *m, uint64_t offset, uint64_t end)
+{
+  size_t i = exmap_find (m, offset), j;
+  struct exmap_entry *e;
+
+  if (i == m->len || m->entries[i].offset >= end)
+    return;
+
+  e = &m->entries[i];
+  if (e->offset < offset && e->end > end) {
+    /* The entry strictly contains the range: split it. */
+    if (exmap_reserve (m) == 0) {
+      e = &m->entries[i];
+      memmove (&m->entries[i+1], &m->entries[i],
+               (m->len - i) * sizeof *e);
+      m->len++;
+      m->entries[i].end = offset;
+      m->entries[i+1].offset = end;
+    }
+    else                        /* no memory: drop the right-hand part */
+      e->end = offset;
+    return;
+  }
+  /* Trim an entry overlapping the start of the range. */
+  if (e->offset < offset) {
+    e->end = offset;
+    i++;
+  }
+  /* Drop entries wholly inside, trim one overlapping the end. */
+  j = i;
+  while (j < m->len && m->entries[j].offset < end && m->entries[j].end <= end)
+    j++;
+  if (j < m->len && m->entries[j].offset < end)
+    m->entries[j].offset = end;
+  if (j > i) {
+    memmove (&m->entries[i], &m->entries[j],
+             (m->len - j) * sizeof m->entries[0]);
+    m->len -= j - i;
+  }
+}
+
+/* Add [offset, end) with the given type, replacing anything it
+ * overlaps and merging with contiguous neighbours of the same type.
+ * Failure to cache is not an error.  Called with the lock held.
+ */
+static void
+exmap_add (struct exmap *m, uint64_t offset, uint64_t end, uint32_t type)
+{
+  size_t i;
+  bool lmerge, rmerge;
+
+  if (end <= offset)
+    return;
+  exmap_remove_range (m, offset, end);
+  i = exmap_find (m, offset);
+  lmerge = i > 0 &&
+    m->entries[i-1].end == offset && m->entries[i-1].type == type;
+  rmerge = i < m->len &&
+    m->entries[i].offset == end && m->entries[i].type == type;
+  if (lmerge && rmerge) {
+    m->entries[i-1].end = m->entries[i].end;
+    memmove (&m->entries[i], &m->entries[i+1],
+             (m->len - i - 1) * sizeof m->entries[0]);
+    m->len--;
+  }
+  else if (lmerge)
+    m->entries[i-1].end = end;
+  else if (rmerge)
+    m->entries[i].offset = offset;
+  else {
+    if (exmap_reserve (m) == -1)
+      return;
+    memmove (&m->entries[i+1], &m->entries[i],
+             (m->len - i) * sizeof m->entries[0]);
+    m->entries[i].offset = offset;
+    m->entries[i].end = end;
+    m->entries[i].type = type;
+    m->len++;
+  }
+}
+
+/* Record one probed extent.  Takes the lock. */
+static void
+exmap_record (struct handle *h, uint64_t offset, uint64_t end, uint32_t type)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->exmap.lock);
+  exmap_add (&h->exmap, offset, end, type);
+}
+
+/* Called by write-like operations so that stale extents are never
+ * served after the region changes under them.
+ */
+static void
+exmap_invalidate (struct handle *h, uint64_t offset, uint64_t count)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->exmap.lock);
+  exmap_remove_range (&h->exmap, offset, offset + count);
+}
+
+/* Serve an extents request from the cached map.  Returns 1 on a hit
+ * (at least the start of the range was described, which is all the
+ * protocol requires), 0 on a miss, -1 on error.
+ */
+static int
+exmap_lookup (struct handle *h, uint32_t count, uint64_t offset,
+              uint32_t flags, struct nbdkit_extents *extents)
+{
+  struct exmap *m = &h->exmap;
+  const bool req_one = flags & NBDKIT_FLAG_REQ_ONE;
+  const uint64_t end = offset + count;
+  uint64_t pos = offset;
+  size_t i;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&m->lock);
+  i = exmap_find (m, offset);
+  if (i == m->len || m->entries[i].offset > offset) {
+    m->misses++;
+    return 0;
+  }
+  m->hits++;
+  for (; i < m->len && pos < end; ++i) {
+    const struct exmap_entry *e = &m->entries[i];
+
+    if (e->offset > pos)
+      break;                    /* gap: describe only what we have */
+    if (nbdkit_add_extent (extents, e->offset, e->end - e->offset,
+                           e->type) == -1)
+      return -1;
+    pos = e->end;
+    if (req_one)
+      break;
+  }
+  return 1;
+}
+
+#ifdef FS_IOC_FIEMAP
+/* Bulk-load the file's layout with FIEMAP.  Returns -1 if the
+ * filesystem does not support it (fall back to the lseek sweep).
+ */
+static int
+exmap_scan_fiemap (struct handle *h, uint64_t size)
+{
+  const size_t nr = 1024;
+  CLEANUP_FREE struct fiemap *fm = NULL;
+  uint64_t pos = 0;
+  bool last = false;
+
+  fm = malloc (sizeof *fm + nr * sizeof (struct fiemap_extent));
+  if (fm == NULL)
+    return -1;
+
+  while (pos < size && !last) {
+    size_t i;
+
+    memset (fm, 0, sizeof *fm);
+    fm->fm_start = pos;
+    fm->fm_length = size - pos;
+    fm->fm_flags = FIEMAP_FLAG_SYNC;
+    fm->fm_extent_count = nr;
+    if (ioctl (h->fd, FS_IOC_FIEMAP, fm) == -1) {
+      nbdkit_debug ("FS_IOC_FIEMAP: %m");
+      return -1;
+    }
+    if (fm->fm_mapped_extents == 0)
+      break;                    /* the rest of the file is a hole */
+
+    for (i = 0; i < fm->fm_mapped_extents; ++i) {
+      const struct fiemap_extent *fe = &fm->fm_extents[i];
+      uint64_t start = fe->fe_logical;
+      uint64_t fend = fe->fe_logical + fe->fe_length;
+      uint32_t type = 0;
+
+      if (start < pos)
+        start = pos;
+      if (fend > size)
+        fend = size;
+      if (start > pos)
+        exmap_record (h, pos, start,
+                      NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO);
+      if (fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN)
+        type = NBDKIT_EXTENT_ZERO;
+      exmap_record (h, start, fend, type);
+      pos = fend;
+      if (fe->fe_flags & FIEMAP_EXTENT_LAST) {
+        last = true;
+        break;
+      }
+    }
+  }
+
+  if (pos < size)
+    exmap_record (h, pos, size, NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO);
+  return 0;
+}
+#endif /* FS_IOC_FIEMAP */
+
+/* Bulk-load the file's layout with an lseek sweep. */
+static int
+exmap_scan_lseek (struct handle *h, uint64_t size)
+{
+  uint64_t offset = 0;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
+  while (offset < size) {
+    off_t pos = lseek (h->fd, offset, SEEK_DATA);
+
+    if (pos == -1) {
+      if (errno == ENXIO)
+        pos = size;
+      else {
+        nbdkit_debug ("lseek: SEEK_DATA: %m");
+        return -1;
+      }
+    }
+    if ((uint64_t) pos > offset)
+      exmap_record (h, offset, pos, NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO);
+    offset = pos;
+    if (offset >= size)
+      break;
+    pos = lseek (h->fd, offset, SEEK_HOLE);
+    if (pos == -1) {
+      nbdkit_debug ("lseek: SEEK_HOLE: %m");
+      return -1;
+    }
+    if ((uint64_t) pos > offset)
+      exmap_record (h, offset, pos, 0 /* allocated data */);
+    offset = pos;
+  }
+  return 0;
+}
+
+/* scan-extents=true: load the whole layout into the map at open. */
+static void
+exmap_scan (struct handle *h, uint64_t size)
+{
+#ifdef FS_IOC_FIEMAP
+  if (exmap_scan_fiemap (h, size) == 0) {
+    nbdkit_debug ("scan-extents: loaded %zu extents using FIEMAP",
+                  h->exmap.len);
+    return;
+  }
+  h->exmap.len = 0;             /* discard any partial results */
+#endif
+  if (exmap_scan_lseek (h, size) == 0)
+    nbdkit_debug ("scan-extents: loaded %zu extents using lseek",
+                  h->exmap.len);
+  else
+    h->exmap.len = 0;
+}
+
 static int
 file_can_extents (void *handle)
 {
   struct handle *h = handle;
   off_t r;
 
+  /* If scan-extents loaded the map we can always serve from it. */
+  if (h->exmap.len > 0)
+    return 1;
+
   /* A simple test to see whether SEEK_HOLE etc is likely to work on
    * the current filesystem.
    */
@@ -806,6 +2257,7 @@ do_extents (void *handle, uint32_t count, uint64_t offset,
 
     /* We know there is a hole from offset to pos-1. */
     if (pos > offset) {
+      exmap_record (h, offset, pos, NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO);
       if (nbdkit_add_extent (extents, offset, pos - offset,
                              NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) == -1)
         return -1;
@@ -825,6 +2277,7 @@ do_extents (void *handle, uint32_t count, uint64_t offset,
 
     /* We know there is data from offset to pos-1. */
     if (pos > offset) {
+      exmap_record (h, offset, pos, 0 /* allocated data */);
       if (nbdkit_add_extent (extents, offset, pos - offset,
                              0 /* allocated data */) == -1)
         return -1;
@@ -842,6 +2295,13 @@ static int
 file_extents (void *handle, uint32_t count, uint64_t offset,
               uint32_t flags, struct nbdkit_extents *extents)
 {
+  struct handle *h = handle;
+  int r;
+
+  r = exmap_lookup (h, count, offset, flags, extents);
+  if (r != 0)
+    return r == 1 ? 0 : -1;
+
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
   return do_extents (handle, count, offset, flags, extents);
 }
@@ -883,6 +2343,7 @@ static struct nbdkit_plugin plugin = {
   .can_multi_conn    = file_can_multi_conn,
   .can_trim          = file_can_trim,
   .can_fua           = file_can_fua,
+  .can_fast_zero     = file_can_fast_zero,
   .can_cache         = file_can_cache,
   .pread             = file_pread,
   .pwrite            = file_pwrite,
@@ -895,6 +2356,16 @@ static struct nbdkit_plugin plugin = {
 #endif
 #if HAVE_POSIX_FADVISE
   .cache             = file_cache,
+#endif
+#ifdef HAVE_PREADV
+  .preadv            = file_preadv,
+#endif
+#ifdef HAVE_PWRITEV
+  .pwritev           = file_pwritev,
+#endif
+#ifdef HAVE_LIBURING
+  .pread_async       = file_pread_async,
+  .pwrite_async      = file_pwrite_async,
 #endif
   .errno_is_preserved = 1,
 };
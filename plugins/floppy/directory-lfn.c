@@ -73,6 +73,113 @@ static int convert_to_utf16le (const char *name, char **out, size_t *output_len)
 static void free_lfns (struct lfn *lfns, size_t n);
 static ssize_t append_dir_table (size_t di, const struct dir_entry *entry, struct virtual_floppy *floppy);
 
+/* Count the number of UTF-16 code units needed to encode the name,
+ * validating the UTF-8 encoding along the way.  Returns -1 if the
+ * name is not valid UTF-8 (which would also make the iconv conversion
+ * in convert_to_utf16le fail).
+ */
+static ssize_t
+utf16_code_units (const char *name)
+{
+  const uint8_t *p = (const uint8_t *) name;
+  size_t units = 0;
+
+  while (*p) {
+    uint32_t c;
+    size_t n, i;
+
+    if (p[0] < 0x80) {
+      c = p[0];
+      n = 1;
+    }
+    else if ((p[0] & 0xe0) == 0xc0) {
+      c = p[0] & 0x1f;
+      n = 2;
+    }
+    else if ((p[0] & 0xf0) == 0xe0) {
+      c = p[0] & 0x0f;
+      n = 3;
+    }
+    else if ((p[0] & 0xf8) == 0xf0) {
+      c = p[0] & 0x07;
+      n = 4;
+    }
+    else
+      return -1;
+
+    for (i = 1; i < n; ++i) {
+      if ((p[i] & 0xc0) != 0x80)
+        return -1;
+      c = (c << 6) | (p[i] & 0x3f);
+    }
+
+    /* Reject overlong encodings, surrogates and out of range. */
+    if ((n == 2 && c < 0x80) ||
+        (n == 3 && c < 0x800) ||
+        (n == 4 && c < 0x10000) ||
+        (c >= 0xd800 && c <= 0xdfff) ||
+        c > 0x10ffff)
+      return -1;
+
+    /* Codepoints outside the BMP need a UTF-16 surrogate pair. */
+    units += n == 4 ? 2 : 1;
+    p += n;
+  }
+
+  return units;
+}
+
+/* Compute the number of entries which the on disk directory table for
+ * dirs[di] will contain, without materializing it.  The result
+ * must agree exactly with what create_directory below produces: one
+ * short name entry per name, preceded by enough LFN entries to hold
+ * the name in UTF-16, plus the volume label (root directory) or the
+ * "." and ".." entries (subdirectories).
+ */
+ssize_t
+count_directory_entries (size_t di, struct virtual_floppy *floppy)
+{
+  const size_t nr_subdirs = floppy->dirs.ptr[di].subdirs.size;
+  const size_t nr_files = floppy->dirs.ptr[di].fileidxs.size;
+  size_t i, entries;
+
+  entries = di == 0 ? 1 : 2;
+
+  for (i = 0; i < nr_subdirs + nr_files; ++i) {
+    const char *name;
+    ssize_t units;
+
+    if (i < nr_subdirs) {
+      const size_t sdi = floppy->dirs.ptr[di].subdirs.ptr[i];
+      assert (sdi < floppy->dirs.size);
+      name = floppy->dirs.ptr[sdi].name;
+    }
+    else {
+      const size_t fi = floppy->dirs.ptr[di].fileidxs.ptr[i-nr_subdirs];
+      assert (fi < floppy->files.size);
+      name = floppy->files.ptr[fi].name;
+    }
+
+    units = utf16_code_units (name);
+    if (units == -1) {
+      nbdkit_error ("%s: filename is not valid UTF-8", name);
+      return -1;
+    }
+    /* Maximum LFN length is 0x3f * 13 = 819 UCS-2 characters. */
+    if (units > 819) {
+      nbdkit_error ("%s: filename is too long", name);
+      return -1;
+    }
+
+    /* LFN entries (cf. the sequence number loop in
+     * add_directory_entry) plus the short name entry.
+     */
+    entries += 2 + units/13;
+  }
+
+  return entries;
+}
+
 /* Create the on disk directory table for dirs[di]. */
 int
 create_directory (size_t di, const char *label,
@@ -146,8 +146,11 @@ floppy_can_cache (void *handle)
 static int
 floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
+  size_t hint = 0;
+
   while (count > 0) {
-    const struct region *region = find_region (&floppy.regions, offset);
+    const struct region *region =
+      find_region_hint (&floppy.regions, offset, &hint);
     size_t i, len;
     const char *host_path;
     int fd;
@@ -184,7 +187,21 @@ floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
       break;
 
     case region_data:
-      memcpy (buf, &region->u.data[offset - region->start], len);
+      if (region->u.data != NULL)
+        memcpy (buf, &region->u.data[offset - region->start], len);
+      else if (offset < (uint64_t) floppy.data_start_sector * SECTOR_SIZE)
+        /* FAT entries are synthesized from the layout. */
+        read_fat (buf, len, offset - region->start, &floppy);
+      else {
+        /* Directory table, materialized on first access. */
+        const unsigned char *data = get_directory_table (region->start,
+                                                         &floppy);
+        if (data == NULL) {
+          errno = EIO;
+          return -1;
+        }
+        memcpy (buf, &data[offset - region->start], len);
+      }
       break;
 
     case region_zero:
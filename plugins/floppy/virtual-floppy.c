@@ -42,6 +42,7 @@
 #include <errno.h>
 #include <dirent.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -50,6 +51,7 @@
 #include "byte-swapping.h"
 #include "cleanup.h"
 #include "get_current_dir_name.h"
+#include "minmax.h"
 #include "regions.h"
 #include "rounding.h"
 
@@ -67,10 +69,11 @@ static int create_mbr (struct virtual_floppy *floppy);
 static void chs_too_large (uint8_t *out);
 static int create_partition_boot_sector (const char *label, struct virtual_floppy *floppy);
 static int create_fsinfo (struct virtual_floppy *floppy);
-static int create_fat (struct virtual_floppy *floppy);
-static void write_fat_file (uint32_t first_cluster, uint32_t nr_clusters, struct virtual_floppy *floppy);
 static int create_regions (struct virtual_floppy *floppy);
 
+/* Protects lazy materialization of the directory tables. */
+static pthread_mutex_t dir_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void
 init_virtual_floppy (struct virtual_floppy *floppy)
 {
@@ -92,22 +95,30 @@ create_virtual_floppy (const char *dir, const char *label,
   uint64_t nr_bytes, nr_clusters;
   uint32_t cluster;
 
+  floppy->label = label;
+
   if (visit (dir, floppy) == -1)
     return -1;
 
   nbdkit_debug ("floppy: %zu directories and %zu files",
                 floppy->dirs.size, floppy->files.size);
 
-  /* Create the on disk directory tables. */
+  /* Compute the size of each on disk directory table.  The tables
+   * themselves are materialized lazily on first access (see
+   * get_directory_table below), but the sizes are needed now because
+   * they determine the disk layout.
+   */
   for (i = 0; i < floppy->dirs.size; ++i) {
-    if (create_directory (i, label, floppy) == -1)
+    ssize_t entries = count_directory_entries (i, floppy);
+    if (entries == -1)
       return -1;
+    floppy->dirs.ptr[i].table_entries = entries;
   }
 
-  /* We now have a complete list of directories and files, and
-   * directories have been converted to on disk directory tables.  So
-   * we can assign them to clusters and also precisely calculate the
-   * size of the data region and hence the size of the FAT.
+  /* We now have a complete list of directories and files, and know
+   * how large the on disk directory tables will be.  So we can assign
+   * them to clusters and also precisely calculate the size of the
+   * data region and hence the size of the FAT.
    *
    * The first cluster number is always 2 (0 and 1 are reserved), and
    * (in this implementation) always contains the root directory.
@@ -117,7 +128,7 @@ create_virtual_floppy (const char *dir, const char *label,
   for (i = 0; i < floppy->dirs.size; ++i) {
     floppy->dirs.ptr[i].first_cluster = cluster;
     nr_bytes =
-      ROUND_UP (floppy->dirs.ptr[i].table.size * sizeof (struct dir_entry),
+      ROUND_UP (floppy->dirs.ptr[i].table_entries * sizeof (struct dir_entry),
                 CLUSTER_SIZE);
     floppy->data_size += nr_bytes;
     nr_clusters = nr_bytes / CLUSTER_SIZE;
@@ -168,15 +179,6 @@ create_virtual_floppy (const char *dir, const char *label,
   floppy->data_last_sector =
     floppy->data_start_sector + floppy->data_clusters * SECTORS_PER_CLUSTER - 1;
 
-  /* We now have to go back and update the cluster numbers in the
-   * directory entries (which we didn't have available during
-   * create_directory above).
-   */
-  for (i = 0; i < floppy->dirs.size; ++i) {
-    if (update_directory_first_cluster (i, floppy) == -1)
-      return -1;
-  }
-
   /* Create MBR. */
   if (create_mbr (floppy) == -1)
     return -1;
@@ -189,10 +191,6 @@ create_virtual_floppy (const char *dir, const char *label,
   if (create_fsinfo (floppy) == -1)
     return -1;
 
-  /* Allocate and populate FAT. */
-  if (create_fat (floppy) == -1)
-    return -1;
-
   /* Now we know how large everything is we can create the virtual
    * disk regions.
    */
@@ -209,8 +207,6 @@ free_virtual_floppy (struct virtual_floppy *floppy)
 
   free_regions (&floppy->regions);
 
-  free (floppy->fat);
-
   for (i = 0; i < floppy->files.size; ++i) {
     free (floppy->files.ptr[i].name);
     free (floppy->files.ptr[i].host_path);
@@ -533,62 +529,133 @@ create_fsinfo (struct virtual_floppy *floppy)
   return 0;
 }
 
-/* Allocate and populate the File Allocation Table. */
-static int
-create_fat (struct virtual_floppy *floppy)
+/* Compute the value of a single FAT entry.  The FAT is not stored
+ * anywhere.  Because directories and files are allocated
+ * contiguously, the entry for a cluster always points to the
+ * following cluster, except for the last cluster of each directory
+ * or file, so entries can be synthesized from the layout.
+ */
+static uint32_t
+fat_entry (uint64_t n, const struct virtual_floppy *floppy)
 {
-  size_t i;
-
-  /* Note there is only one copy held in memory.  The two FAT
-   * regions in the virtual disk point to the same copy.
+  uint32_t first_cluster, nr_clusters;
+  size_t lo, hi;
+
+  /* First two entries are reserved and contain standard data. */
+  if (n == 0)
+    return 0x0ffffff8;
+  if (n == 1)
+    return 0x0fffffff;
+
+  assert (n < floppy->fat_entries);
+
+  /* Find the directory or file containing cluster n.  Directories
+   * are allocated before files, and both lists are in increasing
+   * cluster order, so we can use a binary search for the last
+   * first_cluster <= n.  (Zero length files share the first_cluster
+   * of the following entry, but occupy no clusters, so the search
+   * correctly skips over them.)
    */
-  floppy->fat = calloc (floppy->fat_entries, 4);
-  if (floppy->fat == NULL) {
-    nbdkit_error ("calloc: %m");
-    return -1;
+  if (floppy->files.size > 0 && n >= floppy->files.ptr[0].first_cluster) {
+    lo = 0;
+    hi = floppy->files.size;
+    while (hi - lo > 1) {
+      const size_t mid = lo + (hi - lo) / 2;
+      if (floppy->files.ptr[mid].first_cluster <= n)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    first_cluster = floppy->files.ptr[lo].first_cluster;
+    nr_clusters = floppy->files.ptr[lo].nr_clusters;
+  }
+  else {
+    lo = 0;
+    hi = floppy->dirs.size;
+    while (hi - lo > 1) {
+      const size_t mid = lo + (hi - lo) / 2;
+      if (floppy->dirs.ptr[mid].first_cluster <= n)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    first_cluster = floppy->dirs.ptr[lo].first_cluster;
+    nr_clusters = floppy->dirs.ptr[lo].nr_clusters;
   }
 
-  /* Populate the FAT.  First two entries are reserved and
-   * contain standard data.
-   */
-  floppy->fat[0] = htole32 (0x0ffffff8);
-  floppy->fat[1] = htole32 (0x0fffffff);
+  assert (n >= first_cluster && n < first_cluster + nr_clusters);
 
-  for (i = 0; i < floppy->dirs.size; ++i) {
-    write_fat_file (floppy->dirs.ptr[i].first_cluster,
-                    floppy->dirs.ptr[i].nr_clusters, floppy);
-  }
-  for (i = 0; i < floppy->files.size; ++i) {
-    write_fat_file (floppy->files.ptr[i].first_cluster,
-                    floppy->files.ptr[i].nr_clusters, floppy);
-  }
+  /* Last cluster / end of file marker, else pointer to next cluster. */
+  if (n == first_cluster + nr_clusters - 1)
+    return 0x0fffffff;
+  else
+    return n + 1;
+}
 
-  return 0;
+/* Fill buf with FAT data, starting at byte fatoffs within the FAT.
+ * The caller must clip the request to the FAT region.
+ */
+void
+read_fat (void *buf, uint32_t count, uint64_t fatoffs,
+          const struct virtual_floppy *floppy)
+{
+  char *p = buf;
+  uint64_t n = fatoffs / 4;
+  size_t shift = fatoffs & 3;
+  uint32_t entry;
+
+  while (count > 0) {
+    const size_t len = MIN (count, 4 - shift);
+
+    entry = htole32 (fat_entry (n, floppy));
+    memcpy (p, (char *) &entry + shift, len);
+    p += len;
+    count -= len;
+    shift = 0;
+    n++;
+  }
 }
 
-static void
-write_fat_file (uint32_t first_cluster, uint32_t nr_clusters,
-                struct virtual_floppy *floppy)
+/* Return the on disk directory table for the directory region
+ * starting at the given disk offset, materializing it on first
+ * access.  Returns NULL on error.
+ */
+const unsigned char *
+get_directory_table (uint64_t start, struct virtual_floppy *floppy)
 {
-  uint32_t cl;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&dir_table_lock);
+  uint64_t cluster;
+  size_t lo, hi;
 
-  /* It's possible for files to have zero size.  These don't occupy
-   * any space in the disk or FAT so we just skip them here.
+  /* Which directory does this region belong to?  The directories
+   * are in increasing cluster order so use a binary search.
    */
-  if (nr_clusters == 0)
-    return;
-
-  for (cl = 0; cl < nr_clusters - 1; ++cl) {
-    assert (first_cluster + cl < floppy->fat_entries);
-    /* Directories and files are stored contiguously so the entry in
-     * the FAT always points to the next cluster (except for the
-     * last one, handled below).
-     */
-    floppy->fat[first_cluster + cl] = htole32 (first_cluster + cl + 1);
+  assert (start >= (uint64_t) floppy->data_start_sector * SECTOR_SIZE);
+  cluster =
+    2 + (start - (uint64_t) floppy->data_start_sector * SECTOR_SIZE)
+    / CLUSTER_SIZE;
+  lo = 0;
+  hi = floppy->dirs.size;
+  while (hi - lo > 1) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (floppy->dirs.ptr[mid].first_cluster <= cluster)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  assert (floppy->dirs.ptr[lo].first_cluster == cluster);
+
+  if (floppy->dirs.ptr[lo].table.size == 0) {
+    nbdkit_debug ("floppy: materializing directory table %zu", lo);
+    if (create_directory (lo, floppy->label, floppy) == -1)
+      return NULL;
+    assert (floppy->dirs.ptr[lo].table.size ==
+            floppy->dirs.ptr[lo].table_entries);
+    if (update_directory_first_cluster (lo, floppy) == -1)
+      return NULL;
   }
 
-  /* Last cluster / end of file marker. */
-  floppy->fat[first_cluster + cl] = htole32 (0x0fffffff);
+  return (const unsigned char *) floppy->dirs.ptr[lo].table.ptr;
 }
 
 /* Lay out the final virtual disk. */
@@ -633,10 +700,13 @@ create_regions (struct virtual_floppy *floppy)
                          region_zero) == -1)
     return -1;
 
-  /* First copy of FAT. */
+  /* First copy of FAT.  The data pointer is NULL because FAT entries
+   * are synthesized on access (see read_fat above) instead of being
+   * stored in memory.
+   */
   if (append_region_len (&floppy->regions, "FAT #1",
                          floppy->fat_entries*4, 0, CLUSTER_SIZE,
-                         region_data, (void *) floppy->fat) == -1)
+                         region_data, NULL) == -1)
     return -1;
 
   /* Check that fat2_start_sector and region calculation match. */
@@ -646,7 +716,7 @@ create_regions (struct virtual_floppy *floppy)
   /* Second copy of FAT. */
   if (append_region_len (&floppy->regions, "FAT #2",
                          floppy->fat_entries*4, 0, CLUSTER_SIZE,
-                         region_data, (void *) floppy->fat) == -1)
+                         region_data, NULL) == -1)
     return -1;
 
   /* Check that data_start_sector and region calculation match. */
@@ -654,21 +724,21 @@ create_regions (struct virtual_floppy *floppy)
           floppy->data_start_sector * SECTOR_SIZE);
 
   /* Now we're into the data region.  We add all directory tables
-   * first.
+   * first.  The data pointer is NULL until the table is materialized
+   * on first access (see get_directory_table above).
    */
   for (i = 0; i < floppy->dirs.size; ++i) {
     /* Directories can never be completely empty because of the volume
      * label (root) or "." and ".." entries (non-root).
      */
-    assert (floppy->dirs.ptr[i].table.size > 0);
+    assert (floppy->dirs.ptr[i].table_entries > 0);
 
     if (append_region_len (&floppy->regions,
                            i == 0 ? "root directory" : floppy->dirs.ptr[i].name,
-                           floppy->dirs.ptr[i].table.size *
+                           floppy->dirs.ptr[i].table_entries *
                            sizeof (struct dir_entry),
                            0, CLUSTER_SIZE,
-                           region_data,
-                           (void *) floppy->dirs.ptr[i].table.ptr) == -1)
+                           region_data, NULL) == -1)
       return -1;
   }
 
@@ -156,6 +156,12 @@ struct dir {
   uint32_t first_cluster;       /* First cluster containing this dir. */
   uint32_t nr_clusters;         /* Number of clusters. */
 
+  /* Number of entries in the on disk directory table.  This is
+   * computed up front (because it determines the disk layout), but
+   * the table itself is only materialized on first access.
+   */
+  uint64_t table_entries;
+
   /* List of subdirectories.  This is actually a list of indexes
    * into the floppy->dirs array.
    */
@@ -166,7 +172,9 @@ struct dir {
    */
   idxs fileidxs;
 
-  /* On disk directory table. */
+  /* On disk directory table.  Empty until materialized by
+   * get_directory_table.
+   */
   dir_entries table;
 };
 
@@ -185,8 +193,8 @@ struct virtual_floppy {
   /* Filesystem information sector. */
   struct fsinfo fsinfo;
 
-  /* File Allocation Table (also used for second copy). */
-  uint32_t *fat;
+  /* Volume label (points to the configuration string). */
+  const char *label;
 
   /* All regular files found. */
   files files;
@@ -233,6 +241,15 @@ extern int create_virtual_floppy (const char *dir, const char *label,
   __attribute__((__nonnull__ (1, 2, 3)));
 extern void free_virtual_floppy (struct virtual_floppy *floppy)
   __attribute__((__nonnull__ (1)));
+extern const unsigned char *get_directory_table (uint64_t start,
+                                                 struct virtual_floppy *floppy)
+  __attribute__((__nonnull__ (2)));
+extern void read_fat (void *buf, uint32_t count, uint64_t fatoffs,
+                      const struct virtual_floppy *floppy)
+  __attribute__((__nonnull__ (1, 4)));
+extern ssize_t count_directory_entries (size_t di,
+                                        struct virtual_floppy *floppy)
+  __attribute__((__nonnull__ (2)));
 extern int create_directory (size_t di, const char *label,
                              struct virtual_floppy *floppy)
   __attribute__((__nonnull__ (2, 3)));
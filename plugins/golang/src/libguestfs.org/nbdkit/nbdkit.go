@@ -49,6 +49,7 @@ import "C"
 import (
 	"fmt"
 	"reflect"
+	"sync"
 	"syscall"
 	"unsafe"
 )
@@ -122,9 +123,17 @@ type ConnectionInterface interface {
 	IsRotational() (bool, error)
 	CanMultiConn() (bool, error)
 
+	// PRead fills buf with data read from the underlying store.
+	//
+	// NB: buf aliases the server's own buffer, so reads and
+	// writes happen in place with no copy across the cgo
+	// boundary.  It is only valid until PRead returns: do not
+	// retain the slice, and do not hand it to a goroutine which
+	// can outlive the call.
 	PRead(buf []byte, offset uint64, flags uint32) error // required
 
 	// NB: PWrite will NOT be called unless CanWrite returns true.
+	// The same buffer lifetime rules apply as for PRead.
 	CanWrite() (bool, error)
 	PWrite(buf []byte, offset uint64, flags uint32) error
 
@@ -228,9 +237,14 @@ func (c *Connection) Zero(count uint32, offset uint64, flags uint32) error {
 }
 
 // The implementation of the user plugin.
+//
+// The connection map is read on every request and updated only on
+// open/close, and the thread model is parallel, so guard it with a
+// reader/writer lock rather than serializing all requests.
 var pluginImpl PluginInterface
 var nextConnectionId uintptr
 var connectionMap map[uintptr]ConnectionInterface
+var connectionLock sync.RWMutex
 
 // Callbacks from the server.  These translate C to Go and back.
 
@@ -316,15 +330,19 @@ func implOpen(c_readonly C.int) unsafe.Pointer {
 		set_error(err)
 		return nil
 	}
+	connectionLock.Lock()
 	id := nextConnectionId
 	nextConnectionId++
 	connectionMap[id] = h
+	connectionLock.Unlock()
 	return unsafe.Pointer(id)
 }
 
 func getConn(handle unsafe.Pointer) ConnectionInterface {
 	id := uintptr(handle)
+	connectionLock.RLock()
 	h, ok := connectionMap[id]
+	connectionLock.RUnlock()
 	if !ok {
 		panic(fmt.Sprintf("connection %d was not open", id))
 	}
@@ -336,7 +354,9 @@ func implClose(handle unsafe.Pointer) {
 	h := getConn(handle)
 	h.Close()
 	id := uintptr(handle)
+	connectionLock.Lock()
 	delete(connectionMap, id)
+	connectionLock.Unlock()
 }
 
 //export implGetSize
@@ -440,18 +460,27 @@ func implCanMultiConn(handle unsafe.Pointer) C.int {
 	}
 }
 
-//export implPRead
-func implPRead(handle unsafe.Pointer, c_buf unsafe.Pointer,
-	count C.uint32_t, offset C.uint64_t, flags C.uint32_t) C.int {
-	h := getConn(handle)
-	// https://github.com/golang/go/issues/13656
-	// https://stackoverflow.com/a/25776046
+// Wrap the server's C buffer as a []byte without copying.  The slice
+// aliases memory owned by the server, so it is only valid until the
+// callback it was created for returns; see the lifetime notes on
+// PRead and PWrite in ConnectionInterface.
+//
+// https://github.com/golang/go/issues/13656
+// https://stackoverflow.com/a/25776046
+func wrapBuffer(c_buf unsafe.Pointer, count C.uint32_t) []byte {
 	hdr := reflect.SliceHeader{
 		Data: uintptr(c_buf),
 		Len:  int(count),
 		Cap:  int(count),
 	}
-	buf := *(*[]byte)(unsafe.Pointer(&hdr))
+	return *(*[]byte)(unsafe.Pointer(&hdr))
+}
+
+//export implPRead
+func implPRead(handle unsafe.Pointer, c_buf unsafe.Pointer,
+	count C.uint32_t, offset C.uint64_t, flags C.uint32_t) C.int {
+	h := getConn(handle)
+	buf := wrapBuffer(c_buf, count)
 	err := h.PRead(buf, uint64(offset), uint32(flags))
 	if err != nil {
 		set_error(err)
@@ -464,14 +493,7 @@ func implPRead(handle unsafe.Pointer, c_buf unsafe.Pointer,
 func implPWrite(handle unsafe.Pointer, c_buf unsafe.Pointer,
 	count C.uint32_t, offset C.uint64_t, flags C.uint32_t) C.int {
 	h := getConn(handle)
-	// https://github.com/golang/go/issues/13656
-	// https://stackoverflow.com/a/25776046
-	hdr := reflect.SliceHeader{
-		Data: uintptr(c_buf),
-		Len:  int(count),
-		Cap:  int(count),
-	}
-	buf := *(*[]byte)(unsafe.Pointer(&hdr))
+	buf := wrapBuffer(c_buf, count)
 	err := h.PWrite(buf, uint64(offset), uint32(flags))
 	if err != nil {
 		set_error(err)
@@ -35,6 +35,8 @@ package nbdkit
 /*
 #cgo pkg-config: nbdkit
 
+#include <stdlib.h>
+
 #define NBDKIT_API_VERSION 2
 #include <nbdkit-plugin.h>
 
@@ -53,19 +55,26 @@ _nbdkit_error (const char *s)
 }
 */
 import "C"
-import "syscall"
+import (
+	"syscall"
+	"unsafe"
+)
 
 // Utility functions.
 
 func Debug(s string) {
-	C._nbdkit_debug(C.CString(s))
+	cs := C.CString(s)
+	C._nbdkit_debug(cs)
+	C.free(unsafe.Pointer(cs))
 }
 
 // This function is provided but plugins would rarely need to call
 // this explicitly since returning an error from a plugin callback
 // will call it implicitly.
 func Error(s string) {
-	C._nbdkit_error(C.CString(s))
+	cs := C.CString(s)
+	C._nbdkit_error(cs)
+	C.free(unsafe.Pointer(cs))
 }
 
 // Same applies as for Error().  Callers should not usually need to
@@ -40,6 +40,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <guestfs.h>
 
@@ -52,6 +53,8 @@ static const char *libvirt_uri = NULL; /* libvirt URI */
 static const char *export = NULL;  /* export device or file */
 static const char *format = NULL;  /* format parameter */
 static int trace = 0, debug = 0;
+static unsigned connections = 1;   /* appliances per NBD connection */
+static int64_t readahead = -1;     /* guest readahead in bytes, -1 = default */
 
 /* disk and domain options.  (NB: list stored in reverse order) */
 struct drive {
@@ -94,6 +97,15 @@ plugin_guestfs_config (const char *key, const char *value)
   else if (strcmp (key, "export") == 0) {
     export = value;
   }
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+  }
+  else if (strcmp (key, "readahead") == 0) {
+    readahead = nbdkit_parse_size (value);
+    if (readahead == -1)
+      return -1;
+  }
   else if (strcmp (key, "format") == 0) {
     if (strcmp (value, "") != 0)
       format = value;
@@ -176,14 +188,34 @@ plugin_guestfs_config_complete (void)
     return -1;
   }
 
+  if (connections < 1) {
+    nbdkit_error ("the 'connections' parameter must be >= 1");
+    return -1;
+  }
+
   return 0;
 }
 
+/* A libguestfs handle is not thread safe, so with a single appliance
+ * everything must be serialized (the historical behaviour).  With
+ * connections > 1 we have a pool of appliances and can run read
+ * requests in parallel, striping them across the pool.
+ */
+static int
+plugin_guestfs_thread_model (void)
+{
+  if (connections > 1)
+    return NBDKIT_THREAD_MODEL_PARALLEL;
+  return NBDKIT_THREAD_MODEL_SERIALIZE_CONNECTIONS;
+}
+
 #define plugin_guestfs_config_help                              \
   "connect=<URI>       (optional) libvirt connection URI\n"         \
   "domain=<DOMAIN>                libvirt domain name\n"            \
   "disk=<DISK>                    disk name\n"                      \
   "mount=inspect|MOUNT            mount filesystems\n"              \
+  "connections=N       (optional) number of appliances (readonly only)\n" \
+  "readahead=BYTES     (optional) guest block device readahead\n"   \
   "export=DEVICE|FILE  (required) export device or file"
 
 /* Free up the structures used to store the command line arguments.
@@ -213,9 +245,20 @@ plugin_guestfs_unload (void)
                   guestfs_last_error ((g)));                            \
   } while (0)
 
-/* The per-connection handle. */
+/* The per-connection handle.
+ *
+ * With connections=1 (the default) there is a single appliance and
+ * all requests are serialized around it.  With connections > 1 there
+ * is a pool of identical readonly appliances and each read request
+ * borrows a free one, so concurrent requests are striped across the
+ * pool instead of queueing behind a single guest round trip.
+ */
 struct handle {
-  guestfs_h *g;
+  size_t nr_appliances;
+  guestfs_h **appliances;
+  bool *in_use;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
   bool is_device;
   uint64_t exportsize;
 };
@@ -223,81 +266,165 @@ struct handle {
 static int set_up_logging (guestfs_h *g);
 static int add_disks (guestfs_h *g, int readonly, struct drive *);
 static int mount_filesystems (guestfs_h *g, int readonly, struct mount *);
+static int set_readahead (guestfs_h *g);
 
-/* Create the per-connection handle. */
-static void *
-plugin_guestfs_open (int readonly)
+/* Create and launch one appliance. */
+static guestfs_h *
+launch_appliance (int readonly)
 {
-  struct handle *h;
-  int64_t r;
-
-  h = malloc (sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("malloc: %m");
-    return NULL;
-  }
+  guestfs_h *g;
 
-  h->g = guestfs_create_flags (GUESTFS_CREATE_NO_ENVIRONMENT);
-  if (!h->g) {
+  g = guestfs_create_flags (GUESTFS_CREATE_NO_ENVIRONMENT);
+  if (!g) {
     nbdkit_error ("creating libguestfs handle: %m");
-    goto err1;
+    return NULL;
   }
 
-  guestfs_set_error_handler (h->g, NULL, NULL);
+  guestfs_set_error_handler (g, NULL, NULL);
 
   if (trace)
-    guestfs_set_trace (h->g, 1);
+    guestfs_set_trace (g, 1);
 
   if (debug)
-    guestfs_set_verbose (h->g, 1);
+    guestfs_set_verbose (g, 1);
+
+  if (guestfs_parse_environment (g) == -1) {
+    GERROR (g, "guestfs_parse_environment");
+    goto err;
+  }
+
+  if (set_up_logging (g) == -1)
+    goto err;
+
+  if (add_disks (g, readonly, all_drives) == -1)
+    goto err;
 
-  if (guestfs_parse_environment (h->g) == -1) {
-    GERROR (h->g, "guestfs_parse_environment");
-    goto err2;
+  if (guestfs_launch (g) == -1) {
+    GERROR (g, "guestfs_launch");
+    goto err;
   }
 
-  if (set_up_logging (h->g) == -1)
-    goto err2;
+  if (mount_filesystems (g, readonly, all_mounts) == -1)
+    goto err;
 
-  if (add_disks (h->g, readonly, all_drives) == -1)
-    goto err2;
+  if (readahead >= 0 && set_readahead (g) == -1)
+    goto err;
 
-  if (guestfs_launch (h->g) == -1) {
-    GERROR (h->g, "guestfs_launch");
-    goto err2;
+  return g;
+
+ err:
+  guestfs_close (g);
+  return NULL;
+}
+
+/* Borrow a free appliance from the pool, waiting if they are all
+ * busy.  With connections=1 the thread model serializes requests so
+ * we never actually wait.
+ */
+static guestfs_h *
+get_appliance (struct handle *h)
+{
+  size_t i;
+
+  pthread_mutex_lock (&h->lock);
+  for (;;) {
+    for (i = 0; i < h->nr_appliances; ++i) {
+      if (!h->in_use[i]) {
+        h->in_use[i] = true;
+        pthread_mutex_unlock (&h->lock);
+        return h->appliances[i];
+      }
+    }
+    pthread_cond_wait (&h->cond, &h->lock);
   }
+}
 
-  if (mount_filesystems (h->g, readonly, all_mounts) == -1)
-    goto err2;
+static void
+put_appliance (struct handle *h, guestfs_h *g)
+{
+  size_t i;
+
+  pthread_mutex_lock (&h->lock);
+  for (i = 0; i < h->nr_appliances; ++i) {
+    if (h->appliances[i] == g) {
+      h->in_use[i] = false;
+      break;
+    }
+  }
+  pthread_cond_signal (&h->cond);
+  pthread_mutex_unlock (&h->lock);
+}
+
+/* Create the per-connection handle. */
+static void *
+plugin_guestfs_open (int readonly)
+{
+  struct handle *h;
+  size_t i;
+  int64_t r;
+  guestfs_h *g;
+
+  /* Writes cannot be striped safely across independent appliances. */
+  if (connections > 1 && !readonly) {
+    nbdkit_error ("connections > 1 requires a readonly connection, "
+                  "use the -r option");
+    return NULL;
+  }
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  h->appliances = calloc (connections, sizeof (guestfs_h *));
+  h->in_use = calloc (connections, sizeof (bool));
+  if (h->appliances == NULL || h->in_use == NULL) {
+    nbdkit_error ("calloc: %m");
+    goto err;
+  }
+  pthread_mutex_init (&h->lock, NULL);
+  pthread_cond_init (&h->cond, NULL);
+
+  for (i = 0; i < connections; ++i) {
+    h->appliances[i] = launch_appliance (readonly);
+    if (h->appliances[i] == NULL)
+      goto err;
+    h->nr_appliances++;
+  }
+  g = h->appliances[0];
 
   /* Exported thing. */
   if (strncmp (export, "/dev/", 5) == 0) {
     h->is_device = true;
-    r = guestfs_blockdev_getsize64 (h->g, export);
+    r = guestfs_blockdev_getsize64 (g, export);
     if (r == -1) {
-      GERROR (h->g, "%s: guestfs_blockdev_getsize64", export);
-      goto err2;
+      GERROR (g, "%s: guestfs_blockdev_getsize64", export);
+      goto err;
     }
     h->exportsize = (uint64_t) r;
   }
   else {
     h->is_device = false;
-    r = guestfs_filesize (h->g, export);
+    r = guestfs_filesize (g, export);
     if (r == -1) {
-      GERROR (h->g, "%s: guestfs_filesize", export);
-      goto err2;
+      GERROR (g, "%s: guestfs_filesize", export);
+      goto err;
     }
     h->exportsize = (uint64_t) r;
   }
 
-  nbdkit_debug ("guestfs: export %s, size = %" PRIu64 " bytes",
-                export, h->exportsize);
+  nbdkit_debug ("guestfs: export %s, size = %" PRIu64 " bytes, "
+                "%zu appliance(s)",
+                export, h->exportsize, h->nr_appliances);
 
   return h;
 
- err2:
-  guestfs_close (h->g);
- err1:
+ err:
+  for (i = 0; i < h->nr_appliances; ++i)
+    guestfs_close (h->appliances[i]);
+  free (h->appliances);
+  free (h->in_use);
   free (h);
   return NULL;
 }
@@ -480,21 +607,60 @@ mount_filesystems (guestfs_h *g, int readonly, struct mount *mounts)
   return 0;
 }
 
+/* Set the guest kernel readahead on every block device in the
+ * appliance.  This makes the guest kernel fetch ahead of sequential
+ * reads, overlapping guest I/O with the next request round trip.
+ */
+static int
+set_readahead (guestfs_h *g)
+{
+  char **devices;
+  size_t i;
+  int ret = 0;
+
+  devices = guestfs_list_devices (g);
+  if (devices == NULL) {
+    GERROR (g, "guestfs_list_devices");
+    return -1;
+  }
+
+  for (i = 0; devices[i] != NULL; ++i) {
+    /* blockdev_setra takes the count in 512 byte sectors. */
+    if (guestfs_blockdev_setra (g, devices[i], readahead / 512) == -1) {
+      GERROR (g, "%s: guestfs_blockdev_setra", devices[i]);
+      ret = -1;
+      break;
+    }
+  }
+
+  for (i = 0; devices[i] != NULL; ++i)
+    free (devices[i]);
+  free (devices);
+
+  return ret;
+}
+
 /* Free up the per-connection handle. */
 static void
 plugin_guestfs_close (void *handle)
 {
   struct handle *h = handle;
+  size_t i;
 
-  if (guestfs_shutdown (h->g) == -1) {
-    GERROR (h->g, "shutdown failure: there may be unwritten data");
-    /* ... but we can't do anything about it, see note in nbdkit-plugin(3) */
+  for (i = 0; i < h->nr_appliances; ++i) {
+    if (guestfs_shutdown (h->appliances[i]) == -1) {
+      GERROR (h->appliances[i],
+              "shutdown failure: there may be unwritten data");
+      /* ... but we can't do anything about it, see note in nbdkit-plugin(3) */
+    }
+    guestfs_close (h->appliances[i]);
   }
-  guestfs_close (h->g);
+  free (h->appliances);
+  free (h->in_use);
   free (h);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_CONNECTIONS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
 static int64_t
@@ -510,6 +676,7 @@ static int
 plugin_guestfs_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
   struct handle *h = handle;
+  guestfs_h *g = get_appliance (h);
   char *(*pr) (guestfs_h *, const char *, int, int64_t, size_t *);
   size_t size;
 
@@ -519,10 +686,11 @@ plugin_guestfs_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
     pr = guestfs_pread;
 
   while (count > 0) {
-    CLEANUP_FREE char *data = pr (h->g, export, count, offset, &size);
+    CLEANUP_FREE char *data = pr (g, export, count, offset, &size);
     if (!data) {
-      GERROR (h->g, "%s: pread", export);
-      errno = guestfs_last_errno (h->g) ? : EIO;
+      GERROR (g, "%s: pread", export);
+      errno = guestfs_last_errno (g) ? : EIO;
+      put_appliance (h, g);
       return -1;
     }
 
@@ -533,15 +701,19 @@ plugin_guestfs_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
     count -= size;
   }
 
+  put_appliance (h, g);
   return 0;
 }
 
-/* Write data. */
+/* Write data.  Writes imply connections=1 (see plugin_guestfs_open)
+ * so borrowing an appliance here never waits.
+ */
 static int
 plugin_guestfs_pwrite (void *handle, const void *buf,
                        uint32_t count, uint64_t offset)
 {
   struct handle *h = handle;
+  guestfs_h *g = get_appliance (h);
   int (*pw) (guestfs_h *, const char *, const char *, size_t, int64_t);
   int r;
 
@@ -551,10 +723,11 @@ plugin_guestfs_pwrite (void *handle, const void *buf,
     pw = guestfs_pwrite;
 
   while (count > 0) {
-    r = pw (h->g, export, buf, count, offset);
+    r = pw (g, export, buf, count, offset);
     if (r == -1) {
-      GERROR (h->g, "%s: pwrite", export);
-      errno = guestfs_last_errno (h->g) ? : EIO;
+      GERROR (g, "%s: pwrite", export);
+      errno = guestfs_last_errno (g) ? : EIO;
+      put_appliance (h, g);
       return -1;
     }
 
@@ -563,6 +736,7 @@ plugin_guestfs_pwrite (void *handle, const void *buf,
     count -= r;
   }
 
+  put_appliance (h, g);
   return 0;
 }
 
@@ -571,13 +745,16 @@ static int
 plugin_guestfs_flush (void *handle)
 {
   struct handle *h = handle;
+  guestfs_h *g = get_appliance (h);
 
-  if (guestfs_sync (h->g) == -1) {
-    GERROR (h->g, "guestfs_sync");
-    errno = guestfs_last_errno (h->g) ? : EIO;
+  if (guestfs_sync (g) == -1) {
+    GERROR (g, "guestfs_sync");
+    errno = guestfs_last_errno (g) ? : EIO;
+    put_appliance (h, g);
     return -1;
   }
 
+  put_appliance (h, g);
   return 0;
 }
 
@@ -588,6 +765,7 @@ static struct nbdkit_plugin plugin = {
   .config            = plugin_guestfs_config,
   .config_complete   = plugin_guestfs_config_complete,
   .config_help       = plugin_guestfs_config_help,
+  .thread_model      = plugin_guestfs_thread_model,
   .unload            = plugin_guestfs_unload,
   .open              = plugin_guestfs_open,
   .close             = plugin_guestfs_close,
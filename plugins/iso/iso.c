@@ -34,8 +34,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -57,61 +65,124 @@ static const char *isoprog = ISOPROG;
 /* Extra parameters for isoprog. */
 static const char *params = NULL;
 
+/* Serve the ISO while it is being generated (pipeline=true). */
+static bool pipeline = false;
+
+/* Directory of cached ISOs (cache=DIRECTORY). */
+static char *cachedir = NULL;
+
+/* In cache mode, the final and temporary names of the cached ISO. */
+static char *cachefile = NULL;
+static char *cachetmp = NULL;
+
 /* The temporary ISO. */
 static int fd = -1;
 
-/* Construct the temporary ISO. */
-static int
-make_iso (void)
+/* In pipeline mode, the final size of the ISO in bytes (found using
+ * ‘isoprog -print-size’ before generation starts), and the state of
+ * the background generation.
+ */
+static int64_t size = -1;
+static pthread_t generator;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool generation_started = false;
+static bool generation_done = false;
+static bool generation_failed = false;
+
+/* Construct the isoprog command.  If print_size is true, construct
+ * the variant which prints the size of the ISO in sectors on stdout
+ * instead of writing any data.
+ */
+static char *
+build_command (bool print_size)
 {
-  const char *tmpdir;
-  CLEANUP_FREE char *template = NULL;
-  CLEANUP_FREE char *command = NULL;
+  char *command = NULL;
   size_t command_len = 0;
   FILE *fp;
   size_t i;
-  int r;
 
-  /* Path for temporary file. */
-  tmpdir = getenv ("TMPDIR");
-  if (tmpdir == NULL)
-    tmpdir = LARGE_TMPDIR;
-  if (asprintf (&template, "%s/isoXXXXXX", tmpdir) == -1) {
-    nbdkit_error ("asprintf: %m");
-    return -1;
-  }
-
-  fd = mkstemp (template);
-  if (fd == -1) {
-    nbdkit_error ("mkstemp: %s: %m", template);
-    return -1;
-  }
-  unlink (template);
-
-  /* Construct the isoprog command. */
   fp = open_memstream (&command, &command_len);
   if (fp == NULL) {
     nbdkit_error ("open_memstream: %m");
-    return -1;
+    return NULL;
   }
 
   shell_quote (isoprog, fp);
   fprintf (fp, " -quiet");
+  if (print_size)
+    fprintf (fp, " -print-size");
   if (params)
     fprintf (fp, " %s", params);
   for (i = 0; i < dirs.size; ++i) {
     fputc (' ', fp);
     shell_quote (dirs.ptr[i], fp);
   }
-  /* Redirect output to the temporary file. */
-  fprintf (fp, " >&%d", fd);
+  if (!print_size)
+    /* Redirect output to the temporary file. */
+    fprintf (fp, " >&%d", fd);
 
   if (fclose (fp) == EOF) {
     nbdkit_error ("memstream failed: %m");
-    return -1;
+    free (command);
+    return NULL;
   }
 
-  /* Run the command. */
+  return command;
+}
+
+/* Create the file that the ISO will be written to. */
+static int
+create_iso_file (void)
+{
+  const char *tmpdir;
+  CLEANUP_FREE char *template = NULL;
+
+  if (cachedir == NULL) {
+    /* Path for temporary file. */
+    tmpdir = getenv ("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = LARGE_TMPDIR;
+    if (asprintf (&template, "%s/isoXXXXXX", tmpdir) == -1) {
+      nbdkit_error ("asprintf: %m");
+      return -1;
+    }
+
+    fd = mkstemp (template);
+    if (fd == -1) {
+      nbdkit_error ("mkstemp: %s: %m", template);
+      return -1;
+    }
+    unlink (template);
+  }
+  else {
+    /* Generate into a temporary file in the cache directory so it
+     * can be renamed into place when complete.
+     */
+    if (asprintf (&cachetmp, "%s/isoXXXXXX", cachedir) == -1) {
+      nbdkit_error ("asprintf: %m");
+      return -1;
+    }
+
+    fd = mkstemp (cachetmp);
+    if (fd == -1) {
+      nbdkit_error ("mkstemp: %s: %m", cachetmp);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Run isoprog, writing the ISO to fd. */
+static int
+run_isoprog (void)
+{
+  CLEANUP_FREE char *command = build_command (false);
+  int r;
+
+  if (command == NULL)
+    return -1;
+
   nbdkit_debug ("%s", command);
   r = system (command);
   if (exit_status_to_nbd_error (r, isoprog) == -1)
@@ -120,9 +191,172 @@ make_iso (void)
   return 0;
 }
 
+/* Run ‘isoprog -print-size’ which prints the final size of the ISO
+ * in 2048 byte sectors on stdout without writing any data.  This is
+ * cheap since it only has to walk the input directories.
+ */
+static int64_t
+print_size (void)
+{
+  CLEANUP_FREE char *command = build_command (true);
+  FILE *pp;
+  uint64_t sectors;
+  int n, r;
+
+  if (command == NULL)
+    return -1;
+
+  nbdkit_debug ("%s", command);
+  pp = popen (command, "r");
+  if (pp == NULL) {
+    nbdkit_error ("popen: %m");
+    return -1;
+  }
+  n = fscanf (pp, "%" SCNu64, &sectors);
+  r = pclose (pp);
+  if (exit_status_to_nbd_error (r, isoprog) == -1)
+    return -1;
+  if (n != 1) {
+    nbdkit_error ("could not parse the output of %s -print-size",
+                  isoprog);
+    return -1;
+  }
+
+  return sectors * UINT64_C(2048);
+}
+
+/* On successful generation move the ISO into the cache. */
+static void
+finish_cachefile (void)
+{
+  if (cachetmp == NULL)
+    return;
+
+  if (rename (cachetmp, cachefile) == -1) {
+    /* Not fatal, we can still serve the temporary file. */
+    nbdkit_debug ("rename: %s: %m", cachefile);
+    unlink (cachetmp);
+  }
+  free (cachetmp);
+  cachetmp = NULL;
+}
+
+/* Background thread running the generation in pipeline mode. */
+static void *
+generator_thread (void *vp)
+{
+  bool failed = false;
+  struct stat statbuf;
+
+  if (run_isoprog () == -1)
+    failed = true;
+
+  /* The size advertised to clients came from -print-size, so check
+   * the generated ISO really is that size.
+   */
+  if (!failed) {
+    if (fstat (fd, &statbuf) == -1 || statbuf.st_size != size) {
+      nbdkit_error ("generated ISO size does not match %s -print-size "
+                    "(expected %" PRIi64 ")", isoprog, size);
+      failed = true;
+    }
+  }
+
+  if (!failed)
+    finish_cachefile ();
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    generation_done = true;
+    generation_failed = failed;
+  }
+
+  return NULL;
+}
+
+/* Hash used to key cached ISOs (FNV-1a).  It covers the program, the
+ * parameters, and the name, size and mtime of every file and
+ * directory in the input, so touching any input invalidates the
+ * cached ISO.
+ */
+static uint64_t hash;
+
+static void
+hash_bytes (const void *p, size_t len)
+{
+  const uint8_t *b = p;
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    hash ^= b[i];
+    hash *= UINT64_C(0x100000001b3);
+  }
+}
+
+static void
+hash_string (const char *s)
+{
+  hash_bytes (s, strlen (s) + 1);
+}
+
+static int
+hash_visit (const char *path, const struct stat *statbuf, int flag,
+            struct FTW *ftwbuf)
+{
+  int64_t v;
+
+  hash_string (path);
+  v = statbuf->st_size;
+  hash_bytes (&v, sizeof v);
+  v = statbuf->st_mtime;
+  hash_bytes (&v, sizeof v);
+  return 0;
+}
+
+static int
+compute_cachefile (void)
+{
+  size_t i;
+
+  hash = UINT64_C(0xcbf29ce484222325);
+  hash_string (isoprog);
+  if (params)
+    hash_string (params);
+  for (i = 0; i < dirs.size; ++i) {
+    hash_string (dirs.ptr[i]);
+    if (nftw (dirs.ptr[i], hash_visit, 64, FTW_PHYS) == -1) {
+      nbdkit_error ("nftw: %s: %m", dirs.ptr[i]);
+      return -1;
+    }
+  }
+
+  if (asprintf (&cachefile, "%s/iso-%016" PRIx64 ".iso",
+                cachedir, hash) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+
+  return 0;
+}
+
 static void
 iso_unload (void)
 {
+  if (generation_started) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      if (!generation_done)
+        nbdkit_debug ("waiting for ISO generation to finish");
+    }
+    pthread_join (generator, NULL);
+  }
+  if (cachetmp) {
+    unlink (cachetmp);
+    free (cachetmp);
+  }
+  free (cachefile);
+  free (cachedir);
+
   string_vector_iter (&dirs, (void *) free);
   free (dirs.ptr);
 
@@ -152,6 +386,18 @@ iso_config (const char *key, const char *value)
   else if (strcmp (key, "prog") == 0) {
     isoprog = value;
   }
+  else if (strcmp (key, "cache") == 0) {
+    cachedir = nbdkit_realpath (value);
+    if (cachedir == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "pipeline") == 0) {
+    int r = nbdkit_parse_bool (value);
+
+    if (r == -1)
+      return -1;
+    pipeline = r;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -175,12 +421,66 @@ iso_config_complete (void)
 #define iso_config_help \
   "dir=<DIRECTORY>     (required) The directory to serve.\n" \
   "params='<PARAMS>'              Extra parameters to pass.\n" \
-  "prog=<ISOPROG>                 The program used to make ISOs." \
+  "prog=<ISOPROG>                 The program used to make ISOs.\n" \
+  "cache=<DIRECTORY>              Cache generated ISOs here.\n" \
+  "pipeline=true                  Serve the ISO while generating it." \
 
 static int
 iso_get_ready (void)
 {
-  return make_iso ();
+  if (cachedir) {
+    if (compute_cachefile () == -1)
+      return -1;
+    fd = open (cachefile, O_RDONLY);
+    if (fd >= 0) {
+      nbdkit_debug ("using cached ISO: %s", cachefile);
+      return 0;
+    }
+    /* Cache miss, we must generate the ISO. */
+  }
+
+  if (create_iso_file () == -1)
+    return -1;
+
+  if (!pipeline) {
+    if (run_isoprog () == -1)
+      return -1;
+    finish_cachefile ();
+    return 0;
+  }
+
+  /* Pipeline mode: find out now how large the ISO will be, and defer
+   * the actual generation until after the server forks (see
+   * iso_after_fork).
+   */
+  size = print_size ();
+  if (size == -1)
+    return -1;
+  nbdkit_debug ("pipelined ISO size: %" PRIi64, size);
+
+  return 0;
+}
+
+static int
+iso_after_fork (void)
+{
+  int err;
+
+  /* In pipeline mode (and unless we are serving a cached ISO) start
+   * the background generation.
+   */
+  if (!pipeline || size == -1)
+    return 0;
+
+  err = pthread_create (&generator, NULL, generator_thread, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  generation_started = true;
+
+  return 0;
 }
 
 static void *
@@ -197,6 +497,12 @@ iso_get_size (void *handle)
 {
   struct stat statbuf;
 
+  /* In pipeline mode the final size is known before the generation
+   * finishes.
+   */
+  if (size >= 0)
+    return size;
+
   if (fstat (fd, &statbuf) == -1) {
     nbdkit_error ("fstat: %m");
     return -1;
@@ -219,10 +525,47 @@ iso_can_cache (void *handle)
   return NBDKIT_CACHE_EMULATE;
 }
 
+/* In pipeline mode, wait until the high-water mark of the generator
+ * has passed ‘end’, or until the generation has finished.
+ */
+static int
+wait_for_data (uint64_t end)
+{
+  struct stat statbuf;
+  const struct timespec delay = { .tv_sec = 0, .tv_nsec = 50000000 };
+
+  for (;;) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      if (generation_done) {
+        if (generation_failed) {
+          nbdkit_error ("ISO generation failed, "
+                        "see earlier error messages");
+          errno = EIO;
+          return -1;
+        }
+        return 0;
+      }
+    }
+
+    if (fstat (fd, &statbuf) == -1) {
+      nbdkit_error ("fstat: %m");
+      return -1;
+    }
+    if ((uint64_t) statbuf.st_size >= end)
+      return 0;
+
+    nanosleep (&delay, NULL);
+  }
+}
+
 /* Read data from the file. */
 static int
 iso_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
+  if (generation_started && wait_for_data (offset + count) == -1)
+    return -1;
+
   while (count > 0) {
     ssize_t r = pread (fd, buf, count, offset);
     if (r == -1) {
@@ -251,6 +594,7 @@ static struct nbdkit_plugin plugin = {
   .config_help       = iso_config_help,
   .magic_config_key  = "dir",
   .get_ready         = iso_get_ready,
+  .after_fork        = iso_after_fork,
   .open              = iso_open,
   .get_size          = iso_get_size,
   .can_multi_conn    = iso_can_multi_conn,
@@ -58,6 +58,13 @@
 static const char *libvirt_uri = NULL;
 static const char *domain = NULL;
 static const char *disk = NULL;
+static int64_t fetchsize = 65536;
+
+/* Number of recently used fetch windows cached per handle.  Enough to
+ * cover a few interleaved sequential streams (eg. partition table +
+ * filesystem metadata + data) without holding much memory.
+ */
+#define NR_WINDOWS 4
 
 static int
 virt_config (const char *key, const char *value)
@@ -71,6 +78,11 @@ virt_config (const char *key, const char *value)
   else if (strcmp (key, "disk") == 0) {
     disk = value;
   }
+  else if (strcmp (key, "fetchsize") == 0) {
+    fetchsize = nbdkit_parse_size (value);
+    if (fetchsize == -1)
+      return -1;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -90,19 +102,41 @@ virt_config_complete (void)
     nbdkit_error ("the 'disk' parameter is required");
     return -1;
   }
+  if (fetchsize > 1024*1024) {
+    /* 1MB was the virDomainBlockPeek limit in libvirt 0.9.13, and
+     * larger windows are a waste of latency anyway.
+     */
+    nbdkit_error ("the 'fetchsize' parameter must be <= 1M");
+    return -1;
+  }
+  if (fetchsize & (fetchsize - 1)) {
+    nbdkit_error ("the 'fetchsize' parameter must be a power of two");
+    return -1;
+  }
   return 0;
 }
 
 #define virt_config_help                                        \
   "connect=<URI>   (optional) libvirt connection URI\n"         \
   "domain=<DOMAIN> (required) libvirt domain name\n"            \
-  "disk=<DISK>     (required) guest disk name"
+  "disk=<DISK>     (required) guest disk name\n"                \
+  "fetchsize=<N>   (optional) read window size, 0 to disable"
+
+/* One cached fetch window.  data is allocated lazily on first use. */
+struct window {
+  char *data;
+  uint64_t start;
+  uint32_t len;                 /* 0 = slot unused */
+  uint64_t last_used;
+};
 
 /* The per-connection handle. */
 struct virt_handle {
   virConnectPtr conn;
   virDomainPtr dom;
   uint64_t exportsize;
+  struct window windows[NR_WINDOWS];
+  uint64_t use_counter;
 };
 
 /* Create the per-connection handle. */
@@ -112,9 +146,9 @@ virt_open (int readonly)
   struct virt_handle *h;
   virDomainBlockInfo info;
 
-  h = malloc (sizeof *h);
+  h = calloc (1, sizeof *h);
   if (h == NULL) {
-    nbdkit_error ("malloc: %m");
+    nbdkit_error ("calloc: %m");
     return NULL;
   }
 
@@ -157,7 +191,10 @@ static void
 virt_close (void *handle)
 {
   struct virt_handle *h = handle;
+  size_t i;
 
+  for (i = 0; i < NR_WINDOWS; ++i)
+    free (h->windows[i].data);
   virDomainFree (h->dom);
   virConnectClose (h->conn);
   free (h);
@@ -174,7 +211,69 @@ virt_get_size (void *handle)
   return h->exportsize;
 }
 
-/* Read data from the file. */
+static int
+block_peek (struct virt_handle *h, void *buf, uint32_t count, uint64_t offset)
+{
+  if (virDomainBlockPeek (h->dom, disk, offset, count, buf, 0) == -1) {
+    nbdkit_error ("virDomainBlockPeek: cannot read block from disk '%s'",
+                  disk);
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/* Find or fetch the window covering offset.  Caller guarantees
+ * fetchsize > 0 and offset < exportsize.
+ */
+static struct window *
+get_window (struct virt_handle *h, uint64_t offset)
+{
+  const uint64_t start = offset & ~((uint64_t) fetchsize - 1);
+  const uint32_t len =
+    h->exportsize - start < (uint64_t) fetchsize
+    ? h->exportsize - start : (uint64_t) fetchsize;
+  struct window *w, *lru;
+  size_t i;
+
+  lru = &h->windows[0];
+  for (i = 0; i < NR_WINDOWS; ++i) {
+    w = &h->windows[i];
+    if (w->len > 0 && w->start == start) {
+      w->last_used = ++h->use_counter;
+      return w;
+    }
+    if (w->last_used < lru->last_used)
+      lru = w;
+  }
+
+  /* Not cached: evict the least recently used slot. */
+  w = lru;
+  if (w->data == NULL) {
+    w->data = malloc (fetchsize);
+    if (w->data == NULL) {
+      nbdkit_error ("malloc: %m");
+      return NULL;
+    }
+  }
+  w->len = 0;
+  if (block_peek (h, w->data, len, start) == -1)
+    return NULL;
+  w->start = start;
+  w->len = len;
+  w->last_used = ++h->use_counter;
+  return w;
+}
+
+/* Read data from the file.
+ *
+ * Each virDomainBlockPeek is a full round trip to libvirtd, so small
+ * scattered reads (scanning a partition table, filesystem probing)
+ * are very expensive if peeked one by one.  Instead fetch aligned
+ * fetchsize windows and serve sub-reads from a small MRU cache of
+ * them.  Reads of a whole window or more bypass the cache and are
+ * peeked directly into the caller's buffer.
+ */
 static int
 virt_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
@@ -182,18 +281,26 @@ virt_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   uint32_t c;
 
   while (count > 0) {
-    /* Limit requests to 1MB, which was the limit in 0.9.13 (it has since
-     * been raised).
-     */
-    c = count;
-    if (c > 1024*1024)
-      c = 1024*1024;
-
-    if (virDomainBlockPeek (h->dom, disk, offset, c, buf, 0) == -1) {
-      nbdkit_error ("virDomainBlockPeek: cannot read block from disk '%s'",
-                    disk);
-      errno = EIO;
-      return -1;
+    if (fetchsize == 0 || count >= fetchsize) {
+      /* Limit requests to 1MB, which was the limit in 0.9.13 (it has
+       * since been raised).
+       */
+      c = count;
+      if (c > 1024*1024)
+        c = 1024*1024;
+
+      if (block_peek (h, buf, c, offset) == -1)
+        return -1;
+    }
+    else {
+      struct window *w = get_window (h, offset);
+
+      if (w == NULL)
+        return -1;
+      c = count;
+      if (c > w->start + w->len - offset)
+        c = w->start + w->len - offset;
+      memcpy (buf, &w->data[offset - w->start], c);
     }
 
     buf += c;
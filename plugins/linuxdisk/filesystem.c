@@ -40,7 +40,14 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <errno.h>
+#include <sys/stat.h>
+
+#if defined (__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>       /* For FICLONE */
+#endif
 
 #include <nbdkit-plugin.h>
 
@@ -53,14 +60,35 @@
 
 static int64_t estimate_size (void);
 static int mke2fs (const char *filename);
+static char *compute_cachefile (void);
+static int open_cached_filesystem (struct virtual_disk *disk,
+                                   const char *cachefile);
 
 int
 create_filesystem (struct virtual_disk *disk)
 {
   const char *tmpdir;
+  CLEANUP_FREE char *cachefile = NULL;
   CLEANUP_FREE char *filename = NULL;
   int fd = -1;
 
+  /* If the cache is enabled and contains an image built from the
+   * same input, serve that instead of running mke2fs.
+   */
+  if (cachedir) {
+    cachefile = compute_cachefile ();
+    if (cachefile == NULL)
+      goto error;
+    switch (open_cached_filesystem (disk, cachefile)) {
+    case -1:
+      goto error;
+    case 0:                     /* cache hit */
+      return 0;
+    default:                    /* cache miss */
+      break;
+    }
+  }
+
   /* Estimate the filesystem size and compute the final virtual size
    * of the disk.  We only need to do this if the user didn't specify
    * the exact size on the command line.
@@ -97,10 +125,17 @@ create_filesystem (struct virtual_disk *disk)
 
   nbdkit_debug ("filesystem virtual size: %" PRIi64, size);
 
-  /* Create the filesystem file. */
-  tmpdir = getenv ("TMPDIR");
-  if (tmpdir == NULL)
-    tmpdir = LARGE_TMPDIR;
+  /* Create the filesystem file.  In cache mode create it in the
+   * cache directory so that it can be renamed into the cache
+   * afterwards.
+   */
+  if (cachedir == NULL) {
+    tmpdir = getenv ("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = LARGE_TMPDIR;
+  }
+  else
+    tmpdir = cachedir;
   if (asprintf (&filename, "%s/linuxdiskXXXXXX", tmpdir) == -1) {
     nbdkit_error ("asprintf: %m");
     goto error;
@@ -120,7 +155,15 @@ create_filesystem (struct virtual_disk *disk)
   if (mke2fs (filename) == -1)
     goto error;
 
-  unlink (filename);
+  if (cachefile) {
+    if (rename (filename, cachefile) == -1) {
+      /* Not fatal, we just don't cache the image. */
+      nbdkit_debug ("rename: %s: %m", cachefile);
+      unlink (filename);
+    }
+  }
+  else
+    unlink (filename);
   disk->filesystem_size = size;
   disk->fd = fd;
   return 0;
@@ -243,3 +286,123 @@ mke2fs (const char *filename)
 
   return 0;
 }
+
+/* Hash used to key cached filesystem images (FNV-1a).  It covers the
+ * filesystem parameters and the name, size and mtime of everything
+ * under the directory, so any change to the input causes a rebuild.
+ */
+static uint64_t hash;
+
+static void
+hash_bytes (const void *p, size_t len)
+{
+  const uint8_t *b = p;
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    hash ^= b[i];
+    hash *= UINT64_C(0x100000001b3);
+  }
+}
+
+static void
+hash_string (const char *s)
+{
+  hash_bytes (s, strlen (s) + 1);
+}
+
+static int
+hash_visit (const char *path, const struct stat *statbuf, int flag,
+            struct FTW *ftwbuf)
+{
+  int64_t v;
+
+  hash_string (path);
+  v = statbuf->st_size;
+  hash_bytes (&v, sizeof v);
+  v = statbuf->st_mtime;
+  hash_bytes (&v, sizeof v);
+  return 0;
+}
+
+static char *
+compute_cachefile (void)
+{
+  char *ret;
+
+  hash = UINT64_C(0xcbf29ce484222325);
+  hash_string (type);
+  if (label)
+    hash_string (label);
+  hash_bytes (&size, sizeof size);
+  hash_bytes (&size_add_estimate, sizeof size_add_estimate);
+  hash_string (dir);
+  if (nftw (dir, hash_visit, 64, FTW_PHYS) == -1) {
+    nbdkit_error ("nftw: %s: %m", dir);
+    return NULL;
+  }
+
+  if (asprintf (&ret, "%s/linuxdisk-%016" PRIx64 ".img",
+                cachedir, hash) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return NULL;
+  }
+
+  return ret;
+}
+
+/* Open a cached filesystem image.  Returns 0 on a cache hit, 1 on a
+ * cache miss, or -1 on error.
+ */
+static int
+open_cached_filesystem (struct virtual_disk *disk, const char *cachefile)
+{
+  struct stat statbuf;
+  int cachefd;
+
+  cachefd = open (cachefile, O_RDONLY | O_CLOEXEC);
+  if (cachefd == -1)
+    return 1;                   /* cache miss */
+
+  if (fstat (cachefd, &statbuf) == -1) {
+    nbdkit_error ("fstat: %s: %m", cachefile);
+    close (cachefd);
+    return -1;
+  }
+
+#ifdef FICLONE
+  /* Clone the cached image so that the served copy shares storage
+   * with the cache (copy-on-write, O(1)).
+   */
+  {
+    CLEANUP_FREE char *template = NULL;
+    int fd;
+
+    if (asprintf (&template, "%s/linuxdiskXXXXXX", cachedir) == -1) {
+      nbdkit_error ("asprintf: %m");
+      close (cachefd);
+      return -1;
+    }
+    fd = mkstemp (template);
+    if (fd >= 0) {
+      unlink (template);
+      if (ioctl (fd, FICLONE, cachefd) == 0) {
+        close (cachefd);
+        cachefd = fd;
+      }
+      else
+        close (fd);
+    }
+  }
+  /* If cloning was not possible (eg. not supported by the
+   * filesystem) then cachefd is still the cache file itself.  The
+   * plugin never writes to the image so serving it directly is safe
+   * too.
+   */
+#endif
+
+  nbdkit_debug ("using cached filesystem image: %s", cachefile);
+  disk->filesystem_size = statbuf.st_size;
+  disk->fd = cachefd;
+  return 0;
+}
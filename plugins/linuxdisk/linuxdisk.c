@@ -49,12 +49,13 @@
 
 #include "virtual-disk.h"
 
-/* Directory, label, type, size parameters. */
+/* Directory, label, type, size, cache parameters. */
 const char *dir;
 const char *label;
 const char *type = "ext2";
 int64_t size;
 bool size_add_estimate;  /* if size=+SIZE was used */
+const char *cachedir;
 
 /* Virtual disk. */
 static struct virtual_disk disk;
@@ -113,6 +114,9 @@ linuxdisk_config (const char *key, const char *value)
     if (size == -1)
       return -1;
   }
+  else if (strcmp (key, "cache") == 0) {
+    cachedir = value;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -137,7 +141,8 @@ linuxdisk_config_complete (void)
   "dir=<DIRECTORY>  (required) The directory to serve.\n" \
   "label=<LABEL>               The filesystem label.\n" \
   "type=ext2|ext3|ext4         The filesystem type.\n" \
-  "size=[+]<SIZE>              The virtual filesystem size."
+  "size=[+]<SIZE>              The virtual filesystem size.\n" \
+  "cache=<DIRECTORY>           Cache filesystem images here."
 
 static int
 linuxdisk_get_ready (void)
@@ -180,8 +185,11 @@ static int
 linuxdisk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
                  uint32_t flags)
 {
+  size_t hint = 0;
+
   while (count > 0) {
-    const struct region *region = find_region (&disk.regions, offset);
+    const struct region *region =
+      find_region_hint (&disk.regions, offset, &hint);
     size_t len;
     ssize_t r;
 
@@ -43,6 +43,7 @@ extern const char *label;
 extern const char *type;
 extern int64_t size;
 extern bool size_add_estimate;
+extern const char *cachedir;
 
 extern struct random_state random_state;
 
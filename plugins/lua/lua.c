@@ -35,9 +35,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -65,30 +67,129 @@ lua_isinteger (lua_State *L, int index)
 }
 #endif /* HAVE_LUA_ISINTEGER */
 
-static lua_State *L;
 static const char *script;
 
+/* The interpreter pool.
+ *
+ * By default (pool=1) there is a single interpreter and all requests
+ * are serialized through it, the historical behaviour.  With pool=N
+ * the script is loaded into N isolated interpreters and each request
+ * is dispatched to an idle one, so a slow or CPU-bound script can
+ * serve several requests at once.  Because the interpreters share
+ * nothing, this is only suitable for scripts which do not keep
+ * mutable state in Lua globals (see the manual).
+ */
+struct interp {
+  lua_State *L;
+  bool in_use;
+};
+static struct interp *interps;
+static unsigned nr_interps;
+static unsigned pool = 1;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+/* Configuration parameters passed to the script, recorded so they can
+ * be replayed into the extra pool interpreters in get_ready.
+ */
+struct kv {
+  char *key, *value;
+};
+static struct kv *saved_config;
+static size_t nr_saved_config;
+
 static void
 lua_plugin_load (void)
 {
-  L = luaL_newstate ();
-  if (L == NULL) {
+  interps = calloc (1, sizeof *interps);
+  if (interps == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  interps[0].L = luaL_newstate ();
+  if (interps[0].L == NULL) {
     nbdkit_error ("could not create Lua interpreter: %m");
     exit (EXIT_FAILURE);
   }
-  luaL_openlibs (L);
+  luaL_openlibs (interps[0].L);
+  nr_interps = 1;
 }
 
 static void
 lua_plugin_unload (void)
 {
-  if (L)
-    lua_close (L);
+  unsigned i;
+  size_t j;
+
+  for (i = 0; i < nr_interps; ++i)
+    if (interps[i].L)
+      lua_close (interps[i].L);
+  free (interps);
+
+  for (j = 0; j < nr_saved_config; ++j) {
+    free (saved_config[j].key);
+    free (saved_config[j].value);
+  }
+  free (saved_config);
 }
 
+/* Take any idle interpreter out of the pool, waiting if all are busy.
+ * With pool=1 the thread model serializes requests so we never wait.
+ */
+static unsigned
+acquire_interp (void)
+{
+  unsigned i;
+
+  pthread_mutex_lock (&pool_lock);
+  for (;;) {
+    for (i = 0; i < nr_interps; ++i) {
+      if (!interps[i].in_use) {
+        interps[i].in_use = true;
+        pthread_mutex_unlock (&pool_lock);
+        return i;
+      }
+    }
+    pthread_cond_wait (&pool_cond, &pool_lock);
+  }
+}
+
+/* Take one specific interpreter, for open/close which must visit
+ * every member of the pool.
+ */
+static void
+acquire_interp_idx (unsigned i)
+{
+  pthread_mutex_lock (&pool_lock);
+  while (interps[i].in_use)
+    pthread_cond_wait (&pool_cond, &pool_lock);
+  interps[i].in_use = true;
+  pthread_mutex_unlock (&pool_lock);
+}
+
+static void
+release_interp (unsigned i)
+{
+  pthread_mutex_lock (&pool_lock);
+  interps[i].in_use = false;
+  pthread_cond_broadcast (&pool_cond);
+  pthread_mutex_unlock (&pool_lock);
+}
+
+static void
+release_interp_cleanup (unsigned *i)
+{
+  release_interp (*i);
+}
+
+/* Acquire any idle interpreter for the rest of the current scope. */
+#define ACQUIRE_INTERP_FOR_CURRENT_SCOPE(i) \
+  __attribute__((cleanup (release_interp_cleanup))) \
+  unsigned i = acquire_interp ()
+
 /* Test if a function was defined by the Lua code. */
 static int
-function_defined (const char *name)
+function_defined_in (lua_State *L, const char *name)
 {
   int r;
 
@@ -98,9 +199,20 @@ function_defined (const char *name)
   return r;
 }
 
+/* All interpreters run the same script, so asking the first is
+ * enough.  Only used outside the data path.
+ */
+static int
+function_defined (const char *name)
+{
+  return function_defined_in (interps[0].L, name);
+}
+
 static void
 lua_plugin_dump_plugin (void)
 {
+  lua_State *L = interps[0].L;
+
 #ifdef LUA_VERSION_MAJOR
   printf ("lua_version=%s", LUA_VERSION_MAJOR);
 #ifdef LUA_VERSION_MINOR
@@ -121,9 +233,43 @@ lua_plugin_dump_plugin (void)
   }
 }
 
+/* Load the script into one interpreter. */
+static int
+load_script (lua_State *L)
+{
+  /* Load the Lua file. */
+  if (luaL_loadfile (L, script) != 0) {
+    /* We don't need to print the script name because it's
+     * contained in the error message (as well as the line number).
+     */
+    nbdkit_error ("could not parse Lua script %s", lua_tostring (L, -1));
+    lua_pop (L, 1);
+    return -1;
+  }
+  if (lua_pcall (L, 0, 0, 0) != 0) {
+    nbdkit_error ("could not run Lua script: %s", lua_tostring (L, -1));
+    lua_pop (L, 1);
+    return -1;
+  }
+
+  return 0;
+}
+
 static int
 lua_plugin_config (const char *key, const char *value)
 {
+  lua_State *L = interps[0].L;
+
+  if (strcmp (key, "pool") == 0) {
+    if (nbdkit_parse_unsigned ("pool", value, &pool) == -1)
+      return -1;
+    if (pool < 1) {
+      nbdkit_error ("the 'pool' parameter must be >= 1");
+      return -1;
+    }
+    return 0;
+  }
+
   if (!script) {
     /* The first parameter MUST be "script". */
     if (strcmp (key, "script") != 0) {
@@ -134,20 +280,8 @@ lua_plugin_config (const char *key, const char *value)
 
     assert (L);
 
-    /* Load the Lua file. */
-    if (luaL_loadfile (L, script) != 0) {
-      /* We don't need to print the script name because it's
-       * contained in the error message (as well as the line number).
-       */
-      nbdkit_error ("could not parse Lua script %s", lua_tostring (L, -1));
-      lua_pop (L, 1);
+    if (load_script (L) == -1)
       return -1;
-    }
-    if (lua_pcall (L, 0, 0, 0) != 0) {
-      nbdkit_error ("could not run Lua script: %s", lua_tostring (L, -1));
-      lua_pop (L, 1);
-      return -1;
-    }
 
     /* Minimal set of callbacks which are required (by nbdkit itself). */
     if (!function_defined ("open") ||
@@ -161,6 +295,8 @@ lua_plugin_config (const char *key, const char *value)
     }
   }
   else if (function_defined ("config")) {
+    struct kv *new_config;
+
     lua_getglobal (L, "config");
     lua_pushstring (L, key);
     lua_pushstring (L, value);
@@ -169,6 +305,23 @@ lua_plugin_config (const char *key, const char *value)
       lua_pop (L, 1);
       return -1;
     }
+
+    /* Record the parameter for replay into pool interpreters. */
+    new_config = realloc (saved_config,
+                          (nr_saved_config + 1) * sizeof (struct kv));
+    if (new_config == NULL) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    saved_config = new_config;
+    saved_config[nr_saved_config].key = strdup (key);
+    saved_config[nr_saved_config].value = strdup (value);
+    if (saved_config[nr_saved_config].key == NULL ||
+        saved_config[nr_saved_config].value == NULL) {
+      nbdkit_error ("strdup: %m");
+      return -1;
+    }
+    nr_saved_config++;
     return 0;
   }
   else {
@@ -184,6 +337,8 @@ lua_plugin_config (const char *key, const char *value)
 static int
 lua_plugin_config_complete (void)
 {
+  lua_State *L = interps[0].L;
+
   if (function_defined ("config_complete")) {
     lua_getglobal (L, "config_complete");
     if (lua_pcall (L, 0, 0, 0) != 0) {
@@ -197,29 +352,119 @@ lua_plugin_config_complete (void)
   return 0;
 }
 
+/* Grow the pool: load the script into pool-1 further interpreters,
+ * replaying the config parameters and config_complete into each.
+ */
+static int
+lua_plugin_get_ready (void)
+{
+  struct interp *new_interps;
+  unsigned i;
+  size_t j;
+
+  if (pool == 1)
+    return 0;
+
+  new_interps = realloc (interps, pool * sizeof (struct interp));
+  if (new_interps == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  interps = new_interps;
+
+  for (i = nr_interps; i < pool; ++i) {
+    lua_State *L = luaL_newstate ();
+
+    if (L == NULL) {
+      nbdkit_error ("could not create Lua interpreter: %m");
+      return -1;
+    }
+    luaL_openlibs (L);
+    interps[i].L = L;
+    interps[i].in_use = false;
+    nr_interps++;
+
+    if (load_script (L) == -1)
+      return -1;
+
+    if (function_defined_in (L, "config")) {
+      for (j = 0; j < nr_saved_config; ++j) {
+        lua_getglobal (L, "config");
+        lua_pushstring (L, saved_config[j].key);
+        lua_pushstring (L, saved_config[j].value);
+        if (lua_pcall (L, 2, 0, 0) != 0) {
+          nbdkit_error ("config: %s", lua_tostring (L, -1));
+          lua_pop (L, 1);
+          return -1;
+        }
+      }
+    }
+
+    if (function_defined_in (L, "config_complete")) {
+      lua_getglobal (L, "config_complete");
+      if (lua_pcall (L, 0, 0, 0) != 0) {
+        nbdkit_error ("config_complete: %s", lua_tostring (L, -1));
+        lua_pop (L, 1);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* With a pool we can serve requests in parallel; with a single
+ * interpreter everything must be serialized through it.
+ */
+static int
+lua_plugin_thread_model (void)
+{
+  if (pool > 1)
+    return NBDKIT_THREAD_MODEL_PARALLEL;
+  return NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS;
+}
+
 static void *
 lua_plugin_open (int readonly)
 {
   int *h;
+  unsigned i, k;
 
-  /* We store a Lua reference (an integer) in the handle. */
-  h = malloc (sizeof *h);
+  /* Requests for this connection can be served by any interpreter in
+   * the pool, so open() must run in all of them.  We store one Lua
+   * reference (an integer) per interpreter in the handle.
+   */
+  h = malloc (nr_interps * sizeof *h);
   if (h == NULL) {
     nbdkit_error ("malloc: %m");
     return NULL;
   }
 
-  lua_getglobal (L, "open");
-  lua_pushboolean (L, readonly);
-  if (lua_pcall (L, 1, 1, 0) != 0) {
-    nbdkit_error ("open: %s", lua_tostring (L, -1));
-    lua_pop (L, 1);
-    free (h);
-    return NULL;
-  }
+  for (i = 0; i < nr_interps; ++i) {
+    lua_State *L;
+
+    acquire_interp_idx (i);
+    L = interps[i].L;
+    lua_getglobal (L, "open");
+    lua_pushboolean (L, readonly);
+    if (lua_pcall (L, 1, 1, 0) != 0) {
+      nbdkit_error ("open: %s", lua_tostring (L, -1));
+      lua_pop (L, 1);
+      release_interp (i);
+      /* Drop the references created in earlier interpreters. */
+      for (k = 0; k < i; ++k) {
+        acquire_interp_idx (k);
+        luaL_unref (interps[k].L, LUA_REGISTRYINDEX, h[k]);
+        release_interp (k);
+      }
+      free (h);
+      return NULL;
+    }
 
-  /* Create a reference to the Lua handle returned by open(). */
-  *h = luaL_ref (L, LUA_REGISTRYINDEX);
+    /* Create a reference to the Lua handle returned by open(). */
+    h[i] = luaL_ref (L, LUA_REGISTRYINDEX);
+    release_interp (i);
+  }
 
   return h;
 }
@@ -228,18 +473,27 @@ static void
 lua_plugin_close (void *handle)
 {
   int *h = handle;
-
-  if (function_defined ("close")) {
-    lua_getglobal (L, "close");
-    lua_rawgeti (L, LUA_REGISTRYINDEX, *h);
-    if (lua_pcall (L, 1, 0, 0) != 0) {
-      nbdkit_error ("close: %s", lua_tostring (L, -1));
-      lua_pop (L, 1);
+  unsigned i;
+
+  for (i = 0; i < nr_interps; ++i) {
+    lua_State *L;
+
+    acquire_interp_idx (i);
+    L = interps[i].L;
+    if (function_defined_in (L, "close")) {
+      lua_getglobal (L, "close");
+      lua_rawgeti (L, LUA_REGISTRYINDEX, h[i]);
+      if (lua_pcall (L, 1, 0, 0) != 0) {
+        nbdkit_error ("close: %s", lua_tostring (L, -1));
+        lua_pop (L, 1);
+      }
     }
+
+    /* Ensure that the Lua handle is freed. */
+    luaL_unref (L, LUA_REGISTRYINDEX, h[i]);
+    release_interp (i);
   }
 
-  /* Ensure that the Lua handle is freed. */
-  luaL_unref (L, LUA_REGISTRYINDEX, *h);
   /* Free C handle. */
   free (handle);
 }
@@ -249,9 +503,11 @@ lua_plugin_get_size (void *handle)
 {
   int *h = handle;
   int64_t r;
+  ACQUIRE_INTERP_FOR_CURRENT_SCOPE (i);
+  lua_State *L = interps[i].L;
 
   lua_getglobal (L, "get_size");
-  lua_rawgeti (L, LUA_REGISTRYINDEX, *h);
+  lua_rawgeti (L, LUA_REGISTRYINDEX, h[i]);
   if (lua_pcall (L, 1, 1, 0) != 0) {
     nbdkit_error ("get_size: %s", lua_tostring (L, -1));
     lua_pop (L, 1);
@@ -275,9 +531,11 @@ lua_plugin_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   int *h = handle;
   size_t len;
   const char *str;
+  ACQUIRE_INTERP_FOR_CURRENT_SCOPE (i);
+  lua_State *L = interps[i].L;
 
   lua_getglobal (L, "pread");
-  lua_rawgeti (L, LUA_REGISTRYINDEX, *h);
+  lua_rawgeti (L, LUA_REGISTRYINDEX, h[i]);
   lua_pushinteger (L, count);
   lua_pushinteger (L, offset);
   if (lua_pcall (L, 3, 1, 0) != 0) {
@@ -306,10 +564,12 @@ lua_plugin_pwrite (void *handle, const void *buf,
                    uint32_t count, uint64_t offset)
 {
   int *h = handle;
+  ACQUIRE_INTERP_FOR_CURRENT_SCOPE (i);
+  lua_State *L = interps[i].L;
 
-  if (function_defined ("pwrite")) {
+  if (function_defined_in (L, "pwrite")) {
     lua_getglobal (L, "pwrite");
-    lua_rawgeti (L, LUA_REGISTRYINDEX, *h);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, h[i]);
     lua_pushlstring (L, buf, count);
     lua_pushinteger (L, offset);
     if (lua_pcall (L, 3, 0, 0) != 0) {
@@ -329,10 +589,12 @@ lua_plugin_can_write (void *handle)
 {
   int *h = handle;
   int r;
+  ACQUIRE_INTERP_FOR_CURRENT_SCOPE (i);
+  lua_State *L = interps[i].L;
 
-  if (function_defined ("can_write")) {
+  if (function_defined_in (L, "can_write")) {
     lua_getglobal (L, "can_write");
-    lua_rawgeti (L, LUA_REGISTRYINDEX, *h);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, h[i]);
     if (lua_pcall (L, 1, 1, 0) != 0) {
       nbdkit_error ("can_write: %s", lua_tostring (L, -1));
       lua_pop (L, 1);
@@ -350,7 +612,7 @@ lua_plugin_can_write (void *handle)
   /* No can_write callback, but there's a pwrite callback defined, so
    * return 1.  (In C modules, nbdkit would do this).
    */
-  else if (function_defined ("pwrite"))
+  else if (function_defined_in (L, "pwrite"))
     return 1;
   else
     return 0;
@@ -361,10 +623,12 @@ lua_plugin_can_flush (void *handle)
 {
   int *h = handle;
   int r;
+  ACQUIRE_INTERP_FOR_CURRENT_SCOPE (i);
+  lua_State *L = interps[i].L;
 
-  if (function_defined ("can_flush")) {
+  if (function_defined_in (L, "can_flush")) {
     lua_getglobal (L, "can_flush");
-    lua_rawgeti (L, LUA_REGISTRYINDEX, *h);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, h[i]);
     if (lua_pcall (L, 1, 1, 0) != 0) {
       nbdkit_error ("can_flush: %s", lua_tostring (L, -1));
       lua_pop (L, 1);
@@ -382,7 +646,7 @@ lua_plugin_can_flush (void *handle)
   /* No can_flush callback, but there's a plugin_flush callback
    * defined, so return 1.  (In C modules, nbdkit would do this).
    */
-  else if (function_defined ("plugin_flush"))
+  else if (function_defined_in (L, "plugin_flush"))
     return 1;
   else
     return 0;
@@ -393,10 +657,12 @@ lua_plugin_can_trim (void *handle)
 {
   int *h = handle;
   int r;
+  ACQUIRE_INTERP_FOR_CURRENT_SCOPE (i);
+  lua_State *L = interps[i].L;
 
-  if (function_defined ("can_trim")) {
+  if (function_defined_in (L, "can_trim")) {
     lua_getglobal (L, "can_trim");
-    lua_rawgeti (L, LUA_REGISTRYINDEX, *h);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, h[i]);
     if (lua_pcall (L, 1, 1, 0) != 0) {
       nbdkit_error ("can_trim: %s", lua_tostring (L, -1));
       lua_pop (L, 1);
@@ -414,7 +680,7 @@ lua_plugin_can_trim (void *handle)
   /* No can_trim callback, but there's a trim callback defined, so
    * return 1.  (In C modules, nbdkit would do this).
    */
-  else if (function_defined ("trim"))
+  else if (function_defined_in (L, "trim"))
     return 1;
   else
     return 0;
@@ -425,10 +691,12 @@ lua_plugin_is_rotational (void *handle)
 {
   int *h = handle;
   int r;
+  ACQUIRE_INTERP_FOR_CURRENT_SCOPE (i);
+  lua_State *L = interps[i].L;
 
-  if (function_defined ("is_rotational")) {
+  if (function_defined_in (L, "is_rotational")) {
     lua_getglobal (L, "is_rotational");
-    lua_rawgeti (L, LUA_REGISTRYINDEX, *h);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, h[i]);
     if (lua_pcall (L, 1, 1, 0) != 0) {
       nbdkit_error ("is_rotational: %s", lua_tostring (L, -1));
       lua_pop (L, 1);
@@ -451,10 +719,12 @@ static int
 lua_plugin_flush (void *handle)
 {
   int *h = handle;
+  ACQUIRE_INTERP_FOR_CURRENT_SCOPE (i);
+  lua_State *L = interps[i].L;
 
-  if (function_defined ("flush")) {
+  if (function_defined_in (L, "flush")) {
     lua_getglobal (L, "flush");
-    lua_rawgeti (L, LUA_REGISTRYINDEX, *h);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, h[i]);
     if (lua_pcall (L, 1, 0, 0) != 0) {
       nbdkit_error ("flush: %s", lua_tostring (L, -1));
       lua_pop (L, 1);
@@ -473,10 +743,12 @@ static int
 lua_plugin_trim (void *handle, uint32_t count, uint64_t offset)
 {
   int *h = handle;
+  ACQUIRE_INTERP_FOR_CURRENT_SCOPE (i);
+  lua_State *L = interps[i].L;
 
-  if (function_defined ("trim")) {
+  if (function_defined_in (L, "trim")) {
     lua_getglobal (L, "trim");
-    lua_rawgeti (L, LUA_REGISTRYINDEX, *h);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, h[i]);
     lua_pushinteger (L, count);
     lua_pushinteger (L, offset);
     if (lua_pcall (L, 3, 0, 0) != 0) {
@@ -497,10 +769,12 @@ static int
 lua_plugin_zero (void *handle, uint32_t count, uint64_t offset, int may_trim)
 {
   int *h = handle;
+  ACQUIRE_INTERP_FOR_CURRENT_SCOPE (i);
+  lua_State *L = interps[i].L;
 
-  if (function_defined ("zero")) {
+  if (function_defined_in (L, "zero")) {
     lua_getglobal (L, "zero");
-    lua_rawgeti (L, LUA_REGISTRYINDEX, *h);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, h[i]);
     lua_pushinteger (L, count);
     lua_pushinteger (L, offset);
     lua_pushboolean (L, may_trim);
@@ -519,9 +793,10 @@ lua_plugin_zero (void *handle, uint32_t count, uint64_t offset, int may_trim)
 
 #define lua_plugin_config_help \
   "script=<FILENAME>     (required) The Lua script to run.\n" \
+  "pool=<N>              (optional) Size of the interpreter pool.\n" \
   "[other arguments may be used by the plugin that you load]"
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 static struct nbdkit_plugin plugin = {
   .name              = "lua",
@@ -534,6 +809,8 @@ static struct nbdkit_plugin plugin = {
   .config            = lua_plugin_config,
   .config_complete   = lua_plugin_config_complete,
   .config_help       = lua_plugin_config_help,
+  .thread_model      = lua_plugin_thread_model,
+  .get_ready         = lua_plugin_get_ready,
 
   .open              = lua_plugin_open,
   .close             = lua_plugin_close,
@@ -40,6 +40,11 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #define NBDKIT_API_VERSION 2
 #include <nbdkit-plugin.h>
@@ -57,11 +62,22 @@ int memory_debug_dir;
 static struct allocator *a;
 static const char *allocator_type = "sparse";
 
+/* Snapshot file (snapshot=<FILE> parameter) and whether to write it
+ * on shutdown (snapshot-save=true).
+ */
+static char *snapshot;
+static bool snapshot_save = false;
+
 static void
 memory_unload (void)
 {
-  if (a)
+  if (a) {
+    if (snapshot_save && a->f->save != NULL &&
+        a->f->save (a, snapshot) == -1)
+      nbdkit_error ("could not save snapshot %s", snapshot);
     a->f->free (a);
+  }
+  free (snapshot);
 }
 
 static int
@@ -75,6 +91,20 @@ memory_config (const char *key, const char *value)
   else if (strcmp (key, "allocator") == 0) {
     allocator_type = value;
   }
+  else if (strcmp (key, "snapshot") == 0) {
+    free (snapshot);
+    snapshot = nbdkit_absolute_path (value);
+    if (snapshot == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "snapshot-save") == 0) {
+    int r;
+
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    snapshot_save = r;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -90,12 +120,18 @@ memory_config_complete (void)
     nbdkit_error ("you must specify size=<SIZE> on the command line");
     return -1;
   }
+  if (snapshot_save && snapshot == NULL) {
+    nbdkit_error ("snapshot-save=true requires snapshot=<FILE>");
+    return -1;
+  }
   return 0;
 }
 
 #define memory_config_help \
   "size=<SIZE>  (required) Size of the backing disk\n" \
-  "allocator=sparse|...    Backend allocation strategy"
+  "allocator=sparse|...    Backend allocation strategy\n" \
+  "snapshot=<FILE>         Restore the disk from a snapshot file\n" \
+  "snapshot-save=true      Save a snapshot to the file on shutdown"
 
 static void
 memory_dump_plugin (void)
@@ -105,6 +141,11 @@ memory_dump_plugin (void)
 #else
   printf ("mlock=no\n");
 #endif
+#ifdef MAP_HUGETLB
+  printf ("hugepages=yes\n");
+#else
+  printf ("hugepages=no\n");
+#endif
 #ifdef HAVE_LIBZSTD
   printf ("zstd=yes\n");
 #else
@@ -120,6 +161,26 @@ memory_get_ready (void)
     return -1;
   if (a->f->set_size_hint (a, size) == -1)
     return -1;
+
+  if (snapshot) {
+    if (a->f->save == NULL || a->f->restore == NULL) {
+      nbdkit_error ("allocator '%s' does not support snapshots",
+                    allocator_type);
+      return -1;
+    }
+    if (access (snapshot, F_OK) == 0) {
+      if (a->f->restore (a, snapshot) == -1)
+        return -1;
+    }
+    else if (!snapshot_save) {
+      /* A missing snapshot is only acceptable when we are going to
+       * create it.
+       */
+      nbdkit_error ("open: %s: %m", snapshot);
+      return -1;
+    }
+  }
+
   return 0;
 }
 
@@ -179,6 +240,34 @@ memory_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   return a->f->read (a, buf, count, offset);
 }
 
+/* Zero-copy read: lend the allocator's own backing page to the
+ * server.  Falls back to memory_pread when the allocator cannot lend
+ * (hole, request crosses a page boundary, or no borrow support).
+ */
+static void
+memory_release (void *opaque)
+{
+  a->f->release (a, opaque);
+}
+
+static int
+memory_pread_zerocopy (void *handle, struct nbdkit_zerocopy_read *zc,
+                       uint32_t count, uint64_t offset, uint32_t flags)
+{
+  const void *buf;
+
+  assert (!flags);
+  if (a->f->borrow == NULL)
+    return 1;
+  buf = a->f->borrow (a, count, offset);
+  if (buf == NULL)
+    return 1;
+  zc->buf = buf;
+  zc->opaque = (void *) buf;
+  zc->release = memory_release;
+  return 0;
+}
+
 /* Write data. */
 static int
 memory_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
@@ -247,6 +336,7 @@ static struct nbdkit_plugin plugin = {
   .trim              = memory_trim,
   .flush             = memory_flush,
   .extents           = memory_extents,
+  .pread_zerocopy    = memory_pread_zerocopy,
   /* In this plugin, errno is preserved properly along error return
    * paths from failed system calls.
    */
@@ -0,0 +1,354 @@
+/* nbdkit
+ * Copyright (C) 2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Read-only plugin which maps the image once (MAP_SHARED) and serves
+ * every connection by copying straight out of the mapping.  There are
+ * no per-connection descriptors or buffers, so hundreds of
+ * connections reading the same golden image all hit the same page
+ * cache pages.
+ *
+ * Reads can be recorded (record=FILE) and fed back to a later run
+ * (warmup=FILE) which prefetches the recorded ranges with
+ * madvise(MADV_WILLNEED), optionally pinning them with mlock, so the
+ * first wave of a boot storm finds the hot data already in memory.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+#include "bitmap.h"
+#include "cleanup.h"
+#include "minmax.h"
+#include "rounding.h"
+
+/* Granularity of access recording. */
+#define RECORD_BLKSIZE 65536
+
+static char *filename;
+static char *recordfile;
+static char *warmupfile;
+static bool mlock_requested = false;
+
+/* The mapped image. */
+static char *map;
+static uint64_t size;
+
+/* Which blocks have been read, when record=FILE is used. */
+static struct bitmap bm;
+static pthread_mutex_t bm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+mmap_config (const char *key, const char *value)
+{
+  if (strcmp (key, "file") == 0) {
+    free (filename);
+    filename = nbdkit_realpath (value);
+    if (filename == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "record") == 0) {
+    free (recordfile);
+    recordfile = nbdkit_absolute_path (value);
+    if (recordfile == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "warmup") == 0) {
+    free (warmupfile);
+    warmupfile = nbdkit_absolute_path (value);
+    if (warmupfile == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "mlock") == 0) {
+    int r = nbdkit_parse_bool (value);
+
+    if (r == -1)
+      return -1;
+    mlock_requested = r;
+  }
+  else {
+    nbdkit_error ("unknown parameter '%s'", key);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+mmap_config_complete (void)
+{
+  if (filename == NULL) {
+    nbdkit_error ("you must supply the file=<FILENAME> parameter "
+                  "after the plugin name on the command line");
+    return -1;
+  }
+
+  return 0;
+}
+
+#define mmap_config_help \
+  "file=<FILENAME>     (required) The image to serve.\n" \
+  "record=<FILE>       Write the ranges read during this run to FILE.\n" \
+  "warmup=<FILE>       Prefetch the ranges listed in FILE (from record=).\n" \
+  "mlock=true          Also lock the prefetched ranges in memory."
+
+/* Clamp a recorded range to the image and prefetch (and optionally
+ * lock) it.  mlock failures are fatal because the caller asked for
+ * the pages to be pinned; madvise is just a hint.
+ */
+static int
+warmup_range (uint64_t offset, uint64_t length)
+{
+  const uint64_t pagesize = sysconf (_SC_PAGE_SIZE);
+  uint64_t start, end;
+
+  if (offset >= size)
+    return 0;
+  length = MIN (length, size - offset);
+  start = ROUND_DOWN (offset, pagesize);
+  end = MIN (ROUND_UP (offset + length, pagesize), size);
+
+#ifdef MADV_WILLNEED
+  if (madvise (map + start, end - start, MADV_WILLNEED) == -1)
+    nbdkit_debug ("madvise: MADV_WILLNEED: %m (ignored)");
+#endif
+  if (mlock_requested) {
+    if (mlock (map + start, end - start) == -1) {
+      nbdkit_error ("mlock (%s offset %" PRIu64 " length %" PRIu64 "): %m "
+                    "(is RLIMIT_MEMLOCK large enough?)",
+                    filename, start, end - start);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Prefetch the ranges recorded by a previous run. */
+static int
+do_warmup (void)
+{
+  FILE *fp;
+  uint64_t offset, length, total = 0;
+  unsigned ranges = 0;
+
+  fp = fopen (warmupfile, "r");
+  if (fp == NULL) {
+    nbdkit_error ("open: %s: %m", warmupfile);
+    return -1;
+  }
+  while (fscanf (fp, "%" SCNu64 " %" SCNu64, &offset, &length) == 2) {
+    if (warmup_range (offset, length) == -1) {
+      fclose (fp);
+      return -1;
+    }
+    ranges++;
+    total += length;
+  }
+  if (ferror (fp)) {
+    nbdkit_error ("read: %s: %m", warmupfile);
+    fclose (fp);
+    return -1;
+  }
+  fclose (fp);
+
+  nbdkit_debug ("mmap: prefetched %u range(s), %" PRIu64 " bytes%s",
+                ranges, total, mlock_requested ? " (locked)" : "");
+  return 0;
+}
+
+static int
+mmap_get_ready (void)
+{
+  int fd;
+  struct stat statbuf;
+
+  fd = open (filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", filename);
+    return -1;
+  }
+  if (fstat (fd, &statbuf) == -1) {
+    nbdkit_error ("fstat: %s: %m", filename);
+    close (fd);
+    return -1;
+  }
+  size = statbuf.st_size;
+  if (size == 0) {
+    nbdkit_error ("%s: file is empty", filename);
+    close (fd);
+    return -1;
+  }
+  map = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED) {
+    map = NULL;
+    nbdkit_error ("mmap: %s: %m", filename);
+    return -1;
+  }
+
+  if (warmupfile != NULL) {
+    if (do_warmup () == -1)
+      return -1;
+  }
+  else if (mlock_requested) {
+    /* No recording to go on: lock the whole image. */
+    if (mlock (map, size) == -1) {
+      nbdkit_error ("mlock: %s: %m (is RLIMIT_MEMLOCK large enough?)",
+                    filename);
+      return -1;
+    }
+    nbdkit_debug ("mmap: locked all %" PRIu64 " bytes", size);
+  }
+
+  if (recordfile != NULL) {
+    bitmap_init (&bm, RECORD_BLKSIZE, 1);
+    if (bitmap_resize (&bm, size) == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Write the recorded ranges out, merging adjacent blocks. */
+static void
+write_record_file (void)
+{
+  FILE *fp;
+  uint64_t blk, nr_blks = DIV_ROUND_UP (size, RECORD_BLKSIZE);
+
+  fp = fopen (recordfile, "w");
+  if (fp == NULL) {
+    nbdkit_error ("open: %s: %m", recordfile);
+    return;
+  }
+  for (blk = 0; blk < nr_blks; ++blk) {
+    uint64_t start, length;
+
+    if (!bitmap_get_blk (&bm, blk, 0))
+      continue;
+    start = blk * RECORD_BLKSIZE;
+    while (blk + 1 < nr_blks && bitmap_get_blk (&bm, blk + 1, 0))
+      blk++;
+    length = MIN ((blk + 1) * RECORD_BLKSIZE, size) - start;
+    fprintf (fp, "%" PRIu64 " %" PRIu64 "\n", start, length);
+  }
+  if (fclose (fp) == EOF)
+    nbdkit_error ("close: %s: %m", recordfile);
+}
+
+static void
+mmap_unload (void)
+{
+  if (recordfile != NULL && map != NULL) {
+    write_record_file ();
+    bitmap_free (&bm);
+  }
+  if (map != NULL)
+    munmap (map, size);
+  free (warmupfile);
+  free (recordfile);
+  free (filename);
+}
+
+/* Everything is immutable after get_ready except the recording
+ * bitmap, which takes its own lock.
+ */
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+static void *
+mmap_open (int readonly)
+{
+  return NBDKIT_HANDLE_NOT_NEEDED;
+}
+
+static int64_t
+mmap_get_size (void *handle)
+{
+  return size;
+}
+
+/* Multi-conn is safe because the image is read-only. */
+static int
+mmap_can_multi_conn (void *handle)
+{
+  return 1;
+}
+
+static int
+mmap_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags)
+{
+  memcpy (buf, map + offset, count);
+
+  if (recordfile != NULL) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&bm_lock);
+    uint64_t blk = offset / RECORD_BLKSIZE;
+    uint64_t last = (offset + count - 1) / RECORD_BLKSIZE;
+
+    for (; blk <= last; ++blk)
+      bitmap_set_blk (&bm, blk, 1);
+  }
+
+  return 0;
+}
+
+static struct nbdkit_plugin plugin = {
+  .name              = "mmap",
+  .longname          = "nbdkit memory-mapped file plugin",
+  .version           = PACKAGE_VERSION,
+  .unload            = mmap_unload,
+  .config            = mmap_config,
+  .config_complete   = mmap_config_complete,
+  .config_help       = mmap_config_help,
+  .magic_config_key  = "file",
+  .get_ready         = mmap_get_ready,
+  .open              = mmap_open,
+  .get_size          = mmap_get_size,
+  .can_multi_conn    = mmap_can_multi_conn,
+  .pread             = mmap_pread,
+};
+
+NBDKIT_REGISTER_PLUGIN (plugin)
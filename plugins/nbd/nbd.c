@@ -50,6 +50,15 @@
 
 #include <libnbd.h>
 
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#else
+/* Some old platforms lack atomic types, but 32 bit ints are usually
+ * "atomic enough".
+ */
+#define _Atomic /**/
+#endif
+
 #define NBDKIT_API_VERSION 2
 
 #include <nbdkit-plugin.h>
@@ -68,6 +77,18 @@ DEFINE_VECTOR_TYPE(string_vector, const char *);
 #define USE_VSOCK 1
 #endif
 
+/* Commands are forwarded to the server with the libnbd aio API rather
+ * than the synchronous calls: the worker thread submits with
+ * nbd_aio_pread etc, kicks the reader thread for the link, and blocks
+ * on a semaphore which the completion callback posts.  The reader
+ * thread drives the libnbd state machine for every command in flight
+ * on its link, so the number of outstanding commands at the server is
+ * not limited by the number of threads here.  Each command does pin
+ * its worker thread until the reply arrives, because the plugin API
+ * it implements is synchronous; the thread pool size caps in-flight
+ * commands per nbdkit connection.
+ */
+
 /* The per-transaction details */
 struct transaction {
   int64_t cookie;
@@ -77,13 +98,21 @@ struct transaction {
   nbd_completion_callback cb;
 };
 
+/* A single connection to the server */
+struct link {
+  struct nbd_handle *nbd;
+  int fds[2]; /* Pipe for kicking the reader thread */
+  pthread_t reader;
+};
+
 /* The per-connection handle */
 struct handle {
   /* These fields are read-only once initialized */
-  struct nbd_handle *nbd;
-  int fds[2]; /* Pipe for kicking the reader thread */
+  struct link *links;
+  unsigned nr_links;
   bool readonly;
-  pthread_t reader;
+
+  _Atomic unsigned next_link; /* Round robin dispatch over links */
 };
 
 /* Connect to server via URI */
@@ -118,6 +147,9 @@ static bool dynamic_export;
 /* Number of retries */
 static unsigned retry;
 
+/* Number of connections to the server per handle */
+static unsigned connections = 1;
+
 /* True to share single server connection among all clients */
 static bool shared;
 static struct handle *shared_handle;
@@ -194,6 +226,14 @@ nbdplug_config (const char *key, const char *value)
     if (nbdkit_parse_unsigned ("retry", value, &retry) == -1)
       return -1;
   }
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections < 1) {
+      nbdkit_error ("connections must be at least 1");
+      return -1;
+    }
+  }
   else if (strcmp (key, "shared") == 0) {
     r = nbdkit_parse_bool (value);
     if (r == -1)
@@ -386,6 +426,8 @@ nbdplug_after_fork (void)
   "export=<NAME>          Export name to connect to (default \"\").\n" \
   "dynamic-export=<BOOL>  True to enable export name pass-through.\n" \
   "retry=<N>              Retry connection up to N seconds (default 0).\n" \
+  "connections=<N>        Open N connections to the server per client, if the\n" \
+  "                       server advertises multi-conn (default 1).\n" \
   "shared=<BOOL>          True to share one server connection among all clients,\n" \
   "                       rather than a connection per client (default false).\n" \
   "tls=<MODE>             How to use TLS; one of 'off', 'on', or 'require'.\n" \
@@ -417,24 +459,24 @@ nbdplug_dump_plugin (void)
 
 #define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
-/* Reader loop. */
+/* Reader loop, one thread per link. */
 void *
 nbdplug_reader (void *handle)
 {
-  struct handle *h = handle;
+  struct link *l = handle;
 
   nbdkit_debug ("nbd: started reader thread");
 
-  while (!nbd_aio_is_dead (h->nbd) && !nbd_aio_is_closed (h->nbd)) {
+  while (!nbd_aio_is_dead (l->nbd) && !nbd_aio_is_closed (l->nbd)) {
     int r;
     struct pollfd fds[2] = {
-      [0].fd = nbd_aio_get_fd (h->nbd),
-      [1].fd = h->fds[0],
+      [0].fd = nbd_aio_get_fd (l->nbd),
+      [1].fd = l->fds[0],
       [1].events = POLLIN,
     };
     unsigned dir;
 
-    dir = nbd_aio_get_direction (h->nbd);
+    dir = nbd_aio_get_direction (l->nbd);
     nbdkit_debug ("polling, dir=%d", dir);
     if (dir & LIBNBD_AIO_DIRECTION_READ)
       fds[0].events |= POLLIN;
@@ -445,13 +487,13 @@ nbdplug_reader (void *handle)
       break;
     }
 
-    dir = nbd_aio_get_direction (h->nbd);
+    dir = nbd_aio_get_direction (l->nbd);
 
     r = 0;
     if ((dir & LIBNBD_AIO_DIRECTION_READ) && (fds[0].revents & POLLIN))
-      r = nbd_aio_notify_read (h->nbd);
+      r = nbd_aio_notify_read (l->nbd);
     else if ((dir & LIBNBD_AIO_DIRECTION_WRITE) && (fds[0].revents & POLLOUT))
-      r = nbd_aio_notify_write (h->nbd);
+      r = nbd_aio_notify_write (l->nbd);
     if (r == -1) {
       nbdkit_error ("%s", nbd_get_error ());
       break;
@@ -461,14 +503,14 @@ nbdplug_reader (void *handle)
     if (fds[1].revents & POLLIN) {
       char buf[10]; /* Larger than 1 to allow reduction of any backlog */
 
-      if (read (h->fds[0], buf, sizeof buf) == -1 && errno != EAGAIN) {
+      if (read (l->fds[0], buf, sizeof buf) == -1 && errno != EAGAIN) {
         nbdkit_error ("failed to read pipe: %m");
         break;
       }
     }
   }
 
-  nbdkit_debug ("state machine changed to %s", nbd_connection_state (h->nbd));
+  nbdkit_debug ("state machine changed to %s", nbd_connection_state (l->nbd));
   nbdkit_debug ("exiting reader thread");
   return NULL;
 }
@@ -504,9 +546,21 @@ nbdplug_prepare (struct transaction *trans)
   trans->cb.user_data = trans;
 }
 
+/* Pick the link to send the next command over.  Queries and commands
+ * may use any link: when there is more than one the server advertised
+ * multi-conn, which guarantees they are all equivalent.
+ */
+static struct link *
+nbdplug_choose_link (struct handle *h)
+{
+  if (h->nr_links == 1)
+    return &h->links[0];
+  return &h->links[h->next_link++ % h->nr_links];
+}
+
 /* Register a cookie and kick the I/O thread. */
 static void
-nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
+nbdplug_register (struct link *l, struct transaction *trans, int64_t cookie)
 {
   char c = 0;
 
@@ -519,7 +573,7 @@ nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
   nbdkit_debug ("cookie %" PRId64 " started by state machine", cookie);
   trans->cookie = cookie;
 
-  if (write (h->fds[1], &c, 1) == -1 && errno != EAGAIN)
+  if (write (l->fds[1], &c, 1) == -1 && errno != EAGAIN)
     nbdkit_debug ("failed to kick reader thread: %m");
 }
 
@@ -582,76 +636,61 @@ nbdplug_connect (struct nbd_handle *nbd)
     abort ();
 }
 
-/* Create the shared or per-connection handle. */
-static struct handle *
-nbdplug_open_handle (int readonly, const char *client_export)
+/* Connect a single link to the server. */
+static int
+nbdplug_open_link (struct link *l, const char *client_export)
 {
-  struct handle *h;
   unsigned long retries = retry;
 
-  h = calloc (1, sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("malloc: %m");
-    return NULL;
-  }
 #ifdef HAVE_PIPE2
-  if (pipe2 (h->fds, O_NONBLOCK)) {
+  if (pipe2 (l->fds, O_NONBLOCK)) {
     nbdkit_error ("pipe2: %m");
-    free (h);
-    return NULL;
+    return -1;
   }
 #else
   /* This plugin doesn't fork, so we don't care about CLOEXEC. Our use
    * of pipe2 is merely for convenience.
    */
-  if (pipe (h->fds)) {
+  if (pipe (l->fds)) {
     nbdkit_error ("pipe: %m");
-    free (h);
-    return NULL;
+    return -1;
   }
-  if (set_nonblock (h->fds[0]) == -1) {
-    close (h->fds[1]);
-    free (h);
-    return NULL;
+  if (set_nonblock (l->fds[0]) == -1) {
+    close (l->fds[1]);
+    return -1;
   }
-  if (set_nonblock (h->fds[1]) == -1) {
-    close (h->fds[0]);
-    free (h);
-    return NULL;
+  if (set_nonblock (l->fds[1]) == -1) {
+    close (l->fds[0]);
+    return -1;
   }
 #endif
 
-  if (dynamic_export)
-    assert (client_export);
-  else
-    client_export = export;
-
  retry:
-  h->nbd = nbd_create ();
-  if (!h->nbd)
+  l->nbd = nbd_create ();
+  if (!l->nbd)
     goto errnbd;
-  if (nbd_set_export_name (h->nbd, client_export) == -1)
+  if (nbd_set_export_name (l->nbd, client_export) == -1)
     goto errnbd;
-  if (nbd_add_meta_context (h->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1)
+  if (nbd_add_meta_context (l->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1)
     goto errnbd;
 #if LIBNBD_HAVE_NBD_SET_FULL_INFO
-  if (nbd_set_full_info (h->nbd, 1) == -1)
+  if (nbd_set_full_info (l->nbd, 1) == -1)
     goto errnbd;
 #endif
   if (dynamic_export && uri) {
 #if LIBNBD_HAVE_NBD_SET_OPT_MODE
-    if (nbd_set_opt_mode (h->nbd, 1) == -1)
+    if (nbd_set_opt_mode (l->nbd, 1) == -1)
       goto errnbd;
 #else
     abort (); /* Prevented by .config_complete */
 #endif
   }
-  if (nbd_set_tls (h->nbd, tls) == -1)
+  if (nbd_set_tls (l->nbd, tls) == -1)
     goto errnbd;
-  if (nbdplug_connect (h->nbd) == -1) {
+  if (nbdplug_connect (l->nbd) == -1) {
     if (retries--) {
       nbdkit_debug ("connect failed; will try again: %s", nbd_get_error ());
-      nbd_close (h->nbd);
+      nbd_close (l->nbd);
       sleep (1);
       goto retry;
     }
@@ -660,32 +699,104 @@ nbdplug_open_handle (int readonly, const char *client_export)
 
 #if LIBNBD_HAVE_NBD_SET_OPT_MODE
   /* Oldstyle servers can't change export name, but that's okay. */
-  if (uri && dynamic_export && nbd_aio_is_negotiating (h->nbd)) {
-    if (nbd_set_export_name (h->nbd, client_export) == -1)
+  if (uri && dynamic_export && nbd_aio_is_negotiating (l->nbd)) {
+    if (nbd_set_export_name (l->nbd, client_export) == -1)
       goto errnbd;
-    if (nbd_opt_go (h->nbd) == -1)
+    if (nbd_opt_go (l->nbd) == -1)
       goto errnbd;
   }
 #endif
 
-  if (readonly)
-    h->readonly = true;
-
   /* Spawn a dedicated reader thread */
-  if ((errno = pthread_create (&h->reader, NULL, nbdplug_reader, h))) {
+  if ((errno = pthread_create (&l->reader, NULL, nbdplug_reader, l))) {
     nbdkit_error ("failed to initialize reader thread: %m");
     goto err;
   }
 
-  return h;
+  return 0;
 
  errnbd:
   nbdkit_error ("failure while creating nbd handle: %s", nbd_get_error ());
  err:
-  close (h->fds[0]);
-  close (h->fds[1]);
-  if (h->nbd)
-    nbd_close (h->nbd);
+  close (l->fds[0]);
+  close (l->fds[1]);
+  if (l->nbd)
+    nbd_close (l->nbd);
+  l->nbd = NULL;
+  return -1;
+}
+
+/* Disconnect a single link. */
+static void
+nbdplug_close_link (struct link *l)
+{
+  if (nbd_aio_disconnect (l->nbd, 0) == -1)
+    nbdkit_debug ("failed to clean up handle: %s", nbd_get_error ());
+  if ((errno = pthread_join (l->reader, NULL)))
+    nbdkit_debug ("failed to join reader thread: %m");
+  close (l->fds[0]);
+  close (l->fds[1]);
+  nbd_close (l->nbd);
+}
+
+/* Create the shared or per-connection handle. */
+static struct handle *
+nbdplug_open_handle (int readonly, const char *client_export)
+{
+  struct handle *h;
+  unsigned i;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  h->links = calloc (connections, sizeof *h->links);
+  if (h->links == NULL) {
+    nbdkit_error ("malloc: %m");
+    free (h);
+    return NULL;
+  }
+
+  if (dynamic_export)
+    assert (client_export);
+  else
+    client_export = export;
+
+  if (nbdplug_open_link (&h->links[0], client_export) == -1) {
+    free (h->links);
+    free (h);
+    return NULL;
+  }
+  h->nr_links = 1;
+
+  /* Open further connections to the server so commands can fan out,
+   * but only if the server advertises multi-conn: without that
+   * guarantee a flush on one connection does not cover writes
+   * completed on another.
+   */
+  if (connections > 1) {
+    if (nbd_can_multi_conn (h->links[0].nbd) > 0) {
+      for (i = 1; i < connections; ++i) {
+        if (nbdplug_open_link (&h->links[i], client_export) == -1)
+          goto err;
+        h->nr_links++;
+      }
+    }
+    else
+      nbdkit_debug ("server does not advertise multi-conn, "
+                    "using a single connection");
+  }
+
+  if (readonly)
+    h->readonly = true;
+
+  return h;
+
+ err:
+  while (h->nr_links > 0)
+    nbdplug_close_link (&h->links[--h->nr_links]);
+  free (h->links);
   free (h);
   return NULL;
 }
@@ -792,13 +903,11 @@ nbdplug_open (int readonly)
 static void
 nbdplug_close_handle (struct handle *h)
 {
-  if (nbd_aio_disconnect (h->nbd, 0) == -1)
-    nbdkit_debug ("failed to clean up handle: %s", nbd_get_error ());
-  if ((errno = pthread_join (h->reader, NULL)))
-    nbdkit_debug ("failed to join reader thread: %m");
-  close (h->fds[0]);
-  close (h->fds[1]);
-  nbd_close (h->nbd);
+  unsigned i;
+
+  for (i = 0; i < h->nr_links; ++i)
+    nbdplug_close_link (&h->links[i]);
+  free (h->links);
   free (h);
 }
 
@@ -818,7 +927,7 @@ nbdplug_export_description (void *handle)
 {
 #if LIBNBD_HAVE_NBD_GET_EXPORT_DESCRIPTION
   struct handle *h = handle;
-  CLEANUP_FREE char *desc = nbd_get_export_description (h->nbd);
+  CLEANUP_FREE char *desc = nbd_get_export_description (h->links[0].nbd);
   if (desc)
     return nbdkit_strdup_intern (desc);
 #endif
@@ -830,7 +939,7 @@ static int64_t
 nbdplug_get_size (void *handle)
 {
   struct handle *h = handle;
-  int64_t size = nbd_get_size (h->nbd);
+  int64_t size = nbd_get_size (h->links[0].nbd);
 
   if (size == -1) {
     nbdkit_error ("failure to get size: %s", nbd_get_error ());
@@ -843,7 +952,7 @@ static int
 nbdplug_can_write (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_is_read_only (h->nbd);
+  int i = nbd_is_read_only (h->links[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check readonly flag: %s", nbd_get_error ());
@@ -856,7 +965,7 @@ static int
 nbdplug_can_flush (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_flush (h->nbd);
+  int i = nbd_can_flush (h->links[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check flush flag: %s", nbd_get_error ());
@@ -869,7 +978,7 @@ static int
 nbdplug_is_rotational (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_is_rotational (h->nbd);
+  int i = nbd_is_rotational (h->links[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check rotational flag: %s", nbd_get_error ());
@@ -882,7 +991,7 @@ static int
 nbdplug_can_trim (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_trim (h->nbd);
+  int i = nbd_can_trim (h->links[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check trim flag: %s", nbd_get_error ());
@@ -895,7 +1004,7 @@ static int
 nbdplug_can_zero (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_zero (h->nbd);
+  int i = nbd_can_zero (h->links[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check zero flag: %s", nbd_get_error ());
@@ -909,7 +1018,7 @@ nbdplug_can_fast_zero (void *handle)
 {
 #if LIBNBD_HAVE_NBD_CAN_FAST_ZERO
   struct handle *h = handle;
-  int i = nbd_can_fast_zero (h->nbd);
+  int i = nbd_can_fast_zero (h->links[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check fast zero flag: %s", nbd_get_error ());
@@ -926,7 +1035,7 @@ static int
 nbdplug_can_fua (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_fua (h->nbd);
+  int i = nbd_can_fua (h->links[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check fua flag: %s", nbd_get_error ());
@@ -939,7 +1048,7 @@ static int
 nbdplug_can_multi_conn (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_multi_conn (h->nbd);
+  int i = nbd_can_multi_conn (h->links[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check multi-conn flag: %s", nbd_get_error ());
@@ -952,7 +1061,7 @@ static int
 nbdplug_can_cache (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_cache (h->nbd);
+  int i = nbd_can_cache (h->links[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check cache flag: %s", nbd_get_error ());
@@ -965,7 +1074,7 @@ static int
 nbdplug_can_extents (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_meta_context (h->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION);
+  int i = nbd_can_meta_context (h->links[0].nbd, LIBNBD_CONTEXT_BASE_ALLOCATION);
 
   if (i == -1) {
     nbdkit_error ("failure to check extents ability: %s", nbd_get_error ());
@@ -980,11 +1089,12 @@ nbdplug_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
                uint32_t flags)
 {
   struct handle *h = handle;
+  struct link *l = nbdplug_choose_link (h);
   struct transaction s;
 
   assert (!flags);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_pread (h->nbd, buf, count, offset,
+  nbdplug_register (l, &s, nbd_aio_pread (l->nbd, buf, count, offset,
                                           s.cb, 0));
   return nbdplug_reply (h, &s);
 }
@@ -995,12 +1105,13 @@ nbdplug_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
                 uint32_t flags)
 {
   struct handle *h = handle;
+  struct link *l = nbdplug_choose_link (h);
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_pwrite (h->nbd, buf, count, offset,
+  nbdplug_register (l, &s, nbd_aio_pwrite (l->nbd, buf, count, offset,
                                            s.cb, f));
   return nbdplug_reply (h, &s);
 }
@@ -1010,6 +1121,7 @@ static int
 nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct link *l = nbdplug_choose_link (h);
   struct transaction s;
   uint32_t f = 0;
 
@@ -1027,7 +1139,7 @@ nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   assert (!(flags & NBDKIT_FLAG_FAST_ZERO));
 #endif
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_zero (h->nbd, count, offset, s.cb, f));
+  nbdplug_register (l, &s, nbd_aio_zero (l->nbd, count, offset, s.cb, f));
   return nbdplug_reply (h, &s);
 }
 
@@ -1036,12 +1148,13 @@ static int
 nbdplug_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct link *l = nbdplug_choose_link (h);
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_trim (h->nbd, count, offset, s.cb, f));
+  nbdplug_register (l, &s, nbd_aio_trim (l->nbd, count, offset, s.cb, f));
   return nbdplug_reply (h, &s);
 }
 
@@ -1050,11 +1163,16 @@ static int
 nbdplug_flush (void *handle, uint32_t flags)
 {
   struct handle *h = handle;
+  struct link *l = nbdplug_choose_link (h);
   struct transaction s;
 
   assert (!flags);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_flush (h->nbd, s.cb, 0));
+  /* When there are multiple links the server advertised multi-conn,
+   * which means a flush over any one of them covers writes completed
+   * on all of them.
+   */
+  nbdplug_register (l, &s, nbd_aio_flush (l->nbd, s.cb, 0));
   return nbdplug_reply (h, &s);
 }
 
@@ -1085,13 +1203,14 @@ nbdplug_extents (void *handle, uint32_t count, uint64_t offset,
                  uint32_t flags, struct nbdkit_extents *extents)
 {
   struct handle *h = handle;
+  struct link *l = nbdplug_choose_link (h);
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_REQ_ONE ? LIBNBD_CMD_FLAG_REQ_ONE : 0;
   nbd_extent_callback extcb = { nbdplug_extent, extents };
 
   assert (!(flags & ~NBDKIT_FLAG_REQ_ONE));
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_block_status (h->nbd, count, offset,
+  nbdplug_register (l, &s, nbd_aio_block_status (l->nbd, count, offset,
                                                  extcb, s.cb, f));
   return nbdplug_reply (h, &s);
 }
@@ -1101,11 +1220,12 @@ static int
 nbdplug_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct link *l = nbdplug_choose_link (h);
   struct transaction s;
 
   assert (!flags);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_cache (h->nbd, count, offset, s.cb, 0));
+  nbdplug_register (l, &s, nbd_aio_cache (l->nbd, count, offset, s.cb, 0));
   return nbdplug_reply (h, &s);
 }
 
@@ -61,6 +61,12 @@ constructor (void)
 
   /* Initialize OCaml runtime. */
   caml_startup (argv);
+
+  /* caml_startup returns with the runtime lock held by this thread.
+   * Release it, otherwise no other thread could ever enter OCaml;
+   * each wrapper acquires the lock for the duration of its callback.
+   */
+  caml_release_runtime_system ();
 }
 
 /* Instead of using the NBDKIT_REGISTER_PLUGIN macro, we construct the
@@ -109,7 +115,7 @@ plugin_init (void)
 static void
 load_wrapper (void)
 {
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
   caml_callback (load_fn, Val_unit);
 }
 
@@ -120,7 +126,7 @@ static void
 unload_wrapper (void)
 {
   if (unload_fn) {
-    LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+    ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
     caml_callback (unload_fn, Val_unit);
   }
 
@@ -138,7 +144,7 @@ dump_plugin_wrapper (void)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (dump_plugin_fn, Val_unit);
   if (Is_exception_result (rv))
@@ -151,7 +157,7 @@ config_wrapper (const char *key, const char *val)
 {
   CAMLparam0 ();
   CAMLlocal3 (keyv, valv, rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   keyv = caml_copy_string (key);
   valv = caml_copy_string (val);
@@ -170,7 +176,7 @@ config_complete_wrapper (void)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (config_complete_fn, Val_unit);
   if (Is_exception_result (rv)) {
@@ -186,7 +192,7 @@ thread_model_wrapper (void)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (thread_model_fn, Val_unit);
   if (Is_exception_result (rv)) {
@@ -202,7 +208,7 @@ get_ready_wrapper (void)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (get_ready_fn, Val_unit);
   if (Is_exception_result (rv)) {
@@ -218,7 +224,7 @@ after_fork_wrapper (void)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (after_fork_fn, Val_unit);
   if (Is_exception_result (rv)) {
@@ -234,7 +240,7 @@ preconnect_wrapper (int readonly)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (preconnect_fn, Val_bool (readonly));
   if (Is_exception_result (rv)) {
@@ -250,7 +256,7 @@ list_exports_wrapper (int readonly, int is_tls, struct nbdkit_exports *exports)
 {
   CAMLparam0 ();
   CAMLlocal2 (rv, v);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback2_exn (list_exports_fn, Val_bool (readonly),
                            Val_bool (is_tls));
@@ -283,7 +289,7 @@ default_export_wrapper (int readonly, int is_tls)
   CAMLparam0 ();
   CAMLlocal1 (rv);
   const char *name;
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback2_exn (default_export_fn, Val_bool (readonly),
                            Val_bool (is_tls));
@@ -302,7 +308,7 @@ open_wrapper (int readonly)
   CAMLparam0 ();
   CAMLlocal1 (rv);
   value *ret;
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (open_fn, Val_bool (readonly));
   if (Is_exception_result (rv)) {
@@ -324,7 +330,7 @@ close_wrapper (void *h)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (close_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -344,7 +350,7 @@ export_description_wrapper (void *h)
   CAMLparam0 ();
   CAMLlocal1 (rv);
   const char *desc;
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (export_description_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -362,7 +368,7 @@ get_size_wrapper (void *h)
   CAMLparam0 ();
   CAMLlocal1 (rv);
   int64_t r;
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (get_size_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -379,7 +385,7 @@ can_write_wrapper (void *h)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (can_write_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -395,7 +401,7 @@ can_flush_wrapper (void *h)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (can_flush_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -411,7 +417,7 @@ is_rotational_wrapper (void *h)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (is_rotational_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -427,7 +433,7 @@ can_trim_wrapper (void *h)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (can_trim_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -443,7 +449,7 @@ can_zero_wrapper (void *h)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (can_zero_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -459,7 +465,7 @@ can_fua_wrapper (void *h)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (can_fua_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -475,7 +481,7 @@ can_fast_zero_wrapper (void *h)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (can_fast_zero_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -491,7 +497,7 @@ can_cache_wrapper (void *h)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (can_cache_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -507,7 +513,7 @@ can_extents_wrapper (void *h)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (can_extents_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -523,7 +529,7 @@ can_multi_conn_wrapper (void *h)
 {
   CAMLparam0 ();
   CAMLlocal1 (rv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   rv = caml_callback_exn (can_multi_conn_fn, *(value *) h);
   if (Is_exception_result (rv)) {
@@ -570,7 +576,7 @@ pread_wrapper (void *h, void *buf, uint32_t count, uint64_t offset,
   CAMLparam0 ();
   CAMLlocal4 (rv, countv, offsetv, flagsv);
   mlsize_t len;
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   countv = caml_copy_int32 (count);
   offsetv = caml_copy_int64 (offset);
@@ -599,7 +605,7 @@ pwrite_wrapper (void *h, const void *buf, uint32_t count, uint64_t offset,
 {
   CAMLparam0 ();
   CAMLlocal4 (rv, strv, offsetv, flagsv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   strv = caml_alloc_initialized_string (count, buf);
   offsetv = caml_copy_int64 (offset);
@@ -620,7 +626,7 @@ flush_wrapper (void *h, uint32_t flags)
 {
   CAMLparam0 ();
   CAMLlocal2 (rv, flagsv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   flagsv = Val_flags (flags);
 
@@ -638,7 +644,7 @@ trim_wrapper (void *h, uint32_t count, uint64_t offset, uint32_t flags)
 {
   CAMLparam0 ();
   CAMLlocal4 (rv, countv, offsetv, flagsv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   countv = caml_copy_int32 (count);
   offsetv = caml_copy_int32 (offset);
@@ -659,7 +665,7 @@ zero_wrapper (void *h, uint32_t count, uint64_t offset, uint32_t flags)
 {
   CAMLparam0 ();
   CAMLlocal4 (rv, countv, offsetv, flagsv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   countv = caml_copy_int32 (count);
   offsetv = caml_copy_int32 (offset);
@@ -681,7 +687,7 @@ extents_wrapper (void *h, uint32_t count, uint64_t offset, uint32_t flags,
 {
   CAMLparam0 ();
   CAMLlocal5 (rv, countv, offsetv, flagsv, v);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   countv = caml_copy_int32 (count);
   offsetv = caml_copy_int32 (offset);
@@ -721,7 +727,7 @@ cache_wrapper (void *h, uint32_t count, uint64_t offset, uint32_t flags)
 {
   CAMLparam0 ();
   CAMLlocal4 (rv, countv, offsetv, flagsv);
-  LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE ();
+  ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE ();
 
   countv = caml_copy_int32 (count);
   offsetv = caml_copy_int32 (offset);
@@ -33,6 +33,8 @@
 #ifndef NBDKIT_OCAML_PLUGIN_H
 #define NBDKIT_OCAML_PLUGIN_H
 
+#include <stdbool.h>
+
 /* Replacement if caml_alloc_initialized_string is missing, added
  * to OCaml runtime in 2017.
  */
@@ -46,19 +48,39 @@ caml_alloc_initialized_string (mlsize_t len, const char *p)
 }
 #endif
 
-/* For functions which call into OCaml code, call
- * caml_leave_blocking_section() to prevent other threads running,
- * then caml_enter_blocking_section() on return to C code.  This macro
- * ensures that the calls are paired properly.
+/* Functions which call into OCaml code must hold the OCaml runtime
+ * lock for the duration of the call, and release it again when they
+ * return to C, so that other server threads can enter OCaml in the
+ * meantime (eg. while this request is blocked in a system call made
+ * through the OCaml Unix module, which drops the lock itself).  This
+ * macro ensures that the acquire/release calls are paired properly.
+ *
+ * nbdkit server threads are plain C threads which the OCaml runtime
+ * has never heard of, so they must be registered with the runtime
+ * before they can take the lock.  caml_c_thread_register is only
+ * present when the plugin is linked with the OCaml threads library;
+ * without it the runtime lock is a no-op anyway, hence the weak
+ * reference.
  */
-#define LEAVE_BLOCKING_SECTION_FOR_CURRENT_SCOPE() \
-  __attribute__((unused, cleanup (cleanup_enter_blocking_section))) \
+extern int caml_c_thread_register (void) __attribute__((weak));
+
+#define ACQUIRE_RUNTIME_FOR_CURRENT_SCOPE() \
+  __attribute__((unused, cleanup (cleanup_release_runtime_system))) \
   int _unused;                                              \
-  caml_leave_blocking_section ()
+  do {                                                      \
+    if (caml_c_thread_register && !thread_registered) {     \
+      caml_c_thread_register ();                            \
+      thread_registered = true;                             \
+    }                                                       \
+    caml_acquire_runtime_system ();                         \
+  } while (0)
+
+static __thread bool thread_registered __attribute__((unused)) = false;
+
 static inline void
-cleanup_enter_blocking_section (int *unused)
+cleanup_release_runtime_system (int *unused)
 {
-  caml_enter_blocking_section ();
+  caml_release_runtime_system ();
 }
 
 #endif /* NBDKIT_OCAML_PLUGIN_H */
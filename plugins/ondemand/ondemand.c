@@ -53,6 +53,11 @@
 
 #include <pthread.h>
 
+#if defined (__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>       /* For FICLONE */
+#endif
+
 #define NBDKIT_API_VERSION 2
 #include <nbdkit-plugin.h>
 
@@ -63,6 +68,20 @@
 static char *dir;                   /* dir parameter */
 static DIR *exportsdir;             /* opened exports dir */
 static int64_t requested_size = -1; /* size parameter on the command line */
+static unsigned pool;               /* pool parameter */
+static bool preallocate;            /* preallocate parameter */
+
+/* Pool of pre-created filesystems, stored in a hidden subdirectory of
+ * the exports directory.  (The name contains '.' so it can never
+ * clash with an export and is skipped by .list_exports.)
+ */
+#define POOL_SUBDIR ".pool"
+static DIR *pooldir;                /* opened pool subdirectory */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_thread;
+static bool pool_thread_running;
+static bool pool_quit;
 
 /* Shell variables. */
 static struct var {
@@ -80,11 +99,22 @@ ondemand_unload (void)
 {
   struct var *v, *v_next;
 
+  if (pool_thread_running) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+      pool_quit = true;
+      pthread_cond_signal (&pool_cond);
+    }
+    pthread_join (pool_thread, NULL);
+  }
+
   for (v = vars; v != NULL; v = v_next) {
     v_next = v->next;
     free (v);
   }
 
+  if (pooldir)
+    closedir (pooldir);
   if (exportsdir)
     closedir (exportsdir);
   free (dir);
@@ -106,6 +136,16 @@ ondemand_config (const char *key, const char *value)
     if (dir == NULL)
       return -1;
   }
+  else if (strcmp (key, "pool") == 0) {
+    if (nbdkit_parse_unsigned ("pool", value, &pool) == -1)
+      return -1;
+  }
+  else if (strcmp (key, "preallocate") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    preallocate = r;
+  }
 
   /* This parameter cannot be set on the command line since it is used
    * to pass the disk name to the command.
@@ -164,6 +204,45 @@ ondemand_get_ready (void)
     return -1;
   }
 
+  if (pool > 0) {
+    int fd;
+
+    if (mkdirat (dirfd (exportsdir), POOL_SUBDIR, 0700) == -1 &&
+        errno != EEXIST) {
+      nbdkit_error ("mkdir: %s/%s: %m", dir, POOL_SUBDIR);
+      return -1;
+    }
+    fd = openat (dirfd (exportsdir), POOL_SUBDIR,
+                 O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || (pooldir = fdopendir (fd)) == NULL) {
+      nbdkit_error ("open: %s/%s: %m", dir, POOL_SUBDIR);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* The thread which refills the pool is started after forking so it is
+ * not stranded in the parent process.
+ */
+static void *pool_thread_func (void *vp);
+
+static int
+ondemand_after_fork (void)
+{
+  int err;
+
+  if (pool == 0)
+    return 0;
+
+  err = pthread_create (&pool_thread, NULL, pool_thread_func, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  pool_thread_running = true;
   return 0;
 }
 
@@ -172,7 +251,9 @@ ondemand_get_ready (void)
   "size=<SIZE>      (required) Virtual filesystem size.\n" \
   "label=<LABEL>               The filesystem label.\n" \
   "type=ext4|...               The filesystem type.\n" \
-  "command=<COMMAND>           Alternate command instead of mkfs."
+  "command=<COMMAND>           Alternate command instead of mkfs.\n" \
+  "pool=<N>                    Keep N pre-created filesystems ready.\n" \
+  "preallocate=true            Fully allocate new filesystems."
 
 /* Because we rewind the exportsdir handle, we need a lock to protect
  * list_exports from being called in parallel.
@@ -332,6 +413,174 @@ run_command (const char *disk)
   return 0;
 }
 
+/* Fully allocate a newly created disk if preallocate=true was given. */
+static int
+preallocate_disk (int fd)
+{
+  int err;
+
+  err = posix_fallocate (fd, 0, requested_size);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("posix_fallocate: %m");
+    return -1;
+  }
+  return 0;
+}
+
+/* Count the images currently in the pool.  Caller must hold pool_lock. */
+static unsigned
+pool_count (void)
+{
+  unsigned count = 0;
+  struct dirent *d;
+
+  rewinddir (pooldir);
+  while ((d = readdir (pooldir)) != NULL) {
+    if (d->d_name[0] == '.' || strcmp (d->d_name, "tmp") == 0)
+      continue;
+    count++;
+  }
+  return count;
+}
+
+/* Create one new pool image.  Called only from the pool thread.  Note
+ * this runs the (slow) mkfs command without holding pool_lock.
+ */
+static int
+pool_create_image (void)
+{
+  CLEANUP_FREE char *tmp = NULL;
+  char unique[64];
+  static unsigned seq;
+
+  if (asprintf (&tmp, "%s/%s/tmp", dir, POOL_SUBDIR) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+
+  /* Remove any partially created image from a previous run. */
+  unlinkat (dirfd (pooldir), "tmp", 0);
+
+  if (run_command (tmp) == -1)
+    return -1;
+
+  if (preallocate) {
+    int fd = openat (dirfd (pooldir), "tmp", O_RDWR | O_CLOEXEC);
+
+    if (fd == -1) {
+      nbdkit_error ("open: %s: %m", tmp);
+      return -1;
+    }
+    if (preallocate_disk (fd) == -1) {
+      close (fd);
+      return -1;
+    }
+    close (fd);
+  }
+
+  /* Pick a name which is not already in use (there may be images left
+   * over from a previous run) and move the image into the pool.
+   */
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+  do {
+    snprintf (unique, sizeof unique, "img.%u", seq++);
+  } while (faccessat (dirfd (pooldir), unique, F_OK, 0) == 0);
+  if (renameat (dirfd (pooldir), "tmp", dirfd (pooldir), unique) == -1) {
+    nbdkit_error ("rename: %s/%s/%s: %m", dir, POOL_SUBDIR, unique);
+    return -1;
+  }
+  nbdkit_debug ("ondemand: created pool image %s", unique);
+  return 0;
+}
+
+/* The pool thread keeps the pool topped up with pre-created images so
+ * that new exports do not have to wait for mkfs.
+ */
+static void *
+pool_thread_func (void *vp)
+{
+  for (;;) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+      while (!pool_quit && pool_count () >= pool)
+        pthread_cond_wait (&pool_cond, &pool_lock);
+      if (pool_quit)
+        return NULL;
+    }
+
+    if (pool_create_image () == -1) {
+      /* Don't spin if the command is broken.  Clients will still be
+       * able to create filesystems themselves in .open.
+       */
+      nbdkit_error ("could not create pool image, disabling the pool");
+      return NULL;
+    }
+  }
+}
+
+/* Take a pre-created filesystem from the pool for a new export.
+ * Returns 0 on success, or 1 to tell the caller to fall back to
+ * running the mkfs command itself.
+ */
+static int
+pool_take_image (const char *exportname)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+  struct dirent *d;
+
+  rewinddir (pooldir);
+  while ((d = readdir (pooldir)) != NULL) {
+    if (d->d_name[0] == '.' || strcmp (d->d_name, "tmp") == 0)
+      continue;
+
+#ifdef FICLONE
+    /* Prefer a reflink clone, which leaves the pool image in place.
+     * This only works on filesystems which can share extents
+     * (eg. XFS, btrfs), so fall back to renaming below.
+     */
+    {
+      int srcfd, dstfd;
+
+      srcfd = openat (dirfd (pooldir), d->d_name, O_RDONLY | O_CLOEXEC);
+      if (srcfd >= 0) {
+        dstfd = openat (dirfd (exportsdir), exportname,
+                        O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+        if (dstfd >= 0) {
+          if (ioctl (dstfd, FICLONE, srcfd) == 0) {
+            close (srcfd);
+            close (dstfd);
+            nbdkit_debug ("ondemand: cloned pool image %s for export %s",
+                          d->d_name, exportname);
+            return 0;
+          }
+          nbdkit_debug ("ondemand: FICLONE: %m (falling back to rename)");
+          close (dstfd);
+          unlinkat (dirfd (exportsdir), exportname, 0);
+        }
+        close (srcfd);
+      }
+    }
+#endif
+
+    /* Move the pool image into place, consuming it, and wake up the
+     * pool thread to create a replacement.
+     */
+    if (renameat (dirfd (pooldir), d->d_name,
+                  dirfd (exportsdir), exportname) == -1) {
+      nbdkit_debug ("ondemand: rename pool image %s: %m", d->d_name);
+      return 1;
+    }
+    nbdkit_debug ("ondemand: took pool image %s for export %s",
+                  d->d_name, exportname);
+    pthread_cond_signal (&pool_cond);
+    return 0;
+  }
+
+  nbdkit_debug ("ondemand: pool is empty, running command instead");
+  return 1;
+}
+
 /* For block devices, stat->st_size is not the true size. */
 static int64_t
 block_device_size (int fd)
@@ -353,6 +602,7 @@ ondemand_open (int readonly)
   struct handle *h;
   CLEANUP_FREE char *disk = NULL;
   int flags, err;
+  bool created_by_command = false;
   struct stat statbuf;
 #ifdef F_OFD_SETLK
   struct flock lock;
@@ -404,9 +654,14 @@ ondemand_open (int readonly)
       goto error;
     }
 
-    /* Now run the mkfs command. */
-    if (run_command (disk) == -1)
-      goto error;
+    /* Take a pre-created filesystem from the pool if we can, else run
+     * the mkfs command.
+     */
+    if (pool == 0 || pool_take_image (h->exportname) != 0) {
+      if (run_command (disk) == -1)
+        goto error;
+      created_by_command = true;
+    }
 
     h->fd = openat (dirfd (exportsdir), h->exportname, flags);
     if (h->fd == -1) {
@@ -468,6 +723,16 @@ ondemand_open (int readonly)
   nbdkit_debug ("ondemand: requested_size = %" PRIi64 ", size = %" PRIi64,
                 requested_size, h->size);
 
+  /* If we created the disk by running the command, optionally
+   * preallocate it.  (Pool images are preallocated when they are
+   * created, and preallocating a reflink clone would only unshare
+   * the extents.)
+   */
+  if (created_by_command && preallocate && S_ISREG (statbuf.st_mode)) {
+    if (preallocate_disk (h->fd) == -1)
+      goto error;
+  }
+
   /* Return the handle. */
   return h;
 
@@ -631,6 +896,7 @@ static struct nbdkit_plugin plugin = {
   .config_help       = ondemand_config_help,
   .magic_config_key  = "size",
   .get_ready         = ondemand_get_ready,
+  .after_fork        = ondemand_after_fork,
 
   .list_exports      = ondemand_list_exports,
   .default_export    = ondemand_default_export,
@@ -102,6 +102,14 @@ create_virtual_disk_layout (void)
     }
   }
 
+  /* Reserve the whole region array up front: each file contributes at
+   * most four regions (EBR, pre-alignment padding, the partition
+   * itself, post-padding), plus the partition tables.  With thousands
+   * of partitions this avoids reallocating the array as it grows.
+   */
+  if (reserve_regions (&the_regions, 4 * the_files.size + 2) == -1)
+    return -1;
+
   /* Virtual primary partition table region at the start of the disk. */
   if (parttype == PARTTYPE_MBR) {
     if (append_region_len (&the_regions, "MBR",
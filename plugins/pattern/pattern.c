@@ -104,12 +104,10 @@ pattern_can_cache (void *handle)
   return NBDKIT_CACHE_NATIVE;
 }
 
-/* Read data. */
-static int
-pattern_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
-               uint32_t flags)
+/* Generate the pattern one word at a time. */
+static void
+pattern_fill_scalar (uint8_t *b, uint32_t count, uint64_t offset)
 {
-  char *b = buf;
   uint64_t d;
   uint64_t o;
   uint32_t n;
@@ -123,13 +121,109 @@ pattern_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
     offset += 8-o;
     count -= n;
   }
+}
+
+#if defined (__x86_64__)
+
+#include <immintrin.h>
+
+/* pshufb control bytes reversing each 64-bit element of a 16 byte
+ * lane, converting the little-endian counters to big-endian.
+ */
+static const uint8_t bswap64_shuffle[16] __attribute__((__aligned__ (16))) = {
+  7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+};
+
+/* Write 4 incrementing 64-bit counters per store.  The caller has
+ * already aligned offset to 8 bytes.
+ */
+__attribute__((target ("avx2")))
+static void
+pattern_fill_avx2 (uint8_t *b, uint32_t count, uint64_t offset)
+{
+  const __m256i bswap = _mm256_broadcastsi128_si256
+    (_mm_load_si128 ((const __m128i *) bswap64_shuffle));
+  const __m256i inc = _mm256_set1_epi64x (32);
+  __m256i ctr = _mm256_set_epi64x (offset+24, offset+16, offset+8, offset);
+
+  while (count >= 32) {
+    _mm256_storeu_si256 ((__m256i *) b, _mm256_shuffle_epi8 (ctr, bswap));
+    ctr = _mm256_add_epi64 (ctr, inc);
+    b += 32; offset += 32; count -= 32;
+  }
+  if (count > 0)
+    pattern_fill_scalar (b, count, offset);
+}
+
+#elif defined (__aarch64__) && \
+  __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+#include <arm_neon.h>
+
+/* NEON is mandatory on aarch64, no runtime check needed. */
+static void
+pattern_fill_neon (uint8_t *b, uint32_t count, uint64_t offset)
+{
+  const uint64x2_t inc = vdupq_n_u64 (16);
+  uint64x2_t ctr = { offset, offset+8 };
+
+  while (count >= 16) {
+    vst1q_u8 (b, vrev64q_u8 (vreinterpretq_u8_u64 (ctr)));
+    ctr = vaddq_u64 (ctr, inc);
+    b += 16; offset += 16; count -= 16;
+  }
+  if (count > 0)
+    pattern_fill_scalar (b, count, offset);
+}
+
+#endif
+
+/* The fill kernel used for all requests, selected at load time.  At
+ * the >10 GB/s this plugin is benchmarked at, the scalar generator
+ * itself becomes the bottleneck.
+ */
+static void (*pattern_fill) (uint8_t *b, uint32_t count, uint64_t offset) =
+  pattern_fill_scalar;
+
+static void
+pattern_load (void)
+{
+#if defined (__x86_64__)
+  if (__builtin_cpu_supports ("avx2"))
+    pattern_fill = pattern_fill_avx2;
+#elif defined (__aarch64__) && \
+  __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  pattern_fill = pattern_fill_neon;
+#endif
+}
+
+/* Read data. */
+static int
+pattern_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+               uint32_t flags)
+{
+  uint8_t *b = buf;
+  uint32_t n;
+
+  /* Align to the next word so the vector kernels only have to deal
+   * with whole 8 byte words.
+   */
+  if (offset & 7) {
+    n = MIN (count, 8 - (offset & 7));
+    pattern_fill_scalar (b, n, offset);
+    b += n;
+    offset += n;
+    count -= n;
+  }
 
+  pattern_fill (b, count, offset);
   return 0;
 }
 
 static struct nbdkit_plugin plugin = {
   .name              = "pattern",
   .version           = PACKAGE_VERSION,
+  .load              = pattern_load,
   .config            = pattern_config,
   .config_help       = pattern_config_help,
   .magic_config_key  = "size",
@@ -42,6 +42,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 
 #define PY_SSIZE_T_CLEAN 1
 #include <Python.h>
@@ -78,15 +79,47 @@ static int py_api_version = 1;
 
 static __thread int last_error;
 
+/* Cache of successful callback lookups, so that the hot request
+ * paths (pread, pwrite etc.) do not pay for a module attribute
+ * lookup on every request.  Only successful lookups are cached: a
+ * script may define callbacks dynamically (eg. in get_ready), so a
+ * missing callback is re-probed on the next use.  All users hold the
+ * GIL so no extra locking is needed.
+ */
+#define CALLBACK_CACHE_SIZE 64  /* > the number of distinct callbacks */
+static struct {
+  const char *name;             /* string literal from the caller */
+  PyObject *obj;
+} callback_cache[CALLBACK_CACHE_SIZE];
+static size_t callback_cache_used;
+
+static void
+callback_cache_clear (void)
+{
+  while (callback_cache_used > 0)
+    Py_CLEAR (callback_cache[--callback_cache_used].obj);
+}
+
 /* Is a callback defined? */
 static int
 callback_defined (const char *name, PyObject **obj_rtn)
 {
   PyObject *obj;
+  size_t i;
 
   assert (script != NULL);
   assert (module != NULL);
 
+  for (i = 0; i < callback_cache_used; ++i) {
+    if (strcmp (callback_cache[i].name, name) == 0) {
+      if (obj_rtn != NULL) {
+        Py_INCREF (callback_cache[i].obj);
+        *obj_rtn = callback_cache[i].obj;
+      }
+      return 1;
+    }
+  }
+
   obj = PyObject_GetAttrString (module, name);
   if (!obj) {
     PyErr_Clear (); /* Clear the AttributeError from testing attr. */
@@ -98,6 +131,13 @@ callback_defined (const char *name, PyObject **obj_rtn)
     return 0;
   }
 
+  if (callback_cache_used < CALLBACK_CACHE_SIZE) {
+    Py_INCREF (obj);
+    callback_cache[callback_cache_used].name = name;
+    callback_cache[callback_cache_used].obj = obj;
+    callback_cache_used++;
+  }
+
   if (obj_rtn != NULL)
     *obj_rtn = obj;
   else
@@ -206,6 +246,161 @@ check_python_failure (const char *callback)
   return 0;
 }
 
+/* Support for callbacks written as 'async def'.
+ *
+ * Calling an async callback returns a coroutine object instead of
+ * the result.  We run all coroutines to completion on a single
+ * shared asyncio event loop which runs in its own Python thread,
+ * created on first use.  The nbdkit worker thread waits on a
+ * concurrent.futures.Future, which releases the GIL while waiting,
+ * so with thread_model='parallel' many requests can be awaiting
+ * inside the event loop at the same time even though the plugin API
+ * itself is synchronous.
+ */
+static PyObject *event_loop;          /* the asyncio event loop */
+static PyObject *event_loop_thread;   /* threading.Thread running it */
+static PyObject *run_coroutine_threadsafe;
+static pthread_mutex_t event_loop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Create the event loop and the thread which runs it.  Called with
+ * the GIL (and event_loop_lock) held.  On failure a Python error is
+ * left set for the caller to report.
+ */
+static int
+start_event_loop (void)
+{
+  static const char script_src[] =
+    "import asyncio\n"
+    "import threading\n"
+    "loop = asyncio.new_event_loop()\n"
+    "thread = threading.Thread(target=loop.run_forever,\n"
+    "                          name='python plugin event loop',\n"
+    "                          daemon=True)\n"
+    "thread.start()\n";
+  PyObject *d, *r, *asyncio;
+
+  asyncio = PyImport_ImportModule ("asyncio");
+  if (asyncio == NULL)
+    return -1;
+  run_coroutine_threadsafe = PyObject_GetAttrString (asyncio,
+                                                     "run_coroutine_threadsafe");
+  Py_DECREF (asyncio);
+  if (run_coroutine_threadsafe == NULL)
+    return -1;
+
+  d = PyDict_New ();
+  if (d == NULL)
+    return -1;
+  r = PyRun_String (script_src, Py_file_input, d, d);
+  if (r == NULL) {
+    Py_DECREF (d);
+    return -1;
+  }
+  Py_DECREF (r);
+
+  event_loop = PyDict_GetItemString (d, "loop");
+  Py_XINCREF (event_loop);
+  event_loop_thread = PyDict_GetItemString (d, "thread");
+  Py_XINCREF (event_loop_thread);
+  Py_DECREF (d);
+  assert (event_loop != NULL && event_loop_thread != NULL);
+
+  nbdkit_debug ("started the asyncio event loop");
+  return 0;
+}
+
+/* Stop the event loop thread.  Called at unload with the GIL held. */
+static void
+stop_event_loop (void)
+{
+  PyObject *stop, *r;
+
+  stop = PyObject_GetAttrString (event_loop, "stop");
+  if (stop) {
+    r = PyObject_CallMethod (event_loop, "call_soon_threadsafe", "O", stop);
+    Py_XDECREF (r);
+    Py_DECREF (stop);
+  }
+  r = PyObject_CallMethod (event_loop_thread, "join", NULL);
+  Py_XDECREF (r);
+  PyErr_Clear ();
+  Py_CLEAR (event_loop);
+  Py_CLEAR (event_loop_thread);
+  Py_CLEAR (run_coroutine_threadsafe);
+}
+
+/* An exception from a coroutine is raised on the event loop thread,
+ * so nbdkit.set_error called there cannot reach this (worker)
+ * thread's error indication.  Instead recover the errno from the
+ * exception object itself if it carries one (eg. OSError).
+ */
+static void
+set_errno_from_exception (void)
+{
+  PyObject *type, *error, *traceback, *obj;
+  long err;
+
+  PyErr_Fetch (&type, &error, &traceback);
+  PyErr_NormalizeException (&type, &error, &traceback);
+  if (error) {
+    obj = PyObject_GetAttrString (error, "errno");
+    if (obj) {
+      err = PyLong_AsLong (obj);
+      Py_DECREF (obj);
+      if (err > 0 && !PyErr_Occurred ()) {
+        nbdkit_set_error ((int) err);
+        last_error = (int) err;
+      }
+    }
+    PyErr_Clear ();
+  }
+  PyErr_Restore (type, error, traceback);
+}
+
+/* If r is a coroutine returned by an async def callback, replace it
+ * with the coroutine's result (or NULL with an error set, as if the
+ * callback itself had raised).  For ordinary callbacks this is a
+ * no-op.  Called with the GIL held.
+ */
+static PyObject *
+resolve_coroutine (PyObject *r)
+{
+  PyObject *fut, *result;
+
+  if (r == NULL || !PyCoro_CheckExact (r))
+    return r;
+
+  /* Start the event loop on first use.  Drop the GIL while taking
+   * the lock: the initialization can re-enter the interpreter, so
+   * holding both the lock and the GIL could deadlock with another
+   * thread doing the same.
+   */
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock (&event_loop_lock);
+  Py_END_ALLOW_THREADS
+  if (event_loop == NULL && start_event_loop () == -1) {
+    pthread_mutex_unlock (&event_loop_lock);
+    Py_DECREF (r);
+    return NULL;
+  }
+  pthread_mutex_unlock (&event_loop_lock);
+
+  fut = PyObject_CallFunctionObjArgs (run_coroutine_threadsafe,
+                                      r, event_loop, NULL);
+  Py_DECREF (r);
+  if (fut == NULL)
+    return NULL;
+
+  /* Future.result() waits on a lock which releases the GIL, so other
+   * requests can make progress in the event loop meanwhile.
+   */
+  result = PyObject_CallMethod (fut, "result", NULL);
+  Py_DECREF (fut);
+  if (result == NULL)
+    set_errno_from_exception ();
+  return result;
+}
+
 /* Functions in the virtual nbdkit.* module. */
 
 /* nbdkit.debug */
@@ -342,6 +537,9 @@ py_unload (void)
 {
   if (tstate) {
     PyEval_RestoreThread (tstate);
+    if (event_loop)
+      stop_event_loop ();
+    callback_cache_clear ();
     Py_XDECREF (module);
     Py_Finalize ();
   }
@@ -468,7 +666,7 @@ py_config (const char *key, const char *value)
     /* Other parameters are passed to the Python .config callback. */
     PyErr_Clear ();
 
-    r = PyObject_CallFunction (fn, "ss", key, value);
+    r = resolve_coroutine (PyObject_CallFunction (fn, "ss", key, value));
     Py_DECREF (fn);
     if (check_python_failure ("config") == -1)
       return -1;
@@ -494,7 +692,7 @@ py_config_complete (void)
   if (callback_defined ("config_complete", &fn)) {
     PyErr_Clear ();
 
-    r = PyObject_CallObject (fn, NULL);
+    r = resolve_coroutine (PyObject_CallObject (fn, NULL));
     Py_DECREF (fn);
     if (check_python_failure ("config_complete") == -1)
       return -1;
@@ -515,7 +713,7 @@ py_thread_model (void)
   if (script && callback_defined ("thread_model", &fn)) {
     PyErr_Clear ();
 
-    r = PyObject_CallObject (fn, NULL);
+    r = resolve_coroutine (PyObject_CallObject (fn, NULL));
     Py_DECREF (fn);
     if (check_python_failure ("thread_model") == -1)
       return -1;
@@ -536,7 +734,7 @@ py_get_ready (void)
   if (callback_defined ("get_ready", &fn)) {
     PyErr_Clear ();
 
-    r = PyObject_CallObject (fn, NULL);
+    r = resolve_coroutine (PyObject_CallObject (fn, NULL));
     Py_DECREF (fn);
     if (check_python_failure ("get_ready") == -1)
       return -1;
@@ -556,7 +754,7 @@ py_after_fork (void)
   if (callback_defined ("after_fork", &fn)) {
     PyErr_Clear ();
 
-    r = PyObject_CallObject (fn, NULL);
+    r = resolve_coroutine (PyObject_CallObject (fn, NULL));
     Py_DECREF (fn);
     if (check_python_failure ("after_fork") == -1)
       return -1;
@@ -580,7 +778,7 @@ py_list_exports (int readonly, int is_tls, struct nbdkit_exports *exports)
 
   PyErr_Clear ();
 
-  r = PyObject_CallFunction (fn, "ii", readonly, is_tls);
+  r = resolve_coroutine (PyObject_CallFunction (fn, "ii", readonly, is_tls));
   Py_DECREF (fn);
   if (check_python_failure ("list_exports") == -1)
     return -1;
@@ -644,7 +842,7 @@ py_default_export (int readonly, int is_tls)
 
   PyErr_Clear ();
 
-  r = PyObject_CallFunction (fn, "ii", readonly, is_tls);
+  r = resolve_coroutine (PyObject_CallFunction (fn, "ii", readonly, is_tls));
   Py_DECREF (fn);
   if (check_python_failure ("default_export") == -1)
     return NULL;
@@ -669,8 +867,8 @@ py_preconnect (int readonly)
   if (callback_defined ("preconnect", &fn)) {
     PyErr_Clear ();
 
-    r = PyObject_CallFunctionObjArgs (fn, readonly ? Py_True : Py_False,
-                                      NULL);
+    r = resolve_coroutine (PyObject_CallFunctionObjArgs (fn,
+                             readonly ? Py_True : Py_False, NULL));
     Py_DECREF (fn);
     if (check_python_failure ("preconnect") == -1)
       return -1;
@@ -706,8 +904,8 @@ py_open (int readonly)
 
   PyErr_Clear ();
 
-  h->py_h = PyObject_CallFunctionObjArgs (fn, readonly ? Py_True : Py_False,
-                                          NULL);
+  h->py_h = resolve_coroutine (PyObject_CallFunctionObjArgs (fn,
+                                 readonly ? Py_True : Py_False, NULL));
   Py_DECREF (fn);
   if (check_python_failure ("open") == -1) {
     free (h);
@@ -729,7 +927,7 @@ py_close (void *handle)
   if (callback_defined ("close", &fn)) {
     PyErr_Clear ();
 
-    r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+    r = resolve_coroutine (PyObject_CallFunctionObjArgs (fn, h->py_h, NULL));
     Py_DECREF (fn);
     check_python_failure ("close");
     Py_XDECREF (r);
@@ -753,7 +951,7 @@ py_export_description (void *handle)
 
   PyErr_Clear ();
 
-  r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+  r = resolve_coroutine (PyObject_CallFunctionObjArgs (fn, h->py_h, NULL));
   Py_DECREF (fn);
   if (check_python_failure ("export_description") == -1)
     return NULL;
@@ -784,7 +982,7 @@ py_get_size (void *handle)
 
   PyErr_Clear ();
 
-  r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+  r = resolve_coroutine (PyObject_CallFunctionObjArgs (fn, h->py_h, NULL));
   Py_DECREF (fn);
   if (check_python_failure ("get_size") == -1)
     return -1;
@@ -826,6 +1024,7 @@ py_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
     break;
   default: abort ();
   }
+  r = resolve_coroutine (r);
   Py_DECREF (fn);
   if (check_python_failure ("pread") == -1)
     return ret;
@@ -885,6 +1084,7 @@ py_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
       break;
     default: abort ();
     }
+    r = resolve_coroutine (r);
     Py_DECREF (fn);
     if (check_python_failure ("pwrite") == -1)
       return -1;
@@ -918,6 +1118,7 @@ py_flush (void *handle, uint32_t flags)
       break;
     default: abort ();
     }
+    r = resolve_coroutine (r);
     Py_DECREF (fn);
     if (check_python_failure ("flush") == -1)
       return -1;
@@ -951,6 +1152,7 @@ py_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
       break;
     default: abort ();
     }
+    r = resolve_coroutine (r);
     Py_DECREF (fn);
     if (check_python_failure ("trim") == -1)
       return -1;
@@ -989,6 +1191,7 @@ py_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
       break;
     default: abort ();
     }
+    r = resolve_coroutine (r);
     Py_DECREF (fn);
     if (last_error == EOPNOTSUPP || last_error == ENOTSUP) {
       /* When user requests this particular error, we want to
@@ -1029,6 +1232,7 @@ py_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
       break;
     default: abort ();
     }
+    r = resolve_coroutine (r);
     Py_DECREF (fn);
     if (check_python_failure ("cache") == -1)
       return -1;
@@ -1053,7 +1257,7 @@ boolean_callback (void *handle, const char *can_fn, const char *plain_fn)
   if (callback_defined (can_fn, &fn)) {
     PyErr_Clear ();
 
-    r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+    r = resolve_coroutine (PyObject_CallFunctionObjArgs (fn, h->py_h, NULL));
     Py_DECREF (fn);
     if (check_python_failure (can_fn) == -1)
       return -1;
@@ -1147,7 +1351,7 @@ py_can_fua (void *handle)
   if (callback_defined ("can_fua", &fn)) {
     PyErr_Clear ();
 
-    r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+    r = resolve_coroutine (PyObject_CallFunctionObjArgs (fn, h->py_h, NULL));
     Py_DECREF (fn);
     if (check_python_failure ("can_fua") == -1)
       return -1;
@@ -1176,7 +1380,7 @@ py_can_cache (void *handle)
   if (callback_defined ("can_cache", &fn)) {
     PyErr_Clear ();
 
-    r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+    r = resolve_coroutine (PyObject_CallFunctionObjArgs (fn, h->py_h, NULL));
     Py_DECREF (fn);
     if (check_python_failure ("can_cache") == -1)
       return -1;
@@ -1214,7 +1418,9 @@ py_extents (void *handle, uint32_t count, uint64_t offset,
   if (callback_defined ("extents", &fn)) {
     PyErr_Clear ();
 
-    r = PyObject_CallFunction (fn, "OiLI", h->py_h, count, offset, flags);
+    r = resolve_coroutine (PyObject_CallFunction (fn, "OiLI",
+                                                  h->py_h, count, offset,
+                                                  flags));
     Py_DECREF (fn);
     if (check_python_failure ("extents") == -1)
       return -1;
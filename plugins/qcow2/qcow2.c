@@ -0,0 +1,592 @@
+/* nbdkit
+ * Copyright (C) 2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Read-only plugin for local qcow2 files.
+ *
+ * The whole file is mapped into memory, so the L1 and L2 tables and
+ * uncompressed clusters are read directly from the mapping (the
+ * kernel page cache takes the place of a metadata cache).
+ * Decompressed clusters are kept in a small LRU cache, modelled on
+ * filters/xz/blkcache.c.  Decompression itself happens outside the
+ * cache lock so parallel requests can decompress different clusters
+ * at the same time.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "minmax.h"
+#include "rounding.h"
+
+#define QCOW2_MAGIC UINT32_C (0x514649fb) /* "QFI\xfb" */
+
+/* Incompatible feature bits (version 3 only). */
+#define QCOW2_INCOMPAT_DIRTY        (UINT64_C (1) << 0)
+#define QCOW2_INCOMPAT_CORRUPT      (UINT64_C (1) << 1)
+#define QCOW2_INCOMPAT_DATA_FILE    (UINT64_C (1) << 2)
+#define QCOW2_INCOMPAT_COMPRESSION  (UINT64_C (1) << 3)
+#define QCOW2_INCOMPAT_EXTL2        (UINT64_C (1) << 4)
+#define QCOW2_INCOMPAT_KNOWN        (QCOW2_INCOMPAT_DIRTY |     \
+                                     QCOW2_INCOMPAT_CORRUPT |   \
+                                     QCOW2_INCOMPAT_DATA_FILE | \
+                                     QCOW2_INCOMPAT_COMPRESSION | \
+                                     QCOW2_INCOMPAT_EXTL2)
+
+/* L1 and L2 table entries. */
+#define L1E_OFFSET_MASK UINT64_C (0x00fffffffffffe00)
+#define L2E_OFFSET_MASK UINT64_C (0x00fffffffffffe00)
+#define L2E_COMPRESSED  (UINT64_C (1) << 62)
+#define L2E_ZERO        (UINT64_C (1) << 0)
+
+/* All fields are big-endian.  The layout is naturally aligned but be
+ * defensive about it anyway.
+ */
+struct qcow2_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t backing_file_offset;
+  uint32_t backing_file_size;
+  uint32_t cluster_bits;
+  uint64_t size;
+  uint32_t crypt_method;
+  uint32_t l1_size;
+  uint64_t l1_table_offset;
+  uint64_t refcount_table_offset;
+  uint32_t refcount_table_clusters;
+  uint32_t nb_snapshots;
+  uint64_t snapshots_offset;
+  /* Version 3 only. */
+  uint64_t incompatible_features;
+  uint64_t compatible_features;
+  uint64_t autoclear_features;
+  uint32_t refcount_order;
+  uint32_t header_length;
+} __attribute__ ((packed));
+
+static char *filename;
+static unsigned cluster_cache_depth = 64;
+
+/* The mapped file. */
+static char *map;
+static uint64_t map_size;
+
+/* Parsed metadata, constant after qcow2_get_ready. */
+static uint64_t virtual_size;
+static unsigned cluster_bits;
+static uint64_t cluster_size;
+static unsigned l2_bits;        /* log2 (entries per L2 table) */
+static uint32_t l1_entries;
+static const uint64_t *l1_table; /* points into the mapping, big-endian */
+
+/* LRU cache of decompressed clusters, keyed by the whole L2 entry
+ * (which encodes the compressed cluster's file offset and size, so it
+ * is unique per cluster).  Slot 0 is the most recently used.
+ */
+struct cached_cluster {
+  uint64_t l2_entry;
+  char *data;                   /* cluster_size bytes, or NULL if empty */
+};
+static struct cached_cluster *cache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t cache_hits, cache_misses;
+
+static void
+qcow2_unload (void)
+{
+  unsigned i;
+
+  if (cache != NULL) {
+    nbdkit_debug ("qcow2: cluster cache hits %" PRIu64 " misses %" PRIu64,
+                  cache_hits, cache_misses);
+    for (i = 0; i < cluster_cache_depth; ++i)
+      free (cache[i].data);
+    free (cache);
+  }
+  if (map != NULL)
+    munmap (map, map_size);
+  free (filename);
+}
+
+static int
+qcow2_config (const char *key, const char *value)
+{
+  if (strcmp (key, "file") == 0) {
+    free (filename);
+    filename = nbdkit_realpath (value);
+    if (filename == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "cluster-cache") == 0) {
+    if (nbdkit_parse_unsigned ("cluster-cache", value,
+                               &cluster_cache_depth) == -1)
+      return -1;
+  }
+  else {
+    nbdkit_error ("unknown parameter '%s'", key);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+qcow2_config_complete (void)
+{
+  if (filename == NULL) {
+    nbdkit_error ("you must supply the file=<FILENAME> parameter "
+                  "after the plugin name on the command line");
+    return -1;
+  }
+
+  return 0;
+}
+
+#define qcow2_config_help \
+  "file=<FILENAME>     (required) The qcow2 file to serve.\n" \
+  "cluster-cache=<N>   Number of decompressed clusters to cache (default 64)."
+
+/* Does the byte range lie entirely within the file? */
+static bool
+in_file (uint64_t offset, uint64_t len)
+{
+  return offset <= map_size && len <= map_size - offset;
+}
+
+static int
+qcow2_get_ready (void)
+{
+  int fd;
+  struct stat statbuf;
+  struct qcow2_header h;
+  uint32_t magic, version, header_length;
+  uint64_t l1_table_offset, l1_needed;
+
+  fd = open (filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", filename);
+    return -1;
+  }
+  if (fstat (fd, &statbuf) == -1) {
+    nbdkit_error ("fstat: %s: %m", filename);
+    close (fd);
+    return -1;
+  }
+  map_size = statbuf.st_size;
+  if (map_size < 72) {          /* smallest (version 2) header */
+    nbdkit_error ("%s: file too small to be a qcow2 file", filename);
+    close (fd);
+    return -1;
+  }
+  map = mmap (NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED) {
+    map = NULL;
+    nbdkit_error ("mmap: %s: %m", filename);
+    return -1;
+  }
+
+  memset (&h, 0, sizeof h);
+  memcpy (&h, map, MIN (map_size, sizeof h));
+
+  magic = be32toh (h.magic);
+  version = be32toh (h.version);
+  if (magic != QCOW2_MAGIC) {
+    nbdkit_error ("%s: not a qcow2 file (bad magic)", filename);
+    return -1;
+  }
+  if (version != 2 && version != 3) {
+    nbdkit_error ("%s: unsupported qcow2 version %" PRIu32,
+                  filename, version);
+    return -1;
+  }
+  if (be64toh (h.backing_file_offset) != 0) {
+    nbdkit_error ("%s: backing files are not supported", filename);
+    return -1;
+  }
+  if (be32toh (h.crypt_method) != 0) {
+    nbdkit_error ("%s: encrypted images are not supported", filename);
+    return -1;
+  }
+
+  cluster_bits = be32toh (h.cluster_bits);
+  if (cluster_bits < 9 || cluster_bits > 21) {
+    nbdkit_error ("%s: invalid cluster_bits %u", filename, cluster_bits);
+    return -1;
+  }
+  cluster_size = UINT64_C (1) << cluster_bits;
+  l2_bits = cluster_bits - 3;
+  virtual_size = be64toh (h.size);
+
+  if (version == 3) {
+    uint64_t incompat = be64toh (h.incompatible_features);
+
+    header_length = be32toh (h.header_length);
+    if (map_size < sizeof h || header_length < sizeof h) {
+      nbdkit_error ("%s: truncated version 3 header", filename);
+      return -1;
+    }
+    if (incompat & QCOW2_INCOMPAT_CORRUPT) {
+      nbdkit_error ("%s: image is marked corrupt, "
+                    "run 'qemu-img check -r' on it first", filename);
+      return -1;
+    }
+    if (incompat & QCOW2_INCOMPAT_DATA_FILE) {
+      nbdkit_error ("%s: external data files are not supported", filename);
+      return -1;
+    }
+    if (incompat & QCOW2_INCOMPAT_EXTL2) {
+      nbdkit_error ("%s: extended L2 entries are not supported", filename);
+      return -1;
+    }
+    if (incompat & ~QCOW2_INCOMPAT_KNOWN) {
+      nbdkit_error ("%s: unknown incompatible features %#" PRIx64,
+                    filename, incompat & ~QCOW2_INCOMPAT_KNOWN);
+      return -1;
+    }
+    if (incompat & QCOW2_INCOMPAT_COMPRESSION) {
+      /* The compression type byte follows the fixed header. */
+      if (header_length < sizeof h + 1 || !in_file (sizeof h, 1) ||
+          map[sizeof h] != 0) {
+        nbdkit_error ("%s: only deflate compression is supported", filename);
+        return -1;
+      }
+    }
+    /* The dirty bit only means the refcounts may be stale, which is
+     * harmless since we never read them.
+     */
+    if (incompat & QCOW2_INCOMPAT_DIRTY)
+      nbdkit_debug ("qcow2: %s: image is dirty (ignored for read-only "
+                    "access)", filename);
+  }
+
+  l1_entries = be32toh (h.l1_size);
+  l1_table_offset = be64toh (h.l1_table_offset);
+  if ((l1_table_offset & 511) != 0 ||
+      !in_file (l1_table_offset, (uint64_t) l1_entries * 8)) {
+    nbdkit_error ("%s: L1 table out of file bounds", filename);
+    return -1;
+  }
+  l1_table = (const uint64_t *) (map + l1_table_offset);
+
+  l1_needed = DIV_ROUND_UP (virtual_size, cluster_size << l2_bits);
+  if (l1_entries < l1_needed) {
+    nbdkit_error ("%s: L1 table too small for the virtual size", filename);
+    return -1;
+  }
+
+  if (cluster_cache_depth > 0) {
+    cache = calloc (cluster_cache_depth, sizeof (struct cached_cluster));
+    if (cache == NULL) {
+      nbdkit_error ("calloc: %m");
+      return -1;
+    }
+  }
+
+  nbdkit_debug ("qcow2: %s: version %" PRIu32 ", virtual size %" PRIu64
+                ", cluster size %" PRIu64 ", %" PRIu32 " L1 entries",
+                filename, version, virtual_size, cluster_size, l1_entries);
+  return 0;
+}
+
+/* The mapping and metadata are immutable after get_ready, and the
+ * cluster cache takes its own lock.
+ */
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+static void *
+qcow2_open (int readonly)
+{
+  return NBDKIT_HANDLE_NOT_NEEDED;
+}
+
+static int64_t
+qcow2_get_size (void *handle)
+{
+  return virtual_size;
+}
+
+/* Multi-conn is safe because the image is read-only. */
+static int
+qcow2_can_multi_conn (void *handle)
+{
+  return 1;
+}
+
+/* Look up the L2 entry covering the virtual offset.  Returns -1 on
+ * error; *entry_rtn == 0 means the cluster is unallocated.
+ */
+static int
+lookup_l2_entry (uint64_t offset, uint64_t *entry_rtn)
+{
+  uint64_t l1_index = offset >> (cluster_bits + l2_bits);
+  uint64_t l1_entry, l2_offset, l2_index, entry;
+
+  *entry_rtn = 0;
+  if (l1_index >= l1_entries)
+    return 0;
+  l1_entry = be64toh (l1_table[l1_index]);
+  l2_offset = l1_entry & L1E_OFFSET_MASK;
+  if (l2_offset == 0)
+    return 0;
+  if (!in_file (l2_offset, cluster_size)) {
+    nbdkit_error ("%s: L2 table out of file bounds", filename);
+    return -1;
+  }
+  l2_index = (offset >> cluster_bits) & ((UINT64_C (1) << l2_bits) - 1);
+  memcpy (&entry, map + l2_offset + 8 * l2_index, 8);
+  *entry_rtn = be64toh (entry);
+  return 0;
+}
+
+/* Decompress a compressed cluster into out (cluster_size bytes).
+ * Compressed clusters are raw deflate data; the stream may run past
+ * the end of the logical data, so like qemu we stop when the output
+ * buffer is full.
+ */
+static int
+decompress_cluster (uint64_t l2_entry, char *out)
+{
+  const unsigned csize_shift = 62 - (cluster_bits - 8);
+  const uint64_t coffset = l2_entry & ((UINT64_C (1) << csize_shift) - 1);
+  const uint64_t nb_csectors =
+    ((l2_entry >> csize_shift) & ((1 << (cluster_bits - 8)) - 1)) + 1;
+  const uint64_t csize = (nb_csectors << 9) - (coffset & 511);
+  z_stream strm;
+  int zerr;
+
+  if (!in_file (coffset, csize)) {
+    nbdkit_error ("%s: compressed cluster out of file bounds", filename);
+    return -1;
+  }
+
+  memset (&strm, 0, sizeof strm);
+  strm.next_in = (unsigned char *) map + coffset;
+  strm.avail_in = csize;
+  strm.next_out = (unsigned char *) out;
+  strm.avail_out = cluster_size;
+  zerr = inflateInit2 (&strm, -MAX_WBITS);
+  if (zerr != Z_OK) {
+    nbdkit_error ("inflateInit2: %s", strm.msg ? : zError (zerr));
+    return -1;
+  }
+  zerr = inflate (&strm, Z_FINISH);
+  if ((zerr != Z_STREAM_END && zerr != Z_BUF_ERROR) || strm.avail_out != 0) {
+    nbdkit_error ("%s: error decompressing cluster: %s",
+                  filename, strm.msg ? : zError (zerr));
+    inflateEnd (&strm);
+    return -1;
+  }
+  inflateEnd (&strm);
+  return 0;
+}
+
+/* If the decompressed cluster is cached, copy out the requested part
+ * and return true.  The hit becomes the most recently used entry.
+ */
+static bool
+cache_get (uint64_t l2_entry, uint64_t co, uint32_t n, char *buf)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache_lock);
+  unsigned i;
+  struct cached_cluster tmp;
+
+  for (i = 0; i < cluster_cache_depth; ++i) {
+    if (cache[i].data != NULL && cache[i].l2_entry == l2_entry) {
+      if (i > 0) {
+        tmp = cache[0];
+        cache[0] = cache[i];
+        cache[i] = tmp;
+      }
+      cache_hits++;
+      memcpy (buf, cache[0].data + co, n);
+      return true;
+    }
+  }
+
+  cache_misses++;
+  return false;
+}
+
+/* Insert a freshly decompressed cluster, taking ownership of data.
+ * The least recently used entry is evicted.
+ */
+static void
+cache_put (uint64_t l2_entry, char *data)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cache_lock);
+  unsigned i;
+
+  /* Another thread may have decompressed the same cluster meanwhile. */
+  for (i = 0; i < cluster_cache_depth; ++i) {
+    if (cache[i].data != NULL && cache[i].l2_entry == l2_entry) {
+      free (data);
+      return;
+    }
+  }
+
+  free (cache[cluster_cache_depth-1].data);
+  for (i = cluster_cache_depth-1; i >= 1; --i)
+    cache[i] = cache[i-1];
+  cache[0].l2_entry = l2_entry;
+  cache[0].data = data;
+}
+
+/* Read part of a compressed cluster. */
+static int
+read_compressed (uint64_t l2_entry, uint64_t co, uint32_t n, char *buf)
+{
+  char *data;
+
+  if (cache != NULL && cache_get (l2_entry, co, n, buf))
+    return 0;
+
+  data = malloc (cluster_size);
+  if (data == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  if (decompress_cluster (l2_entry, data) == -1) {
+    free (data);
+    return -1;
+  }
+  memcpy (buf, data + co, n);
+  if (cache != NULL)
+    cache_put (l2_entry, data);
+  else
+    free (data);
+  return 0;
+}
+
+static int
+qcow2_pread (void *handle, void *bufv, uint32_t count, uint64_t offset,
+             uint32_t flags)
+{
+  char *buf = bufv;
+
+  while (count > 0) {
+    const uint64_t co = offset & (cluster_size - 1);
+    const uint32_t n = MIN (count, cluster_size - co);
+    uint64_t entry;
+
+    if (lookup_l2_entry (offset, &entry) == -1)
+      return -1;
+
+    if (entry & L2E_COMPRESSED) {
+      if (read_compressed (entry, co, n, buf) == -1)
+        return -1;
+    }
+    else if ((entry & L2E_OFFSET_MASK) == 0 || (entry & L2E_ZERO))
+      memset (buf, 0, n);
+    else {
+      const uint64_t host_offset = (entry & L2E_OFFSET_MASK) + co;
+
+      if (!in_file (host_offset, n)) {
+        nbdkit_error ("%s: cluster out of file bounds", filename);
+        return -1;
+      }
+      memcpy (buf, map + host_offset, n);
+    }
+
+    buf += n;
+    offset += n;
+    count -= n;
+  }
+
+  return 0;
+}
+
+/* Extents come straight from the allocation metadata: unallocated and
+ * zero clusters are sparse holes, everything else is data.
+ */
+static int
+qcow2_extents (void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+               struct nbdkit_extents *extents)
+{
+  while (count > 0) {
+    const uint64_t co = offset & (cluster_size - 1);
+    const uint32_t n = MIN (count, cluster_size - co);
+    uint64_t entry;
+    uint32_t type = 0;
+
+    if (lookup_l2_entry (offset, &entry) == -1)
+      return -1;
+
+    if (!(entry & L2E_COMPRESSED) &&
+        ((entry & L2E_OFFSET_MASK) == 0 || (entry & L2E_ZERO)))
+      type = NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO;
+    if (nbdkit_add_extent (extents, offset, n, type) == -1)
+      return -1;
+
+    offset += n;
+    count -= n;
+  }
+
+  return 0;
+}
+
+static struct nbdkit_plugin plugin = {
+  .name              = "qcow2",
+  .longname          = "nbdkit qcow2 plugin",
+  .version           = PACKAGE_VERSION,
+  .unload            = qcow2_unload,
+  .config            = qcow2_config,
+  .config_complete   = qcow2_config_complete,
+  .config_help       = qcow2_config_help,
+  .magic_config_key  = "file",
+  .get_ready         = qcow2_get_ready,
+  .open              = qcow2_open,
+  .get_size          = qcow2_get_size,
+  .can_multi_conn    = qcow2_can_multi_conn,
+  .pread             = qcow2_pread,
+  .extents           = qcow2_extents,
+};
+
+NBDKIT_REGISTER_PLUGIN (plugin)
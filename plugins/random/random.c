@@ -43,6 +43,7 @@
 #define NBDKIT_API_VERSION 2
 #include <nbdkit-plugin.h>
 
+#include "byte-swapping.h"
 #include "cleanup.h"
 #include "random.h"
 
@@ -122,36 +123,18 @@ random_can_cache (void *handle)
   return NBDKIT_CACHE_NATIVE;
 }
 
+/* The disk is generated in counter mode by random_fill in
+ * common/include/random.h: any byte can be read without running the
+ * PRNG from the start, so parallel reads of disjoint ranges scale
+ * across cores, and the fill is vectorized.
+ */
+
 /* Read data. */
 static int
 random_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
               uint32_t flags)
 {
-  uint32_t i;
-  unsigned char *b = buf;
-  uint64_t s;
-
-  for (i = 0; i < count; ++i) {
-    /* We use nbdkit common/include/random.h to make random numbers.
-     *
-     * However we're not quite using it in the ordinary way.  In order
-     * to be able to read any byte of data without needing to run the
-     * PRNG from the start, the random data is computed from the index
-     * and seed through three rounds of PRNG:
-     *
-     * index i     PRNG(seed+i)   -> PRNG -> PRNG -> mod 256 -> b[i]
-     * index i+1   PRNG(seed+i+1) -> PRNG -> PRNG -> mod 256 -> b[i+1]
-     * etc
-     */
-    struct random_state state;
-
-    xsrandom (seed + offset + i, &state);
-    xrandom (&state);
-    xrandom (&state);
-    s = xrandom (&state);
-    s &= 255;
-    b[i] = s;
-  }
+  random_fill (seed, offset, buf, count);
   return 0;
 }
 
@@ -36,12 +36,14 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
 #include <poll.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -141,6 +143,17 @@ debug_call (const char **argv)
   nbdkit_debug ("%s", debug);
 }
 
+/* Script which is known to exit with code 2 for every method (see
+ * call_register_missing in call.h), or NULL.
+ */
+static const char *missing_script;
+
+void
+call_register_missing (const char *script)
+{
+  missing_script = script;
+}
+
 /* This is the generic function that calls the script.  It can
  * optionally write to the script's stdin and read from the script's
  * stdout and stderr.  It returns the raw error code and does no error
@@ -371,6 +384,354 @@ call3 (const char *wbuf, size_t wbuflen, /* sent to stdin */
   return ret;
 }
 
+/* Persistent coprocesses.
+ *
+ * Forking the script (above) costs around a millisecond per request,
+ * which caps the request rate no matter how fast the script itself
+ * is.  To avoid this a script may opt in to being started once per
+ * connection: when a client connects we run
+ *
+ *   /path/to/script coprocess
+ *
+ * and if the script prints "READY\n" on stdout then for the rest of
+ * the connection requests are exchanged over the coprocess's
+ * stdin/stdout using a simple length-prefixed protocol:
+ *
+ *   request: "WLEN METHOD [ARGS...]\n" followed by exactly WLEN bytes
+ *     of raw data (the data that the fork path would have written to
+ *     the method's stdin, eg. for pwrite).  The arguments are the
+ *     same as the fork path would have passed on the command line,
+ *     shell-quoted so that an unusual handle string cannot corrupt
+ *     the framing (most arguments are numbers or simple strings and
+ *     appear unquoted; scripts can recover the exact parameters with
+ *     eval set -- "$args")
+ *
+ *   reply: "STATUS LEN\n" followed by exactly LEN bytes of raw data
+ *
+ * STATUS is the same code that the method would have exited with on
+ * the fork path (0 = success, 3 = false).  On success the data is
+ * what the method would have printed on stdout.  Replying with
+ * status 2 means the coprocess does not handle this method over the
+ * pipe: the request is retried on the fork path, so the coprocess
+ * loop only needs to implement the hot methods.  For any other
+ * status the data is the error message that the method would have
+ * printed on stderr, including the optional errno name prefix.
+ *
+ * Scripts which do not implement the coprocess method exit with code
+ * 2 without printing the READY handshake, in which case we continue
+ * to fork per request, so this is fully backwards compatible.  The
+ * same applies if the coprocess exits or breaks the protocol
+ * mid-connection: the request in flight fails and later requests go
+ * back to the fork path.
+ */
+struct coprocess {
+  pid_t pid;
+  int wfd;                      /* Writes requests to script's stdin. */
+  FILE *rfp;                    /* Reads replies from script's stdout. */
+  bool dead;                    /* Protocol error or coprocess exited. */
+  pthread_mutex_t lock;         /* Serializes requests on the pipe. */
+};
+
+struct coprocess *
+coprocess_start (const char *script)
+{
+  const char *argv[] = { script, "coprocess", NULL };
+  struct coprocess *co = NULL;
+  int in_fd[2] = { -1, -1 };
+  int out_fd[2] = { -1, -1 };
+  pid_t pid = -1;
+  char line[16];
+
+  /* A script known to be missing cannot opt in, don't fork it. */
+  if (missing_script != NULL && script == missing_script)
+    return NULL;
+
+  debug_call (argv);
+
+#ifdef HAVE_PIPE2
+  if (pipe2 (in_fd, O_CLOEXEC) == -1) {
+    nbdkit_error ("%s: pipe2: %m", script);
+    goto error;
+  }
+  if (pipe2 (out_fd, O_CLOEXEC) == -1) {
+    nbdkit_error ("%s: pipe2: %m", script);
+    goto error;
+  }
+#else
+  /* Safe for the same reason as in call3 above. */
+  if (pipe (in_fd) == -1) {
+    nbdkit_error ("%s: pipe: %m", script);
+    goto error;
+  }
+  if (pipe (out_fd) == -1) {
+    nbdkit_error ("%s: pipe: %m", script);
+    goto error;
+  }
+#endif
+
+  assert (in_fd[0] > STDERR_FILENO && in_fd[1] > STDERR_FILENO &&
+          out_fd[0] > STDERR_FILENO && out_fd[1] > STDERR_FILENO);
+
+  pid = fork ();
+  if (pid == -1) {
+    nbdkit_error ("%s: fork: %m", script);
+    goto error;
+  }
+
+  if (pid == 0) {               /* Child. */
+    close (in_fd[1]);
+    close (out_fd[0]);
+    dup2 (in_fd[0], 0);
+    dup2 (out_fd[1], 1);
+    close (in_fd[0]);
+    close (out_fd[1]);
+
+    /* stderr is inherited from the server, so anything the coprocess
+     * prints there ends up in the server log.  Per-request error
+     * messages are returned in band instead.
+     */
+
+    signal (SIGPIPE, SIG_DFL);
+
+    environ = env;
+    execvp (argv[0], (char **) argv);
+    perror (argv[0]);
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Parent. */
+  close (in_fd[0]);  in_fd[0] = -1;
+  close (out_fd[1]); out_fd[1] = -1;
+
+  co = malloc (sizeof *co);
+  if (co == NULL) {
+    nbdkit_error ("%s: malloc: %m", script);
+    goto error;
+  }
+  co->pid = pid;
+  co->wfd = in_fd[1];
+  co->rfp = fdopen (out_fd[0], "r");
+  if (co->rfp == NULL) {
+    nbdkit_error ("%s: fdopen: %m", script);
+    goto error;
+  }
+  co->dead = false;
+  pthread_mutex_init (&co->lock, NULL);
+
+  /* Wait for the handshake.  A script which does not implement the
+   * method exits (with code 2) without printing anything.
+   */
+  if (fgets (line, sizeof line, co->rfp) == NULL ||
+      strcmp (line, "READY\n") != 0) {
+    nbdkit_debug ("%s: script does not support coprocess mode, "
+                  "will fork per request", script);
+    coprocess_stop (co);
+    return NULL;
+  }
+
+  nbdkit_debug ("%s: started coprocess (pid %d)", script, (int) pid);
+  return co;
+
+ error:
+  if (in_fd[0] >= 0)
+    close (in_fd[0]);
+  if (in_fd[1] >= 0)
+    close (in_fd[1]);
+  if (out_fd[0] >= 0)
+    close (out_fd[0]);
+  if (out_fd[1] >= 0)
+    close (out_fd[1]);
+  if (pid >= 0)
+    waitpid (pid, NULL, 0);
+  free (co);
+  return NULL;
+}
+
+void
+coprocess_stop (struct coprocess *co)
+{
+  if (co == NULL)
+    return;
+
+  /* Closing stdin makes a well-behaved coprocess exit. */
+  close (co->wfd);
+  fclose (co->rfp);
+  waitpid (co->pid, NULL, 0);
+  pthread_mutex_destroy (&co->lock);
+  free (co);
+}
+
+/* Requests are serialized onto a single line, so we cannot use the
+ * coprocess if any parameter contains a newline (in practice only
+ * possible for the handle returned by the open method).  Such
+ * requests, and everything after a coprocess failure, fall back to
+ * the fork path.
+ */
+static bool
+coprocess_usable (struct coprocess *co, const char **argv)
+{
+  size_t i;
+
+  if (co == NULL || co->dead)
+    return false;
+  for (i = 1; argv[i] != NULL; ++i) {
+    if (strchr (argv[i], '\n') != NULL)
+      return false;
+  }
+  return true;
+}
+
+/* Counterpart of call3 above, exchanging the request over the
+ * coprocess pipe.  Same contract: returns the raw status code and
+ * does no error processing.  On success *rbuf is what the method
+ * printed on stdout, on error *ebuf is what it would have printed on
+ * stderr.
+ */
+static int
+coprocess_call (struct coprocess *co,
+                const char *wbuf, size_t wbuflen, /* request data */
+                char **rbuf, size_t *rbuflen,     /* success reply data */
+                char **ebuf, size_t *ebuflen,     /* error reply data */
+                const char **argv)                /* script + parameters */
+{
+  const char *argv0 = argv[0]; /* script name, used in error messages */
+  CLEANUP_FREE char *req = NULL;
+  size_t reqlen = 0, len, i;
+  FILE *fp;
+  char line[64];
+  char *data;
+  int status;
+  ssize_t r;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&co->lock);
+
+  *rbuf = *ebuf = NULL;
+  *rbuflen = *ebuflen = 0;
+
+  debug_call (argv);
+
+  /* Serialize the request. */
+  fp = open_memstream (&req, &reqlen);
+  if (fp == NULL) {
+    nbdkit_error ("%s: open_memstream: %m", argv0);
+    return ERROR;
+  }
+  fprintf (fp, "%zu", wbuflen);
+  for (i = 1; argv[i] != NULL; ++i) {
+    fputc (' ', fp);
+    shell_quote (argv[i], fp);
+  }
+  fputc ('\n', fp);
+  if (wbuflen > 0)
+    fwrite (wbuf, 1, wbuflen, fp);
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("%s: fclose: %m", argv0);
+    return ERROR;
+  }
+
+  for (len = 0; len < reqlen; len += r) {
+    r = write (co->wfd, req + len, reqlen - len);
+    if (r == -1) {
+      if (errno == EINTR)
+        r = 0;
+      else {
+        nbdkit_error ("%s: error writing to coprocess: %m", argv0);
+        goto dead;
+      }
+    }
+  }
+
+  /* Read the reply status line. */
+  if (fgets (line, sizeof line, co->rfp) == NULL) {
+    nbdkit_error ("%s: unexpected end of input from coprocess", argv0);
+    goto dead;
+  }
+  if (sscanf (line, "%d %zu", &status, &len) != 2 ||
+      status < 0 || status > 255) {
+    nbdkit_error ("%s: cannot parse reply from coprocess: %s", argv0, line);
+    goto dead;
+  }
+
+  data = malloc (len + 1);
+  if (data == NULL) {
+    nbdkit_error ("%s: malloc: %m", argv0);
+    goto dead;
+  }
+  if (len > 0 && fread (data, 1, len, co->rfp) != len) {
+    nbdkit_error ("%s: unexpected end of input from coprocess", argv0);
+    free (data);
+    goto dead;
+  }
+  data[len] = '\0';             /* \0-terminate (for convenience) */
+
+  if (status == OK || status == MISSING || status == RET_FALSE) {
+    *rbuf = data;
+    *rbuflen = len;
+  }
+  else {
+    *ebuf = data;
+    *ebuflen = len;
+  }
+
+  nbdkit_debug ("completed: %s %s: status %d", argv0, argv[1], status);
+  return status;
+
+ dead:
+  /* The state of the pipe is unknown so stop using the coprocess.
+   * Later requests on this connection go back to the fork path.
+   */
+  co->dead = true;
+  return ERROR;
+}
+
+/* Dispatch a request either to the coprocess (if usable) or to the
+ * fork path.
+ */
+static int
+call4 (struct coprocess *co,
+       const char *wbuf, size_t wbuflen,
+       char **rbuf, size_t *rbuflen,
+       char **ebuf, size_t *ebuflen,
+       const char **argv)
+{
+  if (coprocess_usable (co, argv)) {
+    int r = coprocess_call (co, wbuf, wbuflen,
+                            rbuf, rbuflen, ebuf, ebuflen, argv);
+    if (r != MISSING)
+      return r;
+    /* The coprocess declined this method, so use the fork path.
+     * This means the coprocess loop only has to handle the hot
+     * methods, everything else keeps its fork semantics.
+     */
+    free (*rbuf);
+    free (*ebuf);
+  }
+
+  /* If we know up front that the method is missing then we can
+   * answer without forking anything.  Compare by pointer, not by
+   * content: if the user overrides the missing script then the
+   * registration is removed.  This must only be checked after the
+   * coprocess, which may implement methods which have no script.
+   */
+  if (missing_script != NULL && argv[0] == missing_script) {
+    debug_call (argv);
+    *rbuf = calloc (1, 1);
+    *ebuf = calloc (1, 1);
+    *rbuflen = *ebuflen = 0;
+    if (*rbuf == NULL || *ebuf == NULL) {
+      nbdkit_error ("calloc: %m");
+      free (*rbuf);
+      free (*ebuf);
+      *rbuf = *ebuf = NULL;
+      return ERROR;
+    }
+    nbdkit_debug ("completed: %s %s: status %d (without forking)",
+                  argv[0], argv[1], MISSING);
+    return MISSING;
+  }
+
+  return call3 (wbuf, wbuflen, rbuf, rbuflen, ebuf, ebuflen, argv);
+}
+
 static void
 handle_script_error (const char *argv0, char *ebuf, size_t len)
 {
@@ -484,7 +845,7 @@ handle_script_error (const char *argv0, char *ebuf, size_t len)
  * code from the script.
  */
 exit_code
-call (const char **argv)
+call_co (struct coprocess *co, const char **argv)
 {
   int r;
   CLEANUP_FREE char *rbuf = NULL;
@@ -492,7 +853,7 @@ call (const char **argv)
   CLEANUP_FREE char *ebuf = NULL;
   size_t ebuflen;
 
-  r = call3 (NULL, 0, &rbuf, &rbuflen, &ebuf, &ebuflen, argv);
+  r = call4 (co, NULL, 0, &rbuf, &rbuflen, &ebuf, &ebuflen, argv);
   switch (r) {
   case OK:
   case MISSING:
@@ -508,17 +869,24 @@ call (const char **argv)
   }
 }
 
+exit_code
+call (const char **argv)
+{
+  return call_co (NULL, argv);
+}
+
 /* Call the script with parameters.  Read from stdout and return the
  * buffer.  Returns the exit code from the script.
  */
 exit_code
-call_read (char **rbuf, size_t *rbuflen, const char **argv)
+call_read_co (struct coprocess *co,
+              char **rbuf, size_t *rbuflen, const char **argv)
 {
   int r;
   CLEANUP_FREE char *ebuf = NULL;
   size_t ebuflen;
 
-  r = call3 (NULL, 0, rbuf, rbuflen, &ebuf, &ebuflen, argv);
+  r = call4 (co, NULL, 0, rbuf, rbuflen, &ebuf, &ebuflen, argv);
   switch (r) {
   case OK:
   case MISSING:
@@ -536,11 +904,18 @@ call_read (char **rbuf, size_t *rbuflen, const char **argv)
   }
 }
 
+exit_code
+call_read (char **rbuf, size_t *rbuflen, const char **argv)
+{
+  return call_read_co (NULL, rbuf, rbuflen, argv);
+}
+
 /* Call the script with parameters.  Write to stdin of the script.
  * Returns the exit code from the script.
  */
 exit_code
-call_write (const char *wbuf, size_t wbuflen, const char **argv)
+call_write_co (struct coprocess *co,
+               const char *wbuf, size_t wbuflen, const char **argv)
 {
   int r;
   CLEANUP_FREE char *rbuf = NULL;
@@ -548,7 +923,7 @@ call_write (const char *wbuf, size_t wbuflen, const char **argv)
   CLEANUP_FREE char *ebuf = NULL;
   size_t ebuflen;
 
-  r = call3 (wbuf, wbuflen, &rbuf, &rbuflen, &ebuf, &ebuflen, argv);
+  r = call4 (co, wbuf, wbuflen, &rbuf, &rbuflen, &ebuf, &ebuflen, argv);
   switch (r) {
   case OK:
   case MISSING:
@@ -563,3 +938,9 @@ call_write (const char *wbuf, size_t wbuflen, const char **argv)
     return ERROR;
   }
 }
+
+exit_code
+call_write (const char *wbuf, size_t wbuflen, const char **argv)
+{
+  return call_write_co (NULL, wbuf, wbuflen, argv);
+}
@@ -52,6 +52,13 @@ typedef enum exit_code {
   RET_FALSE = 3        /* script exited with code 3 meaning false */
 } exit_code;
 
+/* The eval plugin registers its generated "missing" script here so
+ * that calls to absent methods can be answered without forking.
+ * Matching is by pointer identity.  Pass NULL to unregister (eg. if
+ * the user overrides the missing script with real content).
+ */
+extern void call_register_missing (const char *script);
+
 extern exit_code call (const char **argv)
   __attribute__((__nonnull__ (1)));
 extern exit_code call_read (char **rbuf, size_t *rbuflen, const char **argv)
@@ -60,4 +67,32 @@ extern exit_code call_write (const char *wbuf, size_t wbuflen,
                              const char **argv)
   __attribute__((__nonnull__ (1, 3)));
 
+/* Persistent coprocess, started once per connection for scripts which
+ * implement the coprocess method, avoiding a fork per request.  See
+ * the long comment in call.c for the protocol.
+ */
+struct coprocess;
+
+/* Start a coprocess for the script.  Returns NULL (which is not an
+ * error) if the script does not implement the coprocess method.
+ */
+extern struct coprocess *coprocess_start (const char *script)
+  __attribute__((__nonnull__ (1)));
+extern void coprocess_stop (struct coprocess *co);
+
+/* Same as call/call_read/call_write above, but if co is non-NULL and
+ * still running the request is sent over the coprocess pipe instead
+ * of forking the script.
+ */
+extern exit_code call_co (struct coprocess *co, const char **argv)
+  __attribute__((__nonnull__ (2)));
+extern exit_code call_read_co (struct coprocess *co,
+                               char **rbuf, size_t *rbuflen,
+                               const char **argv)
+  __attribute__((__nonnull__ (2, 3, 4)));
+extern exit_code call_write_co (struct coprocess *co,
+                                const char *wbuf, size_t wbuflen,
+                                const char **argv)
+  __attribute__((__nonnull__ (2, 4)));
+
 #endif /* NBDKIT_CALL_H */
@@ -222,6 +222,11 @@ struct sh_handle {
   char *h;
   int can_flush;
   int can_zero;
+
+  /* Coprocess serving this connection, or NULL if the script does
+   * not implement the coprocess method and we fork per request.
+   */
+  struct coprocess *co;
 };
 
 /* If @s begins with @prefix, return the next offset, else NULL */
@@ -392,6 +397,7 @@ sh_open (int readonly)
   }
   h->can_flush = -1;
   h->can_zero = -1;
+  h->co = NULL;
 
   /* We store the string returned by open in the handle. */
   switch (call_read (&h->h, &hlen, args)) {
@@ -403,6 +409,11 @@ sh_open (int readonly)
     }
     if (hlen > 0)
       nbdkit_debug ("sh: handle: %s", h->h);
+    /* If the script implements the coprocess method, start a
+     * persistent coprocess for this connection.  If not this returns
+     * NULL and we continue to fork the script per request.
+     */
+    h->co = coprocess_start (get_script ("coprocess"));
     return h;
 
   case MISSING:
@@ -417,6 +428,7 @@ sh_open (int readonly)
       free (h);
       return NULL;
     }
+    h->co = coprocess_start (get_script ("coprocess"));
     return h;
 
   case ERROR:
@@ -444,11 +456,12 @@ sh_close (void *handle)
   struct sh_handle *h = handle;
   const char *args[] = { script, method, h->h, NULL };
 
-  switch (call (args)) {
+  switch (call_co (h->co, args)) {
   case OK:
   case MISSING:
   case ERROR:
   case RET_FALSE:
+    coprocess_stop (h->co);
     free (h->h);
     free (h);
     return;
@@ -466,7 +479,7 @@ sh_export_description (void *handle)
   CLEANUP_FREE char *s = NULL;
   size_t slen;
 
-  switch (call_read (&s, &slen, args)) {
+  switch (call_read_co (h->co, &s, &slen, args)) {
   case OK:
     if (slen > 0 && s[slen-1] == '\n')
       s[slen-1] = '\0';
@@ -499,7 +512,7 @@ sh_get_size (void *handle)
   size_t slen;
   int64_t r;
 
-  switch (call_read (&s, &slen, args)) {
+  switch (call_read_co (h->co, &s, &slen, args)) {
   case OK:
     if (slen > 0 && s[slen-1] == '\n')
       s[slen-1] = '\0';
@@ -541,7 +554,7 @@ sh_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   snprintf (cbuf, sizeof cbuf, "%" PRIu32, count);
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
 
-  switch (call_read (&data, &len, args)) {
+  switch (call_read_co (h->co, &data, &len, args)) {
   case OK:
     if (count != len) {
       nbdkit_error ("%s: incorrect amount of data read: "
@@ -628,7 +641,7 @@ sh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
   flags_string (flags, fbuf, sizeof fbuf);
 
-  switch (call_write (buf, count, args)) {
+  switch (call_write_co (h->co, buf, count, args)) {
   case OK:
     return 0;
 
@@ -657,7 +670,7 @@ boolean_method (const char *script, const char *method,
   struct sh_handle *h = handle;
   const char *args[] = { script, method, h->h, NULL };
 
-  switch (call (args)) {
+  switch (call_co (h->co, args)) {
   case OK:                      /* true */
     return 1;
   case RET_FALSE:               /* false */
@@ -750,7 +763,7 @@ sh_can_fua (void *handle)
   size_t slen;
   int r;
 
-  switch (call_read (&s, &slen, args)) {
+  switch (call_read_co (h->co, &s, &slen, args)) {
   case OK:
     if (slen > 0 && s[slen-1] == '\n')
       s[slen-1] = '\0';
@@ -805,7 +818,7 @@ sh_can_cache (void *handle)
   size_t slen;
   int r;
 
-  switch (call_read (&s, &slen, args)) {
+  switch (call_read_co (h->co, &s, &slen, args)) {
   case OK:
     if (slen > 0 && s[slen-1] == '\n')
       s[slen-1] = '\0';
@@ -867,7 +880,7 @@ sh_flush (void *handle, uint32_t flags)
   struct sh_handle *h = handle;
   const char *args[] = { script, method, h->h, NULL };
 
-  switch (call (args)) {
+  switch (call_co (h->co, args)) {
   case OK:
     return 0;
 
@@ -901,7 +914,7 @@ sh_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
   flags_string (flags, fbuf, sizeof fbuf);
 
-  switch (call (args)) {
+  switch (call_co (h->co, args)) {
   case OK:
     return 0;
 
@@ -935,7 +948,7 @@ sh_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
   flags_string (flags, fbuf, sizeof fbuf);
 
-  switch (call (args)) {
+  switch (call_co (h->co, args)) {
   case OK:
     return 0;
 
@@ -1043,7 +1056,7 @@ sh_extents (void *handle, uint32_t count, uint64_t offset, uint32_t flags,
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
   flags_string (flags, fbuf, sizeof fbuf);
 
-  switch (call_read (&s, &slen, args)) {
+  switch (call_read_co (h->co, &s, &slen, args)) {
   case OK:
     r = parse_extents (script, s, slen, extents);
     return r;
@@ -1085,7 +1098,7 @@ sh_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
   assert (!flags);
 
-  switch (call (args)) {
+  switch (call_co (h->co, args)) {
   case OK:
     return 0;
 
@@ -276,20 +276,12 @@ read_block (uint64_t blknum, uint64_t offset, void *buf)
 
   if (bitmap_get_blk (&bm, blknum, 0) == 0) /* hole */
     memset (buf, 0, BLOCKSIZE);
-  else {                        /* data */
-    uint32_t i;
-    struct random_state state;
-
-    /* This produces repeatable data for the same offset.  Note it
-     * works because we are called on whole blocks only.
+  else
+    /* Counter mode produces repeatable data for the same seed and
+     * offset, and generates 8 bytes per PRNG step (vectorized)
+     * instead of one.
      */
-    xsrandom (seed + offset, &state);
-    for (i = 0; i < BLOCKSIZE; ++i) {
-      uint64_t s = xrandom (&state);
-      s &= 255;
-      b[i] = s;
-    }
-  }
+    random_fill (seed, offset, b, BLOCKSIZE);
 }
 
 /* Read data. */
@@ -311,11 +303,14 @@ sparse_random_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   blknum = offset / BLOCKSIZE;  /* block number */
   blkoffs = offset % BLOCKSIZE; /* offset within the block */
 
-  /* Unaligned head */
+  /* Unaligned head.  Note read_block must be given the offset of the
+   * start of the block, otherwise it would generate different data
+   * than an aligned read of the same block.
+   */
   if (blkoffs) {
     uint64_t n = MIN (BLOCKSIZE - blkoffs, count);
 
-    read_block (blknum, offset, block);
+    read_block (blknum, offset - blkoffs, block);
     memcpy (buf, &block[blkoffs], n);
 
     buf += n;
@@ -326,12 +321,30 @@ sparse_random_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
 
   /* Aligned body */
   while (count >= BLOCKSIZE) {
-    read_block (blknum, offset, buf);
+    if (bitmap_get_blk (&bm, blknum, 0) == 0) {
+      /* Hole: zero the whole run of hole blocks in one go instead of
+       * consulting the bitmap block by block.
+       */
+      int64_t next = bitmap_next (&bm, blknum);
+      uint64_t n = count - (count % BLOCKSIZE);
+
+      if (next >= 0 && (next - blknum) * BLOCKSIZE < n)
+        n = (next - blknum) * BLOCKSIZE;
+      memset (buf, 0, n);
+
+      buf += n;
+      count -= n;
+      offset += n;
+      blknum += n / BLOCKSIZE;
+    }
+    else {
+      read_block (blknum, offset, buf);
 
-    buf += BLOCKSIZE;
-    count -= BLOCKSIZE;
-    offset += BLOCKSIZE;
-    blknum++;
+      buf += BLOCKSIZE;
+      count -= BLOCKSIZE;
+      offset += BLOCKSIZE;
+      blknum++;
+    }
   }
 
   /* Unaligned tail */
@@ -365,11 +378,13 @@ sparse_random_pwrite (void *handle, const void *buf,
   blknum = offset / BLOCKSIZE;  /* block number */
   blkoffs = offset % BLOCKSIZE; /* offset within the block */
 
-  /* Unaligned head */
+  /* Unaligned head.  As for pread, read_block must be given the
+   * offset of the start of the block.
+   */
   if (blkoffs) {
     uint64_t n = MIN (BLOCKSIZE - blkoffs, count);
 
-    read_block (blknum, offset, block);
+    read_block (blknum, offset - blkoffs, block);
     if (memcmp (buf, &block[blkoffs], n) != 0) {
     unexpected_data:
       errno = EIO;
@@ -386,22 +401,33 @@ sparse_random_pwrite (void *handle, const void *buf,
   /* Aligned body */
   while (count >= BLOCKSIZE) {
     /* As an optimization, skip calling read_block if we know this is
-     * a hole.  Call is_zero instead which should be faster.
+     * a hole.  Call is_zero over the whole run of hole blocks instead
+     * which should be faster.
      */
     if (bitmap_get_blk (&bm, blknum, 0) == 0) {
-      if (! is_zero (buf, BLOCKSIZE))
+      int64_t next = bitmap_next (&bm, blknum);
+      uint64_t n = count - (count % BLOCKSIZE);
+
+      if (next >= 0 && (next - blknum) * BLOCKSIZE < n)
+        n = (next - blknum) * BLOCKSIZE;
+      if (! is_zero (buf, n))
         goto unexpected_data;
+
+      buf += n;
+      count -= n;
+      offset += n;
+      blknum += n / BLOCKSIZE;
     }
     else {
       read_block (blknum, offset, block);
       if (memcmp (buf, block, BLOCKSIZE) != 0)
         goto unexpected_data;
-    }
 
-    buf += BLOCKSIZE;
-    count -= BLOCKSIZE;
-    offset += BLOCKSIZE;
-    blknum++;
+      buf += BLOCKSIZE;
+      count -= BLOCKSIZE;
+      offset += BLOCKSIZE;
+      blknum++;
+    }
   }
 
   /* Unaligned tail */
@@ -443,19 +469,13 @@ sparse_random_trim_zero (void *handle, uint32_t count, uint64_t offset,
     blknum++;
   }
 
-  /* Aligned body */
-  while (count >= BLOCKSIZE) {
-    if (bitmap_get_blk (&bm, blknum, 0) != 0)
-      goto unexpected_trim;
-
-    count -= BLOCKSIZE;
-    offset += BLOCKSIZE;
-    blknum++;
-  }
-
-  /* Unaligned tail */
+  /* Aligned body and unaligned tail.  A single scan for the next
+   * data block replaces the block-by-block loop.
+   */
   if (count) {
-    if (bitmap_get_blk (&bm, blknum, 0) != 0)
+    int64_t next = bitmap_next (&bm, blknum);
+
+    if (next >= 0 && (uint64_t) next * BLOCKSIZE < offset + count)
       goto unexpected_trim;
   }
 
@@ -466,50 +486,34 @@ static int
 sparse_random_extents (void *handle, uint32_t count, uint64_t offset,
                        uint32_t flags, struct nbdkit_extents *extents)
 {
-  uint64_t blknum, blkoffs;
-  uint32_t type;
+  uint64_t end = offset + count;
+  uint64_t blknum = offset / BLOCKSIZE;
 
-  blknum = offset / BLOCKSIZE;  /* block number */
-  blkoffs = offset % BLOCKSIZE; /* offset within the block */
-
-  /* Unaligned head */
-  if (blkoffs) {
-    uint64_t n = MIN (BLOCKSIZE - blkoffs, count);
-
-    if (bitmap_get_blk (&bm, blknum, 0) == 0)
-      type = NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO;
-    else
-      type = 0; /* data */
-    if (nbdkit_add_extent (extents, offset, n, type) == -1)
-      return -1;
-
-    count -= n;
-    offset += n;
-    blknum++;
-  }
+  /* Walk the bitmap (computed in get_ready) a run at a time, so an
+   * extents request covering terabytes of virtual disk returns one
+   * extent per run of data or holes, not one per block.
+   */
+  while (offset < end) {
+    int64_t next;
+    uint64_t run_end;
+    uint32_t type;
 
-  /* Aligned body */
-  while (count >= BLOCKSIZE) {
-    if (bitmap_get_blk (&bm, blknum, 0) == 0)
+    if (bitmap_get_blk (&bm, blknum, 0) == 0) {
       type = NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO;
-    else
+      next = bitmap_next (&bm, blknum);
+    }
+    else {
       type = 0; /* data */
-    if (nbdkit_add_extent (extents, offset, BLOCKSIZE, type) == -1)
+      next = bitmap_next_zero (&bm, blknum);
+    }
+    run_end = next >= 0 ? (uint64_t) next * BLOCKSIZE : end;
+    if (run_end > end)
+      run_end = end;
+    if (nbdkit_add_extent (extents, offset, run_end - offset, type) == -1)
       return -1;
 
-    count -= BLOCKSIZE;
-    offset += BLOCKSIZE;
-    blknum++;
-  }
-
-  /* Unaligned tail */
-  if (count) {
-    if (bitmap_get_blk (&bm, blknum, 0) == 0)
-      type = NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO;
-    else
-      type = 0; /* data */
-    if (nbdkit_add_extent (extents, offset, count, type) == -1)
-      return -1;
+    offset = run_end;
+    blknum = run_end / BLOCKSIZE;
   }
 
   return 0;
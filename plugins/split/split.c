@@ -201,7 +201,10 @@ split_close (void *handle)
   free (h);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+/* pread(2)/pwrite(2) are safe on shared file descriptors, and
+ * anything using lseek is protected by lseek_lock.
+ */
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the disk size. */
 static int64_t
@@ -246,68 +249,152 @@ get_file (struct handle *h, uint64_t offset)
                   compare_offset);
 }
 
-/* Read data. */
-static int
-split_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+/* One segment of a request, clipped to a single backing file.  When
+ * a request spans several files the segments are issued in parallel
+ * since the files are independent (and often on separate disks).
+ */
+struct segment {
+  struct file *file;
+  void *buf;
+  uint32_t count;
+  uint64_t foffs;
+  bool is_write;
+  int error;                    /* errno on failure, else 0 */
+};
+
+DEFINE_VECTOR_TYPE(segment_list, struct segment);
+
+static void
+do_segment (struct segment *seg)
 {
-  struct handle *h = handle;
+  void *buf = seg->buf;
+  uint32_t count = seg->count;
+  uint64_t foffs = seg->foffs;
 
   while (count > 0) {
-    struct file *file = get_file (h, offset);
-    uint64_t foffs = offset - file->offset;
-    uint64_t max;
     ssize_t r;
 
-    max = file->size - foffs;
-    if (max > count)
-      max = count;
-
-    r = pread (file->fd, buf, max, foffs);
+    if (seg->is_write)
+      r = pwrite (seg->file->fd, buf, count, foffs);
+    else
+      r = pread (seg->file->fd, buf, count, foffs);
     if (r == -1) {
-      nbdkit_error ("pread: %m");
-      return -1;
+      seg->error = errno;
+      nbdkit_error ("%s: %m", seg->is_write ? "pwrite" : "pread");
+      return;
     }
     if (r == 0) {
+      seg->error = errno = EIO;
       nbdkit_error ("pread: unexpected end of file");
-      return -1;
+      return;
     }
     buf += r;
     count -= r;
-    offset += r;
+    foffs += r;
   }
+}
 
-  return 0;
+static void *
+segment_thread (void *vp)
+{
+  do_segment (vp);
+  return NULL;
 }
 
-/* Write data to the file. */
 static int
-split_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
+split_io (struct handle *h, void *buf, uint32_t count, uint64_t offset,
+          bool is_write)
 {
-  struct handle *h = handle;
+  segment_list segs = empty_vector;
+  size_t i, nthreads = 0;
+  int error = 0;
 
+  /* Split the request into per-file segments. */
   while (count > 0) {
     struct file *file = get_file (h, offset);
     uint64_t foffs = offset - file->offset;
     uint64_t max;
-    ssize_t r;
+    struct segment seg;
 
     max = file->size - foffs;
     if (max > count)
       max = count;
 
-    r = pwrite (file->fd, buf, max, offset);
-    if (r == -1) {
-      nbdkit_error ("pwrite: %m");
+    seg.file = file;
+    seg.buf = buf;
+    seg.count = max;
+    seg.foffs = foffs;
+    seg.is_write = is_write;
+    seg.error = 0;
+    if (segment_list_append (&segs, seg) == -1) {
+      nbdkit_error ("realloc: %m");
+      free (segs.ptr);
       return -1;
     }
-    buf += r;
-    count -= r;
-    offset += r;
+
+    buf += max;
+    count -= max;
+    offset += max;
+  }
+
+  if (segs.size == 1)
+    /* Common case: the request lies within a single file. */
+    do_segment (&segs.ptr[0]);
+  else {
+    /* The request crosses file boundaries.  Issue the segments in
+     * parallel, running the first one on this thread.
+     */
+    CLEANUP_FREE pthread_t *threads =
+      malloc (segs.size * sizeof (pthread_t));
+
+    if (threads == NULL) {
+      nbdkit_error ("malloc: %m");
+      free (segs.ptr);
+      return -1;
+    }
+    for (i = 1; i < segs.size; ++i) {
+      if (pthread_create (&threads[i], NULL, segment_thread,
+                          &segs.ptr[i]) != 0)
+        break;
+      nthreads++;
+    }
+    /* If thread creation failed, run the remainder on this thread. */
+    for (i = nthreads + 1; i < segs.size; ++i)
+      do_segment (&segs.ptr[i]);
+    do_segment (&segs.ptr[0]);
+    for (i = 1; i <= nthreads; ++i)
+      pthread_join (threads[i], NULL);
+  }
+
+  for (i = 0; i < segs.size; ++i) {
+    if (segs.ptr[i].error) {
+      error = segs.ptr[i].error;
+      break;
+    }
   }
+  free (segs.ptr);
 
+  if (error) {
+    errno = error;
+    return -1;
+  }
   return 0;
 }
 
+/* Read data. */
+static int
+split_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+{
+  return split_io (handle, buf, count, offset, false);
+}
+
+/* Write data to the file. */
+static int
+split_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
+{
+  return split_io (handle, (void *) buf, count, offset, true);
+}
+
 #if HAVE_POSIX_FADVISE
 /* Caching. */
 static int
@@ -326,14 +413,14 @@ split_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
     if (max > count)
       max = count;
 
-    r = posix_fadvise (file->fd, offset, max, POSIX_FADV_WILLNEED);
+    r = posix_fadvise (file->fd, foffs, max, POSIX_FADV_WILLNEED);
     if (r) {
       errno = r;
       nbdkit_error ("posix_fadvise: %m");
       return -1;
     }
-    count -= r;
-    offset += r;
+    count -= max;
+    offset += max;
   }
 
   return 0;
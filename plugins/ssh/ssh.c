@@ -65,6 +65,7 @@ static const char *known_hosts = NULL;
 static const_string_vector identities = empty_vector;
 static uint32_t timeout = 0;
 static bool compression = false;
+static uint64_t window = 0;
 
 /* config can be:
  * NULL => parse options from default file
@@ -170,6 +171,13 @@ ssh_config (const char *key, const char *value)
     compression = r;
   }
 
+  else if (strcmp (key, "window") == 0) {
+    int64_t w = nbdkit_parse_size (value);
+    if (w == -1)
+      return -1;
+    window = w;
+  }
+
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -202,13 +210,40 @@ ssh_config_complete (void)
   "identity=<FILENAME>        Prepend private key (identity) file.\n" \
   "timeout=SECS               Set SSH connection timeout.\n" \
   "verify-remote-host=false   Ignore known_hosts.\n" \
-  "compression=true           Enable compression."
+  "compression=true           Enable compression.\n" \
+  "window=<SIZE>              Readahead window for sequential reads."
+
+/* Maximum size of a single sftp read request.  Every server must
+ * support at least this (the protocol minimum is 32K).
+ */
+#define MAX_REQUEST (32*1024)
+
+/* An outstanding asynchronous read request in the sliding window. */
+struct ra_request {
+  int id;                       /* Request identifier. */
+  uint32_t len;                 /* Length requested. */
+};
 
 /* The per-connection handle. */
 struct ssh_handle {
   ssh_session session;
   sftp_session sftp;
   sftp_file file;
+
+  /* Sliding window readahead state, only used when window > 0.  The
+   * ring ra (ra_size entries, ra_tail oldest, ra_inflight used)
+   * holds requests issued ahead of the client covering file offsets
+   * [ra_offset, ra_next): the oldest starts at ra_offset and the
+   * next request would be issued at ra_next.  leftover stores the
+   * tail of the last reply which over-ran what the client asked for.
+   */
+  struct ra_request *ra;
+  size_t ra_size, ra_tail, ra_inflight;
+  uint64_t ra_offset, ra_next;
+  uint64_t size;                /* File size, snapshot at open. */
+  char *leftover;               /* MAX_REQUEST bytes. */
+  uint64_t lo_offset;           /* File offset of leftover data. */
+  uint32_t lo_len;              /* Length of leftover data (0 = none). */
 };
 
 /* Verify the remote host.
@@ -514,11 +549,34 @@ ssh_open (int readonly)
     goto err;
   }
 
+  /* Set up the readahead window. */
+  if (window > 0) {
+    sftp_attributes attrs;
+
+    attrs = sftp_fstat (h->file);
+    if (attrs == NULL) {
+      nbdkit_error ("fstat failed: %s", ssh_get_error (h->session));
+      goto err;
+    }
+    h->size = attrs->size;
+    sftp_attributes_free (attrs);
+
+    h->ra_size = (window + MAX_REQUEST - 1) / MAX_REQUEST;
+    h->ra = calloc (h->ra_size, sizeof (struct ra_request));
+    h->leftover = malloc (MAX_REQUEST);
+    if (h->ra == NULL || h->leftover == NULL) {
+      nbdkit_error ("malloc: %m");
+      goto err;
+    }
+  }
+
   nbdkit_debug ("opened libssh handle");
 
   return h;
 
  err:
+  free (h->ra);
+  free (h->leftover);
   if (h->file)
     sftp_close (h->file);
   if (h->sftp)
@@ -531,6 +589,8 @@ ssh_open (int readonly)
   return NULL;
 }
 
+static void window_drain (struct ssh_handle *h);
+
 /* Free up the per-connection handle. */
 static void
 ssh_close (void *handle)
@@ -538,6 +598,12 @@ ssh_close (void *handle)
   struct ssh_handle *h = handle;
   int r;
 
+  /* Consume readahead replies still in flight before closing. */
+  if (h->ra_size > 0)
+    window_drain (h);
+  free (h->ra);
+  free (h->leftover);
+
   r = sftp_close (h->file);
   if (r != SSH_OK)
     nbdkit_error ("cannot close file: %s", ssh_get_error (h->session));
@@ -565,31 +631,255 @@ ssh_get_size (void *handle)
   return r;
 }
 
-/* Read data from the remote server. */
+/* Read data from the remote server.
+ *
+ * SFTP allows many read requests to be outstanding on the channel at
+ * once, and over high latency links pipelining them matters a great
+ * deal: issuing the chunks of a large read one at a time costs a
+ * round trip per chunk.  We issue up to PIPELINE_DEPTH asynchronous
+ * requests ahead of the oldest uncollected reply.
+ *
+ * Each request is at most MAX_REQUEST bytes, which every server must
+ * support.
+ */
+#define PIPELINE_DEPTH 16
+
+struct read_request {
+  int id;                       /* Request identifier. */
+  void *buf;                    /* Where the reply data belongs. */
+  uint32_t len;                 /* Length requested. */
+};
+
+/* Discard every readahead request still in flight, consuming the
+ * replies (into the leftover buffer, which this clobbers) so they are
+ * not left unanswered on the channel.
+ */
+static void
+window_drain (struct ssh_handle *h)
+{
+  while (h->ra_inflight > 0) {
+    struct ra_request *r = &h->ra[h->ra_tail];
+
+    sftp_async_read (h->file, h->leftover, r->len, r->id);
+    h->ra_tail = (h->ra_tail + 1) % h->ra_size;
+    h->ra_inflight--;
+  }
+  h->lo_len = 0;
+}
+
+/* Read when window=SIZE was set.  Unlike plain pipelined reads we
+ * keep issuing requests beyond the end of the current command, so
+ * when the client reads sequentially (eg. nbdcopy) the data for the
+ * next command is already on the wire before it is asked for.
+ */
+static int
+pread_window (struct ssh_handle *h, void *buf, uint32_t count,
+              uint64_t offset)
+{
+  uint32_t len, n;
+  int r;
+  ssize_t rs;
+
+  /* Serve the start from the tail of the previous over-long reply. */
+  if (h->lo_len > 0 &&
+      offset >= h->lo_offset && offset < h->lo_offset + h->lo_len) {
+    n = MIN (count, h->lo_offset + h->lo_len - offset);
+    memcpy (buf, h->leftover + (offset - h->lo_offset), n);
+    buf += n;
+    count -= n;
+    offset += n;
+    if (count == 0)
+      return 0;
+  }
+
+  /* Random access: the window covers the wrong offsets, discard it. */
+  if (h->ra_inflight > 0 && offset != h->ra_offset)
+    window_drain (h);
+
+  if (h->ra_inflight == 0) {
+    r = sftp_seek64 (h->file, offset);
+    if (r != SSH_OK) {
+      nbdkit_error ("seek64 failed: %s", ssh_get_error (h->session));
+      return -1;
+    }
+    h->ra_offset = h->ra_next = offset;
+  }
+
+  while (count > 0) {
+    /* Top up the window.  sftp_async_read_begin advances the file
+     * position by the length of each request.  Don't issue requests
+     * beyond the end of the file.
+     */
+    while (h->ra_inflight < h->ra_size && h->ra_next < h->size) {
+      len = MIN ((uint64_t) MAX_REQUEST, h->size - h->ra_next);
+      r = sftp_async_read_begin (h->file, len);
+      if (r < 0) {
+        nbdkit_error ("async read failed: %s", ssh_get_error (h->session));
+        window_drain (h);
+        return -1;
+      }
+      h->ra[(h->ra_tail + h->ra_inflight) % h->ra_size] =
+        (struct ra_request) { .id = r, .len = len };
+      h->ra_inflight++;
+      h->ra_next += len;
+    }
+
+    if (h->ra_inflight == 0) {
+      /* Nothing in flight and nothing to issue: reading past EOF. */
+      nbdkit_error ("unexpected end of file while reading");
+      return -1;
+    }
+
+    /* Collect the oldest reply, which starts at the current offset.
+     * If it is longer than what the client still wants, collect into
+     * the leftover buffer and copy out, so the rest survives for the
+     * next command.
+     */
+    len = h->ra[h->ra_tail].len;
+    r = h->ra[h->ra_tail].id;
+    if (len <= count)
+      rs = sftp_async_read (h->file, buf, len, r);
+    else
+      rs = sftp_async_read (h->file, h->leftover, len, r);
+    if (rs < 0) {
+      nbdkit_error ("read failed: %s (%zd)", ssh_get_error (h->session), rs);
+      window_drain (h);
+      return -1;
+    }
+    if (rs == 0) {
+      nbdkit_error ("unexpected end of file while reading");
+      window_drain (h);
+      return -1;
+    }
+    h->ra_tail = (h->ra_tail + 1) % h->ra_size;
+    h->ra_inflight--;
+    h->ra_offset += rs;
+
+    n = MIN ((uint32_t) rs, count);
+    if (len > count) {
+      memcpy (buf, h->leftover, n);
+      h->lo_offset = offset;
+      h->lo_len = rs;
+    }
+    buf += n;
+    count -= n;
+    offset += n;
+
+    if ((uint32_t) rs < len) {
+      /* Short reply (the protocol allows this although it is rarely
+       * seen): requests in flight are for offsets beyond the gap
+       * this leaves, so discard them and reseek.
+       */
+      window_drain (h);
+      if (count > 0) {
+        r = sftp_seek64 (h->file, offset);
+        if (r != SSH_OK) {
+          nbdkit_error ("seek64 failed: %s", ssh_get_error (h->session));
+          return -1;
+        }
+        h->ra_offset = h->ra_next = offset;
+      }
+    }
+  }
+
+  return 0;
+}
+
 static int
 ssh_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
   struct ssh_handle *h = handle;
+  struct read_request reqs[PIPELINE_DEPTH];
+  size_t head, tail, inflight;
+  uint32_t to_issue, len;
+  void *issue_buf;
   int r;
   ssize_t rs;
 
+  if (h->ra_size > 0)
+    return pread_window (h, buf, count, offset);
+
+ restart:
   r = sftp_seek64 (h->file, offset);
   if (r != SSH_OK) {
     nbdkit_error ("seek64 failed: %s", ssh_get_error (h->session));
     return -1;
   }
 
+  head = tail = inflight = 0;
+  to_issue = count;
+  issue_buf = buf;
+
+  /* Replies are collected in issue order, so the region before the
+   * oldest uncollected request is always complete, and buf / count /
+   * offset advance as each reply is collected.
+   */
   while (count > 0) {
-    rs = sftp_read (h->file, buf, count);
+    /* Issue requests to fill the pipeline.  sftp_async_read_begin
+     * advances the file position by the length of each request.
+     */
+    while (to_issue > 0 && inflight < PIPELINE_DEPTH) {
+      len = MIN (to_issue, (uint32_t) MAX_REQUEST);
+      r = sftp_async_read_begin (h->file, len);
+      if (r < 0) {
+        nbdkit_error ("async read failed: %s", ssh_get_error (h->session));
+        goto drain_err;
+      }
+      reqs[head] = (struct read_request) { .id = r, .buf = issue_buf,
+                                           .len = len };
+      head = (head + 1) % PIPELINE_DEPTH;
+      issue_buf += len;
+      to_issue -= len;
+      inflight++;
+    }
+
+    /* Collect the oldest reply (reqs[tail].buf == buf here). */
+    len = reqs[tail].len;
+    rs = sftp_async_read (h->file, buf, len, reqs[tail].id);
     if (rs < 0) {
       nbdkit_error ("read failed: %s (%zd)", ssh_get_error (h->session), rs);
-      return -1;
+      goto drain_err;
     }
+    if (rs == 0) {
+      nbdkit_error ("unexpected end of file while reading");
+      goto drain_err;
+    }
+    tail = (tail + 1) % PIPELINE_DEPTH;
+    inflight--;
+
     buf += rs;
     count -= rs;
+    offset += rs;
+
+    if (rs < len) {
+      /* The server answered with less than we asked for (the
+       * protocol allows this although it is rarely seen).  Requests
+       * already in flight are for offsets beyond the gap this
+       * leaves, so drain and discard them and restart the pipeline
+       * just after the data we got.
+       */
+      while (inflight > 0) {
+        sftp_async_read (h->file, reqs[tail].buf, reqs[tail].len,
+                         reqs[tail].id);
+        tail = (tail + 1) % PIPELINE_DEPTH;
+        inflight--;
+      }
+      goto restart;
+    }
   }
 
   return 0;
+
+ drain_err:
+  /* Consume replies for any requests still in flight so they are not
+   * left unanswered on the channel.
+   */
+  while (inflight > 0) {
+    sftp_async_read (h->file, reqs[tail].buf, reqs[tail].len, reqs[tail].id);
+    tail = (tail + 1) % PIPELINE_DEPTH;
+    inflight--;
+  }
+  return -1;
 }
 
 /* Write data to the remote server. */
@@ -600,6 +890,12 @@ ssh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
   int r;
   ssize_t rs;
 
+  /* A write invalidates any readahead data covering the same file, so
+   * discard the window (and the leftover buffer) first.
+   */
+  if (h->ra_size > 0)
+    window_drain (h);
+
   r = sftp_seek64 (h->file, offset);
   if (r != SSH_OK) {
     nbdkit_error ("seek64 failed: %s", ssh_get_error (h->session));
@@ -642,6 +938,12 @@ ssh_can_multi_conn (void *handle)
 {
   struct ssh_handle *h = handle;
 
+  /* A write on another connection cannot invalidate this
+   * connection's readahead window, so reads could return stale data.
+   */
+  if (window > 0)
+    return 0;
+
   /* After examining the OpenSSH implementation of sftp-server we
    * concluded that its write/flush behaviour is safe for advertising
    * multi-conn.  Other servers may not be safe.  Use the
@@ -35,6 +35,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -42,9 +44,13 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include <nbdkit-plugin.h>
 
+#include "minmax.h"
+#include "tvdiff.h"
+
 /* Mode - read or write? */
 static enum { UNKNOWN_MODE, READ_MODE, WRITE_MODE } mode = UNKNOWN_MODE;
 
@@ -55,6 +61,19 @@ static int fd = -1;
 /* This is 2^63 - 2^30.  This is the largest disk that qemu supports. */
 static int64_t size = INT64_C(9223372035781033984);
 
+/* Size of the sliding window of recently streamed data (window
+ * parameter).  Accesses within the window do not cause the fatal
+ * "seek backwards" error.
+ */
+static uint64_t window = 16 * 1024 * 1024;
+
+/* Ring buffer holding the last ‘ringsize’ bytes of the stream,
+ * ie. stream bytes [highest-ringsize, highest).  Stream byte ‘i’ is
+ * stored at ring[i % window].
+ */
+static char *ring = NULL;
+static uint64_t ringsize = 0;
+
 /* Flag if we have entered the unrecoverable error state because of
  * a seek backwards.
  */
@@ -63,11 +82,22 @@ static bool errorstate = 0;
 /* Highest byte (+1) that has been accessed in the data stream. */
 static uint64_t highest = 0;
 
+/* Time spent blocked on the other end of the pipe (-D
+ * streaming.stalls=1 to log individual stalls).
+ */
+int streaming_debug_stalls;
+static uint64_t stalls;           /* pipe operations taking > 1ms */
+static uint64_t stall_usecs;      /* total time blocked on the pipe */
+
 static void
 streaming_unload (void)
 {
+  nbdkit_debug ("time blocked on the pipe: %" PRIu64 " microseconds "
+                "(%" PRIu64 " stalls over 1ms)",
+                stall_usecs, stalls);
   if (fd >= 0)
     close (fd);
+  free (ring);
   free (filename);
 }
 
@@ -100,6 +130,12 @@ streaming_config (const char *key, const char *value)
     if (size == -1)
       return -1;
   }
+  else if (strcmp (key, "window") == 0) {
+    int64_t w = nbdkit_parse_size (value);
+    if (w == -1)
+      return -1;
+    window = w;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -125,7 +161,8 @@ streaming_config_complete (void)
 #define streaming_config_help \
   "read=<FILENAME>                The pipe or socket to read.\n" \
   "write=<FILENAME>               The pipe or socket to write.\n" \
-  "size=<SIZE>         (optional) Stream size."
+  "size=<SIZE>         (optional) Stream size.\n" \
+  "window=<SIZE>       (optional) Recently streamed data to retain."
 
 static int
 streaming_get_ready (void)
@@ -136,6 +173,14 @@ streaming_get_ready (void)
   assert (filename != NULL);
   assert (fd == -1);
 
+  if (window > 0) {
+    ring = malloc (window);
+    if (ring == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+  }
+
   flags = O_CLOEXEC|O_NOCTTY;
   if (mode == WRITE_MODE)
     flags |= O_RDWR;
@@ -199,6 +244,112 @@ streaming_get_size (void *handle)
   return size;
 }
 
+/* Append data which has just passed position ‘highest’ in the stream
+ * to the ring.  The caller increments ‘highest’ afterwards.
+ */
+static void
+ring_append (const void *buf, uint64_t n)
+{
+  const char *p = buf;
+  uint64_t pos, len;
+
+  if (window == 0)
+    return;
+
+  /* Only the last ‘window’ bytes can be retained. */
+  if (n > window) {
+    p += n - window;
+    n = window;
+  }
+
+  ringsize = MIN (ringsize + n, window);
+
+  pos = (highest + (p - (const char *) buf)) % window;
+  while (n > 0) {
+    len = MIN (n, window - pos);
+    memcpy (ring + pos, p, len);
+    p += len;
+    n -= len;
+    pos = 0;
+  }
+}
+
+/* Copy data back out of the ring.  The caller must check that
+ * [offset, offset+count) lies within [highest-ringsize, highest).
+ */
+static void
+ring_read (void *buf, uint32_t count, uint64_t offset)
+{
+  char *p = buf;
+  uint64_t pos, len;
+
+  pos = offset % window;
+  while (count > 0) {
+    len = MIN (count, window - pos);
+    memcpy (p, ring + pos, len);
+    p += len;
+    count -= len;
+    pos = 0;
+  }
+}
+
+/* Wrappers around the blocking pipe I/O which accumulate the time
+ * spent stalled waiting for the other end of the pipe.
+ */
+static ssize_t
+stream_recv (void *buf, size_t count)
+{
+  struct timeval start, end;
+  int64_t usecs;
+  ssize_t r;
+
+  gettimeofday (&start, NULL);
+  r = read (fd, buf, count);
+  gettimeofday (&end, NULL);
+  usecs = tvdiff_usec (&start, &end);
+  stall_usecs += usecs;
+  if (usecs >= 1000) {
+    stalls++;
+    if (streaming_debug_stalls)
+      nbdkit_debug ("read stalled for %" PRIi64 " microseconds", usecs);
+  }
+  return r;
+}
+
+static ssize_t
+stream_send (const void *buf, size_t count)
+{
+  struct timeval start, end;
+  int64_t usecs;
+  ssize_t r;
+
+  gettimeofday (&start, NULL);
+  r = write (fd, buf, count);
+  gettimeofday (&end, NULL);
+  usecs = tvdiff_usec (&start, &end);
+  stall_usecs += usecs;
+  if (usecs >= 1000) {
+    stalls++;
+    if (streaming_debug_stalls)
+      nbdkit_debug ("write stalled for %" PRIi64 " microseconds", usecs);
+  }
+  return r;
+}
+
+/* Called when the client accesses data below the window of retained
+ * data, which is unrecoverable.
+ */
+static void
+seek_too_far_back (uint64_t offset)
+{
+  nbdkit_error ("client tried to seek back %" PRIu64 " bytes but only "
+                "%" PRIu64 " bytes of streamed data are retained: "
+                "try increasing the window parameter",
+                highest - offset, ringsize);
+  errorstate = true;
+  errno = EIO;
+}
+
 /* Read data back from the stream. */
 static int
 streaming_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
@@ -213,16 +364,25 @@ streaming_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   }
 
   if (mode == READ_MODE) {
+    /* Serve any part of the request which is below the high water
+     * mark from the ring of recently streamed data.
+     */
     if (offset < highest) {
-      nbdkit_error ("client tried to seek backwards and read: "
-                    "the streaming plugin does not support this");
-      errorstate = true;
-      errno = EIO;
-      return -1;
+      if (highest - offset > ringsize) {
+        seek_too_far_back (offset);
+        return -1;
+      }
+      n = MIN (count, highest - offset);
+      ring_read (buf, n, offset);
+      buf += n;
+      offset += n;
+      count -= n;
+      if (count == 0)
+        return 0;
     }
 
     /* If the offset is higher than previously read we must seek
-     * forwards and discard data.
+     * forwards, retaining the skipped data in the ring.
      */
     if (offset > highest) {
       int64_t remaining = offset - highest;
@@ -230,7 +390,7 @@ streaming_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 
       while (remaining > 0) {
         n = remaining > sizeof discard ? sizeof discard : remaining;
-        r = read (fd, discard, n);
+        r = stream_recv (discard, n);
         if (r == -1) {
           nbdkit_error ("read: %m");
           errorstate = true;
@@ -241,6 +401,7 @@ streaming_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
           errorstate = true;
           return -1;
         }
+        ring_append (discard, r);
         highest += r;
         remaining -= r;
       }
@@ -248,7 +409,7 @@ streaming_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 
     /* Read data from the pipe into the return buffer. */
     while (count > 0) {
-      r = read (fd, buf, count);
+      r = stream_recv (buf, count);
       if (r == -1) {
         nbdkit_error ("read: %m");
         errorstate = true;
@@ -259,6 +420,7 @@ streaming_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
         errorstate = true;
         return -1;
       }
+      ring_append (buf, r);
       buf += r;
       highest += r;
       count -= r;
@@ -269,17 +431,27 @@ streaming_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 
   /* WRITE_MODE */
   else {
-    /* Allow reads which are entirely >= highest.  These return zeroes. */
-    if (offset >= highest) {
-      memset (buf, 0, count);
-      return 0;
+    /* Serve reads of data we recently wrote from the ring. */
+    if (offset < highest) {
+      if (highest - offset > ringsize) {
+        nbdkit_error ("client tried to read back data which is no longer "
+                      "retained, but the streaming plugin is being used in "
+                      "write mode (write= parameter): "
+                      "try increasing the window parameter");
+        errorstate = true;
+        errno = EIO;
+        return -1;
+      }
+      n = MIN (count, highest - offset);
+      ring_read (buf, n, offset);
+      buf += n;
+      offset += n;
+      count -= n;
     }
 
-    nbdkit_error ("client tried to read, but the streaming plugin is "
-                  "being used in write mode (write= parameter)");
-    errorstate = true;
-    errno = EIO;
-    return -1;
+    /* Reads which are entirely >= highest return zeroes. */
+    memset (buf, 0, count);
+    return 0;
   }
 }
 
@@ -302,12 +474,38 @@ streaming_pwrite (void *handle, const void *buf,
     return -1;
   }
 
+  /* Rewriting data which has already been sent down the pipe cannot
+   * change the stream.  Accept the write only if it is identical to
+   * what was streamed (qemu-img sometimes rewrites the image header).
+   */
   if (offset < highest) {
-    nbdkit_error ("client tried to seek backwards and write: "
-                  "the streaming plugin does not support this");
-    errorstate = true;
-    errno = EIO;
-    return -1;
+    char *expected;
+
+    if (highest - offset > ringsize) {
+      seek_too_far_back (offset);
+      return -1;
+    }
+    n = MIN (count, highest - offset);
+    expected = malloc (n);
+    if (expected == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+    ring_read (expected, n, offset);
+    if (memcmp (buf, expected, n) != 0) {
+      free (expected);
+      nbdkit_error ("client rewrote already streamed data with different "
+                    "contents: the streaming plugin does not support this");
+      errorstate = true;
+      errno = EIO;
+      return -1;
+    }
+    free (expected);
+    buf += n;
+    offset += n;
+    count -= n;
+    if (count == 0)
+      return 0;
   }
 
   /* Need to write some zeroes. */
@@ -317,12 +515,13 @@ streaming_pwrite (void *handle, const void *buf,
 
     while (remaining > 0) {
       n = remaining > sizeof zerobuf ? sizeof zerobuf : remaining;
-      r = write (fd, zerobuf, n);
+      r = stream_send (zerobuf, n);
       if (r == -1) {
         nbdkit_error ("write: %m");
         errorstate = true;
         return -1;
       }
+      ring_append (zerobuf, r);
       highest += r;
       remaining -= r;
     }
@@ -330,12 +529,13 @@ streaming_pwrite (void *handle, const void *buf,
 
   /* Write the data. */
   while (count > 0) {
-    r = write (fd, buf, count);
+    r = stream_send (buf, count);
     if (r == -1) {
       nbdkit_error ("write: %m");
       errorstate = true;
       return -1;
     }
+    ring_append (buf, r);
     buf += r;
     highest += r;
     count -= r;
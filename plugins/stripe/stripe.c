@@ -0,0 +1,865 @@
+/* nbdkit
+ * Copyright (C) 2019-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* RAID0-style aggregation of multiple NBD servers: the virtual disk
+ * is striped (or concatenated) across every server= URI, so one
+ * export aggregates the capacity and bandwidth of several storage
+ * nodes without a client-side md layer.
+ *
+ * The machinery per backend is the same as the nbd plugin: one
+ * libnbd handle driven by a dedicated reader thread, with requests
+ * submitted asynchronously and the submitting thread waiting on a
+ * semaphore.  A request which spans backends is split into segments
+ * which are all submitted before any is waited on, so the transfer
+ * runs on every spanned backend in parallel.  A counting semaphore
+ * per backend bounds the commands in flight there (queue-depth), so
+ * one slow or small node cannot be buried by fan-out from larger
+ * requests.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#include <libnbd.h>
+
+#define NBDKIT_API_VERSION 2
+
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "ispowerof2.h"
+#include "minmax.h"
+#include "vector.h"
+
+DEFINE_VECTOR_TYPE(string_vector, const char *);
+
+/* The backend servers (server=URI, one per backend, in order). */
+static string_vector servers = empty_vector;
+
+/* Bytes per stripe chunk (stripe-size). */
+static uint32_t stripe_size = 524288;
+
+/* How the virtual disk is laid out over the backends (mode). */
+static enum { MODE_STRIPE, MODE_CONCAT } mode = MODE_STRIPE;
+
+/* Maximum commands in flight per backend (queue-depth). */
+static unsigned queue_depth = 64;
+
+/* Number of retries on initial connect (retry). */
+static unsigned retry;
+
+/* The per-transaction details, one per segment of a request. */
+struct transaction {
+  int64_t cookie;
+  sem_t sem;
+  uint32_t early_err;
+  uint32_t err;
+  struct blink *l;              /* to release the queue slot */
+  nbd_completion_callback cb;
+};
+
+/* One connection to one backend server. */
+struct blink {
+  struct nbd_handle *nbd;
+  int fds[2];                   /* Pipe for kicking the reader thread */
+  pthread_t reader;
+  sem_t slots;                  /* queue-depth free submission slots */
+  uint64_t devsize;             /* usable size of this backend */
+  uint64_t start;               /* MODE_CONCAT: virtual start offset */
+};
+
+/* The per-connection handle. */
+struct handle {
+  struct blink *links;          /* one per server, in server= order */
+  unsigned nr_links;
+  bool readonly;
+  int64_t size;                 /* size of the virtual disk */
+};
+
+static void
+stripe_unload (void)
+{
+  free (servers.ptr);           /* the strings are interned */
+}
+
+static int
+stripe_config (const char *key, const char *value)
+{
+  if (strcmp (key, "server") == 0) {
+    const char *s = nbdkit_strdup_intern (value);
+
+    if (s == NULL)
+      return -1;
+    if (string_vector_append (&servers, s) == -1) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "stripe-size") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+
+    if (r == -1)
+      return -1;
+    if (r < 512 || r > UINT32_MAX || !is_power_of_2 (r)) {
+      nbdkit_error ("stripe-size must be a power of 2 and >= 512");
+      return -1;
+    }
+    stripe_size = r;
+    return 0;
+  }
+  else if (strcmp (key, "mode") == 0) {
+    if (strcmp (value, "stripe") == 0)
+      mode = MODE_STRIPE;
+    else if (strcmp (value, "concat") == 0)
+      mode = MODE_CONCAT;
+    else {
+      nbdkit_error ("unknown mode: %s", value);
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "queue-depth") == 0) {
+    if (nbdkit_parse_unsigned ("queue-depth", value, &queue_depth) == -1)
+      return -1;
+    if (queue_depth < 1) {
+      nbdkit_error ("queue-depth must be at least 1");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "retry") == 0) {
+    if (nbdkit_parse_unsigned ("retry", value, &retry) == -1)
+      return -1;
+    return 0;
+  }
+  else {
+    nbdkit_error ("unknown parameter '%s'", key);
+    return -1;
+  }
+}
+
+static int
+stripe_config_complete (void)
+{
+  if (servers.size == 0) {
+    nbdkit_error ("at least one server= parameter is required");
+    return -1;
+  }
+  return 0;
+}
+
+#define stripe_config_help \
+  "server=URI                NBD URI of a backend server.  Give the\n" \
+  "                          parameter once per backend, in order\n" \
+  "                          (required).\n" \
+  "stripe-size=SIZE          Bytes per stripe chunk (default 512K).\n" \
+  "mode=stripe|concat        Stripe across the backends round-robin,\n" \
+  "                          or concatenate them (default stripe).\n" \
+  "queue-depth=N             Maximum commands in flight per backend\n" \
+  "                          (default 64).\n" \
+  "retry=N                   Retry connecting to a backend up to N\n" \
+  "                          times (default 0)."
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+/* Reader loop, one thread per backend link. */
+static void *
+stripe_reader (void *opaque)
+{
+  struct blink *l = opaque;
+
+  while (!nbd_aio_is_dead (l->nbd) && !nbd_aio_is_closed (l->nbd)) {
+    int r;
+    struct pollfd fds[2] = {
+      [0].fd = nbd_aio_get_fd (l->nbd),
+      [1].fd = l->fds[0],
+      [1].events = POLLIN,
+    };
+    unsigned dir;
+
+    dir = nbd_aio_get_direction (l->nbd);
+    if (dir & LIBNBD_AIO_DIRECTION_READ)
+      fds[0].events |= POLLIN;
+    if (dir & LIBNBD_AIO_DIRECTION_WRITE)
+      fds[0].events |= POLLOUT;
+    if (poll (fds, 2, -1) == -1) {
+      nbdkit_error ("poll: %m");
+      break;
+    }
+
+    dir = nbd_aio_get_direction (l->nbd);
+
+    r = 0;
+    if ((dir & LIBNBD_AIO_DIRECTION_READ) && (fds[0].revents & POLLIN))
+      r = nbd_aio_notify_read (l->nbd);
+    else if ((dir & LIBNBD_AIO_DIRECTION_WRITE) && (fds[0].revents & POLLOUT))
+      r = nbd_aio_notify_write (l->nbd);
+    if (r == -1) {
+      nbdkit_error ("%s", nbd_get_error ());
+      break;
+    }
+
+    /* Check if we were kicked because a command was started. */
+    if (fds[1].revents & POLLIN) {
+      char buf[10];
+
+      if (read (l->fds[0], buf, sizeof buf) == -1 && errno != EAGAIN) {
+        nbdkit_error ("failed to read pipe: %m");
+        break;
+      }
+    }
+  }
+
+  nbdkit_debug ("exiting reader thread: %s", nbd_connection_state (l->nbd));
+  return NULL;
+}
+
+/* Callback used at the end of a transaction: record the status,
+ * release the backend's queue slot and wake the submitting thread.
+ */
+static int
+stripe_notify (void *opaque, int *error)
+{
+  struct transaction *trans = opaque;
+
+  trans->err = *error;
+  if (sem_post (&trans->l->slots) || sem_post (&trans->sem)) {
+    nbdkit_error ("failed to post semaphore: %m");
+    abort ();
+  }
+  return 1;
+}
+
+/* Prepare a transaction against the given backend, consuming one of
+ * its queue slots.
+ */
+static void
+stripe_prepare (struct blink *l, struct transaction *trans)
+{
+  memset (trans, 0, sizeof *trans);
+  if (sem_init (&trans->sem, 0, 0))
+    assert (false);
+  trans->l = l;
+  trans->cb.callback = stripe_notify;
+  trans->cb.user_data = trans;
+  while (sem_wait (&l->slots) == -1 && errno == EINTR)
+    /* try again */;
+}
+
+/* Register a submitted cookie and kick the backend's reader thread. */
+static void
+stripe_register (struct blink *l, struct transaction *trans, int64_t cookie)
+{
+  char c = 0;
+
+  if (cookie == -1) {
+    nbdkit_error ("command failed: %s", nbd_get_error ());
+    trans->early_err = nbd_get_errno ();
+    if (sem_post (&l->slots))
+      abort ();
+    return;
+  }
+
+  trans->cookie = cookie;
+
+  if (write (l->fds[1], &c, 1) == -1 && errno != EAGAIN)
+    nbdkit_debug ("failed to kick reader thread: %m");
+}
+
+/* Wait for one transaction; returns its positive error or 0. */
+static uint32_t
+stripe_wait (struct transaction *trans)
+{
+  uint32_t err;
+
+  if (trans->early_err)
+    err = trans->early_err;
+  else {
+    int r;
+
+    while ((r = sem_wait (&trans->sem)) == -1 && errno == EINTR)
+      /* try again */;
+    if (r) {
+      nbdkit_debug ("failed to wait on semaphore: %m");
+      err = EIO;
+    }
+    else
+      err = trans->err;
+  }
+  if (sem_destroy (&trans->sem))
+    abort ();
+  return err;
+}
+
+/* Connect one link to its backend server. */
+static int
+stripe_open_link (struct blink *l, const char *server)
+{
+  unsigned long retries = retry;
+  int64_t size;
+
+#ifdef HAVE_PIPE2
+  if (pipe2 (l->fds, O_NONBLOCK)) {
+    nbdkit_error ("pipe2: %m");
+    return -1;
+  }
+#else
+  if (pipe (l->fds)) {
+    nbdkit_error ("pipe: %m");
+    return -1;
+  }
+  fcntl (l->fds[0], F_SETFL, O_NONBLOCK);
+  fcntl (l->fds[1], F_SETFL, O_NONBLOCK);
+#endif
+
+  if (sem_init (&l->slots, 0, queue_depth)) {
+    nbdkit_error ("sem_init: %m");
+    goto errfds;
+  }
+
+ retry:
+  l->nbd = nbd_create ();
+  if (!l->nbd)
+    goto errnbd;
+  if (nbd_connect_uri (l->nbd, server) == -1) {
+    if (retries--) {
+      nbdkit_debug ("connect to %s failed; will try again: %s",
+                    server, nbd_get_error ());
+      nbd_close (l->nbd);
+      l->nbd = NULL;
+      sleep (1);
+      goto retry;
+    }
+    goto errnbd;
+  }
+
+  size = nbd_get_size (l->nbd);
+  if (size == -1)
+    goto errnbd;
+  l->devsize = size;
+
+  if ((errno = pthread_create (&l->reader, NULL, stripe_reader, l))) {
+    nbdkit_error ("failed to initialize reader thread: %m");
+    goto err;
+  }
+
+  return 0;
+
+ errnbd:
+  nbdkit_error ("failure while connecting to %s: %s",
+                server, nbd_get_error ());
+ err:
+  sem_destroy (&l->slots);
+ errfds:
+  close (l->fds[0]);
+  close (l->fds[1]);
+  if (l->nbd)
+    nbd_close (l->nbd);
+  l->nbd = NULL;
+  return -1;
+}
+
+/* Disconnect one link. */
+static void
+stripe_close_link (struct blink *l)
+{
+  if (nbd_aio_disconnect (l->nbd, 0) == -1)
+    nbdkit_debug ("failed to clean up handle: %s", nbd_get_error ());
+  if ((errno = pthread_join (l->reader, NULL)))
+    nbdkit_debug ("failed to join reader thread: %m");
+  sem_destroy (&l->slots);
+  close (l->fds[0]);
+  close (l->fds[1]);
+  nbd_close (l->nbd);
+}
+
+/* Create the per-connection handle: connect to every backend and
+ * compute the layout.
+ */
+static void *
+stripe_open (int readonly)
+{
+  struct handle *h;
+  unsigned i;
+  uint64_t min_chunks = UINT64_MAX, pos = 0;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  h->links = calloc (servers.size, sizeof *h->links);
+  if (h->links == NULL) {
+    nbdkit_error ("calloc: %m");
+    free (h);
+    return NULL;
+  }
+  h->readonly = readonly;
+
+  for (i = 0; i < servers.size; ++i) {
+    if (stripe_open_link (&h->links[i], servers.ptr[i]) == -1)
+      goto err;
+    h->nr_links++;
+  }
+
+  switch (mode) {
+  case MODE_STRIPE:
+    /* Like md raid0 with equal members: every backend contributes the
+     * same number of whole chunks, the size of the smallest one.
+     */
+    for (i = 0; i < h->nr_links; ++i)
+      min_chunks = MIN (min_chunks, h->links[i].devsize / stripe_size);
+    if (min_chunks == 0) {
+      nbdkit_error ("backend smaller than one stripe-size chunk");
+      goto err;
+    }
+    for (i = 0; i < h->nr_links; ++i) {
+      if (h->links[i].devsize / stripe_size > min_chunks)
+        nbdkit_debug ("%s: only using %" PRIu64 " of %" PRIu64 " chunks",
+                      servers.ptr[i], min_chunks,
+                      h->links[i].devsize / stripe_size);
+      h->links[i].devsize = min_chunks * stripe_size;
+    }
+    h->size = min_chunks * stripe_size * h->nr_links;
+    break;
+
+  case MODE_CONCAT:
+    for (i = 0; i < h->nr_links; ++i) {
+      h->links[i].start = pos;
+      pos += h->links[i].devsize;
+    }
+    h->size = pos;
+    break;
+  }
+
+  return h;
+
+ err:
+  while (h->nr_links > 0)
+    stripe_close_link (&h->links[--h->nr_links]);
+  free (h->links);
+  free (h);
+  return NULL;
+}
+
+static void
+stripe_close (void *handle)
+{
+  struct handle *h = handle;
+  unsigned i;
+
+  for (i = 0; i < h->nr_links; ++i)
+    stripe_close_link (&h->links[i]);
+  free (h->links);
+  free (h);
+}
+
+static int64_t
+stripe_get_size (void *handle)
+{
+  struct handle *h = handle;
+
+  return h->size;
+}
+
+/* Map a virtual offset to (backend, backend offset, contiguous bytes). */
+static struct blink *
+stripe_map (struct handle *h, uint64_t offset, uint32_t count,
+            uint64_t *b_off, uint32_t *n)
+{
+  if (mode == MODE_STRIPE) {
+    const uint64_t chunk = offset / stripe_size;
+    const uint32_t within = offset % stripe_size;
+    struct blink *l = &h->links[chunk % h->nr_links];
+
+    *b_off = chunk / h->nr_links * stripe_size + within;
+    *n = MIN (count, stripe_size - within);
+    return l;
+  }
+  else {
+    unsigned i;
+
+    for (i = 0; i < h->nr_links; ++i) {
+      struct blink *l = &h->links[i];
+
+      if (offset < l->start + l->devsize) {
+        *b_off = offset - l->start;
+        *n = MIN (count, l->start + l->devsize - offset);
+        return l;
+      }
+    }
+    abort ();                   /* the server validated the range */
+  }
+}
+
+enum cmd_type { CMD_PREAD, CMD_PWRITE, CMD_ZERO, CMD_TRIM, CMD_CACHE };
+
+/* Split a request into per-backend segments, submit them all, then
+ * wait for them all; this dispatches a spanning request to every
+ * backend it touches in parallel.  f carries LIBNBD_CMD_FLAG_* bits.
+ */
+static int
+stripe_command (struct handle *h, enum cmd_type type, void *buf,
+                uint32_t count, uint64_t offset, uint32_t f)
+{
+  const size_t max_segs =
+    mode == MODE_STRIPE ? count / stripe_size + 2 : (size_t) h->nr_links;
+  CLEANUP_FREE struct transaction *trans = NULL;
+  size_t nr_segs = 0, i;
+  uint32_t err = 0;
+
+  trans = calloc (max_segs, sizeof *trans);
+  if (trans == NULL) {
+    nbdkit_error ("calloc: %m");
+    errno = ENOMEM;
+    return -1;
+  }
+
+  while (count > 0) {
+    uint64_t b_off;
+    uint32_t n;
+    struct blink *l = stripe_map (h, offset, count, &b_off, &n);
+    struct transaction *t = &trans[nr_segs++];
+    int64_t cookie;
+
+    assert (nr_segs <= max_segs);
+    stripe_prepare (l, t);
+    switch (type) {
+    case CMD_PREAD:
+      cookie = nbd_aio_pread (l->nbd, buf, n, b_off, t->cb, 0);
+      break;
+    case CMD_PWRITE:
+      cookie = nbd_aio_pwrite (l->nbd, buf, n, b_off, t->cb, f);
+      break;
+    case CMD_ZERO:
+      cookie = nbd_aio_zero (l->nbd, n, b_off, t->cb, f);
+      break;
+    case CMD_TRIM:
+      cookie = nbd_aio_trim (l->nbd, n, b_off, t->cb, f);
+      break;
+    case CMD_CACHE:
+      cookie = nbd_aio_cache (l->nbd, n, b_off, t->cb, 0);
+      break;
+    default:
+      abort ();
+    }
+    stripe_register (l, t, cookie);
+
+    offset += n;
+    count -= n;
+    if (buf)
+      buf = (char *) buf + n;
+  }
+
+  /* Wait for every segment; report the first error. */
+  for (i = 0; i < nr_segs; ++i) {
+    const uint32_t e = stripe_wait (&trans[i]);
+
+    if (e && !err)
+      err = e;
+  }
+
+  errno = err;
+  return err ? -1 : 0;
+}
+
+static int
+stripe_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+              uint32_t flags)
+{
+  assert (!flags);
+  return stripe_command (handle, CMD_PREAD, buf, count, offset, 0);
+}
+
+static int
+stripe_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
+               uint32_t flags)
+{
+  const uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
+
+  assert (!(flags & ~NBDKIT_FLAG_FUA));
+  return stripe_command (handle, CMD_PWRITE, (void *) buf, count, offset, f);
+}
+
+static int
+stripe_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  uint32_t f = 0;
+
+  assert (!(flags & ~(NBDKIT_FLAG_FUA | NBDKIT_FLAG_MAY_TRIM |
+                      NBDKIT_FLAG_FAST_ZERO)));
+
+  if (!(flags & NBDKIT_FLAG_MAY_TRIM))
+    f |= LIBNBD_CMD_FLAG_NO_HOLE;
+  if (flags & NBDKIT_FLAG_FUA)
+    f |= LIBNBD_CMD_FLAG_FUA;
+#if LIBNBD_HAVE_NBD_CAN_FAST_ZERO
+  if (flags & NBDKIT_FLAG_FAST_ZERO)
+    f |= LIBNBD_CMD_FLAG_FAST_ZERO;
+#else
+  assert (!(flags & NBDKIT_FLAG_FAST_ZERO));
+#endif
+  return stripe_command (handle, CMD_ZERO, NULL, count, offset, f);
+}
+
+static int
+stripe_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  const uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
+
+  assert (!(flags & ~NBDKIT_FLAG_FUA));
+  return stripe_command (handle, CMD_TRIM, NULL, count, offset, f);
+}
+
+static int
+stripe_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  assert (!flags);
+  return stripe_command (handle, CMD_CACHE, NULL, count, offset, 0);
+}
+
+/* Flush every backend in parallel; all must succeed. */
+static int
+stripe_flush (void *handle, uint32_t flags)
+{
+  struct handle *h = handle;
+  CLEANUP_FREE struct transaction *trans = NULL;
+  unsigned i;
+  uint32_t err = 0;
+
+  assert (!flags);
+  trans = calloc (h->nr_links, sizeof *trans);
+  if (trans == NULL) {
+    nbdkit_error ("calloc: %m");
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (i = 0; i < h->nr_links; ++i) {
+    struct blink *l = &h->links[i];
+
+    stripe_prepare (l, &trans[i]);
+    stripe_register (l, &trans[i], nbd_aio_flush (l->nbd, trans[i].cb, 0));
+  }
+  for (i = 0; i < h->nr_links; ++i) {
+    const uint32_t e = stripe_wait (&trans[i]);
+
+    if (e && !err)
+      err = e;
+  }
+
+  errno = err;
+  return err ? -1 : 0;
+}
+
+/* The virtual disk only supports what every backend supports. */
+static int
+stripe_can_write (void *handle)
+{
+  struct handle *h = handle;
+  unsigned i;
+
+  if (h->readonly)
+    return 0;
+  for (i = 0; i < h->nr_links; ++i) {
+    const int r = nbd_is_read_only (h->links[i].nbd);
+
+    if (r == -1) {
+      nbdkit_error ("failure to check readonly flag: %s", nbd_get_error ());
+      return -1;
+    }
+    if (r)
+      return 0;
+  }
+  return 1;
+}
+
+static int
+stripe_can_flush (void *handle)
+{
+  struct handle *h = handle;
+  unsigned i;
+
+  for (i = 0; i < h->nr_links; ++i) {
+    const int r = nbd_can_flush (h->links[i].nbd);
+
+    if (r == -1) {
+      nbdkit_error ("failure to check flush flag: %s", nbd_get_error ());
+      return -1;
+    }
+    if (!r)
+      return 0;
+  }
+  return 1;
+}
+
+static int
+stripe_can_trim (void *handle)
+{
+  struct handle *h = handle;
+  unsigned i;
+
+  for (i = 0; i < h->nr_links; ++i) {
+    const int r = nbd_can_trim (h->links[i].nbd);
+
+    if (r == -1) {
+      nbdkit_error ("failure to check trim flag: %s", nbd_get_error ());
+      return -1;
+    }
+    if (!r)
+      return 0;
+  }
+  return 1;
+}
+
+static int
+stripe_can_zero (void *handle)
+{
+  struct handle *h = handle;
+  unsigned i;
+
+  for (i = 0; i < h->nr_links; ++i) {
+    const int r = nbd_can_zero (h->links[i].nbd);
+
+    if (r == -1) {
+      nbdkit_error ("failure to check zero flag: %s", nbd_get_error ());
+      return -1;
+    }
+    if (!r)
+      return 0;
+  }
+  return 1;
+}
+
+static int
+stripe_can_fua (void *handle)
+{
+  struct handle *h = handle;
+  unsigned i;
+
+  for (i = 0; i < h->nr_links; ++i) {
+    const int r = nbd_can_fua (h->links[i].nbd);
+
+    if (r == -1) {
+      nbdkit_error ("failure to check fua flag: %s", nbd_get_error ());
+      return -1;
+    }
+    if (!r)
+      return NBDKIT_FUA_NONE;
+  }
+  return NBDKIT_FUA_NATIVE;
+}
+
+static int
+stripe_can_cache (void *handle)
+{
+  struct handle *h = handle;
+  unsigned i;
+
+  for (i = 0; i < h->nr_links; ++i) {
+    const int r = nbd_can_cache (h->links[i].nbd);
+
+    if (r == -1) {
+      nbdkit_error ("failure to check cache flag: %s", nbd_get_error ());
+      return -1;
+    }
+    if (!r)
+      return NBDKIT_CACHE_NONE;
+  }
+  return NBDKIT_CACHE_NATIVE;
+}
+
+/* Each nbdkit connection opens its own connections to the backends,
+ * and a flush fans out to all of them, so we can advertise multi-conn
+ * only when every backend does.
+ */
+static int
+stripe_can_multi_conn (void *handle)
+{
+  struct handle *h = handle;
+  unsigned i;
+
+  for (i = 0; i < h->nr_links; ++i) {
+    const int r = nbd_can_multi_conn (h->links[i].nbd);
+
+    if (r == -1) {
+      nbdkit_error ("failure to check multi-conn flag: %s", nbd_get_error ());
+      return -1;
+    }
+    if (!r)
+      return 0;
+  }
+  return 1;
+}
+
+static struct nbdkit_plugin plugin = {
+  .name               = "stripe",
+  .longname           = "nbdkit NBD striping plugin",
+  .version            = PACKAGE_VERSION,
+  .unload             = stripe_unload,
+  .config             = stripe_config,
+  .config_complete    = stripe_config_complete,
+  .config_help        = stripe_config_help,
+  .magic_config_key   = "server",
+  .open               = stripe_open,
+  .close              = stripe_close,
+  .get_size           = stripe_get_size,
+  .can_write          = stripe_can_write,
+  .can_flush          = stripe_can_flush,
+  .can_trim           = stripe_can_trim,
+  .can_zero           = stripe_can_zero,
+  .can_fua            = stripe_can_fua,
+  .can_cache          = stripe_can_cache,
+  .can_multi_conn     = stripe_can_multi_conn,
+  .pread              = stripe_pread,
+  .pwrite             = stripe_pwrite,
+  .zero               = stripe_zero,
+  .trim               = stripe_trim,
+  .cache              = stripe_cache,
+  .flush              = stripe_flush,
+  .errno_is_preserved = 1,
+};
+
+NBDKIT_REGISTER_PLUGIN(plugin)
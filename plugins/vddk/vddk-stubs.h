@@ -122,3 +122,15 @@ OPTIONAL_STUB (VixDiskLib_FreeBlockList,
 OPTIONAL_STUB (VixDiskLib_AllocateConnectParams,
                VixDiskLibConnectParams *,
                (void));
+OPTIONAL_STUB (VixDiskLib_ReadAsync,
+               VixError,
+               (VixDiskLibHandle diskHandle,
+                uint64_t start_sector, uint64_t nr_sectors,
+                unsigned char *buf,
+                VixDiskLibCompletionCB callback, void *data));
+OPTIONAL_STUB (VixDiskLib_WriteAsync,
+               VixError,
+               (VixDiskLibHandle diskHandle,
+                uint64_t start_sector, uint64_t nr_sectors,
+                const unsigned char *buf,
+                VixDiskLibCompletionCB callback, void *data));
@@ -496,23 +496,127 @@ vddk_dump_plugin (void)
 /* The rules on threads and VDDK are here:
  * https://code.vmware.com/docs/11750/virtual-disk-development-kit-programming-guide/GUID-6BE903E8-DC70-46D9-98E4-E34A2002C2AD.html
  *
- * Before nbdkit 1.22 we used SERIALIZE_ALL_REQUESTS.  Since nbdkit
- * 1.22 we changed this to SERIALIZE_REQUESTS and added a mutex around
- * calls to VixDiskLib_Open and VixDiskLib_Close.  This is not quite
- * within the letter of the rules, but is within the spirit.
+ * Before nbdkit 1.22 we used SERIALIZE_ALL_REQUESTS, then
+ * SERIALIZE_REQUESTS with a mutex around calls to VixDiskLib_Open and
+ * VixDiskLib_Close.  Now all VDDK calls on a disk handle are issued
+ * by a background worker thread (see below), which satisfies the
+ * rules because only one thread ever touches the handle, so we can
+ * use the parallel thread model.  The mutex around open/close calls
+ * is still required.
  */
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Lock protecting open/close calls - see above. */
 static pthread_mutex_t open_close_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Commands.
+ *
+ * Request threads do not call VDDK directly.  Instead each command is
+ * appended to the per-handle command queue, and the background worker
+ * thread issues it.  Reads and writes use the asynchronous calls
+ * (added in VDDK 6.7) when available, so many of them can be in
+ * flight at once even though a single thread issues them; the other
+ * commands are synchronous on the worker thread.  The request thread
+ * sleeps on the command's condition variable until the completion
+ * callback (or the worker thread) signals it.
+ */
+enum command_type { GET_SIZE, READ, WRITE, FLUSH, CAN_EXTENTS, EXTENTS, STOP };
+
+struct command {
+  struct command *next;         /* next command in the queue */
+  enum command_type type;       /* command type */
+
+  void *ptr;                    /* buffer, extents list, return value */
+  uint32_t count;               /* READ, WRITE: number of sectors;
+                                   EXTENTS: byte count */
+  uint64_t offset;              /* READ, WRITE: start sector;
+                                   EXTENTS: byte offset */
+  uint32_t flags;               /* EXTENTS only */
+
+  pthread_mutex_t mutex;        /* completion mutex */
+  pthread_cond_t cond;          /* completion condition */
+  enum { SUBMITTED, SUCCEEDED, FAILED } status;
+  VixError error;               /* set when status == FAILED */
+};
+
 /* The per-connection handle. */
 struct vddk_handle {
   VixDiskLibConnectParams *params; /* connection parameters */
   VixDiskLibConnection connection; /* connection */
   VixDiskLibHandle handle;         /* disk handle */
+
+  pthread_t thread;                /* the worker thread */
+  pthread_mutex_t commands_lock;   /* lock protecting command queue */
+  pthread_cond_t commands_cond;    /* signalled when a command is added */
+  struct command *commands;        /* head of command queue */
+  struct command *commands_tail;   /* tail of command queue */
+
+  int64_t size;                    /* disk size in bytes */
+
+  /* Cache of the last VixDiskLib_QueryAllocatedBlocks result, in
+   * bytes.  Only the worker thread touches these fields; writes
+   * invalidate the cache because they can allocate new blocks.
+   * cache_end == 0 means the cache is empty.
+   */
+  uint64_t cache_start, cache_end;
+  VixDiskLibBlock *cache_blocks;   /* allocated blocks in the range */
+  size_t nr_cache_blocks;
 };
 
+static void *vddk_worker_thread (void *handle);
+static int64_t do_get_size (struct vddk_handle *h);
+
+/* Called from the worker thread or a VDDK completion thread when a
+ * command has finished.
+ */
+static void
+complete_command (void *vp, VixError result)
+{
+  struct command *cmd = vp;
+
+  if (vddk_debug_datapath)
+    nbdkit_debug ("command %d completed, result %" PRIu64,
+                  cmd->type, result);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cmd->mutex);
+  if (result == VIX_OK)
+    cmd->status = SUCCEEDED;
+  else {
+    cmd->status = FAILED;
+    cmd->error = result;
+  }
+  pthread_cond_signal (&cmd->cond);
+}
+
+/* Send a command to the worker thread and wait for it to complete.
+ * Returns 0 on success or -1 if the command failed (the caller
+ * reports the error).
+ */
+static int
+send_command_and_wait (struct vddk_handle *h, struct command *cmd)
+{
+  /* Add the command to the command queue. */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->commands_lock);
+    cmd->next = NULL;
+    if (h->commands_tail != NULL)
+      h->commands_tail->next = cmd;
+    else
+      h->commands = cmd;
+    h->commands_tail = cmd;
+    pthread_cond_signal (&h->commands_cond);
+  }
+
+  /* Wait for the command to be completed. */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cmd->mutex);
+    while (cmd->status == SUBMITTED)
+      pthread_cond_wait (&cmd->cond, &cmd->mutex);
+  }
+
+  return cmd->status == SUCCEEDED ? 0 : -1;
+}
+
 static inline VixDiskLibConnectParams *
 allocate_connect_params (void)
 {
@@ -556,6 +660,12 @@ vddk_open (int readonly)
     nbdkit_error ("malloc: %m");
     return NULL;
   }
+  pthread_mutex_init (&h->commands_lock, NULL);
+  pthread_cond_init (&h->commands_cond, NULL);
+  h->commands = h->commands_tail = NULL;
+  h->cache_start = h->cache_end = 0;
+  h->cache_blocks = NULL;
+  h->nr_cache_blocks = 0;
 
   h->params = allocate_connect_params ();
   if (h->params == NULL) {
@@ -629,8 +739,27 @@ vddk_open (int readonly)
   nbdkit_debug ("transport mode: %s",
                 VixDiskLib_GetTransportMode (h->handle));
 
+  /* Snapshot the size of the disk, which the extents cache needs.
+   * This is safe without the worker thread because nothing else is
+   * using the handle yet.
+   */
+  h->size = do_get_size (h);
+  if (h->size == -1)
+    goto err3;
+
+  /* Start the worker thread which issues all VDDK calls on this
+   * handle.
+   */
+  if ((errno = pthread_create (&h->thread, NULL, vddk_worker_thread, h))) {
+    nbdkit_error ("failed to create worker thread: %m");
+    goto err3;
+  }
+
   return h;
 
+ err3:
+  DEBUG_CALL ("VixDiskLib_Close", "handle");
+  VixDiskLib_Close (h->handle);
  err2:
   DEBUG_CALL ("VixDiskLib_Disconnect", "connection");
   VixDiskLib_Disconnect (h->connection);
@@ -647,20 +776,28 @@ vddk_close (void *handle)
 {
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&open_close_lock);
   struct vddk_handle *h = handle;
+  struct command stop = { .type = STOP };
+
+  pthread_mutex_init (&stop.mutex, NULL);
+  pthread_cond_init (&stop.cond, NULL);
+  send_command_and_wait (h, &stop);
+  pthread_join (h->thread, NULL);
 
   DEBUG_CALL ("VixDiskLib_Close", "handle");
   VixDiskLib_Close (h->handle);
   DEBUG_CALL ("VixDiskLib_Disconnect", "connection");
   VixDiskLib_Disconnect (h->connection);
   free_connect_params (h->params);
+  pthread_mutex_destroy (&h->commands_lock);
+  pthread_cond_destroy (&h->commands_cond);
+  free (h->cache_blocks);
   free (h);
 }
 
-/* Get the file size. */
+/* Get the file size, called on the worker thread. */
 static int64_t
-vddk_get_size (void *handle)
+do_get_size (struct vddk_handle *h)
 {
-  struct vddk_handle *h = handle;
   VixDiskLibInfo *info;
   VixError err;
   uint64_t size;
@@ -700,6 +837,21 @@ vddk_get_size (void *handle)
   return (int64_t) size;
 }
 
+/* Get the file size. */
+static int64_t
+vddk_get_size (void *handle)
+{
+  struct vddk_handle *h = handle;
+  int64_t size = -1;
+  struct command cmd = { .type = GET_SIZE, .ptr = &size,
+                         .mutex = PTHREAD_MUTEX_INITIALIZER,
+                         .cond = PTHREAD_COND_INITIALIZER };
+
+  if (send_command_and_wait (h, &cmd) == -1)
+    return -1;
+  return size;
+}
+
 /* Read data from the file.
  *
  * Note that reads have to be aligned to sectors (XXX).
@@ -709,7 +861,9 @@ vddk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
             uint32_t flags)
 {
   struct vddk_handle *h = handle;
-  VixError err;
+  struct command cmd = { .type = READ, .ptr = buf,
+                         .mutex = PTHREAD_MUTEX_INITIALIZER,
+                         .cond = PTHREAD_COND_INITIALIZER };
 
   /* Align to sectors. */
   if (!IS_ALIGNED (offset, VIXDISKLIB_SECTOR_SIZE)) {
@@ -720,16 +874,11 @@ vddk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
     nbdkit_error ("%s is not aligned to sectors", "read");
     return -1;
   }
-  offset /= VIXDISKLIB_SECTOR_SIZE;
-  count /= VIXDISKLIB_SECTOR_SIZE;
+  cmd.offset = offset / VIXDISKLIB_SECTOR_SIZE;
+  cmd.count = count / VIXDISKLIB_SECTOR_SIZE;
 
-  DEBUG_CALL_DATAPATH ("VixDiskLib_Read",
-                       "handle, %" PRIu64 " sectors, "
-                       "%" PRIu32 " sectors, buffer",
-                       offset, count);
-  err = VixDiskLib_Read (h->handle, offset, count, buf);
-  if (err != VIX_OK) {
-    VDDK_ERROR (err, "VixDiskLib_Read");
+  if (send_command_and_wait (h, &cmd) == -1) {
+    VDDK_ERROR (cmd.error, "VixDiskLib_Read");
     return -1;
   }
 
@@ -748,7 +897,9 @@ vddk_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 {
   const bool fua = flags & NBDKIT_FLAG_FUA;
   struct vddk_handle *h = handle;
-  VixError err;
+  struct command cmd = { .type = WRITE, .ptr = (void *) buf,
+                         .mutex = PTHREAD_MUTEX_INITIALIZER,
+                         .cond = PTHREAD_COND_INITIALIZER };
 
   /* Align to sectors. */
   if (!IS_ALIGNED (offset, VIXDISKLIB_SECTOR_SIZE)) {
@@ -759,16 +910,11 @@ vddk_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
     nbdkit_error ("%s is not aligned to sectors", "write");
     return -1;
   }
-  offset /= VIXDISKLIB_SECTOR_SIZE;
-  count /= VIXDISKLIB_SECTOR_SIZE;
+  cmd.offset = offset / VIXDISKLIB_SECTOR_SIZE;
+  cmd.count = count / VIXDISKLIB_SECTOR_SIZE;
 
-  DEBUG_CALL_DATAPATH ("VixDiskLib_Write",
-                       "handle, %" PRIu64 " sectors, "
-                       "%" PRIu32 " sectors, buffer",
-                       offset, count);
-  err = VixDiskLib_Write (h->handle, offset, count, buf);
-  if (err != VIX_OK) {
-    VDDK_ERROR (err, "VixDiskLib_Write");
+  if (send_command_and_wait (h, &cmd) == -1) {
+    VDDK_ERROR (cmd.error, "VixDiskLib_Write");
     return -1;
   }
 
@@ -778,11 +924,10 @@ vddk_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
   return 0;
 }
 
-/* Flush data to the file. */
+/* Flush data to the file, called on the worker thread. */
 static int
-vddk_flush (void *handle, uint32_t flags)
+do_flush (struct vddk_handle *h)
 {
-  struct vddk_handle *h = handle;
   VixError err;
 
   /* The Flush call was not available in VDDK < 6.0 so this is simply
@@ -801,10 +946,22 @@ vddk_flush (void *handle, uint32_t flags)
   return 0;
 }
 
+/* Flush data to the file. */
 static int
-vddk_can_extents (void *handle)
+vddk_flush (void *handle, uint32_t flags)
 {
   struct vddk_handle *h = handle;
+  struct command cmd = { .type = FLUSH,
+                         .mutex = PTHREAD_MUTEX_INITIALIZER,
+                         .cond = PTHREAD_COND_INITIALIZER };
+
+  return send_command_and_wait (h, &cmd);
+}
+
+/* Test extents support, called on the worker thread. */
+static int
+do_can_extents (struct vddk_handle *h)
+{
   VixError err;
   VixDiskLibBlockList *block_list;
 
@@ -851,6 +1008,20 @@ vddk_can_extents (void *handle)
   return 1;
 }
 
+static int
+vddk_can_extents (void *handle)
+{
+  struct vddk_handle *h = handle;
+  int can_extents = 0;
+  struct command cmd = { .type = CAN_EXTENTS, .ptr = &can_extents,
+                         .mutex = PTHREAD_MUTEX_INITIALIZER,
+                         .cond = PTHREAD_COND_INITIALIZER };
+
+  if (send_command_and_wait (h, &cmd) == -1)
+    return -1;
+  return can_extents;
+}
+
 static int
 add_extent (struct nbdkit_extents *extents,
             uint64_t *position, uint64_t next_position, bool is_hole)
@@ -881,83 +1052,130 @@ add_extent (struct nbdkit_extents *extents,
   return 0;
 }
 
+/* The QueryAllocatedBlocks call is expensive, so on a cache miss
+ * fetch a large chunk-aligned range in one call and keep the answer
+ * for later extents requests, which usually walk the disk
+ * sequentially.
+ */
+#define EXTENTS_CACHE_CHUNKS 2048 /* 128M of disk per VDDK call */
+
 static int
-vddk_extents (void *handle, uint32_t count, uint64_t offset, uint32_t flags,
-              struct nbdkit_extents *extents)
+fill_extents_cache (struct vddk_handle *h, uint64_t position, uint64_t end)
 {
-  struct vddk_handle *h = handle;
-  bool req_one = flags & NBDKIT_FLAG_REQ_ONE;
-  uint64_t position, end, start_sector;
-
-  position = offset;
-  end = offset + count;
+  const uint64_t chunk_bytes =
+    VIXDISKLIB_MIN_CHUNK_SIZE * VIXDISKLIB_SECTOR_SIZE;
+  uint64_t start_sector, nr_chunks, nr_sectors;
+  VixDiskLibBlockList *block_list;
+  VixError err;
+  uint32_t i;
 
   /* We can only query whole chunks.  Therefore start with the first
-   * chunk before offset.
+   * chunk before position.
    */
-  start_sector =
-    ROUND_DOWN (offset, VIXDISKLIB_MIN_CHUNK_SIZE * VIXDISKLIB_SECTOR_SIZE)
-    / VIXDISKLIB_SECTOR_SIZE;
-  while (start_sector * VIXDISKLIB_SECTOR_SIZE < end) {
-    VixError err;
-    uint32_t i;
-    uint64_t nr_chunks, nr_sectors;
-    VixDiskLibBlockList *block_list;
-
-    assert (IS_ALIGNED (start_sector, VIXDISKLIB_MIN_CHUNK_SIZE));
-
-    nr_chunks =
-      ROUND_UP (end - start_sector * VIXDISKLIB_SECTOR_SIZE,
-                VIXDISKLIB_MIN_CHUNK_SIZE * VIXDISKLIB_SECTOR_SIZE)
-      / (VIXDISKLIB_MIN_CHUNK_SIZE * VIXDISKLIB_SECTOR_SIZE);
-    nr_chunks = MIN (nr_chunks, VIXDISKLIB_MAX_CHUNK_NUMBER);
-    nr_sectors = nr_chunks * VIXDISKLIB_MIN_CHUNK_SIZE;
-
-    DEBUG_CALL ("VixDiskLib_QueryAllocatedBlocks",
-                "handle, %" PRIu64 " sectors, %" PRIu64 " sectors, "
-                "%d sectors",
-                start_sector, nr_sectors, VIXDISKLIB_MIN_CHUNK_SIZE);
-    err = VixDiskLib_QueryAllocatedBlocks (h->handle,
-                                           start_sector, nr_sectors,
-                                           VIXDISKLIB_MIN_CHUNK_SIZE,
-                                           &block_list);
-    if (err != VIX_OK) {
-      VDDK_ERROR (err, "VixDiskLib_QueryAllocatedBlocks");
+  start_sector = ROUND_DOWN (position, chunk_bytes) / VIXDISKLIB_SECTOR_SIZE;
+  assert (IS_ALIGNED (start_sector, VIXDISKLIB_MIN_CHUNK_SIZE));
+
+  nr_chunks = ROUND_UP (end - start_sector * VIXDISKLIB_SECTOR_SIZE,
+                        chunk_bytes) / chunk_bytes;
+  nr_chunks = MAX (nr_chunks, (uint64_t) EXTENTS_CACHE_CHUNKS);
+  nr_chunks = MIN (nr_chunks, VIXDISKLIB_MAX_CHUNK_NUMBER);
+  nr_sectors = MIN (nr_chunks * VIXDISKLIB_MIN_CHUNK_SIZE,
+                    (uint64_t) h->size / VIXDISKLIB_SECTOR_SIZE
+                    - start_sector);
+
+  DEBUG_CALL ("VixDiskLib_QueryAllocatedBlocks",
+              "handle, %" PRIu64 " sectors, %" PRIu64 " sectors, "
+              "%d sectors",
+              start_sector, nr_sectors, VIXDISKLIB_MIN_CHUNK_SIZE);
+  err = VixDiskLib_QueryAllocatedBlocks (h->handle,
+                                         start_sector, nr_sectors,
+                                         VIXDISKLIB_MIN_CHUNK_SIZE,
+                                         &block_list);
+  if (err != VIX_OK) {
+    VDDK_ERROR (err, "VixDiskLib_QueryAllocatedBlocks");
+    return -1;
+  }
+
+  if (block_list->numBlocks > 0) {
+    VixDiskLibBlock *p;
+
+    p = realloc (h->cache_blocks,
+                 sizeof (VixDiskLibBlock) * block_list->numBlocks);
+    if (p == NULL) {
+      nbdkit_error ("realloc: %m");
+      DEBUG_CALL ("VixDiskLib_FreeBlockList", "block_list");
+      VixDiskLib_FreeBlockList (block_list);
       return -1;
     }
-
+    h->cache_blocks = p;
     for (i = 0; i < block_list->numBlocks; ++i) {
-      uint64_t blk_offset, blk_length;
+      h->cache_blocks[i].offset =
+        block_list->blocks[i].offset * VIXDISKLIB_SECTOR_SIZE;
+      h->cache_blocks[i].length =
+        block_list->blocks[i].length * VIXDISKLIB_SECTOR_SIZE;
+    }
+  }
+  h->nr_cache_blocks = block_list->numBlocks;
+  h->cache_start = start_sector * VIXDISKLIB_SECTOR_SIZE;
+  h->cache_end = (start_sector + nr_sectors) * VIXDISKLIB_SECTOR_SIZE;
 
-      blk_offset = block_list->blocks[i].offset * VIXDISKLIB_SECTOR_SIZE;
-      blk_length = block_list->blocks[i].length * VIXDISKLIB_SECTOR_SIZE;
+  DEBUG_CALL ("VixDiskLib_FreeBlockList", "block_list");
+  VixDiskLib_FreeBlockList (block_list);
 
-      /* The query returns allocated blocks.  We must insert holes
-       * between the blocks as necessary.
-       */
-      if ((position < blk_offset &&
-           add_extent (extents, &position, blk_offset, true) == -1) ||
-          (add_extent (extents,
-                       &position, blk_offset + blk_length, false) == -1)) {
-        DEBUG_CALL ("VixDiskLib_FreeBlockList", "block_list");
-        VixDiskLib_FreeBlockList (block_list);
+  if (vddk_debug_extents)
+    nbdkit_debug ("extents cache covers [%" PRIu64 "...%" PRIu64 "], "
+                  "%zu allocated blocks",
+                  h->cache_start, h->cache_end - 1, h->nr_cache_blocks);
+
+  return 0;
+}
+
+/* Emit extents from the cache starting at *position and advancing it
+ * to the end of the cached range, inserting holes between the
+ * allocated blocks as necessary.
+ */
+static int
+emit_cached_extents (struct vddk_handle *h, uint64_t *position,
+                     struct nbdkit_extents *extents)
+{
+  size_t i;
+
+  for (i = 0; i < h->nr_cache_blocks; ++i) {
+    const uint64_t blk_offset = h->cache_blocks[i].offset;
+    const uint64_t blk_end = blk_offset + h->cache_blocks[i].length;
+
+    if (blk_end <= *position)
+      continue;
+    if ((*position < blk_offset &&
+         add_extent (extents, position, blk_offset, true) == -1) ||
+        add_extent (extents, position, blk_end, false) == -1)
+      return -1;
+  }
+
+  /* There's an implicit hole after the cached blocks, up to the end
+   * of the cached range.
+   */
+  return add_extent (extents, position, h->cache_end, true);
+}
+
+/* Read the extents, called on the worker thread. */
+static int
+do_extents (struct vddk_handle *h, uint32_t count, uint64_t offset,
+            uint32_t flags, struct nbdkit_extents *extents)
+{
+  const bool req_one = flags & NBDKIT_FLAG_REQ_ONE;
+  const uint64_t end = offset + count;
+  uint64_t position = offset;
+
+  while (position < end) {
+    if (position < h->cache_start || position >= h->cache_end) {
+      if (fill_extents_cache (h, position, end) == -1)
         return -1;
-      }
     }
-    DEBUG_CALL ("VixDiskLib_FreeBlockList", "block_list");
-    VixDiskLib_FreeBlockList (block_list);
 
-    /* There's an implicit hole after the returned list of blocks, up
-     * to the end of the QueryAllocatedBlocks request.
-     */
-    if (add_extent (extents,
-                    &position,
-                    (start_sector + nr_sectors) * VIXDISKLIB_SECTOR_SIZE,
-                    true) == -1)
+    if (emit_cached_extents (h, &position, extents) == -1)
       return -1;
 
-    start_sector += nr_sectors;
-
     /* If one extent was requested, as long as we've added an extent
      * overlapping the original offset we're done.
      */
@@ -968,6 +1186,124 @@ vddk_extents (void *handle, uint32_t count, uint64_t offset, uint32_t flags,
   return 0;
 }
 
+static int
+vddk_extents (void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+              struct nbdkit_extents *extents)
+{
+  struct vddk_handle *h = handle;
+  struct command cmd = { .type = EXTENTS, .ptr = extents,
+                         .count = count, .offset = offset, .flags = flags,
+                         .mutex = PTHREAD_MUTEX_INITIALIZER,
+                         .cond = PTHREAD_COND_INITIALIZER };
+
+  return send_command_and_wait (h, &cmd);
+}
+
+/* The worker thread, one per open handle.  It owns all VDDK calls on
+ * the handle: it pops commands off the queue and issues them, using
+ * the asynchronous calls for reads and writes when the library
+ * provides them so that many commands can be in flight at once.
+ */
+static void *
+vddk_worker_thread (void *handle)
+{
+  struct vddk_handle *h = handle;
+  bool stop = false;
+
+  while (!stop) {
+    struct command *cmd;
+    VixError err;
+
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->commands_lock);
+      while (h->commands == NULL)
+        pthread_cond_wait (&h->commands_cond, &h->commands_lock);
+      cmd = h->commands;
+      h->commands = cmd->next;
+      if (h->commands == NULL)
+        h->commands_tail = NULL;
+    }
+
+    switch (cmd->type) {
+    case GET_SIZE: {
+      int64_t size = do_get_size (h);
+      *(int64_t *) cmd->ptr = size;
+      complete_command (cmd, size == -1 ? VIX_E_FAIL : VIX_OK);
+      break;
+    }
+
+    case READ:
+      if (VixDiskLib_ReadAsync != NULL) {
+        DEBUG_CALL_DATAPATH ("VixDiskLib_ReadAsync",
+                             "handle, %" PRIu64 " sectors, "
+                             "%" PRIu32 " sectors, buffer, callback, cmd",
+                             cmd->offset, cmd->count);
+        err = VixDiskLib_ReadAsync (h->handle, cmd->offset, cmd->count,
+                                    cmd->ptr, complete_command, cmd);
+        if (err != VIX_ASYNC)
+          complete_command (cmd, err);
+      }
+      else {
+        DEBUG_CALL_DATAPATH ("VixDiskLib_Read",
+                             "handle, %" PRIu64 " sectors, "
+                             "%" PRIu32 " sectors, buffer",
+                             cmd->offset, cmd->count);
+        err = VixDiskLib_Read (h->handle, cmd->offset, cmd->count, cmd->ptr);
+        complete_command (cmd, err);
+      }
+      break;
+
+    case WRITE:
+      /* Writes can allocate new blocks, invalidating the extents
+       * cache.
+       */
+      h->cache_start = h->cache_end = 0;
+
+      if (VixDiskLib_WriteAsync != NULL) {
+        DEBUG_CALL_DATAPATH ("VixDiskLib_WriteAsync",
+                             "handle, %" PRIu64 " sectors, "
+                             "%" PRIu32 " sectors, buffer, callback, cmd",
+                             cmd->offset, cmd->count);
+        err = VixDiskLib_WriteAsync (h->handle, cmd->offset, cmd->count,
+                                     cmd->ptr, complete_command, cmd);
+        if (err != VIX_ASYNC)
+          complete_command (cmd, err);
+      }
+      else {
+        DEBUG_CALL_DATAPATH ("VixDiskLib_Write",
+                             "handle, %" PRIu64 " sectors, "
+                             "%" PRIu32 " sectors, buffer",
+                             cmd->offset, cmd->count);
+        err = VixDiskLib_Write (h->handle, cmd->offset, cmd->count, cmd->ptr);
+        complete_command (cmd, err);
+      }
+      break;
+
+    case FLUSH:
+      complete_command (cmd, do_flush (h) == -1 ? VIX_E_FAIL : VIX_OK);
+      break;
+
+    case CAN_EXTENTS:
+      *(int *) cmd->ptr = do_can_extents (h);
+      complete_command (cmd, VIX_OK);
+      break;
+
+    case EXTENTS:
+      complete_command (cmd,
+                        do_extents (h, cmd->count, cmd->offset, cmd->flags,
+                                    cmd->ptr) == -1 ? VIX_E_FAIL : VIX_OK);
+      break;
+
+    case STOP:
+      complete_command (cmd, VIX_OK);
+      stop = true;
+      break;
+    }
+  }
+
+  return NULL;
+}
+
 static struct nbdkit_plugin plugin = {
   .name              = "vddk",
   .longname          = "VMware VDDK plugin",
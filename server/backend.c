@@ -42,6 +42,8 @@
 
 #include "ascii-ctype.h"
 #include "minmax.h"
+#include "probes.h"
+#include "vector.h"
 
 #include "internal.h"
 
@@ -68,6 +70,7 @@ backend_init (struct backend *b, struct backend *next, size_t index,
               const char *filename, void *dl, const char *type)
 {
   b->next = next;
+  b->pread_target = b;
   b->i = index;
   b->type = type;
   b->filename = strdup (filename);
@@ -327,14 +330,188 @@ backend_close (struct backend *b)
 }
 
 bool
-backend_valid_range (struct backend *b, uint64_t offset, uint32_t count)
+backend_valid_range (struct backend *b, uint64_t offset, uint64_t count)
 {
   GET_CONN;
   struct handle *h = get_handle (conn, b->i);
 
   assert (h->exportsize <= INT64_MAX); /* Guaranteed by negotiation phase */
+  /* Written so that no sum can overflow: count may be a full 64 bit
+   * value from an extended headers client.
+   */
   return count > 0 && offset <= h->exportsize &&
-    offset + count <= h->exportsize;
+    count <= h->exportsize - offset;
+}
+
+/* Cache of capability probe results, keyed by export name.
+ *
+ * The first connection to an export interrogates the whole
+ * filter+plugin chain for can_write, can_zero, can_fua and friends,
+ * and some plugins (sh, eval) fork a process per probe.  The answers
+ * are a property of the export, not of the connection, so record them
+ * after the first negotiation and use them to seed the per-connection
+ * handle on subsequent opens, skipping the chain traversals.
+ *
+ * TLS and plain connections can see different exports (and plugins
+ * may vary capabilities on nbdkit_is_tls), so the TLS state is part
+ * of the key.  read_only is global so it does not need to be.
+ *
+ * There is one entry per layer of the chain (keyed by backend->i),
+ * not just for the top, because filters call directly into the layer
+ * below and those calls assert that the layer's own capabilities have
+ * been probed.  Seeding only the top would leave the inner layers
+ * unprobed on every connection after the first.
+ *
+ * The export name is client-controlled (up to NBD_MAX_STRING bytes
+ * per entry), so the cache must not grow without bound: it is capped
+ * at CAPABILITY_CACHE_MAX entries and the least recently used entry
+ * is reused once full, like the TLS session ticket cache in crypto.c.
+ * A client probing many export names only churns the cache; memory
+ * stays bounded.
+ */
+#define CAPABILITY_CACHE_MAX 64
+
+struct capability_cache_entry {
+  char *exportname;
+  bool tls;
+  size_t backend_i;
+  uint64_t last_used;           /* for LRU reuse when the cache is full */
+  int can_write, can_flush, is_rotational, can_trim, can_zero,
+    can_fast_zero, can_fua, can_multi_conn, can_extents, can_cache;
+};
+DEFINE_VECTOR_TYPE(capability_cache, struct capability_cache_entry);
+
+static capability_cache cap_cache = empty_vector;
+static uint64_t cap_cache_clock;
+static pthread_mutex_t cap_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Called with cap_cache_lock held. */
+static struct capability_cache_entry *
+capability_cache_find (const char *exportname, bool tls, size_t backend_i)
+{
+  size_t i;
+
+  for (i = 0; i < cap_cache.size; ++i) {
+    struct capability_cache_entry *e = &cap_cache.ptr[i];
+    if (e->tls == tls && e->backend_i == backend_i &&
+        strcmp (e->exportname, exportname) == 0) {
+      e->last_used = ++cap_cache_clock;
+      return e;
+    }
+  }
+  return NULL;
+}
+
+void
+backend_seed_capabilities (struct backend *b)
+{
+  GET_CONN;
+
+  if (conn->exportname == NULL)
+    return;
+
+  ACQUIRE_ADAPTIVE_LOCK_FOR_CURRENT_SCOPE (&cap_cache_lock);
+
+  for (; b != NULL; b = b->next) {
+    struct handle *h = get_handle (conn, b->i);
+    const struct capability_cache_entry *e;
+
+    assert (h->handle && (h->state & HANDLE_CONNECTED));
+    e = capability_cache_find (conn->exportname, conn->using_tls, b->i);
+    if (e == NULL)
+      continue;
+
+    controlpath_debug ("%s: seeding capabilities for export \"%s\" from cache",
+                       b->name, conn->exportname);
+
+    /* Don't overwrite anything already determined for this connection
+     * (eg. can_write forced to 0 by -r).
+     */
+    if (h->can_write == -1) h->can_write = e->can_write;
+    if (h->can_flush == -1) h->can_flush = e->can_flush;
+    if (h->is_rotational == -1) h->is_rotational = e->is_rotational;
+    if (h->can_trim == -1) h->can_trim = e->can_trim;
+    if (h->can_zero == -1) h->can_zero = e->can_zero;
+    if (h->can_fast_zero == -1) h->can_fast_zero = e->can_fast_zero;
+    if (h->can_fua == -1) h->can_fua = e->can_fua;
+    if (h->can_multi_conn == -1) h->can_multi_conn = e->can_multi_conn;
+    if (h->can_extents == -1) h->can_extents = e->can_extents;
+    if (h->can_cache == -1) h->can_cache = e->can_cache;
+  }
+}
+
+void
+backend_store_capabilities (struct backend *b)
+{
+  GET_CONN;
+
+  if (conn->exportname == NULL)
+    return;
+
+  ACQUIRE_ADAPTIVE_LOCK_FOR_CURRENT_SCOPE (&cap_cache_lock);
+
+  for (; b != NULL; b = b->next) {
+    struct handle *h = get_handle (conn, b->i);
+    struct capability_cache_entry *e;
+
+    assert (h->handle && (h->state & HANDLE_CONNECTED));
+    e = capability_cache_find (conn->exportname, conn->using_tls, b->i);
+    if (e == NULL) {
+      char *exportname = strdup (conn->exportname);
+
+      if (exportname == NULL)
+        return;                 /* Not an error, just don't cache. */
+
+      if (cap_cache.size >= CAPABILITY_CACHE_MAX) {
+        /* Cache is full: reuse the least recently used entry. */
+        size_t i;
+
+        e = &cap_cache.ptr[0];
+        for (i = 1; i < cap_cache.size; ++i)
+          if (cap_cache.ptr[i].last_used < e->last_used)
+            e = &cap_cache.ptr[i];
+        free (e->exportname);
+      }
+      else {
+        struct capability_cache_entry new_entry = { 0 };
+
+        if (capability_cache_append (&cap_cache, new_entry) == -1) {
+          free (exportname);
+          return;
+        }
+        e = &cap_cache.ptr[cap_cache.size-1];
+      }
+      e->exportname = exportname;
+      e->tls = conn->using_tls;
+      e->backend_i = b->i;
+      e->last_used = ++cap_cache_clock;
+    }
+
+    e->can_write = h->can_write;
+    e->can_flush = h->can_flush;
+    e->is_rotational = h->is_rotational;
+    e->can_trim = h->can_trim;
+    e->can_zero = h->can_zero;
+    e->can_fast_zero = h->can_fast_zero;
+    e->can_fua = h->can_fua;
+    e->can_multi_conn = h->can_multi_conn;
+    e->can_extents = h->can_extents;
+    e->can_cache = h->can_cache;
+  }
+}
+
+/* Invalidation hook for code which knows capabilities may have
+ * changed, eg. after a filter reopens the backend.
+ */
+void
+backend_invalidate_capabilities (void)
+{
+  size_t i;
+
+  ACQUIRE_ADAPTIVE_LOCK_FOR_CURRENT_SCOPE (&cap_cache_lock);
+  for (i = 0; i < cap_cache.size; ++i)
+    free (cap_cache.ptr[i].exportname);
+  cap_cache.size = 0;
 }
 
 /* Wrappers for all callbacks in a filter's struct nbdkit_next_ops. */
@@ -345,6 +522,11 @@ backend_reopen (struct backend *b, int readonly, const char *exportname)
   controlpath_debug ("%s: reopen readonly=%d exportname=\"%s\"",
                      b->name, readonly, exportname);
 
+  /* A filter reopening the backend may change the capabilities below
+   * it, so don't let other connections use stale probe results.
+   */
+  backend_invalidate_capabilities ();
+
   if (backend_finalize (b) == -1)
     return -1;
   backend_close (b);
@@ -382,6 +564,20 @@ backend_export_description (struct backend *b)
   return s;
 }
 
+/* Prime the per-handle size cache from a value saved by an earlier
+ * open of the same export on this connection, so the handshake fast
+ * path does not call .get_size again (see protocol_common_open).
+ */
+void
+backend_set_exportsize (struct backend *b, uint64_t size)
+{
+  GET_CONN;
+  struct handle *h = get_handle (conn, b->i);
+
+  if (h->exportsize == (uint64_t) -1)
+    h->exportsize = size;
+}
+
 int64_t
 backend_get_size (struct backend *b)
 {
@@ -566,16 +762,21 @@ backend_pread (struct backend *b,
                uint32_t flags, int *err)
 {
   GET_CONN;
-  struct handle *h = get_handle (conn, b->i);
+  struct handle *h;
   int r;
 
+  b = b->pread_target;          /* elide pass-through filter layers */
+  h = get_handle (conn, b->i);
+
   assert (h->handle && (h->state & HANDLE_CONNECTED));
   assert (backend_valid_range (b, offset, count));
   assert (flags == 0);
   datapath_debug ("%s: pread count=%" PRIu32 " offset=%" PRIu64,
                   b->name, count, offset);
 
+  PROBE3 (backend_pread_start, b->name, count, offset);
   r = b->pread (b, h->handle, buf, count, offset, flags, err);
+  PROBE2 (backend_pread_done, b->name, r);
   if (r == -1)
     assert (*err);
   return r;
@@ -600,7 +801,84 @@ backend_pwrite (struct backend *b,
   datapath_debug ("%s: pwrite count=%" PRIu32 " offset=%" PRIu64 " fua=%d",
                   b->name, count, offset, fua);
 
+  PROBE3 (backend_pwrite_start, b->name, count, offset);
   r = b->pwrite (b, h->handle, buf, count, offset, flags, err);
+  PROBE2 (backend_pwrite_done, b->name, r);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+/* Total length of a scatter-gather request.  The server never builds
+ * vectors longer than a single NBD request, so the sum fits in the
+ * same uint32_t as a flat count.
+ */
+static uint32_t
+iovec_len (const struct nbdkit_iovec *iov, int iovcnt)
+{
+  uint64_t count = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; ++i)
+    count += iov[i].iov_len;
+  assert (count <= UINT32_MAX);
+  return count;
+}
+
+int
+backend_preadv (struct backend *b,
+                const struct nbdkit_iovec *iov, int iovcnt,
+                uint64_t offset, uint32_t flags, int *err)
+{
+  GET_CONN;
+  struct handle *h;
+  uint32_t count = iovec_len (iov, iovcnt);
+  int r;
+
+  b = b->pread_target;          /* elide pass-through filter layers */
+  h = get_handle (conn, b->i);
+
+  assert (h->handle && (h->state & HANDLE_CONNECTED));
+  assert (iovcnt > 0);
+  assert (backend_valid_range (b, offset, count));
+  assert (flags == 0);
+  datapath_debug ("%s: preadv count=%" PRIu32 " offset=%" PRIu64
+                  " iovcnt=%d",
+                  b->name, count, offset, iovcnt);
+
+  PROBE3 (backend_pread_start, b->name, count, offset);
+  r = b->preadv (b, h->handle, iov, iovcnt, offset, flags, err);
+  PROBE2 (backend_pread_done, b->name, r);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+int
+backend_pwritev (struct backend *b,
+                 const struct nbdkit_iovec *iov, int iovcnt,
+                 uint64_t offset, uint32_t flags, int *err)
+{
+  GET_CONN;
+  struct handle *h = get_handle (conn, b->i);
+  uint32_t count = iovec_len (iov, iovcnt);
+  bool fua = !!(flags & NBDKIT_FLAG_FUA);
+  int r;
+
+  assert (h->handle && (h->state & HANDLE_CONNECTED));
+  assert (h->can_write == 1);
+  assert (iovcnt > 0);
+  assert (backend_valid_range (b, offset, count));
+  assert (!(flags & ~NBDKIT_FLAG_FUA));
+  if (fua)
+    assert (h->can_fua > NBDKIT_FUA_NONE);
+  datapath_debug ("%s: pwritev count=%" PRIu32 " offset=%" PRIu64
+                  " iovcnt=%d fua=%d",
+                  b->name, count, offset, iovcnt, fua);
+
+  PROBE3 (backend_pwrite_start, b->name, count, offset);
+  r = b->pwritev (b, h->handle, iov, iovcnt, offset, flags, err);
+  PROBE2 (backend_pwrite_done, b->name, r);
   if (r == -1)
     assert (*err);
   return r;
@@ -717,6 +995,34 @@ backend_extents (struct backend *b,
   return r;
 }
 
+const char *
+backend_dirty_bitmap (struct backend *b)
+{
+  return b->dirty_bitmap (b);
+}
+
+int
+backend_dirty_extents (struct backend *b,
+                       uint32_t count, uint64_t offset, uint32_t flags,
+                       struct nbdkit_extents *extents, int *err)
+{
+  GET_CONN;
+  struct handle *h = get_handle (conn, b->i);
+  int r;
+
+  assert (h->handle && (h->state & HANDLE_CONNECTED));
+  assert (backend_valid_range (b, offset, count));
+  assert (!(flags & ~NBDKIT_FLAG_REQ_ONE));
+  datapath_debug ("%s: dirty_extents count=%" PRIu32 " offset=%" PRIu64
+                  " req_one=%d",
+                  b->name, count, offset, !!(flags & NBDKIT_FLAG_REQ_ONE));
+
+  r = b->dirty_extents (b, h->handle, count, offset, flags, extents, err);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
 int
 backend_cache (struct backend *b,
                uint32_t count, uint64_t offset,
@@ -750,3 +1056,93 @@ backend_cache (struct backend *b,
     assert (*err);
   return r;
 }
+
+int
+backend_can_async (struct backend *b)
+{
+  GET_CONN;
+  struct handle *h = get_handle (conn, b->i);
+
+  assert (h->handle && (h->state & HANDLE_CONNECTED));
+  return b->can_async (b, h->handle);
+}
+
+int
+backend_pread_zerocopy (struct backend *b,
+                        struct nbdkit_zerocopy_read *zc,
+                        uint32_t count, uint64_t offset,
+                        uint32_t flags, int *err)
+{
+  GET_CONN;
+  struct handle *h;
+  int r;
+
+  b = b->pread_target;          /* elide pass-through filter layers */
+  h = get_handle (conn, b->i);
+
+  assert (b->pread_zerocopy != NULL);
+  assert (h->handle && (h->state & HANDLE_CONNECTED));
+  assert (backend_valid_range (b, offset, count));
+  assert (flags == 0);
+  datapath_debug ("%s: pread_zerocopy count=%" PRIu32 " offset=%" PRIu64,
+                  b->name, count, offset);
+
+  r = b->pread_zerocopy (b, h->handle, zc, count, offset, flags, err);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+int
+backend_pread_async (struct backend *b,
+                     void *buf, uint32_t count, uint64_t offset,
+                     uint32_t flags, struct nbdkit_completion *completion,
+                     int *err)
+{
+  GET_CONN;
+  struct handle *h = get_handle (conn, b->i);
+  int r;
+
+  assert (b->pread_async != NULL);
+  assert (h->handle && (h->state & HANDLE_CONNECTED));
+  assert (backend_valid_range (b, offset, count));
+  assert (flags == 0);
+  datapath_debug ("%s: pread_async count=%" PRIu32 " offset=%" PRIu64,
+                  b->name, count, offset);
+
+  PROBE3 (backend_pread_start, b->name, count, offset);
+  r = b->pread_async (b, h->handle, buf, count, offset, flags,
+                      completion, err);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+int
+backend_pwrite_async (struct backend *b,
+                      const void *buf, uint32_t count, uint64_t offset,
+                      uint32_t flags, struct nbdkit_completion *completion,
+                      int *err)
+{
+  GET_CONN;
+  struct handle *h = get_handle (conn, b->i);
+  bool fua = !!(flags & NBDKIT_FLAG_FUA);
+  int r;
+
+  assert (b->pwrite_async != NULL);
+  assert (h->handle && (h->state & HANDLE_CONNECTED));
+  assert (h->can_write == 1);
+  assert (backend_valid_range (b, offset, count));
+  assert (!(flags & ~NBDKIT_FLAG_FUA));
+  if (fua)
+    assert (h->can_fua == NBDKIT_FUA_NATIVE);
+  datapath_debug ("%s: pwrite_async count=%" PRIu32 " offset=%" PRIu64
+                  " fua=%d", b->name, count, offset, fua);
+
+  PROBE3 (backend_pwrite_start, b->name, count, offset);
+  r = b->pwrite_async (b, h->handle, buf, count, offset, flags,
+                       completion, err);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
@@ -38,6 +38,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
+
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
 
 #include "internal.h"
 
@@ -82,6 +87,93 @@ fork_into_background (void)
   debug ("forked into background (new pid = %d)", getpid ());
 }
 
+/* PIDs of the extra server processes, only valid in the first process. */
+static pid_t *process_pids;
+static size_t nr_process_pids;
+
+/* Fork the extra server processes requested with --processes.  Called
+ * after the plugin is loaded and we have daemonized, just before the
+ * accept loop, so each process gets its own after_fork callback and
+ * plugin state.  On return the calling process may be any one of the
+ * N server processes.
+ */
+void
+fork_server_processes (sockets *socks)
+{
+  size_t i;
+
+  if (nprocesses <= 1)
+    return;
+
+  process_pids = calloc (nprocesses - 1, sizeof (pid_t));
+  if (process_pids == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+
+  debug ("forking %u server processes", nprocesses);
+
+  for (i = 1; i < nprocesses; ++i) {
+    pid_t pid = fork ();
+
+    if (pid == -1) {
+      /* Not fatal: serve with the processes created so far. */
+      perror ("fork");
+      break;
+    }
+    if (pid > 0) {
+      process_pids[nr_process_pids++] = pid;
+      continue;
+    }
+
+    /* Child. */
+    free (process_pids);
+    process_pids = NULL;
+    nr_process_pids = 0;
+
+    /* The quit pipe is shared with the other server processes.  Replace
+     * it with our own so that a byte written by a sibling's signal
+     * handler cannot leave our accept loop spinning on a readable fd.
+     */
+    close_quit_pipe ();
+    set_up_quit_pipe ();
+
+    /* On TCP/IP each process listens on its own socket bound to the
+     * same address with SO_REUSEPORT, so the kernel load-balances
+     * connections across processes.  For socket activation, Unix and
+     * vsock sockets all processes share the inherited listening socket
+     * and take turns accepting from it.
+     */
+    if (!socket_activation && !unixsocket && !vsock) {
+      size_t j;
+
+      for (j = 0; j < socks->size; ++j)
+        closesocket (socks->ptr[j]);
+      socks->size = 0;
+      bind_tcpip_socket (socks);
+    }
+    return;
+  }
+}
+
+/* Wait for the extra server processes after our own accept loop has
+ * finished.  Ask them to shut down first: a signal delivered only to
+ * this process would otherwise leave them running.
+ */
+void
+wait_server_processes (void)
+{
+  size_t i;
+
+  for (i = 0; i < nr_process_pids; ++i)
+    kill (process_pids[i], SIGTERM);
+  for (i = 0; i < nr_process_pids; ++i)
+    waitpid (process_pids[i], NULL, 0);
+  free (process_pids);
+  process_pids = NULL;
+  nr_process_pids = 0;
+}
+
 #else /* WIN32 */
 
 void
@@ -94,4 +186,15 @@ fork_into_background (void)
   NOT_IMPLEMENTED_ON_WINDOWS ("daemonizing");
 }
 
+/* --processes cannot be enabled on Windows so these are no-ops. */
+void
+fork_server_processes (sockets *socks)
+{
+}
+
+void
+wait_server_processes (void)
+{
+}
+
 #endif /* WIN32 */
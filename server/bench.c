@@ -0,0 +1,573 @@
+/* nbdkit
+ * Copyright (C) 2013-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Built-in loopback benchmark (--bench).
+ *
+ * Instead of serving clients, run a phony NBD client against the
+ * configured plugin and filter chain over an in-process socketpair
+ * (the same trick as fuzzer.c) and report IOPS and latency
+ * percentiles on stderr (stdout is redirected to /dev/null before
+ * serving, like --profile).  External load generators measure the
+ * client, the network and the server together; this isolates the
+ * server + plugin cost, so a performance regression can be bisected
+ * with nothing but nbdkit itself and a plugin.
+ *
+ * The client keeps a fixed number of requests in flight: a submitter
+ * (the main thread) builds requests against free reply slots and a
+ * reply thread retires them, timestamping each round trip into the
+ * same histogram buckets the --stats-socket reporter uses.  The
+ * server side of the socketpair is an ordinary connection, so the
+ * handshake, the request serialization locks and the reply path are
+ * all measured.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#include "internal.h"
+#include "byte-swapping.h"
+#include "nbd-protocol.h"
+#include "random.h"
+
+enum bench_pattern {
+  BENCH_READ,
+  BENCH_WRITE,
+  BENCH_ZERO,
+  BENCH_RW,                     /* 70% reads, 30% writes */
+};
+
+static const char *pattern_names[] = { "read", "write", "zero", "rw" };
+
+static enum bench_pattern pattern = BENCH_READ;
+static uint64_t blocksize = 4096;
+static unsigned queue_depth = 16;
+static unsigned seconds = 5;
+static bool sequential = false;
+
+/* Parse the --bench parameter, a comma-separated list of
+ * read|write|zero|rw, seq|random, qd=N, size=SIZE and time=SECONDS.
+ * Returns -1 after printing an error.
+ */
+int
+bench_parse (const char *arg)
+{
+  CLEANUP_FREE char *copy = strdup (arg);
+  char *tok, *saveptr = NULL;
+
+  if (copy == NULL) {
+    perror ("strdup");
+    return -1;
+  }
+
+  for (tok = strtok_r (copy, ",", &saveptr); tok != NULL;
+       tok = strtok_r (NULL, ",", &saveptr)) {
+    if (strcmp (tok, "read") == 0)
+      pattern = BENCH_READ;
+    else if (strcmp (tok, "write") == 0)
+      pattern = BENCH_WRITE;
+    else if (strcmp (tok, "zero") == 0)
+      pattern = BENCH_ZERO;
+    else if (strcmp (tok, "rw") == 0)
+      pattern = BENCH_RW;
+    else if (strcmp (tok, "seq") == 0)
+      sequential = true;
+    else if (strcmp (tok, "random") == 0)
+      sequential = false;
+    else if (strncmp (tok, "qd=", 3) == 0) {
+      if (nbdkit_parse_unsigned ("bench: qd", tok + 3, &queue_depth) == -1)
+        return -1;
+      if (queue_depth < 1 || queue_depth > 4096) {
+        fprintf (stderr, "%s: --bench: qd must be in the range 1..4096\n",
+                 program_name);
+        return -1;
+      }
+    }
+    else if (strncmp (tok, "size=", 5) == 0) {
+      int64_t t = nbdkit_parse_size (tok + 5);
+
+      if (t == -1)
+        return -1;
+      if (t < 1 || t > MAX_REQUEST_SIZE) {
+        fprintf (stderr, "%s: --bench: size must be in the range 1..%d\n",
+                 program_name, MAX_REQUEST_SIZE);
+        return -1;
+      }
+      blocksize = t;
+    }
+    else if (strncmp (tok, "time=", 5) == 0) {
+      if (nbdkit_parse_unsigned ("bench: time", tok + 5, &seconds) == -1)
+        return -1;
+      if (seconds < 1) {
+        fprintf (stderr, "%s: --bench: time must be >= 1\n", program_name);
+        return -1;
+      }
+    }
+    else {
+      fprintf (stderr, "%s: --bench: unknown parameter '%s'\n",
+               program_name, tok);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+#ifndef WIN32
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec t;
+
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec * UINT64_C (1000000000) + t.tv_nsec;
+}
+
+/* Full read/write on the blocking client socket. */
+static void
+xread (int sock, void *vbuf, size_t len)
+{
+  char *buf = vbuf;
+  ssize_t r;
+
+  while (len > 0) {
+    r = read (sock, buf, len);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      fprintf (stderr, "%s: bench: unexpected end of input from server\n",
+               program_name);
+      exit (EXIT_FAILURE);
+    }
+    buf += r;
+    len -= r;
+  }
+}
+
+static void
+xwrite (int sock, const void *vbuf, size_t len)
+{
+  const char *buf = vbuf;
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (sock, buf, len);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r == -1) {
+      perror ("bench: write");
+      exit (EXIT_FAILURE);
+    }
+    buf += r;
+    len -= r;
+  }
+}
+
+/* One in-flight request, indexed by the NBD handle. */
+struct bench_slot {
+  uint64_t start_ns;
+  uint16_t cmd;
+};
+
+static struct bench_slot *slots;
+static char *data_buffer;       /* written payload / read scratch */
+
+/* Free slot stack: the submitter pops, the reply thread pushes. */
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t free_cond = PTHREAD_COND_INITIALIZER;
+static unsigned *free_slots;
+static unsigned nr_free;
+
+static unsigned
+pop_free_slot (void)
+{
+  unsigned slot;
+
+  pthread_mutex_lock (&free_lock);
+  while (nr_free == 0)
+    pthread_cond_wait (&free_cond, &free_lock);
+  slot = free_slots[--nr_free];
+  pthread_mutex_unlock (&free_lock);
+  return slot;
+}
+
+static void
+push_free_slot (unsigned slot)
+{
+  pthread_mutex_lock (&free_lock);
+  free_slots[nr_free++] = slot;
+  pthread_cond_signal (&free_cond);
+  pthread_mutex_unlock (&free_lock);
+}
+
+/* Results, written only by the reply thread until it is joined. */
+static uint64_t total_ops, total_bytes, total_ns, errors, max_ns;
+static uint64_t buckets[STATS_BUCKETS];
+
+static int client_sock;
+
+/* Like xread, but a clean end of file before the first byte (the
+ * server closing the socket after NBD_CMD_DISC) returns false.
+ */
+static bool
+xread_or_eof (int sock, void *vbuf, size_t len)
+{
+  char *buf = vbuf;
+  ssize_t r;
+
+  r = read (sock, buf, len);
+  if (r == 0)
+    return false;
+  if (r > 0) {
+    buf += r;
+    len -= r;
+  }
+  else if (errno != EINTR) {
+    perror ("bench: read");
+    exit (EXIT_FAILURE);
+  }
+  if (len > 0)
+    xread (sock, buf, len);
+  return true;
+}
+
+static void *
+reply_thread (void *vp)
+{
+  struct nbd_simple_reply reply;
+  unsigned slot;
+  uint64_t ns;
+
+  for (;;) {
+    if (!xread_or_eof (client_sock, &reply, sizeof reply))
+      break;
+    if (be32toh (reply.magic) != NBD_SIMPLE_REPLY_MAGIC) {
+      fprintf (stderr, "%s: bench: invalid reply magic\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+    slot = be64toh (reply.handle);
+    if (slot >= queue_depth) {
+      fprintf (stderr, "%s: bench: invalid reply handle\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+
+    ns = now_ns () - slots[slot].start_ns;
+    if (be32toh (reply.error) != 0)
+      errors++;
+    else {
+      total_ops++;
+      total_bytes += blocksize;
+      total_ns += ns;
+      if (ns > max_ns)
+        max_ns = ns;
+      buckets[stats_bucket_of (ns)]++;
+      if (slots[slot].cmd == NBD_CMD_READ)
+        xread (client_sock, data_buffer, blocksize);
+    }
+
+    push_free_slot (slot);
+  }
+  return NULL;
+}
+
+/* The server side of the socketpair is served like any other
+ * connection.
+ */
+static void *
+server_thread (void *vp)
+{
+  int sock = *(int *)vp;
+
+  threadlocal_new_server_thread ();
+  handle_single_connection (sock, sock);
+  return NULL;
+}
+
+/* Fixed newstyle handshake with NBD_OPT_GO on the default export,
+ * returning the export size and flags.
+ */
+static void
+handshake (uint64_t *exportsize, uint16_t *eflags)
+{
+  struct nbd_new_handshake hs;
+  struct nbd_new_option opt;
+  struct nbd_fixed_new_option_reply reply;
+  uint32_t cflags, len;
+  const uint32_t exportnamelen = 0;
+  const uint16_t nrinfos = 0;
+  char payload[512];
+
+  xread (client_sock, &hs, sizeof hs);
+  if (be64toh (hs.nbdmagic) != NBD_MAGIC ||
+      be64toh (hs.version) != NBD_NEW_VERSION) {
+    fprintf (stderr, "%s: bench: unexpected handshake magic\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  cflags = htobe32 (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  xwrite (client_sock, &cflags, sizeof cflags);
+
+  opt.version = htobe64 (NBD_NEW_VERSION);
+  opt.option = htobe32 (NBD_OPT_GO);
+  opt.optlen = htobe32 (sizeof exportnamelen + sizeof nrinfos);
+  xwrite (client_sock, &opt, sizeof opt);
+  xwrite (client_sock, &exportnamelen, sizeof exportnamelen);
+  xwrite (client_sock, &nrinfos, sizeof nrinfos);
+
+  for (;;) {
+    xread (client_sock, &reply, sizeof reply);
+    len = be32toh (reply.replylen);
+    if (len > sizeof payload) {
+      fprintf (stderr, "%s: bench: option reply too long\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+    if (len > 0)
+      xread (client_sock, payload, len);
+
+    switch (be32toh (reply.reply)) {
+    case NBD_REP_ACK:
+      return;
+    case NBD_REP_INFO:
+      if (len >= sizeof (struct nbd_fixed_new_option_reply_info_export)) {
+        struct nbd_fixed_new_option_reply_info_export info;
+
+        memcpy (&info, payload, sizeof info);
+        if (be16toh (info.info) == NBD_INFO_EXPORT) {
+          *exportsize = be64toh (info.exportsize);
+          *eflags = be16toh (info.eflags);
+        }
+      }
+      break;
+    default:
+      fprintf (stderr, "%s: bench: NBD_OPT_GO failed (reply 0x%x)\n",
+               program_name, be32toh (reply.reply));
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+static void
+submit (unsigned slot, uint16_t cmd, uint64_t offset)
+{
+  struct nbd_request request;
+
+  request.magic = htobe32 (NBD_REQUEST_MAGIC);
+  request.flags = htobe16 (0);
+  request.type = htobe16 (cmd);
+  request.handle = htobe64 (slot);
+  request.offset = htobe64 (offset);
+  request.count = htobe32 (blocksize);
+
+  slots[slot].cmd = cmd;
+  slots[slot].start_ns = now_ns ();
+  xwrite (client_sock, &request, sizeof request);
+  if (cmd == NBD_CMD_WRITE)
+    xwrite (client_sock, data_buffer, blocksize);
+}
+
+static void
+report (double elapsed_secs)
+{
+  static const double percentiles[] = { 50, 90, 99, 99.9 };
+  uint64_t seen = 0;
+  unsigned i;
+  size_t p = 0;
+
+  fprintf (stderr, "bench: %s size=%" PRIu64 " qd=%u %s: "
+          "%" PRIu64 " ops in %.2fs, %.0f IOPS, %.1f MiB/s, "
+          "%" PRIu64 " errors\n",
+          pattern_names[pattern], blocksize, queue_depth,
+          sequential ? "seq" : "random",
+          total_ops, elapsed_secs, total_ops / elapsed_secs,
+          total_bytes / elapsed_secs / 1048576.0, errors);
+
+  if (total_ops == 0)
+    return;
+
+  fprintf (stderr, "bench: latency mean=%.1fus",
+          total_ns / (double) total_ops / 1000.0);
+  for (i = 0; i < STATS_BUCKETS && p < sizeof percentiles / sizeof percentiles[0]; ++i) {
+    seen += buckets[i];
+    while (p < sizeof percentiles / sizeof percentiles[0] &&
+           seen * 100.0 >= total_ops * percentiles[p]) {
+      fprintf (stderr, " p%g=%.1fus", percentiles[p],
+              stats_bucket_value (i) / 1000.0);
+      p++;
+    }
+  }
+  fprintf (stderr, " max=%.1fus\n", max_ns / 1000.0);
+}
+
+void
+bench_run (void)
+{
+  int sv[2];
+  pthread_t server, replier;
+  struct nbd_request request;
+  struct random_state rs;
+  uint64_t exportsize = 0, nblocks, next_block = 0;
+  uint64_t deadline, start, elapsed;
+  uint16_t eflags = 0;
+  unsigned i;
+  int err;
+
+  set_up_quit_pipe ();
+  top->after_fork (top);
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+    perror ("socketpair");
+    exit (EXIT_FAILURE);
+  }
+  client_sock = sv[1];
+
+  err = pthread_create (&server, NULL, server_thread, &sv[0]);
+  if (err) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+
+  handshake (&exportsize, &eflags);
+
+  nblocks = exportsize / blocksize;
+  if (nblocks == 0) {
+    fprintf (stderr, "%s: bench: export too small for size=%" PRIu64 "\n",
+             program_name, blocksize);
+    exit (EXIT_FAILURE);
+  }
+  if (pattern != BENCH_READ && (eflags & NBD_FLAG_READ_ONLY) != 0) {
+    fprintf (stderr, "%s: bench: export is read-only, use --bench read\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+  if (pattern == BENCH_ZERO && (eflags & NBD_FLAG_SEND_WRITE_ZEROES) == 0) {
+    fprintf (stderr, "%s: bench: export does not support write zeroes\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  slots = calloc (queue_depth, sizeof *slots);
+  free_slots = malloc (queue_depth * sizeof *free_slots);
+  data_buffer = malloc (blocksize);
+  if (slots == NULL || free_slots == NULL || data_buffer == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  xsrandom (time (NULL), &rs);
+  for (i = 0; i < blocksize; ++i)
+    data_buffer[i] = xrandom (&rs);
+  for (i = 0; i < queue_depth; ++i)
+    free_slots[nr_free++] = i;
+
+  err = pthread_create (&replier, NULL, reply_thread, NULL);
+  if (err) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+
+  start = now_ns ();
+  deadline = start + seconds * UINT64_C (1000000000);
+  while (now_ns () < deadline) {
+    unsigned slot = pop_free_slot ();
+    uint16_t cmd;
+    uint64_t block;
+
+    switch (pattern) {
+    case BENCH_READ: cmd = NBD_CMD_READ; break;
+    case BENCH_WRITE: cmd = NBD_CMD_WRITE; break;
+    case BENCH_ZERO: cmd = NBD_CMD_WRITE_ZEROES; break;
+    case BENCH_RW:
+    default:
+      cmd = xrandom (&rs) % 10 < 7 ? NBD_CMD_READ : NBD_CMD_WRITE;
+      break;
+    }
+    if (sequential) {
+      block = next_block;
+      next_block = (next_block + 1) % nblocks;
+    }
+    else
+      block = xrandom (&rs) % nblocks;
+
+    submit (slot, cmd, block * blocksize);
+  }
+
+  /* Wait for the in-flight requests to be retired, then disconnect:
+   * the server closes the socket, the reply thread sees end of file
+   * and exits.
+   */
+  for (i = 0; i < queue_depth; ++i)
+    pop_free_slot ();
+  elapsed = now_ns () - start;
+
+  request.magic = htobe32 (NBD_REQUEST_MAGIC);
+  request.flags = htobe16 (0);
+  request.type = htobe16 (NBD_CMD_DISC);
+  request.handle = htobe64 (0);
+  request.offset = htobe64 (0);
+  request.count = htobe32 (0);
+  xwrite (client_sock, &request, sizeof request);
+
+  pthread_join (replier, NULL);
+  pthread_join (server, NULL);
+  close (client_sock);
+
+  report (elapsed / 1e9);
+
+  free (slots);
+  free (free_slots);
+  free (data_buffer);
+}
+
+#else /* WIN32 */
+
+void
+bench_run (void)
+{
+  /* --bench is rejected by main() on Windows. */
+  abort ();
+}
+
+#endif /* WIN32 */
@@ -39,6 +39,8 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <spawn.h>
+#include <errno.h>
 #include <assert.h>
 
 #ifdef HAVE_SYS_WAIT_H
@@ -51,6 +53,8 @@
 
 #ifndef WIN32
 
+extern char **environ;
+
 /* Handle the --run option.  If run is NULL, does nothing.  If run is
  * not NULL then run nbdkit as a captive subprocess of the command.
  */
@@ -140,17 +144,54 @@ run_command (void)
   }
 
   if (pid > 0) {              /* Parent process is the run command. */
-    /* Restore original stdin/out */
-    if (dup2 (saved_stdin, STDIN_FILENO) == -1 ||
-        dup2 (saved_stdout, STDOUT_FILENO) == -1) {
-      r = -1;
-    }
-    else
-      r = system (cmd);
-    if (r == -1) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attrs;
+    sigset_t sigdfl;
+    char *argv[] = { (char *) "sh", (char *) "-c", cmd, NULL };
+    pid_t cmd_pid;
+
+    /* We don't use system(3) here because that would fork a second
+     * copy of the whole server address space just to exec the shell.
+     * posix_spawn(3) typically uses vfork or clone(CLONE_VM) so the
+     * command starts immediately even when the server image is large
+     * or locked into memory (--swap).  Note the listening sockets
+     * were already bound before we were called (see main.c) so the
+     * command can connect straight away without a retry loop; the
+     * kernel queues connections until captive nbdkit accepts them.
+     *
+     * Restore the original stdin/stdout in the command (not in this
+     * process).
+     */
+    posix_spawn_file_actions_init (&actions);
+    posix_spawn_file_actions_adddup2 (&actions, saved_stdin, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2 (&actions, saved_stdout, STDOUT_FILENO);
+
+    /* Like system(3): run the command with the default SIGINT and
+     * SIGQUIT dispositions and ignore those signals ourselves while
+     * waiting, so that ^C is delivered to the command and not to us.
+     * There is no need to restore our handlers since we exit below.
+     */
+    sigemptyset (&sigdfl);
+    sigaddset (&sigdfl, SIGINT);
+    sigaddset (&sigdfl, SIGQUIT);
+    posix_spawnattr_init (&attrs);
+    posix_spawnattr_setflags (&attrs, POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setsigdefault (&attrs, &sigdfl);
+    signal (SIGINT, SIG_IGN);
+    signal (SIGQUIT, SIG_IGN);
+
+    r = posix_spawn (&cmd_pid, "/bin/sh", &actions, &attrs, argv, environ);
+    posix_spawn_file_actions_destroy (&actions);
+    posix_spawnattr_destroy (&attrs);
+    if (r != 0) {
+      errno = r;
       nbdkit_error ("failure to execute external command: %m");
       r = EXIT_FAILURE;
     }
+    else if (waitpid (cmd_pid, &r, 0) == -1) {
+      nbdkit_error ("waitpid: %m");
+      r = EXIT_FAILURE;
+    }
     else if (WIFEXITED (r))
       r = WEXITSTATUS (r);
     else {
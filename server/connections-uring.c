@@ -0,0 +1,340 @@
+/* nbdkit
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#include "internal.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+
+/* Depth of the per-connection rings.  The send path queues at most
+ * two SQEs per flush (staged header chunks + the final payload) so
+ * this is plenty.
+ */
+#define URING_QUEUE_DEPTH 8
+
+/* Maximum bytes of reply chunks staged before we force a flush.  This
+ * is the same limit as the TLS corking path in crypto.c.
+ */
+#define MAX_STAGED_LEN (64 * 1024)
+
+/* The engine batches socket I/O through two io_urings (one for each
+ * direction, since reads are serialized by conn->read_lock and writes
+ * by conn->write_lock, which are distinct locks).
+ *
+ * Reply chunks sent with the SEND_MORE hint are copied into a staging
+ * buffer rather than issued as separate syscalls.  When the final
+ * chunk of a reply arrives (no SEND_MORE), the staged headers and the
+ * payload are submitted together and we wait for both completions
+ * with a single io_uring_enter, so a read reply costs one syscall
+ * rather than one per chunk.  Chunks must be copied because callers
+ * reuse stack buffers between sends (see for example the export list
+ * loop in protocol-handshake-newstyle.c).
+ */
+struct uring_engine {
+  struct io_uring recv_ring;    /* used under conn->read_lock */
+  struct io_uring send_ring;    /* used under conn->write_lock */
+  char *staging;                /* staged SEND_MORE chunks */
+  size_t staged;                /* bytes currently staged */
+};
+
+static int uring_recv (void *buf, size_t len);
+static int uring_send (const void *buf, size_t len, int flags);
+static void uring_close (void);
+
+/* Try to switch the connection to the io_uring engine.  On any
+ * failure we simply leave the plain socket functions in place, so
+ * this only returns an error for fatal problems like out of memory.
+ */
+int
+connection_uring_start (struct connection *conn)
+{
+  struct uring_engine *e;
+  int r;
+
+  e = calloc (1, sizeof *e);
+  if (e == NULL) {
+    perror ("malloc");
+    return -1;
+  }
+  e->staging = malloc (MAX_STAGED_LEN);
+  if (e->staging == NULL) {
+    perror ("malloc");
+    free (e);
+    return -1;
+  }
+
+  r = io_uring_queue_init (URING_QUEUE_DEPTH, &e->recv_ring, 0);
+  if (r < 0) {
+    errno = -r;
+    debug ("io_uring_queue_init: %m (using plain socket calls instead)");
+    free (e->staging);
+    free (e);
+    return 0;
+  }
+  r = io_uring_queue_init (URING_QUEUE_DEPTH, &e->send_ring, 0);
+  if (r < 0) {
+    errno = -r;
+    debug ("io_uring_queue_init: %m (using plain socket calls instead)");
+    io_uring_queue_exit (&e->recv_ring);
+    free (e->staging);
+    free (e);
+    return 0;
+  }
+
+  conn->uring_engine = e;
+  conn->recv = uring_recv;
+  conn->send = uring_send;
+  /* The fallback in connection_sendv stages all but the final buffer
+   * so a vectored send already becomes a single submission.
+   */
+  conn->sendv = NULL;
+  conn->close = uring_close;
+  debug ("connection is using the io_uring engine");
+  return 0;
+}
+
+/* Send any remainder of a chunk which the kernel sent short (or which
+ * was cancelled because an earlier linked send was short), using
+ * ordinary blocking send.  This is rare so it doesn't need to be
+ * fast, only correct.
+ */
+static int
+send_remainder (int sock, const char *buf, size_t len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = send (sock, buf, len, 0);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
+
+  return 0;
+}
+
+/* Submit the staged chunks plus the optional final chunk as linked
+ * SQEs and wait for all completions in one syscall.  Caller must hold
+ * conn->write_lock.
+ */
+static int
+uring_flush (struct uring_engine *e, int sock,
+             const char *buf, size_t len, bool more)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  unsigned wait = 0, i;
+  const char *bufs[2];
+  size_t lens[2];
+  int res[2] = { 0, 0 };
+  int r;
+
+  bufs[0] = e->staging;
+  lens[0] = e->staged;
+  bufs[1] = buf;
+  lens[1] = len;
+
+  if (e->staged > 0) {
+    sqe = io_uring_get_sqe (&e->send_ring);
+    assert (sqe != NULL);
+    io_uring_prep_send (sqe, sock, e->staging, e->staged,
+                        buf != NULL || more ? MSG_MORE : 0);
+    if (buf != NULL)
+      sqe->flags |= IOSQE_IO_LINK;
+    sqe->user_data = 0;
+    wait++;
+  }
+  if (buf != NULL) {
+    sqe = io_uring_get_sqe (&e->send_ring);
+    assert (sqe != NULL);
+    io_uring_prep_send (sqe, sock, buf, len, more ? MSG_MORE : 0);
+    sqe->user_data = 1;
+    wait++;
+  }
+  if (wait == 0)
+    return 0;
+
+  r = io_uring_submit (&e->send_ring);
+  if (r < 0) {
+    errno = -r;
+    return -1;
+  }
+  for (i = 0; i < wait; ++i) {
+    do
+      r = io_uring_wait_cqe (&e->send_ring, &cqe);
+    while (r == -EINTR);
+    if (r < 0) {
+      errno = -r;
+      return -1;
+    }
+    assert (cqe->user_data < 2);
+    res[cqe->user_data] = cqe->res;
+    io_uring_cqe_seen (&e->send_ring, cqe);
+  }
+  e->staged = 0;
+
+  /* Complete, in order, any chunk which was short or cancelled. */
+  for (i = 0; i < 2; ++i) {
+    if (bufs[i] == NULL || lens[i] == 0)
+      continue;
+    r = res[i];
+    if (r < 0) {
+      if (r != -ECANCELED && r != -EINTR && r != -EAGAIN) {
+        errno = -r;
+        return -1;
+      }
+      r = 0;
+    }
+    if ((size_t) r < lens[i] &&
+        send_remainder (sock, bufs[i] + r, lens[i] - r) == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+static int
+uring_send (const void *vbuf, size_t len, int flags)
+{
+  GET_CONN;
+  struct uring_engine *e = conn->uring_engine;
+  int sock = conn->sockout;
+
+  if (flags & SEND_MORE) {
+    if (len <= MAX_STAGED_LEN) {
+      if (e->staged + len > MAX_STAGED_LEN &&
+          uring_flush (e, sock, NULL, 0, true) == -1)
+        return -1;
+      memcpy (e->staging + e->staged, vbuf, len);
+      e->staged += len;
+      return 0;
+    }
+    /* Chunk too large to stage: send it now, keeping the hint. */
+    return uring_flush (e, sock, vbuf, len, true);
+  }
+
+  return uring_flush (e, sock, vbuf, len, false);
+}
+
+static int
+uring_recv (void *vbuf, size_t len)
+{
+  GET_CONN;
+  struct uring_engine *e = conn->uring_engine;
+  int sock = conn->sockin;
+  char *buf = vbuf;
+  bool first_read = true;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  int r;
+
+  while (len > 0) {
+    sqe = io_uring_get_sqe (&e->recv_ring);
+    assert (sqe != NULL);       /* the ring is idle between calls */
+    io_uring_prep_recv (sqe, sock, buf, len, 0);
+    r = io_uring_submit (&e->recv_ring);
+    if (r < 0) {
+      errno = -r;
+      return -1;
+    }
+    do
+      r = io_uring_wait_cqe (&e->recv_ring, &cqe);
+    while (r == -EINTR);
+    if (r < 0) {
+      errno = -r;
+      return -1;
+    }
+    r = cqe->res;
+    io_uring_cqe_seen (&e->recv_ring, cqe);
+    if (r < 0) {
+      if (r == -EINTR || r == -EAGAIN)
+        continue;
+      errno = -r;
+      return -1;
+    }
+    if (r == 0) {
+      if (first_read)
+        return 0;
+      /* Partial record read.  This is an error. */
+      errno = EBADMSG;
+      return -1;
+    }
+    first_read = false;
+    buf += r;
+    len -= r;
+  }
+
+  return 1;
+}
+
+/* Like raw_close this cannot report errors.  Unsubmitted SQEs from a
+ * failed reply are dropped along with the rings.
+ */
+static void
+uring_close (void)
+{
+  GET_CONN;
+  struct uring_engine *e = conn->uring_engine;
+
+  io_uring_queue_exit (&e->recv_ring);
+  io_uring_queue_exit (&e->send_ring);
+  free (e->staging);
+  free (e);
+  conn->uring_engine = NULL;
+
+  if (conn->sockin >= 0)
+    closesocket (conn->sockin);
+  if (conn->sockout >= 0 && conn->sockin != conn->sockout)
+    closesocket (conn->sockout);
+}
+
+#endif /* HAVE_LIBURING */
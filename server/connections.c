@@ -41,41 +41,96 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <time.h>
 
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
 
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+
+#include <poll.h>
+
 #include "internal.h"
 #include "utils.h"
 
-/* Default number of parallel requests. */
-#define DEFAULT_PARALLEL_REQUESTS 16
+#ifdef USE_ZEROCOPY
+#include <poll.h>
+#include <linux/errqueue.h>
+
+/* Payloads at least this large are sent with MSG_ZEROCOPY when the
+ * --zerocopy option is in use.  Pinning pages has a fixed cost so
+ * zero copy only wins for large sends.
+ */
+#define ZEROCOPY_THRESHOLD (256 * 1024)
+#endif
 
 static struct connection *new_connection (int sockin, int sockout,
                                           int nworkers);
 static void free_connection (struct connection *conn);
 
+/* Connection counts for the metrics report (stats.c).  Updated from
+ * connection threads, read racily by the reporter.
+ */
+_Atomic unsigned nr_active_connections;
+_Atomic uint64_t nr_total_connections;
+
+/* Adaptive socket buffer telemetry for the metrics report (stats.c). */
+_Atomic uint64_t nr_sockbuf_grows;
+_Atomic int max_adaptive_sockbuf;
+
 /* Don't call these raw socket functions directly.  Use conn->recv etc. */
 static int raw_recv ( void *buf, size_t len);
 static int raw_send_socket (const void *buf, size_t len, int flags);
 static int raw_send_other (const void *buf, size_t len, int flags);
 static void raw_close (void);
+static int get_wmem_max (void);
+#ifdef HAVE_SYS_UIO_H
+static int raw_sendv_socket (const struct iovec *iov, int niov, int flags);
+static int raw_sendv_other (const struct iovec *iov, int niov, int flags);
+#endif
+#ifdef USE_ZEROCOPY
+static int send_zerocopy (struct connection *conn, int sock,
+                          const char *buf, size_t len, int f);
+#endif
+
+/* Send a vector of buffers as one reply.  Uses the connection's
+ * vectored send function if it has one, otherwise falls back to
+ * sending the buffers one at a time with the SEND_MORE hint.
+ */
+int
+connection_sendv (const struct iovec *iov, int niov, int flags)
+{
+  GET_CONN;
+  int i;
+
+  if (conn->sendv)
+    return conn->sendv (iov, niov, flags);
+
+  for (i = 0; i < niov; ++i) {
+    int f = i < niov - 1 ? flags | SEND_MORE : flags;
+
+    if (conn->send (iov[i].iov_base, iov[i].iov_len, f) == -1)
+      return -1;
+  }
+  return 0;
+}
 
 int
 connection_get_status (void)
 {
   GET_CONN;
-  int r;
 
-  if (conn->nworkers &&
-      pthread_mutex_lock (&conn->status_lock))
-    abort ();
-  r = conn->status;
-  if (conn->nworkers &&
-      pthread_mutex_unlock (&conn->status_lock))
-    abort ();
-  return r;
+  /* A plain atomic load: this runs on every iteration of every
+   * worker's request loop, so it must not contend on status_lock.
+   */
+  return atomic_load_explicit (&conn->status, memory_order_relaxed);
 }
 
 /* Update the status if the new value is lower than the existing value.
@@ -86,6 +141,13 @@ connection_set_status (int value)
 {
   GET_CONN;
 
+  /* Transitions are rare; take the lock only when the new value could
+   * actually lower the status, so the common "still running" case
+   * (value == 1) stays lock-free.
+   */
+  if (value >= atomic_load_explicit (&conn->status, memory_order_relaxed))
+    return value;
+
   if (conn->nworkers &&
       pthread_mutex_lock (&conn->status_lock))
     abort ();
@@ -105,29 +167,202 @@ connection_set_status (int value)
   return value;
 }
 
-struct worker_data {
-  struct connection *conn;
-  char *name;
-};
+/* Take one of the --max-inflight slots for this connection, blocking
+ * while the cap is reached.  Blocking here (instead of reading the
+ * socket) is what turns a client burst into TCP backpressure.  The
+ * wait re-checks quit and the connection status periodically since
+ * neither is signalled on our condition variable; on shutdown we
+ * simply take the slot and let the caller notice the status.
+ */
+void
+connection_acquire_inflight_slot (struct connection *conn)
+{
+  struct timespec ts;
 
-static void *
-connection_worker (void *data)
+  if (pthread_mutex_lock (&conn->inflight_lock))
+    abort ();
+  while (conn->inflight >= max_inflight &&
+         !quit && connection_get_status () > 0) {
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    pthread_cond_timedwait (&conn->inflight_cond, &conn->inflight_lock, &ts);
+  }
+  conn->inflight++;
+  if (pthread_mutex_unlock (&conn->inflight_lock))
+    abort ();
+}
+
+void
+connection_release_inflight_slot (struct connection *conn)
 {
-  struct worker_data *worker = data;
-  struct connection *conn = worker->conn;
-  char *name = worker->name;
+  if (pthread_mutex_lock (&conn->inflight_lock))
+    abort ();
+  conn->inflight--;
+  pthread_cond_broadcast (&conn->inflight_cond);
+  if (pthread_mutex_unlock (&conn->inflight_lock))
+    abort ();
+}
 
-  debug ("starting worker thread %s", name);
-  threadlocal_new_server_thread ();
-  threadlocal_set_name (name);
-  threadlocal_set_conn (conn);
-  free (worker);
+/* Track asynchronous operations outstanding against the plugin, so
+ * the connection is not finalized under them (see protocol.c).
+ */
+void
+connection_async_begin (struct connection *conn)
+{
+  if (pthread_mutex_lock (&conn->inflight_lock))
+    abort ();
+  conn->async_pending++;
+  if (pthread_mutex_unlock (&conn->inflight_lock))
+    abort ();
+}
 
-  while (!quit && connection_get_status () > 0)
-    protocol_recv_request_send_reply ();
-  debug ("exiting worker thread %s", threadlocal_get_name ());
-  free (name);
-  return NULL;
+void
+connection_async_end (struct connection *conn)
+{
+  if (pthread_mutex_lock (&conn->inflight_lock))
+    abort ();
+  conn->async_pending--;
+  pthread_cond_broadcast (&conn->inflight_cond);
+  if (pthread_mutex_unlock (&conn->inflight_lock))
+    abort ();
+}
+
+void
+connection_drain_async (struct connection *conn)
+{
+  if (pthread_mutex_lock (&conn->inflight_lock))
+    abort ();
+  while (conn->async_pending > 0)
+    pthread_cond_wait (&conn->inflight_cond, &conn->inflight_lock);
+  if (pthread_mutex_unlock (&conn->inflight_lock))
+    abort ();
+}
+
+/* Dependency-aware scheduling between flushes and writes (protocol.c).
+ *
+ * NBD_CMD_FLUSH must not complete until writes which completed before
+ * it are durable, so a flush waits out writes already in flight.
+ * Writes arriving while a flush is in flight queue behind it, which
+ * keeps the barrier simple; reads take part in neither and can
+ * overlap a flush freely.
+ */
+void
+connection_write_begin (struct connection *conn)
+{
+  if (pthread_mutex_lock (&conn->inflight_lock))
+    abort ();
+  while (conn->flushes_pending > 0)
+    pthread_cond_wait (&conn->inflight_cond, &conn->inflight_lock);
+  conn->writes_pending++;
+  if (pthread_mutex_unlock (&conn->inflight_lock))
+    abort ();
+}
+
+/* Non-blocking variant for the asynchronous submission path, which
+ * runs with the socket read lock held and so must not sleep: returns
+ * false if a flush is in flight and the caller should fall back to
+ * the synchronous path (which queues without holding that lock).
+ */
+bool
+connection_write_try_begin (struct connection *conn)
+{
+  bool r;
+
+  if (pthread_mutex_lock (&conn->inflight_lock))
+    abort ();
+  r = conn->flushes_pending == 0;
+  if (r)
+    conn->writes_pending++;
+  if (pthread_mutex_unlock (&conn->inflight_lock))
+    abort ();
+  return r;
+}
+
+void
+connection_write_end (struct connection *conn)
+{
+  if (pthread_mutex_lock (&conn->inflight_lock))
+    abort ();
+  conn->writes_pending--;
+  pthread_cond_broadcast (&conn->inflight_cond);
+  if (pthread_mutex_unlock (&conn->inflight_lock))
+    abort ();
+}
+
+void
+connection_flush_begin (struct connection *conn)
+{
+  if (pthread_mutex_lock (&conn->inflight_lock))
+    abort ();
+  conn->flushes_pending++;
+  while (conn->writes_pending > 0)
+    pthread_cond_wait (&conn->inflight_cond, &conn->inflight_lock);
+  if (pthread_mutex_unlock (&conn->inflight_lock))
+    abort ();
+}
+
+void
+connection_flush_end (struct connection *conn)
+{
+  if (pthread_mutex_lock (&conn->inflight_lock))
+    abort ();
+  conn->flushes_pending--;
+  pthread_cond_broadcast (&conn->inflight_cond);
+  if (pthread_mutex_unlock (&conn->inflight_lock))
+    abort ();
+}
+
+/* Park the connection thread until the client sends a request, the
+ * connection status changes, or the server quits.  No pool workers
+ * are consumed while parked.  Returns 1 when the socket is readable,
+ * 0 for shutdown, -1 on error.
+ */
+static int
+connection_wait_readable (struct connection *conn)
+{
+  struct pollfd fds[3];
+  nfds_t nfds = 1;
+  int status_idx = -1, quit_idx = -1;
+  int r;
+
+  fds[0].fd = conn->sockin;
+  fds[0].events = POLLIN;
+#ifndef WIN32
+  quit_idx = nfds;
+  fds[nfds].fd = quit_fd;
+  fds[nfds].events = POLLIN;
+  nfds++;
+#endif
+  if (conn->status_pipe[0] >= 0) {
+    status_idx = nfds;
+    fds[nfds].fd = conn->status_pipe[0];
+    fds[nfds].events = POLLIN;
+    nfds++;
+  }
+
+  for (;;) {
+    nfds_t i;
+
+    for (i = 0; i < nfds; ++i)
+      fds[i].revents = 0;
+    r = poll (fds, nfds, -1);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("poll: %m");
+      return connection_set_status (-1);
+    }
+    if (quit || (quit_idx >= 0 && fds[quit_idx].revents))
+      return 0;
+    if (status_idx >= 0 && fds[status_idx].revents) {
+      r = connection_get_status ();
+      if (r <= 0)
+        return r;
+      continue;
+    }
+    if (fds[0].revents)
+      return 1;
+  }
 }
 
 void
@@ -137,7 +372,6 @@ handle_single_connection (int sockin, int sockout)
   int r;
   struct connection *conn;
   int nworkers = threads ? threads : DEFAULT_PARALLEL_REQUESTS;
-  pthread_t *workers = NULL;
 
   lock_connection ();
 
@@ -157,9 +391,18 @@ handle_single_connection (int sockin, int sockout)
   if (!conn)
     goto done;
 
+  nr_active_connections++;
+  nr_total_connections++;
+
   plugin_name = top->plugin_name (top);
   threadlocal_set_name (plugin_name);
 
+  /* Bind before the handshake so that the plugin handle, opened
+   * during the handshake, is first-touched on the connection's node.
+   */
+  if (conn->numa_node >= 0)
+    numa_bind_worker (conn->numa_node);
+
   if (top->preconnect (top, read_only) == -1)
     goto done;
 
@@ -172,56 +415,85 @@ handle_single_connection (int sockin, int sockout)
     goto done;
   conn->handshake_complete = true;
 
+#ifdef HAVE_LIBURING
+  /* Switch to the io_uring engine for the request phase.  This is not
+   * possible if the client upgraded to TLS (crypto.c owns the socket
+   * functions then) or if the input is not a socket (nbdkit -s).
+   */
+  if (uring && !conn->using_tls && conn->send == raw_send_socket) {
+    if (connection_uring_start (conn) == -1)
+      goto done;
+  }
+#endif
+
   if (!nworkers) {
     /* No need for a separate thread. */
     debug ("handshake complete, processing requests serially");
     while (!quit && connection_get_status () > 0)
-      protocol_recv_request_send_reply ();
+      protocol_recv_request_send_reply (-1);
   }
   else {
-    /* Create thread pool to process requests. */
-    debug ("handshake complete, processing requests with %d threads",
-           nworkers);
-    workers = calloc (nworkers, sizeof *workers);
-    if (unlikely (!workers)) {
-      perror ("malloc");
-      goto done;
-    }
+    /* Borrow worker threads from the shared server-wide pool while
+     * the client is active.  The pool is bounded, so when many
+     * connections are open we may be granted fewer threads than
+     * requested.  This thread always processes requests itself (as
+     * worker 0), so the connection makes progress even if the pool is
+     * exhausted.
+     *
+     * When the client goes idle the borrowed workers drain back to
+     * the pool and this thread parks in poll, so a mostly-idle
+     * connection costs one waiting thread and no pool workers.  TLS
+     * connections cannot park because the TLS layer may hold buffered
+     * records which polling the socket would not see.
+     */
+    struct worker_group group = WORKER_GROUP_INIT;
+    const bool can_park = !conn->using_tls;
+    int n;
 
-    for (nworkers = 0; nworkers < conn->nworkers; nworkers++) {
-      struct worker_data *worker = malloc (sizeof *worker);
-      int err;
+    debug ("handshake complete, processing requests with up to %d threads",
+           nworkers);
 
-      if (unlikely (!worker)) {
-        perror ("malloc");
-        connection_set_status (-1);
-        goto wait;
+    while (!quit && connection_get_status () > 0) {
+      if (can_park) {
+        r = connection_wait_readable (conn);
+        if (r <= 0)
+          break;
       }
-      if (unlikely (asprintf (&worker->name, "%s.%d", plugin_name, nworkers)
-                    < 0)) {
-        perror ("asprintf");
-        connection_set_status (-1);
-        free (worker);
-        goto wait;
+
+      for (n = 1; n < nworkers; n++) {
+        char *name;
+
+        if (unlikely (asprintf (&name, "%s.%d", plugin_name, n) < 0)) {
+          perror ("asprintf");
+          break;
+        }
+        if (worker_pool_submit (conn, name, &group) == -1) {
+          free (name);
+          break;
+        }
       }
-      worker->conn = conn;
-      err = pthread_create (&workers[nworkers], NULL, connection_worker,
-                            worker);
-      if (unlikely (err)) {
-        errno = err;
-        perror ("pthread_create");
-        connection_set_status (-1);
-        free (worker);
-        goto wait;
+
+      r = 0;
+      while (!quit && connection_get_status () > 0) {
+        r = protocol_recv_request_send_reply (can_park
+                                              ? CONN_IDLE_GRACE_MS : -1);
+        if (r != 1)
+          break;
       }
+      worker_group_wait (&group);
+      if (r != 2)               /* not an idle timeout: close down */
+        break;
     }
-
-  wait:
-    while (nworkers)
-      pthread_join (workers[--nworkers], NULL);
-    free (workers);
   }
 
+  /* Wait for asynchronous operations still in flight against the
+   * plugin: their completions reference this connection.  Queued
+   * cache hints are discarded first so that the drain only has to
+   * wait for work which has actually started.
+   */
+  prefetch_cancel (conn);
+  connection_drain_async (conn);
+
   /* Finalize (for filters), called just before close. */
   lock_request ();
   r = backend_finalize (top);
@@ -230,6 +502,8 @@ handle_single_connection (int sockin, int sockout)
     goto done;
 
  done:
+  if (conn)
+    nr_active_connections--;
   free_connection (conn);
   unlock_connection ();
 }
@@ -253,6 +527,9 @@ new_connection (int sockin, int sockout, int nworkers)
   pthread_mutex_init (&conn->read_lock, NULL);
   pthread_mutex_init (&conn->write_lock, NULL);
   pthread_mutex_init (&conn->status_lock, NULL);
+  pthread_mutex_init (&conn->extent_cache_lock, NULL);
+  pthread_mutex_init (&conn->inflight_lock, NULL);
+  pthread_cond_init (&conn->inflight_cond, NULL);
 
   conn->handles = calloc (top->i + 1, sizeof *conn->handles);
   if (conn->handles == NULL) {
@@ -265,6 +542,7 @@ new_connection (int sockin, int sockout, int nworkers)
 
   conn->status = 1;
   conn->nworkers = nworkers;
+  conn->numa_node = numa ? numa_choose_node () : -1;
   if (nworkers) {
 #ifdef HAVE_PIPE2
     if (pipe2 (conn->status_pipe, O_NONBLOCK | O_CLOEXEC)) {
@@ -311,15 +589,82 @@ new_connection (int sockin, int sockout, int nworkers)
   conn->sockout = sockout;
   conn->recv = raw_recv;
 #ifndef WIN32
-  if (getsockopt (sockout, SOL_SOCKET, SO_TYPE, &opt, &optlen) == 0)
+  if (getsockopt (sockout, SOL_SOCKET, SO_TYPE, &opt, &optlen) == 0) {
     conn->send = raw_send_socket;
-  else
+#ifdef HAVE_SYS_UIO_H
+    conn->sendv = raw_sendv_socket;
+#endif
+  }
+  else {
     conn->send = raw_send_other;
+#ifdef HAVE_SYS_UIO_H
+    conn->sendv = raw_sendv_other;
+#endif
+  }
 #else
   conn->send = raw_send_socket;
 #endif
   conn->close = raw_close;
 
+#ifdef USE_ZEROCOPY
+  if (zerocopy && conn->send == raw_send_socket) {
+    opt = 1;
+    if (setsockopt (sockout, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof opt) == 0)
+      conn->zerocopy = true;
+    else
+      /* Not fatal: eg. Unix domain sockets cannot do zero copy. */
+      debug ("setsockopt: SO_ZEROCOPY: %m (using copying sends)");
+  }
+#endif
+
+#ifndef WIN32
+  /* Adaptive socket buffer sizing only makes sense for TCP: for Unix
+   * domain and vsock sockets there is no bandwidth-delay product to
+   * fill.  Record the kernel's initial SO_SNDBUF as the baseline for
+   * growth (see note_partial_send below).
+   */
+  if (conn->send == raw_send_socket) {
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof ss;
+
+    if (getpeername (sockout, (struct sockaddr *) &ss, &sslen) == 0 &&
+        (ss.ss_family == AF_INET || ss.ss_family == AF_INET6)) {
+      optlen = sizeof conn->sockbuf;
+      if (getsockopt (sockout, SOL_SOCKET, SO_SNDBUF,
+                      &conn->sockbuf, &optlen) == 0) {
+        int wm = get_wmem_max ();
+
+        conn->is_tcp = true;
+        if (wm > 0 && conn->sockbuf / 2 >= wm)
+          /* setsockopt cannot beat what autotuning already gave us. */
+          conn->sockbuf_maxed = true;
+        debug ("adaptive socket buffers %s, initial SO_SNDBUF %d",
+               conn->sockbuf_maxed
+               ? "capped by net.core.wmem_max" : "enabled",
+               conn->sockbuf);
+      }
+    }
+  }
+#endif
+
+#ifndef WIN32
+  if (busy_poll > 0 && conn->send == raw_send_socket) {
+    /* Spin in userspace before blocking (see raw_recv). */
+    conn->busy_poll = true;
+#ifdef SO_BUSY_POLL
+    /* Additionally ask the kernel to busy-poll the device queue while
+     * we block in recv, which cuts out interrupt latency on NICs
+     * which support it.  May need CAP_NET_ADMIN on older kernels, and
+     * does nothing for Unix domain sockets, so failure is not fatal.
+     */
+    opt = busy_poll;
+    if (setsockopt (sockin, SOL_SOCKET, SO_BUSY_POLL, &opt, sizeof opt) == -1)
+      debug ("setsockopt: SO_BUSY_POLL: %m (continuing without "
+             "kernel busy polling)");
+#endif
+  }
+#endif
+
   threadlocal_set_conn (conn);
 
   return conn;
@@ -336,6 +681,9 @@ new_connection (int sockin, int sockout, int nworkers)
   pthread_mutex_destroy (&conn->read_lock);
   pthread_mutex_destroy (&conn->write_lock);
   pthread_mutex_destroy (&conn->status_lock);
+  pthread_mutex_destroy (&conn->extent_cache_lock);
+  pthread_mutex_destroy (&conn->inflight_lock);
+  pthread_cond_destroy (&conn->inflight_cond);
   free (conn);
   return NULL;
 }
@@ -369,8 +717,14 @@ free_connection (struct connection *conn)
   pthread_mutex_destroy (&conn->read_lock);
   pthread_mutex_destroy (&conn->write_lock);
   pthread_mutex_destroy (&conn->status_lock);
+  pthread_mutex_destroy (&conn->extent_cache_lock);
+  pthread_mutex_destroy (&conn->inflight_lock);
+  pthread_cond_destroy (&conn->inflight_cond);
 
+  nbdkit_extents_free (conn->extent_cache);
+  qos_free_flow (conn);
   free (conn->exportname_from_set_meta_context);
+  free (conn->exportinfo_name);
   free_interns ();
 
   /* This is needed in order to free a field in struct handle. */
@@ -382,6 +736,117 @@ free_connection (struct connection *conn)
   threadlocal_set_conn (NULL);
 }
 
+/* Adaptive socket buffer sizing (TCP only).
+ *
+ * A partial send() on a blocking socket means the socket buffer
+ * filled: the kernel is draining it more slowly than we fill it,
+ * which on a long fat path usually means SO_SNDBUF is smaller than
+ * the bandwidth-delay product and the connection runs under line
+ * rate.  After PARTIAL_SEND_THRESHOLD consecutive sends hit this,
+ * ask for a buffer of the current size — Linux doubles what you ask
+ * for, so this roughly doubles the real allocation — and grow the
+ * receive buffer with it, since large inbound write payloads have
+ * the same problem.  Growth stops at ADAPTIVE_SOCKBUF_MAX or when
+ * the kernel clamps the request (net.core.wmem_max), whichever comes
+ * first.
+ *
+ * "Persistent" is a running score: a partial send adds 3, a send
+ * which completes in one call subtracts 1, and the buffer grows when
+ * the score reaches PARTIAL_SEND_THRESHOLD.  Under pressure full
+ * sends still interleave with partial ones (a blocking send returns
+ * the moment its last byte is queued, briefly leaving room), so the
+ * score only climbs while at least a quarter of sends hit a full
+ * buffer, and occasional stalls decay away.
+ *
+ * Care is needed on Linux: plain setsockopt can only deliver double
+ * net.core.wmem_max, and it permanently disables kernel autotuning
+ * for the socket.  On a default host autotuning reaches several
+ * megabytes while wmem_max allows well under one, so a careless
+ * "grow" request would actually shrink the buffer.  Growth therefore
+ * only engages when the administrator has raised wmem_max above what
+ * autotuning already provided, and the receive buffer is never set
+ * to less than it already has.
+ */
+#define PARTIAL_SEND_THRESHOLD 48
+#define ADAPTIVE_SOCKBUF_MAX (16 * 1024 * 1024)
+
+/* net.core.wmem_max; -1 = not read yet, 0 = unknown (not Linux). */
+static _Atomic int wmem_max_limit = -1;
+
+static int
+get_wmem_max (void)
+{
+  int v = wmem_max_limit;
+
+  if (v == -1) {
+    FILE *fp = fopen ("/proc/sys/net/core/wmem_max", "r");
+
+    v = 0;
+    if (fp) {
+      if (fscanf (fp, "%d", &v) != 1 || v < 0)
+        v = 0;
+      fclose (fp);
+    }
+    wmem_max_limit = v;
+  }
+  return v;
+}
+
+static void
+note_partial_send (struct connection *conn, bool partial)
+{
+  int want, got, wm;
+  socklen_t optlen = sizeof got;
+
+  if (!conn->is_tcp || conn->sockbuf_maxed)
+    return;
+  if (!partial) {
+    if (conn->partial_sends > 0)
+      conn->partial_sends--;
+    return;
+  }
+  conn->partial_sends += 3;
+  if (conn->partial_sends < PARTIAL_SEND_THRESHOLD)
+    return;
+  conn->partial_sends = 0;
+
+  want = conn->sockbuf;
+  wm = get_wmem_max ();
+  if (want >= ADAPTIVE_SOCKBUF_MAX || (wm > 0 && want / 2 >= wm)) {
+    conn->sockbuf_maxed = true;
+    debug ("socket buffer growth stopped at %d bytes "
+           "(raise net.core.wmem_max to allow more)", conn->sockbuf);
+    return;
+  }
+  if (wm > 0 && want > wm)
+    want = wm;        /* the largest request the kernel will honour */
+  setsockopt (conn->sockout, SOL_SOCKET, SO_SNDBUF, &want, sizeof want);
+  if (getsockopt (conn->sockout, SOL_SOCKET, SO_SNDBUF, &got, &optlen) == -1 ||
+      got <= conn->sockbuf) {
+    /* The kernel refused to grow the buffer; stop asking. */
+    conn->sockbuf_maxed = true;
+    debug ("socket buffer growth stopped at %d bytes "
+           "(raise net.core.wmem_max to allow more)", conn->sockbuf);
+    return;
+  }
+  conn->sockbuf = got;
+
+  /* Grow the receive buffer with it, but never shrink it: the limit
+   * differs (net.core.rmem_max) and setting it also turns kernel
+   * autotuning off.
+   */
+  optlen = sizeof got;
+  if (getsockopt (conn->sockin, SOL_SOCKET, SO_RCVBUF, &got, &optlen) == 0 &&
+      got < conn->sockbuf)
+    setsockopt (conn->sockin, SOL_SOCKET, SO_RCVBUF, &want, sizeof want);
+
+  nr_sockbuf_grows++;
+  if (conn->sockbuf > max_adaptive_sockbuf)
+    max_adaptive_sockbuf = conn->sockbuf;
+  debug ("grew socket buffers to %d bytes after persistent partial sends",
+         conn->sockbuf);
+}
+
 /* Write buffer to conn->sockout with send() and either succeed completely
  * (returns 0) or fail (returns -1). flags may include SEND_MORE as a hint
  * that this send will be followed by related data.
@@ -393,26 +858,149 @@ raw_send_socket (const void *vbuf, size_t len, int flags)
   int sock = conn->sockout;
   const char *buf = vbuf;
   ssize_t r;
+  bool partial = false;
   int f = 0;
 
 #ifdef MSG_MORE
   if (flags & SEND_MORE)
     f |= MSG_MORE;
+#endif
+#ifdef USE_ZEROCOPY
+  if (conn->zerocopy && len >= ZEROCOPY_THRESHOLD)
+    return send_zerocopy (conn, sock, buf, len, f);
 #endif
   while (len > 0) {
-    r = send (sock, buf, len, f);
+    int fl = f;
+
+#if defined (MSG_DONTWAIT) && !defined (WIN32)
+    /* A blocking send() queues the whole buffer and only returns
+     * short on a signal, so buffer pressure is invisible to it.
+     * While adaptive sizing is still interested, probe with
+     * MSG_DONTWAIT: EAGAIN here is the "socket buffer full" signal,
+     * after which we finish with blocking sends.
+     */
+    if (conn->is_tcp && !conn->sockbuf_maxed && !partial)
+      fl |= MSG_DONTWAIT;
+#endif
+    r = send (sock, buf, len, fl);
     if (r == -1) {
+#if defined (MSG_DONTWAIT) && !defined (WIN32)
+      if ((fl & MSG_DONTWAIT) &&
+          (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        partial = true;
+        continue;
+      }
+#endif
       if (errno == EINTR || errno == EAGAIN)
         continue;
       return -1;
     }
+    if ((size_t) r < len)
+      partial = true;
     buf += r;
     len -= r;
   }
 
+  note_partial_send (conn, partial);
+  return 0;
+}
+
+#ifdef USE_ZEROCOPY
+/* Wait for the kernel to acknowledge all outstanding MSG_ZEROCOPY
+ * sends on the error queue.  Each zerocopy send is numbered by the
+ * kernel and a notification covers a range of sends, so we only have
+ * to track the highest number acknowledged.
+ */
+static int
+zerocopy_reap (struct connection *conn, int sock)
+{
+  while (conn->zerocopy_acked != conn->zerocopy_sent) {
+    struct pollfd pfd = { .fd = sock, .events = 0 };
+    struct msghdr msg = { 0 };
+    char control[128];
+    struct cmsghdr *cm;
+    const struct sock_extended_err *serr;
+
+    /* The error queue being non-empty is signalled via POLLERR. */
+    if (poll (&pfd, 1, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    if (recvmsg (sock, &msg, MSG_ERRQUEUE) == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    for (cm = CMSG_FIRSTHDR (&msg); cm != NULL; cm = CMSG_NXTHDR (&msg, cm)) {
+      serr = (const struct sock_extended_err *) CMSG_DATA (cm);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      /* This notification covers sends ee_info..ee_data inclusive. */
+      conn->zerocopy_acked = serr->ee_data + 1;
+    }
+  }
   return 0;
 }
 
+/* Like the plain path of raw_send_socket but asks the kernel to
+ * transmit directly from our pages instead of copying.  The payload
+ * is normally the threadlocal buffer which is reused as soon as this
+ * thread handles its next request, so we cannot return until the
+ * kernel has finished with the pinned pages.
+ */
+static int
+send_zerocopy (struct connection *conn, int sock,
+               const char *buf, size_t len, int f)
+{
+  ssize_t r;
+  bool partial = false;
+
+  while (len > 0) {
+    int fl = f | MSG_ZEROCOPY;
+
+    /* Buffer-full probe as in raw_send_socket. */
+    if (conn->is_tcp && !conn->sockbuf_maxed && !partial)
+      fl |= MSG_DONTWAIT;
+    r = send (sock, buf, len, fl);
+    if (r == -1) {
+      if ((fl & MSG_DONTWAIT) &&
+          (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        partial = true;
+        continue;
+      }
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      if (errno == ENOBUFS) {
+        /* The kernel could not pin the pages (eg. optmem limit),
+         * fall back to a copying send for this chunk.
+         */
+        r = send (sock, buf, len, f);
+        if (r == -1) {
+          if (errno == EINTR || errno == EAGAIN)
+            continue;
+          return -1;
+        }
+        buf += r;
+        len -= r;
+        continue;
+      }
+      return -1;
+    }
+    conn->zerocopy_sent++;
+    if ((size_t) r < len)
+      partial = true;
+    buf += r;
+    len -= r;
+  }
+
+  note_partial_send (conn, partial);
+  return zerocopy_reap (conn, sock);
+}
+#endif /* USE_ZEROCOPY */
+
 /* Write buffer to conn->sockout with write() and either succeed completely
  * (returns 0) or fail (returns -1). flags is ignored.
  */
@@ -438,6 +1026,146 @@ raw_send_other (const void *vbuf, size_t len, int flags)
   return 0;
 }
 
+#ifdef HAVE_SYS_UIO_H
+
+/* The largest vector protocol.c sends is header + offset + payload. */
+#define SENDV_MAX_IOV 4
+
+/* Write a vector of buffers to conn->sockout with a single sendmsg()
+ * where possible and either succeed completely (returns 0) or fail
+ * (returns -1).  Large vectors honour the zero copy setting like
+ * raw_send_socket.
+ */
+static int
+raw_sendv_socket (const struct iovec *vec, int niov, int flags)
+{
+  GET_CONN;
+  int sock = conn->sockout;
+  struct iovec iov[SENDV_MAX_IOV];
+  struct msghdr msg = { 0 };
+  ssize_t r;
+  bool partial = false;
+  int f = 0;
+#ifdef USE_ZEROCOPY
+  bool zc = false;
+#endif
+
+  assert (niov <= SENDV_MAX_IOV);
+  memcpy (iov, vec, niov * sizeof (struct iovec));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = niov;
+
+#ifdef MSG_MORE
+  if (flags & SEND_MORE)
+    f |= MSG_MORE;
+#endif
+#ifdef USE_ZEROCOPY
+  if (conn->zerocopy) {
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < niov; ++i)
+      total += iov[i].iov_len;
+    zc = total >= ZEROCOPY_THRESHOLD;
+  }
+#endif
+
+  while (msg.msg_iovlen > 0) {
+    int fl = f;
+
+#if defined (MSG_DONTWAIT) && !defined (WIN32)
+    /* Buffer-full probe as in raw_send_socket. */
+    if (conn->is_tcp && !conn->sockbuf_maxed && !partial)
+      fl |= MSG_DONTWAIT;
+#endif
+#ifdef USE_ZEROCOPY
+    r = sendmsg (sock, &msg, zc ? fl | MSG_ZEROCOPY : fl);
+#else
+    r = sendmsg (sock, &msg, fl);
+#endif
+    if (r == -1) {
+#if defined (MSG_DONTWAIT) && !defined (WIN32)
+      if ((fl & MSG_DONTWAIT) &&
+          (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        partial = true;
+        continue;
+      }
+#endif
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+#ifdef USE_ZEROCOPY
+      if (zc && errno == ENOBUFS) {
+        /* The kernel could not pin the pages, use copying sends. */
+        zc = false;
+        continue;
+      }
+#endif
+      return -1;
+    }
+#ifdef USE_ZEROCOPY
+    if (zc)
+      conn->zerocopy_sent++;
+#endif
+    /* Advance past the buffers which were sent completely, then
+     * adjust any partially sent buffer.
+     */
+    while (r > 0 && (size_t) r >= msg.msg_iov[0].iov_len) {
+      r -= msg.msg_iov[0].iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (r > 0) {
+      msg.msg_iov[0].iov_base = (char *) msg.msg_iov[0].iov_base + r;
+      msg.msg_iov[0].iov_len -= r;
+    }
+    if (msg.msg_iovlen > 0)
+      partial = true;
+  }
+
+  note_partial_send (conn, partial);
+#ifdef USE_ZEROCOPY
+  if (conn->zerocopy_acked != conn->zerocopy_sent)
+    return zerocopy_reap (conn, sock);
+#endif
+  return 0;
+}
+
+/* Like raw_sendv_socket but using writev() for non-sockets. */
+static int
+raw_sendv_other (const struct iovec *vec, int niov, int flags)
+{
+  GET_CONN;
+  int sock = conn->sockout;
+  struct iovec iov[SENDV_MAX_IOV];
+  struct iovec *p = iov;
+  ssize_t r;
+
+  assert (niov <= SENDV_MAX_IOV);
+  memcpy (iov, vec, niov * sizeof (struct iovec));
+
+  while (niov > 0) {
+    r = writev (sock, p, niov);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    while (r > 0 && (size_t) r >= p[0].iov_len) {
+      r -= p[0].iov_len;
+      p++;
+      niov--;
+    }
+    if (r > 0) {
+      p[0].iov_base = (char *) p[0].iov_base + r;
+      p[0].iov_len -= r;
+    }
+  }
+
+  return 0;
+}
+
+#endif /* HAVE_SYS_UIO_H */
+
 /* Read buffer from conn->sockin and either succeed completely
  * (returns > 0), read an EOF (returns 0), or fail (returns -1).
  */
@@ -450,6 +1178,49 @@ raw_recv (void *vbuf, size_t len)
   ssize_t r;
   bool first_read = true;
 
+#ifdef TCP_QUICKACK
+  /* For small reads the request-reply pattern means our ACKs
+   * piggyback on the reply and delayed ACKs cost nothing.  A large
+   * write payload is a one-way stream: the client stalls waiting for
+   * window updates, so re-arm QUICKACK (the kernel clears it again
+   * after use) before draining it.
+   */
+  if (conn->is_tcp && len >= 64 * 1024) {
+    const int one = 1;
+    setsockopt (sock, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof one);
+  }
+#endif
+
+#if defined (MSG_DONTWAIT) && !defined (WIN32)
+  /* --busy-poll: spin for up to busy_poll microseconds before
+   * blocking, so on a dedicated core the next request is picked up
+   * without paying scheduler wake/sleep latency.  Only the wait for
+   * the start of a record is worth spinning on; its remaining bytes
+   * follow immediately.  Errors other than EAGAIN fall through to the
+   * blocking loop below to be diagnosed there.
+   */
+  if (conn->busy_poll) {
+    struct timespec t0, t;
+
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    do {
+      r = recv (sock, buf, len, MSG_DONTWAIT);
+      if (r > 0) {
+        buf += r;
+        len -= r;
+        first_read = false;
+        break;
+      }
+      if (r == 0)
+        return 0;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        break;
+      clock_gettime (CLOCK_MONOTONIC, &t);
+    } while ((t.tv_sec - t0.tv_sec) * UINT64_C (1000000000) +
+             (t.tv_nsec - t0.tv_nsec) < busy_poll * UINT64_C (1000));
+  }
+#endif
+
   while (len > 0) {
     /* On Unix we want to use read(2) here because that allows us to
      * read from non-sockets (think: nbdkit -s).  In particular this
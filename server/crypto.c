@@ -44,6 +44,8 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "cleanup.h"
 #include "internal.h"
@@ -54,6 +56,9 @@
 
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+#include <gnutls/socket.h>
+#endif
 
 static int crypto_auth;
 #define CRYPTO_AUTH_CERTIFICATES 1
@@ -62,6 +67,132 @@ static int crypto_auth;
 static gnutls_certificate_credentials_t x509_creds;
 static gnutls_psk_server_credentials_t psk_creds;
 
+/* Session resumption, so that reconnecting clients do not pay for a
+ * full handshake every time: stateless session tickets (one key for
+ * the server lifetime), plus a bounded server-side cache for clients
+ * which do not support the ticket extension.
+ */
+static gnutls_datum_t ticket_key;
+
+#define SESSION_CACHE_SIZE 128
+#define SESSION_CACHE_EXPIRY (6 * 60 * 60) /* seconds, GnuTLS default */
+
+struct session_cache_entry {
+  gnutls_datum_t key;
+  gnutls_datum_t data;
+  time_t stored;                /* 0 = slot is free */
+};
+
+static struct session_cache_entry session_cache[SESSION_CACHE_SIZE];
+static pthread_mutex_t session_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Called with the session cache lock held. */
+static void
+free_session_cache_entry (struct session_cache_entry *ent)
+{
+  free (ent->key.data);
+  free (ent->data.data);
+  memset (ent, 0, sizeof *ent);
+}
+
+static int
+session_db_store (void *ptr, gnutls_datum_t key, gnutls_datum_t data)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&session_cache_lock);
+  struct session_cache_entry *slot = NULL;
+  const time_t now = time (NULL);
+  size_t i;
+
+  /* Reuse the entry with the same key, else take a free or expired
+   * slot, else evict the oldest entry so the cache stays bounded.
+   */
+  for (i = 0; i < SESSION_CACHE_SIZE; ++i) {
+    struct session_cache_entry *ent = &session_cache[i];
+
+    if (ent->stored != 0 &&
+        ent->key.size == key.size &&
+        memcmp (ent->key.data, key.data, key.size) == 0) {
+      slot = ent;
+      break;
+    }
+  }
+  if (slot == NULL) {
+    for (i = 0; i < SESSION_CACHE_SIZE; ++i) {
+      struct session_cache_entry *ent = &session_cache[i];
+
+      if (ent->stored == 0 || now - ent->stored >= SESSION_CACHE_EXPIRY) {
+        slot = ent;
+        break;
+      }
+      if (slot == NULL || ent->stored < slot->stored)
+        slot = ent;
+    }
+  }
+
+  free_session_cache_entry (slot);
+  slot->key.data = malloc (key.size);
+  slot->data.data = malloc (data.size);
+  if (slot->key.data == NULL || slot->data.data == NULL) {
+    free_session_cache_entry (slot);
+    return -1;
+  }
+  memcpy (slot->key.data, key.data, key.size);
+  slot->key.size = key.size;
+  memcpy (slot->data.data, data.data, data.size);
+  slot->data.size = data.size;
+  slot->stored = now;
+  return 0;
+}
+
+static gnutls_datum_t
+session_db_retrieve (void *ptr, gnutls_datum_t key)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&session_cache_lock);
+  gnutls_datum_t ret = { NULL, 0 };
+  const time_t now = time (NULL);
+  size_t i;
+
+  for (i = 0; i < SESSION_CACHE_SIZE; ++i) {
+    struct session_cache_entry *ent = &session_cache[i];
+
+    if (ent->stored != 0 &&
+        ent->key.size == key.size &&
+        memcmp (ent->key.data, key.data, key.size) == 0) {
+      if (now - ent->stored >= SESSION_CACHE_EXPIRY) {
+        free_session_cache_entry (ent);
+        break;
+      }
+      /* GnuTLS frees the returned datum with gnutls_free. */
+      ret.data = gnutls_malloc (ent->data.size);
+      if (ret.data == NULL)
+        break;
+      memcpy (ret.data, ent->data.data, ent->data.size);
+      ret.size = ent->data.size;
+      break;
+    }
+  }
+  return ret;
+}
+
+static int
+session_db_remove (void *ptr, gnutls_datum_t key)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&session_cache_lock);
+  size_t i;
+
+  for (i = 0; i < SESSION_CACHE_SIZE; ++i) {
+    struct session_cache_entry *ent = &session_cache[i];
+
+    if (ent->stored != 0 &&
+        ent->key.size == key.size &&
+        memcmp (ent->key.data, key.data, key.size) == 0) {
+      free_session_cache_entry (ent);
+      break;
+    }
+  }
+  return 0;
+}
+
 static void print_gnutls_error (int err, const char *fs, ...)
   __attribute__((format (printf, 2, 3)));
 
@@ -267,6 +398,17 @@ crypto_init (bool tls_set_on_cli)
 
   if (r == 0) {
     debug ("TLS enabled using: %s", what);
+
+    /* One ticket key for the server lifetime is enough: it expires
+     * with the process and tickets carry their own lifetime.  Not
+     * fatal if this fails, clients simply do full handshakes.
+     */
+    err = gnutls_session_ticket_key_generate (&ticket_key);
+    if (err < 0) {
+      debug ("gnutls_session_ticket_key_generate: %s (session tickets "
+             "disabled)", gnutls_strerror (err));
+      ticket_key.data = NULL;
+    }
     return;
   }
 
@@ -302,6 +444,8 @@ crypto_init (bool tls_set_on_cli)
 void
 crypto_free (void)
 {
+  size_t i;
+
   if (tls > 0) {
     switch (crypto_auth) {
     case CRYPTO_AUTH_CERTIFICATES:
@@ -313,6 +457,14 @@ crypto_free (void)
     }
   }
 
+  if (ticket_key.data != NULL) {
+    gnutls_memset (ticket_key.data, 0, ticket_key.size);
+    gnutls_free (ticket_key.data);
+    ticket_key.data = NULL;
+  }
+  for (i = 0; i < SESSION_CACHE_SIZE; ++i)
+    free_session_cache_entry (&session_cache[i]);
+
   gnutls_global_deinit ();
 }
 
@@ -690,6 +842,20 @@ crypto_negotiate_tls (int sockin, int sockout)
     goto error;
   }
 
+  /* Enable session resumption so reconnecting clients skip most of
+   * the handshake.
+   */
+  if (ticket_key.data != NULL) {
+    err = gnutls_session_ticket_enable_server (session, &ticket_key);
+    if (err < 0)
+      debug ("gnutls_session_ticket_enable_server: %s",
+             gnutls_strerror (err));
+  }
+  gnutls_db_set_retrieve_function (session, session_db_retrieve);
+  gnutls_db_set_store_function (session, session_db_store);
+  gnutls_db_set_remove_function (session, session_db_remove);
+  gnutls_db_set_cache_expiration (session, SESSION_CACHE_EXPIRY);
+
   /* Set up GnuTLS so it reads and writes on the raw sockets. */
   gnutls_transport_set_int2 (session, sockin, sockout);
 #ifdef WIN32
@@ -722,12 +888,43 @@ crypto_negotiate_tls (int sockin, int sockout)
   debug ("TLS handshake completed");
   debug_session (session);
 
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+  /* If GnuTLS established kernel TLS offload for the send direction
+   * (requires a GnuTLS build with ktls enabled and the kernel tls
+   * module) then anything written to the socket is encrypted by the
+   * kernel, so we can keep the plain socket send paths including
+   * vectored sends and MSG_MORE corking.  The receive side stays with
+   * GnuTLS so post-handshake control messages are still handled in
+   * userspace.
+   */
+  {
+    gnutls_transport_ktls_enable_flags_t ktls_flags =
+      gnutls_transport_is_ktls_enabled (session);
+
+    if (ktls_flags & GNUTLS_KTLS_SEND) {
+      debug ("TLS: kernel TLS offload enabled for sending");
+      conn->crypto_session = session;
+      conn->recv = crypto_recv;
+      conn->close = crypto_close;
+#ifdef USE_ZEROCOPY
+      /* MSG_ZEROCOPY is not supported on kTLS sockets. */
+      conn->zerocopy = false;
+#endif
+      return 0;
+    }
+  }
+#endif
+
   /* Set up the connection recv/send/close functions so they call
    * GnuTLS wrappers instead.
    */
   conn->crypto_session = session;
   conn->recv = crypto_recv;
   conn->send = crypto_send;
+  /* The fallback in connection_sendv already batches via the corking
+   * in crypto_send, so no vectored send is needed here.
+   */
+  conn->sendv = NULL;
   conn->close = crypto_close;
   return 0;
 
@@ -38,6 +38,7 @@
 
 #include <dlfcn.h>
 
+#include "cleanup.h"
 #include "internal.h"
 
 struct debug_flag {
@@ -153,6 +154,60 @@ apply_debug_flags (void *dl, const char *name)
   }
 }
 
+/* Set a *_debug_* variable at runtime ("debug NAME.FLAG=N" received
+ * on the stats socket).  Unlike add_debug_flag this must not exit on
+ * bad input; it returns 0 on success or -1 with a message in *error
+ * (static string) on failure.  The store is atomic so flipping
+ * instrumentation on under load is safe against concurrent readers.
+ */
+int
+set_debug_flag_at_runtime (const char *arg, const char **error)
+{
+  CLEANUP_FREE char *name = NULL, *flagname = NULL, *symbol = NULL;
+  struct backend *b;
+  const char *p, *q;
+  int value, *sym;
+
+  p = strchr (arg, '.');
+  q = strchr (arg, '=');
+  if (p == NULL || q == NULL || p == arg || q < p + 2 || q[1] == '\0') {
+    *error = "must have the format NAME.FLAG=N";
+    return -1;
+  }
+
+  name = strndup (arg, p - arg);
+  flagname = strndup (p + 1, q - p - 1);
+  if (name == NULL || flagname == NULL) {
+    *error = "out of memory";
+    return -1;
+  }
+  if (nbdkit_parse_int ("flag", q + 1, &value) == -1) {
+    *error = "could not parse value";
+    return -1;
+  }
+  symbol = symbol_of_debug_flag (name, flagname);
+
+  if (strcmp (name, "nbdkit") == 0)
+    sym = dlsym (RTLD_DEFAULT, symbol);
+  else {
+    for_each_backend (b)
+      if (strcmp (b->name, name) == 0)
+        break;
+    if (b == NULL) {
+      *error = "no plugin or filter with that name is loaded";
+      return -1;
+    }
+    sym = dlsym (b->dl, symbol);
+  }
+  if (sym == NULL) {
+    *error = "no such debug flag";
+    return -1;
+  }
+
+  __atomic_store_n (sym, value, __ATOMIC_RELAXED);
+  return 0;
+}
+
 void
 free_debug_flags (void)
 {
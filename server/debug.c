@@ -67,6 +67,16 @@ nbdkit_vdebug (const char *fs, va_list args)
 
   if (!verbose)
     return;
+
+  /* With --trace, record in the per-thread ring instead of
+   * serializing every thread on the stderr lock.
+   */
+  if (trace) {
+    trace_record (fs, args);
+    errno = err;
+    return;
+  }
+
 #ifdef HAVE_FLOCKFILE
   flockfile (stderr);
 #endif
@@ -92,6 +102,14 @@ nbdkit_debug (const char *fs, ...)
   if (!verbose)
     return;
 
+  if (trace) {
+    va_start (args, fs);
+    trace_record (fs, args);
+    va_end (args);
+    errno = err;
+    return;
+  }
+
 #ifdef HAVE_FLOCKFILE
   flockfile (stderr);
 #endif
@@ -33,6 +33,7 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <sys/types.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
@@ -53,8 +54,61 @@ DEFINE_VECTOR_TYPE(exports, struct nbdkit_export);
 struct nbdkit_exports {
   exports exports;
   bool use_default;
+
+  /* Hash index over export names so that lookup stays O(1) even with
+   * tens of thousands of dynamic exports.  Open addressing with
+   * linear probing; slots store index+1 into the exports vector so
+   * that 0 (from calloc) means empty.  nr_slots is a power of two or
+   * 0 before the first export is added.
+   */
+  size_t *slots;
+  size_t nr_slots;
 };
 
+static size_t
+hash_name (const char *name)
+{
+  size_t h = 0xcbf29ce484222325; /* FNV-1a */
+
+  while (*name) {
+    h ^= (unsigned char) *name++;
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+static void
+index_insert (struct nbdkit_exports *exps, size_t i)
+{
+  size_t slot = hash_name (exps->exports.ptr[i].name) & (exps->nr_slots - 1);
+
+  while (exps->slots[slot] != 0)
+    slot = (slot + 1) & (exps->nr_slots - 1);
+  exps->slots[slot] = i + 1;
+}
+
+/* Keep the load factor under 2/3.  Returns -1 on allocation failure. */
+static int
+index_reserve (struct nbdkit_exports *exps)
+{
+  size_t new_slots, i;
+
+  if (exps->nr_slots && (exps->exports.size + 1) * 3 < exps->nr_slots * 2)
+    return 0;
+
+  new_slots = exps->nr_slots ? exps->nr_slots * 2 : 64;
+  free (exps->slots);
+  exps->slots = calloc (new_slots, sizeof (size_t));
+  if (exps->slots == NULL) {
+    exps->nr_slots = 0;
+    return -1;
+  }
+  exps->nr_slots = new_slots;
+  for (i = 0; i < exps->exports.size; ++i)
+    index_insert (exps, i);
+  return 0;
+}
+
 struct nbdkit_exports *
 nbdkit_exports_new (void)
 {
@@ -67,6 +121,8 @@ nbdkit_exports_new (void)
   }
   r->exports = (exports) empty_vector;
   r->use_default = false;
+  r->slots = NULL;
+  r->nr_slots = 0;
   return r;
 }
 
@@ -83,6 +139,7 @@ nbdkit_exports_free (struct nbdkit_exports *exps)
   if (exps) {
     exports_iter (&exps->exports, nbdkit_export_clear);
     free (exps->exports.ptr);
+    free (exps->slots);
     free (exps);
   }
 }
@@ -100,6 +157,23 @@ nbdkit_get_export (const struct nbdkit_exports *exps, size_t i)
   return exps->exports.ptr[i];
 }
 
+ssize_t
+nbdkit_find_export (const struct nbdkit_exports *exps, const char *name)
+{
+  size_t slot, i;
+
+  if (exps->nr_slots == 0)
+    return -1;
+
+  slot = hash_name (name) & (exps->nr_slots - 1);
+  while ((i = exps->slots[slot]) != 0) {
+    if (strcmp (exps->exports.ptr[i-1].name, name) == 0)
+      return i - 1;
+    slot = (slot + 1) & (exps->nr_slots - 1);
+  }
+  return -1;
+}
+
 int
 nbdkit_add_export (struct nbdkit_exports *exps,
                    const char *name, const char *description)
@@ -133,13 +207,15 @@ nbdkit_add_export (struct nbdkit_exports *exps,
     }
   }
 
-  if (exports_append (&exps->exports, e) == -1) {
+  if (index_reserve (exps) == -1 ||
+      exports_append (&exps->exports, e) == -1) {
     nbdkit_error ("nbdkit_add_export: realloc: %m");
     free (e.name);
     free (e.description);
     errno = ENOMEM;
     return -1;
   }
+  index_insert (exps, exps->exports.size - 1);
 
   return 0;
 }
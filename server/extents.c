@@ -105,6 +105,38 @@ nbdkit_extents_new (uint64_t start, uint64_t end)
   return r;
 }
 
+/* Reuse an already-allocated list for a new request, keeping the
+ * backing array.  This is called on the request hot path (via
+ * threadlocal_extents) so that steady-state block status requests do
+ * not allocate.
+ */
+int
+reset_extents (struct nbdkit_extents *exts, uint64_t start, uint64_t end)
+{
+  if (start > INT64_MAX || end > INT64_MAX) {
+    nbdkit_error ("reset_extents: "
+                  "start (%" PRIu64 ") or end (%" PRIu64 ") > INT64_MAX",
+                  start, end);
+    errno = ERANGE;
+    return -1;
+  }
+
+  /* 0-length ranges are possible, so start == end is not an error. */
+  if (start > end) {
+    nbdkit_error ("reset_extents: "
+                  "start (%" PRIu64 ") >= end (%" PRIu64 ")",
+                  start, end);
+    errno = ERANGE;
+    return -1;
+  }
+
+  exts->extents.size = 0;      /* keep the backing array */
+  exts->start = start;
+  exts->end = end;
+  exts->next = -1;
+  return 0;
+}
+
 void
 nbdkit_extents_free (struct nbdkit_extents *exts)
 {
@@ -210,6 +242,130 @@ nbdkit_add_extent (struct nbdkit_extents *exts,
   }
 }
 
+/* Per-connection cache of the last block status reply.
+ *
+ * Clients such as qemu-img walk the disk linearly, sending many
+ * NBD_CMD_BLOCK_STATUS requests which land inside the range covered
+ * by an earlier reply (plugins often describe more of the disk than
+ * the request asked for, and REQ_ONE truncates the reply to the
+ * client but not the list we computed).  Keep a copy of the last
+ * reply on the connection and serve later requests from it when they
+ * fall entirely inside the cached range.
+ *
+ * The cache must be invalidated by writes on ANY connection, not
+ * just this one: a multi-conn client may write on one connection,
+ * flush, and query block status on another, and serving it stale
+ * "hole" extents there could make a copy tool skip real data.  A
+ * global generation counter is bumped by every write-like command;
+ * a cached reply is only valid while the generation it was stored
+ * under is still current.  Writes from outside nbdkit are not seen,
+ * but block status is always advisory in the face of those.
+ */
+
+static _Atomic uint64_t extent_cache_generation;
+
+/* Don't copy enormous replies; covering ranges with this many extents
+ * are unlikely to be re-queried before a write anyway.
+ */
+#define EXTENT_CACHE_MAX_EXTENTS 4096
+
+/* Serve a block status request from the cache if possible.  Returns 1
+ * and fills in 'exts' on a hit, 0 on a miss, or -1 on error (errno is
+ * set).
+ */
+int
+extent_cache_lookup (struct connection *conn,
+                     uint64_t offset, uint32_t count,
+                     struct nbdkit_extents *exts)
+{
+  ACQUIRE_ADAPTIVE_LOCK_FOR_CURRENT_SCOPE (&conn->extent_cache_lock);
+  const struct nbdkit_extents *cache = conn->extent_cache;
+  const struct nbdkit_extent *last;
+  size_t i;
+
+  if (cache == NULL || cache->extents.size == 0)
+    return 0;
+
+  /* A write on any connection since this was stored invalidates it. */
+  if (conn->extent_cache_gen != extent_cache_generation)
+    return 0;
+
+  /* The cached extents are contiguous, but the plugin may have
+   * described less than the original request asked for, so check the
+   * requested range against what the reply actually covered.
+   */
+  last = &cache->extents.ptr[cache->extents.size-1];
+  if (offset < cache->extents.ptr[0].offset ||
+      offset + count > last->offset + last->length)
+    return 0;
+
+  for (i = 0; i < cache->extents.size; ++i) {
+    const struct nbdkit_extent e = cache->extents.ptr[i];
+
+    if (e.offset + e.length <= offset)
+      continue;
+    if (e.offset >= offset + count)
+      break;
+    /* nbdkit_add_extent clamps extents overlapping the start of the
+     * range, so we can add the whole cached extent here.
+     */
+    if (nbdkit_add_extent (exts, e.offset, e.length, e.type) == -1)
+      return -1;
+  }
+
+  return 1;
+}
+
+/* Take a copy of the reply we are about to send so that later
+ * requests inside the same range can be served without calling the
+ * plugin.  Failure to cache is not an error.
+ */
+void
+extent_cache_store (struct connection *conn,
+                    const struct nbdkit_extents *exts)
+{
+  struct nbdkit_extents *copy;
+  const size_t size = exts->extents.size;
+
+  if (size == 0 || size > EXTENT_CACHE_MAX_EXTENTS)
+    return;
+
+  copy = malloc (sizeof *copy);
+  if (copy == NULL)
+    return;
+  copy->extents.ptr = malloc (size * sizeof (struct nbdkit_extent));
+  if (copy->extents.ptr == NULL) {
+    free (copy);
+    return;
+  }
+  memcpy (copy->extents.ptr, exts->extents.ptr,
+          size * sizeof (struct nbdkit_extent));
+  copy->extents.size = copy->extents.alloc = size;
+  copy->start = exts->start;
+  copy->end = exts->end;
+  copy->next = exts->next;
+
+  {
+    ACQUIRE_ADAPTIVE_LOCK_FOR_CURRENT_SCOPE (&conn->extent_cache_lock);
+    nbdkit_extents_free (conn->extent_cache);
+    conn->extent_cache = copy;
+    conn->extent_cache_gen = extent_cache_generation;
+  }
+}
+
+/* Called before any write-like command so that stale extents are
+ * never served after the disk changes under them.  Bumping the
+ * generation invalidates the caches of every other connection too.
+ */
+void
+extent_cache_invalidate (struct connection *conn)
+{
+  extent_cache_generation++;
+  ACQUIRE_ADAPTIVE_LOCK_FOR_CURRENT_SCOPE (&conn->extent_cache_lock);
+  nbdkit_extents_free (conn->extent_cache);
+  conn->extent_cache = NULL;
+}
+
 /* Compute aligned extents on behalf of a filter. */
 int
 nbdkit_extents_aligned (struct nbdkit_next_ops *next_ops,
@@ -40,6 +40,7 @@
 #include <assert.h>
 
 #include "internal.h"
+#include "probes.h"
 
 /* We extend the generic backend struct with extra fields relating
  * to this filter.
@@ -310,6 +311,8 @@ static struct nbdkit_next_ops next_ops = {
   .zero = backend_zero,
   .extents = backend_extents,
   .cache = backend_cache,
+  .preadv = backend_preadv,
+  .pwritev = backend_pwritev,
 };
 
 static int
@@ -473,12 +476,16 @@ filter_pread (struct backend *b, void *handle,
               uint32_t flags, int *err)
 {
   struct backend_filter *f = container_of (b, struct backend_filter, backend);
+  int r;
 
+  PROBE3 (filter_pread_start, b->name, count, offset);
   if (f->filter.pread)
-    return f->filter.pread (&next_ops, b->next, handle,
-                            buf, count, offset, flags, err);
+    r = f->filter.pread (&next_ops, b->next, handle,
+                         buf, count, offset, flags, err);
   else
-    return backend_pread (b->next, buf, count, offset, flags, err);
+    r = backend_pread (b->next, buf, count, offset, flags, err);
+  PROBE2 (filter_pread_done, b->name, r);
+  return r;
 }
 
 static int
@@ -487,12 +494,78 @@ filter_pwrite (struct backend *b, void *handle,
                uint32_t flags, int *err)
 {
   struct backend_filter *f = container_of (b, struct backend_filter, backend);
+  int r;
 
+  PROBE3 (filter_pwrite_start, b->name, count, offset);
   if (f->filter.pwrite)
-    return f->filter.pwrite (&next_ops, b->next, handle,
-                             buf, count, offset, flags, err);
+    r = f->filter.pwrite (&next_ops, b->next, handle,
+                          buf, count, offset, flags, err);
   else
-    return backend_pwrite (b->next, buf, count, offset, flags, err);
+    r = backend_pwrite (b->next, buf, count, offset, flags, err);
+  PROBE2 (filter_pwrite_done, b->name, r);
+  return r;
+}
+
+static int
+filter_preadv (struct backend *b, void *handle,
+               const struct nbdkit_iovec *iov, int iovcnt, uint64_t offset,
+               uint32_t flags, int *err)
+{
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+  int i, r;
+
+  if (f->filter.preadv)
+    return f->filter.preadv (&next_ops, b->next, handle,
+                             iov, iovcnt, offset, flags, err);
+
+  /* A filter which only understands flat reads sees one per segment;
+   * one with neither callback passes the vector through untouched.
+   */
+  if (f->filter.pread == NULL)
+    return backend_preadv (b->next, iov, iovcnt, offset, flags, err);
+
+  for (i = 0; i < iovcnt; ++i) {
+    PROBE3 (filter_pread_start, b->name, (uint32_t) iov[i].iov_len, offset);
+    r = f->filter.pread (&next_ops, b->next, handle,
+                         iov[i].iov_base, iov[i].iov_len, offset, flags, err);
+    PROBE2 (filter_pread_done, b->name, r);
+    if (r == -1)
+      return -1;
+    offset += iov[i].iov_len;
+  }
+  return 0;
+}
+
+static int
+filter_pwritev (struct backend *b, void *handle,
+                const struct nbdkit_iovec *iov, int iovcnt, uint64_t offset,
+                uint32_t flags, int *err)
+{
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+  int i, r;
+
+  if (f->filter.pwritev)
+    return f->filter.pwritev (&next_ops, b->next, handle,
+                              iov, iovcnt, offset, flags, err);
+
+  if (f->filter.pwrite == NULL)
+    return backend_pwritev (b->next, iov, iovcnt, offset, flags, err);
+
+  /* FUA need only apply to the last write: nothing in the request is
+   * durable until the whole request has succeeded.
+   */
+  for (i = 0; i < iovcnt; ++i) {
+    uint32_t fl = i == iovcnt - 1 ? flags : flags & ~NBDKIT_FLAG_FUA;
+
+    PROBE3 (filter_pwrite_start, b->name, (uint32_t) iov[i].iov_len, offset);
+    r = f->filter.pwrite (&next_ops, b->next, handle,
+                          iov[i].iov_base, iov[i].iov_len, offset, fl, err);
+    PROBE2 (filter_pwrite_done, b->name, r);
+    if (r == -1)
+      return -1;
+    offset += iov[i].iov_len;
+  }
+  return 0;
 }
 
 static int
@@ -564,6 +637,69 @@ filter_cache (struct backend *b, void *handle,
     return backend_cache (b->next, count, offset, flags, err);
 }
 
+static const char *
+filter_dirty_bitmap (struct backend *b)
+{
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+
+  if (f->filter.dirty_bitmap)
+    return f->filter.dirty_bitmap ();
+  else
+    return backend_dirty_bitmap (b->next);
+}
+
+static int
+filter_dirty_extents (struct backend *b, void *handle,
+                      uint32_t count, uint64_t offset, uint32_t flags,
+                      struct nbdkit_extents *extents, int *err)
+{
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+
+  if (f->filter.dirty_extents)
+    return f->filter.dirty_extents (&next_ops, b->next, handle,
+                                    count, offset, flags,
+                                    extents, err);
+  else
+    return backend_dirty_extents (b->next, count, offset, flags,
+                                  extents, err);
+}
+
+static char *
+filter_metrics (struct backend *b)
+{
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+
+  /* Not forwarded along the chain: the metrics reporter visits every
+   * backend itself.
+   */
+  if (f->filter.metrics)
+    return f->filter.metrics ();
+  else
+    return NULL;
+}
+
+static int
+filter_pread_zerocopy (struct backend *b, void *handle,
+                       struct nbdkit_zerocopy_read *zc,
+                       uint32_t count, uint64_t offset, uint32_t flags,
+                       int *err)
+{
+  /* Filters transform the data path, so a plugin buffer cannot be
+   * lent through them; make the server fall back to a copied read.
+   */
+  return 1;
+}
+
+static int
+filter_can_async (struct backend *b, void *handle)
+{
+  /* Filters cannot pass asynchronous requests through: every filter
+   * callback wraps the data path synchronously, so the whole chain
+   * falls back to the synchronous path.
+   */
+  return 0;
+}
+
 static struct backend filter_functions = {
   .free = filter_free,
   .thread_model = filter_thread_model,
@@ -602,6 +738,13 @@ static struct backend filter_functions = {
   .zero = filter_zero,
   .extents = filter_extents,
   .cache = filter_cache,
+  .dirty_bitmap = filter_dirty_bitmap,
+  .dirty_extents = filter_dirty_extents,
+  .metrics = filter_metrics,
+  .can_async = filter_can_async,
+  .pread_zerocopy = filter_pread_zerocopy,
+  .preadv = filter_preadv,
+  .pwritev = filter_pwritev,
 };
 
 /* Register and load a filter. */
@@ -655,6 +798,15 @@ filter_register (struct backend *next, size_t index, const char *filename,
 
   f->filter = *filter;
 
+  /* A filter with no .pread or .preadv callback forwards reads
+   * verbatim, so dispatch reads for this layer straight to the
+   * deepest layer which does intercept them, skipping the per-layer
+   * wrappers (see backend_pread and backend_preadv, which share this
+   * field).
+   */
+  if (f->filter.pread == NULL && f->filter.preadv == NULL)
+    f->backend.pread_target = next->pread_target;
+
   backend_load (&f->backend, f->filter.name, f->filter.load);
 
   return (struct backend *) f;
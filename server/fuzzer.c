@@ -39,9 +39,9 @@
 #include <unistd.h>
 #include <poll.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/wait.h>
 
 #include "internal.h"
 
@@ -55,15 +55,46 @@
  */
 extern int fuzzer_main (int argc, char *argv[]);
 
-static void server (int sock);
+static void initialize (void);
+static void *client_thread (void *vp);
 static void client (const uint8_t *data, size_t size, int sock);
 
-/* This is the entry point called by libFuzzer. */
+/* Set while fuzzer_main runs: makes main() return just before it
+ * would start serving, leaving the configured server (plugin loaded,
+ * .get_ready and .after_fork done) in place for us to drive.
+ */
+bool fuzzer_initialize_only;
+
+struct client_args {
+  const uint8_t *data;
+  size_t size;
+  int sock;
+};
+
+/* This is the entry point called by libFuzzer.
+ *
+ * Persistent mode: the server is initialized once, then each input is
+ * one in-process client connection over a socketpair.  A thread plays
+ * the phony NBD client while this thread runs the ordinary connection
+ * loop (handle_single_connection does new_connection, handshake,
+ * request loop, free_connection), so no fork or exec happens per
+ * input and connection state is fully reset in between.  The memory
+ * plugin's disk contents do persist from one input to the next, which
+ * trades a little reproducibility for orders of magnitude more execs
+ * per second.
+ */
 int
 LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
 {
-  pid_t pid;
-  int sv[2], r, status;
+  static bool initialized = false;
+  int sv[2], err;
+  pthread_t thread;
+  struct client_args args;
+
+  if (!initialized) {
+    initialize ();
+    initialized = true;
+  }
 
   /* Create a connected socket. */
   if (socketpair (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) == -1) {
@@ -71,76 +102,55 @@ LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
     exit (EXIT_FAILURE);
   }
 
-  /* Fork: The parent will be the nbdkit process (server).  The child
-   * will be the phony NBD client.
-   */
-  pid = fork ();
-  if (pid == -1) {
-    perror ("fork");
+  args.data = data;
+  args.size = size;
+  args.sock = sv[1];
+  err = pthread_create (&thread, NULL, client_thread, &args);
+  if (err) {
+    errno = err;
+    perror ("pthread_create");
     exit (EXIT_FAILURE);
   }
 
-  if (pid > 0) {
-    /* Parent: nbdkit server. */
-    close (sv[1]);
-
-    server (sv[0]);
-
-    close (sv[0]);
-
-  again:
-    r = wait (&status);
-    if (r == -1) {
-      if (errno == EINTR)
-        goto again;
-      perror ("wait");
-      exit (EXIT_FAILURE);
-    }
-    if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
-      fprintf (stderr, "bad exit status %d\n", status);
-
-    return 0;
-  }
-
-  /* Child: phony NBD client. */
-  close (sv[0]);
-
-  client (data, size, sv[1]);
+  /* Serve the connection; the socket is closed by free_connection. */
+  handle_single_connection (sv[0], sv[0]);
 
-  close (sv[1]);
-
-  _exit (EXIT_SUCCESS);
+  pthread_join (thread, NULL);
+  return 0;
 }
 
 static void
-server (int sock)
+initialize (void)
 {
   char *argv[] = {
     "nbdkit",
-    "-s",         /* take input from stdin/stdout */
+    "-s",         /* single connection mode */
+    "-t", "1",    /* serial request loop, keeps inputs deterministic */
     "--log=null", /* discard error messages */
     "plugins/memory/.libs/nbdkit-memory-plugin." SOEXT, "1M",
     NULL
   };
   const int argc = sizeof argv / sizeof argv[0] - 1;
-  int saved_stdin, saved_stdout;
-
-  /* Make the socket appear as stdin and stdout of the process, saving
-   * the existing stdin/stdout.
-   */
-  saved_stdin = dup (0);
-  saved_stdout = dup (1);
-  dup2 (sock, 0);
-  dup2 (sock, 1);
-
-  /* Call nbdkit's normal main() function. */
-  fuzzer_main (argc, argv);
-
-  /* Restore stdin/stdout. */
-  dup2 (saved_stdin, 0);
-  dup2 (saved_stdout, 1);
-  close (saved_stdin);
-  close (saved_stdout);
+
+  fuzzer_initialize_only = true;
+  if (fuzzer_main (argc, argv) != 0) {
+    fprintf (stderr, "fuzzer: server initialization failed\n");
+    exit (EXIT_FAILURE);
+  }
+  fuzzer_initialize_only = false;
+
+  /* The connections are handled on this (the libFuzzer) thread. */
+  threadlocal_new_server_thread ();
+}
+
+static void *
+client_thread (void *vp)
+{
+  struct client_args *args = vp;
+
+  client (args->data, args->size, args->sock);
+  close (args->sock);
+  return NULL;
 }
 
 static void
@@ -37,11 +37,23 @@
 #include <stddef.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#else
+/* Windows lacks struct iovec; used only with the sendv fallback. */
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
+
 #define NBDKIT_API_VERSION 2
 #define NBDKIT_INTERNAL
 #include "nbdkit-plugin.h"
@@ -101,6 +113,13 @@
 /* Maximum read or write request that we will handle. */
 #define MAX_REQUEST_SIZE (64 * 1024 * 1024)
 
+/* Alignment guaranteed for the payload buffers the server allocates
+ * (threadlocal.c and the async path in protocol.c), published to
+ * plugins as nbdkit_buffer_alignment so they can do direct I/O from
+ * them.  Covers any sector size in practice.
+ */
+#define REQUEST_BUFFER_ALIGNMENT 4096
+
 /* main.c */
 enum log_to {
   LOG_TO_DEFAULT,        /* --log not specified: log to stderr, unless
@@ -112,28 +131,41 @@ enum log_to {
 };
 
 extern struct debug_flag *debug_flags;
+extern unsigned busy_poll;
+extern bool coalesce;
 extern const char *export_name;
 extern bool foreground;
+extern bool hugepages;
 extern const char *ipaddr;
 extern enum log_to log_to;
 extern unsigned mask_handshake;
+extern unsigned max_inflight;
 extern bool newstyle;
+extern bool numa;
 extern bool no_sr;
+extern unsigned nprocesses;
 extern const char *port;
 extern bool read_only;
 extern const char *run;
 extern bool listen_stdin;
 extern bool configured;
 extern const char *selinux_label;
+extern unsigned shards;
+extern const char *stats_socket;
+extern bool profile;
 extern unsigned threads;
 extern int tls;
+extern bool trace;
 extern const char *tls_certificates_dir;
 extern const char *tls_psk;
 extern bool tls_verify_peer;
+extern bool uring;
 extern char *unixsocket;
 extern const char *user, *group;
 extern bool verbose;
 extern bool vsock;
+extern bool zerocopy;
+extern unsigned int socket_activation;
 extern int saved_stdin;
 extern int saved_stdout;
 
@@ -164,6 +196,88 @@ extern void handle_quit (int sig);
 /* signals.c */
 extern void set_up_signals (void);
 
+/* stats.c */
+struct stats_block;
+extern void start_stats_thread (void);
+extern void stats_record (uint16_t cmd, uint64_t ns, uint64_t bytes,
+                          bool error);
+extern void stats_set_busy (bool busy);
+extern void stats_block_release (struct stats_block *block);
+
+/* Latency histogram buckets, shared by stats.c and bench.c.  Each
+ * bucket covers a power-of-two range of nanoseconds split into 8
+ * linear sub-buckets, giving roughly 12% worst-case value error,
+ * which is plenty for percentile reporting.
+ */
+#define STATS_SUBBUCKET_BITS 3
+#define STATS_SUBBUCKETS (1 << STATS_SUBBUCKET_BITS)
+#define STATS_BUCKETS (64 * STATS_SUBBUCKETS)
+
+static inline unsigned
+stats_bucket_of (uint64_t ns)
+{
+  unsigned msb;
+
+  if (ns < STATS_SUBBUCKETS)
+    return ns;
+  msb = 63 - __builtin_clzll (ns);
+  return ((msb - STATS_SUBBUCKET_BITS + 1) << STATS_SUBBUCKET_BITS)
+    | ((ns >> (msb - STATS_SUBBUCKET_BITS)) & (STATS_SUBBUCKETS - 1));
+}
+
+/* Midpoint of the value range covered by a bucket, in nanoseconds. */
+static inline uint64_t
+stats_bucket_value (unsigned i)
+{
+  unsigned exp, sub;
+  uint64_t low, width;
+
+  if (i < STATS_SUBBUCKETS)
+    return i;
+  exp = i >> STATS_SUBBUCKET_BITS;
+  sub = i & (STATS_SUBBUCKETS - 1);
+  width = UINT64_C(1) << (exp - 1);
+  low = (STATS_SUBBUCKETS + sub) * width;
+  return low + width / 2;
+}
+
+/* bench.c */
+extern const char *bench;
+extern int bench_parse (const char *arg);
+extern void bench_run (void);
+
+/* trace.c */
+struct trace_ring;
+extern void set_up_trace (void);
+extern void trace_record (const char *fs, va_list args)
+  __attribute__((__format__ (printf, 1, 0), __nonnull__ (1)));
+extern void trace_dump (void);
+extern struct trace_ring *trace_ring_acquire (void);
+extern void trace_ring_release (struct trace_ring *ring);
+
+/* profile.c */
+enum profile_stage {
+  PROFILE_RECV,                 /* reading the request from the socket */
+  PROFILE_WAIT,                 /* waiting for the request serialization lock */
+  PROFILE_DISPATCH,             /* filter chain and plugin */
+  PROFILE_SEND,                 /* writing the reply to the socket */
+  PROFILE_NR_STAGES,
+};
+extern void set_up_profile (void);
+extern void profile_record (enum profile_stage stage,
+                            const struct timespec *t0);
+extern void profile_report (void);
+/* Take a stage start timestamp; pair with profile_record. */
+static inline void
+profile_start (struct timespec *t0)
+{
+  if (profile)
+    clock_gettime (CLOCK_MONOTONIC, t0);
+}
+
+/* fuzzer.c (only compiled with --enable-libfuzzer) */
+extern bool fuzzer_initialize_only;
+
 /* background.c */
 extern bool forked_into_background;
 extern void fork_into_background (void);
@@ -180,6 +294,20 @@ extern void change_user (void);
 
 /* connections.c */
 
+/* Connection counts, read by the metrics report in stats.c. */
+extern _Atomic unsigned nr_active_connections;
+extern _Atomic uint64_t nr_total_connections;
+
+/* Adaptive socket buffer telemetry, also for the metrics report. */
+extern _Atomic uint64_t nr_sockbuf_grows;
+extern _Atomic int max_adaptive_sockbuf;
+
+/* True if this platform can send with MSG_ZEROCOPY (--zerocopy). */
+#if defined MSG_ZEROCOPY && defined SO_ZEROCOPY && \
+    defined HAVE_LINUX_ERRQUEUE_H
+#define USE_ZEROCOPY 1
+#endif
+
 /* Flags for connection_send_function */
 enum {
   SEND_MORE = 1, /* Hint to use MSG_MORE/corking to group send()s */
@@ -190,6 +318,9 @@ typedef int (*connection_recv_function) (void *buf, size_t len)
 typedef int (*connection_send_function) (const void *buf, size_t len,
                                          int flags)
   __attribute__((__nonnull__ (1)));
+typedef int (*connection_sendv_function) (const struct iovec *iov, int niov,
+                                          int flags)
+  __attribute__((__nonnull__ (1)));
 typedef void (*connection_close_function) (void);
 
 /* struct handle stores data per connection and backend.  Primarily
@@ -253,9 +384,15 @@ struct connection {
   pthread_mutex_t write_lock;
   pthread_mutex_t status_lock;
 
-  int status; /* 1 for more I/O with client, 0 for shutdown, -1 on error */
+  /* 1 for more I/O with client, 0 for shutdown, -1 on error.  Read
+   * atomically without the lock on every request loop iteration;
+   * status_lock only serializes downward transitions (and the
+   * pipe-to-self notification).
+   */
+  _Atomic int status;
   int status_pipe[2]; /* track status changes via poll when nworkers > 1 */
   void *crypto_session;
+  void *uring_engine;
   int nworkers;
 
   struct handle *handles;       /* One per plugin and filter. */
@@ -266,15 +403,100 @@ struct connection {
   bool handshake_complete;
   bool using_tls;
   bool structured_replies;
+  bool extended_headers;
   bool meta_context_base_allocation;
+  bool meta_context_dirty_bitmap;
 
   string_vector interns;
   char *exportname_from_set_meta_context;
   const char *exportname;
 
+  /* The readonly flag the plugin layer was opened with, recorded so
+   * the handle cache can key parked handles (see plugins.c).
+   */
+  int plugin_readonly;
+
+  /* Export info block (size and eflags) computed by the last
+   * protocol_common_open on this connection, with the parameters it
+   * depends on, so that NBD_OPT_GO straight after NBD_OPT_INFO on the
+   * same export is answered without re-probing the backend.
+   */
+  char *exportinfo_name;
+  uint64_t exportinfo_size;
+  uint16_t exportinfo_eflags;
+  bool exportinfo_tls;
+  bool exportinfo_sr;
+  bool exportinfo_valid;
+
+  /* A request pulled off the socket by the --coalesce lookahead which
+   * turned out not to continue the current read.  Consumed (under the
+   * read lock) before reading from the socket again.
+   */
+  struct nbd_request pending_request;
+  bool have_pending_request;
+
+  /* Extents from the most recent block status reply, so that clients
+   * walking the disk linearly with overlapping or repeated
+   * NBD_CMD_BLOCK_STATUS requests do not re-query the plugin.
+   * Invalidated by writes on any connection (see the generation
+   * counter in extents.c).  NULL when empty.
+   */
+  pthread_mutex_t extent_cache_lock;
+  struct nbdkit_extents *extent_cache;
+  uint64_t extent_cache_gen;    /* generation extent_cache was stored at */
+
+  /* Fair queueing state for this connection (--qos), created lazily
+   * by sched.c on the first contended lock acquisition.
+   */
+  struct qos_flow *qos_flow;
+
+  /* Number of threads currently serving a request on this connection,
+   * bounded by --max-inflight (see
+   * connection_acquire_inflight_slot).  Protected by inflight_lock.
+   */
+  pthread_mutex_t inflight_lock;
+  pthread_cond_t inflight_cond;
+  unsigned inflight;
+
+  /* Asynchronous operations submitted to the plugin but not yet
+   * completed (see protocol.c).  Protected by inflight_lock; the
+   * connection is drained to zero before it is finalized.
+   */
+  unsigned async_pending;
+
+  /* Dependency tracking between flushes and writes, protected by
+   * inflight_lock.  A flush only starts once in-flight writes have
+   * completed (so its reply really covers them), and new writes queue
+   * until in-flight flushes finish; reads bypass both.  See
+   * connection_write_begin etc.
+   */
+  unsigned writes_pending;
+  unsigned flushes_pending;
+
+  /* NUMA node serving this connection (--numa), or -1 for no
+   * binding.  Chosen round-robin when the connection is created;
+   * every thread serving the connection binds to it.
+   */
+  int numa_node;
+
   int sockin, sockout;
+  bool busy_poll;           /* spin in raw_recv before blocking (--busy-poll) */
+
+  /* Adaptive socket buffer sizing, TCP only (see note_partial_send in
+   * connections.c).
+   */
+  bool is_tcp;
+  bool sockbuf_maxed;       /* the kernel refused further growth */
+  int sockbuf;              /* current SO_SNDBUF as the kernel reports it */
+  unsigned partial_sends;   /* partial send() pressure score */
+#ifdef USE_ZEROCOPY
+  bool zerocopy;            /* MSG_ZEROCOPY enabled on sockout */
+  uint32_t zerocopy_sent;   /* zerocopy sends issued */
+  uint32_t zerocopy_acked;  /* completions reaped from the error queue */
+#endif
   connection_recv_function recv;
   connection_send_function send;
+  connection_sendv_function sendv; /* may be NULL, use connection_sendv */
   connection_close_function close;
 };
 
@@ -287,6 +509,65 @@ get_handle (struct connection *conn, int i)
 extern void handle_single_connection (int sockin, int sockout);
 extern int connection_get_status (void);
 extern int connection_set_status (int value);
+extern int connection_sendv (const struct iovec *iov, int niov, int flags)
+  __attribute__((__nonnull__ (1)));
+extern void connection_acquire_inflight_slot (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern void connection_release_inflight_slot (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern void connection_async_begin (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern void connection_async_end (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern void connection_drain_async (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern void connection_write_begin (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern bool connection_write_try_begin (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern void connection_write_end (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern void connection_flush_begin (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern void connection_flush_end (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+
+/* prefetch.c */
+extern int prefetch_submit (struct connection *conn, uint64_t offset,
+                            uint64_t count)
+  __attribute__((__nonnull__ (1)));
+extern void prefetch_cancel (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+
+/* worker-pool.c */
+
+/* Default number of parallel requests per connection. */
+#define DEFAULT_PARALLEL_REQUESTS 16
+
+/* Tracks the pool threads granted to one connection so that the
+ * connection thread can wait for all of them to finish.
+ */
+struct worker_group {
+  pthread_cond_t cond;
+  unsigned remaining;
+};
+#define WORKER_GROUP_INIT { PTHREAD_COND_INITIALIZER, 0 }
+
+extern int worker_pool_submit (struct connection *conn, char *name,
+                               struct worker_group *group)
+  __attribute__((__nonnull__ (1, 2, 3)));
+extern void worker_group_wait (struct worker_group *group)
+  __attribute__((__nonnull__ (1)));
+
+/* numa.c */
+extern int numa_choose_node (void);
+extern void numa_bind_worker (int node);
+
+/* connections-uring.c */
+#ifdef HAVE_LIBURING
+extern int connection_uring_start (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+#endif
 
 /* protocol-handshake.c */
 extern int protocol_handshake (void);
@@ -301,7 +582,17 @@ extern int protocol_handshake_oldstyle (void);
 extern int protocol_handshake_newstyle (void);
 
 /* protocol.c */
-extern int protocol_recv_request_send_reply (void);
+
+/* How long a worker waits for the next request before returning to
+ * the pool (only when the connection supports parking).
+ */
+#define CONN_IDLE_GRACE_MS 500
+
+/* idle_timeout_ms < 0 means wait for the next request forever.
+ * Returns -1 on error, 0 on clean shutdown, 1 if a request was
+ * processed, or 2 if the idle timeout expired without a request.
+ */
+extern int protocol_recv_request_send_reply (int idle_timeout_ms);
 
 /* The context ID of base:allocation.  As far as I can tell it doesn't
  * matter what this is as long as nbdkit always returns the same
@@ -309,6 +600,11 @@ extern int protocol_recv_request_send_reply (void);
  */
 #define base_allocation_id 1
 
+/* The context ID of the dirty bitmap context, if some layer in the
+ * backend chain advertises one (see backend_dirty_bitmap).
+ */
+#define dirty_bitmap_id 2
+
 /* public.c */
 extern void free_interns (void);
 
@@ -330,6 +626,8 @@ extern int crypto_negotiate_tls (int sockin, int sockout);
 extern void add_debug_flag (const char *arg);
 extern void apply_debug_flags (void *dl, const char *name);
 extern void free_debug_flags (void);
+extern int set_debug_flag_at_runtime (const char *arg, const char **error)
+  __attribute__((__nonnull__ (1, 2)));
 
 /* log.c */
 extern void log_verror (const char *fs, va_list args);
@@ -355,6 +653,14 @@ struct backend {
    */
   struct backend *next;
 
+  /* Precomputed read-dispatch target: the deepest layer reachable by
+   * skipping consecutive filters which do not intercept .pread (such
+   * filters forward reads verbatim, so they can be elided from the
+   * data path entirely).  Points back to this backend for plugins and
+   * for filters which do intercept reads.
+   */
+  struct backend *pread_target;
+
   /* A unique index used to fetch the handle from the connections
    * object.  The plugin (last in the chain) has index 0, and the
    * filters have index 1, 2, ... depending how "far" they are from
@@ -425,8 +731,65 @@ struct backend {
                   struct nbdkit_extents *extents, int *err);
   int (*cache) (struct backend *, void *handle,
                 uint32_t count, uint64_t offset, uint32_t flags, int *err);
+
+  /* Dirty bitmap metadata context (see the cbt filter).  dirty_bitmap
+   * returns the name of the context to advertise during negotiation
+   * (eg. "qemu:dirty-bitmap:NAME"), or NULL if no layer in the chain
+   * maintains one.  It only depends on configuration so it may be
+   * called before any handle is open.  dirty_extents is only called
+   * during NBD_CMD_BLOCK_STATUS when dirty_bitmap returned non-NULL
+   * and the client selected the context.
+   */
+  const char *(*dirty_bitmap) (struct backend *);
+  int (*dirty_extents) (struct backend *, void *handle,
+                        uint32_t count, uint64_t offset, uint32_t flags,
+                        struct nbdkit_extents *extents, int *err);
+
+  /* Metrics in Prometheus text format from this layer (or NULL).
+   * Unlike the data callbacks this is not forwarded along the chain:
+   * the metrics reporter in stats.c visits every backend itself.
+   */
+  char *(*metrics) (struct backend *);
+
+  /* Asynchronous I/O.  can_async returns a mask of BACKEND_ASYNC_*
+   * bits; the submit functions may be NULL when the mask is 0 (this
+   * is the case for all filters, which force the whole chain onto the
+   * synchronous path).
+   */
+  int (*can_async) (struct backend *, void *handle);
+  int (*pread_async) (struct backend *, void *handle,
+                      void *buf, uint32_t count, uint64_t offset,
+                      uint32_t flags, struct nbdkit_completion *completion,
+                      int *err);
+  int (*pwrite_async) (struct backend *, void *handle,
+                       const void *buf, uint32_t count, uint64_t offset,
+                       uint32_t flags, struct nbdkit_completion *completion,
+                       int *err);
+
+  /* Zero-copy read: fill *zc with plugin-owned storage and return 0;
+   * return 1 to make the caller fall back to .pread; -1 on error.
+   */
+  int (*pread_zerocopy) (struct backend *, void *handle,
+                         struct nbdkit_zerocopy_read *zc,
+                         uint32_t count, uint64_t offset, uint32_t flags,
+                         int *err);
+
+  /* Scatter-gather read and write.  Never NULL: every layer either
+   * forwards the vector or decomposes it into per-segment pread/pwrite
+   * calls.
+   */
+  int (*preadv) (struct backend *, void *handle,
+                 const struct nbdkit_iovec *iov, int iovcnt, uint64_t offset,
+                 uint32_t flags, int *err);
+  int (*pwritev) (struct backend *, void *handle,
+                  const struct nbdkit_iovec *iov, int iovcnt, uint64_t offset,
+                  uint32_t flags, int *err);
 };
 
+/* Bits returned by backend_can_async. */
+#define BACKEND_ASYNC_READ  1
+#define BACKEND_ASYNC_WRITE 2
+
 extern void backend_init (struct backend *b, struct backend *next, size_t index,
                           const char *filename, void *dl, const char *type)
   __attribute__((__nonnull__ (1, 4, 5, 6)));
@@ -457,12 +820,14 @@ extern int backend_finalize (struct backend *b)
 extern void backend_close (struct backend *b)
   __attribute__((__nonnull__ (1)));
 extern bool backend_valid_range (struct backend *b,
-                                 uint64_t offset, uint32_t count)
+                                 uint64_t offset, uint64_t count)
   __attribute__((__nonnull__ (1)));
 
 extern int backend_reopen (struct backend *b,
                            int readonly, const char *exportname)
   __attribute__((__nonnull__ (1, 3)));
+extern void backend_set_exportsize (struct backend *b, uint64_t size)
+  __attribute__((__nonnull__ (1)));
 extern int64_t backend_get_size (struct backend *b)
   __attribute__((__nonnull__ (1)));
 extern int backend_can_write (struct backend *b)
@@ -486,6 +851,12 @@ extern int backend_can_multi_conn (struct backend *b)
 extern int backend_can_cache (struct backend *b)
   __attribute__((__nonnull__ (1)));
 
+extern void backend_seed_capabilities (struct backend *b)
+  __attribute__((__nonnull__ (1)));
+extern void backend_store_capabilities (struct backend *b)
+  __attribute__((__nonnull__ (1)));
+extern void backend_invalidate_capabilities (void);
+
 extern int backend_pread (struct backend *b,
                           void *buf, uint32_t count, uint64_t offset,
                           uint32_t flags, int *err)
@@ -513,6 +884,40 @@ extern int backend_cache (struct backend *b,
                           uint32_t count, uint64_t offset,
                           uint32_t flags, int *err)
   __attribute__((__nonnull__ (1, 5)));
+extern const char *backend_dirty_bitmap (struct backend *b)
+  __attribute__((__nonnull__ (1)));
+extern int backend_dirty_extents (struct backend *b,
+                                  uint32_t count, uint64_t offset,
+                                  uint32_t flags,
+                                  struct nbdkit_extents *extents, int *err)
+  __attribute__((__nonnull__ (1, 5, 6)));
+
+extern int backend_preadv (struct backend *b,
+                           const struct nbdkit_iovec *iov, int iovcnt,
+                           uint64_t offset, uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 2, 6)));
+extern int backend_pwritev (struct backend *b,
+                            const struct nbdkit_iovec *iov, int iovcnt,
+                            uint64_t offset, uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 2, 6)));
+extern int backend_can_async (struct backend *b)
+  __attribute__((__nonnull__ (1)));
+extern int backend_pread_zerocopy (struct backend *b,
+                                   struct nbdkit_zerocopy_read *zc,
+                                   uint32_t count, uint64_t offset,
+                                   uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 2, 6)));
+extern int backend_pread_async (struct backend *b,
+                                void *buf, uint32_t count, uint64_t offset,
+                                uint32_t flags,
+                                struct nbdkit_completion *completion, int *err)
+  __attribute__((__nonnull__ (1, 2, 6, 7)));
+extern int backend_pwrite_async (struct backend *b,
+                                 const void *buf, uint32_t count,
+                                 uint64_t offset, uint32_t flags,
+                                 struct nbdkit_completion *completion,
+                                 int *err)
+  __attribute__((__nonnull__ (1, 2, 6, 7)));
 
 /* plugins.c */
 extern struct backend *plugin_register (size_t index, const char *filename,
@@ -536,6 +941,16 @@ extern void unlock_request (void);
 extern void lock_unload (void);
 extern void unlock_unload (void);
 
+/* sched.c */
+extern bool qos_enabled;
+extern int qos_parse_rule (const char *arg, const char **error)
+  __attribute__((__nonnull__ (1, 2)));
+extern void qos_set_cost (uint64_t cost);
+extern void qos_acquire (void);
+extern void qos_release (void);
+extern void qos_free_flow (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+
 /* sockets.c */
 DEFINE_VECTOR_TYPE(sockets, int);
 extern void bind_unix_socket (sockets *) __attribute__((__nonnull__ (1)));
@@ -544,6 +959,11 @@ extern void bind_vsock (sockets *) __attribute__((__nonnull__ (1)));
 extern void accept_incoming_connections (const sockets *socks)
   __attribute__((__nonnull__ (1)));
 
+/* background.c (here because these need the sockets type above) */
+extern void fork_server_processes (sockets *socks)
+  __attribute__((__nonnull__ (1)));
+extern void wait_server_processes (void);
+
 /* threadlocal.c */
 extern void threadlocal_init (void);
 extern void threadlocal_new_server_thread (void);
@@ -555,8 +975,15 @@ extern size_t threadlocal_get_instance_num (void);
 extern void threadlocal_set_error (int err);
 extern int threadlocal_get_error (void);
 extern void *threadlocal_buffer (size_t size);
+extern struct nbdkit_extents *threadlocal_extents (uint64_t start,
+                                                   uint64_t end);
 extern void threadlocal_set_conn (struct connection *conn);
+extern void threadlocal_adopt_conn (struct connection *conn);
 extern struct connection *threadlocal_get_conn (void);
+extern struct trace_ring *threadlocal_get_trace_ring (void);
+extern bool threadlocal_set_trace_ring (struct trace_ring *ring);
+extern struct stats_block *threadlocal_get_stats_block (void);
+extern bool threadlocal_set_stats_block (struct stats_block *block);
 
 /* Macro which sets local variable struct connection *conn from
  * thread-local storage, asserting that it is non-NULL.  If you want
@@ -567,6 +994,20 @@ extern struct connection *threadlocal_get_conn (void);
   struct connection *conn = threadlocal_get_conn ();    \
   assert (conn != NULL)
 
+/* extents.c */
+extern int reset_extents (struct nbdkit_extents *exts,
+                          uint64_t start, uint64_t end)
+  __attribute__((__nonnull__ (1)));
+extern int extent_cache_lookup (struct connection *conn,
+                                uint64_t offset, uint32_t count,
+                                struct nbdkit_extents *exts)
+  __attribute__((__nonnull__ (1, 4)));
+extern void extent_cache_store (struct connection *conn,
+                                const struct nbdkit_extents *exts)
+  __attribute__((__nonnull__ (1, 2)));
+extern void extent_cache_invalidate (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+
 /* exports.c */
 extern int exports_resolve_default (struct nbdkit_exports *exports,
                                     struct backend *b, int readonly);
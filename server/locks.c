@@ -72,6 +72,12 @@ lock_init_thread_model (void)
   thread_model = top->thread_model (top);
   debug ("using thread model: %s", name_of_thread_model (thread_model));
   assert (thread_model <= NBDKIT_THREAD_MODEL_PARALLEL);
+
+  if (qos_enabled &&
+      thread_model > NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS)
+    debug ("--qos has no effect: thread model %s does not serialize "
+           "requests across connections",
+           name_of_thread_model (thread_model));
 }
 
 void
@@ -95,9 +101,13 @@ lock_request (void)
 {
   struct connection *conn = threadlocal_get_conn ();
 
-  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS &&
-      pthread_mutex_lock (&all_requests_lock))
-    abort ();
+  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS) {
+    /* --qos replaces the plain mutex with fair queueing of waiters. */
+    if (qos_enabled)
+      qos_acquire ();
+    else if (pthread_mutex_lock (&all_requests_lock))
+      abort ();
+  }
 
   if (conn && thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS &&
       pthread_mutex_lock (&conn->request_lock))
@@ -119,9 +129,12 @@ unlock_request ()
       pthread_mutex_unlock (&conn->request_lock))
     abort ();
 
-  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS &&
-      pthread_mutex_unlock (&all_requests_lock))
-    abort ();
+  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS) {
+    if (qos_enabled)
+      qos_release ();
+    else if (pthread_mutex_unlock (&all_requests_lock))
+      abort ();
+  }
 }
 
 void
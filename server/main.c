@@ -79,6 +79,7 @@
 static char *make_random_fifo (void);
 static struct backend *open_plugin_so (size_t i, const char *filename, int short_name);
 static struct backend *open_filter_so (struct backend *next, size_t i, const char *filename, int short_name);
+static void bind_listening_sockets (void);
 static void start_serving (void);
 static void write_pidfile (void);
 static bool is_config_key (const char *key, size_t len);
@@ -86,31 +87,44 @@ static void error_if_stdio_closed (void);
 static void switch_stdio (void);
 static void winsock_init (void);
 
+const char *bench;              /* --bench workload, NULL = serve normally */
+unsigned busy_poll;             /* --busy-poll microseconds, 0 = off */
+bool coalesce;                  /* --coalesce */
 struct debug_flag *debug_flags; /* -D */
 bool exit_with_parent;          /* --exit-with-parent */
 const char *export_name;        /* -e */
 bool foreground;                /* -f */
+bool hugepages;                 /* --hugepages */
 const char *ipaddr;             /* -i */
 enum log_to log_to = LOG_TO_DEFAULT; /* --log */
 unsigned mask_handshake = ~0U;  /* --mask-handshake */
+unsigned max_inflight;          /* --max-inflight, 0 = no limit */
 bool newstyle = true;           /* false = -o, true = -n */
 bool no_sr;                     /* --no-sr */
+bool numa;                      /* --numa */
 char *pidfile;                  /* -P */
+unsigned nprocesses;            /* --processes */
 const char *port;               /* -p */
 bool read_only;                 /* -r */
 const char *run;                /* --run */
 bool listen_stdin;              /* -s */
+bool profile;                   /* --profile */
 const char *selinux_label;      /* --selinux-label */
+unsigned shards = 1;            /* --shards */
+const char *stats_socket;       /* --stats-socket */
 bool swap;                      /* --swap */
 unsigned threads;               /* -t */
 int tls;                        /* --tls : 0=off 1=on 2=require */
 const char *tls_certificates_dir; /* --tls-certificates */
 const char *tls_psk;            /* --tls-psk */
 bool tls_verify_peer;           /* --tls-verify-peer */
+bool trace;                     /* --trace */
+bool uring;                     /* --uring */
 char *unixsocket;               /* -U */
 const char *user, *group;       /* -u & -g */
 bool verbose;                   /* -v */
 bool vsock;                     /* --vsock */
+bool zerocopy;                  /* --zerocopy */
 unsigned int socket_activation; /* $LISTEN_FDS and $LISTEN_PID set */
 bool configured;                /* .config_complete done */
 int saved_stdin = -1;           /* dup'd stdin during -s/--run */
@@ -175,6 +189,11 @@ dump_config (void)
   printf ("%s=%s\n", "libdir", libdir);
   printf ("%s=%s\n", "mandir", mandir);
   printf ("%s=%s\n", "name", PACKAGE_NAME);
+#ifdef HAVE_LIBNUMA
+  printf ("numa=yes\n");
+#else
+  printf ("numa=no\n");
+#endif
   printf ("%s=%s\n", "plugindir", plugindir);
   printf ("%s=%s\n", "root_tls_certificates_dir", root_tls_certificates_dir);
   printf ("%s=%s\n", "sbindir", sbindir);
@@ -188,6 +207,11 @@ dump_config (void)
   printf ("tls=yes\n");
 #else
   printf ("tls=no\n");
+#endif
+#ifdef HAVE_LIBURING
+  printf ("uring=yes\n");
+#else
+  printf ("uring=no\n");
 #endif
   printf ("%s=%s\n", "version", PACKAGE_VERSION);
   if (strcmp (NBDKIT_VERSION_EXTRA, "") != 0)
@@ -248,6 +272,26 @@ main (int argc, char *argv[])
       break;
 
     switch (c) {
+    case BENCH_OPTION:
+#ifndef WIN32
+      if (bench_parse (optarg) == -1)
+        exit (EXIT_FAILURE);
+      bench = optarg;
+      foreground = true;
+      break;
+#else
+      NOT_IMPLEMENTED_ON_WINDOWS ("--bench");
+#endif
+
+    case BUSY_POLL_OPTION:
+      if (nbdkit_parse_unsigned ("busy-poll", optarg, &busy_poll) == -1)
+        exit (EXIT_FAILURE);
+      break;
+
+    case COALESCE_OPTION:
+      coalesce = true;
+      break;
+
     case DUMP_CONFIG_OPTION:
       dump_config ();
       exit (EXIT_SUCCESS);
@@ -284,6 +328,16 @@ main (int argc, char *argv[])
       }
       break;
 
+    case HUGEPAGES_OPTION:
+#ifdef MAP_HUGETLB
+      hugepages = true;
+      break;
+#else
+      fprintf (stderr, "%s: hugepage-backed buffers are not supported "
+               "on this platform\n", program_name);
+      exit (EXIT_FAILURE);
+#endif
+
     case LOG_OPTION:
       if (strcmp (optarg, "stderr") == 0)
         log_to = LOG_TO_STDERR;
@@ -321,6 +375,15 @@ main (int argc, char *argv[])
       selinux_label = optarg;
       break;
 
+    case SHARDS_OPTION:
+      if (nbdkit_parse_unsigned ("shards", optarg, &shards) == -1)
+        exit (EXIT_FAILURE);
+      if (shards == 0) {
+        fprintf (stderr, "%s: --shards must be >= 1\n", program_name);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
     case SHORT_OPTIONS_OPTION:
       for (i = 0; short_options[i]; ++i) {
         if (short_options[i] != ':')
@@ -328,6 +391,16 @@ main (int argc, char *argv[])
       }
       exit (EXIT_SUCCESS);
 
+    case STATS_SOCKET_OPTION:
+#ifndef WIN32
+      stats_socket = nbdkit_absolute_path (optarg);
+      if (stats_socket == NULL)
+        exit (EXIT_FAILURE);
+      break;
+#else
+      NOT_IMPLEMENTED_ON_WINDOWS ("--stats-socket");
+#endif
+
     case SWAP_OPTION:
       swap = 1;
       break;
@@ -357,6 +430,20 @@ main (int argc, char *argv[])
       tls_verify_peer = true;
       break;
 
+    case TRACE_OPTION:
+      trace = true;
+      break;
+
+    case URING_OPTION:
+#ifdef HAVE_LIBURING
+      uring = true;
+      break;
+#else
+      fprintf (stderr, "%s: io_uring is not supported in this build of "
+               "nbdkit\n", program_name);
+      exit (EXIT_FAILURE);
+#endif
+
     case VSOCK_OPTION:
 #ifdef AF_VSOCK
       vsock = true;
@@ -367,6 +454,16 @@ main (int argc, char *argv[])
       exit (EXIT_FAILURE);
 #endif
 
+    case ZEROCOPY_OPTION:
+#ifdef USE_ZEROCOPY
+      zerocopy = true;
+      break;
+#else
+      fprintf (stderr, "%s: MSG_ZEROCOPY is not supported on this platform\n",
+               program_name);
+      exit (EXIT_FAILURE);
+#endif
+
     case 'D':
       add_debug_flag (optarg);
       break;
@@ -398,6 +495,16 @@ main (int argc, char *argv[])
         exit (EXIT_FAILURE);
       break;
 
+    case MAX_INFLIGHT_OPTION:
+      if (nbdkit_parse_unsigned ("max-inflight",
+                                 optarg, &max_inflight) == -1)
+        exit (EXIT_FAILURE);
+      if (max_inflight == 0) {
+        fprintf (stderr, "%s: --max-inflight must be >= 1\n", program_name);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
     case 'n':
       newstyle = true;
       break;
@@ -406,6 +513,16 @@ main (int argc, char *argv[])
       no_sr = true;
       break;
 
+    case NUMA_OPTION:
+#ifdef HAVE_LIBNUMA
+      numa = true;
+      break;
+#else
+      fprintf (stderr, "%s: NUMA placement is not supported in this build of "
+               "nbdkit\n", program_name);
+      exit (EXIT_FAILURE);
+#endif
+
     case 'o':
       newstyle = false;
       break;
@@ -416,6 +533,31 @@ main (int argc, char *argv[])
         exit (EXIT_FAILURE);
       break;
 
+    case PROCESSES_OPTION:
+#ifndef WIN32
+      if (nbdkit_parse_unsigned ("processes", optarg, &nprocesses) == -1)
+        exit (EXIT_FAILURE);
+      break;
+#else
+      NOT_IMPLEMENTED_ON_WINDOWS ("--processes");
+#endif
+
+    case PROFILE_OPTION:
+      profile = true;
+      break;
+
+    case QOS_OPTION:
+      {
+        const char *error;
+
+        if (qos_parse_rule (optarg, &error) == -1) {
+          fprintf (stderr, "%s: --qos: %s\n", program_name, error);
+          exit (EXIT_FAILURE);
+        }
+        qos_enabled = true;
+      }
+      break;
+
     case 'p':
       if (socket_activation) {
         fprintf (stderr, "%s: cannot use socket activation with -p flag\n",
@@ -578,6 +720,16 @@ main (int argc, char *argv[])
     exit (EXIT_FAILURE);
   }
 
+  /* -s serves a single connection on stdin so extra processes make no
+   * sense there.
+   */
+  if (nprocesses > 1 && listen_stdin) {
+    fprintf (stderr,
+             "%s: -s and --processes cannot be used together\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+
   /* The remaining command line arguments are the plugin name and
    * parameters.  If --help, --version or --dump-plugin were specified
    * then we open the plugin so that we can display the per-plugin
@@ -720,6 +872,17 @@ main (int argc, char *argv[])
     exit (EXIT_SUCCESS);
   }
 
+  /* Bind the listening sockets now, before the possibly expensive
+   * .config_complete and .get_ready callbacks (remote plugins such as
+   * curl probe the far end there), so that clients can connect
+   * straight away and wait in the listen backlog while the plugin
+   * finishes its preparation.  Connections are only accepted after
+   * .get_ready and .after_fork below.  Socket activation already
+   * behaves this way since those sockets pre-exist the server.
+   */
+  if (bench == NULL)
+    bind_listening_sockets ();
+
   top->config_complete (top);
 
   /* Select the correct thread model based on config. */
@@ -733,7 +896,24 @@ main (int argc, char *argv[])
   switch_stdio ();
   configured = true;
 
-  start_serving ();
+#ifdef ENABLE_LIBFUZZER
+  /* Persistent fuzzing: stop here with the server fully configured
+   * and the plugin ready; fuzzer.c drives one in-process connection
+   * per fuzz input.
+   */
+  if (fuzzer_initialize_only) {
+    top->after_fork (top);
+    return EXIT_SUCCESS;
+  }
+#endif
+
+  if (bench)
+    bench_run ();
+  else
+    start_serving ();
+
+  if (profile)
+    profile_report ();
 
   top->free (top);
   top = NULL;
@@ -898,6 +1078,25 @@ open_filter_so (struct backend *next, size_t i,
   return ret;
 }
 
+/* Sockets bound by bind_listening_sockets, consumed by
+ * start_serving.  Empty when running with -s or socket activation.
+ */
+static sockets listen_socks = empty_vector;
+
+static void
+bind_listening_sockets (void)
+{
+  if (socket_activation || listen_stdin)
+    return;
+
+  if (unixsocket)
+    bind_unix_socket (&listen_socks);
+  else if (vsock)
+    bind_vsock (&listen_socks);
+  else
+    bind_tcpip_socket (&listen_socks);
+}
+
 static void
 start_serving (void)
 {
@@ -907,8 +1106,15 @@ start_serving (void)
   set_up_quit_pipe ();
 #if !ENABLE_LIBFUZZER
   set_up_signals ();
+  if (trace)
+    set_up_trace ();
+  if (profile)
+    set_up_profile ();
 #endif
 
+  if (stats_socket)
+    start_stats_thread ();
+
   /* Lock the process into memory if requested. */
   if (swap) {
 #ifdef HAVE_MLOCKALL
@@ -942,8 +1148,10 @@ start_serving (void)
     debug ("using socket activation, nr_socks = %zu", socks.size);
     change_user ();
     write_pidfile ();
+    fork_server_processes (&socks);
     top->after_fork (top);
     accept_incoming_connections (&socks);
+    wait_server_processes ();
     return;
   }
 
@@ -958,21 +1166,20 @@ start_serving (void)
   }
 
   /* Handling multiple connections on TCP/IP, Unix domain socket or
-   * AF_VSOCK.
+   * AF_VSOCK.  The sockets were already bound before
+   * .config_complete (see bind_listening_sockets).
    */
-  if (unixsocket)
-    bind_unix_socket (&socks);
-  else if (vsock)
-    bind_vsock (&socks);
-  else
-    bind_tcpip_socket (&socks);
+  free (socks.ptr);
+  socks = listen_socks;
 
   run_command ();
   change_user ();
   fork_into_background ();
   write_pidfile ();
+  fork_server_processes (&socks);
   top->after_fork (top);
   accept_incoming_connections (&socks);
+  wait_server_processes ();
 }
 
 static void
@@ -0,0 +1,121 @@
+/* nbdkit
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "internal.h"
+#include "cleanup.h"
+
+/* NUMA-aware worker placement (--numa).
+ *
+ * On multi-socket machines a connection's worker threads float freely
+ * across nodes while the data they touch (thread-local request
+ * buffers, the plugin handle, whatever the plugin caches) lands on
+ * whichever node happened to run the first-touching thread.  The
+ * resulting cross-node traffic makes throughput depend on scheduler
+ * luck.
+ *
+ * With --numa each connection is assigned a node round-robin and
+ * every thread serving it is bound to that node before it does any
+ * work.  Memory affinity then follows for free: the kernel's
+ * first-touch policy places the worker's request buffers, and the
+ * plugin handle allocated during the handshake, on the node the
+ * threads are bound to.
+ */
+
+#ifdef HAVE_LIBNUMA
+
+#include <numa.h>
+
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned next_node;
+
+/* Pick a node for a new connection, round-robin across all nodes.
+ * Returns -1 (no binding) on single-node or non-NUMA machines.
+ */
+int
+numa_choose_node (void)
+{
+  int nr_nodes, node;
+
+  if (numa_available () == -1)
+    return -1;
+  nr_nodes = numa_max_node () + 1;
+  if (nr_nodes <= 1)
+    return -1;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&node_lock);
+  node = next_node++ % nr_nodes;
+  return node;
+}
+
+/* Bind the calling thread to the connection's node.  Pool workers are
+ * reused across connections, so node == -1 (connection not bound)
+ * must undo any binding left over from a previous assignment.
+ */
+void
+numa_bind_worker (int node)
+{
+  if (node >= 0) {
+    if (numa_run_on_node (node) == -1) {
+      debug ("numa_run_on_node %d: %m", node);
+      return;
+    }
+    numa_set_preferred (node);
+    debug ("bound worker thread to NUMA node %d", node);
+  }
+  else {
+    numa_run_on_node (-1);
+    numa_set_localalloc ();
+  }
+}
+
+#else /* !HAVE_LIBNUMA */
+
+int
+numa_choose_node (void)
+{
+  return -1;
+}
+
+void
+numa_bind_worker (int node)
+{
+  /* nothing */
+}
+
+#endif /* !HAVE_LIBNUMA */
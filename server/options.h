@@ -40,27 +40,44 @@
 
 enum {
   HELP_OPTION = CHAR_MAX + 1,
+  BENCH_OPTION,
+  BUSY_POLL_OPTION,
+  COALESCE_OPTION,
   DUMP_CONFIG_OPTION,
   DUMP_PLUGIN_OPTION,
   EXIT_WITH_PARENT_OPTION,
   FILTER_OPTION,
+  HUGEPAGES_OPTION,
   LOG_OPTION,
   LONG_OPTIONS_OPTION,
   MASK_HANDSHAKE_OPTION,
+  MAX_INFLIGHT_OPTION,
   NO_SR_OPTION,
+  NUMA_OPTION,
+  PROCESSES_OPTION,
+  PROFILE_OPTION,
+  QOS_OPTION,
   RUN_OPTION,
   SELINUX_LABEL_OPTION,
+  SHARDS_OPTION,
   SHORT_OPTIONS_OPTION,
+  STATS_SOCKET_OPTION,
   SWAP_OPTION,
   TLS_OPTION,
   TLS_CERTIFICATES_OPTION,
   TLS_PSK_OPTION,
   TLS_VERIFY_PEER_OPTION,
+  TRACE_OPTION,
+  URING_OPTION,
   VSOCK_OPTION,
+  ZEROCOPY_OPTION,
 };
 
 static const char *short_options = "D:e:fg:i:nop:P:rst:u:U:vV";
 static const struct option long_options[] = {
+  { "bench",            required_argument, NULL, BENCH_OPTION },
+  { "busy-poll",        required_argument, NULL, BUSY_POLL_OPTION },
+  { "coalesce",         no_argument,       NULL, COALESCE_OPTION },
   { "debug",            required_argument, NULL, 'D' },
   { "dump-config",      no_argument,       NULL, DUMP_CONFIG_OPTION },
   { "dump-plugin",      no_argument,       NULL, DUMP_PLUGIN_OPTION },
@@ -73,25 +90,33 @@ static const struct option long_options[] = {
   { "no-fork",          no_argument,       NULL, 'f' },
   { "group",            required_argument, NULL, 'g' },
   { "help",             no_argument,       NULL, HELP_OPTION },
+  { "hugepages",        no_argument,       NULL, HUGEPAGES_OPTION },
   { "ip-addr",          required_argument, NULL, 'i' },
   { "ipaddr",           required_argument, NULL, 'i' },
   { "log",              required_argument, NULL, LOG_OPTION },
   { "long-options",     no_argument,       NULL, LONG_OPTIONS_OPTION },
   { "mask-handshake",   required_argument, NULL, MASK_HANDSHAKE_OPTION },
+  { "max-inflight",     required_argument, NULL, MAX_INFLIGHT_OPTION },
   { "new-style",        no_argument,       NULL, 'n' },
   { "newstyle",         no_argument,       NULL, 'n' },
   { "no-sr",            no_argument,       NULL, NO_SR_OPTION },
+  { "numa",             no_argument,       NULL, NUMA_OPTION },
   { "old-style",        no_argument,       NULL, 'o' },
   { "oldstyle",         no_argument,       NULL, 'o' },
   { "pid-file",         required_argument, NULL, 'P' },
   { "pidfile",          required_argument, NULL, 'P' },
   { "port",             required_argument, NULL, 'p' },
+  { "processes",        required_argument, NULL, PROCESSES_OPTION },
+  { "profile",          no_argument,       NULL, PROFILE_OPTION },
+  { "qos",              required_argument, NULL, QOS_OPTION },
   { "read-only",        no_argument,       NULL, 'r' },
   { "readonly",         no_argument,       NULL, 'r' },
   { "run",              required_argument, NULL, RUN_OPTION },
   { "selinux-label",    required_argument, NULL, SELINUX_LABEL_OPTION },
+  { "shards",           required_argument, NULL, SHARDS_OPTION },
   { "short-options",    no_argument,       NULL, SHORT_OPTIONS_OPTION },
   { "single",           no_argument,       NULL, 's' },
+  { "stats-socket",     required_argument, NULL, STATS_SOCKET_OPTION },
   { "stdin",            no_argument,       NULL, 's' },
   { "swap",             no_argument,       NULL, SWAP_OPTION },
   { "threads",          required_argument, NULL, 't' },
@@ -99,11 +124,14 @@ static const struct option long_options[] = {
   { "tls-certificates", required_argument, NULL, TLS_CERTIFICATES_OPTION },
   { "tls-psk",          required_argument, NULL, TLS_PSK_OPTION },
   { "tls-verify-peer",  no_argument,       NULL, TLS_VERIFY_PEER_OPTION },
+  { "trace",            no_argument,       NULL, TRACE_OPTION },
   { "unix",             required_argument, NULL, 'U' },
+  { "uring",            no_argument,       NULL, URING_OPTION },
   { "user",             required_argument, NULL, 'u' },
   { "verbose",          no_argument,       NULL, 'v' },
   { "version",          no_argument,       NULL, 'V' },
   { "vsock",            no_argument,       NULL, VSOCK_OPTION },
+  { "zerocopy",         no_argument,       NULL, ZEROCOPY_OPTION },
   { NULL },
 };
 
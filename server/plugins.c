@@ -39,12 +39,16 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
 
 #include "internal.h"
+#include "cleanup.h"
 #include "minmax.h"
 
 /* We extend the generic backend struct with extra fields relating
@@ -55,11 +59,85 @@ struct backend_plugin {
   struct nbdkit_plugin plugin;
 };
 
+static void handle_cache_free (struct backend_plugin *p);
+
+/* Instance sharding (--shards, see plugin_thread_model).  When
+ * active, the opaque handle stored for the connection is a shard set
+ * rather than a plugin handle: N handles, each protected by the mutex
+ * which provides the SERIALIZE_REQUESTS guarantee the plugin asked
+ * for.
+ */
+struct shard {
+  pthread_mutex_t lock;
+  void *handle;
+};
+
+struct shard_set {
+  _Atomic unsigned next;        /* round-robin distribution counter */
+  struct shard shard[];
+};
+
+static bool sharding = false;
+
+/* Unwrap the handle for control-path calls (option negotiation and
+ * the can_* queries).  These all happen before the parallel data
+ * phase of the connection starts, so no lock is taken; the first
+ * instance answers for all of them.
+ */
+static void *
+shard_handle (void *handle)
+{
+  if (!sharding)
+    return handle;
+  return ((struct shard_set *) handle)->shard[0].handle;
+}
+
+/* Pick an instance for a data-path call and lock it.  Prefer an idle
+ * instance; if all are busy, block on the round-robin choice.
+ * Returns the lock the caller must release, or NULL when sharding is
+ * off.
+ */
+static pthread_mutex_t *
+shard_acquire (void *handle, void **real)
+{
+  struct shard_set *ss;
+  struct shard *s;
+  unsigned i, start;
+
+  if (!sharding) {
+    *real = handle;
+    return NULL;
+  }
+
+  ss = handle;
+  start = atomic_fetch_add_explicit (&ss->next, 1, memory_order_relaxed)
+    % shards;
+  for (i = 0; i < shards; ++i) {
+    s = &ss->shard[(start + i) % shards];
+    if (pthread_mutex_trylock (&s->lock) == 0) {
+      *real = s->handle;
+      return &s->lock;
+    }
+  }
+  s = &ss->shard[start];
+  pthread_mutex_lock (&s->lock);
+  *real = s->handle;
+  return &s->lock;
+}
+
+static void
+shard_release (pthread_mutex_t *lock)
+{
+  if (lock)
+    pthread_mutex_unlock (lock);
+}
+
 static void
 plugin_free (struct backend *b)
 {
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
 
+  handle_cache_free (p);
   backend_unload (b, p->plugin.unload);
   free (p);
 }
@@ -87,6 +165,26 @@ plugin_thread_model (struct backend *b)
       model = r;
   }
 
+  /* --shards: instead of letting a SERIALIZE_REQUESTS plugin cap each
+   * connection at one request in flight, open several independent
+   * plugin handles per connection and spread requests across them,
+   * serializing only within each handle (see shard_acquire).  The
+   * rest of the server then treats the plugin as parallel.  Handles
+   * are exactly what separate connections would get, so a plugin
+   * which is safe with parallel connections is safe with shards.
+   */
+  if (shards > 1) {
+    if (model == NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS) {
+      debug ("%s: sharding %u plugin instances per connection",
+             b->name, shards);
+      sharding = true;
+      model = NBDKIT_THREAD_MODEL_PARALLEL;
+    }
+    else
+      debug ("%s: --shards ignored: thread model is %s",
+             b->name, name_of_thread_model (model));
+  }
+
   return model;
 }
 
@@ -309,6 +407,96 @@ plugin_default_export (struct backend *b, int readonly, int is_tls)
   return p->plugin.default_export (readonly, is_tls);
 }
 
+/* Optional cache of plugin handles (see .can_reuse).  A handle whose
+ * connection closed is parked here for a short while and handed to
+ * the next connection opening the same export with the same readonly
+ * flag, so that reconnecting clients skip an expensive .open (ssh
+ * session setup, vddk opens).  Stale entries are closed during the
+ * next open or at unload.
+ */
+#define HANDLE_CACHE_SIZE 16
+#define HANDLE_CACHE_TTL 60     /* seconds */
+
+static struct cached_handle {
+  void *handle;
+  char *exportname;
+  int readonly;
+  time_t parked;
+} handle_cache[HANDLE_CACHE_SIZE];
+static size_t nr_cached_handles;
+static pthread_mutex_t handle_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Called with handle_cache_lock held. */
+static void
+handle_cache_drop (struct backend_plugin *p, size_t i)
+{
+  if (p->plugin.close)
+    p->plugin.close (handle_cache[i].handle);
+  free (handle_cache[i].exportname);
+  handle_cache[i] = handle_cache[--nr_cached_handles];
+}
+
+static void *
+handle_cache_get (struct backend_plugin *p,
+                  int readonly, const char *exportname)
+{
+  size_t i;
+  time_t now = time (NULL);
+  void *r = NULL;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&handle_cache_lock);
+
+  for (i = 0; i < nr_cached_handles; ) {
+    if (now - handle_cache[i].parked > HANDLE_CACHE_TTL) {
+      handle_cache_drop (p, i);
+      continue;
+    }
+    if (r == NULL &&
+        handle_cache[i].readonly == readonly &&
+        strcmp (handle_cache[i].exportname, exportname) == 0) {
+      r = handle_cache[i].handle;
+      free (handle_cache[i].exportname);
+      handle_cache[i] = handle_cache[--nr_cached_handles];
+      continue;
+    }
+    ++i;
+  }
+  return r;
+}
+
+/* Returns true if the handle was parked, false if the caller should
+ * close it as normal.
+ */
+static bool
+handle_cache_put (struct backend_plugin *p, void *handle,
+                  int readonly, const char *exportname)
+{
+  char *name;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&handle_cache_lock);
+
+  if (nr_cached_handles == HANDLE_CACHE_SIZE)
+    return false;
+  name = strdup (exportname);
+  if (name == NULL)
+    return false;
+  handle_cache[nr_cached_handles].handle = handle;
+  handle_cache[nr_cached_handles].exportname = name;
+  handle_cache[nr_cached_handles].readonly = readonly;
+  handle_cache[nr_cached_handles].parked = time (NULL);
+  nr_cached_handles++;
+  return true;
+}
+
+static void
+handle_cache_free (struct backend_plugin *p)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&handle_cache_lock);
+
+  while (nr_cached_handles > 0)
+    handle_cache_drop (p, 0);
+}
+
 static void *
 plugin_open (struct backend *b, int readonly, const char *exportname,
              int is_tls)
@@ -335,6 +523,47 @@ plugin_open (struct backend *b, int readonly, const char *exportname,
   conn->exportname = nbdkit_strdup_intern (exportname);
   if (conn->exportname == NULL)
     return NULL;
+  conn->plugin_readonly = readonly;
+
+  /* Handle reuse is per plugin handle; with sharding the stored
+   * handle is a whole set, so the cache is not used.
+   */
+  if (p->plugin.can_reuse && !sharding) {
+    r = handle_cache_get (p, readonly, exportname);
+    if (r != NULL) {
+      debug ("%s: reusing cached handle %p", b->name, r);
+      return r;
+    }
+  }
+
+  if (sharding) {
+    struct shard_set *ss;
+    unsigned i;
+
+    ss = malloc (sizeof *ss + shards * sizeof ss->shard[0]);
+    if (ss == NULL) {
+      nbdkit_error ("malloc: %m");
+      conn->exportname = NULL;
+      return NULL;
+    }
+    ss->next = 0;
+    for (i = 0; i < shards; ++i) {
+      ss->shard[i].handle = p->plugin.open (readonly);
+      if (ss->shard[i].handle == NULL) {
+        while (i > 0) {
+          --i;
+          pthread_mutex_destroy (&ss->shard[i].lock);
+          if (p->plugin.close)
+            p->plugin.close (ss->shard[i].handle);
+        }
+        free (ss);
+        conn->exportname = NULL;
+        return NULL;
+      }
+      pthread_mutex_init (&ss->shard[i].lock, NULL);
+    }
+    return ss;
+  }
 
   r = p->plugin.open (readonly);
   if (r == NULL)
@@ -365,6 +594,28 @@ plugin_close (struct backend *b, void *handle)
   GET_CONN;
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
 
+  if (handle && sharding) {
+    struct shard_set *ss = handle;
+    unsigned i;
+
+    for (i = 0; i < shards; ++i) {
+      if (p->plugin.close)
+        p->plugin.close (ss->shard[i].handle);
+      pthread_mutex_destroy (&ss->shard[i].lock);
+    }
+    free (ss);
+    conn->exportname = NULL;
+    return;
+  }
+
+  if (handle && p->plugin.can_reuse && conn->exportname &&
+      p->plugin.can_reuse (handle) &&
+      handle_cache_put (p, handle, conn->plugin_readonly,
+                        conn->exportname)) {
+    debug ("%s: parked handle %p for reuse", b->name, handle);
+    handle = NULL;              /* .close deferred until expiry */
+  }
+
   if (handle && p->plugin.close)
     p->plugin.close (handle);
   conn->exportname = NULL;
@@ -376,7 +627,7 @@ plugin_export_description (struct backend *b, void *handle)
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
 
   if (p->plugin.export_description)
-    return p->plugin.export_description (handle);
+    return p->plugin.export_description (shard_handle (handle));
   else
     return NULL;
 }
@@ -388,7 +639,7 @@ plugin_get_size (struct backend *b, void *handle)
 
   assert (p->plugin.get_size != NULL);
 
-  return p->plugin.get_size (handle);
+  return p->plugin.get_size (shard_handle (handle));
 }
 
 static int
@@ -406,7 +657,7 @@ plugin_can_write (struct backend *b, void *handle)
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
 
   if (p->plugin.can_write)
-    return normalize_bool (p->plugin.can_write (handle));
+    return normalize_bool (p->plugin.can_write (shard_handle (handle)));
   else
     return p->plugin.pwrite || p->plugin._pwrite_v1;
 }
@@ -417,7 +668,7 @@ plugin_can_flush (struct backend *b, void *handle)
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
 
   if (p->plugin.can_flush)
-    return normalize_bool (p->plugin.can_flush (handle));
+    return normalize_bool (p->plugin.can_flush (shard_handle (handle)));
   else
     return p->plugin.flush || p->plugin._flush_v1;
 }
@@ -428,7 +679,7 @@ plugin_is_rotational (struct backend *b, void *handle)
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
 
   if (p->plugin.is_rotational)
-    return normalize_bool (p->plugin.is_rotational (handle));
+    return normalize_bool (p->plugin.is_rotational (shard_handle (handle)));
   else
     return 0; /* assume false */
 }
@@ -439,7 +690,7 @@ plugin_can_trim (struct backend *b, void *handle)
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
 
   if (p->plugin.can_trim)
-    return normalize_bool (p->plugin.can_trim (handle));
+    return normalize_bool (p->plugin.can_trim (shard_handle (handle)));
   else
     return p->plugin.trim || p->plugin._trim_v1;
 }
@@ -455,7 +706,7 @@ plugin_can_zero (struct backend *b, void *handle)
    * expects .can_zero to return a tri-state on level of support.
    */
   if (p->plugin.can_zero) {
-    r = p->plugin.can_zero (handle);
+    r = p->plugin.can_zero (shard_handle (handle));
     if (r == -1)
       return -1;
     return r ? NBDKIT_ZERO_NATIVE : NBDKIT_ZERO_EMULATE;
@@ -472,7 +723,7 @@ plugin_can_fast_zero (struct backend *b, void *handle)
   int r;
 
   if (p->plugin.can_fast_zero)
-    return normalize_bool (p->plugin.can_fast_zero (handle));
+    return normalize_bool (p->plugin.can_fast_zero (shard_handle (handle)));
   /* Advertise support for fast zeroes if no .zero or .can_zero is
    * false: in those cases, we fail fast instead of using .pwrite.
    * This also works when v1 plugin has only ._zero_v1.
@@ -491,7 +742,7 @@ plugin_can_extents (struct backend *b, void *handle)
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
 
   if (p->plugin.can_extents)
-    return normalize_bool (p->plugin.can_extents (handle));
+    return normalize_bool (p->plugin.can_extents (shard_handle (handle)));
   else
     return p->plugin.extents != NULL;
 }
@@ -505,7 +756,7 @@ plugin_can_fua (struct backend *b, void *handle)
   /* The plugin must use API version 2 and have .can_fua return
      NBDKIT_FUA_NATIVE before we will pass the FUA flag on. */
   if (p->plugin.can_fua) {
-    r = p->plugin.can_fua (handle);
+    r = p->plugin.can_fua (shard_handle (handle));
     if (r > NBDKIT_FUA_EMULATE && p->plugin._api_version == 1)
       r = NBDKIT_FUA_EMULATE;
     return r;
@@ -522,7 +773,7 @@ plugin_can_multi_conn (struct backend *b, void *handle)
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
 
   if (p->plugin.can_multi_conn)
-    return normalize_bool (p->plugin.can_multi_conn (handle));
+    return normalize_bool (p->plugin.can_multi_conn (shard_handle (handle)));
   else
     return 0; /* assume false */
 }
@@ -533,12 +784,27 @@ plugin_can_cache (struct backend *b, void *handle)
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
 
   if (p->plugin.can_cache)
-    return p->plugin.can_cache (handle);
+    return p->plugin.can_cache (shard_handle (handle));
   if (p->plugin.cache)
     return NBDKIT_CACHE_NATIVE;
   return NBDKIT_CACHE_NONE;
 }
 
+static int
+plugin_can_async (struct backend *b, void *handle)
+{
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+
+  /* Asynchronous submission only makes sense when requests are not
+   * serialized around the plugin; sharded instances are serialized
+   * internally.
+   */
+  if (thread_model < NBDKIT_THREAD_MODEL_PARALLEL || sharding)
+    return 0;
+  return (p->plugin.pread_async ? BACKEND_ASYNC_READ : 0) |
+         (p->plugin.pwrite_async ? BACKEND_ASYNC_WRITE : 0);
+}
+
 /* Plugins and filters can call this to set the true errno, in cases
  * where !errno_is_preserved.
  */
@@ -566,24 +832,25 @@ plugin_pread (struct backend *b, void *handle,
               int *err)
 {
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  pthread_mutex_t *lock;
   int r;
 
   assert (p->plugin.pread || p->plugin._pread_v1);
 
+  lock = shard_acquire (handle, &handle);
   if (p->plugin.pread)
     r = p->plugin.pread (handle, buf, count, offset, 0);
   else
     r = p->plugin._pread_v1 (handle, buf, count, offset);
   if (r == -1)
     *err = get_error (p);
+  shard_release (lock);
   return r;
 }
 
 static int
-plugin_flush (struct backend *b, void *handle,
-              uint32_t flags, int *err)
+flush_instance (struct backend_plugin *p, void *handle, int *err)
 {
-  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
   int r;
 
   if (p->plugin.flush)
@@ -599,6 +866,33 @@ plugin_flush (struct backend *b, void *handle,
   return r;
 }
 
+static int
+plugin_flush (struct backend *b, void *handle,
+              uint32_t flags, int *err)
+{
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+
+  /* With sharding, writes may have gone through any instance, so a
+   * flush must cover them all.
+   */
+  if (sharding) {
+    struct shard_set *ss = handle;
+    unsigned i;
+    int r = 0;
+
+    for (i = 0; i < shards && r == 0; ++i) {
+      struct shard *s = &ss->shard[i];
+
+      pthread_mutex_lock (&s->lock);
+      r = flush_instance (p, s->handle, err);
+      pthread_mutex_unlock (&s->lock);
+    }
+    return r;
+  }
+
+  return flush_instance (p, handle, err);
+}
+
 static int
 plugin_pwrite (struct backend *b, void *handle,
                const void *buf, uint32_t count, uint64_t offset, uint32_t flags,
@@ -606,24 +900,163 @@ plugin_pwrite (struct backend *b, void *handle,
 {
   int r;
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  pthread_mutex_t *lock;
   bool fua = flags & NBDKIT_FLAG_FUA;
   bool need_flush = false;
+  void *h;
 
   if (fua && backend_can_fua (b) != NBDKIT_FUA_NATIVE) {
     flags &= ~NBDKIT_FLAG_FUA;
     need_flush = true;
   }
+  lock = shard_acquire (handle, &h);
   if (p->plugin.pwrite)
-    r = p->plugin.pwrite (handle, buf, count, offset, flags);
+    r = p->plugin.pwrite (h, buf, count, offset, flags);
   else if (p->plugin._pwrite_v1)
-    r = p->plugin._pwrite_v1 (handle, buf, count, offset);
+    r = p->plugin._pwrite_v1 (h, buf, count, offset);
   else {
+    shard_release (lock);
     *err = EROFS;
     return -1;
   }
+  if (r == -1)
+    *err = get_error (p);
+  shard_release (lock);
+  /* plugin_flush takes the shard locks itself, so this must happen
+   * after the write's lock is dropped.
+   */
   if (r != -1 && need_flush)
     r = plugin_flush (b, handle, 0, err);
-  if (r == -1 && !*err)
+  return r;
+}
+
+static int
+plugin_preadv (struct backend *b, void *handle,
+               const struct nbdkit_iovec *iov, int iovcnt, uint64_t offset,
+               uint32_t flags, int *err)
+{
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int i, r;
+
+  if (p->plugin.preadv) {
+    pthread_mutex_t *lock = shard_acquire (handle, &handle);
+
+    r = p->plugin.preadv (handle, iov, iovcnt, offset, flags);
+    if (r == -1)
+      *err = get_error (p);
+    shard_release (lock);
+    return r;
+  }
+
+  /* Decompose into one flat read per segment. */
+  for (i = 0; i < iovcnt; ++i) {
+    if (plugin_pread (b, handle, iov[i].iov_base, iov[i].iov_len, offset,
+                      flags, err) == -1)
+      return -1;
+    offset += iov[i].iov_len;
+  }
+  return 0;
+}
+
+static int
+plugin_pwritev (struct backend *b, void *handle,
+                const struct nbdkit_iovec *iov, int iovcnt, uint64_t offset,
+                uint32_t flags, int *err)
+{
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  bool fua = flags & NBDKIT_FLAG_FUA;
+  int i, r;
+
+  if (p->plugin.pwritev) {
+    pthread_mutex_t *lock;
+    bool need_flush = false;
+    void *h;
+
+    if (fua && backend_can_fua (b) != NBDKIT_FUA_NATIVE) {
+      flags &= ~NBDKIT_FLAG_FUA;
+      need_flush = true;
+    }
+    lock = shard_acquire (handle, &h);
+    r = p->plugin.pwritev (h, iov, iovcnt, offset, flags);
+    if (r == -1)
+      *err = get_error (p);
+    shard_release (lock);
+    if (r != -1 && need_flush)
+      r = plugin_flush (b, handle, 0, err);
+    return r;
+  }
+
+  /* Decompose into one flat write per segment.  FUA need only apply
+   * to the last write: nothing in the request is durable until the
+   * whole request has succeeded.
+   */
+  for (i = 0; i < iovcnt; ++i) {
+    uint32_t f = i == iovcnt - 1 ? flags : flags & ~NBDKIT_FLAG_FUA;
+
+    if (plugin_pwrite (b, handle, iov[i].iov_base, iov[i].iov_len, offset,
+                       f, err) == -1)
+      return -1;
+    offset += iov[i].iov_len;
+  }
+  return 0;
+}
+
+static int
+plugin_pread_zerocopy (struct backend *b, void *handle,
+                       struct nbdkit_zerocopy_read *zc,
+                       uint32_t count, uint64_t offset, uint32_t flags,
+                       int *err)
+{
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int r;
+
+  /* The lent buffer outlives this call (released after the socket
+   * send), so a shard lock could not be held for the duration; fall
+   * back to copied reads when sharding.
+   */
+  if (!p->plugin.pread_zerocopy || sharding)
+    return 1;                   /* fall back to .pread */
+
+  r = p->plugin.pread_zerocopy (handle, zc, count, offset, flags);
+  if (r == -1)
+    *err = get_error (p);
+  return r;
+}
+
+static int
+plugin_pread_async (struct backend *b, void *handle,
+                    void *buf, uint32_t count, uint64_t offset, uint32_t flags,
+                    struct nbdkit_completion *completion, int *err)
+{
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int r;
+
+  assert (p->plugin.pread_async);
+
+  r = p->plugin.pread_async (handle, buf, count, offset, flags, completion);
+  if (r == -1)
+    *err = get_error (p);
+  return r;
+}
+
+static int
+plugin_pwrite_async (struct backend *b, void *handle,
+                     const void *buf, uint32_t count, uint64_t offset,
+                     uint32_t flags,
+                     struct nbdkit_completion *completion, int *err)
+{
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int r;
+
+  assert (p->plugin.pwrite_async);
+  /* FUA is only submitted asynchronously when it is native; the
+   * flush-emulated form goes through the synchronous path.
+   */
+  assert (!(flags & NBDKIT_FLAG_FUA) ||
+          backend_can_fua (b) == NBDKIT_FUA_NATIVE);
+
+  r = p->plugin.pwrite_async (handle, buf, count, offset, flags, completion);
+  if (r == -1)
     *err = get_error (p);
   return r;
 }
@@ -634,25 +1067,30 @@ plugin_trim (struct backend *b, void *handle,
 {
   int r;
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  pthread_mutex_t *lock;
   bool fua = flags & NBDKIT_FLAG_FUA;
   bool need_flush = false;
+  void *h;
 
   if (fua && backend_can_fua (b) != NBDKIT_FUA_NATIVE) {
     flags &= ~NBDKIT_FLAG_FUA;
     need_flush = true;
   }
+  lock = shard_acquire (handle, &h);
   if (p->plugin.trim)
-    r = p->plugin.trim (handle, count, offset, flags);
+    r = p->plugin.trim (h, count, offset, flags);
   else if (p->plugin._trim_v1)
-    r = p->plugin._trim_v1 (handle, count, offset);
+    r = p->plugin._trim_v1 (h, count, offset);
   else {
+    shard_release (lock);
     *err = EINVAL;
     return -1;
   }
+  if (r == -1)
+    *err = get_error (p);
+  shard_release (lock);
   if (r != -1 && need_flush)
     r = plugin_flush (b, handle, 0, err);
-  if (r == -1 && !*err)
-    *err = get_error (p);
   return r;
 }
 
@@ -676,20 +1114,26 @@ plugin_zero (struct backend *b, void *handle,
     return 0;
 
   if (backend_can_zero (b) == NBDKIT_ZERO_NATIVE) {
+    pthread_mutex_t *lock;
+    void *h;
+
+    lock = shard_acquire (handle, &h);
     errno = 0;
     if (p->plugin.zero)
-      r = p->plugin.zero (handle, count, offset, flags);
+      r = p->plugin.zero (h, count, offset, flags);
     else if (p->plugin._zero_v1) {
       if (fast_zero) {
+        shard_release (lock);
         *err = EOPNOTSUPP;
         return -1;
       }
-      r = p->plugin._zero_v1 (handle, count, offset, may_trim);
+      r = p->plugin._zero_v1 (h, count, offset, may_trim);
     }
     else
       emulate = true;
     if (r == -1)
       *err = emulate ? EOPNOTSUPP : get_error (p);
+    shard_release (lock);
     if (r == 0 || (*err != EOPNOTSUPP && *err != ENOTSUP))
       goto done;
   }
@@ -733,11 +1177,14 @@ plugin_extents (struct backend *b, void *handle,
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
   int r;
 
+  pthread_mutex_t *lock;
+
   if (p->plugin.extents == NULL) { /* Possible if .can_extents lied */
     *err = EINVAL;
     return -1;
   }
 
+  lock = shard_acquire (handle, &handle);
   r = p->plugin.extents (handle, count, offset, flags, extents);
   if (r >= 0 && nbdkit_extents_count (extents) < 1) {
     nbdkit_error ("extents: plugin must return at least one extent");
@@ -746,15 +1193,46 @@ plugin_extents (struct backend *b, void *handle,
   }
   if (r == -1)
     *err = get_error (p);
+  shard_release (lock);
   return r;
 }
 
+static const char *
+plugin_dirty_bitmap (struct backend *b)
+{
+  /* Dirty bitmaps are only maintained by filters. */
+  return NULL;
+}
+
+static int
+plugin_dirty_extents (struct backend *b, void *handle,
+                      uint32_t count, uint64_t offset, uint32_t flags,
+                      struct nbdkit_extents *extents, int *err)
+{
+  /* Only reachable if a filter advertised a dirty bitmap but did not
+   * answer the query itself; report the whole range as clean.
+   */
+  if (nbdkit_add_extent (extents, offset, count, 0) == -1) {
+    *err = errno;
+    return -1;
+  }
+  return 0;
+}
+
+static char *
+plugin_metrics (struct backend *b)
+{
+  /* Metrics are only exported by filters. */
+  return NULL;
+}
+
 static int
 plugin_cache (struct backend *b, void *handle,
               uint32_t count, uint64_t offset, uint32_t flags,
               int *err)
 {
   struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  pthread_mutex_t *lock;
   int r;
 
   /* A plugin may advertise caching but not provide .cache; in that
@@ -762,9 +1240,11 @@ plugin_cache (struct backend *b, void *handle,
   if (!p->plugin.cache)
     return 0;
 
+  lock = shard_acquire (handle, &handle);
   r = p->plugin.cache (handle, count, offset, flags);
   if (r == -1)
     *err = get_error (p);
+  shard_release (lock);
   return r;
 }
 
@@ -806,6 +1286,15 @@ static struct backend plugin_functions = {
   .zero = plugin_zero,
   .extents = plugin_extents,
   .cache = plugin_cache,
+  .dirty_bitmap = plugin_dirty_bitmap,
+  .dirty_extents = plugin_dirty_extents,
+  .metrics = plugin_metrics,
+  .can_async = plugin_can_async,
+  .pread_async = plugin_pread_async,
+  .pread_zerocopy = plugin_pread_zerocopy,
+  .pwrite_async = plugin_pwrite_async,
+  .preadv = plugin_preadv,
+  .pwritev = plugin_pwritev,
 };
 
 /* Register and load a plugin. */
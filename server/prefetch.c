@@ -0,0 +1,257 @@
+/* nbdkit
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "minmax.h"
+
+#include "internal.h"
+
+/* NBD_CMD_CACHE is advisory: the reply carries no data and clients do
+ * not depend on the prefetch having happened when it arrives.
+ * Executing hints synchronously nevertheless tied up a scarce worker
+ * thread for the whole backend fetch, so a client which streams cache
+ * hints ahead of its reads (eg. qemu) could starve its own demand I/O
+ * of workers.
+ *
+ * Instead the server acknowledges cache commands immediately and the
+ * backend .cache calls run here, on a single background thread,
+ * scheduled at the lowest priority the platform offers.  The thread
+ * is started on first use and exits again after an idle period, like
+ * the worker pool.  Hints are bounded by a small queue and dropped
+ * when it overflows, since dropping a hint is always correct.
+ */
+
+/* How long the idle background thread waits for work before exiting. */
+#define PREFETCH_IDLE_TIMEOUT 30 /* seconds */
+
+/* Maximum number of queued hints (across all connections). */
+#define MAX_QUEUED_PREFETCHES 64
+
+struct prefetch {
+  struct connection *conn;
+  uint64_t offset;
+  uint64_t count;
+  struct prefetch *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static struct prefetch *queue, *queue_end;
+static size_t queue_len;
+static bool thread_running;
+
+/* Run one hint.  The backend API is 32 bit so large ranges are
+ * carried out as a loop of chunks, like the synchronous path in
+ * protocol.c (see MAX_EFFECT_CHUNK there); the request lock is taken
+ * per chunk so that under serialized thread models demand requests
+ * interleave with a long prefetch rather than queueing behind it.
+ */
+static void
+do_prefetch (struct prefetch *p)
+{
+  uint64_t offset = p->offset, count = p->count;
+  int err = 0;
+
+  threadlocal_set_conn (p->conn);
+  while (count > 0) {
+    const uint32_t n = MIN (count, UINT64_C (0xffff0000));
+    int r;
+
+    lock_request ();
+    r = backend_cache (top, n, offset, 0, &err);
+    unlock_request ();
+    if (r == -1) {
+      /* The command was acknowledged long ago and caching is only a
+       * hint, so errors are dropped.
+       */
+      debug ("background cache failed: offset=%" PRIu64 ": error %d",
+             offset, err);
+      break;
+    }
+    offset += n;
+    count -= n;
+  }
+  threadlocal_set_conn (NULL);
+}
+
+static void *
+prefetch_worker (void *arg)
+{
+  threadlocal_new_server_thread ();
+  threadlocal_set_name ("prefetch");
+
+#ifdef SCHED_IDLE
+  /* Best effort: demand I/O threads should always win the CPU. */
+  {
+    struct sched_param sp = { .sched_priority = 0 };
+
+    pthread_setschedparam (pthread_self (), SCHED_IDLE, &sp);
+  }
+#endif
+
+  pthread_mutex_lock (&lock);
+  for (;;) {
+    struct prefetch *p;
+    struct connection *conn;
+
+    while (queue == NULL) {
+      struct timespec deadline;
+      int err;
+
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += PREFETCH_IDLE_TIMEOUT;
+      err = pthread_cond_timedwait (&work_cond, &lock, &deadline);
+      if (err == ETIMEDOUT && queue == NULL) {
+        thread_running = false;
+        pthread_mutex_unlock (&lock);
+        return NULL;
+      }
+    }
+    p = queue;
+    queue = p->next;
+    if (queue == NULL)
+      queue_end = NULL;
+    queue_len--;
+    pthread_mutex_unlock (&lock);
+
+    if (!quit && p->conn->status > 0)
+      do_prefetch (p);
+    conn = p->conn;
+    free (p);
+    /* The connection cannot be finalized while this is accounted
+     * against it, so drop the reference only after the backend call
+     * is over.
+     */
+    connection_async_end (conn);
+
+    pthread_mutex_lock (&lock);
+  }
+}
+
+/* Queue a cache command for the background thread, called from
+ * protocol.c with the request lock held (queueing only, no backend
+ * calls).  Returns -1 if the hint cannot be queued, in which case the
+ * caller falls back to caching synchronously.
+ */
+int
+prefetch_submit (struct connection *conn, uint64_t offset, uint64_t count)
+{
+  struct prefetch *p;
+
+  p = malloc (sizeof *p);
+  if (p == NULL)
+    return -1;
+  p->conn = conn;
+  p->offset = offset;
+  p->count = count;
+  p->next = NULL;
+
+  pthread_mutex_lock (&lock);
+  if (queue_len >= MAX_QUEUED_PREFETCHES) {
+    /* Hint flood: dropping the hint is always correct, and cheaper
+     * than either queueing without bound or making the client wait.
+     */
+    pthread_mutex_unlock (&lock);
+    free (p);
+    return 0;
+  }
+  if (!thread_running) {
+    pthread_t t;
+    pthread_attr_t attr;
+    int err;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create (&t, &attr, prefetch_worker, NULL);
+    pthread_attr_destroy (&attr);
+    if (err) {
+      pthread_mutex_unlock (&lock);
+      free (p);
+      return -1;
+    }
+    thread_running = true;
+  }
+  if (queue_end)
+    queue_end->next = p;
+  else
+    queue = p;
+  queue_end = p;
+  queue_len++;
+  connection_async_begin (conn);
+  pthread_cond_signal (&work_cond);
+  pthread_mutex_unlock (&lock);
+  return 0;
+}
+
+/* Discard queued hints referencing a connection which is about to be
+ * finalized.  A hint the background thread is already executing is
+ * not interrupted; the caller's connection_drain_async waits it out.
+ */
+void
+prefetch_cancel (struct connection *conn)
+{
+  struct prefetch *p, **prev;
+  size_t dropped = 0;
+
+  pthread_mutex_lock (&lock);
+  prev = &queue;
+  queue_end = NULL;
+  while ((p = *prev) != NULL) {
+    if (p->conn == conn) {
+      *prev = p->next;
+      free (p);
+      queue_len--;
+      dropped++;
+    }
+    else {
+      queue_end = p;
+      prev = &p->next;
+    }
+  }
+  pthread_mutex_unlock (&lock);
+
+  while (dropped > 0) {
+    connection_async_end (conn);
+    dropped--;
+  }
+}
@@ -0,0 +1,68 @@
+/* nbdkit
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_PROBES_H
+#define NBDKIT_PROBES_H
+
+/* Static (USDT) tracepoints on the request lifecycle, usable from
+ * systemtap, bpftrace, perf etc. without knowing symbol offsets, eg:
+ *
+ *   bpftrace -e 'usdt:./nbdkit:nbdkit:request_start { @[arg0] = count() }'
+ *
+ * The probes compile to a single nop when not attached, and to
+ * nothing at all when <sys/sdt.h> is not available at build time, so
+ * they are safe on the hottest paths.  All probes are in the "nbdkit"
+ * provider.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define PROBE(name) DTRACE_PROBE (nbdkit, name)
+#define PROBE1(name, a1) DTRACE_PROBE1 (nbdkit, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2 (nbdkit, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3 (nbdkit, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4) \
+  DTRACE_PROBE4 (nbdkit, name, a1, a2, a3, a4)
+
+#else
+
+#define PROBE(name)
+#define PROBE1(name, a1)
+#define PROBE2(name, a1, a2)
+#define PROBE3(name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4)
+
+#endif /* !HAVE_SYS_SDT_H */
+
+#endif /* NBDKIT_PROBES_H */
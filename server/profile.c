@@ -0,0 +1,172 @@
+/* nbdkit
+ * Copyright (C) 2013-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Per-stage timing breakdown (--profile).
+ *
+ * The server knows exactly where each request crosses a stage
+ * boundary: reading it off the socket (including TLS decryption and
+ * stalls while the client dribbles a payload), waiting for the
+ * request serialization lock, the backend/plugin call, and writing
+ * the reply (including TLS encryption and socket backpressure).
+ * External profilers see one flat call stack and cannot split these
+ * apart, so when --profile is in effect the request paths bracket
+ * each stage with a pair of clock reads and add the elapsed time
+ * here.
+ *
+ * The accumulators are relaxed atomics rather than per-thread blocks:
+ * two atomic adds per stage are negligible next to the clock reads,
+ * and it keeps the report readable from a signal handler.
+ *
+ * The breakdown is written to stderr when the server exits and on
+ * SIGUSR2 (SIGUSR1 belongs to --trace).
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+static const char *stage_names[PROFILE_NR_STAGES] = {
+  [PROFILE_RECV] =     "recv     (read request from socket)",
+  [PROFILE_WAIT] =     "wait     (request serialization lock)",
+  [PROFILE_DISPATCH] = "dispatch (filters and plugin)",
+  [PROFILE_SEND] =     "send     (write reply to socket)",
+};
+
+static _Atomic uint64_t stage_ns[PROFILE_NR_STAGES];
+static _Atomic uint64_t stage_count[PROFILE_NR_STAGES];
+
+/* Add the time elapsed since *t0 to a stage.  Called from the data
+ * path, but only when --profile is in effect (the callers check).
+ */
+void
+profile_record (enum profile_stage stage, const struct timespec *t0)
+{
+  struct timespec t1;
+  uint64_t ns;
+
+  if (!profile)
+    return;
+
+  clock_gettime (CLOCK_MONOTONIC, &t1);
+  ns = (t1.tv_sec - t0->tv_sec) * UINT64_C (1000000000)
+    + t1.tv_nsec - t0->tv_nsec;
+  atomic_fetch_add_explicit (&stage_ns[stage], ns, memory_order_relaxed);
+  atomic_fetch_add_explicit (&stage_count[stage], 1, memory_order_relaxed);
+}
+
+/* write(2) is the only thing we may safely call from the report
+ * signal handler.
+ */
+static void
+write_all (const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t r = write (STDERR_FILENO, buf, len);
+    if (r <= 0)
+      return;                   /* nothing useful we can do */
+    buf += r;
+    len -= r;
+  }
+}
+
+/* Write the breakdown to stderr.  Uses only snprintf and write so it
+ * is safe to call from the SIGUSR2 handler; the counters are read
+ * racily, which merely makes the report a snapshot of a moving
+ * target.
+ */
+void
+profile_report (void)
+{
+  char line[256];
+  uint64_t total_ns = 0;
+  int n;
+  size_t i;
+
+  for (i = 0; i < PROFILE_NR_STAGES; ++i)
+    total_ns += stage_ns[i];
+
+  n = snprintf (line, sizeof line, "=== nbdkit profile (pid %d) ===\n",
+                (int) getpid ());
+  write_all (line, n);
+
+  for (i = 0; i < PROFILE_NR_STAGES; ++i) {
+    uint64_t ns = stage_ns[i], count = stage_count[i];
+
+    n = snprintf (line, sizeof line,
+                  "%s: count=%" PRIu64 " total=%.3fs mean=%.1fus (%.1f%%)\n",
+                  stage_names[i], count,
+                  ns / 1e9,
+                  count ? ns / (double) count / 1000.0 : 0.0,
+                  total_ns ? 100.0 * ns / total_ns : 0.0);
+    write_all (line, n);
+  }
+
+  n = snprintf (line, sizeof line, "=== end of profile ===\n");
+  write_all (line, n);
+}
+
+#ifndef WIN32
+
+static void
+handle_profile_report (int sig)
+{
+  profile_report ();
+}
+
+void
+set_up_profile (void)
+{
+  struct sigaction sa;
+
+  memset (&sa, 0, sizeof sa);
+  sa.sa_flags = SA_RESTART;
+  sa.sa_handler = handle_profile_report;
+  sigaction (SIGUSR2, &sa, NULL);
+}
+
+#else /* WIN32 */
+
+void
+set_up_profile (void)
+{
+  /* No signal to report on; profile_report is still called on exit. */
+}
+
+#endif /* WIN32 */
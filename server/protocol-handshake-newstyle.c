@@ -127,7 +127,10 @@ send_newstyle_option_reply_exportnames (uint32_t option, size_t *nr_options)
                     name_of_nbd_opt (option), "sending export name");
       return -1;
     }
-    if (conn->send (export.description, desc_len, 0) == -1) {
+    /* A server never stops after NBD_REP_SERVER: at least the final
+     * NBD_REP_ACK (or an error) always follows, so keep corking.
+     */
+    if (conn->send (export.description, desc_len, SEND_MORE) == -1) {
       nbdkit_error ("write: %s: %s: %m",
                     name_of_nbd_opt (option), "sending export description");
       return -1;
@@ -186,7 +189,10 @@ send_newstyle_option_reply_info_str (uint32_t option, uint32_t reply,
   if (conn->send (&fixed_new_option_reply,
                   sizeof fixed_new_option_reply, SEND_MORE) == -1 ||
       conn->send (&name, sizeof name, SEND_MORE) == -1 ||
-      conn->send (str, len, 0) == -1) {
+      /* NBD_REP_INFO is always followed by at least one more reply,
+       * ultimately NBD_REP_ACK or an error, so keep corking.
+       */
+      conn->send (str, len, SEND_MORE) == -1) {
     nbdkit_error ("write: %s: %m", name_of_nbd_opt (option));
     return -1;
   }
@@ -215,7 +221,10 @@ send_newstyle_option_reply_meta_context (uint32_t option, uint32_t reply,
   if (conn->send (&fixed_new_option_reply,
                   sizeof fixed_new_option_reply, SEND_MORE) == -1 ||
       conn->send (&context, sizeof context, SEND_MORE) == -1 ||
-      conn->send (name, namelen, 0) == -1) {
+      /* NBD_REP_META_CONTEXT is always followed by at least one more
+       * reply, ultimately NBD_REP_ACK or an error, so keep corking.
+       */
+      conn->send (name, namelen, SEND_MORE) == -1) {
     nbdkit_error ("write: %s: %m", name_of_nbd_opt (option));
     return -1;
   }
@@ -667,6 +676,15 @@ negotiate_handshake_newstyle_options (void)
       debug ("newstyle negotiation: %s: client requested structured replies",
              name_of_nbd_opt (option));
 
+      if (conn->extended_headers) {
+        /* The spec requires this to fail after extended headers have
+         * been negotiated.
+         */
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_INVALID) == -1)
+          return -1;
+        continue;
+      }
+
       if (no_sr) {
         /* Must fail with ERR_UNSUP for qemu 4.2 to remain happy;
          * but failing with ERR_POLICY would have been nicer.
@@ -684,6 +702,39 @@ negotiate_handshake_newstyle_options (void)
       conn->structured_replies = true;
       break;
 
+    case NBD_OPT_EXTENDED_HEADERS:
+      if (optlen != 0) {
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_INVALID)
+            == -1)
+          return -1;
+        if (conn_recv_full (data, optlen,
+                            "read: %s: %m", name_of_nbd_opt (option)) == -1)
+          return -1;
+        continue;
+      }
+
+      debug ("newstyle negotiation: %s: client requested extended headers",
+             name_of_nbd_opt (option));
+
+      if (no_sr) {
+        /* Extended headers imply structured replies, so respect the
+         * --no-sr debugging switch here too.
+         */
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_UNSUP) == -1)
+          return -1;
+        debug ("newstyle negotiation: %s: extended headers are disabled",
+               name_of_nbd_opt (option));
+        break;
+      }
+
+      if (send_newstyle_option_reply (option, NBD_REP_ACK) == -1)
+        return -1;
+
+      /* Extended headers imply structured replies. */
+      conn->extended_headers = true;
+      conn->structured_replies = true;
+      break;
+
     case NBD_OPT_LIST_META_CONTEXT:
     case NBD_OPT_SET_META_CONTEXT:
       {
@@ -692,6 +743,11 @@ negotiate_handshake_newstyle_options (void)
         uint32_t nr_queries;
         uint32_t querylen;
         const char *what;
+        /* Non-NULL if some layer in the chain maintains a dirty
+         * bitmap (see the cbt filter), eg. "qemu:dirty-bitmap:NAME".
+         */
+        const char *dirty_bitmap = backend_dirty_bitmap (top);
+        size_t dirty_bitmap_len = dirty_bitmap ? strlen (dirty_bitmap) : 0;
 
         if (conn_recv_full (data, optlen, "read: %s: %m", optname) == -1)
           return -1;
@@ -759,8 +815,10 @@ negotiate_handshake_newstyle_options (void)
         debug ("newstyle negotiation: %s: %s count: %d", optname,
                option == NBD_OPT_LIST_META_CONTEXT ? "query" : "set",
                nr_queries);
-        if (option == NBD_OPT_SET_META_CONTEXT)
+        if (option == NBD_OPT_SET_META_CONTEXT) {
           conn->meta_context_base_allocation = false;
+          conn->meta_context_dirty_bitmap = false;
+        }
         if (nr_queries == 0) {
           if (option == NBD_OPT_LIST_META_CONTEXT) {
             if (send_newstyle_option_reply_meta_context (option,
@@ -768,6 +826,12 @@ negotiate_handshake_newstyle_options (void)
                                                          0, "base:allocation")
                 == -1)
               return -1;
+            if (dirty_bitmap &&
+                send_newstyle_option_reply_meta_context (option,
+                                                         NBD_REP_META_CONTEXT,
+                                                         0, dirty_bitmap)
+                == -1)
+              return -1;
           }
 
           if (send_newstyle_option_reply (option, NBD_REP_ACK) == -1)
@@ -815,6 +879,33 @@ negotiate_handshake_newstyle_options (void)
               if (option == NBD_OPT_SET_META_CONTEXT)
                 conn->meta_context_base_allocation = true;
             }
+            /* For LIST, "qemu:" returns all contexts we support in
+             * the qemu namespace, which is only the dirty bitmap (if
+             * one is configured).
+             */
+            else if (dirty_bitmap &&
+                     option == NBD_OPT_LIST_META_CONTEXT &&
+                     querylen == 5 &&
+                     strncmp (&data[opt_index], "qemu:", 5) == 0) {
+              if (send_newstyle_option_reply_meta_context
+                  (option, NBD_REP_META_CONTEXT,
+                   0, dirty_bitmap) == -1)
+                return -1;
+            }
+            /* The dirty bitmap context requested by name. */
+            else if (dirty_bitmap &&
+                     querylen == dirty_bitmap_len &&
+                     strncmp (&data[opt_index], dirty_bitmap,
+                              dirty_bitmap_len) == 0) {
+              if (send_newstyle_option_reply_meta_context
+                  (option, NBD_REP_META_CONTEXT,
+                   option == NBD_OPT_SET_META_CONTEXT
+                   ? dirty_bitmap_id : 0,
+                   dirty_bitmap) == -1)
+                return -1;
+              if (option == NBD_OPT_SET_META_CONTEXT)
+                conn->meta_context_dirty_bitmap = true;
+            }
             /* Every other query must be ignored. */
 
             opt_index += querylen;
@@ -87,6 +87,24 @@ protocol_common_open (uint64_t *exportsize, uint16_t *flags,
   if (backend_prepare (top) == -1)
     return -1;
 
+  /* Clients commonly send NBD_OPT_INFO then NBD_OPT_GO back to back,
+   * which would recompute everything below for the same export.
+   * Answer the repeat from the export info cached on this connection,
+   * only reseeding the per-layer capability fields which request
+   * validation relies on.  The eflags depend on the negotiated
+   * options and the TLS state, so those are part of the key.
+   */
+  if (conn->exportinfo_valid &&
+      conn->exportinfo_tls == conn->using_tls &&
+      conn->exportinfo_sr == conn->structured_replies &&
+      strcmp (conn->exportinfo_name, exportname) == 0) {
+    backend_seed_capabilities (top);
+    backend_set_exportsize (top, conn->exportinfo_size);
+    *exportsize = conn->exportinfo_size;
+    *flags = conn->exportinfo_eflags;
+    return 0;
+  }
+
   size = backend_get_size (top);
   if (size == -1)
     return -1;
@@ -96,6 +114,12 @@ protocol_common_open (uint64_t *exportsize, uint16_t *flags,
     return -1;
   }
 
+  /* Seed the per-connection probe results from an earlier connection
+   * to the same export, if any, so the checks below don't have to
+   * traverse the filter+plugin chain again.
+   */
+  backend_seed_capabilities (top);
+
   /* Check all flags even if they won't be advertised, to prime the
    * cache and make later request validation easier.
    */
@@ -166,6 +190,24 @@ protocol_common_open (uint64_t *exportsize, uint16_t *flags,
   if (conn->structured_replies)
     eflags |= NBD_FLAG_SEND_DF;
 
+  /* All probes succeeded; record them for subsequent connections. */
+  backend_store_capabilities (top);
+
+  /* Remember the export info for a following NBD_OPT_GO on the same
+   * export (failure to save just means the next call recomputes).
+   */
+  free (conn->exportinfo_name);
+  conn->exportinfo_name = strdup (exportname);
+  if (conn->exportinfo_name != NULL) {
+    conn->exportinfo_size = size;
+    conn->exportinfo_eflags = eflags;
+    conn->exportinfo_tls = conn->using_tls;
+    conn->exportinfo_sr = conn->structured_replies;
+    conn->exportinfo_valid = true;
+  }
+  else
+    conn->exportinfo_valid = false;
+
   *exportsize = size;
   *flags = eflags;
   return 0;
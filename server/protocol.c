@@ -41,15 +41,19 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <poll.h>
+#include <time.h>
 
 #include "internal.h"
 #include "byte-swapping.h"
+#include "iszero.h"
 #include "minmax.h"
 #include "nbd-protocol.h"
+#include "probes.h"
 #include "protostrings.h"
 
 static bool
-validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
+validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint64_t count,
                   uint32_t *error)
 {
   GET_CONN;
@@ -75,7 +79,7 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
     if (!backend_valid_range (top, offset, count)) {
       /* XXX Allow writes to extend the disk? */
       nbdkit_error ("invalid request: %s: offset and count are out of range: "
-                    "offset=%" PRIu64 " count=%" PRIu32,
+                    "offset=%" PRIu64 " count=%" PRIu64,
                     name_of_nbd_cmd (cmd), offset, count);
       *error = (cmd == NBD_CMD_WRITE ||
                 cmd == NBD_CMD_WRITE_ZEROES) ? ENOSPC : EINVAL;
@@ -102,7 +106,7 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   /* Validate flags */
   if (flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE |
                 NBD_CMD_FLAG_DF | NBD_CMD_FLAG_REQ_ONE |
-                NBD_CMD_FLAG_FAST_ZERO)) {
+                NBD_CMD_FLAG_FAST_ZERO | NBD_CMD_FLAG_PAYLOAD_LEN)) {
     nbdkit_error ("invalid request: unknown flag (0x%x)", flags);
     *error = EINVAL;
     return false;
@@ -140,6 +144,21 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
     *error = EINVAL;
     return false;
   }
+  if (flags & NBD_CMD_FLAG_PAYLOAD_LEN) {
+    if (!conn->extended_headers || cmd != NBD_CMD_WRITE) {
+      nbdkit_error ("invalid request: PAYLOAD_LEN flag needs "
+                    "extended headers and a WRITE request");
+      *error = EINVAL;
+      return false;
+    }
+  }
+  else if (conn->extended_headers && cmd == NBD_CMD_WRITE) {
+    nbdkit_error ("invalid request: %s: extended headers require the "
+                  "PAYLOAD_LEN flag on write requests",
+                  name_of_nbd_cmd (cmd));
+    *error = EINVAL;
+    return false;
+  }
   if (flags & NBD_CMD_FLAG_FUA && !(conn->eflags & NBD_FLAG_SEND_FUA)) {
     nbdkit_error ("invalid request: FUA flag not supported");
     *error = EINVAL;
@@ -149,7 +168,7 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   /* Refuse over-large read and write requests. */
   if ((cmd == NBD_CMD_WRITE || cmd == NBD_CMD_READ) &&
       count > MAX_REQUEST_SIZE) {
-    nbdkit_error ("invalid request: %s: data request is too large (%" PRIu32
+    nbdkit_error ("invalid request: %s: data request is too large (%" PRIu64
                   " > %d)",
                   name_of_nbd_cmd (cmd), count, MAX_REQUEST_SIZE);
     *error = ENOMEM;
@@ -198,9 +217,10 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
       *error = EINVAL;
       return false;
     }
-    if (!conn->meta_context_base_allocation) {
+    if (!conn->meta_context_base_allocation &&
+        !conn->meta_context_dirty_bitmap) {
       nbdkit_error ("invalid request: "
-                    "%s: base:allocation was not negotiated",
+                    "%s: no metadata context was negotiated",
                     name_of_nbd_cmd (cmd));
       *error = EINVAL;
       return false;
@@ -225,12 +245,22 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
  * later be converted to the nbd error to send back to the client (0
  * for success).
  */
+/* Extended headers allow 64 bit effect lengths but the backend API is
+ * still 32 bit, so large TRIM, CACHE and WRITE_ZEROES requests are
+ * carried out as a loop of backend calls of at most this much each
+ * (the largest 64K-aligned value fitting in 32 bits).
+ */
+#define MAX_EFFECT_CHUNK UINT64_C (0xffff0000)
+
 static uint32_t
-handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
-                void *buf, struct nbdkit_extents *extents)
+handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint64_t count,
+                void *buf, struct nbdkit_extents *extents,
+                struct nbdkit_extents *dirty_extents)
 {
+  GET_CONN;
   uint32_t f = 0;
   int err = 0;
+  int r;
 
   /* Clear the error, so that we know if the plugin calls
    * nbdkit_set_error() or relied on errno.  */
@@ -245,25 +275,61 @@ handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   case NBD_CMD_WRITE:
     if (flags & NBD_CMD_FLAG_FUA)
       f |= NBDKIT_FLAG_FUA;
-    if (backend_pwrite (top, buf, count, offset, f, &err) == -1)
+    extent_cache_invalidate (conn);
+    connection_write_begin (conn);
+    r = backend_pwrite (top, buf, count, offset, f, &err);
+    connection_write_end (conn);
+    if (r == -1)
       return err;
     break;
 
   case NBD_CMD_FLUSH:
-    if (backend_flush (top, 0, &err) == -1)
+    /* The flush waits out in-flight writes so that its reply covers
+     * them; writes arriving meanwhile queue behind it, while reads
+     * bypass the barrier entirely.
+     */
+    connection_flush_begin (conn);
+    r = backend_flush (top, 0, &err);
+    connection_flush_end (conn);
+    if (r == -1)
       return err;
     break;
 
   case NBD_CMD_TRIM:
     if (flags & NBD_CMD_FLAG_FUA)
       f |= NBDKIT_FLAG_FUA;
-    if (backend_trim (top, count, offset, f, &err) == -1)
-      return err;
+    extent_cache_invalidate (conn);
+    connection_write_begin (conn);
+    while (count > 0) {
+      const uint32_t n = MIN (count, MAX_EFFECT_CHUNK);
+
+      if (backend_trim (top, n, offset, f, &err) == -1) {
+        connection_write_end (conn);
+        return err;
+      }
+      offset += n;
+      count -= n;
+    }
+    connection_write_end (conn);
     break;
 
   case NBD_CMD_CACHE:
-    if (backend_cache (top, count, offset, 0, &err) == -1)
-      return err;
+    /* Cache is advisory, so acknowledge it at once and run the
+     * backend prefetch on the background queue (see prefetch.c); a
+     * flood of hints then never occupies worker threads needed by
+     * demand reads.  If the hint cannot be queued, cache
+     * synchronously as before.
+     */
+    if (prefetch_submit (conn, offset, count) == 0)
+      break;
+    while (count > 0) {
+      const uint32_t n = MIN (count, MAX_EFFECT_CHUNK);
+
+      if (backend_cache (top, n, offset, 0, &err) == -1)
+        return err;
+      offset += n;
+      count -= n;
+    }
     break;
 
   case NBD_CMD_WRITE_ZEROES:
@@ -273,16 +339,45 @@ handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
       f |= NBDKIT_FLAG_FUA;
     if (flags & NBD_CMD_FLAG_FAST_ZERO)
       f |= NBDKIT_FLAG_FAST_ZERO;
-    if (backend_zero (top, count, offset, f, &err) == -1)
-      return err;
+    extent_cache_invalidate (conn);
+    connection_write_begin (conn);
+    while (count > 0) {
+      const uint32_t n = MIN (count, MAX_EFFECT_CHUNK);
+
+      if (backend_zero (top, n, offset, f, &err) == -1) {
+        connection_write_end (conn);
+        return err;
+      }
+      offset += n;
+      count -= n;
+    }
+    connection_write_end (conn);
     break;
 
   case NBD_CMD_BLOCK_STATUS:
     if (flags & NBD_CMD_FLAG_REQ_ONE)
       f |= NBDKIT_FLAG_REQ_ONE;
-    if (backend_extents (top, count, offset, f,
-                         extents, &err) == -1)
-      return err;
+    /* base:allocation: serve from the per-connection cache if a
+     * previous reply already covered this range, else ask the backend
+     * and cache the answer.
+     */
+    if (extents) {
+      r = extent_cache_lookup (conn, offset, count, extents);
+      if (r == -1)
+        return errno;
+      if (r == 0) {
+        if (backend_extents (top, count, offset, f,
+                             extents, &err) == -1)
+          return err;
+        extent_cache_store (conn, extents);
+      }
+    }
+    /* The dirty bitmap context, if the client selected it. */
+    if (dirty_extents) {
+      if (backend_dirty_extents (top, count, offset, f,
+                                 dirty_extents, &err) == -1)
+        return err;
+    }
     break;
 
   default:
@@ -368,73 +463,165 @@ send_simple_reply (uint64_t handle, uint16_t cmd, uint16_t flags,
   GET_CONN;
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
   struct nbd_simple_reply reply;
+  struct iovec iov[2];
+  int niov = 1;
   int r;
-  int f = (cmd == NBD_CMD_READ && !error) ? SEND_MORE : 0;
+
+  /* Extended headers forbid simple replies. */
+  assert (!conn->extended_headers);
 
   reply.magic = htobe32 (NBD_SIMPLE_REPLY_MAGIC);
   reply.handle = handle;
   reply.error = htobe32 (nbd_errno (error, flags));
 
-  r = conn->send (&reply, sizeof reply, f);
+  iov[0].iov_base = &reply;
+  iov[0].iov_len = sizeof reply;
+
+  /* Send the reply header and any read data in a single call. */
+  if (cmd == NBD_CMD_READ && !error) {
+    iov[1].iov_base = (char *) buf;
+    iov[1].iov_len = count;
+    niov = 2;
+  }
+
+  r = connection_sendv (iov, niov, 0);
   if (r == -1) {
     nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (-1);
   }
 
-  /* Send the read data buffer. */
-  if (cmd == NBD_CMD_READ && !error) {
-    r = conn->send (buf, count, 0);
-    if (r == -1) {
-      nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
-      return connection_set_status (-1);
-    }
-  }
-
   return 1;                     /* command processed ok */
 }
 
+/* One reply chunk header, in either wire format.  When extended
+ * headers have been negotiated every chunk of every reply must use
+ * the extended (32 byte) form, whose offset field echoes the offset
+ * of the original request; otherwise the structured (16 byte) form is
+ * used and the offset and high length bits are dropped.
+ */
+union reply_header {
+  struct nbd_structured_reply structured;
+  struct nbd_extended_reply extended;
+};
+
+static void
+start_reply_chunk (union reply_header *hdr, struct iovec *iov,
+                   uint64_t cookie, uint16_t rflags, uint16_t type,
+                   uint64_t offset, uint64_t length)
+{
+  GET_CONN;
+
+  if (conn->extended_headers) {
+    hdr->extended.magic = htobe32 (NBD_EXTENDED_REPLY_MAGIC);
+    hdr->extended.flags = htobe16 (rflags);
+    hdr->extended.type = htobe16 (type);
+    hdr->extended.cookie = cookie;
+    hdr->extended.offset = htobe64 (offset);
+    hdr->extended.length = htobe64 (length);
+    iov->iov_len = sizeof hdr->extended;
+  }
+  else {
+    hdr->structured.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
+    hdr->structured.flags = htobe16 (rflags);
+    hdr->structured.type = htobe16 (type);
+    hdr->structured.handle = cookie;
+    hdr->structured.length = htobe32 (length);
+    iov->iov_len = sizeof hdr->structured;
+  }
+  iov->iov_base = hdr;
+}
+
+/* Granularity of hole detection in structured read replies.  Aligned
+ * runs of zeroes at least this long become NBD_REPLY_TYPE_OFFSET_HOLE
+ * chunks instead of travelling over the wire as data.
+ */
+#define READ_HOLE_MIN 4096
+
 static int
-send_structured_reply_read (uint64_t handle, uint16_t cmd,
+send_structured_reply_read (uint64_t cookie, uint16_t cmd, uint16_t flags,
                             const char *buf, uint32_t count, uint64_t offset)
 {
   GET_CONN;
-  /* Once we are really using structured replies and sending data back
-   * in chunks, we'll be able to grab the write lock for each chunk,
-   * allowing other threads to interleave replies.  As we're not doing
-   * that yet we acquire the lock for the whole function.
+  /* The whole reply (all chunks) is sent under one lock so that other
+   * threads cannot interleave their replies with our chunks.
    */
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-  struct nbd_structured_reply reply;
+  union reply_header reply;
   struct nbd_structured_reply_offset_data offset_data;
+  struct nbd_structured_reply_offset_hole offset_hole;
+  struct nbd_structured_reply_offset_hole_ext offset_hole_ext;
+  struct iovec iov[3];
+  uint32_t pos = 0;
   int r;
 
   assert (cmd == NBD_CMD_READ);
 
-  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-  reply.handle = handle;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_OFFSET_DATA);
-  reply.length = htobe32 (count + sizeof offset_data);
-
-  r = conn->send (&reply, sizeof reply, SEND_MORE);
-  if (r == -1) {
-    nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
-    return connection_set_status (-1);
-  }
+  do {
+    uint32_t n;
+    uint16_t rflags;
+    bool hole, last;
+    int niov;
 
-  /* Send the offset + read data buffer. */
-  offset_data.offset = htobe64 (offset);
-  r = conn->send (&offset_data, sizeof offset_data, SEND_MORE);
-  if (r == -1) {
-    nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
-    return connection_set_status (-1);
-  }
+    /* Work out the extent of the next chunk.  NBD_CMD_FLAG_DF forbids
+     * fragmenting the reply, and short reads are not worth scanning.
+     */
+    if ((flags & NBD_CMD_FLAG_DF) || count < READ_HOLE_MIN) {
+      n = count - pos;
+      hole = false;
+    }
+    else {
+      n = MIN (READ_HOLE_MIN, count - pos);
+      hole = is_zero (buf + pos, n);
+      while (pos + n < count) {
+        uint32_t b = MIN (READ_HOLE_MIN, count - pos - n);
+
+        if (is_zero (buf + pos + n, b) != hole)
+          break;
+        n += b;
+      }
+    }
+    last = pos + n == count;
+
+    rflags = last ? NBD_REPLY_FLAG_DONE : 0;
+    if (hole && conn->extended_headers) {
+      start_reply_chunk (&reply, &iov[0], cookie, rflags,
+                         NBD_REPLY_TYPE_OFFSET_HOLE_EXT,
+                         offset, sizeof offset_hole_ext);
+      offset_hole_ext.offset = htobe64 (offset + pos);
+      offset_hole_ext.length = htobe64 (n);
+      iov[1].iov_base = &offset_hole_ext;
+      iov[1].iov_len = sizeof offset_hole_ext;
+      niov = 2;
+    }
+    else if (hole) {
+      start_reply_chunk (&reply, &iov[0], cookie, rflags,
+                         NBD_REPLY_TYPE_OFFSET_HOLE,
+                         offset, sizeof offset_hole);
+      offset_hole.offset = htobe64 (offset + pos);
+      offset_hole.length = htobe32 (n);
+      iov[1].iov_base = &offset_hole;
+      iov[1].iov_len = sizeof offset_hole;
+      niov = 2;
+    }
+    else {
+      start_reply_chunk (&reply, &iov[0], cookie, rflags,
+                         NBD_REPLY_TYPE_OFFSET_DATA,
+                         offset, n + sizeof offset_data);
+      offset_data.offset = htobe64 (offset + pos);
+      iov[1].iov_base = &offset_data;
+      iov[1].iov_len = sizeof offset_data;
+      iov[2].iov_base = (char *) buf + pos;
+      iov[2].iov_len = n;
+      niov = 3;
+    }
 
-  r = conn->send (buf, count, 0);
-  if (r == -1) {
-    nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
-    return connection_set_status (-1);
-  }
+    r = connection_sendv (iov, niov, last ? 0 : SEND_MORE);
+    if (r == -1) {
+      nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
+      return connection_set_status (-1);
+    }
+    pos += n;
+  } while (pos < count);
 
   return 1;                     /* command processed ok */
 }
@@ -456,13 +643,14 @@ extents_to_block_descriptors (struct nbdkit_extents *extents,
   /* This is checked in server/plugins.c. */
   assert (nr_extents >= 1);
 
-  /* We may send fewer than nr_extents blocks, but never more. */
-  blocks = calloc (req_one ? 1 : nr_extents,
-                   sizeof (struct nbd_block_descriptor));
-  if (blocks == NULL) {
-    nbdkit_error ("calloc: %m");
+  /* We may send fewer than nr_extents blocks, but never more.  The
+   * per-thread buffer is shared with read/write payloads but a block
+   * status request never carries one, so it is free here.
+   */
+  blocks = threadlocal_buffer ((req_one ? 1 : nr_extents) *
+                               sizeof (struct nbd_block_descriptor));
+  if (blocks == NULL)
     return NULL;
-  }
 
   if (req_one) {
     const struct nbdkit_extent e = nbdkit_get_extent (extents, 0);
@@ -521,109 +709,576 @@ extents_to_block_descriptors (struct nbdkit_extents *extents,
   return blocks;
 }
 
+/* 64 bit variant of the above for extended headers
+ * (NBD_REPLY_TYPE_BLOCK_STATUS_EXT).  Unlike the 32 bit form this
+ * never has to clamp an extent length, so every extent maps to
+ * exactly one descriptor.
+ */
+static struct nbd_block_descriptor_ext *
+extents_to_block_descriptors_ext (struct nbdkit_extents *extents,
+                                  uint16_t flags,
+                                  uint64_t count, uint64_t offset,
+                                  size_t *nr_blocks)
+{
+  const bool req_one = flags & NBD_CMD_FLAG_REQ_ONE;
+  const size_t nr_extents = nbdkit_extents_count (extents);
+  size_t i;
+  struct nbd_block_descriptor_ext *blocks;
+
+  /* This is checked in server/plugins.c. */
+  assert (nr_extents >= 1);
+
+  blocks = threadlocal_buffer ((req_one ? 1 : nr_extents) *
+                               sizeof (struct nbd_block_descriptor_ext));
+  if (blocks == NULL)
+    return NULL;
+
+  if (req_one) {
+    const struct nbdkit_extent e = nbdkit_get_extent (extents, 0);
+
+    /* Checked as a side effect of how the extent list is created. */
+    assert (e.length > 0);
+
+    *nr_blocks = 1;
+
+    /* Must not exceed count of the original request. */
+    blocks[0].length = MIN (e.length, count);
+    blocks[0].status_flags = e.type & 3;
+  }
+  else {
+    uint64_t pos = offset;
+
+    *nr_blocks = 0;
+    for (i = 0; i < nr_extents; ++i) {
+      const struct nbdkit_extent e = nbdkit_get_extent (extents, i);
+
+      if (i == 0)
+        assert (e.offset == offset);
+
+      blocks[i].length = e.length;
+      blocks[i].status_flags = e.type & 3;
+      (*nr_blocks)++;
+
+      pos += e.length;
+      if (pos > offset + count) /* this must be the last block */
+        break;
+    }
+  }
+
+  /* Convert to big endian for the protocol. */
+  for (i = 0; i < *nr_blocks; ++i) {
+    blocks[i].length = htobe64 (blocks[i].length);
+    blocks[i].status_flags = htobe64 (blocks[i].status_flags);
+  }
+
+  return blocks;
+}
+
+/* Send the block status chunk for one metadata context.  Called with
+ * the connection write lock held; NBD_REPLY_FLAG_DONE is only set on
+ * the last chunk of the reply.
+ */
 static int
-send_structured_reply_block_status (uint64_t handle,
+send_block_status_context (uint64_t cookie,
+                           uint16_t cmd, uint16_t flags,
+                           uint32_t count, uint64_t offset,
+                           struct nbdkit_extents *extents,
+                           uint32_t context, bool final)
+{
+  GET_CONN;
+  union reply_header reply;
+  void *blocks;                 /* per-thread, do not free */
+  size_t nr_blocks, descsize;
+  uint32_t context_id, nr_blocks_be;
+  struct iovec iov[4];
+  int niov, r;
+  const uint16_t reply_flags = final ? NBD_REPLY_FLAG_DONE : 0;
+
+  if (conn->extended_headers) {
+    descsize = sizeof (struct nbd_block_descriptor_ext);
+    blocks = extents_to_block_descriptors_ext (extents, flags, count, offset,
+                                               &nr_blocks);
+  }
+  else {
+    descsize = sizeof (struct nbd_block_descriptor);
+    blocks = extents_to_block_descriptors (extents, flags, count, offset,
+                                           &nr_blocks);
+  }
+  if (blocks == NULL)
+    return -1;
+
+  context_id = htobe32 (context);
+
+  /* Send the reply header, context ID and the whole array of block
+   * descriptors in a single call.  The extended form additionally
+   * carries a count of descriptors after the context ID.
+   */
+  iov[1].iov_base = &context_id;
+  iov[1].iov_len = sizeof context_id;
+  if (conn->extended_headers) {
+    start_reply_chunk (&reply, &iov[0], cookie, reply_flags,
+                       NBD_REPLY_TYPE_BLOCK_STATUS_EXT,
+                       offset,
+                       sizeof context_id + sizeof nr_blocks_be +
+                       nr_blocks * descsize);
+    nr_blocks_be = htobe32 (nr_blocks);
+    iov[2].iov_base = &nr_blocks_be;
+    iov[2].iov_len = sizeof nr_blocks_be;
+    iov[3].iov_base = blocks;
+    iov[3].iov_len = nr_blocks * descsize;
+    niov = 4;
+  }
+  else {
+    start_reply_chunk (&reply, &iov[0], cookie, reply_flags,
+                       NBD_REPLY_TYPE_BLOCK_STATUS,
+                       offset, sizeof context_id + nr_blocks * descsize);
+    iov[2].iov_base = blocks;
+    iov[2].iov_len = nr_blocks * descsize;
+    niov = 3;
+  }
+
+  r = connection_sendv (iov, niov, 0);
+  if (r == -1) {
+    nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+send_structured_reply_block_status (uint64_t cookie,
                                     uint16_t cmd, uint16_t flags,
                                     uint32_t count, uint64_t offset,
-                                    struct nbdkit_extents *extents)
+                                    struct nbdkit_extents *extents,
+                                    struct nbdkit_extents *dirty_extents)
 {
   GET_CONN;
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-  struct nbd_structured_reply reply;
-  CLEANUP_FREE struct nbd_block_descriptor *blocks = NULL;
-  size_t nr_blocks;
-  uint32_t context_id;
-  size_t i;
-  int r;
 
-  assert (conn->meta_context_base_allocation);
   assert (cmd == NBD_CMD_BLOCK_STATUS);
+  assert (extents != NULL || dirty_extents != NULL);
 
-  blocks = extents_to_block_descriptors (extents, flags, count, offset,
-                                         &nr_blocks);
-  if (blocks == NULL)
+  /* One chunk per negotiated context; the DONE flag goes on the last. */
+  if (extents &&
+      send_block_status_context (cookie, cmd, flags, count, offset,
+                                 extents, base_allocation_id,
+                                 dirty_extents == NULL) == -1)
+    return connection_set_status (-1);
+  if (dirty_extents &&
+      send_block_status_context (cookie, cmd, flags, count, offset,
+                                 dirty_extents, dirty_bitmap_id,
+                                 true) == -1)
     return connection_set_status (-1);
 
-  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-  reply.handle = handle;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_BLOCK_STATUS);
-  reply.length = htobe32 (sizeof context_id +
-                          nr_blocks * sizeof (struct nbd_block_descriptor));
+  return 1;                     /* command processed ok */
+}
 
-  r = conn->send (&reply, sizeof reply, SEND_MORE);
+static int
+send_structured_reply_error (uint64_t cookie, uint16_t cmd, uint16_t flags,
+                             uint64_t offset, uint32_t error)
+{
+  GET_CONN;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+  union reply_header reply;
+  struct nbd_structured_reply_error error_data;
+  struct iovec iov[2];
+  int r;
+
+  start_reply_chunk (&reply, &iov[0], cookie, NBD_REPLY_FLAG_DONE,
+                     NBD_REPLY_TYPE_ERROR,
+                     offset,
+                     0 /* no human readable error */ + sizeof error_data);
+  error_data.error = htobe32 (nbd_errno (error, flags));
+  error_data.len = htobe16 (0);
+  /* No human readable error message at the moment. */
+
+  iov[1].iov_base = &error_data;
+  iov[1].iov_len = sizeof error_data;
+
+  r = connection_sendv (iov, 2, 0);
   if (r == -1) {
-    nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
+    nbdkit_error ("write error reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (-1);
   }
 
-  /* Send the base:allocation context ID. */
-  context_id = htobe32 (base_allocation_id);
-  r = conn->send (&context_id, sizeof context_id, SEND_MORE);
+  return 1;                     /* command processed ok */
+}
+
+/* With extended headers there are no simple replies, so success with
+ * no payload is signalled by a lone NBD_REPLY_TYPE_NONE chunk.
+ */
+static int
+send_done_reply (uint64_t cookie, uint16_t cmd, uint64_t offset)
+{
+  GET_CONN;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+  union reply_header reply;
+  struct iovec iov[1];
+  int r;
+
+  assert (conn->extended_headers);
+
+  start_reply_chunk (&reply, &iov[0], cookie, NBD_REPLY_FLAG_DONE,
+                     NBD_REPLY_TYPE_NONE, offset, 0);
+
+  r = connection_sendv (iov, 1, 0);
   if (r == -1) {
     nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (-1);
   }
 
-  /* Send each block descriptor. */
-  for (i = 0; i < nr_blocks; ++i) {
-    r = conn->send (&blocks[i], sizeof blocks[i],
-                    i == nr_blocks - 1 ? 0 : SEND_MORE);
+  return 1;                     /* command processed ok */
+}
+
+/* Asynchronous requests.
+ *
+ * A plugin which implements .pread_async / .pwrite_async does not tie
+ * up a worker thread for the duration of the operation: the request
+ * is submitted and the worker goes straight back to reading the
+ * socket, so a handful of threads can drive many in-flight operations
+ * against a remote backend.  The reply is sent from whichever thread
+ * the plugin calls nbdkit_completion_complete on; the existing
+ * write_lock in the reply senders makes that safe.
+ *
+ * The operation outlives the submitting thread, so it carries its own
+ * data buffer (following the struct) instead of the per-thread one.
+ */
+struct nbdkit_completion {
+  struct connection *conn;
+  uint64_t cookie;              /* NBD request handle */
+  uint16_t cmd;
+  uint16_t flags;
+  uint64_t offset;
+  uint32_t count;
+  char *buf;
+};
+
+/* Try to submit a request asynchronously.  Called with the read lock
+ * held, after validation, before the write payload has been received.
+ * Returns 0 if the caller should fall back to the synchronous path,
+ * otherwise a protocol_recv_request_send_reply status.
+ */
+static int
+submit_request_async (uint64_t cookie, uint16_t cmd, uint16_t flags,
+                      uint64_t offset, uint32_t count)
+{
+  GET_CONN;
+  struct nbdkit_completion *c;
+  uint32_t f = 0;
+  int err = 0, r;
+  struct timespec pts;          /* --profile stage timestamp */
+  const int can = backend_can_async (top);
+
+  if (cmd == NBD_CMD_READ) {
+    if (!(can & BACKEND_ASYNC_READ))
+      return 0;
+  }
+  else {
+    if (!(can & BACKEND_ASYNC_WRITE))
+      return 0;
+    /* Only native FUA can be submitted asynchronously; the
+     * flush-emulated form needs the synchronous path.
+     */
+    if (flags & NBD_CMD_FLAG_FUA) {
+      if (backend_can_fua (top) != NBDKIT_FUA_NATIVE)
+        return 0;
+      f |= NBDKIT_FLAG_FUA;
+    }
+  }
+
+  /* Decide whether we can go asynchronous BEFORE receiving the write
+   * payload.  Once any of it has been read from the socket, falling
+   * back (returning 0) would make the synchronous path re-receive the
+   * payload and permanently desynchronize the stream.
+   */
+  if (cmd == NBD_CMD_WRITE && !connection_write_try_begin (conn)) {
+    /* A flush is in flight: queue behind it on the synchronous path,
+     * which does not hold the socket read lock while waiting.
+     */
+    return 0;
+  }
+
+  /* The data buffer carries the same alignment guarantee as the
+   * per-thread one (nbdkit_buffer_alignment), at the cost of padding
+   * the struct out to one alignment unit.
+   */
+#ifdef HAVE_POSIX_MEMALIGN
+  {
+    void *ptr;
+
+    if (posix_memalign (&ptr, REQUEST_BUFFER_ALIGNMENT,
+                        REQUEST_BUFFER_ALIGNMENT + count) != 0) {
+      if (cmd == NBD_CMD_WRITE)
+        connection_write_end (conn);
+      return 0;                 /* fall back to the synchronous path */
+    }
+    c = ptr;
+    c->buf = (char *) c + REQUEST_BUFFER_ALIGNMENT;
+  }
+#else
+  c = malloc (sizeof *c + count);
+  if (c == NULL) {
+    if (cmd == NBD_CMD_WRITE)
+      connection_write_end (conn);
+    return 0;                   /* fall back to the synchronous path */
+  }
+  c->buf = (char *) (c + 1);
+#endif
+  c->conn = conn;
+  c->cookie = cookie;
+  c->cmd = cmd;
+  c->flags = flags;
+  c->offset = offset;
+  c->count = count;
+
+  if (cmd == NBD_CMD_WRITE) {
+    r = conn->recv (c->buf, count);
+    if (r == 0) {
+      errno = EBADMSG;
+      r = -1;
+    }
     if (r == -1) {
-      nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
+      nbdkit_error ("read data: %s: %m", name_of_nbd_cmd (cmd));
+      connection_write_end (conn);
+      free (c);
       return connection_set_status (-1);
     }
+    extent_cache_invalidate (conn);
   }
 
-  return 1;                     /* command processed ok */
+  connection_async_begin (conn);
+  /* For asynchronous plugins only the submission is attributed to the
+   * dispatch stage; the operation itself runs on the plugin's own
+   * threads where the server has no stage boundary to observe.
+   */
+  profile_start (&pts);
+  if (cmd == NBD_CMD_READ)
+    r = backend_pread_async (top, c->buf, count, offset, 0, c, &err);
+  else
+    r = backend_pwrite_async (top, c->buf, count, offset, f, c, &err);
+  if (profile)
+    profile_record (PROFILE_DISPATCH, &pts);
+  if (r == -1) {
+    /* Could not submit: the completion will never be called, so send
+     * the error reply here.
+     */
+    if (cmd == NBD_CMD_WRITE)
+      connection_write_end (conn);
+    connection_async_end (conn);
+    debug ("sending error reply: %s", strerror (err));
+    if (conn->extended_headers ||
+        (conn->structured_replies && cmd == NBD_CMD_READ))
+      r = send_structured_reply_error (cookie, cmd, flags, offset, err);
+    else
+      r = send_simple_reply (cookie, cmd, flags, NULL, 0, err);
+    free (c);
+    return r;
+  }
+  return 1;
+}
+
+/* Called by the plugin (from any thread, including its own event
+ * threads) when an asynchronous operation finishes.  error is 0 or a
+ * positive errno value.
+ */
+void
+nbdkit_completion_complete (struct nbdkit_completion *c, int error)
+{
+  struct connection *conn = c->conn;
+  struct connection *old_conn;
+
+  /* This may run on a plugin thread which has no server threadlocal
+   * yet; the reply senders and connection_set_status need one which
+   * points at the right connection.  Restore the old value afterwards
+   * in case the plugin completed synchronously on a worker thread.
+   */
+  old_conn = threadlocal_get_conn ();
+  if (old_conn != conn) {
+    threadlocal_set_conn (conn);
+    if (threadlocal_get_conn () != conn) {
+      /* The thread had no threadlocal at all: give it one. */
+      threadlocal_new_server_thread ();
+      threadlocal_set_conn (conn);
+    }
+  }
+
+  if (connection_get_status () > 0) {
+    struct timespec pts;
+
+    PROBE2 (reply_start, c->cmd, error);
+    profile_start (&pts);
+    if (error != 0) {
+      debug ("sending async error reply: %s", strerror (error));
+      if (conn->extended_headers ||
+          (conn->structured_replies && c->cmd == NBD_CMD_READ))
+        send_structured_reply_error (c->cookie, c->cmd, c->flags, c->offset,
+                                     error);
+      else
+        send_simple_reply (c->cookie, c->cmd, c->flags, NULL, 0, error);
+    }
+    else if (conn->structured_replies && c->cmd == NBD_CMD_READ)
+      send_structured_reply_read (c->cookie, c->cmd, c->flags,
+                                  c->buf, c->count, c->offset);
+    else if (conn->extended_headers)
+      send_done_reply (c->cookie, c->cmd, c->offset);
+    else
+      send_simple_reply (c->cookie, c->cmd, c->flags, c->buf, c->count, 0);
+    if (profile)
+      profile_record (PROFILE_SEND, &pts);
+    PROBE2 (request_done, c->cmd, error);
+  }
+
+  if (old_conn != conn)
+    threadlocal_set_conn (old_conn);
+  if (c->cmd == NBD_CMD_WRITE)
+    connection_write_end (conn); /* only now may a queued flush start */
+  connection_async_end (conn);
+  free (c);
 }
 
+/* Wait up to timeout_ms for the client to start sending a request.
+ * Called with the read lock held.  Returns like
+ * protocol_recv_request_send_reply.
+ */
 static int
-send_structured_reply_error (uint64_t handle, uint16_t cmd, uint16_t flags,
-                             uint32_t error)
+wait_for_request (struct connection *conn, int timeout_ms)
 {
-  GET_CONN;
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-  struct nbd_structured_reply reply;
-  struct nbd_structured_reply_error error_data;
+  struct pollfd fds[2];
+  nfds_t nfds = 1;
   int r;
 
-  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-  reply.handle = handle;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_ERROR);
-  reply.length = htobe32 (0 /* no human readable error */ + sizeof error_data);
+  fds[0].fd = conn->sockin;
+  fds[0].events = POLLIN;
+  fds[1].fd = conn->status_pipe[0];
+  fds[1].events = POLLIN;
+  if (conn->status_pipe[0] >= 0)
+    nfds = 2;
 
-  r = conn->send (&reply, sizeof reply, SEND_MORE);
-  if (r == -1) {
-    nbdkit_error ("write error reply: %m");
-    return connection_set_status (-1);
+  for (;;) {
+    fds[0].revents = fds[1].revents = 0;
+    r = poll (fds, nfds, timeout_ms);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("poll: %m");
+      return connection_set_status (-1);
+    }
+    if (quit)
+      return 0;
+    if (nfds > 1 && fds[1].revents) {
+      /* Another worker changed the connection status. */
+      r = connection_get_status ();
+      if (r <= 0)
+        return r;
+      continue;
+    }
+    if (fds[0].revents)
+      return 1;                 /* readable (or EOF, recv will see it) */
+    return 2;                   /* idle timeout */
   }
+}
 
-  /* Send the error. */
-  error_data.error = htobe32 (nbd_errno (error, flags));
-  error_data.len = htobe16 (0);
-  r = conn->send (&error_data, sizeof error_data, 0);
-  if (r == -1) {
-    nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
-    return connection_set_status (-1);
-  }
-  /* No human readable error message at the moment. */
+/* Limits for the --coalesce lookahead: how much data one merged
+ * backend call may cover and how many client requests it may serve.
+ */
+#define COALESCE_MAX_SIZE (2 * 1024 * 1024)
+#define COALESCE_MAX_REQUESTS 16
+
+struct read_group {
+  uint64_t handles[COALESCE_MAX_REQUESTS];
+  uint32_t counts[COALESCE_MAX_REQUESTS];
+  size_t n;
+};
+
+/* Called with the read lock held after receiving a valid NBD_CMD_READ.
+ * Greedily pulls further requests which are already waiting in the
+ * socket and which continue the same read, so a sequential stream of
+ * small reads becomes one backend call.  A request which does not
+ * continue the read is stashed in conn->pending_request for the next
+ * receive.  On return *count covers the whole group.  Returns -1 on a
+ * fatal receive error.
+ */
+static int
+coalesce_reads (struct connection *conn, uint16_t flags,
+                uint64_t offset, uint64_t *count, struct read_group *group)
+{
+  for (;;) {
+    struct pollfd fd = { .fd = conn->sockin, .events = POLLIN };
+    struct nbd_request next;
+    uint16_t next_cmd, next_flags;
+    uint64_t next_offset;
+    uint32_t next_count, next_error = 0;
+    int r;
+
+    if (group->n >= COALESCE_MAX_REQUESTS || *count >= COALESCE_MAX_SIZE)
+      return 0;
+
+    /* Only look at requests the client has already sent: never wait. */
+    r = poll (&fd, 1, 0);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+    if (r == 0)
+      return 0;
 
-  return 1;                     /* command processed ok */
+    r = conn->recv (&next, sizeof next);
+    if (r == -1) {
+      nbdkit_error ("read request: %m");
+      return -1;
+    }
+    if (r == 0)                 /* EOF, seen again by the next receive */
+      return 0;
+
+    if (be32toh (next.magic) != NBD_REQUEST_MAGIC) {
+      nbdkit_error ("invalid request: 'magic' field is incorrect (0x%x)",
+                    be32toh (next.magic));
+      return -1;
+    }
+
+    next_cmd = be16toh (next.type);
+    next_flags = be16toh (next.flags);
+    next_offset = be64toh (next.offset);
+    next_count = be32toh (next.count);
+
+    if (next_cmd == NBD_CMD_READ &&
+        next_flags == flags &&
+        next_offset == offset + *count &&
+        *count + next_count <= COALESCE_MAX_SIZE &&
+        validate_request (next_cmd, next_flags, next_offset, next_count,
+                          &next_error)) {
+      group->handles[group->n] = next.handle;
+      group->counts[group->n] = next_count;
+      group->n++;
+      *count += next_count;
+      continue;
+    }
+
+    /* Not a continuation: stash it for the next receive. */
+    conn->pending_request = next;
+    conn->have_pending_request = true;
+    return 0;
+  }
 }
 
-int
-protocol_recv_request_send_reply (void)
+static int
+recv_request_send_reply (int idle_timeout_ms)
 {
   GET_CONN;
   int r;
   struct nbd_request request;
   uint16_t cmd, flags;
-  uint32_t magic, count, error = 0;
-  uint64_t offset;
+  uint32_t magic, error = 0;
+  uint64_t cookie, offset, count;
   char *buf = NULL;
-  CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents = NULL;
+  struct nbdkit_extents *extents = NULL; /* per-thread, do not free */
+  CLEANUP_EXTENTS_FREE struct nbdkit_extents *dirty_extents = NULL;
+  struct read_group group = { .n = 0 };
+  struct nbdkit_zerocopy_read zc;
+  bool zerocopy = false;
+  struct timespec pts;          /* --profile stage timestamp */
 
   /* Read the request packet. */
   {
@@ -631,28 +1286,88 @@ protocol_recv_request_send_reply (void)
     r = connection_get_status ();
     if (r <= 0)
       return r;
-    r = conn->recv (&request, sizeof request);
-    if (r == -1) {
-      nbdkit_error ("read request: %m");
-      return connection_set_status (-1);
-    }
-    if (r == 0) {
-      debug ("client closed input socket, closing connection");
-      return connection_set_status (0); /* disconnect */
-    }
+    if (conn->extended_headers) {
+      /* Extended requests are a different size and layout on the wire
+       * (and --coalesce is disabled, so there is never a pending
+       * request to pick up).
+       */
+      struct nbd_extended_request request_ext;
 
-    magic = be32toh (request.magic);
-    if (magic != NBD_REQUEST_MAGIC) {
-      nbdkit_error ("invalid request: 'magic' field is incorrect (0x%x)",
-                    magic);
-      return connection_set_status (-1);
+      assert (!conn->have_pending_request);
+      if (idle_timeout_ms >= 0) {
+        r = wait_for_request (conn, idle_timeout_ms);
+        if (r != 1)
+          return r;
+      }
+      profile_start (&pts);
+      r = conn->recv (&request_ext, sizeof request_ext);
+      if (profile)
+        profile_record (PROFILE_RECV, &pts);
+      if (r == -1) {
+        nbdkit_error ("read request: %m");
+        return connection_set_status (-1);
+      }
+      if (r == 0) {
+        debug ("client closed input socket, closing connection");
+        return connection_set_status (0); /* disconnect */
+      }
+
+      magic = be32toh (request_ext.magic);
+      if (magic != NBD_EXTENDED_REQUEST_MAGIC) {
+        nbdkit_error ("invalid request: 'magic' field is incorrect (0x%x)",
+                      magic);
+        return connection_set_status (-1);
+      }
+
+      flags = be16toh (request_ext.flags);
+      cmd = be16toh (request_ext.type);
+      cookie = request_ext.cookie;
+
+      offset = be64toh (request_ext.offset);
+      count = be64toh (request_ext.count);
     }
+    else {
+      if (conn->have_pending_request) {
+        /* A previous --coalesce lookahead already read our request. */
+        request = conn->pending_request;
+        conn->have_pending_request = false;
+      }
+      else {
+        if (idle_timeout_ms >= 0) {
+          r = wait_for_request (conn, idle_timeout_ms);
+          if (r != 1)
+            return r;
+        }
+        profile_start (&pts);
+        r = conn->recv (&request, sizeof request);
+        if (profile)
+          profile_record (PROFILE_RECV, &pts);
+        if (r == -1) {
+          nbdkit_error ("read request: %m");
+          return connection_set_status (-1);
+        }
+        if (r == 0) {
+          debug ("client closed input socket, closing connection");
+          return connection_set_status (0); /* disconnect */
+        }
+      }
 
-    flags = be16toh (request.flags);
-    cmd = be16toh (request.type);
+      magic = be32toh (request.magic);
+      if (magic != NBD_REQUEST_MAGIC) {
+        nbdkit_error ("invalid request: 'magic' field is incorrect (0x%x)",
+                      magic);
+        return connection_set_status (-1);
+      }
+
+      flags = be16toh (request.flags);
+      cmd = be16toh (request.type);
+      cookie = request.handle;
+
+      offset = be64toh (request.offset);
+      count = be32toh (request.count);
+    }
 
-    offset = be64toh (request.offset);
-    count = be32toh (request.count);
+    PROBE4 (request_start, cmd, flags, offset, count);
 
     if (cmd == NBD_CMD_DISC) {
       debug ("client sent %s, closing connection", name_of_nbd_cmd (cmd));
@@ -661,16 +1376,51 @@ protocol_recv_request_send_reply (void)
 
     /* Validate the request. */
     if (!validate_request (cmd, flags, offset, count, &error)) {
+      /* Note with extended headers a write without PAYLOAD_LEN fails
+       * validation but carries no payload to skip.
+       */
       if (cmd == NBD_CMD_WRITE &&
+          (!conn->extended_headers || (flags & NBD_CMD_FLAG_PAYLOAD_LEN)) &&
           skip_over_write_buffer (conn->sockin, count) < 0)
         return connection_set_status (-1);
       goto send_reply;
     }
 
+    /* The backend extents API is still 32 bit; replying about a
+     * prefix of a larger block status request is allowed.
+     */
+    if (cmd == NBD_CMD_BLOCK_STATUS && count > UINT32_MAX)
+      count = UINT32_MAX;
+
+    /* Hand reads and writes to an asynchronous plugin if possible;
+     * the reply is sent by nbdkit_completion_complete and this thread
+     * goes straight back to the socket.
+     */
+    if (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) {
+      r = submit_request_async (cookie, cmd, flags, offset, count);
+      if (r != 0)
+        return r;
+    }
+
+    /* Merge adjacent reads which are already waiting in the socket
+     * into this request, so they are served by one backend call.  The
+     * lookahead reads classic requests off the wire, so it cannot be
+     * used when extended headers have been negotiated.
+     */
+    if (coalesce && !conn->extended_headers && cmd == NBD_CMD_READ) {
+      group.handles[0] = cookie;
+      group.counts[0] = count;
+      group.n = 1;
+      if (coalesce_reads (conn, flags, offset, &count, &group) == -1)
+        return connection_set_status (-1);
+    }
+
     /* Get the data buffer used for either read or write requests.
      * This is a common per-thread data buffer, it must not be freed.
+     * For a single read the allocation is deferred: the plugin may
+     * lend us its own buffer instead (see the zero-copy path below).
      */
-    if (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) {
+    if (cmd == NBD_CMD_WRITE || (cmd == NBD_CMD_READ && group.n > 1)) {
       buf = threadlocal_buffer ((size_t) count);
       if (buf == NULL) {
         error = ENOMEM;
@@ -681,18 +1431,33 @@ protocol_recv_request_send_reply (void)
       }
     }
 
-    /* Allocate the extents list for block status only. */
+    /* Get an extents list for each metadata context the client
+     * selected.  The base:allocation list is a common per-thread
+     * list, it must not be freed.
+     */
     if (cmd == NBD_CMD_BLOCK_STATUS) {
-      extents = nbdkit_extents_new (offset, backend_get_size (top));
-      if (extents == NULL) {
-        error = ENOMEM;
-        goto send_reply;
+      if (conn->meta_context_base_allocation) {
+        extents = threadlocal_extents (offset, backend_get_size (top));
+        if (extents == NULL) {
+          error = ENOMEM;
+          goto send_reply;
+        }
+      }
+      if (conn->meta_context_dirty_bitmap) {
+        dirty_extents = nbdkit_extents_new (offset, backend_get_size (top));
+        if (dirty_extents == NULL) {
+          error = ENOMEM;
+          goto send_reply;
+        }
       }
     }
 
     /* Receive the write data buffer. */
     if (cmd == NBD_CMD_WRITE) {
+      profile_start (&pts);
       r = conn->recv (buf, count);
+      if (profile)
+        profile_record (PROFILE_RECV, &pts);
       if (r == 0) {
         errno = EBADMSG;
         r = -1;
@@ -709,10 +1474,60 @@ protocol_recv_request_send_reply (void)
     error = ESHUTDOWN;
   }
   else {
+    struct timespec t0, t1;
+
+    if (stats_socket)
+      clock_gettime (CLOCK_MONOTONIC, &t0);
+    if (qos_enabled)
+      qos_set_cost (count);
+    profile_start (&pts);
     lock_request ();
-    error = handle_request (cmd, flags, offset, count, buf, extents);
+    if (profile) {
+      profile_record (PROFILE_WAIT, &pts);
+      profile_start (&pts);
+    }
+    if (stats_socket)
+      stats_set_busy (true);
+    if (cmd == NBD_CMD_READ && buf == NULL) {
+      /* Zero-copy read: ask the plugin to lend us its own buffer,
+       * saving the copy into the per-thread buffer.  Most plugins
+       * (and any filter chain) make this fall back to a normal read.
+       */
+      int zerr = 0;
+
+      switch (backend_pread_zerocopy (top, &zc, count, offset, 0, &zerr)) {
+      case 0:
+        zerocopy = true;
+        break;
+      case 1:
+        buf = threadlocal_buffer ((size_t) count);
+        if (buf == NULL)
+          error = ENOMEM;
+        else
+          error = handle_request (cmd, flags, offset, count, buf, extents,
+                                  dirty_extents);
+        break;
+      default:
+        error = zerr;
+        break;
+      }
+    }
+    else
+      error = handle_request (cmd, flags, offset, count, buf, extents,
+                              dirty_extents);
     assert ((int) error >= 0);
+    if (profile)
+      profile_record (PROFILE_DISPATCH, &pts);
+    if (stats_socket)
+      stats_set_busy (false);
     unlock_request ();
+    if (stats_socket) {
+      clock_gettime (CLOCK_MONOTONIC, &t1);
+      stats_record (cmd,
+                    (t1.tv_sec - t0.tv_sec) * UINT64_C(1000000000) +
+                    t1.tv_nsec - t0.tv_nsec,
+                    count, error != 0);
+    }
   }
 
   /* Send the reply packet. */
@@ -720,6 +1535,9 @@ protocol_recv_request_send_reply (void)
   if (connection_get_status () < 0)
     return -1;
 
+  PROBE2 (reply_start, cmd, error);
+  profile_start (&pts);
+
   if (error != 0) {
     /* Since we're about to send only the limited NBD_E* errno to the
      * client, don't lose the information about what really happened
@@ -729,29 +1547,96 @@ protocol_recv_request_send_reply (void)
     debug ("sending error reply: %s", strerror (error));
   }
 
-  /* Currently we prefer to send simple replies for everything except
-   * where we have to (ie. NBD_CMD_READ and NBD_CMD_BLOCK_STATUS when
-   * structured_replies have been negotiated).  However this prevents
-   * us from sending human-readable error messages to the client, so
-   * we should reconsider this in future.
+  /* A coalesced read covers several client requests: slice the merged
+   * buffer into one reply per request (every request in the group gets
+   * the error if the merged read failed).
    */
-  if (conn->structured_replies &&
-      (cmd == NBD_CMD_READ || cmd == NBD_CMD_BLOCK_STATUS)) {
+  if (group.n > 1) {
+    uint64_t off = offset;
+    const char *p = buf;
+    size_t i;
+
+    for (i = 0; i < group.n; ++i) {
+      if (conn->structured_replies) {
+        if (!error)
+          r = send_structured_reply_read (group.handles[i], cmd, flags,
+                                          p, group.counts[i], off);
+        else
+          r = send_structured_reply_error (group.handles[i], cmd, flags,
+                                           off, error);
+      }
+      else
+        r = send_simple_reply (group.handles[i], cmd, flags,
+                               p, group.counts[i], error);
+      if (r != 1)
+        return r;
+      p += group.counts[i];
+      off += group.counts[i];
+    }
+    if (profile)
+      profile_record (PROFILE_SEND, &pts);
+    PROBE2 (request_done, cmd, error);
+    return 1;
+  }
+
+  if (zerocopy)
+    buf = (char *) zc.buf;
+
+  /* With extended headers every reply must be a chunked reply.
+   * Otherwise we currently prefer to send simple replies for
+   * everything except where we have to (ie. NBD_CMD_READ and
+   * NBD_CMD_BLOCK_STATUS when structured_replies have been
+   * negotiated).  However this prevents us from sending
+   * human-readable error messages to the client, so we should
+   * reconsider this in future.
+   */
+  if (conn->extended_headers ||
+      (conn->structured_replies &&
+       (cmd == NBD_CMD_READ || cmd == NBD_CMD_BLOCK_STATUS))) {
     if (!error) {
       if (cmd == NBD_CMD_READ)
-        return send_structured_reply_read (request.handle, cmd,
-                                           buf, count, offset);
-      else /* NBD_CMD_BLOCK_STATUS */
-        return send_structured_reply_block_status (request.handle,
-                                                   cmd, flags,
-                                                   count, offset,
-                                                   extents);
+        r = send_structured_reply_read (cookie, cmd, flags,
+                                        buf, count, offset);
+      else if (cmd == NBD_CMD_BLOCK_STATUS)
+        r = send_structured_reply_block_status (cookie,
+                                                cmd, flags,
+                                                count, offset,
+                                                extents, dirty_extents);
+      else
+        r = send_done_reply (cookie, cmd, offset);
     }
     else
-      return send_structured_reply_error (request.handle, cmd, flags,
-                                          error);
+      r = send_structured_reply_error (cookie, cmd, flags, offset,
+                                       error);
   }
   else
-    return send_simple_reply (request.handle, cmd, flags, buf, count,
-                              error);
+    r = send_simple_reply (cookie, cmd, flags, buf, count,
+                          error);
+  if (profile)
+    profile_record (PROFILE_SEND, &pts);
+  if (zerocopy)
+    zc.release (zc.opaque);
+  PROBE2 (request_done, cmd, error);
+  return r;
+}
+
+int
+protocol_recv_request_send_reply (int idle_timeout_ms)
+{
+  GET_CONN;
+  int r;
+
+  if (max_inflight == 0)
+    return recv_request_send_reply (idle_timeout_ms);
+
+  /* Overload control (--max-inflight): bound the number of threads
+   * concurrently serving this connection.  When the cap is reached we
+   * block here instead of reading the socket, so a bursting client
+   * fills its TCP window and gets backpressure rather than queueing
+   * unbounded work and starving other connections.
+   */
+  connection_acquire_inflight_slot (conn);
+  r = recv_request_send_reply (idle_timeout_ms);
+  connection_release_inflight_slot (conn);
+  return r;
 }
@@ -452,6 +452,22 @@ nbdkit_stdio_safe (void)
   return !listen_stdin && !configured;
 }
 
+/* Alignment in bytes of the payload buffers the server passes to
+ * .pread and .pwrite, so plugins doing direct I/O can transfer from
+ * them without bouncing.  Note a filter which substitutes a buffer
+ * of its own may provide less; plugins which care should still check
+ * each buffer.
+ */
+int
+nbdkit_buffer_alignment (void)
+{
+#ifdef HAVE_POSIX_MEMALIGN
+  return REQUEST_BUFFER_ALIGNMENT;
+#else
+  return 1;
+#endif
+}
+
 /* Read a password from configuration value. */
 static int read_password_interactive (char **password);
 static int read_password_from_fd (const char *what, int fd, char **password);
@@ -1056,3 +1072,24 @@ nbdkit_printf_intern (const char *fmt, ...)
   va_end (ap);
   return ret;
 }
+
+/* Lend the current request's context to a thread created by a filter
+ * or plugin, so that the helper thread can issue calls (for a filter,
+ * next_ops calls) on behalf of the request.  The caller gets the
+ * context from the thread servicing the request and hands it to the
+ * helper, which must adopt it before making any calls and must only
+ * use it until the original request returns.  It is the caller's
+ * responsibility to only issue concurrent calls when the thread model
+ * allows them (filters learn the final thread model in .get_ready).
+ */
+void *
+nbdkit_get_request_context (void)
+{
+  return threadlocal_get_conn ();
+}
+
+void
+nbdkit_set_request_context (void *context)
+{
+  threadlocal_adopt_conn (context);
+}
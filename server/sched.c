@@ -0,0 +1,454 @@
+/* nbdkit
+ * Copyright (C) 2013-2021 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Weighted fair queueing of the request serialization lock (--qos).
+ *
+ * When the plugin serializes requests, the order in which blocked
+ * worker threads acquire the lock decides which client makes
+ * progress.  A plain mutex hands it out in whatever order the kernel
+ * wakes the waiters, so a connection issuing a stream of large
+ * requests can starve a connection issuing small ones.  With --qos
+ * the lock is instead granted by deficit round robin: each connection
+ * is a flow which earns byte credit in proportion to its weight and
+ * pays the size of each request out of it, so over time every
+ * connection gets plugin time in the ratio of the weights regardless
+ * of its request size.  Flows are grouped into three strict priority
+ * classes (high, normal, low); a waiter in a higher class always wins
+ * over lower classes, and round robin only happens within a class.
+ *
+ * Weights are keyed on the export name the client negotiated and can
+ * be changed at runtime through the stats socket (see stats.c).
+ *
+ * This only reorders waiters for the global all_requests_lock, so it
+ * has no effect for thread models above serialize_all_requests where
+ * connections do not contend on a server-side lock.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "internal.h"
+
+/* Set (before threads start) when any --qos option is seen. */
+bool qos_enabled;
+
+enum qos_class {
+  QOS_CLASS_HIGH = 0,
+  QOS_CLASS_NORMAL,
+  QOS_CLASS_LOW,
+  NR_QOS_CLASSES,
+};
+
+/* Byte credit earned per unit of weight each time a flow is passed
+ * over in the round.
+ */
+#define QOS_QUANTUM 65536
+
+/* Cost charged for requests carrying no payload (flush, handshake,
+ * connection open/close), so they cannot be had for free.
+ */
+#define QOS_MIN_COST 4096
+
+/* One [EXPORTNAME=]WEIGHT[,CLASS] rule.  exportname == NULL is the
+ * default rule applying to connections no other rule matches.
+ */
+struct qos_rule {
+  struct qos_rule *next;
+  char *exportname;
+  unsigned weight;
+  enum qos_class class;
+};
+
+/* One thread blocked in qos_acquire, on the owning flow's FIFO. */
+struct qos_waiter {
+  struct qos_waiter *next;
+  uint64_t cost;
+  bool granted;
+  pthread_cond_t cond;
+};
+
+/* Per-connection scheduling state, created lazily on the first
+ * acquisition by the connection and freed with it.
+ */
+struct qos_flow {
+  struct connection *conn;
+  const char *exportname;       /* rule key the weight was resolved from */
+  unsigned weight;
+  enum qos_class class;
+  uint64_t deficit;
+  struct qos_waiter *waiters, *waiters_tail;
+  struct qos_flow *active_next, *active_prev; /* ring, while waiters != NULL */
+  struct qos_flow *all_next;    /* list of all live flows */
+};
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct qos_rule *rules;
+static struct qos_flow *flows;
+static struct qos_flow *active[NR_QOS_CLASSES]; /* round robin position */
+static bool busy;               /* a thread holds the grant */
+
+/* Acquisitions from contexts without a connection (the unload path)
+ * use this static flow so they are never starved behind client I/O.
+ */
+static struct qos_flow internal_flow = {
+  .weight = 1, .class = QOS_CLASS_HIGH,
+};
+
+/* Cost of the request the current thread is about to issue, stashed
+ * by protocol.c just before it takes the lock.  Zero for lock users
+ * which are not data requests.
+ */
+static __thread uint64_t request_cost;
+
+void
+qos_set_cost (uint64_t cost)
+{
+  request_cost = cost;
+}
+
+static struct qos_rule *
+lookup_rule (const char *exportname)
+{
+  struct qos_rule *r, *def = NULL;
+
+  for (r = rules; r != NULL; r = r->next) {
+    if (r->exportname == NULL)
+      def = r;
+    else if (exportname && strcmp (r->exportname, exportname) == 0)
+      return r;
+  }
+  return def;
+}
+
+/* Insert at the tail of the class ring (just before the round robin
+ * position), so a newly backlogged flow waits for the current round.
+ */
+static void
+ring_insert (struct qos_flow *f)
+{
+  struct qos_flow **head = &active[f->class];
+
+  if (*head == NULL) {
+    f->active_next = f->active_prev = f;
+    *head = f;
+  }
+  else {
+    f->active_next = *head;
+    f->active_prev = (*head)->active_prev;
+    f->active_prev->active_next = f;
+    (*head)->active_prev = f;
+  }
+}
+
+static void
+ring_remove (struct qos_flow *f)
+{
+  struct qos_flow **head = &active[f->class];
+
+  if (f->active_next == f)
+    *head = NULL;
+  else {
+    f->active_prev->active_next = f->active_next;
+    f->active_next->active_prev = f->active_prev;
+    if (*head == f)
+      *head = f->active_next;
+  }
+  f->active_next = f->active_prev = NULL;
+}
+
+/* Apply the best matching rule to a flow, moving it between class
+ * rings if it is backlogged.  Called with sched_lock held.
+ */
+static void
+apply_rules (struct qos_flow *f)
+{
+  const struct qos_rule *r = lookup_rule (f->exportname);
+  unsigned weight = r ? r->weight : 1;
+  enum qos_class class = r ? r->class : QOS_CLASS_NORMAL;
+
+  f->weight = weight;
+  if (class != f->class) {
+    if (f->waiters != NULL) {
+      ring_remove (f);
+      f->class = class;
+      ring_insert (f);
+    }
+    else
+      f->class = class;
+  }
+}
+
+/* Get (creating if necessary) the flow for this connection.  Called
+ * with sched_lock held.
+ */
+static struct qos_flow *
+get_flow (struct connection *conn)
+{
+  struct qos_flow *f;
+
+  if (conn == NULL)
+    return &internal_flow;
+
+  f = conn->qos_flow;
+  if (f == NULL) {
+    f = calloc (1, sizeof *f);
+    if (f == NULL)
+      return &internal_flow; /* degrade rather than fail the request */
+    f->conn = conn;
+    f->all_next = flows;
+    flows = f;
+    conn->qos_flow = f;
+    f->exportname = conn->exportname;
+    apply_rules (f);
+  }
+  else if (f->exportname != conn->exportname) {
+    /* The handshake acquires the lock before the export name is
+     * known; re-resolve the weight when it changes.
+     */
+    f->exportname = conn->exportname;
+    apply_rules (f);
+  }
+  return f;
+}
+
+void
+qos_acquire (void)
+{
+  struct qos_flow *f;
+  struct qos_waiter w;
+
+  w.cost = request_cost > QOS_MIN_COST ? request_cost : QOS_MIN_COST;
+  request_cost = 0;
+
+  if (pthread_mutex_lock (&sched_lock))
+    abort ();
+
+  /* No release is pending a grant while !busy, so there can be no
+   * queued waiters and we can take the grant directly.
+   */
+  if (!busy) {
+    busy = true;
+    if (pthread_mutex_unlock (&sched_lock))
+      abort ();
+    return;
+  }
+
+  f = get_flow (threadlocal_get_conn ());
+  w.next = NULL;
+  w.granted = false;
+  pthread_cond_init (&w.cond, NULL);
+  if (f->waiters == NULL) {
+    f->waiters = f->waiters_tail = &w;
+    ring_insert (f);
+  }
+  else {
+    f->waiters_tail->next = &w;
+    f->waiters_tail = &w;
+  }
+
+  while (!w.granted)
+    pthread_cond_wait (&w.cond, &sched_lock);
+
+  pthread_cond_destroy (&w.cond);
+  if (pthread_mutex_unlock (&sched_lock))
+    abort ();
+}
+
+/* Pick the next waiter by deficit round robin within the highest
+ * backlogged class and hand it the grant.  Called with sched_lock
+ * held and busy == false; each pass over a ring tops up every flow's
+ * deficit so the loop terminates.
+ */
+static void
+dispatch_next (void)
+{
+  enum qos_class c;
+  struct qos_flow *f;
+  struct qos_waiter *w;
+
+  for (c = 0; c < NR_QOS_CLASSES; ++c) {
+    if (active[c] == NULL)
+      continue;
+
+    for (;;) {
+      f = active[c];
+      w = f->waiters;
+      if (f->deficit >= w->cost) {
+        f->deficit -= w->cost;
+        f->waiters = w->next;
+        if (f->waiters == NULL) {
+          f->waiters_tail = NULL;
+          ring_remove (f);
+          f->deficit = 0;       /* idle flows do not bank credit */
+        }
+        w->granted = true;
+        busy = true;
+        pthread_cond_signal (&w->cond);
+        return;
+      }
+      f->deficit += (uint64_t) f->weight * QOS_QUANTUM;
+      active[c] = f->active_next;
+    }
+  }
+}
+
+void
+qos_release (void)
+{
+  if (pthread_mutex_lock (&sched_lock))
+    abort ();
+  busy = false;
+  dispatch_next ();
+  if (pthread_mutex_unlock (&sched_lock))
+    abort ();
+}
+
+/* Free the flow when the connection goes away.  All of the
+ * connection's workers have been joined by this point so it cannot
+ * have waiters.
+ */
+void
+qos_free_flow (struct connection *conn)
+{
+  struct qos_flow *f = conn->qos_flow, **p;
+
+  if (f == NULL)
+    return;
+
+  if (pthread_mutex_lock (&sched_lock))
+    abort ();
+  assert (f->waiters == NULL);
+  for (p = &flows; *p != NULL; p = &(*p)->all_next) {
+    if (*p == f) {
+      *p = f->all_next;
+      break;
+    }
+  }
+  if (pthread_mutex_unlock (&sched_lock))
+    abort ();
+  free (f);
+  conn->qos_flow = NULL;
+}
+
+/* Parse one [EXPORTNAME=]WEIGHT[,high|normal|low] rule and install
+ * it, updating any live flows it applies to.  Without "EXPORTNAME="
+ * the rule sets the default for unmatched connections.  Used both for
+ * --qos on the command line and the qos command on the stats socket;
+ * on failure returns -1 and sets *error to a static message.
+ */
+int
+qos_parse_rule (const char *arg, const char **error)
+{
+  const char *eq = strchr (arg, '=');
+  const char *spec = eq ? eq + 1 : arg;
+  char *exportname = NULL;
+  char *comma, *end;
+  unsigned long weight;
+  enum qos_class class = QOS_CLASS_NORMAL;
+  struct qos_rule *r;
+  struct qos_flow *f;
+
+  weight = strtoul (spec, &end, 10);
+  if (end == spec || weight == 0 || weight > 1000000) {
+    *error = "weight must be a number in the range 1..1000000";
+    return -1;
+  }
+  comma = end;
+  if (*comma == ',') {
+    if (strcmp (comma + 1, "high") == 0)
+      class = QOS_CLASS_HIGH;
+    else if (strcmp (comma + 1, "normal") == 0)
+      class = QOS_CLASS_NORMAL;
+    else if (strcmp (comma + 1, "low") == 0)
+      class = QOS_CLASS_LOW;
+    else {
+      *error = "class must be \"high\", \"normal\" or \"low\"";
+      return -1;
+    }
+  }
+  else if (*comma != '\0') {
+    *error = "expected [EXPORTNAME=]WEIGHT[,high|normal|low]";
+    return -1;
+  }
+
+  if (eq) {
+    exportname = strndup (arg, eq - arg);
+    if (exportname == NULL) {
+      *error = "out of memory";
+      return -1;
+    }
+  }
+
+  if (pthread_mutex_lock (&sched_lock))
+    abort ();
+
+  /* Replace an existing rule for the same export, else add one. */
+  for (r = rules; r != NULL; r = r->next) {
+    if ((r->exportname == NULL) == (exportname == NULL) &&
+        (exportname == NULL || strcmp (r->exportname, exportname) == 0))
+      break;
+  }
+  if (r != NULL) {
+    free (exportname);
+    r->weight = weight;
+    r->class = class;
+  }
+  else {
+    r = malloc (sizeof *r);
+    if (r == NULL) {
+      if (pthread_mutex_unlock (&sched_lock))
+        abort ();
+      free (exportname);
+      *error = "out of memory";
+      return -1;
+    }
+    r->exportname = exportname;
+    r->weight = weight;
+    r->class = class;
+    r->next = rules;
+    rules = r;
+  }
+
+  for (f = flows; f != NULL; f = f->all_next)
+    apply_rules (f);
+
+  if (pthread_mutex_unlock (&sched_lock))
+    abort ();
+  return 0;
+}
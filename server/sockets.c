@@ -214,6 +214,17 @@ bind_tcpip_socket (sockets *socks)
     if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt) == -1)
       perror ("setsockopt: SO_REUSEADDR");
 
+#ifdef SO_REUSEPORT
+    /* In --processes mode every server process binds its own listening
+     * socket to the same address and the kernel spreads incoming
+     * connections across them.
+     */
+    if (nprocesses > 1) {
+      if (setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof opt) == -1)
+        perror ("setsockopt: SO_REUSEPORT");
+    }
+#endif
+
 #ifdef IPV6_V6ONLY
     if (a->ai_family == PF_INET6) {
       if (setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof opt) == -1)
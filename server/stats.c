@@ -0,0 +1,635 @@
+/* nbdkit
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
+
+#include "internal.h"
+#include "poll.h"
+#include "utils.h"
+
+/* Per-command latency histograms (--stats-socket).
+ *
+ * Each thread records the service time of every request into its own
+ * set of histograms: no locks and no atomics on the request path.  A
+ * histogram bucket covers a power-of-two range of nanoseconds split
+ * into linear sub-buckets (see stats_bucket_of in internal.h; the
+ * buckets are shared with the --bench reporter).
+ *
+ * The histogram blocks are registered on a global list (locked only
+ * on thread creation/exit, like the trace rings) so the reporting
+ * thread can aggregate them.  Reports read the counters racily; a
+ * report is a snapshot of a moving target anyway.
+ *
+ * Reporting is pull-based: a small listening socket alongside the
+ * ordinary server sockets.  Connecting to it returns a plain text
+ * report and closes, so "nc -U /path" or a monitoring agent can
+ * scrape percentiles without restarting or perturbing the server.
+ */
+
+/* Commands are the NBD_CMD_* numbers, 0..7. */
+#define STATS_NR_CMDS 8
+
+static const char *cmd_names[STATS_NR_CMDS] = {
+  "READ", "WRITE", "DISC", "FLUSH", "TRIM", "CACHE", "WRITE_ZEROES",
+  "BLOCK_STATUS",
+};
+
+/* The same names as Prometheus label values. */
+static const char *cmd_labels[STATS_NR_CMDS] = {
+  "read", "write", "disc", "flush", "trim", "cache", "write_zeroes",
+  "block_status",
+};
+
+struct stats_block {
+  struct stats_block *next;     /* list of all blocks, under blocks_lock */
+  bool in_use;                  /* owned by a live thread */
+  bool busy;                    /* owning thread is inside the backend */
+  uint64_t count[STATS_NR_CMDS];
+  uint64_t sum_ns[STATS_NR_CMDS];
+  uint64_t sum_bytes[STATS_NR_CMDS];
+  uint64_t errors[STATS_NR_CMDS];
+  uint64_t buckets[STATS_NR_CMDS][STATS_BUCKETS];
+};
+
+static struct stats_block *blocks;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct stats_block *
+stats_block_acquire (void)
+{
+  struct stats_block *b;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&blocks_lock);
+
+  /* Reuse the block of a dead thread: its counts are still part of
+   * the server totals, we just keep adding to them.
+   */
+  for (b = blocks; b != NULL; b = b->next) {
+    if (!b->in_use) {
+      b->in_use = true;
+      return b;
+    }
+  }
+
+  b = calloc (1, sizeof *b);
+  if (b == NULL)
+    return NULL;                /* not fatal, samples are dropped */
+  b->in_use = true;
+  b->next = blocks;
+  blocks = b;
+  return b;
+}
+
+void
+stats_block_release (struct stats_block *block)
+{
+  if (block == NULL)
+    return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&blocks_lock);
+  block->in_use = false;
+}
+
+/* Return this thread's block, acquiring one on first use.  NULL means
+ * no block could be allocated and the sample is dropped.
+ */
+static struct stats_block *
+get_block (void)
+{
+  struct stats_block *b;
+
+  b = threadlocal_get_stats_block ();
+  if (b == NULL) {
+    b = stats_block_acquire ();
+    if (b == NULL || !threadlocal_set_stats_block (b)) {
+      stats_block_release (b);
+      return NULL;
+    }
+  }
+  return b;
+}
+
+/* Record one request, called from the data path.  Lock-free: only the
+ * owning thread writes to its block.
+ */
+void
+stats_record (uint16_t cmd, uint64_t ns, uint64_t bytes, bool error)
+{
+  struct stats_block *b;
+
+  if (cmd >= STATS_NR_CMDS)
+    return;
+
+  b = get_block ();
+  if (b == NULL)
+    return;
+
+  b->count[cmd]++;
+  b->sum_ns[cmd] += ns;
+  b->sum_bytes[cmd] += bytes;
+  if (error)
+    b->errors[cmd]++;
+  b->buckets[cmd][stats_bucket_of (ns)]++;
+}
+
+/* Mark this worker busy (inside the backend) or idle, for the worker
+ * utilization gauge in the metrics report.
+ */
+void
+stats_set_busy (bool busy)
+{
+  struct stats_block *b = get_block ();
+
+  if (b != NULL)
+    b->busy = busy;
+}
+
+/* Aggregate all blocks and format a report.  Returns a malloc'd
+ * string, or NULL on error.
+ */
+static char *
+format_report (void)
+{
+  uint64_t count, sum_ns;
+  uint64_t buckets[STATS_BUCKETS];
+  const struct stats_block *b;
+  char *r = NULL;
+  size_t len = 0;
+  FILE *fp;
+  unsigned cmd, i;
+
+  fp = open_memstream (&r, &len);
+  if (fp == NULL)
+    return NULL;
+
+  for (cmd = 0; cmd < STATS_NR_CMDS; ++cmd) {
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    uint64_t seen, max_ns = 0;
+    size_t p;
+
+    count = sum_ns = 0;
+    memset (buckets, 0, sizeof buckets);
+
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&blocks_lock);
+    for (b = blocks; b != NULL; b = b->next) {
+      count += b->count[cmd];
+      sum_ns += b->sum_ns[cmd];
+      for (i = 0; i < STATS_BUCKETS; ++i)
+        buckets[i] += b->buckets[cmd][i];
+    }
+
+    if (count == 0)
+      continue;
+
+    fprintf (fp, "%s: count=%" PRIu64 " mean=%.1fus",
+             cmd_names[cmd], count, sum_ns / (double) count / 1000.0);
+
+    seen = 0;
+    p = 0;
+    for (i = 0; i < STATS_BUCKETS && p < sizeof percentiles / sizeof percentiles[0]; ++i) {
+      seen += buckets[i];
+      while (p < sizeof percentiles / sizeof percentiles[0] &&
+             seen * 100.0 >= count * percentiles[p]) {
+        fprintf (fp, " p%g=%.1fus", percentiles[p],
+                 stats_bucket_value (i) / 1000.0);
+        p++;
+      }
+    }
+    for (i = 0; i < STATS_BUCKETS; ++i)
+      if (buckets[i] > 0)
+        max_ns = stats_bucket_value (i);
+    fprintf (fp, " max=%.1fus\n", max_ns / 1000.0);
+  }
+
+  if (fclose (fp) == EOF) {
+    free (r);
+    return NULL;
+  }
+  return r;
+}
+
+/* Aggregate all blocks and format a report in Prometheus text
+ * exposition format.  Returns a malloc'd string, or NULL on error.
+ *
+ * The per-thread blocks have no notion of which export a request was
+ * for, so the request counters are labelled by command only.  The
+ * latency histogram is rebucketed from the fine nanosecond buckets
+ * into a handful of decade bounds in seconds, which is what scrapers
+ * expect.
+ */
+static char *
+format_metrics (void)
+{
+  static const double le_bounds[] =     /* seconds */
+    { 1e-05, 1e-04, 1e-03, 1e-02, 1e-01, 1 };
+#define NR_LE_BOUNDS (sizeof le_bounds / sizeof le_bounds[0])
+  uint64_t count[STATS_NR_CMDS], sum_ns[STATS_NR_CMDS];
+  uint64_t sum_bytes[STATS_NR_CMDS], errors[STATS_NR_CMDS];
+  uint64_t buckets[STATS_BUCKETS];
+  uint64_t total_count = 0, total_ns = 0, cumulative;
+  unsigned nr_workers = 0, nr_busy = 0;
+  const struct stats_block *blk;
+  struct backend *b;
+  char *r = NULL;
+  size_t len = 0;
+  FILE *fp;
+  unsigned cmd, i;
+  size_t p;
+
+  fp = open_memstream (&r, &len);
+  if (fp == NULL)
+    return NULL;
+
+  memset (count, 0, sizeof count);
+  memset (sum_ns, 0, sizeof sum_ns);
+  memset (sum_bytes, 0, sizeof sum_bytes);
+  memset (errors, 0, sizeof errors);
+  memset (buckets, 0, sizeof buckets);
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&blocks_lock);
+    for (blk = blocks; blk != NULL; blk = blk->next) {
+      if (blk->in_use) {
+        nr_workers++;
+        if (blk->busy)
+          nr_busy++;
+      }
+      for (cmd = 0; cmd < STATS_NR_CMDS; ++cmd) {
+        count[cmd] += blk->count[cmd];
+        sum_ns[cmd] += blk->sum_ns[cmd];
+        sum_bytes[cmd] += blk->sum_bytes[cmd];
+        errors[cmd] += blk->errors[cmd];
+        for (i = 0; i < STATS_BUCKETS; ++i)
+          buckets[i] += blk->buckets[cmd][i];
+      }
+    }
+  }
+
+  for (cmd = 0; cmd < STATS_NR_CMDS; ++cmd) {
+    total_count += count[cmd];
+    total_ns += sum_ns[cmd];
+  }
+
+  fprintf (fp, "# HELP nbdkit_requests_total "
+           "Requests processed, by command.\n");
+  fprintf (fp, "# TYPE nbdkit_requests_total counter\n");
+  for (cmd = 0; cmd < STATS_NR_CMDS; ++cmd)
+    fprintf (fp, "nbdkit_requests_total{cmd=\"%s\"} %" PRIu64 "\n",
+             cmd_labels[cmd], count[cmd]);
+
+  fprintf (fp, "# HELP nbdkit_request_errors_total "
+           "Requests which failed, by command.\n");
+  fprintf (fp, "# TYPE nbdkit_request_errors_total counter\n");
+  for (cmd = 0; cmd < STATS_NR_CMDS; ++cmd)
+    fprintf (fp, "nbdkit_request_errors_total{cmd=\"%s\"} %" PRIu64 "\n",
+             cmd_labels[cmd], errors[cmd]);
+
+  fprintf (fp, "# HELP nbdkit_request_bytes_total "
+           "Bytes transferred or affected, by command.\n");
+  fprintf (fp, "# TYPE nbdkit_request_bytes_total counter\n");
+  for (cmd = 0; cmd < STATS_NR_CMDS; ++cmd)
+    fprintf (fp, "nbdkit_request_bytes_total{cmd=\"%s\"} %" PRIu64 "\n",
+             cmd_labels[cmd], sum_bytes[cmd]);
+
+  fprintf (fp, "# HELP nbdkit_request_duration_seconds "
+           "Request service time, all commands.\n");
+  fprintf (fp, "# TYPE nbdkit_request_duration_seconds histogram\n");
+  cumulative = 0;
+  i = 0;
+  for (p = 0; p < NR_LE_BOUNDS; ++p) {
+    uint64_t bound_ns = le_bounds[p] * 1e9;
+
+    for (; i < STATS_BUCKETS && stats_bucket_value (i) <= bound_ns; ++i)
+      cumulative += buckets[i];
+    fprintf (fp, "nbdkit_request_duration_seconds_bucket{le=\"%g\"} "
+             "%" PRIu64 "\n", le_bounds[p], cumulative);
+  }
+  fprintf (fp, "nbdkit_request_duration_seconds_bucket{le=\"+Inf\"} "
+           "%" PRIu64 "\n", total_count);
+  fprintf (fp, "nbdkit_request_duration_seconds_sum %g\n", total_ns / 1e9);
+  fprintf (fp, "nbdkit_request_duration_seconds_count %" PRIu64 "\n",
+           total_count);
+#undef NR_LE_BOUNDS
+
+  fprintf (fp, "# HELP nbdkit_connections_active "
+           "Clients currently connected.\n");
+  fprintf (fp, "# TYPE nbdkit_connections_active gauge\n");
+  fprintf (fp, "nbdkit_connections_active %u\n",
+           (unsigned) nr_active_connections);
+  fprintf (fp, "# HELP nbdkit_connections_total "
+           "Clients accepted since the server started.\n");
+  fprintf (fp, "# TYPE nbdkit_connections_total counter\n");
+  fprintf (fp, "nbdkit_connections_total %" PRIu64 "\n",
+           (uint64_t) nr_total_connections);
+
+  fprintf (fp, "# HELP nbdkit_sockbuf_grows_total "
+           "Adaptive socket buffer size increases.\n");
+  fprintf (fp, "# TYPE nbdkit_sockbuf_grows_total counter\n");
+  fprintf (fp, "nbdkit_sockbuf_grows_total %" PRIu64 "\n",
+           (uint64_t) nr_sockbuf_grows);
+  fprintf (fp, "# HELP nbdkit_sockbuf_bytes_max "
+           "Largest adaptively chosen SO_SNDBUF.\n");
+  fprintf (fp, "# TYPE nbdkit_sockbuf_bytes_max gauge\n");
+  fprintf (fp, "nbdkit_sockbuf_bytes_max %d\n",
+           (int) max_adaptive_sockbuf);
+
+  fprintf (fp, "# HELP nbdkit_workers "
+           "Threads which have served requests.\n");
+  fprintf (fp, "# TYPE nbdkit_workers gauge\n");
+  fprintf (fp, "nbdkit_workers %u\n", nr_workers);
+  fprintf (fp, "# HELP nbdkit_workers_busy "
+           "Threads currently inside the plugin or a filter.\n");
+  fprintf (fp, "# TYPE nbdkit_workers_busy gauge\n");
+  fprintf (fp, "nbdkit_workers_busy %u\n", nr_busy);
+
+  /* Filter-specific metrics.  Visit every layer directly rather than
+   * forwarding along the chain.
+   */
+  for_each_backend (b) {
+    char *s = b->metrics (b);
+
+    if (s) {
+      fputs (s, fp);
+      free (s);
+    }
+  }
+
+  if (fclose (fp) == EOF) {
+    free (r);
+    return NULL;
+  }
+  return r;
+}
+
+#ifndef WIN32
+
+static void
+write_all (int fd, const char *p, size_t n)
+{
+  ssize_t w;
+
+  for (; n > 0; p += w, n -= w) {
+    w = write (fd, p, n);
+    if (w <= 0)
+      break;
+  }
+}
+
+/* Serve one connected client and close.  If the client sends a
+ * command within a short grace period it is executed instead of the
+ * report; currently:
+ *
+ *   debug NAME.FLAG=N    set a *_debug_* variable at runtime
+ *   qos [EXPORT=]W[,C]   change a --qos weight/class at runtime
+ *   metrics              report in Prometheus text format
+ *
+ * An HTTP GET request is answered like "metrics" but wrapped in an
+ * HTTP/1.0 response, so "curl --unix-socket" and Prometheus-style
+ * scrapers work unmodified.  A silent client (plain "nc -U") still
+ * receives the histogram report after the grace period.
+ */
+static void
+serve_report (int fd)
+{
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  char *report;
+
+  if (poll (&pfd, 1, 50) == 1 && (pfd.revents & POLLIN)) {
+    char line[256];
+    ssize_t n = read (fd, line, sizeof line - 1);
+
+    if (n > 0) {
+      line[n] = '\0';
+      line[strcspn (line, "\r\n")] = '\0';
+      if (strncmp (line, "debug ", 6) == 0) {
+        const char *error;
+
+        if (set_debug_flag_at_runtime (line + 6, &error) == 0) {
+          debug ("stats socket: set debug flag %s", line + 6);
+          write_all (fd, "ok\n", 3);
+        }
+        else {
+          char reply[320];
+
+          snprintf (reply, sizeof reply, "error: %s\n", error);
+          write_all (fd, reply, strlen (reply));
+        }
+        close (fd);
+        return;
+      }
+      if (strncmp (line, "qos ", 4) == 0) {
+        const char *error =
+          "the scheduler is not enabled (start nbdkit with --qos)";
+
+        if (qos_enabled && qos_parse_rule (line + 4, &error) == 0) {
+          debug ("stats socket: set qos rule %s", line + 4);
+          write_all (fd, "ok\n", 3);
+        }
+        else {
+          char reply[320];
+
+          snprintf (reply, sizeof reply, "error: %s\n", error);
+          write_all (fd, reply, strlen (reply));
+        }
+        close (fd);
+        return;
+      }
+      if (strcmp (line, "metrics") == 0 || strncmp (line, "GET ", 4) == 0) {
+        const bool http = line[0] == 'G';
+        char *metrics = format_metrics ();
+
+        if (metrics != NULL) {
+          if (http) {
+            char header[128];
+
+            snprintf (header, sizeof header,
+                      "HTTP/1.0 200 OK\r\n"
+                      "Content-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: %zu\r\n"
+                      "\r\n",
+                      strlen (metrics));
+            write_all (fd, header, strlen (header));
+          }
+          write_all (fd, metrics, strlen (metrics));
+          free (metrics);
+        }
+        close (fd);
+        return;
+      }
+      /* An unknown or empty line falls through to the report. */
+    }
+  }
+
+  report = format_report ();
+  if (report == NULL) {
+    close (fd);
+    return;
+  }
+  write_all (fd, report, strlen (report));
+  free (report);
+  close (fd);
+}
+
+static void *
+stats_thread (void *sockvp)
+{
+  int sock = *(int *)sockvp;
+  struct pollfd fds[2];
+
+  free (sockvp);
+  threadlocal_new_server_thread ();
+
+  for (;;) {
+    int fd, r;
+
+    fds[0].fd = sock;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = quit_fd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    r = poll (fds, 2, -1);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      perror ("stats: poll");
+      break;
+    }
+    if (fds[1].revents & POLLIN)
+      break;                    /* server is quitting */
+
+    fd = accept (sock, NULL, NULL);
+    if (fd == -1)
+      continue;
+    serve_report (fd);
+  }
+
+  close (sock);
+  return NULL;
+}
+
+void
+start_stats_thread (void)
+{
+  size_t len;
+  int sock, err, *sockp;
+  struct sockaddr_un addr;
+  pthread_attr_t attrs;
+  pthread_t thread;
+
+  if (stats_socket == NULL)
+    return;
+
+  len = strlen (stats_socket);
+  if (len >= UNIX_PATH_MAX) {
+    fprintf (stderr, "%s: --stats-socket: path too long: "
+             "length %zu > max %d bytes\n",
+             program_name, len, UNIX_PATH_MAX-1);
+    exit (EXIT_FAILURE);
+  }
+
+#ifdef SOCK_CLOEXEC
+  sock = socket (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+#else
+  sock = set_cloexec (socket (AF_UNIX, SOCK_STREAM, 0));
+#endif
+  if (sock == -1) {
+    perror ("start_stats_thread: socket");
+    exit (EXIT_FAILURE);
+  }
+
+  addr.sun_family = AF_UNIX;
+  memcpy (addr.sun_path, stats_socket, len+1 /* trailing \0 */);
+
+  if (bind (sock, (struct sockaddr *) &addr, sizeof addr) == -1) {
+    perror (stats_socket);
+    exit (EXIT_FAILURE);
+  }
+
+  if (listen (sock, SOMAXCONN) == -1) {
+    perror ("listen");
+    exit (EXIT_FAILURE);
+  }
+
+  sockp = malloc (sizeof sock);
+  if (sockp == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  *sockp = sock;
+
+  pthread_attr_init (&attrs);
+  pthread_attr_setdetachstate (&attrs, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&thread, &attrs, stats_thread, sockp);
+  pthread_attr_destroy (&attrs);
+  if (err != 0) {
+    errno = err;
+    perror ("stats: pthread_create");
+    exit (EXIT_FAILURE);
+  }
+
+  debug ("bound stats socket %s", stats_socket);
+}
+
+#else /* WIN32 */
+
+void
+start_stats_thread (void)
+{
+  if (stats_socket != NULL) {
+    fprintf (stderr, "%s: --stats-socket is not supported on this platform\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+}
+
+#endif /* WIN32 */
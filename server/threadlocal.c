@@ -39,9 +39,14 @@
 #include <assert.h>
 #include <errno.h>
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #include <pthread.h>
 
 #include "internal.h"
+#include "rounding.h"
 
 /* Note that most thread-local storage data is informational, used for
  * smart error and debug messages on the server side.  However, error
@@ -58,18 +63,47 @@ struct threadlocal {
   int err;
   void *buffer;
   size_t buffer_size;
+  bool buffer_mmapped;          /* hugepage-backed (--hugepages) */
+  struct nbdkit_extents *extents;
   struct connection *conn;
+  struct trace_ring *trace_ring;
+  struct stats_block *stats_block;
 };
 
+/* The threadlocal struct is reached through a plain thread-local
+ * pointer: cheaper than pthread_getspecific, and this is on the path
+ * of every request.  The pthread key below duplicates the pointer
+ * purely so that free_threadlocal still runs when a thread exits.
+ */
+static __thread struct threadlocal *threadlocal_data;
+
 static pthread_key_t threadlocal_key;
 
+static void
+free_buffer (struct threadlocal *threadlocal)
+{
+#ifdef MAP_HUGETLB
+  if (threadlocal->buffer_mmapped) {
+    munmap (threadlocal->buffer, threadlocal->buffer_size);
+    threadlocal->buffer = NULL;
+    threadlocal->buffer_mmapped = false;
+    return;
+  }
+#endif
+  free (threadlocal->buffer);
+  threadlocal->buffer = NULL;
+}
+
 static void
 free_threadlocal (void *threadlocalv)
 {
   struct threadlocal *threadlocal = threadlocalv;
 
   free (threadlocal->name);
-  free (threadlocal->buffer);
+  free_buffer (threadlocal);
+  nbdkit_extents_free (threadlocal->extents);
+  trace_ring_release (threadlocal->trace_ring);
+  stats_block_release (threadlocal->stats_block);
   free (threadlocal);
 }
 
@@ -103,12 +137,13 @@ threadlocal_new_server_thread (void)
     perror ("pthread_setspecific");
     exit (EXIT_FAILURE);
   }
+  threadlocal_data = threadlocal;
 }
 
 void
 threadlocal_set_name (const char *name)
 {
-  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct threadlocal *threadlocal = threadlocal_data;
 
   /* Copy name, as the original may be residing in a module, but we
    * want our thread name to persist even after unload. */
@@ -124,7 +159,7 @@ threadlocal_set_name (const char *name)
 void
 threadlocal_set_instance_num (size_t instance_num)
 {
-  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct threadlocal *threadlocal = threadlocal_data;
 
   if (threadlocal)
     threadlocal->instance_num = instance_num;
@@ -133,7 +168,7 @@ threadlocal_set_instance_num (size_t instance_num)
 const char *
 threadlocal_get_name (void)
 {
-  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct threadlocal *threadlocal = threadlocal_data;
 
   if (!threadlocal)
     return NULL;
@@ -144,7 +179,7 @@ threadlocal_get_name (void)
 size_t
 threadlocal_get_instance_num (void)
 {
-  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct threadlocal *threadlocal = threadlocal_data;
 
   if (!threadlocal)
     return 0;
@@ -155,7 +190,7 @@ threadlocal_get_instance_num (void)
 void
 threadlocal_set_error (int err)
 {
-  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct threadlocal *threadlocal = threadlocal_data;
 
   if (threadlocal)
     threadlocal->err = err;
@@ -169,15 +204,26 @@ int
 threadlocal_get_error (void)
 {
   int err = errno;
-  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct threadlocal *threadlocal = threadlocal_data;
 
   errno = err;
   return threadlocal ? threadlocal->err : 0;
 }
 
+/* Huge pages are 2M wherever MAP_HUGETLB exists. */
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
 /* Return the single pread/pwrite buffer for this thread.  The buffer
  * size is increased to ‘size’ bytes if required.
  *
+ * The buffer is aligned to REQUEST_BUFFER_ALIGNMENT (published to
+ * plugins as nbdkit_buffer_alignment) so that plugins opened with
+ * O_DIRECT can transfer straight from it, and with --hugepages it is
+ * an anonymous MAP_HUGETLB mapping, which cuts TLB pressure when
+ * large requests are streamed through it.  If no huge pages are
+ * reserved the mapping fails and we quietly fall back to an ordinary
+ * aligned buffer.
+ *
  * The buffer starts out as zeroes but after use may contain data from
  * previous requests.  This is fine because: (a) Correctly written
  * plugins should overwrite the whole buffer on each request so no
@@ -188,19 +234,52 @@ threadlocal_get_error (void)
 extern void *
 threadlocal_buffer (size_t size)
 {
-  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct threadlocal *threadlocal = threadlocal_data;
 
   if (!threadlocal)
     abort ();
 
   if (threadlocal->buffer_size < size) {
-    void *ptr;
+    void *ptr = NULL;
+
+    free_buffer (threadlocal);
+    threadlocal->buffer_size = 0;
+
+#ifdef MAP_HUGETLB
+    if (hugepages) {
+      size_t hsize = ROUND_UP (size, HUGEPAGE_SIZE);
+
+      ptr = mmap (NULL, hsize, PROT_READ|PROT_WRITE,
+                  MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+      if (ptr != MAP_FAILED) {
+        threadlocal->buffer_mmapped = true;
+        size = hsize;
+      }
+      else {
+        debug ("mmap: MAP_HUGETLB: %m (using an ordinary buffer)");
+        ptr = NULL;
+      }
+    }
+#endif
 
-    ptr = realloc (threadlocal->buffer, size);
     if (ptr == NULL) {
-      nbdkit_error ("threadlocal_buffer: realloc: %m");
-      return NULL;
+#ifdef HAVE_POSIX_MEMALIGN
+      int err = posix_memalign (&ptr, REQUEST_BUFFER_ALIGNMENT, size);
+
+      if (err != 0) {
+        errno = err;
+        nbdkit_error ("threadlocal_buffer: posix_memalign: %m");
+        return NULL;
+      }
+#else
+      ptr = malloc (size);
+      if (ptr == NULL) {
+        nbdkit_error ("threadlocal_buffer: malloc: %m");
+        return NULL;
+      }
+#endif
     }
+
     memset (ptr, 0, size);
     threadlocal->buffer = ptr;
     threadlocal->buffer_size = size;
@@ -209,21 +288,102 @@ threadlocal_buffer (size_t size)
   return threadlocal->buffer;
 }
 
+/* Return the single extents list for this thread, reset and ready for
+ * a new block status request.  Like the data buffer above, recycling
+ * it means steady-state requests do not touch the heap.
+ */
+struct nbdkit_extents *
+threadlocal_extents (uint64_t start, uint64_t end)
+{
+  struct threadlocal *threadlocal = threadlocal_data;
+
+  if (!threadlocal)
+    abort ();
+
+  if (threadlocal->extents) {
+    if (reset_extents (threadlocal->extents, start, end) == -1)
+      return NULL;
+    return threadlocal->extents;
+  }
+
+  threadlocal->extents = nbdkit_extents_new (start, end);
+  return threadlocal->extents;
+}
+
+/* The trace ring for this thread (--trace), NULL if none has been
+ * acquired yet.  The setter returns false if this thread has no
+ * threadlocal struct, so the caller does not strand the ring.
+ */
+struct trace_ring *
+threadlocal_get_trace_ring (void)
+{
+  struct threadlocal *threadlocal = threadlocal_data;
+
+  return threadlocal ? threadlocal->trace_ring : NULL;
+}
+
+bool
+threadlocal_set_trace_ring (struct trace_ring *ring)
+{
+  struct threadlocal *threadlocal = threadlocal_data;
+
+  if (!threadlocal)
+    return false;
+  threadlocal->trace_ring = ring;
+  return true;
+}
+
+/* The latency stats block for this thread (--stats-socket), NULL if
+ * none has been acquired yet.  Same contract as the trace ring above.
+ */
+struct stats_block *
+threadlocal_get_stats_block (void)
+{
+  struct threadlocal *threadlocal = threadlocal_data;
+
+  return threadlocal ? threadlocal->stats_block : NULL;
+}
+
+bool
+threadlocal_set_stats_block (struct stats_block *block)
+{
+  struct threadlocal *threadlocal = threadlocal_data;
+
+  if (!threadlocal)
+    return false;
+  threadlocal->stats_block = block;
+  return true;
+}
+
 /* Set (or clear) the connection that is using the current thread */
 void
 threadlocal_set_conn (struct connection *conn)
 {
-  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct threadlocal *threadlocal = threadlocal_data;
 
   if (threadlocal)
     threadlocal->conn = conn;
 }
 
+/* As threadlocal_set_conn, but also works from threads which were
+ * not created by the server (eg. helper threads created by a filter),
+ * which do not have thread-local storage yet.
+ */
+void
+threadlocal_adopt_conn (struct connection *conn)
+{
+  struct threadlocal *threadlocal = threadlocal_data;
+
+  if (threadlocal == NULL)
+    threadlocal_new_server_thread ();
+  threadlocal_set_conn (conn);
+}
+
 /* Get the connection associated with this thread, if available */
 struct connection *
 threadlocal_get_conn (void)
 {
-  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct threadlocal *threadlocal = threadlocal_data;
 
   return threadlocal ? threadlocal->conn : NULL;
 }
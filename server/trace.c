@@ -0,0 +1,247 @@
+/* nbdkit
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "internal.h"
+
+/* Per-thread debug trace rings (--trace).
+ *
+ * With many worker threads, routing -v output through stderr
+ * serializes every thread on the stderr lock, which distorts the very
+ * behaviour being diagnosed.  When --trace is in effect each thread
+ * instead formats debug messages into its own fixed-size ring buffer
+ * with no locking or I/O on the message path.  The rings are written
+ * to stderr on demand (SIGUSR1) or when the server crashes.
+ *
+ * Rings are registered on a global list so the dump can find them.
+ * The list is only locked when a thread acquires or releases a ring,
+ * never per message.  Rings of dead threads are kept (and reused by
+ * new threads) so their final messages remain visible in dumps.
+ */
+
+#define TRACE_RING_ENTRIES 256
+#define TRACE_MSG_SIZE 256
+
+struct trace_ring {
+  struct trace_ring *next;      /* list of all rings, under rings_lock */
+  bool in_use;                  /* owned by a live thread */
+  uint64_t seq;                 /* messages ever recorded */
+  char msgs[TRACE_RING_ENTRIES][TRACE_MSG_SIZE];
+};
+
+static struct trace_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct trace_ring *
+trace_ring_acquire (void)
+{
+  struct trace_ring *r;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rings_lock);
+
+  for (r = rings; r != NULL; r = r->next) {
+    if (!r->in_use) {
+      r->in_use = true;
+      return r;
+    }
+  }
+
+  r = calloc (1, sizeof *r);
+  if (r == NULL)
+    return NULL;                /* not fatal, messages are dropped */
+  r->in_use = true;
+  r->next = rings;
+  rings = r;
+  return r;
+}
+
+void
+trace_ring_release (struct trace_ring *ring)
+{
+  if (ring == NULL)
+    return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rings_lock);
+  /* Keep the contents so the thread's last messages still appear in
+   * later dumps; a new thread may reuse the ring.
+   */
+  ring->in_use = false;
+}
+
+/* Record one debug message in the calling thread's ring.  Lock-free:
+ * only the owning thread ever writes to a ring.  Note: preserves the
+ * previous value of errno.
+ */
+void
+trace_record (const char *fs, va_list args)
+{
+  int err = errno;
+  struct trace_ring *ring;
+  const char *name;
+  size_t instance_num;
+  struct timespec ts;
+  char *slot;
+  int n;
+
+  ring = threadlocal_get_trace_ring ();
+  if (ring == NULL) {
+    ring = trace_ring_acquire ();
+    if (ring == NULL || !threadlocal_set_trace_ring (ring)) {
+      /* No threadlocal for this thread, don't leak a ring per call. */
+      trace_ring_release (ring);
+      errno = err;
+      return;
+    }
+  }
+
+  slot = ring->msgs[ring->seq % TRACE_RING_ENTRIES];
+  clock_gettime (CLOCK_REALTIME, &ts);
+  name = threadlocal_get_name ();
+  instance_num = threadlocal_get_instance_num ();
+
+  if (name && instance_num > 0)
+    n = snprintf (slot, TRACE_MSG_SIZE, "[%ld.%06ld] %s[%zu]: ",
+                  (long) ts.tv_sec, ts.tv_nsec / 1000, name, instance_num);
+  else if (name)
+    n = snprintf (slot, TRACE_MSG_SIZE, "[%ld.%06ld] %s: ",
+                  (long) ts.tv_sec, ts.tv_nsec / 1000, name);
+  else
+    n = snprintf (slot, TRACE_MSG_SIZE, "[%ld.%06ld] ",
+                  (long) ts.tv_sec, ts.tv_nsec / 1000);
+  if (n < 0 || n >= TRACE_MSG_SIZE)
+    n = TRACE_MSG_SIZE - 1;
+
+  errno = err;                  /* in case fs contains %m */
+  vsnprintf (slot + n, TRACE_MSG_SIZE - n, fs, args);
+
+  /* Increment after the slot is complete so a concurrent dump never
+   * sees a half-written latest entry.
+   */
+  ring->seq++;
+
+  errno = err;
+}
+
+/* write(2) is the only thing we may safely call from the dump signal
+ * handler.
+ */
+static void
+write_all (const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t r = write (STDERR_FILENO, buf, len);
+    if (r <= 0)
+      return;                   /* nothing useful we can do */
+    buf += r;
+    len -= r;
+  }
+}
+
+/* Dump all rings, oldest message first.  Called from a signal
+ * handler, so this walks the list without the lock (the list only
+ * ever grows) and may emit a torn message if a thread is writing the
+ * same slot concurrently; that is acceptable in a diagnostic dump.
+ */
+void
+trace_dump (void)
+{
+  static const char head[] = "=== nbdkit trace rings ===\n";
+  static const char tail[] = "=== end of trace rings ===\n";
+  const struct trace_ring *r;
+  uint64_t i, seq, first;
+
+  write_all (head, sizeof head - 1);
+  for (r = rings; r != NULL; r = r->next) {
+    seq = r->seq;
+    first = seq > TRACE_RING_ENTRIES ? seq - TRACE_RING_ENTRIES : 0;
+    for (i = first; i < seq; ++i) {
+      const char *msg = r->msgs[i % TRACE_RING_ENTRIES];
+      write_all (msg, strnlen (msg, TRACE_MSG_SIZE));
+      write_all ("\n", 1);
+    }
+  }
+  write_all (tail, sizeof tail - 1);
+}
+
+#ifndef WIN32
+
+static void
+handle_trace_dump (int sig)
+{
+  trace_dump ();
+}
+
+static void
+handle_trace_crash (int sig)
+{
+  trace_dump ();
+  signal (sig, SIG_DFL);
+  raise (sig);
+}
+
+void
+set_up_trace (void)
+{
+  struct sigaction sa;
+
+  memset (&sa, 0, sizeof sa);
+  sa.sa_flags = SA_RESTART;
+  sa.sa_handler = handle_trace_dump;
+  sigaction (SIGUSR1, &sa, NULL);
+
+  memset (&sa, 0, sizeof sa);
+  sa.sa_handler = handle_trace_crash;
+  sigaction (SIGSEGV, &sa, NULL);
+  sigaction (SIGBUS, &sa, NULL);
+  sigaction (SIGABRT, &sa, NULL);
+}
+
+#else /* WIN32 */
+
+void
+set_up_trace (void)
+{
+  /* No signals to dump on; trace_dump can still be called directly. */
+}
+
+#endif /* WIN32 */
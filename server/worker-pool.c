@@ -0,0 +1,217 @@
+/* nbdkit
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "internal.h"
+
+/* A bounded, server-wide pool of threads which process requests on
+ * behalf of all connections.  Previously every connection created its
+ * own set of worker threads (default 16), so a server with hundreds
+ * of mostly-idle clients carried thousands of mostly-idle threads.
+ * Now connections borrow threads from this pool for their lifetime;
+ * the pool is capped relative to the machine size, and when it is
+ * exhausted a connection simply runs with fewer parallel workers (in
+ * the limit, just the connection's own thread).
+ *
+ * Idle pool threads linger for a while so that reconnecting clients
+ * do not pay thread creation costs, then exit.
+ */
+
+/* How long an idle pool thread waits for work before exiting. */
+#define WORKER_IDLE_TIMEOUT 30 /* seconds */
+
+struct assignment {
+  struct connection *conn;
+  char *name;                   /* thread name, freed by the worker */
+  struct worker_group *group;
+  struct assignment *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static struct assignment *work_queue;
+static unsigned nr_threads;     /* pool threads in existence */
+static unsigned nr_idle;        /* pool threads waiting for work */
+static unsigned max_threads;
+
+/* Compute the pool size cap, called with the lock held on first use.
+ * We allow at least one connection's full complement of workers so a
+ * single client behaves exactly as before, but scale with the machine
+ * rather than with the number of clients.
+ */
+static void
+init_max_threads (void)
+{
+  unsigned per_conn = threads ? threads : DEFAULT_PARALLEL_REQUESTS;
+
+  max_threads = per_conn;
+#ifdef _SC_NPROCESSORS_ONLN
+  {
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+    if (n > 0 && 2 * (unsigned) n > max_threads)
+      max_threads = 2 * (unsigned) n;
+  }
+#endif
+  debug ("worker pool: maximum %u threads", max_threads);
+}
+
+static void *
+pool_worker (void *arg)
+{
+  struct assignment *a;
+  struct worker_group *group;
+
+  threadlocal_new_server_thread ();
+
+  pthread_mutex_lock (&lock);
+  for (;;) {
+    while (work_queue == NULL) {
+      struct timespec deadline;
+      int err;
+
+      nr_idle++;
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += WORKER_IDLE_TIMEOUT;
+      err = pthread_cond_timedwait (&work_cond, &lock, &deadline);
+      nr_idle--;
+      if (err == ETIMEDOUT && work_queue == NULL) {
+        nr_threads--;
+        pthread_mutex_unlock (&lock);
+        return NULL;
+      }
+    }
+    a = work_queue;
+    work_queue = a->next;
+    pthread_mutex_unlock (&lock);
+
+    debug ("starting worker thread %s", a->name);
+    threadlocal_set_name (a->name);
+    threadlocal_set_conn (a->conn);
+    if (numa)
+      numa_bind_worker (a->conn->numa_node);
+    while (!quit && connection_get_status () > 0) {
+      /* Return to the pool when the connection goes idle, so that
+       * mostly-idle clients do not hold on to pool threads.
+       */
+      if (protocol_recv_request_send_reply (CONN_IDLE_GRACE_MS) != 1)
+        break;
+    }
+    debug ("exiting worker thread %s", threadlocal_get_name ());
+    threadlocal_set_conn (NULL);
+    free (a->name);
+    group = a->group;
+    free (a);
+
+    pthread_mutex_lock (&lock);
+    if (--group->remaining == 0)
+      pthread_cond_signal (&group->cond);
+  }
+}
+
+/* Called with the lock held. */
+static int
+start_thread (void)
+{
+  pthread_t t;
+  pthread_attr_t attr;
+  int err;
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&t, &attr, pool_worker, NULL);
+  pthread_attr_destroy (&attr);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  nr_threads++;
+  return 0;
+}
+
+/* Ask the pool to run requests for this connection in another thread.
+ * Returns -1 (without calling nbdkit_error) if no thread can be
+ * spared, in which case the connection runs with fewer workers.
+ */
+int
+worker_pool_submit (struct connection *conn, char *name,
+                    struct worker_group *group)
+{
+  struct assignment *a;
+
+  a = malloc (sizeof *a);
+  if (a == NULL)
+    return -1;
+  a->conn = conn;
+  a->name = name;
+  a->group = group;
+  a->next = NULL;
+
+  pthread_mutex_lock (&lock);
+  if (max_threads == 0)
+    init_max_threads ();
+  if (nr_idle == 0 &&
+      (nr_threads >= max_threads || start_thread () == -1)) {
+    pthread_mutex_unlock (&lock);
+    free (a);
+    return -1;
+  }
+  a->next = work_queue;
+  work_queue = a;
+  group->remaining++;
+  pthread_cond_signal (&work_cond);
+  pthread_mutex_unlock (&lock);
+  return 0;
+}
+
+/* Wait until every worker granted to this group has finished.  The
+ * connection must not be freed before this returns.  The group can be
+ * reused for further submissions afterwards.
+ */
+void
+worker_group_wait (struct worker_group *group)
+{
+  pthread_mutex_lock (&lock);
+  while (group->remaining > 0)
+    pthread_cond_wait (&group->cond, &lock);
+  pthread_mutex_unlock (&lock);
+}
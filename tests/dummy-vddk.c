@@ -196,3 +196,69 @@ VixDiskLib_Write (VixDiskLibHandle handle,
   memcpy (disk + offset, buf, nr_sectors * VIXDISKLIB_SECTOR_SIZE);
   return VIX_OK;
 }
+
+VixError
+VixDiskLib_QueryAllocatedBlocks (VixDiskLibHandle handle,
+                                 uint64_t start_sector, uint64_t nr_sectors,
+                                 uint64_t chunk_size,
+                                 VixDiskLibBlockList **block_list)
+{
+  uint64_t c, nr_chunks = nr_sectors / chunk_size;
+  uint32_t n = 0;
+
+  /* Report the chunks which contain any non-zero byte. */
+  *block_list = calloc (1, sizeof (VixDiskLibBlockList) +
+                        nr_chunks * sizeof (VixDiskLibBlock));
+  for (c = 0; c < nr_chunks; ++c) {
+    const char *chunk =
+      &disk[(start_sector + c * chunk_size) * VIXDISKLIB_SECTOR_SIZE];
+    uint64_t i;
+
+    for (i = 0; i < chunk_size * VIXDISKLIB_SECTOR_SIZE; ++i) {
+      if (chunk[i]) {
+        (*block_list)->blocks[n].offset = start_sector + c * chunk_size;
+        (*block_list)->blocks[n].length = chunk_size;
+        n++;
+        break;
+      }
+    }
+  }
+  (*block_list)->numBlocks = n;
+  return VIX_OK;
+}
+
+VixError
+VixDiskLib_FreeBlockList (VixDiskLibBlockList *block_list)
+{
+  free (block_list);
+  return VIX_OK;
+}
+
+/* The asynchronous calls complete immediately from the caller's
+ * thread, which the interface permits.
+ */
+VixError
+VixDiskLib_ReadAsync (VixDiskLibHandle handle,
+                      uint64_t start_sector, uint64_t nr_sectors,
+                      unsigned char *buf,
+                      VixDiskLibCompletionCB callback, void *data)
+{
+  size_t offset = start_sector * VIXDISKLIB_SECTOR_SIZE;
+
+  memcpy (buf, disk + offset, nr_sectors * VIXDISKLIB_SECTOR_SIZE);
+  callback (data, VIX_OK);
+  return VIX_ASYNC;
+}
+
+VixError
+VixDiskLib_WriteAsync (VixDiskLibHandle handle,
+                       uint64_t start_sector, uint64_t nr_sectors,
+                       const unsigned char *buf,
+                       VixDiskLibCompletionCB callback, void *data)
+{
+  size_t offset = start_sector * VIXDISKLIB_SECTOR_SIZE;
+
+  memcpy (disk + offset, buf, nr_sectors * VIXDISKLIB_SECTOR_SIZE);
+  callback (data, VIX_OK);
+  return VIX_ASYNC;
+}
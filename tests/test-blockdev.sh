@@ -0,0 +1,69 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Root-only test of the blockdev plugin against a loop device.
+
+source ./functions.sh
+set -e
+set -x
+
+requires test `id -u` -eq 0
+requires losetup --version
+requires nbdsh --version
+requires_plugin blockdev
+
+disk=blockdev-test.img
+rm -f $disk
+truncate -s 10M $disk
+
+loopdev=$(losetup -f --show $disk)
+cleanup_fn losetup -d $loopdev
+cleanup_fn rm -f $disk
+
+nbdsh -c - <<EOF
+import os
+
+h.connect_command(
+    ["nbdkit", "-fv", "-s", "--exit-with-parent",
+     "blockdev", "$loopdev"]
+)
+assert h.get_size() == 10 * 1024 * 1024
+
+buf = os.urandom(70000)
+h.pwrite(buf, 4096)
+assert h.pread(len(buf), 4096) == buf
+
+h.flush()
+h.trim(65536, 131072)
+h.zero(8192, 16384)
+assert h.pread(8192, 16384) == bytes(8192)
+EOF
@@ -0,0 +1,86 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the cache filter cache-preload parameter.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cache
+requires_nbdsh_uri
+
+sock1=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+sock2=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="cache-preload.img cache-preload.ranges
+       $sock1 cache-preload1.pid $sock2 cache-preload2.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Create a sparse base image with two allocated regions.
+truncate -s 16M cache-preload.img
+dd if=/dev/zero bs=1M count=2 of=cache-preload.img conv=notrunc 2>/dev/null
+printf 'data' | dd bs=1 seek=$((8*1024*1024)) of=cache-preload.img \
+                   conv=notrunc 2>/dev/null
+
+# Preload everything the plugin reports as allocated.
+start_nbdkit -P cache-preload1.pid -U $sock1 \
+             --filter=cache \
+             file cache-preload.img \
+             cache-preload=extents cache-preload-threads=2
+
+nbdsh --connect "nbd+unix://?socket=$sock1" \
+      -c '
+assert h.pread(2*1024*1024, 0) == bytearray(2*1024*1024)
+assert h.pread(4, 8*1024*1024) == b"data"
+assert h.pread(65536, 4*1024*1024) == bytearray(65536)
+'
+
+# Preload an explicit list of ranges.
+cat > cache-preload.ranges <<'EOF'
+# comment followed by a blank line
+
+0	64K
+1M	128K
+EOF
+
+start_nbdkit -P cache-preload2.pid -U $sock2 \
+             --filter=cache \
+             file cache-preload.img \
+             cache-preload=cache-preload.ranges
+
+nbdsh --connect "nbd+unix://?socket=$sock2" \
+      -c '
+assert h.pread(65536, 0) == bytearray(65536)
+assert h.pread(128*1024, 1024*1024) == bytearray(128*1024)
+assert h.pread(4, 8*1024*1024) == b"data"
+'
@@ -0,0 +1,166 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the cbt filter: writes must show up as dirty extents in the
+# qemu:dirty-bitmap: metadata context, and the bitmap must survive a
+# server restart through the state file.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cbt
+requires_nbdsh_uri
+requires nbdsh -c 'print(h.add_meta_context)'
+
+gran=65536
+# Each server gets its own socket: nbdkit does not unlink the socket
+# on exit, so a restart on the same path fails to bind.
+sock1=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+sock2=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+sock3=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="test-cbt.img test-cbt.state $sock1 $sock2 $sock3
+       test-cbt1.pid test-cbt2.pid test-cbt3.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Wait for a killed server to exit so the state checkpoint written on
+# shutdown is complete before the next server loads it.
+wait_gone ()
+{
+    for i in $(seq 1 10); do
+        kill -0 "$1" 2>/dev/null || return 0
+        sleep 1
+    done
+    echo "$0: server $1 did not exit"
+    exit 1
+}
+
+truncate -s 1M test-cbt.img
+
+# First epoch: start clean, dirty blocks 2 and 5.
+export sock=$sock1
+start_nbdkit -P test-cbt1.pid -U $sock1 \
+             --filter=cbt \
+             file test-cbt.img \
+             cbt-state=test-cbt.state cbt-granularity=$gran \
+             cbt-clear=true
+
+nbdsh -c '
+import os
+
+gran = 65536
+h.add_meta_context("qemu:dirty-bitmap:cbt0")
+h.connect_unix(os.environ["sock"])
+
+def dirty_ranges():
+    ranges = []
+    def f(mc, offset, entries, err):
+        assert mc == "qemu:dirty-bitmap:cbt0"
+        o = offset
+        for i in range(0, len(entries), 2):
+            if entries[i+1] & 1:
+                ranges.append((o, entries[i]))
+            o += entries[i]
+    h.block_status(h.get_size(), 0, f)
+    return ranges
+
+assert dirty_ranges() == []
+
+h.pwrite(b"X" * gran, 2 * gran)
+h.pwrite(b"Y" * gran, 5 * gran)
+h.flush()
+
+assert dirty_ranges() == [(2 * gran, gran), (5 * gran, gran)]
+'
+
+kill "$(cat test-cbt1.pid)"
+wait_gone "$(cat test-cbt1.pid)"
+
+# Second run without cbt-clear: the same ranges must still be dirty,
+# and new writes accumulate.
+export sock=$sock2
+start_nbdkit -P test-cbt2.pid -U $sock2 \
+             --filter=cbt \
+             file test-cbt.img \
+             cbt-state=test-cbt.state cbt-granularity=$gran
+
+nbdsh -c '
+import os
+
+gran = 65536
+h.add_meta_context("qemu:dirty-bitmap:cbt0")
+h.connect_unix(os.environ["sock"])
+
+def dirty_ranges():
+    ranges = []
+    def f(mc, offset, entries, err):
+        o = offset
+        for i in range(0, len(entries), 2):
+            if entries[i+1] & 1:
+                ranges.append((o, entries[i]))
+            o += entries[i]
+    h.block_status(h.get_size(), 0, f)
+    return ranges
+
+assert dirty_ranges() == [(2 * gran, gran), (5 * gran, gran)]
+
+h.pwrite(b"Z" * gran, 9 * gran)
+h.flush()
+assert dirty_ranges() == [(2 * gran, gran), (5 * gran, gran),
+                          (9 * gran, gran)]
+'
+
+kill "$(cat test-cbt2.pid)"
+wait_gone "$(cat test-cbt2.pid)"
+
+# A new epoch with cbt-clear=true starts all clean again.
+export sock=$sock3
+start_nbdkit -P test-cbt3.pid -U $sock3 \
+             --filter=cbt \
+             file test-cbt.img \
+             cbt-state=test-cbt.state cbt-granularity=$gran \
+             cbt-clear=true
+
+nbdsh -c '
+import os
+
+h.add_meta_context("qemu:dirty-bitmap:cbt0")
+h.connect_unix(os.environ["sock"])
+
+entries = []
+def f(mc, offset, e, err):
+    entries.extend(e)
+h.block_status(h.get_size(), 0, f)
+assert not any(e & 1 for e in entries[1::2])
+'
@@ -0,0 +1,85 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the checksum filter: normal I/O passes, out-of-band corruption
+# of the backing file turns the next read into EIO.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter checksum
+requires_nbdsh_uri
+
+blksize=65536
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="test-checksum.img test-checksum.crc $sock test-checksum.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 1M test-checksum.img
+
+start_nbdkit -P test-checksum.pid -U $sock \
+             --filter=checksum \
+             file test-checksum.img \
+             checksum-file=test-checksum.crc checksum-blocksize=$blksize
+
+# Learn checksums for two blocks and verify a clean re-read.
+nbdsh --connect "nbd+unix://?socket=$sock" \
+      -c '
+blksize = 65536
+h.pwrite(b"G" * blksize, 0)
+h.pwrite(b"H" * blksize, blksize)
+h.flush()
+assert h.pread(blksize, 0) == b"G" * blksize
+assert h.pread(blksize, blksize) == b"H" * blksize
+'
+
+# Corrupt one byte of block 1 behind the filter's back.
+printf 'X' | dd of=test-checksum.img bs=1 seek=$((blksize + 100)) \
+               conv=notrunc status=none
+
+# Block 1 must now fail with EIO; block 0 is still fine.
+nbdsh --connect "nbd+unix://?socket=$sock" \
+      -c '
+import errno
+import nbd
+
+blksize = 65536
+assert h.pread(blksize, 0) == b"G" * blksize
+try:
+    h.pread(blksize, blksize)
+    assert False, "read of corrupted block unexpectedly succeeded"
+except nbd.Error as ex:
+    assert ex.errnum == errno.EIO
+'
@@ -0,0 +1,89 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the dedup filter: duplicate blocks written at different offsets
+# must read back correctly and occupy a single file in the store.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter dedup
+requires_nbdsh_uri
+
+blksize=65536
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="test-dedup.img $sock test-dedup.pid"
+rm -f $files
+rm -rf test-dedup.d
+cleanup_fn rm -f $files
+cleanup_fn rm -rf test-dedup.d
+
+truncate -s 1M test-dedup.img
+
+start_nbdkit -P test-dedup.pid -U $sock \
+             --filter=dedup \
+             file test-dedup.img \
+             dedup-dir=test-dedup.d dedup-blocksize=$blksize
+
+nbdsh --connect "nbd+unix://?socket=$sock" \
+      -c '
+blksize = 65536
+
+# The same content three times, plus one unique block.
+dup = b"X" * blksize
+uniq = b"Y" * blksize
+for n in 0, 3, 7:
+    h.pwrite(dup, n * blksize)
+h.pwrite(uniq, 5 * blksize)
+
+# An unaligned write forces a read-modify-write of the block.
+h.pwrite(b"Z" * 100, 9 * blksize + 10)
+h.flush()
+
+for n in 0, 3, 7:
+    assert h.pread(blksize, n * blksize) == dup
+assert h.pread(blksize, 5 * blksize) == uniq
+assert h.pread(10, 9 * blksize) == b"\0" * 10
+assert h.pread(100, 9 * blksize + 10) == b"Z" * 100
+'
+
+# Writes go straight to the plugin, so the image must contain the data.
+cmp <(dd if=test-dedup.img bs=$blksize skip=3 count=1 status=none) \
+    <(dd if=test-dedup.img bs=$blksize skip=7 count=1 status=none)
+
+# Three duplicate blocks, one unique block and one read-modify-write
+# block: the content-addressed store must hold exactly 3 files (the
+# untouched regions are all zeroes, which are never stored).
+nblk=$(ls test-dedup.d/*.blk | wc -l)
+test "$nblk" -eq 3
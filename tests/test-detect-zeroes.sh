@@ -0,0 +1,102 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the detect-zeroes filter: writes of literal zeroes must turn
+# into zero requests (visible as holes in base:allocation on the
+# memory plugin), and mixed payloads must split without corruption.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter detect-zeroes
+requires_nbdsh_uri
+requires nbdsh -c 'print(h.add_meta_context)'
+
+export sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="$sock test-detect-zeroes.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+start_nbdkit -P test-detect-zeroes.pid -U $sock \
+             --filter=detect-zeroes \
+             memory 8M detect-zeroes-block=65536
+
+nbdsh -c '
+import os
+
+M = 1024 * 1024
+K = 65536
+
+h.add_meta_context("base:allocation")
+h.connect_unix(os.environ["sock"])
+
+def hole_ranges(offset, count):
+    ranges = []
+    def f(mc, o, entries, err):
+        pos = o
+        for i in range(0, len(entries), 2):
+            if entries[i+1] & 1:          # NBD_STATE_HOLE
+                ranges.append((pos, entries[i]))
+            pos += entries[i]
+    h.block_status(count, offset, f)
+    # Coalesce adjacent ranges so the assertions do not depend on the
+    # page size the plugin reports extents at.
+    out = []
+    for o, l in ranges:
+        if out and out[-1][0] + out[-1][1] == o:
+            out[-1] = (out[-1][0], out[-1][1] + l)
+        else:
+            out.append((o, l))
+    return out
+
+# A data write allocates; overwriting it with literal zeroes must be
+# converted to a zero request which deallocates again.
+h.pwrite(b"D" * 2 * M, 0)
+assert hole_ranges(0, 2 * M) == []
+h.pwrite(b"\0" * 2 * M, 0)
+assert hole_ranges(0, 2 * M) == [(0, 2 * M)]
+assert h.pread(2 * M, 0) == b"\0" * 2 * M
+
+# A mixed payload: only the block-aligned zero run in the middle may
+# become a hole, and every byte must read back exactly.
+buf = b"E" * K + b"\0" * 3 * K + b"F" * K
+h.pwrite(buf, 4 * M)
+assert h.pread(len(buf), 4 * M) == buf
+assert hole_ranges(4 * M, len(buf)) == [(4 * M + K, 3 * K)]
+
+# A zero run shorter than one block is written as data, not zeroed.
+h.pwrite(b"G" * K + b"\0" * 1000 + b"H" * K, 6 * M)
+assert h.pread(2 * K + 1000, 6 * M) == b"G" * K + b"\0" * 1000 + b"H" * K
+assert hole_ranges(6 * M, 2 * K + 1000) == []
+'
@@ -0,0 +1,83 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test NBD extended headers: 64-bit requests and replies must work for
+# reads, writes and block status on a > 4G disk.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin memory
+requires_nbdsh_uri
+requires nbdsh -c 'print(h.get_extended_headers_negotiated)'
+requires nbdsh -c 'print(h.block_status_64)'
+
+export sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="extended-headers.pid $sock"
+rm -f $files
+cleanup_fn rm -f $files
+
+start_nbdkit -P extended-headers.pid -U $sock memory 5G
+
+nbdsh -c '
+import os
+
+h.add_meta_context("base:allocation")
+h.connect_unix(os.environ["sock"])
+
+# libnbd requests extended headers by default; the server must have
+# acked them or the 64-bit calls below are not testing the new wire
+# format.
+assert h.get_extended_headers_negotiated()
+
+G = 1024**3
+assert h.get_size() == 5 * G
+
+# Write and read back beyond the 32-bit offset boundary.
+buf = b"1" * 65536
+h.pwrite(buf, 4 * G + 12345)
+assert h.pread(len(buf), 4 * G + 12345) == buf
+
+entries = []
+def f(mc, offset, e, err):
+    assert mc == "base:allocation"
+    entries.extend(e)
+h.block_status_64(h.get_size(), 0, f)
+
+# The untouched start of the disk must come back as a hole extent
+# longer than 4G, which can only be described with 64-bit lengths.
+length, flags = entries[0]
+assert length >= 4 * G
+assert flags & 3 == 3
+'
@@ -0,0 +1,95 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the fanout filter: large requests split into concurrent
+# sub-requests must reassemble byte-exactly.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter fanout
+requires_nbdsh_uri
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="test-fanout.img $sock test-fanout.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 8M test-fanout.img
+
+# fanout-split far below the request sizes used, so every large
+# request really fans out (into up to 4 concurrent pieces).
+start_nbdkit -P test-fanout.pid -U $sock \
+             --filter=fanout \
+             file test-fanout.img \
+             fanout-split=65536 fanout-threads=4
+
+nbdsh --connect "nbd+unix://?socket=$sock" \
+      -c '
+import hashlib
+
+split = 65536
+
+# Position-dependent data, so any resequencing of the pieces is
+# detected.
+buf = bytearray()
+while len(buf) < 4 * 1024 * 1024:
+    buf += hashlib.sha256(len(buf).to_bytes(8, "big")).digest()
+buf = bytes(buf)
+
+# One large write and one large read, both a multiple of the split.
+h.pwrite(buf, 0)
+assert h.pread(len(buf), 0) == buf
+
+# Requests not aligned to the split size: an odd length and an odd
+# offset, covering the unaligned head and tail paths.
+assert h.pread(3 * split + 12345, 777) == buf[777:777 + 3 * split + 12345]
+h.pwrite(buf[:2 * split + 99], 4 * 1024 * 1024 + 5)
+assert h.pread(2 * split + 99, 4 * 1024 * 1024 + 5) == buf[:2 * split + 99]
+
+# Below the threshold: must pass through unsplit and still be right.
+assert h.pread(split, 0) == buf[:split]
+'
+
+# The data must have reached the backing file intact.
+python3 -c '
+import hashlib
+
+buf = bytearray()
+while len(buf) < 4 * 1024 * 1024:
+    buf += hashlib.sha256(len(buf).to_bytes(8, "big")).digest()
+
+with open("test-fanout.img", "rb") as f:
+    assert f.read(len(buf)) == bytes(buf)
+'
@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the scheduling between NBD_CMD_FLUSH and other in-flight
+# commands: a flush must not complete while a write issued before it
+# is still in flight, while reads are free to overlap the write.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin memory
+requires_filter delay
+requires_nbdsh_uri
+
+export sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="flush-overlap.pid $sock"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Writes take 2 seconds; everything else is fast.
+start_nbdkit -P flush-overlap.pid -U $sock \
+             --filter=delay memory 64M delay-write=2
+
+nbdsh -c '
+import os
+import time
+
+h.connect_unix(os.environ["sock"])
+
+wbuf = nbd.Buffer.from_bytearray(b"x" * 512)
+rbuf = nbd.Buffer(512)
+t0 = time.monotonic()
+w = h.aio_pwrite(wbuf, 0)
+f = h.aio_flush()
+r = h.aio_pread(rbuf, 1024)
+
+# The read must not queue behind the delayed write or the flush.
+while not h.aio_command_completed(r):
+    h.poll(-1)
+assert time.monotonic() - t0 < 2
+
+# When the flush completes the write it was ordered after must have
+# completed too, and only the write delay should have elapsed.
+while not h.aio_command_completed(f):
+    h.poll(-1)
+assert h.aio_command_completed(w)
+assert time.monotonic() - t0 >= 1.9
+'
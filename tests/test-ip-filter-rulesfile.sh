@@ -0,0 +1,83 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the ip filter rulesfile parameter, including reloading the
+# rules when the file changes.
+
+source ./functions.sh
+set -e
+set -x
+
+requires qemu-img --version
+
+# Not supported on Windows.
+if is_windows; then
+    echo "$0: nbdkit-ip-filter rulesfile not implemented on Windows"
+    exit 77
+fi
+
+rules=test-ip-filter-rulesfile.rules
+cleanup_fn rm -f $rules
+
+cat > $rules <<EOF
+# Allow only the current user.
+allow=uid:`id -u`
+deny=all
+EOF
+
+nbdkit -U - -v --filter=ip null rulesfile=$rules \
+       --run 'qemu-img info $nbd'
+
+# Rewrite the file to deny the current user and check new connections
+# to the same server are rejected.  The sleep ensures the mtime
+# changes.
+export rules
+if nbdkit -U - -v --filter=ip null rulesfile=$rules \
+          --run '
+    qemu-img info $nbd || exit 1
+    sleep 2
+    echo deny=uid:`id -u` > $rules
+    if qemu-img info $nbd; then exit 1; fi
+'; then
+    :
+else
+    echo "$0: expected reloaded rules to deny the connection"
+    exit 1
+fi
+
+# An invalid rules file must be rejected at startup.
+echo "allow=notarule" > $rules
+if nbdkit -U - -v --filter=ip null rulesfile=$rules \
+          --run 'qemu-img info $nbd'; then
+    echo "$0: expected invalid rules file to fail at startup"
+    exit 1
+fi
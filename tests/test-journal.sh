@@ -0,0 +1,96 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the journal filter: data acknowledged by a flush must survive
+# nbdkit being killed before it was replayed to the plugin.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter journal
+requires_nbdsh_uri
+
+sock1=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+sock2=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="test-journal.img test-journal.jrnl $sock1 $sock2
+       test-journal1.pid test-journal2.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 1M test-journal.img
+
+start_nbdkit -P test-journal1.pid -U $sock1 \
+             --filter=journal \
+             file test-journal.img \
+             journal-file=test-journal.jrnl
+
+# Write, flush, and then kill the server without a clean shutdown:
+# the flush made the journal durable, so nothing may be lost.
+nbdsh --connect "nbd+unix://?socket=$sock1" \
+      -c '
+h.pwrite(b"J" * 65536, 65536)
+h.pwrite(b"K" * 65536, 393216)
+h.flush()
+'
+
+kill -9 "$(cat test-journal1.pid)"
+
+# A new server over the same journal must replay the records and
+# serve the data back.
+start_nbdkit -P test-journal2.pid -U $sock2 \
+             --filter=journal \
+             file test-journal.img \
+             journal-file=test-journal.jrnl
+
+nbdsh --connect "nbd+unix://?socket=$sock2" \
+      -c '
+assert h.pread(65536, 65536) == b"J" * 65536
+assert h.pread(65536, 393216) == b"K" * 65536
+assert h.pread(65536, 0) == b"\0" * 65536
+
+# New writes after recovery work as usual.
+h.pwrite(b"L" * 512, 0)
+h.flush()
+assert h.pread(512, 0) == b"L" * 512
+'
+
+# Crash recovery replays into the plugin before serving, so the
+# pre-crash writes must be in the backing image by now.
+python3 -c '
+with open("test-journal.img", "rb") as f:
+    f.seek(65536)
+    assert f.read(65536) == b"J" * 65536
+    f.seek(393216)
+    assert f.read(65536) == b"K" * 65536
+'
@@ -0,0 +1,87 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the luks filter: write plaintext through the filter, check a
+# second server decrypts it back, and check only ciphertext reaches
+# the backing file.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter luks
+requires_nbdsh_uri
+requires cryptsetup --version
+
+sock1=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+sock2=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="test-luks.img test-luks.key $sock1 $sock2
+       test-luks1.pid test-luks2.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+echo -n "sesame" > test-luks.key
+truncate -s 16M test-luks.img
+cryptsetup -q luksFormat --type luks1 test-luks.img test-luks.key
+
+start_nbdkit -P test-luks1.pid -U $sock1 \
+             --filter=luks \
+             file test-luks.img passphrase=+test-luks.key
+
+# Write a recognizable pattern and read it straight back.  The flush
+# pushes the ciphertext to the backing file for the checks below.
+nbdsh --connect "nbd+unix://?socket=$sock1" \
+      -c '
+buf = (b"LUKS-PLAINTEXT-CANARY-" * 1024)[:16384]
+h.pwrite(buf, 65536)
+h.flush()
+assert h.pread(16384, 65536) == buf
+'
+
+# The plaintext must not appear anywhere in the encrypted image.
+if grep -q "LUKS-PLAINTEXT-CANARY" test-luks.img; then
+    echo "$0: plaintext leaked into the backing file"
+    exit 1
+fi
+
+# A separate server, recovering the master key from the header by
+# itself, must decrypt the same data back.
+start_nbdkit -P test-luks2.pid -U $sock2 \
+             --filter=luks \
+             file test-luks.img passphrase=+test-luks.key
+
+nbdsh --connect "nbd+unix://?socket=$sock2" \
+      -c '
+buf = (b"LUKS-PLAINTEXT-CANARY-" * 1024)[:16384]
+assert h.pread(16384, 65536) == buf
+'
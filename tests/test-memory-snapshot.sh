@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the memory plugin snapshot and snapshot-save parameters.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_nbdsh_uri
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="memory-snapshot.snap memory-snapshot.pid $sock"
+rm -f $files
+cleanup_fn rm -f $files
+
+# First run: populate the disk and save a snapshot on shutdown.
+start_nbdkit -P memory-snapshot.pid -U $sock \
+             memory 16M \
+             snapshot=memory-snapshot.snap snapshot-save=true
+
+nbdsh --connect "nbd+unix://?socket=$sock" \
+      -c '
+h.pwrite(b"1" * 65536, 0)
+h.pwrite(b"2" * 65536, 8*1024*1024)
+'
+
+pid="$(cat memory-snapshot.pid)"
+kill $pid
+for i in {1..10}; do
+    if ! kill -s 0 $pid 2>/dev/null; then break; fi
+    sleep 1
+done
+test -f memory-snapshot.snap
+cksum="$(md5sum memory-snapshot.snap)"
+
+# Second run: restore the snapshot, check the contents, and check
+# that writes do not modify the snapshot file.
+rm -f $sock memory-snapshot.pid
+start_nbdkit -P memory-snapshot.pid -U $sock \
+             memory 16M snapshot=memory-snapshot.snap
+
+nbdsh --connect "nbd+unix://?socket=$sock" \
+      -c '
+assert h.pread(65536, 0) == b"1" * 65536
+assert h.pread(65536, 8*1024*1024) == b"2" * 65536
+assert h.pread(65536, 4*1024*1024) == bytearray(65536)
+h.pwrite(b"3" * 65536, 0)
+assert h.pread(65536, 0) == b"3" * 65536
+'
+
+test "$(md5sum memory-snapshot.snap)" = "$cksum"
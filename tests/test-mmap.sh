@@ -0,0 +1,65 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the mmap plugin, including recording reads and warming up from
+# the recorded file.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdcopy --version
+requires cmp --version
+requires dd --version
+
+img=mmap-test.img
+hot=mmap-test.hot
+out=mmap-test.out
+rm -f $img $hot $out
+cleanup_fn rm -f $img $hot $out
+
+dd if=/dev/urandom of=$img bs=1M count=4
+
+# First run records which ranges are read.
+nbdkit -U - mmap $img record=$hot --run "nbdcopy \"\$uri\" $out"
+cmp $img $out
+
+# nbdcopy reads everything, so the record must cover the whole image.
+test -s $hot
+read start length < $hot
+test "$start" -eq 0
+test "$length" -eq $(( 4 * 1024 * 1024 ))
+
+# Second run prefetches from the recorded file.
+rm -f $out
+nbdkit -U - mmap $img warmup=$hot --run "nbdcopy \"\$uri\" $out"
+cmp $img $out
@@ -0,0 +1,113 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the qcow2 plugin against a hand-crafted image containing an
+# uncompressed cluster, a deflate-compressed cluster, a zero cluster
+# and an unallocated cluster.
+
+source ./functions.sh
+set -e
+set -x
+
+requires $PYTHON --version
+requires nbdcopy --version
+requires_plugin qcow2
+
+img=qcow2-test.qcow2
+raw=qcow2-test.raw
+out=qcow2-test.out
+rm -f $img $raw $out
+cleanup_fn rm -f $img $raw $out
+
+# Build the test image.  qemu-img is not required at test time.
+$PYTHON - <<'EOF'
+import struct
+import zlib
+
+cluster_bits = 16
+cluster_size = 1 << cluster_bits
+
+data0 = bytes(i % 251 for i in range(cluster_size))
+data1 = b'b' * cluster_size
+
+# Layout: header, L1 table, L2 table, data cluster, compressed data.
+l1_offset = cluster_size
+l2_offset = 2 * cluster_size
+data_offset = 3 * cluster_size
+comp_offset = 4 * cluster_size
+
+comp = zlib.compressobj(9, zlib.DEFLATED, -15)
+cdata = comp.compress(data1) + comp.flush()
+assert len(cdata) <= 512
+
+# Compressed cluster descriptor.
+x = 62 - (cluster_bits - 8)
+nb_csectors = (len(cdata) + 511) // 512
+desc = (1 << 62) | ((nb_csectors - 1) << x) | comp_offset
+
+header = struct.pack('>IIQIIQIIQQIIQQQQII',
+                     0x514649fb,        # magic
+                     3,                 # version
+                     0, 0,              # no backing file
+                     cluster_bits,
+                     4 * cluster_size,  # virtual size
+                     0,                 # no encryption
+                     1, l1_offset,      # L1 table
+                     0, 0,              # refcount table (unused)
+                     0, 0,              # no snapshots
+                     0, 0, 0,           # feature bits
+                     4,                 # refcount_order
+                     104)               # header_length
+
+l1 = struct.pack('>Q', l2_offset | (1 << 63))
+l2 = struct.pack('>QQQQ',
+                 data_offset | (1 << 63),  # uncompressed
+                 desc,                     # compressed
+                 1,                        # zero flag
+                 0)                        # unallocated
+
+with open('qcow2-test.qcow2', 'wb') as f:
+    f.write(header.ljust(l1_offset, b'\0'))
+    f.write(l1.ljust(cluster_size, b'\0'))
+    f.write(l2.ljust(cluster_size, b'\0'))
+    f.write(data0)
+    f.write(cdata.ljust(nb_csectors * 512, b'\0'))
+
+with open('qcow2-test.raw', 'wb') as f:
+    f.write(data0)
+    f.write(data1)
+    f.write(b'\0' * 2 * cluster_size)
+EOF
+
+nbdkit -U - qcow2 $img --run "nbdcopy \"\$uri\" $out"
+
+cmp $raw $out
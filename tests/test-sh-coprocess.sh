@@ -0,0 +1,102 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the sh plugin coprocess mode.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin sh
+requires_nbdsh_uri
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="test-sh-coprocess.img test-sh-coprocess.script
+       $sock test-sh-coprocess.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 1M test-sh-coprocess.img
+
+# The fork-path pread deliberately fails, so the test proves that
+# reads are served by the coprocess.  Methods which the coprocess loop
+# declines (everything except pread and pwrite) must fall back to
+# forking the script.
+cat > test-sh-coprocess.script <<'EOF'
+#!/usr/bin/env bash
+f=test-sh-coprocess.img
+case "$1" in
+    thread_model) echo parallel ;;
+    get_size) stat -c %s $f ;;
+    can_write) exit 0 ;;
+    pread)
+        echo 'EIO fork path used for pread' >&2
+        exit 1 ;;
+    pwrite) dd of=$f seek=$4 conv=notrunc oflag=seek_bytes status=none ;;
+    coprocess)
+        echo READY
+        while read -r wlen method args; do
+            set -- $args
+            if [ "$wlen" -gt 0 ]; then head -c "$wlen" > $tmpdir/wdata; fi
+            case "$method" in
+                pread)
+                    dd if=$f skip=$3 count=$2 \
+                       iflag=skip_bytes,count_bytes status=none > $tmpdir/out
+                    echo "0 $(stat -c %s $tmpdir/out)"
+                    cat $tmpdir/out ;;
+                pwrite)
+                    dd if=$tmpdir/wdata of=$f seek=$3 \
+                       conv=notrunc oflag=seek_bytes status=none
+                    echo "0 0" ;;
+                *) echo "2 0" ;;
+            esac
+        done ;;
+    *) exit 2 ;;
+esac
+EOF
+chmod +x test-sh-coprocess.script
+
+start_nbdkit -P test-sh-coprocess.pid -U $sock \
+             sh test-sh-coprocess.script
+
+nbdsh --connect "nbd+unix://?socket=$sock" \
+      -c '
+# Write pattern data through the coprocess and check it reads back OK.
+buf = b"0123456789abcdef" * 4096
+h.pwrite(buf, 0)
+buf2 = h.pread(65536, 0)
+assert buf == buf2
+
+# Unaligned read crossing the end of the written area.
+buf2 = h.pread(1000, 65000)
+assert buf2 == buf[65000:] + b"\0" * 464
+'
@@ -0,0 +1,100 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the stripe plugin: stripe a disk over two local nbdkit file
+# servers and check both the client view and the on-disk layout.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin stripe
+requires_nbdsh_uri
+
+chunk=65536
+backend_size=$((4 * chunk))
+sock0=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+sock1=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="test-stripe0.img test-stripe1.img $sock0 $sock1 $sock
+       test-stripe0.pid test-stripe1.pid test-stripe.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s $backend_size test-stripe0.img
+truncate -s $backend_size test-stripe1.img
+
+# The two storage nodes.
+start_nbdkit -P test-stripe0.pid -U $sock0 file test-stripe0.img
+start_nbdkit -P test-stripe1.pid -U $sock1 file test-stripe1.img
+
+# The striped volume over them.
+start_nbdkit -P test-stripe.pid -U $sock \
+             stripe \
+             server="nbd+unix:///?socket=$sock0" \
+             server="nbd+unix:///?socket=$sock1" \
+             stripe-size=$chunk
+
+# Fill every chunk with a distinct pattern, including one large write
+# spanning several chunks, and read everything back.
+nbdsh --connect "nbd+unix://?socket=$sock" \
+      -c '
+chunk = 65536
+
+assert h.get_size() == 8 * chunk
+
+for i in range(4):
+    h.pwrite(bytes([0x41 + i]) * chunk, i * chunk)
+h.pwrite(b"".join(bytes([0x45 + i]) * chunk for i in range(4)),
+         4 * chunk)
+h.flush()
+
+for i in range(8):
+    assert h.pread(chunk, i * chunk) == bytes([0x41 + i]) * chunk
+
+# A read crossing a chunk (and therefore backend) boundary.
+assert h.pread(512, chunk - 256) == b"A" * 256 + b"B" * 256
+'
+
+# RAID0 layout: chunk i of the virtual disk must live in backend
+# (i % 2) at offset (i / 2) * chunk.
+for i in $(seq 0 7); do
+    python3 -c '
+import sys
+i = int(sys.argv[1]); chunk = 65536
+with open("test-stripe%d.img" % (i % 2), "rb") as f:
+    f.seek(i // 2 * chunk)
+    assert f.read(chunk) == bytes([0x41 + i]) * chunk, \
+        "chunk %d misplaced" % i
+' $i
+done
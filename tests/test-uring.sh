@@ -0,0 +1,76 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Basic I/O smoke test for the io_uring connection engine (--uring).
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin memory
+requires_nbdsh_uri
+
+if ! nbdkit --dump-config | grep -sq uring=yes; then
+    echo "$0: nbdkit built without io_uring support"
+    exit 77
+fi
+
+export sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="uring.pid $sock"
+rm -f $files
+cleanup_fn rm -f $files
+
+# --uring falls back silently to plain socket calls when io_uring is
+# unavailable at runtime, so this cannot fail on a restricted kernel,
+# but where io_uring works it exercises the staged-submit reply path.
+start_nbdkit -P uring.pid -U $sock --uring memory 64M
+
+nbdsh -c '
+import os
+
+h.connect_unix(os.environ["sock"])
+
+M = 1024 * 1024
+assert h.get_size() == 64 * M
+
+# A large read makes the server send the reply header and payload as
+# separate chunks, which --uring batches into one submission.
+buf = os.urandom(8 * M)
+h.pwrite(buf, 3 * M)
+h.flush()
+assert h.pread(len(buf), 3 * M) == buf
+
+h.zero(M, 3 * M)
+assert h.pread(M, 3 * M) == bytes(M)
+assert h.pread(M, 4 * M) == buf[M:2 * M]
+'
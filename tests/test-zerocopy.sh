@@ -0,0 +1,77 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Basic I/O smoke test for MSG_ZEROCOPY sends (--zerocopy).  The
+# option only takes effect over TCP, so unlike most tests this one
+# listens on a localhost port.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin memory
+requires_nbdsh_uri
+# Fails at option parsing on platforms without MSG_ZEROCOPY.
+requires nbdkit --zerocopy --version
+
+rm -f zerocopy.pid
+cleanup_fn rm -f zerocopy.pid
+
+# Find an unused port to listen on.
+pick_unused_port
+export port
+
+start_nbdkit -P zerocopy.pid -p $port --zerocopy memory 64M
+
+nbdsh -c '
+import os
+
+h.connect_tcp("localhost", os.environ["port"])
+
+M = 1024 * 1024
+assert h.get_size() == 64 * M
+
+# Replies of 256K and up go through the zero-copy send path, which
+# must wait for the kernel to finish with the buffer before the
+# thread reuses it; interleave writes and large reads to catch any
+# reply sent from a buffer that was handed back too early.
+buf = os.urandom(M)
+h.pwrite(buf, 3 * M)
+assert h.pread(M, 3 * M) == buf
+h.pwrite(buf[::-1], 8 * M)
+assert h.pread(M, 8 * M) == buf[::-1]
+assert h.pread(M, 3 * M) == buf
+
+# Large read of unwritten space.
+assert h.pread(512 * 1024, 32 * M) == bytes(512 * 1024)
+'
@@ -0,0 +1,110 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2018-2021 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the zstd filter with a file in the zstd seekable format.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter zstd
+requires_nbdsh_uri
+requires python3 --version
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="test-zstd.zst $sock test-zstd.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Construct a seekable zstd file without needing any external zstd
+# tool: a zstd frame containing only raw (uncompressed) blocks is
+# valid, and the seek table is a simple skippable frame appended at
+# the end.  The payload is 4 frames x 64K of pattern data.
+python3 - <<'EOF'
+import struct
+
+FRAME_SIZE = 65536
+NR_FRAMES = 4
+
+def raw_frame(data):
+    # Frame header: magic, descriptor (single segment, 4-byte frame
+    # content size), then one raw block per 32K of data.
+    f = struct.pack("<IBI", 0xFD2FB528, 0x80 | 0x20, len(data))
+    blocksize = 32768
+    for i in range(0, len(data), blocksize):
+        block = data[i:i+blocksize]
+        last = 1 if i + blocksize >= len(data) else 0
+        # Block_Header: bit 0 last block, bits 1-2 type (0 = raw).
+        f += struct.pack("<I", last | (len(block) << 3))[:3] + block
+    return f
+
+frames = []
+for n in range(NR_FRAMES):
+    data = bytes([0x41 + n]) * FRAME_SIZE
+    frames.append(raw_frame(data))
+
+# Seek table: skippable frame + entries + footer.
+entries = b"".join(struct.pack("<II", len(f), FRAME_SIZE) for f in frames)
+footer = struct.pack("<IBI", NR_FRAMES, 0, 0x8F92EAB1)
+table = struct.pack("<II", 0x184D2A5E, len(entries) + len(footer)) \
+    + entries + footer
+
+with open("test-zstd.zst", "wb") as fp:
+    for f in frames:
+        fp.write(f)
+    fp.write(table)
+EOF
+
+start_nbdkit -P test-zstd.pid -U $sock \
+             --filter=zstd \
+             file test-zstd.zst
+
+nbdsh --connect "nbd+unix://?socket=$sock" \
+      -c '
+FRAME_SIZE = 65536
+
+assert h.get_size() == 4 * FRAME_SIZE
+assert h.is_read_only()
+
+# Whole frames.
+for n in range(4):
+    buf = h.pread(FRAME_SIZE, n * FRAME_SIZE)
+    assert buf == bytes([0x41 + n]) * FRAME_SIZE
+
+# A read crossing a frame boundary.
+buf = h.pread(512, FRAME_SIZE - 256)
+assert buf == b"A" * 256 + b"B" * 256
+
+# Unaligned read within a frame.
+buf = h.pread(100, 2 * FRAME_SIZE + 12345)
+assert buf == b"C" * 100
+'